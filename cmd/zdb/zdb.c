@@ -44,6 +44,7 @@
 #include <sys/vdev.h>
 #include <sys/vdev_impl.h>
 #include <sys/metaslab_impl.h>
+#include <sys/spa_log_spacemap.h>
 #include <sys/dmu_objset.h>
 #include <sys/dsl_dir.h>
 #include <sys/dsl_dataset.h>
@@ -59,6 +60,7 @@
 #include <sys/zfs_fuid.h>
 #include <sys/arc.h>
 #include <sys/ddt.h>
+#include <sys/brt.h>
 #include <sys/zfeature.h>
 #include <sys/abd.h>
 #include <sys/dsl_crypt.h>
@@ -895,6 +897,11 @@ dump_metaslab(metaslab_t *msp)
 	    (u_longlong_t)msp->ms_id, (u_longlong_t)msp->ms_start,
 	    (u_longlong_t)space_map_object(sm), freebuf);
 
+	if (spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP)) {
+		(void) printf("\tunflushed txg=%llu\n",
+		    (u_longlong_t)msp->ms_unflushed_txg);
+	}
+
 	if (dump_opt['m'] > 2 && !dump_opt['L']) {
 		mutex_enter(&msp->ms_lock);
 		metaslab_load_wait(msp);
@@ -1062,6 +1069,37 @@ print_vdev_indirect(vdev_t *vd)
 	}
 }
 
+/*
+ * List the log space maps, oldest first.  Their entries are the changes
+ * that have not yet been flushed to the metaslabs' own space maps.
+ */
+static void
+dump_log_spacemaps(spa_t *spa)
+{
+	if (!spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP))
+		return;
+
+	(void) printf("\nLog Space Maps in Pool:\n");
+	for (spa_log_sm_t *sls = avl_first(&spa->spa_sm_logs_by_txg);
+	    sls != NULL; sls = AVL_NEXT(&spa->spa_sm_logs_by_txg, sls)) {
+		(void) printf("Log Spacemap object %llu txg %llu "
+		    "blocks %llu metaslabs %llu\n",
+		    (u_longlong_t)sls->sls_sm_obj, (u_longlong_t)sls->sls_txg,
+		    (u_longlong_t)sls->sls_nblocks,
+		    (u_longlong_t)sls->sls_mscount);
+
+		if (dump_opt['m'] > 3) {
+			space_map_t *sm = NULL;
+
+			VERIFY0(space_map_open(&sm, spa->spa_meta_objset,
+			    sls->sls_sm_obj, 0, UINT64_MAX,
+			    SPA_MINBLOCKSHIFT));
+			dump_spacemap(spa->spa_meta_objset, sm);
+			space_map_close(sm);
+		}
+	}
+}
+
 static void
 dump_metaslabs(spa_t *spa)
 {
@@ -1104,6 +1142,8 @@ dump_metaslabs(spa_t *spa)
 			dump_metaslab(vd->vdev_ms[m]);
 		(void) printf("\n");
 	}
+
+	dump_log_spacemaps(spa);
 }
 
 static void
@@ -1684,13 +1724,14 @@ dump_bptree(objset_t *os, uint64_t obj, const char *name)
 
 /* ARGSUSED */
 static int
-dump_bpobj_cb(void *arg, const blkptr_t *bp, dmu_tx_t *tx)
+dump_bpobj_cb(void *arg, const blkptr_t *bp, boolean_t bp_freed,
+    dmu_tx_t *tx)
 {
 	char blkbuf[BP_SPRINTF_LEN];
 
 	ASSERT(bp->blk_birth != 0);
 	snprintf_blkptr_compact(blkbuf, sizeof (blkbuf), bp);
-	(void) printf("\t%s\n", blkbuf);
+	(void) printf("\t%s%s\n", bp_freed ? "FREE: " : "", blkbuf);
 	return (0);
 }
 
@@ -3065,12 +3106,26 @@ static const char *zdb_ot_extname[] = {
 
 #define	ZB_TOTAL	DN_MAX_LEVELS
 
+/*
+ * A cloned block, with the number of its references that the traversal
+ * has not seen yet.
+ */
+typedef struct zdb_brt_entry {
+	dva_t		zbre_dva;
+	uint64_t	zbre_refcount;
+	avl_node_t	zbre_node;
+} zdb_brt_entry_t;
+
 typedef struct zdb_cb {
 	zdb_blkstats_t	zcb_type[ZB_TOTAL + 1][ZDB_OT_TOTAL + 1];
 	uint64_t	zcb_removing_size;
 	uint64_t	zcb_checkpoint_size;
 	uint64_t	zcb_dedup_asize;
 	uint64_t	zcb_dedup_blocks;
+	uint64_t	zcb_clone_asize;
+	uint64_t	zcb_clone_blocks;
+	boolean_t	zcb_brt_is_active;
+	avl_tree_t	zcb_brt;
 	uint64_t	zcb_embedded_blocks[NUM_BP_EMBEDDED_TYPES];
 	uint64_t	zcb_embedded_histogram[NUM_BP_EMBEDDED_TYPES]
 	    [BPE_PAYLOAD_SIZE];
@@ -3084,6 +3139,20 @@ typedef struct zdb_cb {
 	uint32_t	**zcb_vd_obsolete_counts;
 } zdb_cb_t;
 
+static int
+zdb_brt_entry_compare(const void *zcn1, const void *zcn2)
+{
+	const dva_t *dva1 = &((const zdb_brt_entry_t *)zcn1)->zbre_dva;
+	const dva_t *dva2 = &((const zdb_brt_entry_t *)zcn2)->zbre_dva;
+	int cmp;
+
+	cmp = AVL_CMP(DVA_GET_VDEV(dva1), DVA_GET_VDEV(dva2));
+	if (cmp == 0)
+		cmp = AVL_CMP(DVA_GET_OFFSET(dva1), DVA_GET_OFFSET(dva2));
+
+	return (cmp);
+}
+
 /* test if two DVA offsets from same vdev are within the same metaslab */
 static boolean_t
 same_metaslab(spa_t *spa, uint64_t vdev, uint64_t off1, uint64_t off2)
@@ -3188,21 +3257,58 @@ zdb_count_block(zdb_cb_t *zcb, zilog_t *zilog, const blkptr_t *bp,
 		return;
 	}
 
+	/*
+	 * A cloned block is referenced once more than its BRT refcount.
+	 * Seed our own copy of the entry from the BRT the first time we
+	 * see the block, count every later reference as a clone, and claim
+	 * the block for real only with the last one, as for dedup.
+	 */
+	if (zcb->zcb_brt_is_active && !BP_GET_DEDUP(bp) &&
+	    brt_maybe_exists(zcb->zcb_spa, bp)) {
+		zdb_brt_entry_t zbre_search, *zbre;
+		avl_index_t where;
+
+		zbre_search.zbre_dva = bp->blk_dva[0];
+		zbre = avl_find(&zcb->zcb_brt, &zbre_search, &where);
+		if (zbre == NULL) {
+			refcnt = brt_entry_get_refcount(zcb->zcb_spa, bp);
+			if (refcnt != 0) {
+				zbre = umem_zalloc(sizeof (zdb_brt_entry_t),
+				    UMEM_NOFAIL);
+				zbre->zbre_dva = bp->blk_dva[0];
+				zbre->zbre_refcount = refcnt;
+				avl_insert(&zcb->zcb_brt, zbre, where);
+			}
+		} else {
+			zcb->zcb_clone_asize += BP_GET_ASIZE(bp);
+			zcb->zcb_clone_blocks++;
+
+			refcnt = --zbre->zbre_refcount;
+			if (refcnt == 0) {
+				avl_remove(&zcb->zcb_brt, zbre);
+				umem_free(zbre, sizeof (zdb_brt_entry_t));
+			}
+		}
+	}
+
 	if (dump_opt['L'])
 		return;
 
 	if (BP_GET_DEDUP(bp)) {
 		ddt_t *ddt;
 		ddt_entry_t *dde;
+		ddt_phys_t *ddp;
 
 		ddt = ddt_select(zcb->zcb_spa, bp);
 		ddt_enter(ddt);
 		dde = ddt_lookup(ddt, bp, B_FALSE);
 
-		if (dde == NULL) {
+		ddp = (dde != NULL) ? ddt_phys_select(dde, bp) : NULL;
+
+		/* A pruned block is no longer in the DDT. */
+		if (ddp == NULL) {
 			refcnt = 0;
 		} else {
-			ddt_phys_t *ddp = ddt_phys_select(dde, bp);
 			ddt_phys_decref(ddp);
 			refcnt = ddp->ddp_refcnt;
 			if (ddt_phys_total_refcnt(dde) == 0)
@@ -3354,46 +3460,94 @@ static metaslab_ops_t zdb_metaslab_ops = {
 	NULL	/* alloc */
 };
 
+/*
+ * Account a duplicate DDT entry before the traversal, and load it in core
+ * so that zdb_count_block() finds the references it has to expect.
+ */
+static void
+zdb_ddt_leak_entry(spa_t *spa, zdb_cb_t *zcb, enum zio_checksum checksum,
+    ddt_entry_t *dde)
+{
+	blkptr_t blk;
+	ddt_phys_t *ddp = dde->dde_phys;
+	int p;
+
+	ASSERT(ddt_phys_total_refcnt(dde) > 1);
+
+	for (p = 0; p < DDT_PHYS_TYPES; p++, ddp++) {
+		if (ddp->ddp_phys_birth == 0)
+			continue;
+		ddt_bp_create(checksum, &dde->dde_key, ddp, &blk);
+		if (p == DDT_PHYS_DITTO) {
+			zdb_count_block(zcb, NULL, &blk, ZDB_OT_DITTO);
+		} else {
+			zcb->zcb_dedup_asize +=
+			    BP_GET_ASIZE(&blk) * (ddp->ddp_refcnt - 1);
+			zcb->zcb_dedup_blocks++;
+		}
+	}
+	if (!dump_opt['L']) {
+		ddt_t *ddt = spa->spa_ddt[checksum];
+		ddt_enter(ddt);
+		VERIFY(ddt_lookup(ddt, &blk, B_TRUE) != NULL);
+		ddt_exit(ddt);
+	}
+}
+
+/*
+ * ddt_walk() returns the entries of the DDT objects whose logged state, if
+ * any, still has them there.  The entries that the DDT logs created or
+ * moved to another class since they were last flushed are only found in
+ * the logs themselves.
+ */
+static void
+zdb_ddt_leak_init_log(spa_t *spa, zdb_cb_t *zcb, enum zio_checksum checksum,
+    ddt_log_t *ddl)
+{
+	ddt_log_entry_t *ddle;
+	ddt_entry_t dde;
+
+	for (ddle = avl_first(&ddl->ddl_tree); ddle != NULL;
+	    ddle = AVL_NEXT(&ddl->ddl_tree, ddle)) {
+		if (ddle->ddle_type == DDT_TYPES ||
+		    ddle->ddle_class == DDT_CLASS_UNIQUE)
+			continue;
+		if (ddle->ddle_type == ddle->ddle_obj_type &&
+		    ddle->ddle_class == ddle->ddle_obj_class)
+			continue;
+
+		bzero(&dde, sizeof (dde));
+		dde.dde_key = ddle->ddle_key;
+		bcopy(ddle->ddle_phys, dde.dde_phys, sizeof (dde.dde_phys));
+		dde.dde_type = ddle->ddle_type;
+		dde.dde_class = ddle->ddle_class;
+		zdb_ddt_leak_entry(spa, zcb, checksum, &dde);
+	}
+}
+
 static void
 zdb_ddt_leak_init(spa_t *spa, zdb_cb_t *zcb)
 {
 	ddt_bookmark_t ddb;
 	ddt_entry_t dde;
 	int error;
-	int p;
 
 	bzero(&ddb, sizeof (ddb));
 	while ((error = ddt_walk(spa, &ddb, &dde)) == 0) {
-		blkptr_t blk;
-		ddt_phys_t *ddp = dde.dde_phys;
-
 		if (ddb.ddb_class == DDT_CLASS_UNIQUE)
-			return;
+			break;
+		zdb_ddt_leak_entry(spa, zcb, ddb.ddb_checksum, &dde);
+	}
+	ASSERT(error == 0 || error == ENOENT);
 
-		ASSERT(ddt_phys_total_refcnt(&dde) > 1);
+	for (enum zio_checksum c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
 
-		for (p = 0; p < DDT_PHYS_TYPES; p++, ddp++) {
-			if (ddp->ddp_phys_birth == 0)
-				continue;
-			ddt_bp_create(ddb.ddb_checksum,
-			    &dde.dde_key, ddp, &blk);
-			if (p == DDT_PHYS_DITTO) {
-				zdb_count_block(zcb, NULL, &blk, ZDB_OT_DITTO);
-			} else {
-				zcb->zcb_dedup_asize +=
-				    BP_GET_ASIZE(&blk) * (ddp->ddp_refcnt - 1);
-				zcb->zcb_dedup_blocks++;
-			}
-		}
-		if (!dump_opt['L']) {
-			ddt_t *ddt = spa->spa_ddt[ddb.ddb_checksum];
-			ddt_enter(ddt);
-			VERIFY(ddt_lookup(ddt, &blk, B_TRUE) != NULL);
-			ddt_exit(ddt);
-		}
+		if (ddt == NULL)
+			continue;
+		zdb_ddt_leak_init_log(spa, zcb, c, ddt->ddt_log_active);
+		zdb_ddt_leak_init_log(spa, zcb, c, ddt->ddt_log_flushing);
 	}
-
-	ASSERT(error == ENOENT);
 }
 
 /* ARGSUSED */
@@ -3429,6 +3583,26 @@ claim_segment_cb(void *arg, uint64_t offset, uint64_t size)
  * through the metaslabs we have already mapped and claim the destination
  * blocks.
  */
+/*
+ * Apply the changes of a metaslab that are still in the log space maps,
+ * which spa_ld_log_spacemaps() read in core at import, on top of the
+ * 'maptype' segments that were loaded into rt from its space map.
+ */
+static void
+zdb_load_unflushed(metaslab_t *msp, range_tree_t *rt, maptype_t maptype)
+{
+	range_tree_t *same = msp->ms_unflushed_allocs;
+	range_tree_t *other = msp->ms_unflushed_frees;
+
+	if (maptype == SM_FREE) {
+		same = msp->ms_unflushed_frees;
+		other = msp->ms_unflushed_allocs;
+	}
+
+	range_tree_walk(other, range_tree_remove, rt);
+	range_tree_walk(same, range_tree_add, rt);
+}
+
 static void
 zdb_claim_removing(spa_t *spa, zdb_cb_t *zcb)
 {
@@ -3452,20 +3626,20 @@ zdb_claim_removing(spa_t *spa, zdb_cb_t *zcb)
 		if (msp->ms_sm != NULL) {
 			VERIFY0(space_map_load(msp->ms_sm,
 			    svr->svr_allocd_segs, SM_ALLOC));
-
-			/*
-			 * Clear everything past what has been synced unless
-			 * it's past the spacemap, because we have not allocated
-			 * mappings for it yet.
-			 */
-			uint64_t vim_max_offset =
-			    vdev_indirect_mapping_max_offset(vim);
-			uint64_t sm_end = msp->ms_sm->sm_start +
-			    msp->ms_sm->sm_size;
-			if (sm_end > vim_max_offset)
-				range_tree_clear(svr->svr_allocd_segs,
-				    vim_max_offset, sm_end - vim_max_offset);
 		}
+		zdb_load_unflushed(msp, svr->svr_allocd_segs, SM_ALLOC);
+
+		/*
+		 * Clear everything past what has been synced unless
+		 * it's past the spacemap, because we have not allocated
+		 * mappings for it yet.
+		 */
+		uint64_t vim_max_offset =
+		    vdev_indirect_mapping_max_offset(vim);
+		uint64_t ms_end = msp->ms_start + msp->ms_size;
+		if (ms_end > vim_max_offset)
+			range_tree_clear(svr->svr_allocd_segs,
+			    vim_max_offset, ms_end - vim_max_offset);
 
 		zcb->zcb_removing_size +=
 		    range_tree_space(svr->svr_allocd_segs);
@@ -3477,13 +3651,15 @@ zdb_claim_removing(spa_t *spa, zdb_cb_t *zcb)
 
 /* ARGSUSED */
 static int
-increment_indirect_mapping_cb(void *arg, const blkptr_t *bp, dmu_tx_t *tx)
+increment_indirect_mapping_cb(void *arg, const blkptr_t *bp,
+    boolean_t bp_freed, dmu_tx_t *tx)
 {
 	zdb_cb_t *zcb = arg;
 	spa_t *spa = zcb->zcb_spa;
 	vdev_t *vd;
 	const dva_t *dva = &bp->blk_dva[0];
 
+	ASSERT(!bp_freed);
 	ASSERT(!dump_opt['L']);
 	ASSERT3U(BP_GET_NDVAS(bp), ==, 1);
 
@@ -3672,6 +3848,7 @@ load_concrete_ms_allocatable_trees(spa_t *spa, maptype_t maptype)
 				VERIFY0(space_map_load(msp->ms_sm,
 				    msp->ms_allocatable, maptype));
 			}
+			zdb_load_unflushed(msp, msp->ms_allocatable, maptype);
 			if (!msp->ms_loaded)
 				msp->ms_loaded = B_TRUE;
 			mutex_exit(&msp->ms_lock);
@@ -3838,6 +4015,11 @@ zdb_leak_init(spa_t *spa, zdb_cb_t *zcb)
 	spa_config_enter(spa, SCL_CONFIG, FTAG, RW_READER);
 	zdb_ddt_leak_init(spa, zcb);
 	spa_config_exit(spa, SCL_CONFIG, FTAG);
+
+	zcb->zcb_brt_is_active =
+	    spa_feature_is_active(spa, SPA_FEATURE_BLOCK_CLONING);
+	avl_create(&zcb->zcb_brt, zdb_brt_entry_compare,
+	    sizeof (zdb_brt_entry_t), offsetof(zdb_brt_entry_t, zbre_node));
 }
 
 static boolean_t
@@ -3914,6 +4096,16 @@ static boolean_t
 zdb_leak_fini(spa_t *spa, zdb_cb_t *zcb)
 {
 	boolean_t leaks = B_FALSE;
+	zdb_brt_entry_t *zbre;
+	void *cookie = NULL;
+
+	/*
+	 * Cloned blocks whose references were not all found have not been
+	 * claimed, and are reported as leaked below.
+	 */
+	while ((zbre = avl_destroy_nodes(&zcb->zcb_brt, &cookie)) != NULL)
+		umem_free(zbre, sizeof (zdb_brt_entry_t));
+	avl_destroy(&zcb->zcb_brt);
 
 	if (!dump_opt['L']) {
 		vdev_t *rvd = spa->spa_root_vdev;
@@ -3979,6 +4171,55 @@ count_block_cb(void *arg, const blkptr_t *bp, dmu_tx_t *tx)
 	return (0);
 }
 
+/* ARGSUSED */
+static int
+bpobj_count_block_cb(void *arg, const blkptr_t *bp, boolean_t bp_freed,
+    dmu_tx_t *tx)
+{
+	ASSERT(!bp_freed);
+	return (count_block_cb(arg, bp, tx));
+}
+
+/*
+ * Count the blocks of destroyed clones whose livelists are still waiting
+ * to be processed by the livelist delete zthr.  Within each sublist, only
+ * the ALLOC entries without a matching FREE are still allocated.
+ */
+static void
+count_deleted_livelists(spa_t *spa, zdb_cb_t *zcb)
+{
+	objset_t *mos = spa->spa_meta_objset;
+	uint64_t zap_obj;
+	zap_cursor_t zc;
+	zap_attribute_t za;
+
+	if (zap_lookup(mos, DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_DELETED_CLONES, sizeof (uint64_t), 1, &zap_obj) != 0)
+		return;
+
+	for (zap_cursor_init(&zc, mos, zap_obj);
+	    zap_cursor_retrieve(&zc, &za) == 0;
+	    zap_cursor_advance(&zc)) {
+		dsl_deadlist_t ll = { 0 };
+		dsl_deadlist_entry_t *dle;
+
+		dsl_deadlist_open(&ll, mos, za.za_first_integer);
+		for (dle = dsl_deadlist_first(&ll); dle != NULL;
+		    dle = AVL_NEXT(&ll.dl_tree, dle)) {
+			bplist_t to_free;
+
+			bplist_create(&to_free);
+			VERIFY0(dsl_process_sub_livelist(&dle->dle_bpobj,
+			    &to_free, NULL, NULL));
+			bplist_iterate(&to_free, count_block_cb, zcb, NULL);
+			bplist_clear(&to_free);
+			bplist_destroy(&to_free);
+		}
+		dsl_deadlist_close(&ll);
+	}
+	zap_cursor_fini(&zc);
+}
+
 static int
 dump_block_stats(spa_t *spa)
 {
@@ -4014,13 +4255,15 @@ dump_block_stats(spa_t *spa)
 	 * If there's a deferred-free bplist, process that first.
 	 */
 	(void) bpobj_iterate_nofree(&spa->spa_deferred_bpobj,
-	    count_block_cb, &zcb, NULL);
+	    bpobj_count_block_cb, &zcb, NULL);
 
 	if (spa_version(spa) >= SPA_VERSION_DEADLISTS) {
 		(void) bpobj_iterate_nofree(&spa->spa_dsl_pool->dp_free_bpobj,
-		    count_block_cb, &zcb, NULL);
+		    bpobj_count_block_cb, &zcb, NULL);
 	}
 
+	count_deleted_livelists(spa, &zcb);
+
 	zdb_claim_removing(spa, &zcb);
 
 	if (spa_feature_is_active(spa, SPA_FEATURE_ASYNC_DESTROY)) {
@@ -4077,8 +4320,8 @@ dump_block_stats(spa_t *spa)
 	    metaslab_class_get_alloc(spa_log_class(spa)) +
 	    metaslab_class_get_alloc(spa_special_class(spa)) +
 	    metaslab_class_get_alloc(spa_dedup_class(spa));
-	total_found = tzb->zb_asize - zcb.zcb_dedup_asize +
-	    zcb.zcb_removing_size + zcb.zcb_checkpoint_size;
+	total_found = tzb->zb_asize - zcb.zcb_dedup_asize -
+	    zcb.zcb_clone_asize + zcb.zcb_removing_size + zcb.zcb_checkpoint_size;
 
 	if (total_found == total_alloc) {
 		if (!dump_opt['L'])
@@ -4117,6 +4360,9 @@ dump_block_stats(spa_t *spa)
 	    "bp deduped:", (u_longlong_t)zcb.zcb_dedup_asize,
 	    (u_longlong_t)zcb.zcb_dedup_blocks,
 	    (double)zcb.zcb_dedup_asize / tzb->zb_asize + 1.0);
+	(void) printf("\t%-16s %14llu    count: %6llu\n",
+	    "bp cloned:", (u_longlong_t)zcb.zcb_clone_asize,
+	    (u_longlong_t)zcb.zcb_clone_blocks);
 	(void) printf("\t%-16s %14llu     used: %5.2f%%\n", "Normal class:",
 	    (u_longlong_t)norm_alloc, 100.0 * norm_alloc / norm_space);
 
@@ -5308,9 +5554,9 @@ zdb_read_block(char *thing, spa_t *spa)
 		    lsize -= SPA_MINBLOCKSIZE) {
 			for (c = 0; c < ZIO_COMPRESS_FUNCTIONS; c++) {
 				if (zio_decompress_data(c, pabd,
-				    lbuf, psize, lsize) == 0 &&
+				    lbuf, psize, lsize, NULL) == 0 &&
 				    zio_decompress_data_buf(c, pbuf2,
-				    lbuf2, psize, lsize) == 0 &&
+				    lbuf2, psize, lsize, NULL) == 0 &&
 				    bcmp(lbuf, lbuf2, lsize) == 0)
 					break;
 			}
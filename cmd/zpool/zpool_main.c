@@ -86,6 +86,8 @@ static int zpool_do_labelclear(int, char **);
 
 static int zpool_do_checkpoint(int, char **);
 
+static int zpool_do_ddt_prune(int, char **);
+
 static int zpool_do_list(int, char **);
 static int zpool_do_iostat(int, char **);
 static int zpool_do_status(int, char **);
@@ -148,6 +150,7 @@ typedef enum {
 	HELP_CLEAR,
 	HELP_CREATE,
 	HELP_CHECKPOINT,
+	HELP_DDT_PRUNE,
 	HELP_DESTROY,
 	HELP_DETACH,
 	HELP_EXPORT,
@@ -284,6 +287,8 @@ static zpool_command_t command_table[] = {
 	{ NULL },
 	{ "checkpoint",	zpool_do_checkpoint,	HELP_CHECKPOINT		},
 	{ NULL },
+	{ "ddtprune",	zpool_do_ddt_prune,	HELP_DDT_PRUNE		},
+	{ NULL },
 	{ "list",	zpool_do_list,		HELP_LIST		},
 	{ "iostat",	zpool_do_iostat,	HELP_IOSTAT		},
 	{ "status",	zpool_do_status,	HELP_STATUS		},
@@ -342,6 +347,9 @@ get_usage(zpool_help_t idx) {
 		    "\t    [-m mountpoint] [-R root] <pool> <vdev> ...\n"));
 	case HELP_CHECKPOINT:
 		return (gettext("\tcheckpoint [--discard] <pool> ...\n"));
+	case HELP_DDT_PRUNE:
+		return (gettext("\tddtprune -d <days> | -p <percentage> "
+		    "<pool>\n"));
 	case HELP_DESTROY:
 		return (gettext("\tdestroy [-f] <pool>\n"));
 	case HELP_DETACH:
@@ -2808,6 +2816,99 @@ zpool_do_checkpoint(int argc, char **argv)
 	return (err);
 }
 
+/*
+ * zpool ddtprune -d <days> | -p <percentage> <pool>
+ *
+ *       -d <days>        Prune the unique entries older than this many days.
+ *       -p <percentage>  Prune this percentage of the unique entries, oldest
+ *                        first.
+ *
+ * Removes old unique entries from the pool's dedup tables.  Their blocks
+ * are kept, and become ordinary blocks.
+ */
+int
+zpool_do_ddt_prune(int argc, char **argv)
+{
+	zpool_handle_t *zhp;
+	pool_ddt_prune_unit_t unit = POOL_DDT_PRUNE_AGE;
+	uint64_t amount = 0;
+	char *pool, *end;
+	int c, err;
+
+	while ((c = getopt(argc, argv, "d:p:")) != -1) {
+		switch (c) {
+		case 'd':
+			if (amount != 0) {
+				(void) fprintf(stderr, gettext("-d and -p are "
+				    "mutually exclusive\n"));
+				usage(B_FALSE);
+			}
+			errno = 0;
+			amount = strtoull(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || amount == 0 ||
+			    amount > UINT64_MAX / (24 * 60 * 60)) {
+				(void) fprintf(stderr,
+				    gettext("invalid days value: %s\n"),
+				    optarg);
+				usage(B_FALSE);
+			}
+			amount *= 24 * 60 * 60;
+			unit = POOL_DDT_PRUNE_AGE;
+			break;
+		case 'p':
+			if (amount != 0) {
+				(void) fprintf(stderr, gettext("-d and -p are "
+				    "mutually exclusive\n"));
+				usage(B_FALSE);
+			}
+			errno = 0;
+			amount = strtoull(optarg, &end, 10);
+			if (errno != 0 || *end != '\0' || amount == 0 ||
+			    amount > 100) {
+				(void) fprintf(stderr,
+				    gettext("invalid percentage value: %s\n"),
+				    optarg);
+				usage(B_FALSE);
+			}
+			unit = POOL_DDT_PRUNE_PERCENTAGE;
+			break;
+		case '?':
+			(void) fprintf(stderr, gettext("invalid option '%c'\n"),
+			    optopt);
+			usage(B_FALSE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (amount == 0) {
+		(void) fprintf(stderr, gettext("missing -d or -p option\n"));
+		usage(B_FALSE);
+	}
+
+	if (argc < 1) {
+		(void) fprintf(stderr, gettext("missing pool argument\n"));
+		usage(B_FALSE);
+	}
+
+	if (argc > 1) {
+		(void) fprintf(stderr, gettext("too many arguments\n"));
+		usage(B_FALSE);
+	}
+
+	pool = argv[0];
+
+	if ((zhp = zpool_open(g_zfs, pool)) == NULL)
+		return (1);
+
+	err = (zpool_ddt_prune(zhp, unit, amount) != 0);
+
+	zpool_close(zhp);
+
+	return (err);
+}
+
 #define	CHECKPOINT_OPT	1024
 
 /*
@@ -6893,11 +6994,13 @@ print_l2cache(zpool_handle_t *zhp, status_cbdata_t *cb, nvlist_t **l2cache,
 }
 
 static void
-print_dedup_stats(nvlist_t *config)
+print_dedup_stats(zpool_handle_t *zhp, nvlist_t *config)
 {
 	ddt_histogram_t *ddh;
 	ddt_stat_t *dds;
 	ddt_object_t *ddo;
+	uint64_t quota, size;
+	char qbuf[32], sbuf[32];
 	uint_t c;
 
 	/*
@@ -6921,6 +7024,22 @@ print_dedup_stats(nvlist_t *config)
 	    (u_longlong_t)ddo->ddo_dspace,
 	    (u_longlong_t)ddo->ddo_mspace);
 
+	/*
+	 * Show how close the DDT is to its quota; past it, new blocks are
+	 * no longer deduplicated.
+	 */
+	quota = zpool_get_prop_int(zhp, ZPOOL_PROP_DEDUP_TABLE_QUOTA, NULL);
+	if (quota != 0) {
+		size = zpool_get_prop_int(zhp, ZPOOL_PROP_DEDUP_TABLE_SIZE,
+		    NULL);
+		zfs_nicenum(quota, qbuf, sizeof (qbuf));
+		zfs_nicenum(size, sbuf, sizeof (sbuf));
+		(void) printf(gettext("        DDT quota %s, %s used "
+		    "(%llu%%)%s\n"), qbuf, sbuf,
+		    (u_longlong_t)(size * 100 / quota), size >= quota ?
+		    gettext(", new blocks not deduplicated") : "");
+	}
+
 	verify(nvlist_lookup_uint64_array(config, ZPOOL_CONFIG_DDT_STATS,
 	    (uint64_t **)&dds, &c) == 0);
 	verify(nvlist_lookup_uint64_array(config, ZPOOL_CONFIG_DDT_HISTOGRAM,
@@ -7330,7 +7449,7 @@ status_callback(zpool_handle_t *zhp, void *data)
 		}
 
 		if (cbp->cb_dedup_stats)
-			print_dedup_stats(config);
+			print_dedup_stats(zhp, config);
 	} else {
 		(void) printf(gettext("config: The configuration cannot be "
 		    "determined.\n"));
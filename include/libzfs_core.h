@@ -68,6 +68,7 @@ int lzc_initialize(const char *, pool_initialize_func_t, nvlist_t *,
     nvlist_t **);
 int lzc_trim(const char *, pool_trim_func_t, uint64_t, boolean_t,
     nvlist_t *, nvlist_t **);
+int lzc_ddt_prune(const char *, pool_ddt_prune_unit_t, uint64_t);
 
 int lzc_snaprange_space(const char *, const char *, uint64_t *);
 
@@ -34,6 +34,7 @@
 #include <sys/spa.h>
 #include <sys/nvpair.h>
 
+#include <pthread.h>
 #include <libuutil.h>
 #include <libzfs.h>
 #include <libshare.h>
@@ -80,6 +81,11 @@ struct libzfs_handle {
 	void *libzfs_sharehdl; /* libshare handle */
 	uint_t libzfs_shareflags;
 	boolean_t libzfs_mnttab_enable;
+	/*
+	 * We need a lock to prevent multiple threads from updating the
+	 * cache at the same time, e.g. when mounting datasets in parallel.
+	 */
+	pthread_mutex_t libzfs_mnttab_cache_lock;
 	avl_tree_t libzfs_mnttab_cache;
 	int libzfs_pool_iter;
 #if defined(HAVE_LIBTOPO)
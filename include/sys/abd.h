@@ -97,6 +97,8 @@ void abd_return_buf(abd_t *, void *, size_t);
 void abd_return_buf_copy(abd_t *, void *, size_t);
 void abd_return_buf_copy_off(abd_t *, void *, size_t, size_t, size_t);
 void abd_return_buf_off(abd_t *, void *, size_t, size_t, size_t);
+uio_t *abd_borrow_uio(abd_t *, size_t, uint_t, int);
+void abd_return_uio(abd_t *, uio_t *, size_t);
 void abd_take_ownership_of_buf(abd_t *, boolean_t);
 void abd_release_ownership_of_buf(abd_t *);
 
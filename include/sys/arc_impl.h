@@ -212,6 +212,173 @@ typedef struct arc_buf_hdr_crypt {
 	uint8_t			b_mac[ZIO_DATA_MAC_LEN];
 } arc_buf_hdr_crypt_t;
 
+/*
+ * Persistent L2ARC
+ *
+ * The on-disk format of a persistent L2ARC device consists of a device
+ * header, written right after the front vdev labels, followed by a chain
+ * of log blocks interleaved with the cached buffers themselves. Each log
+ * block describes the buffers written to the device immediately before
+ * it and points back at the previous log block, so the chain can be
+ * walked from the newest block (referenced by the device header) to the
+ * oldest one still present on the device:
+ *
+ *	+------+-------+-----+-------+-----+-------+-----+-------+-----+
+ *	|labels|dev hdr|bufs |log blk|bufs |log blk|bufs |log blk| ... |
+ *	+------+-------+-----+-------+-----+-------+-----+-------+-----+
+ *	                      lb 1          lb 2          lb 3 (newest)
+ *
+ * The device header's dh_start_lbps[0] references lb 3, whose lb_prev_lbp
+ * references lb 2, and so on.
+ *
+ * On pool import the chain is walked by l2arc_rebuild() in a background
+ * thread, recreating L2-only ARC headers for every buffer that still
+ * lives on the device.
+ */
+#define	L2ARC_DEV_HDR_MAGIC	0x5a46534341434845LLU	/* ASCII: "ZFSCACHE" */
+#define	L2ARC_LOG_BLK_MAGIC	0x4c4f47424c4b4844LLU	/* ASCII: "LOGBLKHD" */
+#define	L2ARC_PERSISTENT_VERSION	1
+
+/*
+ * Log blocks are 64 KiB with a 128-byte header, leaving room for 1022
+ * 64-byte log entries.
+ */
+#define	L2ARC_LOG_BLK_MAX_ENTRIES	(1022)
+
+/* dh_flags */
+#define	L2ARC_DEV_HDR_EVICT_FIRST	(1 << 0)	/* l2ad_first was set */
+
+/*
+ * Pointer to a log block on an L2ARC device. lbp_prop uses the L2BLK_*
+ * accessors below; its psize is the aligned on-disk size of the block.
+ */
+typedef struct l2arc_log_blkptr {
+	uint64_t	lbp_daddr;		/* device address of log block */
+	uint64_t	lbp_payload_asize;	/* aligned size of its payload */
+	uint64_t	lbp_payload_start;	/* device address of payload */
+	uint64_t	lbp_prop;		/* sizes, compression, checksum */
+	zio_cksum_t	lbp_cksum;		/* fletcher4 of the log block */
+} l2arc_log_blkptr_t;
+
+typedef struct l2arc_dev_hdr_phys {
+	uint64_t	dh_magic;	/* L2ARC_DEV_HDR_MAGIC */
+	uint64_t	dh_version;	/* L2ARC_PERSISTENT_VERSION */
+
+	/*
+	 * Global L2ARC device state and metadata.
+	 */
+	uint64_t	dh_spa_guid;
+	uint64_t	dh_vdev_guid;
+	uint64_t	dh_log_entries;	/* entries per log block */
+	uint64_t	dh_evict;	/* evicted offset in bytes */
+	uint64_t	dh_flags;	/* L2ARC_DEV_HDR_* flags */
+	/*
+	 * Device geometry at the time the header was written, so that a
+	 * header written for a differently sized device can be rejected.
+	 */
+	uint64_t	dh_start;	/* mirror of l2ad_start */
+	uint64_t	dh_end;		/* mirror of l2ad_end */
+
+	/*
+	 * Start of log block chain. [0] -> newest log, [1] -> one older.
+	 */
+	l2arc_log_blkptr_t	dh_start_lbps[2];
+
+	/*
+	 * Aligned size of all log blocks as accounted by vdev_space_update().
+	 */
+	uint64_t	dh_lb_asize;	/* mirror of l2ad_lb_asize */
+	uint64_t	dh_lb_count;	/* mirror of l2ad_lb_count */
+	const uint64_t	dh_pad[32];	/* pad to 512 bytes */
+	zio_eck_t	dh_tail;
+} l2arc_dev_hdr_phys_t;
+
+/*
+ * A single ARC buffer header entry in a log block.
+ */
+typedef struct l2arc_log_ent_phys {
+	dva_t			le_dva;		/* dva of buffer */
+	uint64_t		le_birth;	/* birth txg of buffer */
+	/*
+	 * le_prop has the following format:
+	 *	* logical size (in bytes)
+	 *	* physical (compressed) size (in bytes)
+	 *	* compression algorithm
+	 *	* object type (used to restore arc_buf_contents_t)
+	 *	* prefetch flag
+	 */
+	uint64_t		le_prop;
+	uint64_t		le_daddr;	/* buf location on l2dev */
+	const uint64_t		le_pad[3];	/* pad to 64 bytes */
+} l2arc_log_ent_phys_t;
+
+/*
+ * A log block of up to L2ARC_LOG_BLK_MAX_ENTRIES ARC buffer log entries,
+ * chained together via lb_prev_lbp. The block is always written out
+ * (optionally compressed) as a whole and is protected by the checksum
+ * stored in the pointer referencing it.
+ */
+typedef struct l2arc_log_blk_phys {
+	uint64_t		lb_magic;	/* L2ARC_LOG_BLK_MAGIC */
+	/*
+	 * Points back to the log block committed right before this one,
+	 * which lets the rebuild issue the read of the next block while
+	 * it restores the current one.
+	 */
+	l2arc_log_blkptr_t	lb_prev_lbp;	/* pointer to prev log block */
+	/*
+	 * Pad header section to 128 bytes
+	 */
+	uint64_t		lb_pad[7];
+	/* Payload */
+	l2arc_log_ent_phys_t	lb_entries[L2ARC_LOG_BLK_MAX_ENTRIES];
+} l2arc_log_blk_phys_t;
+
+/*
+ * These structures hold in-flight abd buffers for log blocks as they're
+ * being written to the L2ARC device.
+ */
+typedef struct l2arc_lb_abd_buf {
+	abd_t		*abd;
+	list_node_t	node;
+} l2arc_lb_abd_buf_t;
+
+/*
+ * These structures hold pointers to log blocks present on the L2ARC device.
+ */
+typedef struct l2arc_lb_ptr_buf {
+	l2arc_log_blkptr_t	*lb_ptr;
+	list_node_t		node;
+} l2arc_lb_ptr_buf_t;
+
+/* Macros for setting fields in le_prop and lbp_prop */
+#define	L2BLK_GET_LSIZE(field)	\
+	BF64_GET_SB((field), 0, SPA_LSIZEBITS, SPA_MINBLOCKSHIFT, 1)
+#define	L2BLK_SET_LSIZE(field, x)	\
+	BF64_SET_SB((field), 0, SPA_LSIZEBITS, SPA_MINBLOCKSHIFT, 1, x)
+#define	L2BLK_GET_PSIZE(field)	\
+	BF64_GET_SB((field), 16, SPA_PSIZEBITS, SPA_MINBLOCKSHIFT, 1)
+#define	L2BLK_SET_PSIZE(field, x)	\
+	BF64_SET_SB((field), 16, SPA_PSIZEBITS, SPA_MINBLOCKSHIFT, 1, x)
+#define	L2BLK_GET_COMPRESS(field)	\
+	BF64_GET((field), 32, SPA_COMPRESSBITS)
+#define	L2BLK_SET_COMPRESS(field, x)	\
+	BF64_SET((field), 32, SPA_COMPRESSBITS, x)
+#define	L2BLK_GET_PREFETCH(field)	BF64_GET((field), 39, 1)
+#define	L2BLK_SET_PREFETCH(field, x)	BF64_SET((field), 39, 1, x)
+#define	L2BLK_GET_CHECKSUM(field)	BF64_GET((field), 40, 8)
+#define	L2BLK_SET_CHECKSUM(field, x)	BF64_SET((field), 40, 8, x)
+#define	L2BLK_GET_TYPE(field)		BF64_GET((field), 48, 8)
+#define	L2BLK_SET_TYPE(field, x)	BF64_SET((field), 48, 8, x)
+
+#define	PTR_SWAP(x, y)		\
+	do {			\
+		void *tmp = (x);\
+		x = y;		\
+		y = tmp;	\
+	_NOTE(CONSTCOND)	\
+	} while (0)
+
 typedef struct l2arc_dev {
 	vdev_t			*l2ad_vdev;	/* vdev */
 	spa_t			*l2ad_spa;	/* spa */
@@ -224,6 +391,34 @@ typedef struct l2arc_dev {
 	list_t			l2ad_buflist;	/* buffer list */
 	list_node_t		l2ad_node;	/* device list node */
 	zfs_refcount_t		l2ad_alloc;	/* allocated bytes */
+	/*
+	 * Persistence-related stuff
+	 */
+	l2arc_dev_hdr_phys_t	*l2ad_dev_hdr;	/* persistent device header */
+	uint64_t		l2ad_dev_hdr_asize; /* aligned hdr size */
+	/* Set when the header on the device no longer matches l2ad_dev_hdr */
+	boolean_t		l2ad_dev_hdr_dirty;
+	l2arc_log_blk_phys_t	l2ad_log_blk;	/* currently open log block */
+	int			l2ad_log_ent_idx; /* index into cur log blk */
+	/* Number of bytes in current log block's payload */
+	uint64_t		l2ad_log_blk_payload_asize;
+	/*
+	 * Offset (in bytes) of the first buffer in current log block's
+	 * payload.
+	 */
+	uint64_t		l2ad_log_blk_payload_start;
+	/* Flag indicating whether a rebuild is scheduled or is going on */
+	boolean_t		l2ad_rebuild;
+	boolean_t		l2ad_rebuild_cancel;
+	boolean_t		l2ad_rebuild_began;
+	uint64_t		l2ad_log_entries;   /* entries per log blk  */
+	uint64_t		l2ad_evict;	 /* evicted offset in bytes */
+	/* List of pointers to log blocks present in the L2ARC device */
+	list_t			l2ad_lbptr_list;
+	/* Aligned size of all log blocks as accounted by vdev_space_update() */
+	zfs_refcount_t		l2ad_lb_asize;
+	/* Number of log blocks present on the device */
+	zfs_refcount_t		l2ad_lb_count;
 } l2arc_dev_t;
 
 typedef struct l2arc_buf_hdr {
@@ -240,6 +435,8 @@ typedef struct l2arc_buf_hdr {
 typedef struct l2arc_write_callback {
 	l2arc_dev_t	*l2wcb_dev;		/* device info */
 	arc_buf_hdr_t	*l2wcb_head;		/* head of write buflist */
+	/* in-flight list of log blocks */
+	list_t		l2wcb_abd_list;
 } l2arc_write_callback_t;
 
 struct arc_buf_hdr {
@@ -276,6 +473,14 @@ struct arc_buf_hdr {
 	 * of SPA_MINBLOCKSIZE (e.g. 2 == 1024 bytes)
 	 */
 	uint16_t		b_lsize;	/* immutable */
+
+	/*
+	 * The level the data was compressed with, for algorithms that
+	 * have levels (zstd). Zero when unknown; it is learned when the
+	 * block is written or first decompressed, and is needed to
+	 * recompress the block identically.
+	 */
+	uint8_t			b_complevel;
 	uint64_t		b_spa;		/* immutable */
 
 	/* L2ARC fields. Undefined when not in L2ARC. */
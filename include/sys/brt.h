@@ -0,0 +1,89 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2020, 2021, 2022 by Pawel Jakub Dawidek
+ */
+
+#ifndef _SYS_BRT_H
+#define	_SYS_BRT_H
+
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/fs/zfs.h>
+#include <sys/zio.h>
+#include <sys/dmu.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * MOS directory entry, suffixed with the top-level vdev id, naming the
+ * per-vdev BRT object.
+ */
+#define	BRT_OBJECT_VDEV_PREFIX	"com.fudosecurity:brt:vdev:"
+
+/*
+ * Bonus buffer of the per-vdev BRT object.  The object's data is an
+ * array of uint16_t counters, one per BRT range of the vdev, holding
+ * the number of BRT entries within that range.  The entries themselves
+ * live in the bvp_mos_entries ZAP, keyed by the DVA offset and holding
+ * the number of extra references to the block.
+ */
+typedef struct brt_vdev_phys {
+	uint64_t	bvp_mos_entries;	/* ZAP of BRT entries */
+	uint64_t	bvp_size;		/* number of range counters */
+	uint64_t	bvp_byteorder;		/* byte order of the counters */
+	uint64_t	bvp_totalcount;		/* number of BRT entries */
+	uint64_t	bvp_rangesize;		/* bytes covered by a counter */
+	uint64_t	bvp_usedspace;		/* space used by cloned blocks */
+	uint64_t	bvp_savedspace;		/* space saved by cloning */
+} brt_vdev_phys_t;
+
+typedef struct brt brt_t;
+
+extern void brt_init(void);
+extern void brt_fini(void);
+
+extern void brt_create(spa_t *spa);
+extern int brt_load(spa_t *spa);
+extern void brt_unload(spa_t *spa);
+extern void brt_sync(spa_t *spa, uint64_t txg);
+
+extern boolean_t brt_can_clone(spa_t *spa, const blkptr_t *bp);
+extern void brt_pending_add(spa_t *spa, const blkptr_t *bp, dmu_tx_t *tx);
+extern void brt_pending_apply(spa_t *spa, uint64_t txg);
+
+extern boolean_t brt_maybe_exists(spa_t *spa, const blkptr_t *bp);
+extern boolean_t brt_entry_decref(spa_t *spa, const blkptr_t *bp);
+extern uint64_t brt_entry_get_refcount(spa_t *spa, const blkptr_t *bp);
+extern boolean_t brt_vdev_has_entries(spa_t *spa, uint64_t vdevid);
+
+extern uint64_t brt_get_used(spa_t *spa);
+extern uint64_t brt_get_saved(spa_t *spa);
+extern uint64_t brt_get_ratio(spa_t *spa);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_BRT_H */
@@ -125,12 +125,96 @@ struct ddt_entry {
 	struct abd	*dde_repair_abd;
 	enum ddt_type	dde_type;
 	enum ddt_class	dde_class;
+	enum ddt_type	dde_obj_type;	/* DDT object holding the entry, */
+	enum ddt_class	dde_obj_class;	/* may lag behind with a DDT log */
+	uint64_t	dde_prune_txg;	/* to prune if born before, or 0 */
 	uint8_t		dde_loading;
 	uint8_t		dde_loaded;
 	kcondvar_t	dde_cv;
 	avl_node_t	dde_node;
 };
 
+/*
+ * DDT log.  With the ddt_log feature, the changes ddt_sync() makes to a
+ * DDT are appended to a log object instead of being applied to the DDT
+ * ZAPs right away, and are moved into the ZAPs later in sorted batches.
+ * See the comment at the top of ddt_log.c.
+ */
+
+/*
+ * On-disk log record: the state of an entry at the end of a txg.  Records
+ * are made only of uint64_t words, as the DMU byteswaps the log objects
+ * as uint64_t arrays.
+ */
+typedef struct ddt_log_record {
+	ddt_key_t	dlr_key;
+	ddt_phys_t	dlr_phys[DDT_PHYS_TYPES];
+	/*
+	 * Type and class of the entry (DDT_TYPES and DDT_CLASSES once it
+	 * has been removed), then of the DDT object it is stored in:
+	 *   +-------+-------+-------+-------+-------+-------+-------+-------+
+	 *   |   0   |   0   |   0   |   0   | otype | oclass|  type | class |
+	 *   +-------+-------+-------+-------+-------+-------+-------+-------+
+	 */
+	uint64_t	dlr_info;
+} ddt_log_record_t;
+
+#define	DLR_GET_CLASS(dlr)		BF64_GET((dlr)->dlr_info, 0, 8)
+#define	DLR_SET_CLASS(dlr, x)		BF64_SET((dlr)->dlr_info, 0, 8, x)
+#define	DLR_GET_TYPE(dlr)		BF64_GET((dlr)->dlr_info, 8, 8)
+#define	DLR_SET_TYPE(dlr, x)		BF64_SET((dlr)->dlr_info, 8, 8, x)
+#define	DLR_GET_OBJ_CLASS(dlr)		BF64_GET((dlr)->dlr_info, 16, 8)
+#define	DLR_SET_OBJ_CLASS(dlr, x)	BF64_SET((dlr)->dlr_info, 16, 8, x)
+#define	DLR_GET_OBJ_TYPE(dlr)		BF64_GET((dlr)->dlr_info, 24, 8)
+#define	DLR_SET_OBJ_TYPE(dlr, x)	BF64_SET((dlr)->dlr_info, 24, 8, x)
+
+/*
+ * Bonus buffer of a log object, whose data is an array of records.
+ */
+typedef struct ddt_log_phys {
+	uint64_t	dlp_count;		/* number of records */
+	uint64_t	dlp_first_txg;		/* txg of the first record */
+	uint64_t	dlp_flags;		/* DDT_LOG_FLAG_* */
+	ddt_key_t	dlp_checkpoint;		/* last key flushed */
+} ddt_log_phys_t;
+
+#define	DDT_LOG_FLAG_CHECKPOINT		(1ULL << 0)
+
+/*
+ * In-core log entry: the latest logged state of a DDT entry.
+ */
+typedef struct ddt_log_entry {
+	ddt_key_t	ddle_key;
+	ddt_phys_t	ddle_phys[DDT_PHYS_TYPES];
+	uint8_t		ddle_type;
+	uint8_t		ddle_class;
+	uint8_t		ddle_obj_type;
+	uint8_t		ddle_obj_class;
+	avl_node_t	ddle_node;
+} ddt_log_entry_t;
+
+typedef struct ddt_log {
+	avl_tree_t	ddl_tree;		/* ddt_log_entry_t by key */
+	uint64_t	ddl_object;		/* log object, 0 if none */
+	uint64_t	ddl_count;		/* number of records */
+	uint64_t	ddl_first_txg;		/* txg of the first record */
+	uint64_t	ddl_flags;		/* DDT_LOG_FLAG_* */
+	ddt_key_t	ddl_checkpoint;		/* last key flushed */
+	boolean_t	ddl_dirty;		/* bonus buffer needs syncing */
+} ddt_log_t;
+
+typedef struct ddt_log_stats {
+	kstat_named_t	ddls_active_entries;
+	kstat_named_t	ddls_active_bytes;
+	kstat_named_t	ddls_active_records;
+	kstat_named_t	ddls_flushing_entries;
+	kstat_named_t	ddls_flushing_bytes;
+	kstat_named_t	ddls_flush_rate;
+	kstat_named_t	ddls_flushed_last_txg;
+	kstat_named_t	ddls_flushed_entries;
+	kstat_named_t	ddls_swaps;
+} ddt_log_stats_t;
+
 /*
  * In-core ddt
  */
@@ -146,6 +230,20 @@ struct ddt {
 	ddt_histogram_t	ddt_histogram[DDT_TYPES][DDT_CLASSES];
 	ddt_histogram_t	ddt_histogram_cache[DDT_TYPES][DDT_CLASSES];
 	ddt_object_t	ddt_object_stats[DDT_TYPES][DDT_CLASSES];
+	ddt_log_t	ddt_log[2];
+	ddt_log_t	*ddt_log_active;	/* log being appended to */
+	ddt_log_t	*ddt_log_flushing;	/* log being flushed */
+	ddt_log_record_t *ddt_log_records;	/* records of this txg */
+	uint64_t	ddt_log_nrecords;
+	uint64_t	ddt_log_maxrecords;
+	uint64_t	ddt_flush_rate;		/* entries flushed per txg */
+	uint64_t	ddt_flush_force_txg;	/* flush all logged up to txg */
+	kstat_t		*ddt_log_kstat;
+	ddt_log_stats_t	ddt_log_stats;
+	kmutex_t	ddt_lookup_lock;	/* protects the lookup batch */
+	list_t		ddt_lookup_list;	/* writes waiting for entries */
+	boolean_t	ddt_lookup_dispatched;	/* batch task is queued */
+	taskq_ent_t	ddt_lookup_tqent;
 	avl_node_t	ddt_node;
 };
 
@@ -183,6 +281,10 @@ typedef struct ddt_ops {
 
 extern void ddt_object_name(ddt_t *ddt, enum ddt_type type,
     enum ddt_class _class, char *name);
+extern void ddt_object_create(ddt_t *ddt, enum ddt_type type,
+    enum ddt_class _class, dmu_tx_t *tx);
+extern int ddt_object_remove(ddt_t *ddt, enum ddt_type type,
+    enum ddt_class _class, ddt_entry_t *dde, dmu_tx_t *tx);
 extern int ddt_object_walk(ddt_t *ddt, enum ddt_type type,
     enum ddt_class _class, uint64_t *walk, ddt_entry_t *dde);
 extern uint64_t ddt_object_count(ddt_t *ddt, enum ddt_type type,
@@ -219,6 +321,10 @@ extern void ddt_get_dedup_stats(spa_t *spa, ddt_stat_t *dds_total);
 
 extern uint64_t ddt_get_dedup_dspace(spa_t *spa);
 extern uint64_t ddt_get_pool_dedup_ratio(spa_t *spa);
+extern uint64_t ddt_get_ddt_dsize(spa_t *spa);
+extern boolean_t ddt_over_quota(spa_t *spa);
+extern int ddt_prune_unique_entries(spa_t *spa, pool_ddt_prune_unit_t unit,
+    uint64_t amount);
 
 extern size_t ddt_compress(void *src, uchar_t *dst, size_t s_len, size_t d_len);
 extern void ddt_decompress(uchar_t *src, void *dst, size_t s_len, size_t d_len);
@@ -230,6 +336,7 @@ extern void ddt_init(void);
 extern void ddt_fini(void);
 extern ddt_entry_t *ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add);
 extern void ddt_prefetch(spa_t *spa, const blkptr_t *bp);
+extern boolean_t ddt_lookup_async(ddt_t *ddt, zio_t *zio);
 extern void ddt_remove(ddt_t *ddt, ddt_entry_t *dde);
 
 extern boolean_t ddt_class_contains(spa_t *spa, enum ddt_class max_class,
@@ -238,6 +345,7 @@ extern boolean_t ddt_class_contains(spa_t *spa, enum ddt_class max_class,
 extern ddt_entry_t *ddt_repair_start(ddt_t *ddt, const blkptr_t *bp);
 extern void ddt_repair_done(ddt_t *ddt, ddt_entry_t *dde);
 
+extern int ddt_key_compare(const ddt_key_t *k1, const ddt_key_t *k2);
 extern int ddt_entry_compare(const void *x1, const void *x2);
 
 extern void ddt_create(spa_t *spa);
@@ -245,9 +353,21 @@ extern int ddt_load(spa_t *spa);
 extern void ddt_unload(spa_t *spa);
 extern void ddt_sync(spa_t *spa, uint64_t txg);
 extern int ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde);
+extern void ddt_walk_init(spa_t *spa, uint64_t txg);
+extern boolean_t ddt_walk_ready(spa_t *spa);
 extern int ddt_object_update(ddt_t *ddt, enum ddt_type type,
     enum ddt_class _class, ddt_entry_t *dde, dmu_tx_t *tx);
 
+extern void ddt_log_init(void);
+extern void ddt_log_fini(void);
+extern void ddt_log_alloc(ddt_t *ddt);
+extern void ddt_log_free(ddt_t *ddt);
+extern int ddt_log_load(ddt_t *ddt);
+extern boolean_t ddt_log_empty(ddt_t *ddt);
+extern boolean_t ddt_log_lookup(ddt_t *ddt, ddt_entry_t *dde);
+extern void ddt_log_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx);
+extern boolean_t ddt_log_sync(ddt_t *ddt, dmu_tx_t *tx);
+
 extern const ddt_ops_t ddt_zap_ops;
 
 #ifdef	__cplusplus
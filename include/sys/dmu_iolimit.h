@@ -0,0 +1,77 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2024 by Pawel Jakub Dawidek
+ */
+
+#ifndef _SYS_DMU_IOLIMIT_H
+#define	_SYS_DMU_IOLIMIT_H
+
+#include <sys/zfs_context.h>
+#include <sys/fs/zfs.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+struct objset;
+struct dmu_tx;
+
+typedef enum dmu_iolimit_type {
+	DMU_IOLIMIT_READ,
+	DMU_IOLIMIT_WRITE,
+	DMU_IOLIMIT_TYPES
+} dmu_iolimit_type_t;
+
+typedef struct dmu_iolimit_stats {
+	kstat_named_t	iols_reads_delayed;
+	kstat_named_t	iols_read_delay_time;
+	kstat_named_t	iols_writes_delayed;
+	kstat_named_t	iols_write_delay_time;
+} dmu_iolimit_stats_t;
+
+/*
+ * Per-objset rate limits, cached from the limit_* properties.  Each limit
+ * is a token bucket kept as the time at which it will be empty again
+ * (its "theoretical arrival time"); 0 means no limit.
+ */
+typedef struct dmu_iolimit {
+	kmutex_t	iol_lock;
+	uint64_t	iol_bw[DMU_IOLIMIT_TYPES];	/* bytes per second */
+	uint64_t	iol_ops[DMU_IOLIMIT_TYPES];	/* blocks per second */
+	hrtime_t	iol_bw_tat[DMU_IOLIMIT_TYPES];
+	hrtime_t	iol_ops_tat[DMU_IOLIMIT_TYPES];
+} dmu_iolimit_t;
+
+extern void dmu_iolimit_init(dmu_iolimit_t *iol);
+extern void dmu_iolimit_fini(dmu_iolimit_t *iol);
+extern void dmu_iolimit_stats_init(dmu_iolimit_stats_t *st);
+
+extern void dmu_iolimit_read(struct objset *os, uint64_t blksz,
+    uint64_t offset, uint64_t length);
+extern void dmu_iolimit_tx(struct dmu_tx *tx);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_DMU_IOLIMIT_H */
@@ -40,6 +40,7 @@
 #include <sys/zil.h>
 #include <sys/sa.h>
 #include <sys/zfs_ioctl.h>
+#include <sys/dmu_iolimit.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -76,6 +77,15 @@ typedef struct objset_phys {
 	dnode_phys_t os_groupused_dnode;
 } objset_phys_t;
 
+/*
+ * Values of a dataset's zfs/<pool>/objset-0x<id> kstat.
+ */
+typedef struct objset_kstat_values {
+	kstat_named_t		oks_dataset_name;
+	dmu_iolimit_stats_t	oks_iolimit;
+	zio_compress_stats_t	oks_compress;
+} objset_kstat_values_t;
+
 #define	OBJSET_PROP_UNINITIALIZED	((uint64_t)-1)
 struct objset {
 	/* Immutable: */
@@ -102,6 +112,7 @@ struct objset {
 	uint64_t os_dnodesize; /* default dnode size for new objects */
 	enum zio_checksum os_checksum;
 	enum zio_compress os_compress;
+	uint8_t os_complevel;
 	uint8_t os_copies;
 	enum zio_checksum os_dedup_checksum;
 	boolean_t os_dedup_verify;
@@ -109,6 +120,13 @@ struct objset {
 	zfs_cache_type_t os_primary_cache;
 	zfs_cache_type_t os_secondary_cache;
 	zfs_sync_type_t os_sync;
+	zfs_direct_type_t os_direct;
+	dmu_iolimit_t os_iolimit;
+	/* see dmu_objset_kstat_create() */
+	uint32_t os_kstat_tried;
+	kstat_t *os_kstat;
+	objset_kstat_values_t os_kstat_values;
+	char os_kstat_dsname[ZFS_MAX_DATASET_NAME_LEN];
 	zfs_redundant_metadata_type_t os_redundant_metadata;
 	int os_recordsize;
 	/*
@@ -207,6 +225,8 @@ int dmu_objset_find_dp(struct dsl_pool *dp, uint64_t ddobj,
     void *arg, int flags);
 void dmu_objset_evict_dbufs(objset_t *os);
 timestruc_t dmu_objset_snap_cmtime(objset_t *os);
+void dmu_objset_kstat_create(objset_t *os);
+zio_compress_stats_t *dmu_objset_compress_stats(objset_t *os);
 
 /* called from dsl */
 void dmu_objset_sync(objset_t *os, zio_t *zio, dmu_tx_t *tx);
@@ -27,7 +27,9 @@
 #define	_SYS_DSL_DEADLIST_H
 
 #include <sys/bpobj.h>
+#include <sys/bplist.h>
 #include <sys/zfs_context.h>
+#include <sys/zthr.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -63,13 +65,78 @@ typedef struct dsl_deadlist_entry {
 	bpobj_t dle_bpobj;
 } dsl_deadlist_entry_t;
 
+typedef struct livelist_entry {
+	blkptr_t le_bp;
+	uint64_t le_refcnt;
+	avl_node_t le_node;
+} livelist_entry_t;
+
+/*
+ * Used for livelist kstat.
+ */
+typedef struct livelist_stats {
+	/*
+	 * Number of sublist condenses that completed.
+	 */
+	kstat_named_t livelist_condense_completed;
+	/*
+	 * Number of condenses abandoned in syncing context because the
+	 * livelist was removed while the condense was in flight.
+	 */
+	kstat_named_t livelist_condense_sync_cancel;
+	/*
+	 * Number of condenses interrupted in open context because the
+	 * condense zthr was cancelled (pool export or livelist removal).
+	 */
+	kstat_named_t livelist_condense_zthr_cancel;
+	/*
+	 * Number of entries appended to the sublist being condensed while
+	 * the condense was in progress, and carried over on completion.
+	 */
+	kstat_named_t livelist_condense_new_alloc;
+	/*
+	 * Number of matching ALLOC/FREE entry pairs dropped by condensing.
+	 */
+	kstat_named_t livelist_condense_entries_freed;
+	/*
+	 * Number of sublists consumed by deleted-clone processing.
+	 */
+	kstat_named_t livelist_sublists_deleted;
+	/*
+	 * Number of livelists whose deletion has completed.
+	 */
+	kstat_named_t livelist_livelists_deleted;
+	/*
+	 * Number of livelists dropped because the clone shared too little
+	 * with its origin for the livelist to remain worthwhile.
+	 */
+	kstat_named_t livelist_livelists_disabled;
+} livelist_stats_t;
+
+extern livelist_stats_t livelist_stats;
+
+#define	LIVELIST_STAT_INCR(stat, val) \
+    atomic_add_64(&livelist_stats.stat.value.ui64, (val));
+#define	LIVELIST_STAT_BUMP(stat) \
+    LIVELIST_STAT_INCR(stat, 1);
+
+typedef int deadlist_iter_t(void *args, dsl_deadlist_entry_t *dle);
+
 void dsl_deadlist_open(dsl_deadlist_t *dl, objset_t *os, uint64_t object);
 void dsl_deadlist_close(dsl_deadlist_t *dl);
+void dsl_deadlist_iterate(dsl_deadlist_t *dl, deadlist_iter_t func, void *arg);
 uint64_t dsl_deadlist_alloc(objset_t *os, dmu_tx_t *tx);
 void dsl_deadlist_free(objset_t *os, uint64_t dlobj, dmu_tx_t *tx);
-void dsl_deadlist_insert(dsl_deadlist_t *dl, const blkptr_t *bp, dmu_tx_t *tx);
+void dsl_deadlist_insert(dsl_deadlist_t *dl, const blkptr_t *bp,
+    boolean_t bp_freed, dmu_tx_t *tx);
+dsl_deadlist_entry_t *dsl_deadlist_first(dsl_deadlist_t *dl);
+dsl_deadlist_entry_t *dsl_deadlist_last(dsl_deadlist_t *dl);
 void dsl_deadlist_add_key(dsl_deadlist_t *dl, uint64_t mintxg, dmu_tx_t *tx);
 void dsl_deadlist_remove_key(dsl_deadlist_t *dl, uint64_t mintxg, dmu_tx_t *tx);
+void dsl_deadlist_remove_entry(dsl_deadlist_t *dl, uint64_t mintxg,
+    dmu_tx_t *tx);
+void dsl_deadlist_clear_entry(dsl_deadlist_entry_t *dle, dsl_deadlist_t *dl,
+    dmu_tx_t *tx);
 uint64_t dsl_deadlist_clone(dsl_deadlist_t *dl, uint64_t maxtxg,
     uint64_t mrs_obj, dmu_tx_t *tx);
 void dsl_deadlist_space(dsl_deadlist_t *dl,
@@ -81,6 +148,12 @@ void dsl_deadlist_merge(dsl_deadlist_t *dl, uint64_t obj, dmu_tx_t *tx);
 void dsl_deadlist_move_bpobj(dsl_deadlist_t *dl, bpobj_t *bpo, uint64_t mintxg,
     dmu_tx_t *tx);
 boolean_t dsl_deadlist_is_open(dsl_deadlist_t *dl);
+int dsl_process_sub_livelist(bpobj_t *bpobj, bplist_t *to_free,
+    zthr_t *t, uint64_t *size);
+int dsl_deadlist_insert_alloc_cb(void *arg, const blkptr_t *bp, dmu_tx_t *tx);
+int dsl_deadlist_insert_free_cb(void *arg, const blkptr_t *bp, dmu_tx_t *tx);
+void livelist_stat_init(void);
+void livelist_stat_fini(void);
 
 #ifdef	__cplusplus
 }
@@ -193,6 +193,11 @@ typedef enum {
 	ZFS_PROP_REMAPTXG,		/* not exposed to the user */
 	ZFS_PROP_SPECIAL_SMALL_BLOCKS,
 	ZFS_PROP_IVSET_GUID,		/* not exposed to the user */
+	ZFS_PROP_DIRECT,
+	ZFS_PROP_LIMIT_BW_READ,
+	ZFS_PROP_LIMIT_BW_WRITE,
+	ZFS_PROP_LIMIT_OP_READ,
+	ZFS_PROP_LIMIT_OP_WRITE,
 	ZFS_NUM_PROPS
 } zfs_prop_t;
 
@@ -246,6 +251,11 @@ typedef enum {
 	ZPOOL_PROP_MULTIHOST,
 	ZPOOL_PROP_MAXDNODESIZE,
 	ZPOOL_PROP_AUTOTRIM,
+	ZPOOL_PROP_BCLONEUSED,
+	ZPOOL_PROP_BCLONESAVED,
+	ZPOOL_PROP_BCLONERATIO,
+	ZPOOL_PROP_DEDUP_TABLE_SIZE,
+	ZPOOL_PROP_DEDUP_TABLE_QUOTA,
 	ZPOOL_NUM_PROPS
 } zpool_prop_t;
 
@@ -404,6 +414,12 @@ typedef enum {
 	ZFS_SYNC_DISABLED = 2
 } zfs_sync_type_t;
 
+typedef enum {
+	ZFS_DIRECT_STANDARD = 0,
+	ZFS_DIRECT_ALWAYS = 1,
+	ZFS_DIRECT_DISABLED = 2
+} zfs_direct_type_t;
+
 typedef enum {
 	ZFS_XATTR_OFF = 0,
 	ZFS_XATTR_DIR = 1,
@@ -755,6 +771,8 @@ typedef struct zpool_load_policy {
 	"com.delphix:obsolete_counts_are_precise"
 #define	VDEV_TOP_ZAP_POOL_CHECKPOINT_SM \
 	"com.delphix:pool_checkpoint_sm"
+#define	VDEV_TOP_ZAP_MS_UNFLUSHED_PHYS_TXGS \
+	"com.delphix:ms_unflushed_phys_txgs"
 
 #define	VDEV_LEAF_ZAP_INITIALIZE_LAST_OFFSET	\
 	"com.delphix:next_offset_to_initialize"
@@ -1108,6 +1126,15 @@ typedef enum pool_trim_func {
 	POOL_TRIM_FUNCS
 } pool_trim_func_t;
 
+/*
+ * How the amount passed to ZFS_IOC_DDT_PRUNE is to be taken.
+ */
+typedef enum pool_ddt_prune_unit {
+	POOL_DDT_PRUNE_AGE,		/* seconds */
+	POOL_DDT_PRUNE_PERCENTAGE,	/* of the unique entries, 1-100 */
+	POOL_DDT_PRUNE_UNITS
+} pool_ddt_prune_unit_t;
+
 /*
  * DDT statistics.  Note: all fields should be 64-bit because this
  * is passed between kernel and userland as an nvlist uint64 array.
@@ -1263,6 +1290,12 @@ typedef enum {
 #define	ZPOOL_TRIM_RATE			"trim_rate"
 #define	ZPOOL_TRIM_SECURE		"trim_secure"
 
+/*
+ * The following are names used when invoking ZFS_IOC_DDT_PRUNE.
+ */
+#define	ZPOOL_DDT_PRUNE_UNIT		"ddt_prune_unit"
+#define	ZPOOL_DDT_PRUNE_AMOUNT		"ddt_prune_amount"
+
 /*
  * Flags for ZFS_IOC_VDEV_SET_STATE
  */
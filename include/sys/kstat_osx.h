@@ -47,6 +47,7 @@ typedef struct osx_kstat {
 	kstat_named_t arc_zfs_arc_shrink_shift;
 	kstat_named_t arc_zfs_arc_p_min_shift;
 	kstat_named_t arc_zfs_arc_average_blocksize;
+	kstat_named_t arc_zfs_arc_evict_threads;
 
 	kstat_named_t l2arc_write_max;
 	kstat_named_t l2arc_write_boost;
@@ -113,6 +114,8 @@ typedef struct osx_kstat {
 	kstat_named_t l2arc_noprefetch;
 	kstat_named_t l2arc_feed_again;
 	kstat_named_t l2arc_norw;
+	kstat_named_t l2arc_rebuild_enabled;
+	kstat_named_t l2arc_rebuild_blocks_min_l2size;
 
 	kstat_named_t zfs_recover;
 
@@ -147,10 +150,49 @@ typedef struct osx_kstat {
 	kstat_named_t zfs_send_unmodified_spill_blocks;
 	kstat_named_t zfs_special_class_metadata_reserve_pct;
 
+	kstat_named_t zfs_zstd_earlyabort_pass;
+	kstat_named_t zfs_zstd_abort_size;
+
+	kstat_named_t zfs_unflushed_max_mem_amt;
+	kstat_named_t zfs_unflushed_log_block_max;
+	kstat_named_t zfs_unflushed_log_txg_max;
+	kstat_named_t zfs_min_metaslabs_to_flush;
+
+	kstat_named_t zfs_livelist_max_entries;
+	kstat_named_t zfs_livelist_min_percent_shared;
+
+	kstat_named_t zfs_bclone_enabled;
+
+	kstat_named_t zfs_vdev_mirror_latency_aware;
+	kstat_named_t zfs_vdev_mirror_latency_ewma_shift;
+	kstat_named_t zfs_vdev_mirror_latency_probe_ms;
+
+	kstat_named_t zfs_iolimit_burst_ms;
+
+	kstat_named_t zfs_send_read_queue_length;
+
+	kstat_named_t zfs_recv_writer_threads;
+
+	kstat_named_t zfs_dedup_log_txg_max;
+	kstat_named_t zfs_dedup_log_flush_txgs;
+	kstat_named_t zfs_dedup_log_flush_entries_min;
+	kstat_named_t zfs_dedup_log_mem_max;
+
+	kstat_named_t zfs_dedup_prune_batch;
+
+	kstat_named_t zfs_dedup_lookup_batch;
+
+	kstat_named_t zio_checksum_batch_max;
+
+	kstat_named_t zfs_compress_entropy_limit;
+	kstat_named_t zfs_compress_entropy_sample;
+
 	kstat_named_t zfs_vdev_raidz_impl;
 	kstat_named_t icp_gcm_impl;
 	kstat_named_t icp_aes_impl;
 	kstat_named_t zfs_fletcher_4_impl;
+	kstat_named_t zfs_blake3_impl;
+	kstat_named_t icp_sha2_impl;
 } osx_kstat_t;
 
 
@@ -171,6 +213,7 @@ extern int zfs_arc_grow_retry;
 extern int zfs_arc_shrink_shift;
 extern int zfs_arc_p_min_shift;
 extern int zfs_arc_average_blocksize;
+extern int zfs_arc_evict_threads;
 
 extern uint64_t l2arc_write_max;
 extern uint64_t l2arc_write_boost;
@@ -219,6 +262,8 @@ extern ssize_t zvol_immediate_write_sz;
 extern boolean_t l2arc_noprefetch;
 extern boolean_t l2arc_feed_again;
 extern boolean_t l2arc_norw;
+extern boolean_t l2arc_rebuild_enabled;
+extern uint64_t l2arc_rebuild_blocks_min_l2size;
 
 extern int zfs_top_maxinflight;
 extern int zfs_resilver_delay;
@@ -258,6 +303,43 @@ extern uint64_t  zfs_trim_queue_limit;
 extern uint64_t  zfs_send_unmodified_spill_blocks;
 extern uint64_t  zfs_special_class_metadata_reserve_pct;
 
+extern uint64_t  zfs_zstd_earlyabort_pass;
+extern uint64_t  zfs_zstd_abort_size;
+
+extern uint64_t  zfs_unflushed_max_mem_amt;
+extern uint64_t  zfs_unflushed_log_block_max;
+extern uint64_t  zfs_unflushed_log_txg_max;
+extern uint64_t  zfs_min_metaslabs_to_flush;
+
+extern uint64_t  zfs_livelist_max_entries;
+extern uint64_t  zfs_livelist_min_percent_shared;
+
+extern uint64_t  zfs_bclone_enabled;
+
+extern uint64_t  zfs_vdev_mirror_latency_aware;
+extern uint64_t  zfs_vdev_mirror_latency_ewma_shift;
+extern uint64_t  zfs_vdev_mirror_latency_probe_ms;
+
+extern uint64_t  zfs_iolimit_burst_ms;
+
+extern uint64_t  zfs_send_read_queue_length;
+
+extern uint64_t  zfs_recv_writer_threads;
+
+extern uint64_t  zfs_dedup_log_txg_max;
+extern uint64_t  zfs_dedup_log_flush_txgs;
+extern uint64_t  zfs_dedup_log_flush_entries_min;
+extern uint64_t  zfs_dedup_log_mem_max;
+
+extern uint64_t  zfs_dedup_prune_batch;
+
+extern uint64_t  zfs_dedup_lookup_batch;
+
+extern uint64_t  zio_checksum_batch_max;
+
+extern uint64_t  zfs_compress_entropy_limit;
+extern uint64_t  zfs_compress_entropy_sample;
+
 int        kstat_osx_init(void);
 void       kstat_osx_fini(void);
 
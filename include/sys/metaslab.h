@@ -61,6 +61,12 @@ void metaslab_sync_done(metaslab_t *, uint64_t);
 void metaslab_sync_reassess(metaslab_group_t *);
 uint64_t metaslab_block_maxsize(metaslab_t *);
 
+int metaslab_sort_by_flushed(const void *, const void *);
+boolean_t metaslab_flush(metaslab_t *, dmu_tx_t *);
+uint64_t metaslab_unflushed_changes_memused(metaslab_t *);
+void metaslab_space_update(vdev_t *, metaslab_class_t *, int64_t, int64_t,
+    int64_t);
+
 /*
  * metaslab alloc flags
  */
@@ -339,6 +339,17 @@ struct metaslab_group {
  * metaslab needs to condense then we must set the ms_condensing flag to
  * ensure that allocations are not performed on the metaslab that is
  * being written.
+ *
+ * When the log_spacemap feature is active, allocs and frees are not
+ * appended to the metaslab's own space map every txg.  Instead, all
+ * the metaslabs that were dirtied in a txg record their changes in a
+ * single pool-wide log space map, and keep an in-core copy of these
+ * changes in ms_unflushed_allocs and ms_unflushed_frees.  Every txg a
+ * few of the metaslabs with the oldest unflushed changes are flushed,
+ * i.e. their unflushed trees are appended to their own space map, so
+ * that old log space maps can eventually be destroyed.  On import, the
+ * log space maps are replayed to reconstruct the unflushed trees [see
+ * spa_log_spacemap.c].
  */
 struct metaslab {
 	/*
@@ -370,6 +381,7 @@ struct metaslab {
 	kmutex_t	ms_sync_lock;
 
 	kcondvar_t	ms_load_cv;
+	kcondvar_t	ms_flush_cv;
 	space_map_t	*ms_sm;
 	uint64_t	ms_id;
 	uint64_t	ms_start;
@@ -416,6 +428,13 @@ struct metaslab {
 	boolean_t	ms_loaded;
 	boolean_t	ms_loading;
 
+	/*
+	 * Set while metaslab_flush() has dropped the ms_lock to write the
+	 * unflushed changes to the space map. metaslab_load() waits on
+	 * ms_flush_cv until the flush is done.
+	 */
+	boolean_t	ms_flushing;
+
 	/*
 	 * Tracks the exact amount of allocated space of this metaslab
 	 * (and specifically the metaslab's space map) up to the most
@@ -445,13 +464,13 @@ struct metaslab {
 
 	/*
 	 * The metaslab block allocators can optionally use a size-ordered
-	 * range tree and/or an array of LBAs. Not all allocators use
+	 * b-tree and/or an array of LBAs. Not all allocators use
 	 * this functionality. The ms_allocatable_by_size should always
 	 * contain the same number of segments as the ms_allocatable. The
 	 * only difference is that the ms_allocatable_by_size is ordered by
 	 * segment sizes.
 	 */
-	avl_tree_t	ms_allocatable_by_size;
+	zfs_btree_t	ms_allocatable_by_size;
 	uint64_t	ms_lbas[MAX_LBAS];
 
 	metaslab_group_t *ms_group;	/* metaslab group		*/
@@ -461,9 +480,32 @@ struct metaslab {
 	/* updated every time we are done syncing the metaslab's space map */
 	uint64_t	ms_synced_length;
 
+	/*
+	 * Changes recorded in the log space maps but not yet flushed to
+	 * ms_sm. A segment is never in both trees at the same time.
+	 */
+	range_tree_t	*ms_unflushed_allocs;
+	range_tree_t	*ms_unflushed_frees;
+
+	/*
+	 * The txg of the oldest log space map that has changes for this
+	 * metaslab that are not in ms_sm yet, or 0 if the metaslab has
+	 * never used the log.
+	 */
+	uint64_t	ms_unflushed_txg;
+	avl_node_t	ms_spa_txg_node; /* node in spa_metaslabs_by_flushed */
+
 	boolean_t	ms_new;
 };
 
+/*
+ * On-disk entry of the per-vdev array (referenced from the vdev's top
+ * ZAP) that records each metaslab's ms_unflushed_txg.
+ */
+typedef struct metaslab_unflushed_phys {
+	uint64_t	msp_unflushed_txg;
+} metaslab_unflushed_phys_t;
+
 #ifdef	__cplusplus
 }
 #endif
@@ -118,6 +118,34 @@ extern void SHA512Update(SHA512_CTX *, const void *, size_t);
 
 extern void SHA512Final(void *, SHA512_CTX *);
 
+/*
+ * Hash count separate buffers, in[i] of len[i] bytes into digest[i], as
+ * many of them side by side as the selected implementation can.
+ */
+extern void SHA2Multi(uint64_t mech, const void *const *in,
+    const size_t *len, void *const *digest, uint32_t count);
+
+/*
+ * Advance count contexts, none of them holding a partial block, by len
+ * bytes each, len being a multiple of the block size.
+ */
+extern void SHA2MultiUpdate(SHA2_CTX *const *ctx, const void *const *in,
+    size_t len, uint32_t count);
+
+/* the number of buffers SHA2Multi() hashes side by side */
+extern uint32_t SHA2MultiLanes(uint64_t mech);
+
+/* select and benchmark the implementations, see sha2_impl.c */
+extern void sha2_impl_init(void);
+extern void sha2_impl_fini(void);
+
+/* select the implementation: "fastest", "generic", "shani", ... */
+extern int sha2_impl_set(const char *name);
+
+/* number of supported implementations, and their names */
+extern uint32_t sha2_impl_getcnt(void);
+extern const char *sha2_impl_getname(uint32_t id);
+
 #ifdef _SHA2_IMPL
 /*
  * The following types/functions are all private to the implementation
@@ -544,6 +544,13 @@ _NOTE(CONSTCOND) } while (0)
 	BF64_SET((bp)->blk_fill, 32, 32, iv2);	\
 }
 
+/*
+ * Blkptrs stored in a bpobj never need their fill count, so livelists
+ * reuse its low bit to distinguish FREE entries from ALLOC entries.
+ */
+#define	BP_GET_FREE(bp)		BF64_GET((bp)->blk_fill, 0, 1)
+#define	BP_SET_FREE(bp, x)	BF64_SET((bp)->blk_fill, 0, 1, x)
+
 #define	BP_IS_METADATA(bp)	\
 	(BP_GET_LEVEL(bp) > 0 || DMU_OT_IS_METADATA(BP_GET_TYPE(bp)))
 
@@ -812,6 +819,7 @@ extern int spa_scan_get_stats(spa_t *spa, pool_scan_stat_t *ps);
 #define	SPA_ASYNC_INITIALIZE_RESTART		0x100
 #define	SPA_ASYNC_TRIM_RESTART			0x200
 #define	SPA_ASYNC_AUTOTRIM_RESTART		0x400
+#define	SPA_ASYNC_L2CACHE_REBUILD		0x800
 
 /*
  * Controls the behavior of spa_vdev_remove().
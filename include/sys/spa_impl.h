@@ -34,6 +34,7 @@
 
 #include <sys/spa.h>
 #include <sys/spa_checkpoint.h>
+#include <sys/spa_log_spacemap.h>
 #include <sys/vdev.h>
 #include <sys/vdev_removal.h>
 #include <sys/metaslab.h>
@@ -46,6 +47,7 @@
 #include <sys/bplist.h>
 #include <sys/bpobj.h>
 #include <sys/dsl_crypt.h>
+#include <sys/dsl_deadlist.h>
 #include <sys/zfeature.h>
 #include <sys/zthr.h>
 #include <zfeature_common.h>
@@ -124,6 +126,20 @@ typedef struct spa_condensing_indirect_phys {
 	uint64_t	scip_next_mapping_object;
 } spa_condensing_indirect_phys_t;
 
+/*
+ * The livelist sublist pair currently targeted by the livelist condense
+ * zthr.  Set and cleared in syncing context; 'syncing' is set once the
+ * condense synctask has been dispatched and 'cancelled' once the livelist
+ * has been removed out from under it.
+ */
+typedef struct livelist_condense_entry {
+	struct dsl_dataset *ds;
+	dsl_deadlist_entry_t *first;
+	dsl_deadlist_entry_t *next;
+	boolean_t syncing;
+	boolean_t cancelled;
+} livelist_condense_entry_t;
+
 struct spa_aux_vdev {
 	uint64_t	sav_object;		/* MOS object for device list */
 	nvlist_t	*sav_config;		/* cached device config */
@@ -263,10 +279,27 @@ struct spa {
 	uint64_t	spa_syncing_txg;	/* txg currently syncing */
 	bpobj_t		spa_deferred_bpobj;	/* deferred-free bplist */
 	bplist_t	spa_free_bplist[TXG_SIZE]; /* bplist of stuff to free */
+
+	/*
+	 * Log space map state [see spa_log_spacemap.c]. The syncing log
+	 * space map and spa_sm_logs_by_txg are only accessed from syncing
+	 * context and spa_load()/spa_unload().
+	 */
+	space_map_t	*spa_syncing_log_sm;	/* current log space map */
+	avl_tree_t	spa_sm_logs_by_txg;	/* spa_log_sm_t by sls_txg */
+	kmutex_t	spa_flushed_ms_lock;	/* for metaslabs_by_flushed */
+	avl_tree_t	spa_metaslabs_by_flushed;
+	spa_unflushed_stats_t	spa_unflushed_stats;
+
 	zio_cksum_salt_t spa_cksum_salt;        /* secret salt for cksum */
 	/* checksum context templates */
 	kmutex_t        spa_cksum_tmpls_lock;
 	void            *spa_cksum_tmpls[ZIO_CHECKSUM_FUNCTIONS];
+	/* writes waiting for their checksums, see zio_checksum.c */
+	kmutex_t	spa_cksum_batch_lock;
+	list_t		spa_cksum_batch_list;
+	boolean_t	spa_cksum_batch_dispatched; /* batch task is queued */
+	taskq_ent_t	spa_cksum_batch_tqent;
 	uberblock_t	spa_ubsync;		/* last synced uberblock */
 	uberblock_t	spa_uberblock;		/* current uberblock */
 	boolean_t	spa_extreme_rewind;	/* rewind past deferred frees */
@@ -310,6 +343,11 @@ struct spa {
 	spa_checkpoint_info_t spa_checkpoint_info; /* checkpoint accounting */
 	zthr_t		*spa_checkpoint_discard_zthr;
 
+	uint64_t	spa_livelists_to_delete; /* zap obj of deleted clones */
+	livelist_condense_entry_t	spa_to_condense;
+	zthr_t		*spa_livelist_delete_zthr;
+	zthr_t		*spa_livelist_condense_zthr;
+
 	char		*spa_root;		/* alternate root directory */
 	uint64_t	spa_ena;		/* spa-wide ereport ENA */
 	int		spa_last_open_failed;	/* error if last open failed */
@@ -353,6 +391,11 @@ struct spa {
 	uint64_t	spa_ddt_stat_object;	/* DDT statistics */
 	uint64_t	spa_dedup_dspace;	/* Cache get_dedup_dspace() */
 	uint64_t	spa_dedup_checksum;	/* default dedup checksum */
+	uint64_t	spa_dedup_table_quota;	/* property DDT maximum size */
+	uint64_t	spa_dedup_dsize;	/* cached on-disk size of DDT */
+	uint64_t	spa_ddt_txg_time_object; /* DDT txg to time samples */
+	uint64_t	spa_ddt_txg_time_last;	/* time of the last sample */
+	struct brt	*spa_brt;		/* in-core block reference table */
 	uint64_t	spa_dspace;		/* dspace in normal class */
 	kmutex_t	spa_vdev_top_lock;	/* dueling offline/remove */
 	kmutex_t	spa_proc_lock;		/* protects spa_proc* */
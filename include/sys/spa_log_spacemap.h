@@ -0,0 +1,66 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2018, 2019 by Delphix. All rights reserved.
+ */
+
+#ifndef _SYS_SPA_LOG_SPACEMAP_H
+#define	_SYS_SPA_LOG_SPACEMAP_H
+
+#include <sys/avl.h>
+#include <sys/spa.h>
+#include <sys/space_map.h>
+
+typedef struct spa_log_sm {
+	uint64_t sls_sm_obj;	/* space map object ID */
+	uint64_t sls_txg;	/* txg logged on the space map */
+	uint64_t sls_nblocks;	/* number of blocks in this log */
+	uint64_t sls_mscount;	/* # of metaslabs whose oldest log is this */
+	avl_node_t sls_node;	/* node in spa_sm_logs_by_txg */
+} spa_log_sm_t;
+
+typedef struct spa_unflushed_stats  {
+	/* used for memory heuristic */
+	uint64_t sus_memused;	/* current memory used for unflushed trees */
+
+	/* used for block heuristic */
+	uint64_t sus_blocklimit;	/* max # of log blocks allowed */
+	uint64_t sus_nblocks;	/* # of blocks in log space maps currently */
+} spa_unflushed_stats_t;
+
+int spa_log_sm_sort_by_txg(const void *va, const void *vb);
+space_map_t *spa_syncing_log_sm(spa_t *spa);
+
+void spa_log_sm_decrement_mscount(spa_t *spa, uint64_t txg);
+void spa_log_sm_increment_current_mscount(spa_t *spa);
+void spa_log_sm_set_blocklimit(spa_t *spa);
+boolean_t spa_log_exceeds_memlimit(spa_t *spa);
+
+void spa_generate_syncing_log_sm(spa_t *spa, dmu_tx_t *tx);
+void spa_flush_metaslabs(spa_t *spa, dmu_tx_t *tx);
+void spa_sync_close_syncing_log_sm(spa_t *spa);
+void spa_cleanup_old_sm_logs(spa_t *spa, dmu_tx_t *tx);
+
+int spa_ld_log_spacemaps(spa_t *spa);
+void spa_unload_log_sm_metadata(spa_t *spa);
+
+#endif /* _SYS_SPA_LOG_SPACEMAP_H */
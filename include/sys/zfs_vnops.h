@@ -51,6 +51,23 @@ extern "C" {
 #define SPOTLIGHT_IOC_GET_LAST_MTIME              _IOR('h', 19, u_int32_t)
 #define SPOTLIGHT_FSCTL_GET_LAST_MTIME            IOCBASECMD(SPOTLIGHT_IOC_GET_LAST_MTIME)
 
+/*
+ * Clone a range of the file open on src_fd into the file the fsctl is
+ * issued on, sharing blocks instead of copying them.  Both files must be
+ * on the same ZFS file system; EXDEV means the range should be copied.
+ * On return len holds the number of bytes cloned.
+ */
+typedef struct zfs_clone_range_args {
+	int32_t		src_fd;
+	uint32_t	flags;		/* must be 0 */
+	uint64_t	src_offset;
+	uint64_t	dst_offset;
+	uint64_t	len;
+} zfs_clone_range_args_t;
+
+#define ZFS_IOC_CLONE_RANGE		_IOWR('Z', 1, zfs_clone_range_args_t)
+#define ZFS_FSCTL_CLONE_RANGE		IOCBASECMD(ZFS_IOC_CLONE_RANGE)
+
 /*
  * Account for user timespec structure differences
  */
@@ -62,6 +79,15 @@ typedef struct user32_timespec	timespec_user32_t;
 typedef struct user64_timespec	timespec_user64_t;
 #endif
 
+/*
+ * There is no O_DIRECT on Mac OS X.  Files put in no-cache mode with
+ * fcntl(F_NOCACHE) reach the vnops with IO_NOCACHE set, which
+ * zfs_ioflags() passes on to zfs_read() and zfs_write() as FDIRECT.
+ */
+#ifndef FDIRECT
+#define FDIRECT		0x40000		/* same bit as the kernel's FNOCACHE */
+#endif
+
 #define UNKNOWNUID ((uid_t)99)
 #define UNKNOWNGID ((gid_t)99)
 
@@ -152,6 +178,9 @@ extern int    zfs_read   ( vnode_t *vp, uio_t *uio, int ioflag,
                            cred_t *cr, caller_context_t *ct);
 extern int    zfs_write  ( vnode_t *vp, uio_t *uio, int ioflag,
                            cred_t *cr, caller_context_t *ct);
+extern int    zfs_clone_range ( znode_t *inzp, uint64_t *inoffp,
+                           znode_t *outzp, uint64_t *outoffp,
+                           uint64_t *lenp, cred_t *cr);
 extern int    zfs_lookup ( vnode_t *dvp, char *nm, vnode_t **vpp,
                            struct componentname *cnp, int nameiop,
                            cred_t *cr, int flags);
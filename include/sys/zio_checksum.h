@@ -110,6 +110,16 @@ extern zio_checksum_t abd_checksum_SHA256;
 extern zio_checksum_t abd_checksum_SHA512_native;
 extern zio_checksum_t abd_checksum_SHA512_byteswap;
 
+/*
+ * Most blocks whose SHA2 checksums are computed in one call, see
+ * zio_checksum_compute_async().
+ */
+#define	ZIO_CHECKSUM_BATCH_MAX	16
+
+extern uint_t abd_checksum_SHA2_batch_width(enum zio_checksum);
+extern void abd_checksum_SHA2_batch(enum zio_checksum, struct abd **,
+    const uint64_t *, uint_t, zio_cksum_t *);
+
 /* Skein */
 extern zio_checksum_t abd_checksum_skein_native;
 extern zio_checksum_t abd_checksum_skein_byteswap;
@@ -122,15 +132,24 @@ extern zio_checksum_t abd_checksum_edonr_byteswap;
 extern zio_checksum_tmpl_init_t abd_checksum_edonr_tmpl_init;
 extern zio_checksum_tmpl_free_t abd_checksum_edonr_tmpl_free;
 
+/* BLAKE3 */
+extern zio_checksum_t abd_checksum_blake3_native;
+extern zio_checksum_t abd_checksum_blake3_byteswap;
+extern zio_checksum_tmpl_init_t abd_checksum_blake3_tmpl_init;
+extern zio_checksum_tmpl_free_t abd_checksum_blake3_tmpl_free;
+
 extern int zio_checksum_equal(spa_t *, blkptr_t *, enum zio_checksum,
     void *, uint64_t, uint64_t, zio_bad_cksum_t *);
 extern void zio_checksum_compute(zio_t *, enum zio_checksum,
     struct abd *, uint64_t);
+extern boolean_t zio_checksum_compute_async(zio_t *, enum zio_checksum);
 extern int zio_checksum_error_impl(spa_t *, const blkptr_t *, enum zio_checksum,
     struct abd *, uint64_t, uint64_t, zio_bad_cksum_t *);
 extern int zio_checksum_error(zio_t *zio, zio_bad_cksum_t *out);
 extern enum zio_checksum spa_dedup_checksum(spa_t *spa);
 extern void zio_checksum_templates_free(spa_t *spa);
+extern void zio_checksum_batch_init(spa_t *spa);
+extern void zio_checksum_batch_fini(spa_t *spa);
 extern spa_feature_t zio_checksum_to_feature(enum zio_checksum cksum);
 
 #ifdef	__cplusplus
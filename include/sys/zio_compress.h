@@ -31,6 +31,8 @@
 #define	_SYS_ZIO_COMPRESS_H
 
 #include <sys/abd.h>
+#include <sys/kstat.h>
+#include <zfeature_common.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -53,15 +55,111 @@ enum zio_compress {
 	ZIO_COMPRESS_GZIP_9,
 	ZIO_COMPRESS_ZLE,
 	ZIO_COMPRESS_LZ4,
+	ZIO_COMPRESS_ZSTD,
 	ZIO_COMPRESS_FUNCTIONS
 };
 
+/*
+ * Compression levels for algorithms that support them.  Only zstd uses
+ * these today.  The values are chosen to fit in eight bits so that they
+ * can be carried in zio_prop_t, in the arc_buf_hdr_t and in the zstd
+ * block header without widening any of them.  Levels 1-19 map directly
+ * onto the zstd levels; the "fast" levels map onto negative zstd levels,
+ * which trade compression ratio for speed.
+ *
+ * The values are recorded on disk in every zstd block header, so they
+ * must stay identical to the numbering used by other OpenZFS platforms
+ * for the same feature (org.freebsd:zstd_compress).
+ */
+enum zio_zstd_levels {
+	ZIO_ZSTD_LEVEL_INHERIT = 0,
+	ZIO_ZSTD_LEVEL_1,
+	ZIO_ZSTD_LEVEL_2,
+	ZIO_ZSTD_LEVEL_3,
+	ZIO_ZSTD_LEVEL_4,
+	ZIO_ZSTD_LEVEL_5,
+	ZIO_ZSTD_LEVEL_6,
+	ZIO_ZSTD_LEVEL_7,
+	ZIO_ZSTD_LEVEL_8,
+	ZIO_ZSTD_LEVEL_9,
+	ZIO_ZSTD_LEVEL_10,
+	ZIO_ZSTD_LEVEL_11,
+	ZIO_ZSTD_LEVEL_12,
+	ZIO_ZSTD_LEVEL_13,
+	ZIO_ZSTD_LEVEL_14,
+	ZIO_ZSTD_LEVEL_15,
+	ZIO_ZSTD_LEVEL_16,
+	ZIO_ZSTD_LEVEL_17,
+	ZIO_ZSTD_LEVEL_18,
+	ZIO_ZSTD_LEVEL_19,
+#define	ZIO_ZSTD_LEVEL_MAX	ZIO_ZSTD_LEVEL_19
+	ZIO_ZSTD_LEVEL_RESERVE = 101,	/* room for new regular levels */
+	ZIO_ZSTD_LEVEL_FAST,		/* base of the fast levels */
+	ZIO_ZSTD_LEVEL_FAST_1,
+	ZIO_ZSTD_LEVEL_FAST_2,
+	ZIO_ZSTD_LEVEL_FAST_3,
+	ZIO_ZSTD_LEVEL_FAST_4,
+	ZIO_ZSTD_LEVEL_FAST_5,
+	ZIO_ZSTD_LEVEL_FAST_6,
+	ZIO_ZSTD_LEVEL_FAST_7,
+	ZIO_ZSTD_LEVEL_FAST_8,
+	ZIO_ZSTD_LEVEL_FAST_9,
+	ZIO_ZSTD_LEVEL_FAST_10,
+	ZIO_ZSTD_LEVEL_FAST_20,
+	ZIO_ZSTD_LEVEL_FAST_30,
+	ZIO_ZSTD_LEVEL_FAST_40,
+	ZIO_ZSTD_LEVEL_FAST_50,
+	ZIO_ZSTD_LEVEL_FAST_60,
+	ZIO_ZSTD_LEVEL_FAST_70,
+	ZIO_ZSTD_LEVEL_FAST_80,
+	ZIO_ZSTD_LEVEL_FAST_90,
+	ZIO_ZSTD_LEVEL_FAST_100,
+	ZIO_ZSTD_LEVEL_FAST_500,
+	ZIO_ZSTD_LEVEL_FAST_1000,
+#define	ZIO_ZSTD_LEVEL_FAST_MAX	ZIO_ZSTD_LEVEL_FAST_1000
+	ZIO_ZSTD_LEVEL_AUTO = 251,	/* reserved */
+	ZIO_ZSTD_LEVEL_LEVELS
+};
+
+#define	ZIO_ZSTD_LEVEL_DEFAULT		ZIO_ZSTD_LEVEL_3
+#define	ZIO_COMPLEVEL_INHERIT		0
+
+/*
+ * The compression property packs the algorithm into the low bits (the
+ * same width as the compression field of a block pointer) and the level
+ * above it, so that e.g. "zstd-7" is a single index property value.  Only
+ * the algorithm ever reaches the block pointer.
+ */
+#define	ZIO_COMPRESS_LEVEL_SHIFT	7	/* SPA_COMPRESSBITS */
+#define	ZIO_COMPRESS_ALGO_MASK		((1ULL << ZIO_COMPRESS_LEVEL_SHIFT) - 1)
+#define	ZIO_COMPRESS_RAW(type, level)	\
+	((uint64_t)(type) | ((uint64_t)(level) << ZIO_COMPRESS_LEVEL_SHIFT))
+#define	ZIO_COMPRESS_ALGO(x)	\
+	((enum zio_compress)((x) & ZIO_COMPRESS_ALGO_MASK))
+#define	ZIO_COMPRESS_LEVEL(x)	((uint8_t)((x) >> ZIO_COMPRESS_LEVEL_SHIFT))
+
 /* Common signature for all zio compress functions. */
 typedef size_t zio_compress_func_t(void *src, void *dst,
     size_t s_len, size_t d_len, int);
 /* Common signature for all zio decompress functions. */
 typedef int zio_decompress_func_t(void *src, void *dst,
     size_t s_len, size_t d_len, int);
+/* Common signature for all zio decompress functions that report a level. */
+typedef int zio_decompresslevel_func_t(void *src, void *dst,
+    size_t s_len, size_t d_len, uint8_t *level);
+/*
+ * Common signature for zio compress functions that read their input straight
+ * out of an ABD, so that a scattered source is not linearized first.  The
+ * result has to be byte-identical to that of the algorithm's ci_compress
+ * however the ABD is split into chunks, because the ARC recompresses blocks
+ * from differently laid out buffers to verify them.  Only gzip implements
+ * it: deflate() is a stream compressor whose output does not depend on how
+ * its input is fed.  LZ4, LZJB, ZLE and zstd compress a block in one call,
+ * and compressing it chunk by chunk would change the stream, so they keep
+ * the linear copy.
+ */
+typedef size_t zio_compress_abd_func_t(abd_t *src, void *dst,
+    size_t s_len, size_t d_len, int);
 /*
  * Common signature for all zio decompress functions using an ABD as input.
  * This is helpful if you have both compressed ARC and scatter ABDs enabled,
@@ -78,16 +176,40 @@ typedef struct zio_compress_info {
 	int				ci_level;
 	zio_compress_func_t		*ci_compress;
 	zio_decompress_func_t		*ci_decompress;
+	zio_decompresslevel_func_t	*ci_decompress_level;
+	zio_compress_abd_func_t		*ci_compress_abd;
 } zio_compress_info_t;
 
 extern zio_compress_info_t zio_compress_table[ZIO_COMPRESS_FUNCTIONS];
 
+/*
+ * Per-dataset counts of records that were written uncompressed although
+ * the dataset has compression enabled, either because sampling judged
+ * them incompressible and no compression was attempted ("skipped"), or
+ * because the compressor ran and did not save enough space ("failed").
+ */
+typedef struct zio_compress_stats {
+	kstat_named_t	zcs_skipped;
+	kstat_named_t	zcs_skipped_bytes;
+	kstat_named_t	zcs_failed;
+	kstat_named_t	zcs_failed_bytes;
+} zio_compress_stats_t;
+
+extern uint64_t zfs_compress_entropy_limit;
+extern uint64_t zfs_compress_entropy_sample;
+
 /*
  * lz4 compression init & free
  */
 extern void lz4_init(void);
 extern void lz4_fini(void);
 
+/*
+ * zstd compression init & free
+ */
+extern void zstd_init(void);
+extern void zstd_fini(void);
+
 /*
  * Compression routines.
  */
@@ -97,6 +219,8 @@ extern int lzjb_decompress(void *src, void *dst, size_t s_len, size_t d_len,
     int level);
 extern size_t gzip_compress(void *src, void *dst, size_t s_len, size_t d_len,
     int level);
+extern size_t gzip_compress_abd(abd_t *src, void *dst, size_t s_len,
+    size_t d_len, int level);
 extern int gzip_decompress(void *src, void *dst, size_t s_len, size_t d_len,
     int level);
 extern size_t zle_compress(void *src, void *dst, size_t s_len, size_t d_len,
@@ -107,16 +231,25 @@ extern size_t lz4_compress_zfs(void *src, void *dst, size_t s_len, size_t d_len,
     int level);
 extern int lz4_decompress_zfs(void *src, void *dst, size_t s_len, size_t d_len,
     int level);
+extern size_t zfs_zstd_compress(void *src, void *dst, size_t s_len,
+    size_t d_len, int level);
+extern int zfs_zstd_decompress(void *src, void *dst, size_t s_len,
+    size_t d_len, int level);
+extern int zfs_zstd_decompress_level(void *src, void *dst, size_t s_len,
+    size_t d_len, uint8_t *level);
 
 /*
  * Compress and decompress data if necessary.
  */
 extern size_t zio_compress_data(enum zio_compress c, abd_t *src, void *dst,
-    size_t s_len);
+    size_t s_len, uint8_t level);
 extern int zio_decompress_data(enum zio_compress c, abd_t *src, void *dst,
-    size_t s_len, size_t d_len);
+    size_t s_len, size_t d_len, uint8_t *level);
 extern int zio_decompress_data_buf(enum zio_compress c, void *src, void *dst,
-    size_t s_len, size_t d_len);
+    size_t s_len, size_t d_len, uint8_t *level);
+extern spa_feature_t zio_compress_to_feature(enum zio_compress comp);
+extern boolean_t zio_compress_incompressible(abd_t *src, size_t s_len);
+extern void zio_compress_stats_init(zio_compress_stats_t *zcs);
 
 #ifdef	__cplusplus
 }
@@ -65,6 +65,12 @@ typedef enum spa_feature {
 	SPA_FEATURE_ALLOCATION_CLASSES,
 	SPA_FEATURE_BOOKMARK_V2,
 	SPA_FEATURE_RESILVER_DEFER,
+	SPA_FEATURE_ZSTD_COMPRESS,
+	SPA_FEATURE_LOG_SPACEMAP,
+	SPA_FEATURE_LIVELIST,
+	SPA_FEATURE_BLOCK_CLONING,
+	SPA_FEATURE_DDT_LOG,
+	SPA_FEATURE_BLAKE3,
 	SPA_FEATURES
 } spa_feature_t;
 
@@ -50,6 +50,11 @@
  * 	zfs_bmi1_available()
  * 	zfs_bmi2_available()
  *
+ * 	zfs_shani_available()
+ *
+ * 	zfs_vaes_available()
+ * 	zfs_vpclmulqdq_available()
+ *
  * 	zfs_avx512f_available()
  * 	zfs_avx512cd_available()
  * 	zfs_avx512er_available()
@@ -146,7 +151,10 @@ typedef enum cpuid_inst_sets {
 	AVX512ER,
 	AVX512VL,
 	AES,
-	PCLMULQDQ
+	PCLMULQDQ,
+	SHA_NI,
+	VAES,
+	VPCLMULQDQ
 } cpuid_inst_sets_t;
 
 /*
@@ -170,6 +178,9 @@ typedef struct cpuid_feature_desc {
 #define	_AVX512VL_BIT		(1U << 31) /* if used also check other levels */
 #define	_AES_BIT		(1U << 25)
 #define	_PCLMULQDQ_BIT		(1U << 1)
+#define	_SHA_NI_BIT		(1U << 29)
+#define	_VAES_BIT		(1U << 9)
+#define	_VPCLMULQDQ_BIT		(1U << 10)
 
 /*
  * Descriptions of supported instruction sets
@@ -197,6 +208,9 @@ static const cpuid_feature_desc_t spl_cpuid_features[] = {
 	[AVX512VL]	= {7U, 0U, _AVX512ER_BIT,	EBX	},
 	[AES]		= {1U, 0U, _AES_BIT,		ECX	},
 	[PCLMULQDQ]	= {1U, 0U, _PCLMULQDQ_BIT,	ECX	},
+	[SHA_NI]	= {7U, 0U, _SHA_NI_BIT,		EBX	},
+	[VAES]		= {7U, 0U, _VAES_BIT,		ECX	},
+	[VPCLMULQDQ]	= {7U, 0U, _VPCLMULQDQ_BIT,	ECX	},
 };
 
 /*
@@ -269,6 +283,9 @@ CPUID_FEATURE_CHECK(avx512er, AVX512ER);
 CPUID_FEATURE_CHECK(avx512vl, AVX512VL);
 CPUID_FEATURE_CHECK(aes, AES);
 CPUID_FEATURE_CHECK(pclmulqdq, PCLMULQDQ);
+CPUID_FEATURE_CHECK(sha_ni, SHA_NI);
+CPUID_FEATURE_CHECK(vaes, VAES);
+CPUID_FEATURE_CHECK(vpclmulqdq, VPCLMULQDQ);
 
 #endif /* !defined(_KERNEL) */
 
@@ -483,6 +500,64 @@ zfs_pclmulqdq_available(void)
 #endif
 }
 
+/*
+ * Check if SHA-NI (the SHA-1 and SHA-256 extensions) is available
+ */
+static inline boolean_t
+zfs_shani_available(void)
+{
+#if defined(_KERNEL)
+#if defined(HAVE_SHA_NI) && defined(CPUID_LEAF7_FEATURE_SHA)
+	return !!(spl_cpuid_leaf7_features() & CPUID_LEAF7_FEATURE_SHA);
+#else
+	return (B_FALSE);
+#endif
+#elif !defined(_KERNEL)
+	return (__cpuid_has_sha_ni());
+#endif
+}
+
+/*
+ * Check if VAES (AES instructions on ymm registers) is available
+ */
+static inline boolean_t
+zfs_vaes_available(void)
+{
+	boolean_t has_vaes;
+#if defined(_KERNEL)
+#if defined(HAVE_VAES) && defined(CPUID_LEAF7_FEATURE_VAES)
+	has_vaes = !!(spl_cpuid_leaf7_features() & CPUID_LEAF7_FEATURE_VAES);
+#else
+	has_vaes = B_FALSE;
+#endif
+#elif !defined(_KERNEL)
+	has_vaes = __cpuid_has_vaes();
+#endif
+
+	return (has_vaes && __ymm_enabled());
+}
+
+/*
+ * Check if VPCLMULQDQ (PCLMULQDQ on ymm registers) is available
+ */
+static inline boolean_t
+zfs_vpclmulqdq_available(void)
+{
+	boolean_t has_vpclmulqdq;
+#if defined(_KERNEL)
+#if defined(HAVE_VPCLMULQDQ) && defined(CPUID_LEAF7_FEATURE_VPCLMULQDQ)
+	has_vpclmulqdq = !!(spl_cpuid_leaf7_features() &
+	    CPUID_LEAF7_FEATURE_VPCLMULQDQ);
+#else
+	has_vpclmulqdq = B_FALSE;
+#endif
+#elif !defined(_KERNEL)
+	has_vpclmulqdq = __cpuid_has_vpclmulqdq();
+#endif
+
+	return (has_vpclmulqdq && __ymm_enabled());
+}
+
 /*
  * AVX-512 family of instruction sets:
  *
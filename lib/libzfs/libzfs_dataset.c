@@ -879,25 +879,55 @@ libzfs_mnttab_cache(libzfs_handle_t *hdl, boolean_t enable)
 	hdl->libzfs_mnttab_enable = enable;
 }
 
+/*
+ * Copy a mount table entry into storage owned by the caller.  The source
+ * points either into the cache, which other threads may change, or into
+ * getmntany()'s static buffers, which the next lookup overwrites.
+ */
+static void
+libzfs_mnttab_copy(libzfs_handle_t *hdl, const struct mnttab *src,
+    struct mnttab *dst)
+{
+	*dst = *src;
+	dst->mnt_special = src->mnt_special == NULL ? NULL :
+	    zfs_strdup(hdl, src->mnt_special);
+	dst->mnt_mountp = src->mnt_mountp == NULL ? NULL :
+	    zfs_strdup(hdl, src->mnt_mountp);
+	dst->mnt_fstype = src->mnt_fstype == NULL ? NULL :
+	    zfs_strdup(hdl, src->mnt_fstype);
+	dst->mnt_mntopts = src->mnt_mntopts == NULL ? NULL :
+	    zfs_strdup(hdl, src->mnt_mntopts);
+}
+
+/*
+ * Look up the mount table entry of 'fsname'.  On success the strings in
+ * 'entry' belong to the caller, who must release them with
+ * libzfs_mnttab_entry_free().
+ */
 int
 libzfs_mnttab_find(libzfs_handle_t *hdl, const char *fsname,
     struct mnttab *entry)
 {
 	mnttab_node_t find;
 	mnttab_node_t *mtn;
+	int ret = ENOENT;
 
+	pthread_mutex_lock(&hdl->libzfs_mnttab_cache_lock);
 	if (!hdl->libzfs_mnttab_enable) {
 		struct mnttab srch = { 0 };
+		struct mnttab found;
 
 		if (avl_numnodes(&hdl->libzfs_mnttab_cache))
 			libzfs_mnttab_fini(hdl);
 		srch.mnt_special = (char *)fsname;
 		//srch.mnt_fstype = MNTTYPE_ZFS;
 		srch.mnt_fstype = NULL; // search for zfs or mimic
-		if (getmntany(hdl->libzfs_mnttab, entry, &srch) == 0)
-			return (0);
-		else
-			return (ENOENT);
+		if (getmntany(hdl->libzfs_mnttab, &found, &srch) == 0) {
+			libzfs_mnttab_copy(hdl, &found, entry);
+			ret = 0;
+		}
+		pthread_mutex_unlock(&hdl->libzfs_mnttab_cache_lock);
+		return (ret);
 	}
 
 	if (avl_numnodes(&hdl->libzfs_mnttab_cache) == 0)
@@ -906,10 +936,21 @@ libzfs_mnttab_find(libzfs_handle_t *hdl, const char *fsname,
 	find.mtn_mt.mnt_special = (char *)fsname;
 	mtn = avl_find(&hdl->libzfs_mnttab_cache, &find, NULL);
 	if (mtn) {
-		*entry = mtn->mtn_mt;
-		return (0);
+		libzfs_mnttab_copy(hdl, &mtn->mtn_mt, entry);
+		ret = 0;
 	}
-	return (ENOENT);
+	pthread_mutex_unlock(&hdl->libzfs_mnttab_cache_lock);
+	return (ret);
+}
+
+void
+libzfs_mnttab_entry_free(struct mnttab *entry)
+{
+	free(entry->mnt_special);
+	free(entry->mnt_mountp);
+	free(entry->mnt_fstype);
+	free(entry->mnt_mntopts);
+	bzero(entry, sizeof (*entry));
 }
 
 
@@ -920,8 +961,11 @@ libzfs_mnttab_add(libzfs_handle_t *hdl, const char *special,
 {
 	mnttab_node_t *mtn;
 
-	if (avl_numnodes(&hdl->libzfs_mnttab_cache) == 0)
+	pthread_mutex_lock(&hdl->libzfs_mnttab_cache_lock);
+	if (avl_numnodes(&hdl->libzfs_mnttab_cache) == 0) {
+		pthread_mutex_unlock(&hdl->libzfs_mnttab_cache_lock);
 		return;
+	}
 	mtn = zfs_alloc(hdl, sizeof (mnttab_node_t));
 	mtn->mtn_mt.mnt_special = zfs_strdup(hdl, special);
 	mtn->mtn_mt.mnt_mountp = zfs_strdup(hdl, mountp);
@@ -929,6 +973,7 @@ libzfs_mnttab_add(libzfs_handle_t *hdl, const char *special,
 	if (mntopts != NULL)
 		mtn->mtn_mt.mnt_mntopts = zfs_strdup(hdl, mntopts);
 	avl_add(&hdl->libzfs_mnttab_cache, mtn);
+	pthread_mutex_unlock(&hdl->libzfs_mnttab_cache_lock);
 }
 
 void
@@ -938,6 +983,7 @@ libzfs_mnttab_remove(libzfs_handle_t *hdl, const char *fsname)
 	mnttab_node_t *ret;
 
 	find.mtn_mt.mnt_special = (char *)fsname;
+	pthread_mutex_lock(&hdl->libzfs_mnttab_cache_lock);
 	if ((ret = avl_find(&hdl->libzfs_mnttab_cache, (void *)&find, NULL))) {
 		avl_remove(&hdl->libzfs_mnttab_cache, ret);
 		free(ret->mtn_mt.mnt_special);
@@ -947,6 +993,7 @@ libzfs_mnttab_remove(libzfs_handle_t *hdl, const char *fsname)
 			free(ret->mtn_mt.mnt_mntopts);
 		free(ret);
 	}
+	pthread_mutex_unlock(&hdl->libzfs_mnttab_cache_lock);
 }
 
 int
@@ -2314,9 +2361,10 @@ get_numeric_property(zfs_handle_t *zhp, zfs_prop_t prop, zprop_source_t *src,
 		struct mnttab entry;
 
 		if (libzfs_mnttab_find(hdl, zhp->zfs_name, &entry) == 0) {
-            if (!entry.mnt_mntopts) return -1;
-			zhp->zfs_mntopts = zfs_strdup(hdl,
-			    entry.mnt_mntopts);
+			/* hand the copied options over to the handle */
+			zhp->zfs_mntopts = entry.mnt_mntopts;
+			entry.mnt_mntopts = NULL;
+			libzfs_mnttab_entry_free(&entry);
 			if (zhp->zfs_mntopts == NULL)
 				return (-1);
 			//printf("Found options: %s\n", zhp->zfs_mntopts);
@@ -2883,14 +2931,18 @@ zfs_prop_get(zfs_handle_t *zhp, zfs_prop_t prop, char *propbuf, size_t proplen,
 	case ZFS_PROP_REFQUOTA:
 	case ZFS_PROP_RESERVATION:
 	case ZFS_PROP_REFRESERVATION:
+	case ZFS_PROP_LIMIT_BW_READ:
+	case ZFS_PROP_LIMIT_BW_WRITE:
+	case ZFS_PROP_LIMIT_OP_READ:
+	case ZFS_PROP_LIMIT_OP_WRITE:
 
 		if (get_numeric_property(zhp, prop, src, &source, &val) != 0)
 			return (-1);
 		/*
-		 * If quota or reservation is 0, we translate this into 'none'
-		 * (unless literal is set), and indicate that it's the default
-		 * value.  Otherwise, we print the number nicely and indicate
-		 * that its set locally.
+		 * If quota, reservation or a rate limit is 0, we translate
+		 * this into 'none' (unless literal is set), and indicate that
+		 * it's the default value.  Otherwise, we print the number
+		 * nicely and indicate that its set locally.
 		 */
 		if (val == 0) {
 			if (literal)
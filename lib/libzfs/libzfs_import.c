@@ -52,6 +52,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <sys/vtoc.h>
 #include <sys/dktp/fdisk.h>
 #include <sys/efi_partition.h>
@@ -945,15 +947,34 @@ zpool_read_label(int fd, nvlist_t **config, int *num_labels)
 	return (0);
 }
 
+typedef enum rdsk_state {
+	RDSK_QUEUED,		/* waiting for a worker */
+	RDSK_READING,		/* being opened and read */
+	RDSK_DONE,		/* finished, rn_config is valid */
+	RDSK_TIMEDOUT		/* given up on, still owned by a worker */
+} rdsk_state_t;
+
+struct label_scan;
+
 typedef struct rdsk_node {
 	char *rn_name;
 	int rn_num_labels;
 	int rn_dfd;
-	libzfs_handle_t *rn_hdl;
+	boolean_t rn_nomem;		/* reading the labels ran out of memory */
 	nvlist_t *rn_config;
 	avl_tree_t *rn_avl;
 	avl_node_t rn_node;
+	avl_node_t rn_order_node;	/* see label_scan_order() */
+	avl_node_t rn_dev_node;		/* in ls_devices */
 	boolean_t rn_nozpool;
+	struct label_scan *rn_scan;
+	rdsk_state_t rn_state;
+	hrtime_t rn_start;
+	dev_t rn_dev;
+	ino_t rn_ino;
+	struct rdsk_node *rn_dup;	/* same device, whose labels we use */
+	const char *rn_dir;		/* search directory, with a '/' */
+	int rn_order;			/* its position in the search path */
 } rdsk_node_t;
 
 static int
@@ -991,6 +1012,75 @@ slice_cache_compare(const void *arg1, const void *arg2)
 	return (rv > 0 ? 1 : -1);
 }
 
+/*
+ * Labels are read by a pool of worker threads, each with at most one device
+ * open and being read at a time, so ZPOOL_IMPORT_THREADS (by default twice
+ * the number of processors) also bounds the number of outstanding reads.
+ * The caller merges the results into the pool list as they come in, in the
+ * same order as a serial scan would, and gives up on a device that has not
+ * answered within ZPOOL_IMPORT_LABEL_TIMEOUT seconds.  A worker stuck on
+ * such a device is left behind; whichever of the caller and the workers is
+ * the last to let go of the scan frees it.
+ */
+#define	ZPOOL_IMPORT_LABEL_TIMEOUT	20
+#define	ZPOOL_IMPORT_THREADS_MAX	256
+
+typedef struct label_scan {
+	pthread_mutex_t	ls_lock;
+	pthread_cond_t	ls_cv;
+	int		ls_refs;	/* the caller and running workers */
+	rdsk_node_t	**ls_slices;	/* every slice, in merge order */
+	int		ls_count;
+	int		ls_next;	/* next slice to hand out */
+	avl_tree_t	ls_devices;	/* slices reading a device */
+	int		ls_workers;	/* workers not stuck on a device */
+	avl_tree_t	*ls_caches;	/* slice cache of each directory */
+	DIR		**ls_dirs;
+	char		**ls_paths;
+	int		ls_ndirs;
+} label_scan_t;
+
+static int
+label_scan_dev_compare(const void *arg1, const void *arg2)
+{
+	const rdsk_node_t *rn1 = arg1;
+	const rdsk_node_t *rn2 = arg2;
+
+	if (rn1->rn_dev != rn2->rn_dev)
+		return (rn1->rn_dev < rn2->rn_dev ? -1 : 1);
+	if (rn1->rn_ino != rn2->rn_ino)
+		return (rn1->rn_ino < rn2->rn_ino ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Called by a worker that is about to read the labels of the device backing
+ * 'rn'.  Returns B_TRUE if another slice has already claimed that device,
+ * in which case its labels will be used for 'rn' as well.
+ */
+static boolean_t
+label_scan_claim(rdsk_node_t *rn, dev_t dev, ino_t ino)
+{
+	label_scan_t *ls = rn->rn_scan;
+	rdsk_node_t *other;
+	avl_index_t where;
+
+	if (ls == NULL)
+		return (B_FALSE);
+
+	rn->rn_dev = dev;
+	rn->rn_ino = ino;
+
+	(void) pthread_mutex_lock(&ls->ls_lock);
+	if ((other = avl_find(&ls->ls_devices, rn, &where)) != NULL)
+		rn->rn_dup = other;
+	else
+		avl_insert(&ls->ls_devices, rn, where);
+	(void) pthread_mutex_unlock(&ls->ls_lock);
+
+	return (other != NULL);
+}
+
 #ifndef __linux__
 static void
 check_one_slice(avl_tree_t *r, char *diskname, uint_t partno,
@@ -1138,13 +1228,6 @@ int is_optical_media(const char *bsdname)
 	IOObjectRelease(start);
 	return ret;
 }
-
-jmp_buf buffer;
-
-void signal_alarm(int foo)
-{
-	longjmp(buffer, 1);
-}
 #endif
 
 static void
@@ -1267,35 +1350,28 @@ zpool_open_func(void *arg)
 		close(fd);
 		return;
 	}
+#endif
 
-	struct sigaction sact;
-	sigemptyset(&sact.sa_mask);
-	sact.sa_flags = 0;
-	sact.sa_handler = signal_alarm;
-	sigaction(SIGALRM, &sact, NULL);
-
-	if (setjmp(buffer) != 0) {
-		printf("ZFS: Warning, timeout reading device '%s'\n", rn->rn_name);
-		close(fd);
+	/*
+	 * The same device is usually found under several names, in one
+	 * directory or across the search path; only read its labels once.
+	 */
+	if (label_scan_claim(rn, statbuf.st_dev, statbuf.st_ino)) {
+		(void) close(fd);
 		return;
 	}
 
-	alarm(20);
-#endif
-
+	/*
+	 * A worker may outlive the scan's caller (see label_scan_wait()), so
+	 * it must not touch the libzfs handle; the caller reports the error
+	 * when it merges this slice.
+	 */
 	if ((zpool_read_label(fd, &config, &num_labels)) != 0) {
-#ifdef __APPLE__
-		alarm(0);
-#endif
 		(void) close(fd);
-		(void) no_memory(rn->rn_hdl);
+		rn->rn_nomem = B_TRUE;
 		return;
 	}
 
-#ifdef __APPLE__
-	alarm(0);
-#endif
-
 	if (num_labels == 0) {
 		(void) close(fd);
 		nvlist_free(config);
@@ -1308,6 +1384,154 @@ zpool_open_func(void *arg)
 	rn->rn_num_labels = num_labels;
 }
 
+static void
+label_scan_free(label_scan_t *ls)
+{
+	rdsk_node_t *slice;
+	void *cookie;
+	int i;
+
+	cookie = NULL;
+	while (avl_destroy_nodes(&ls->ls_devices, &cookie) != NULL)
+		;
+	avl_destroy(&ls->ls_devices);
+
+	for (i = 0; i < ls->ls_ndirs; i++) {
+		cookie = NULL;
+		while ((slice = avl_destroy_nodes(&ls->ls_caches[i],
+		    &cookie)) != NULL) {
+			nvlist_free(slice->rn_config);
+			free(slice->rn_name);
+			free(slice);
+		}
+		avl_destroy(&ls->ls_caches[i]);
+		(void) closedir(ls->ls_dirs[i]);
+		free(ls->ls_paths[i]);
+	}
+
+	(void) pthread_cond_destroy(&ls->ls_cv);
+	(void) pthread_mutex_destroy(&ls->ls_lock);
+	free(ls->ls_paths);
+	free(ls->ls_dirs);
+	free(ls->ls_caches);
+	free(ls->ls_slices);
+	free(ls);
+}
+
+/*
+ * Drop a reference to the scan, freeing it if it was the last one.  Called
+ * with ls_lock held, which is dropped.
+ */
+static void
+label_scan_rele(label_scan_t *ls)
+{
+	boolean_t last = (--ls->ls_refs == 0);
+
+	(void) pthread_mutex_unlock(&ls->ls_lock);
+	if (last)
+		label_scan_free(ls);
+}
+
+/* Called with ls_lock held, which is dropped while the slice is read. */
+static void
+label_scan_one(label_scan_t *ls, rdsk_node_t *rn)
+{
+	rn->rn_state = RDSK_READING;
+	rn->rn_start = gethrtime();
+	(void) pthread_mutex_unlock(&ls->ls_lock);
+
+	zpool_open_func(rn);
+
+	(void) pthread_mutex_lock(&ls->ls_lock);
+	if (rn->rn_state == RDSK_READING)
+		rn->rn_state = RDSK_DONE;
+	(void) pthread_cond_broadcast(&ls->ls_cv);
+}
+
+static void *
+label_scan_worker(void *arg)
+{
+	label_scan_t *ls = arg;
+	rdsk_node_t *rn;
+
+	(void) pthread_mutex_lock(&ls->ls_lock);
+	while (ls->ls_next < ls->ls_count) {
+		rn = ls->ls_slices[ls->ls_next++];
+		if (rn->rn_state == RDSK_QUEUED)
+			label_scan_one(ls, rn);
+	}
+	label_scan_rele(ls);
+
+	return (NULL);
+}
+
+/* Called with ls_lock held. */
+static void
+label_scan_add_worker(label_scan_t *ls)
+{
+	pthread_t tid;
+
+	ls->ls_refs++;
+	if (pthread_create(&tid, NULL, label_scan_worker, ls) != 0) {
+		ls->ls_refs--;
+		return;
+	}
+	(void) pthread_detach(tid);
+	ls->ls_workers++;
+}
+
+/*
+ * Wait for the labels of 'rn' to have been read.  Returns B_FALSE if its
+ * device did not answer in time, in which case the worker reading it is
+ * replaced by a new one.  Called with ls_lock held.
+ */
+static boolean_t
+label_scan_wait(label_scan_t *ls, rdsk_node_t *rn)
+{
+	hrtime_t deadline, now;
+	struct timeval tv;
+	struct timespec ts;
+
+	for (;;) {
+		switch (rn->rn_state) {
+		case RDSK_DONE:
+			return (B_TRUE);
+		case RDSK_TIMEDOUT:
+			return (B_FALSE);
+		case RDSK_QUEUED:
+			/* With no worker left to read it, read it here. */
+			if (ls->ls_workers == 0)
+				label_scan_one(ls, rn);
+			else
+				(void) pthread_cond_wait(&ls->ls_cv,
+				    &ls->ls_lock);
+			continue;
+		case RDSK_READING:
+			break;
+		}
+
+		deadline = rn->rn_start + SEC2NSEC(ZPOOL_IMPORT_LABEL_TIMEOUT);
+		now = gethrtime();
+		if (now >= deadline) {
+			(void) fprintf(stderr, gettext("ZFS: Warning, timeout "
+			    "reading device '%s'\n"), rn->rn_name);
+			rn->rn_state = RDSK_TIMEDOUT;
+			ls->ls_workers--;
+			label_scan_add_worker(ls);
+			return (B_FALSE);
+		}
+
+		(void) gettimeofday(&tv, NULL);
+		ts.tv_sec = tv.tv_sec + (deadline - now) / NANOSEC;
+		ts.tv_nsec = tv.tv_usec * 1000 + (deadline - now) % NANOSEC;
+		if (ts.tv_nsec >= NANOSEC) {
+			ts.tv_sec++;
+			ts.tv_nsec -= NANOSEC;
+		}
+		(void) pthread_cond_timedwait(&ls->ls_cv, &ls->ls_lock, &ts);
+	}
+}
+
 /*
  * Given a file descriptor, clear (zero) the label information.
  */
@@ -1448,16 +1672,20 @@ zpool_find_import_impl(libzfs_handle_t *hdl, importargs_t *iarg)
 	struct dirent *dp;
 	char path[MAXPATHLEN];
 	char *end, **dir = iarg->path;
-	size_t pathleft;
 	nvlist_t *ret = NULL;
 	pool_list_t pools = { 0 };
 	pool_entry_t *pe, *penext;
 	vdev_entry_t *ve, *venext;
 	config_entry_t *ce, *cenext;
 	name_entry_t *ne, *nenext;
-	avl_tree_t slice_cache;
-	rdsk_node_t *slice;
+	label_scan_t *ls = NULL;
+	avl_tree_t order;
+	rdsk_node_t *slice, *src;
+	boolean_t config_failed = B_FALSE;
+	boolean_t found;
+	int nthreads;
 	void *cookie;
+	char *env;
 
 	verify(iarg->poolname == NULL || iarg->guid == 0);
 
@@ -1476,16 +1704,26 @@ zpool_find_import_impl(libzfs_handle_t *hdl, importargs_t *iarg)
 		dirs = DEFAULT_IMPORT_PATH_SIZE;
 	}
 
+	ls = zfs_alloc(hdl, sizeof (label_scan_t));
+	(void) pthread_mutex_init(&ls->ls_lock, NULL);
+	(void) pthread_cond_init(&ls->ls_cv, NULL);
+	ls->ls_refs = 1;
+	avl_create(&ls->ls_devices, label_scan_dev_compare,
+	    sizeof (rdsk_node_t), offsetof(rdsk_node_t, rn_dev_node));
+	ls->ls_caches = zfs_alloc(hdl, dirs * sizeof (avl_tree_t));
+	ls->ls_dirs = zfs_alloc(hdl, dirs * sizeof (DIR *));
+	ls->ls_paths = zfs_alloc(hdl, dirs * sizeof (char *));
+
 	/*
-	 * Go through and read the label configuration information from every
-	 * possible device, organizing the information according to pool GUID
-	 * and toplevel GUID.
+	 * Go through and gather every possible device in the search path.
+	 * Their labels are read by the workers below, and the results merged
+	 * here, organizing the information according to pool GUID and
+	 * toplevel GUID.
 	 */
 	for (i = 0; i < dirs; i++) {
-		taskq_t *t;
+		avl_tree_t *slice_cache;
 		char rdsk[MAXPATHLEN];
 		int dfd;
-		boolean_t config_failed = B_FALSE;
 		DIR *dirp;
 
 		/* use realpath to normalize the path */
@@ -1503,7 +1741,6 @@ zpool_find_import_impl(libzfs_handle_t *hdl, importargs_t *iarg)
 		end = &path[strlen(path)];
 		*end++ = '/';
 		*end = 0;
-		pathleft = &path[sizeof (path)] - end;
 
 		/*
 		 * Using raw devices instead of block devices when we're
@@ -1526,8 +1763,21 @@ zpool_find_import_impl(libzfs_handle_t *hdl, importargs_t *iarg)
 			goto error;
 		}
 
-		avl_create(&slice_cache, slice_cache_compare,
+		slice_cache = &ls->ls_caches[ls->ls_ndirs];
+		avl_create(slice_cache, slice_cache_compare,
 		    sizeof (rdsk_node_t), offsetof(rdsk_node_t, rn_node));
+		ls->ls_dirs[ls->ls_ndirs] = dirp;
+		ls->ls_paths[ls->ls_ndirs] = zfs_strdup(hdl, path);
+
+		/*
+		 * The slices used to be merged in the order in which they
+		 * came off the slice cache as it was torn down, and the order
+		 * in which configurations are added decides the order in
+		 * which pools are listed.  Replay that order on a second tree
+		 * built by the same insertions, and so of the same shape.
+		 */
+		avl_create(&order, slice_cache_compare,
+		    sizeof (rdsk_node_t), offsetof(rdsk_node_t, rn_order_node));
 
 		/*
 		 * This is not MT-safe, but we have no MT consumers of libzfs
@@ -1540,83 +1790,118 @@ zpool_find_import_impl(libzfs_handle_t *hdl, importargs_t *iarg)
 
 			slice = zfs_alloc(hdl, sizeof (rdsk_node_t));
 			slice->rn_name = zfs_strdup(hdl, name);
-			slice->rn_avl = &slice_cache;
+			slice->rn_avl = slice_cache;
 			slice->rn_dfd = dfd;
-			slice->rn_hdl = hdl;
+			slice->rn_nomem = B_FALSE;
 			slice->rn_nozpool = B_FALSE;
-			avl_add(&slice_cache, slice);
+			slice->rn_scan = ls;
+			slice->rn_state = RDSK_QUEUED;
+			slice->rn_dir = ls->ls_paths[ls->ls_ndirs];
+			slice->rn_order = i + 1;
+			avl_add(slice_cache, slice);
+			avl_add(&order, slice);
 		}
+		ls->ls_ndirs++;
 
-		/*
-		 * create a thread pool to do all of this in parallel;
-		 * rn_nozpool is not protected, so this is racy in that
-		 * multiple tasks could decide that the same slice can
-		 * not hold a zpool, which is benign.  Also choose
-		 * double the number of processors; we hold a lot of
-		 * locks in the kernel, so going beyond this doesn't
-		 * buy us much.
-		 */
-		t = taskq_create("z_import", 2 * max_ncpus, defclsyspri,
-		    2 * max_ncpus, INT_MAX, TASKQ_PREPOPULATE);
-		for (slice = avl_first(&slice_cache); slice;
-		    (slice = avl_walk(&slice_cache, slice,
-		    AVL_AFTER)))
-			(void) taskq_dispatch(t, zpool_open_func, slice,
-			    TQ_SLEEP);
-		taskq_wait(t);
-		taskq_destroy(t);
-
+		if (avl_numnodes(&order) != 0) {
+			ls->ls_slices = zfs_realloc(hdl, ls->ls_slices,
+			    ls->ls_count * sizeof (rdsk_node_t *),
+			    (ls->ls_count + avl_numnodes(&order)) *
+			    sizeof (rdsk_node_t *));
+		}
 		cookie = NULL;
-		while ((slice = avl_destroy_nodes(&slice_cache,
-		    &cookie)) != NULL) {
-			if (slice->rn_config != NULL && !config_failed) {
-				nvlist_t *config = slice->rn_config;
-				boolean_t matched = B_TRUE;
-
-				if (iarg->poolname != NULL) {
-					char *pname;
-
-					matched = nvlist_lookup_string(config,
-					    ZPOOL_CONFIG_POOL_NAME,
-					    &pname) == 0 &&
-					    strcmp(iarg->poolname, pname) == 0;
-				} else if (iarg->guid != 0) {
-					uint64_t this_guid;
-
-					matched = nvlist_lookup_uint64(config,
-					    ZPOOL_CONFIG_POOL_GUID,
-					    &this_guid) == 0 &&
-					    iarg->guid == this_guid;
-				}
-				if (matched) {
-					/*
-					 * use the non-raw path for the config
-					 */
-					(void) strlcpy(end, slice->rn_name,
-					    pathleft);
-					if (add_config(hdl, &pools, path, i+1,
-					    slice->rn_num_labels, config) != 0)
-						config_failed = B_TRUE;
-				}
-				nvlist_free(config);
-			}
-			free(slice->rn_name);
-			free(slice);
+		while ((slice = avl_destroy_nodes(&order, &cookie)) != NULL)
+			ls->ls_slices[ls->ls_count++] = slice;
+		avl_destroy(&order);
+	}
+
+	/*
+	 * Read the labels in parallel.  rn_nozpool is not protected, so this
+	 * is racy in that multiple workers could decide that the same slice
+	 * can not hold a zpool, which is benign.  By default use double the
+	 * number of processors; we hold a lot of locks in the kernel, so
+	 * going beyond this doesn't buy us much.
+	 */
+	nthreads = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	if ((env = getenv("ZPOOL_IMPORT_THREADS")) != NULL)
+		nthreads = atoi(env);
+	nthreads = MAX(1, MIN(MIN(nthreads, ZPOOL_IMPORT_THREADS_MAX),
+	    ls->ls_count));
+
+	(void) pthread_mutex_lock(&ls->ls_lock);
+	for (i = 0; i < nthreads; i++)
+		label_scan_add_worker(ls);
+
+	/*
+	 * Merge each slice as soon as it, and every slice before it, has
+	 * been read.
+	 */
+	for (i = 0; i < ls->ls_count && !config_failed; i++) {
+		nvlist_t *config;
+		boolean_t matched = B_TRUE;
+
+		slice = ls->ls_slices[i];
+		found = label_scan_wait(ls, slice);
+		src = slice;
+		if (found && slice->rn_dup != NULL) {
+			src = slice->rn_dup;
+			found = label_scan_wait(ls, src);
+		}
+		if (found && src->rn_nomem) {
+			(void) no_memory(hdl);
+			src->rn_nomem = B_FALSE;
 		}
-		avl_destroy(&slice_cache);
+		if (!found || src->rn_config == NULL)
+			continue;
+		config = src->rn_config;
+		(void) pthread_mutex_unlock(&ls->ls_lock);
 
-		(void) closedir(dirp);
+		if (iarg->poolname != NULL) {
+			char *pname;
 
-		if (config_failed)
-			goto error;
+			matched = nvlist_lookup_string(config,
+			    ZPOOL_CONFIG_POOL_NAME, &pname) == 0 &&
+			    strcmp(iarg->poolname, pname) == 0;
+		} else if (iarg->guid != 0) {
+			uint64_t this_guid;
+
+			matched = nvlist_lookup_uint64(config,
+			    ZPOOL_CONFIG_POOL_GUID, &this_guid) == 0 &&
+			    iarg->guid == this_guid;
+		}
+		if (matched) {
+			/*
+			 * use the non-raw path for the config
+			 */
+			(void) snprintf(path, sizeof (path), "%s%s",
+			    slice->rn_dir, slice->rn_name);
+			if (add_config(hdl, &pools, path, slice->rn_order,
+			    src->rn_num_labels, config) != 0)
+				config_failed = B_TRUE;
+		}
+
+		(void) pthread_mutex_lock(&ls->ls_lock);
 	}
 
+	/* Stop handing out slices and let go of the scan. */
+	ls->ls_next = ls->ls_count;
+	label_scan_rele(ls);
+	ls = NULL;
+
+	if (config_failed)
+		goto error;
+
 #ifdef HAVE_LIBBLKID
 skip_scanning:
 #endif
 	ret = get_configs(hdl, &pools, iarg->can_be_active, iarg->policy);
 
 error:
+	if (ls != NULL) {
+		(void) pthread_mutex_lock(&ls->ls_lock);
+		label_scan_rele(ls);
+	}
+
 	for (pe = pools.pools; pe != NULL; pe = penext) {
 		penext = pe->pe_next;
 		for (ve = pe->pe_vdevs; ve != NULL; ve = venext) {
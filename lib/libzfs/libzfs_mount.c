@@ -66,6 +66,7 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <libintl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
@@ -372,6 +373,7 @@ is_mounted(libzfs_handle_t *zfs_hdl, const char *special, char **where)
 
 	if (where != NULL)
 		*where = zfs_strdup(zfs_hdl, entry.mnt_mountp);
+	libzfs_mnttab_entry_free(&entry);
 
 	return (B_TRUE);
 }
@@ -992,9 +994,9 @@ zfs_unmount(zfs_handle_t *zhp, const char *mountpoint, int flags)
 {
 	libzfs_handle_t *hdl = zhp->zfs_hdl;
 #ifdef __LINUX__
-	struct mnttab search = { 0 }, entry;
+	struct mnttab search = { 0 }, entry = { 0 };
 #else
-	struct mnttab entry;
+	struct mnttab entry = { 0 };
 #endif /* __LINUX__ */
 	char *mntpt = NULL;
 
@@ -1006,14 +1008,14 @@ zfs_unmount(zfs_handle_t *zhp, const char *mountpoint, int flags)
 
 		/*
 		 * mountpoint may have come from a call to
-		 * getmnt/getmntany if it isn't NULL. If it is NULL,
-		 * we know it comes from getmntany which can then get
+		 * getmnt/getmntany if it isn't NULL, which can then get
 		 * overwritten later. We strdup it to play it safe.
 		 */
 		if (mountpoint == NULL)
 			mntpt = zfs_strdup(zhp->zfs_hdl, entry.mnt_mountp);
 		else
 			mntpt = zfs_strdup(zhp->zfs_hdl, mountpoint);
+		libzfs_mnttab_entry_free(&entry);
 
 		/*
 		 * Unshare and unmount the filesystem
@@ -1385,8 +1387,10 @@ zfs_unshare_proto(zfs_handle_t *zhp, const char *mountpoint,
 	    libzfs_mnttab_find(hdl, zfs_get_name(zhp), &entry) == 0)) {
 		zfs_share_proto_t *curr_proto;
 
-		if (mountpoint == NULL)
+		if (mountpoint == NULL) {
 			mntpt = zfs_strdup(zhp->zfs_hdl, entry.mnt_mountp);
+			libzfs_mnttab_entry_free(&entry);
+		}
 
 		for (curr_proto = proto; *curr_proto != PROTO_END;
 		    curr_proto++) {
@@ -1589,20 +1593,308 @@ libzfs_dataset_cmp(const void *a, const void *b)
 	return (strcmp(zfs_get_name(a), zfs_get_name(b)));
 }
 
+/*
+ * Mount or unmount a set of mountpoints with a pool of worker threads.
+ *
+ * The mountpoints form a forest: the parent of a mountpoint is the closest
+ * other mountpoint that is a path prefix of it.  When mounting, a
+ * mountpoint is handed to the workers only once its parent has been
+ * mounted; when unmounting, only once all of its children have been
+ * unmounted.  Siblings, and anything else that does not depend on each
+ * other, are processed concurrently.
+ *
+ * The number of workers is MOUNT_THREADS_DEFAULT unless ZFS_MOUNT_THREADS
+ * is set in the environment; ZFS_MOUNT_THREADS=1 processes the mountpoints
+ * one at a time in the calling thread.
+ */
+#define	MOUNT_THREADS_DEFAULT	64
+#define	MOUNT_THREADS_MAX	512
+
+typedef int (*mount_func_t)(int, void *);
+
+typedef struct mount_sched {
+	pthread_mutex_t	ms_lock;
+	pthread_cond_t	ms_cv;
+	boolean_t	ms_reverse;	/* children before parents */
+	boolean_t	ms_abort;	/* stop at the first error */
+	int		*ms_parent;	/* closest ancestor, or -1 */
+	int		*ms_child;	/* first child, or -1 */
+	int		*ms_sibling;	/* next sibling, or -1 */
+	int		*ms_pending;	/* children not unmounted yet */
+	int		*ms_queue;	/* ready to be processed */
+	int		ms_head;
+	int		ms_tail;
+	int		ms_active;	/* being processed */
+	int		ms_error;
+	mount_func_t	ms_func;
+	void		*ms_arg;
+} mount_sched_t;
+
+typedef struct mount_sched_ent {
+	const char	*mse_path;
+	int		mse_idx;
+} mount_sched_ent_t;
+
+/*
+ * Compare two mountpoints like strcmp(), except that '/' sorts before any
+ * other character, so that every mountpoint is directly followed by all
+ * of its descendants.
+ */
+static int
+mount_sched_cmp(const void *a, const void *b)
+{
+	const char *pa = ((const mount_sched_ent_t *)a)->mse_path;
+	const char *pb = ((const mount_sched_ent_t *)b)->mse_path;
+
+	for (; *pa != '\0' && *pa == *pb; pa++, pb++)
+		;
+
+	if (*pa == *pb)
+		return (0);
+	if (*pa == '\0')
+		return (-1);
+	if (*pb == '\0')
+		return (1);
+	if (*pa == '/')
+		return (-1);
+	if (*pb == '/')
+		return (1);
+	return ((unsigned char)*pa < (unsigned char)*pb ? -1 : 1);
+}
+
+/*
+ * Does 'path' have to wait for 'parent' to be mounted first?  Mountpoints
+ * such as "none" or "legacy" are never anyone's parent.
+ */
+static boolean_t
+mount_sched_below(const char *parent, const char *path)
+{
+	size_t len = strlen(parent);
+
+	if (parent[0] != '/' || strncmp(parent, path, len) != 0)
+		return (B_FALSE);
+
+	return (path[len] == '/' || path[len] == '\0' ||
+	    parent[len - 1] == '/');
+}
+
+/*
+ * Called with ms_lock held once 'idx' has been processed, to queue
+ * whatever was waiting for it.
+ */
+static void
+mount_sched_done(mount_sched_t *ms, int idx)
+{
+	int c, p;
+
+	if (!ms->ms_reverse) {
+		for (c = ms->ms_child[idx]; c != -1; c = ms->ms_sibling[c])
+			ms->ms_queue[ms->ms_tail++] = c;
+	} else if ((p = ms->ms_parent[idx]) != -1) {
+		if (--ms->ms_pending[p] == 0)
+			ms->ms_queue[ms->ms_tail++] = p;
+	}
+}
+
+static void *
+mount_sched_worker(void *arg)
+{
+	mount_sched_t *ms = arg;
+	int idx, err;
+
+	(void) pthread_mutex_lock(&ms->ms_lock);
+	for (;;) {
+		while (ms->ms_head == ms->ms_tail && ms->ms_active > 0)
+			(void) pthread_cond_wait(&ms->ms_cv, &ms->ms_lock);
+		if (ms->ms_head == ms->ms_tail)
+			break;
+
+		idx = ms->ms_queue[ms->ms_head++];
+		ms->ms_active++;
+		(void) pthread_mutex_unlock(&ms->ms_lock);
+
+		err = ms->ms_func(idx, ms->ms_arg);
+
+		(void) pthread_mutex_lock(&ms->ms_lock);
+		ms->ms_active--;
+		if (err != 0) {
+			ms->ms_error = -1;
+			/* Drop everything that has not been started yet. */
+			if (ms->ms_abort)
+				ms->ms_head = ms->ms_tail;
+		}
+		if (ms->ms_error == 0 || !ms->ms_abort)
+			mount_sched_done(ms, idx);
+		(void) pthread_cond_broadcast(&ms->ms_cv);
+	}
+	(void) pthread_mutex_unlock(&ms->ms_lock);
+
+	return (NULL);
+}
+
+/*
+ * Call 'func' on the index of every one of the 'count' mountpoints in
+ * 'paths', parents before children, or children before parents if
+ * 'reverse' is set.  If 'abort' is set, nothing new is started once a call
+ * has failed.  Returns -1 if any call failed or memory ran out, 0
+ * otherwise.
+ */
+static int
+zfs_foreach_mountpoint(libzfs_handle_t *hdl, const char **paths, int count,
+    boolean_t reverse, boolean_t abort, mount_func_t func, void *arg)
+{
+	mount_sched_t ms = { 0 };
+	mount_sched_ent_t *ents = NULL;
+	pthread_t *tids = NULL;
+	int *stack = NULL;
+	int i, idx, depth, nthreads, started;
+	int ret = -1;
+	char *env;
+
+	if (count == 0)
+		return (0);
+
+	nthreads = MOUNT_THREADS_DEFAULT;
+	if ((env = getenv("ZFS_MOUNT_THREADS")) != NULL)
+		nthreads = atoi(env);
+	nthreads = MAX(1, MIN(MIN(nthreads, MOUNT_THREADS_MAX), count));
+
+	if ((ents = zfs_alloc(hdl, count * sizeof (*ents))) == NULL ||
+	    (stack = zfs_alloc(hdl, count * sizeof (int))) == NULL ||
+	    (ms.ms_parent = zfs_alloc(hdl, count * sizeof (int))) == NULL ||
+	    (ms.ms_child = zfs_alloc(hdl, count * sizeof (int))) == NULL ||
+	    (ms.ms_sibling = zfs_alloc(hdl, count * sizeof (int))) == NULL ||
+	    (ms.ms_pending = zfs_alloc(hdl, count * sizeof (int))) == NULL ||
+	    (ms.ms_queue = zfs_alloc(hdl, count * sizeof (int))) == NULL ||
+	    (tids = zfs_alloc(hdl, nthreads * sizeof (pthread_t))) == NULL)
+		goto out;
+
+	ms.ms_reverse = reverse;
+	ms.ms_abort = abort;
+	ms.ms_func = func;
+	ms.ms_arg = arg;
+
+	for (i = 0; i < count; i++) {
+		ents[i].mse_path = paths[i];
+		ents[i].mse_idx = i;
+	}
+	qsort(ents, count, sizeof (mount_sched_ent_t), mount_sched_cmp);
+
+	/*
+	 * Walk the sorted mountpoints keeping the chain of ancestors of the
+	 * current one on a stack; its parent is the top of the stack once
+	 * everything it is not below has been popped off.
+	 */
+	depth = 0;
+	for (i = 0; i < count; i++) {
+		while (depth > 0 && !mount_sched_below(
+		    ents[stack[depth - 1]].mse_path, ents[i].mse_path))
+			depth--;
+		idx = ents[i].mse_idx;
+		ms.ms_parent[idx] = (depth > 0) ?
+		    ents[stack[depth - 1]].mse_idx : -1;
+		ms.ms_child[idx] = -1;
+		ms.ms_sibling[idx] = -1;
+		ms.ms_pending[idx] = 0;
+		stack[depth++] = i;
+	}
+
+	/* Link the children in sorted order and queue the first batch. */
+	for (i = count - 1; i >= 0; i--) {
+		int p;
+
+		idx = ents[i].mse_idx;
+		if ((p = ms.ms_parent[idx]) != -1) {
+			ms.ms_sibling[idx] = ms.ms_child[p];
+			ms.ms_child[p] = idx;
+			ms.ms_pending[p]++;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		idx = ents[reverse ? count - 1 - i : i].mse_idx;
+		if (reverse ? ms.ms_pending[idx] == 0 :
+		    ms.ms_parent[idx] == -1)
+			ms.ms_queue[ms.ms_tail++] = idx;
+	}
+
+	(void) pthread_mutex_init(&ms.ms_lock, NULL);
+	(void) pthread_cond_init(&ms.ms_cv, NULL);
+
+	/*
+	 * The calling thread is one of the workers.  If some of the others
+	 * cannot be created, make do with fewer.
+	 */
+	for (started = 0; started < nthreads - 1; started++) {
+		if (pthread_create(&tids[started], NULL, mount_sched_worker,
+		    &ms) != 0)
+			break;
+	}
+	(void) mount_sched_worker(&ms);
+	for (i = 0; i < started; i++)
+		(void) pthread_join(tids[i], NULL);
+
+	(void) pthread_cond_destroy(&ms.ms_cv);
+	(void) pthread_mutex_destroy(&ms.ms_lock);
+	ret = ms.ms_error;
+
+out:
+	free(tids);
+	free(ms.ms_queue);
+	free(ms.ms_pending);
+	free(ms.ms_sibling);
+	free(ms.ms_child);
+	free(ms.ms_parent);
+	free(stack);
+	free(ents);
+
+	return (ret);
+}
+
 /*
  * Mount and share all datasets within the given pool.  This assumes that no
  * datasets within the pool are currently mounted.  Because users can create
  * complicated nested hierarchies of mountpoints, we first gather all the
  * datasets and mountpoints within the pool, and sort them by mountpoint.  Once
- * we have the list of all filesystems, we iterate over them in order and mount
- * and/or share each one.
+ * we have the list of all filesystems, we mount them in parallel, each one
+ * after the filesystem it is mounted below, and then share them in order.
  */
+typedef struct mount_state {
+	zfs_handle_t	**mnt_handles;
+	const char	*mnt_opts;
+	int		mnt_flags;
+	int		*mnt_good;
+} mount_state_t;
+
+static int
+zfs_mount_one(int idx, void *arg)
+{
+	mount_state_t *mnt = arg;
+	zfs_handle_t *zhp = mnt->mnt_handles[idx];
+
+	/*
+	 * don't attempt to mount encrypted datasets with
+	 * unloaded keys
+	 */
+	if (zfs_prop_get_int(zhp, ZFS_PROP_KEYSTATUS) ==
+	    ZFS_KEYSTATUS_UNAVAILABLE)
+		return (0);
+
+	if (zfs_mount(zhp, mnt->mnt_opts, mnt->mnt_flags) != 0)
+		return (-1);
+
+	mnt->mnt_good[idx] = 1;
+	return (0);
+}
+
 int
 zpool_enable_datasets(zpool_handle_t *zhp, const char *mntopts, int flags)
 {
 	get_all_cb_t cb = { 0 };
 	libzfs_handle_t *hdl = zhp->zpool_hdl;
 	zfs_handle_t *zfsp;
+	mount_state_t mnt;
+	char mountpoint[MAXPATHLEN];
+	char **mountpoints;
 	int i, ret = -1;
 	int *good;
 	/*
@@ -1628,22 +1920,33 @@ zpool_enable_datasets(zpool_handle_t *zhp, const char *mntopts, int flags)
 	    cb.cb_used * sizeof (int))) == NULL)
 		goto out;
 
-	ret = 0;
+	if ((mountpoints = zfs_alloc(hdl,
+	    cb.cb_used * sizeof (char *))) == NULL) {
+		free(good);
+		goto out;
+	}
 	for (i = 0; i < cb.cb_used; i++) {
-		/*
-		 * don't attempt to mount encrypted datasets with
-		 * unloaded keys
-		 */
-		if (zfs_prop_get_int(cb.cb_handles[i], ZFS_PROP_KEYSTATUS) ==
-		    ZFS_KEYSTATUS_UNAVAILABLE)
-			continue;
+		if (zfs_prop_get(cb.cb_handles[i], ZFS_PROP_MOUNTPOINT,
+		    mountpoint, sizeof (mountpoint), NULL, NULL, 0,
+		    B_FALSE) != 0)
+			mountpoint[0] = '\0';
+		if ((mountpoints[i] = zfs_strdup(hdl, mountpoint)) == NULL)
+			break;
+	}
 
-		if (zfs_mount(cb.cb_handles[i], mntopts, flags) != 0)
-			ret = -1;
-		else
-			good[i] = 1;
+	if (i == cb.cb_used) {
+		mnt.mnt_handles = cb.cb_handles;
+		mnt.mnt_opts = mntopts;
+		mnt.mnt_flags = flags;
+		mnt.mnt_good = good;
+		ret = zfs_foreach_mountpoint(hdl, (const char **)mountpoints,
+		    cb.cb_used, B_FALSE, B_FALSE, zfs_mount_one, &mnt);
 	}
 
+	for (i = 0; i < cb.cb_used; i++)
+		free(mountpoints[i]);
+	free(mountpoints);
+
 	/*
 	 * Then share all the ones that need to be shared. This needs
 	 * to be a separate pass in order to avoid excessive reloading
@@ -1665,13 +1968,19 @@ out:
 	return (ret);
 }
 
+typedef struct unmount_state {
+	libzfs_handle_t	*umnt_hdl;
+	char		**umnt_mountpoints;
+	int		umnt_flags;
+} unmount_state_t;
+
 static int
-mountpoint_compare(const void *a, const void *b)
+zfs_unmount_one(int idx, void *arg)
 {
-	const char *mounta = *((char **)a);
-	const char *mountb = *((char **)b);
+	unmount_state_t *umnt = arg;
 
-	return (strcmp(mountb, mounta));
+	return (unmount_one(umnt->umnt_hdl, umnt->umnt_mountpoints[idx],
+	    umnt->umnt_flags));
 }
 
 
@@ -1732,6 +2041,7 @@ zpool_disable_datasets(zpool_handle_t *zhp, boolean_t force)
 	char **mountpoints = NULL;
 	zfs_handle_t **datasets = NULL;
 	libzfs_handle_t *hdl = zhp->zpool_hdl;
+	unmount_state_t umnt;
 	int i;
 	int ret = -1;
 	int flags = (force ? MS_FORCE : 0);
@@ -1810,12 +2120,6 @@ zpool_disable_datasets(zpool_handle_t *zhp, boolean_t force)
 		used++;
 	}
 
-	/*
-	 * At this point, we have the entire list of filesystems, so sort it by
-	 * mountpoint.
-	 */
-	qsort(mountpoints, used, sizeof (char *), mountpoint_compare);
-
 	/*
 	 * Walk through and first unshare everything.
 	 */
@@ -1848,13 +2152,15 @@ zpool_disable_datasets(zpool_handle_t *zhp, boolean_t force)
 	}
 
 	/*
-	 * Now unmount everything, removing the underlying directories as
-	 * appropriate.
+	 * Now unmount everything, children before their parents, removing the
+	 * underlying directories as appropriate.
 	 */
-	for (i = 0; i < used; i++) {
-		if (unmount_one(hdl, mountpoints[i], flags) != 0)
-			goto out;
-	}
+	umnt.umnt_hdl = hdl;
+	umnt.umnt_mountpoints = mountpoints;
+	umnt.umnt_flags = flags;
+	if (zfs_foreach_mountpoint(hdl, (const char **)mountpoints, used,
+	    B_TRUE, B_TRUE, zfs_unmount_one, &umnt) != 0)
+		goto out;
 
 	for (i = 0; i < used; i++) {
 		if (datasets[i])
@@ -317,6 +317,9 @@ zpool_get_prop(zpool_handle_t *zhp, zpool_prop_t prop, char *buf,
 		case ZPOOL_PROP_FREEING:
 		case ZPOOL_PROP_LEAKED:
 		case ZPOOL_PROP_ASHIFT:
+		case ZPOOL_PROP_BCLONEUSED:
+		case ZPOOL_PROP_BCLONESAVED:
+		case ZPOOL_PROP_DEDUP_TABLE_SIZE:
 			if (literal)
 				(void) snprintf(buf, len, "%llu",
 					(u_longlong_t)intval);
@@ -336,6 +339,17 @@ zpool_get_prop(zpool_handle_t *zhp, zpool_prop_t prop, char *buf,
 			}
 			break;
 
+		case ZPOOL_PROP_DEDUP_TABLE_QUOTA:
+			if (intval == 0) {
+				(void) strlcpy(buf, "none", len);
+			} else if (literal) {
+				(void) snprintf(buf, len, "%llu",
+				    (u_longlong_t)intval);
+			} else {
+				(void) zfs_nicenum(intval, buf, len);
+			}
+			break;
+
 		case ZPOOL_PROP_CAPACITY:
 			if (literal) {
 				(void) snprintf(buf, len, "%llu",
@@ -356,6 +370,7 @@ zpool_get_prop(zpool_handle_t *zhp, zpool_prop_t prop, char *buf,
 			break;
 
 		case ZPOOL_PROP_DEDUPRATIO:
+		case ZPOOL_PROP_BCLONERATIO:
 			(void) snprintf(buf, len, "%llu.%02llux",
 			    (u_longlong_t)(intval / 100),
 			    (u_longlong_t)(intval % 100));
@@ -738,6 +753,15 @@ zpool_valid_proplist(libzfs_handle_t *hdl, const char *poolname,
 			printf("Note: property '%s' no longer has "
 			    "any effect\n", propname);
 			break;
+		case ZPOOL_PROP_DEDUP_TABLE_QUOTA:
+			if (version < SPA_VERSION_DEDUP) {
+				zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+				    "pool must be upgraded to support "
+				    "'%s' property"), propname);
+				(void) zfs_error(hdl, EZFS_BADVERSION, errbuf);
+				goto error;
+			}
+			break;
 
 		default:
 			zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
@@ -1481,6 +1505,29 @@ zpool_discard_checkpoint(zpool_handle_t *zhp)
 	return (0);
 }
 
+/*
+ * Drop unique entries from the pool's dedup tables, by age in seconds or by
+ * percentage (see lzc_ddt_prune()).
+ */
+int
+zpool_ddt_prune(zpool_handle_t *zhp, pool_ddt_prune_unit_t unit,
+    uint64_t amount)
+{
+	libzfs_handle_t *hdl = zhp->zpool_hdl;
+	char msg[1024];
+	int error;
+
+	error = lzc_ddt_prune(zhp->zpool_name, unit, amount);
+	if (error != 0) {
+		(void) snprintf(msg, sizeof (msg), dgettext(TEXT_DOMAIN,
+		    "cannot prune dedup table on '%s'"), zhp->zpool_name);
+		(void) zpool_standard_error(hdl, error, msg);
+		return (-1);
+	}
+
+	return (0);
+}
+
 /*
  * Add the given vdevs to the pool.  The caller must have already performed the
  * necessary verification to ensure that the vdev specification is well-formed.
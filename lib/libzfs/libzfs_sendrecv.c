@@ -50,7 +50,6 @@
 #include <sys/stat.h>
 #include <stddef.h>
 #include <pthread.h>
-#include <umem.h>
 #include <time.h>
 
 #include <libzfs.h>
@@ -103,7 +102,6 @@ typedef struct dataref {
 } dataref_t;
 
 typedef struct dedup_entry {
-	struct dedup_entry	*dde_next;
 	zio_cksum_t dde_chksum;
 	uint64_t dde_prop;
 	dataref_t dde_ref;
@@ -111,17 +109,64 @@ typedef struct dedup_entry {
 
 #define	MAX_DDT_PHYSMEM_PERCENT		20
 #define	SMALLEST_POSSIBLE_MAX_DDT_MB		128
+#define	INITIAL_DDT_HASHBITS		16
 
+/*
+ * The blocks already sent in a dedup'ed stream, in an open-addressed hash
+ * table indexed by the low bits of the checksum and probed linearly.  An
+ * entry whose ref_guid is 0 is free.  The table is never filled beyond
+ * ddt_max_count entries, so that probe sequences stay short and always end
+ * at a free entry.  It starts small and doubles each time it reaches
+ * ddt_max_count, until it would outgrow max_ddt_size.
+ */
 typedef struct dedup_table {
-	dedup_entry_t	**dedup_hash_array;
-	umem_cache_t	*ddecache;
+	dedup_entry_t	*dedup_hash_array;
 	uint64_t	max_ddt_size;  /* max dedup table size in bytes */
-	uint64_t	cur_ddt_size;  /* current dedup table size in bytes */
 	uint64_t	ddt_count;
+	uint64_t	ddt_max_count;
 	int		numhashbits;
+	int		max_numhashbits;
 	boolean_t	ddt_full;
 } dedup_table_t;
 
+/*
+ * A record of the stream being dedup'ed, held by cksummer() until it can be
+ * written out in stream order.
+ */
+typedef struct cksum_slot {
+	dmu_replay_record_t cs_drr;
+	char		*cs_buf;
+	uint64_t	cs_bufsize;
+	uint64_t	cs_payload_size;
+	boolean_t	cs_done;	/* hashed, or doesn't need to be */
+} cksum_slot_t;
+
+/*
+ * cksummer() reads records into a ring of slots, from which its workers
+ * take the DRR_WRITE records that need a SHA256 checksum.  The slots
+ * between cp_head and cp_tail are in flight; the workers have looked at
+ * those before cp_next.  Each slot is written out, and the dedup table
+ * updated, by cksummer() itself once it reaches the head of the ring.
+ */
+typedef struct cksum_pipeline {
+	pthread_mutex_t	cp_lock;
+	pthread_cond_t	cp_done_cv;	/* a slot was hashed */
+	pthread_cond_t	cp_work_cv;	/* a slot was queued, or cp_exit */
+	cksum_slot_t	*cp_slots;
+	uint64_t	cp_nslots;
+	uint64_t	cp_head;
+	uint64_t	cp_next;
+	uint64_t	cp_tail;
+	boolean_t	cp_exit;
+	pthread_t	*cp_workers;
+	int		cp_nworkers;
+	libzfs_handle_t	*cp_hdl;
+	dedup_table_t	cp_ddt;
+	FILE		*cp_ifp;
+} cksum_pipeline_t;
+
+#define	CKSUM_THREADS_MAX	64
+
 static int
 high_order_bit(uint64_t n)
 {
@@ -144,12 +189,57 @@ ssread(void *buf, size_t len, FILE *stream)
 }
 
 static void
-ddt_hash_append(libzfs_handle_t *hdl, dedup_table_t *ddt, dedup_entry_t **ddepp,
-    zio_cksum_t *cs, uint64_t prop, dataref_t *dr)
+ddt_set_hashbits(dedup_table_t *ddt, int numhashbits)
+{
+	ddt->numhashbits = numhashbits;
+	ddt->ddt_max_count = (1ULL << numhashbits) / 4 * 3;
+}
+
+/*
+ * Double the size of the dedup table and rehash its entries.  Returns
+ * B_FALSE if it has reached its maximum size or the memory can't be had,
+ * in which case the table is left as it is.
+ */
+static boolean_t
+ddt_grow(dedup_table_t *ddt)
 {
-	dedup_entry_t	*dde;
+	int numhashbits = ddt->numhashbits + 1;
+	uint64_t mask = (1ULL << numhashbits) - 1;
+	uint64_t oldbuckets = 1ULL << ddt->numhashbits;
+	dedup_entry_t *array;
+
+	if (numhashbits > ddt->max_numhashbits)
+		return (B_FALSE);
+
+	array = calloc(1ULL << numhashbits, sizeof (dedup_entry_t));
+	if (array == NULL)
+		return (B_FALSE);
+
+	for (uint64_t i = 0; i < oldbuckets; i++) {
+		dedup_entry_t *dde = &ddt->dedup_hash_array[i];
+		uint64_t hashcode;
+
+		if (dde->dde_ref.ref_guid == 0)
+			continue;
+
+		hashcode = BF64_GET(dde->dde_chksum.zc_word[0], 0,
+		    numhashbits);
+		while (array[hashcode].dde_ref.ref_guid != 0)
+			hashcode = (hashcode + 1) & mask;
+		array[hashcode] = *dde;
+	}
 
-	if (ddt->cur_ddt_size >= ddt->max_ddt_size) {
+	free(ddt->dedup_hash_array);
+	ddt->dedup_hash_array = array;
+	ddt_set_hashbits(ddt, numhashbits);
+	return (B_TRUE);
+}
+
+static void
+ddt_hash_append(libzfs_handle_t *hdl, dedup_table_t *ddt, dedup_entry_t *dde,
+    zio_cksum_t *cs, uint64_t prop, dataref_t *dr)
+{
+	if (ddt->ddt_count >= ddt->ddt_max_count) {
 		if (ddt->ddt_full == B_FALSE) {
 			zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
 			    "Dedup table full.  Deduplication will continue "
@@ -159,17 +249,14 @@ ddt_hash_append(libzfs_handle_t *hdl, dedup_table_t *ddt, dedup_entry_t **ddepp,
 		return;
 	}
 
-	if ((dde = umem_cache_alloc(ddt->ddecache, UMEM_DEFAULT))
-	    != NULL) {
-		assert(*ddepp == NULL);
-		dde->dde_next = NULL;
-		dde->dde_chksum = *cs;
-		dde->dde_prop = prop;
-		dde->dde_ref = *dr;
-		*ddepp = dde;
-		ddt->cur_ddt_size += sizeof (dedup_entry_t);
-		ddt->ddt_count++;
-	}
+	/* A guid of 0 marks a free entry, so it can't be referenced. */
+	if (dr->ref_guid == 0)
+		return;
+
+	dde->dde_chksum = *cs;
+	dde->dde_prop = prop;
+	dde->dde_ref = *dr;
+	ddt->ddt_count++;
 }
 
 /*
@@ -185,20 +272,28 @@ static boolean_t
 ddt_update(libzfs_handle_t *hdl, dedup_table_t *ddt, zio_cksum_t *cs,
     uint64_t prop, dataref_t *dr)
 {
-	uint32_t hashcode;
-	dedup_entry_t **ddepp;
+	uint64_t mask;
+	uint64_t hashcode;
+	dedup_entry_t *dde;
 
+	if (ddt->ddt_count >= ddt->ddt_max_count)
+		(void) ddt_grow(ddt);
+
+	mask = (1ULL << ddt->numhashbits) - 1;
 	hashcode = BF64_GET(cs->zc_word[0], 0, ddt->numhashbits);
 
-	for (ddepp = &(ddt->dedup_hash_array[hashcode]); *ddepp != NULL;
-	    ddepp = &((*ddepp)->dde_next)) {
-		if (ZIO_CHECKSUM_EQUAL(((*ddepp)->dde_chksum), *cs) &&
-		    (*ddepp)->dde_prop == prop) {
-			*dr = (*ddepp)->dde_ref;
+	for (;;) {
+		dde = &ddt->dedup_hash_array[hashcode];
+		if (dde->dde_ref.ref_guid == 0)
+			break;
+		if (ZIO_CHECKSUM_EQUAL(dde->dde_chksum, *cs) &&
+		    dde->dde_prop == prop) {
+			*dr = dde->dde_ref;
 			return (B_TRUE);
 		}
+		hashcode = (hashcode + 1) & mask;
 	}
-	ddt_hash_append(hdl, ddt, ddepp, cs, prop, dr);
+	ddt_hash_append(hdl, ddt, dde, cs, prop, dr);
 	return (B_FALSE);
 }
 
@@ -227,6 +322,204 @@ dump_record(dmu_replay_record_t *drr, void *payload, int payload_len,
 	return (0);
 }
 
+/*
+ * Use the existing checksum of a DRR_WRITE record if it's dedup-capable,
+ * else calculate a SHA256 checksum for it.
+ */
+static boolean_t
+cksum_slot_needs_hash(cksum_slot_t *cs)
+{
+	struct drr_write *drrw = &cs->cs_drr.drr_u.drr_write;
+
+	return (cs->cs_drr.drr_type == DRR_WRITE &&
+	    (ZIO_CHECKSUM_EQUAL(drrw->drr_key.ddk_cksum, zero_cksum) ||
+	    !DRR_IS_DEDUP_CAPABLE(drrw->drr_flags)));
+}
+
+static void
+cksum_slot_hash(cksum_slot_t *cs)
+{
+	struct drr_write *drrw = &cs->cs_drr.drr_u.drr_write;
+	SHA256_CTX	ctx;
+	zio_cksum_t tmpsha256;
+
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, cs->cs_buf, cs->cs_payload_size);
+	SHA256Final(&tmpsha256, &ctx);
+
+	drrw->drr_key.ddk_cksum.zc_word[0] = BE_64(tmpsha256.zc_word[0]);
+	drrw->drr_key.ddk_cksum.zc_word[1] = BE_64(tmpsha256.zc_word[1]);
+	drrw->drr_key.ddk_cksum.zc_word[2] = BE_64(tmpsha256.zc_word[2]);
+	drrw->drr_key.ddk_cksum.zc_word[3] = BE_64(tmpsha256.zc_word[3]);
+	drrw->drr_checksumtype = ZIO_CHECKSUM_SHA256;
+	drrw->drr_flags |= DRR_CHECKSUM_DEDUP;
+}
+
+static void *
+cksum_worker(void *arg)
+{
+	cksum_pipeline_t *cp = arg;
+	cksum_slot_t *cs;
+
+	(void) pthread_mutex_lock(&cp->cp_lock);
+	for (;;) {
+		while (!cp->cp_exit && cp->cp_next == cp->cp_tail)
+			(void) pthread_cond_wait(&cp->cp_work_cv, &cp->cp_lock);
+		if (cp->cp_exit)
+			break;
+
+		cs = &cp->cp_slots[cp->cp_next++ % cp->cp_nslots];
+		if (cs->cs_done)
+			continue;
+
+		(void) pthread_mutex_unlock(&cp->cp_lock);
+		cksum_slot_hash(cs);
+		(void) pthread_mutex_lock(&cp->cp_lock);
+		cs->cs_done = B_TRUE;
+		(void) pthread_cond_signal(&cp->cp_done_cv);
+	}
+	(void) pthread_mutex_unlock(&cp->cp_lock);
+
+	return (NULL);
+}
+
+static void
+cksum_unlock(void *arg)
+{
+	(void) pthread_mutex_unlock(arg);
+}
+
+/*
+ * Return the slot at the head of the ring if it's ready to be written out,
+ * waiting for it to be hashed if 'wait' is set.  The workers are moved past
+ * it, since a slot that needed no hashing may not have been looked at yet
+ * and is about to be reused.
+ */
+static cksum_slot_t *
+cksum_head(cksum_pipeline_t *cp, boolean_t wait)
+{
+	cksum_slot_t *cs = &cp->cp_slots[cp->cp_head % cp->cp_nslots];
+	boolean_t done;
+
+	(void) pthread_mutex_lock(&cp->cp_lock);
+	pthread_cleanup_push(cksum_unlock, &cp->cp_lock);
+	while (wait && !cs->cs_done)
+		(void) pthread_cond_wait(&cp->cp_done_cv, &cp->cp_lock);
+	done = cs->cs_done;
+	if (done && cp->cp_next <= cp->cp_head)
+		cp->cp_next = cp->cp_head + 1;
+	pthread_cleanup_pop(1);
+
+	return (done ? cs : NULL);
+}
+
+/*
+ * Write out the record held by a slot, or a DRR_WRITE_BYREF record in its
+ * place if the block is already in the stream.
+ */
+static int
+cksum_slot_dump(cksum_pipeline_t *cp, cksum_slot_t *cs, zio_cksum_t *zc,
+    int outfd)
+{
+	dmu_replay_record_t *drr = &cs->cs_drr;
+
+	switch (drr->drr_type) {
+	case DRR_BEGIN:
+	{
+		struct drr_begin *drrb = &drr->drr_u.drr_begin;
+		int fflags;
+		ZIO_SET_CHECKSUM(zc, 0, 0, 0, 0);
+
+		ASSERT3U(drrb->drr_magic, ==, DMU_BACKUP_MAGIC);
+
+		/* set the DEDUP feature flag for this stream */
+		fflags = DMU_GET_FEATUREFLAGS(drrb->drr_versioninfo);
+		fflags |= (DMU_BACKUP_FEATURE_DEDUP |
+		    DMU_BACKUP_FEATURE_DEDUPPROPS);
+		DMU_SET_FEATUREFLAGS(drrb->drr_versioninfo, fflags);
+		break;
+	}
+
+	case DRR_END:
+	{
+		struct drr_end *drre = &drr->drr_u.drr_end;
+		/* use the recalculated checksum */
+		drre->drr_checksum = *zc;
+		break;
+	}
+
+	case DRR_WRITE:
+	{
+		struct drr_write *drrw = &drr->drr_u.drr_write;
+		dataref_t	dataref;
+
+		dataref.ref_guid = drrw->drr_toguid;
+		dataref.ref_object = drrw->drr_object;
+		dataref.ref_offset = drrw->drr_offset;
+
+		if (ddt_update(cp->cp_hdl, &cp->cp_ddt,
+		    &drrw->drr_key.ddk_cksum, drrw->drr_key.ddk_prop,
+		    &dataref)) {
+			dmu_replay_record_t wbr_drr = {0};
+			struct drr_write_byref *wbr_drrr =
+			    &wbr_drr.drr_u.drr_write_byref;
+
+			/* block already present in stream */
+			wbr_drr.drr_type = DRR_WRITE_BYREF;
+
+			wbr_drrr->drr_object = drrw->drr_object;
+			wbr_drrr->drr_offset = drrw->drr_offset;
+			wbr_drrr->drr_length = drrw->drr_logical_size;
+			wbr_drrr->drr_toguid = drrw->drr_toguid;
+			wbr_drrr->drr_refguid = dataref.ref_guid;
+			wbr_drrr->drr_refobject = dataref.ref_object;
+			wbr_drrr->drr_refoffset = dataref.ref_offset;
+
+			wbr_drrr->drr_checksumtype = drrw->drr_checksumtype;
+			wbr_drrr->drr_flags = drrw->drr_flags;
+			wbr_drrr->drr_key.ddk_cksum = drrw->drr_key.ddk_cksum;
+			wbr_drrr->drr_key.ddk_prop = drrw->drr_key.ddk_prop;
+
+			return (dump_record(&wbr_drr, NULL, 0, zc, outfd));
+		}
+		/* block not previously seen */
+		break;
+	}
+
+	default:
+		break;
+	}
+
+	return (dump_record(drr, cs->cs_buf, cs->cs_payload_size, zc, outfd));
+}
+
+/*
+ * Stop the workers and free everything; runs when cksummer() returns or is
+ * cancelled.
+ */
+static void
+cksum_pipeline_fini(void *arg)
+{
+	cksum_pipeline_t *cp = arg;
+
+	(void) pthread_mutex_lock(&cp->cp_lock);
+	cp->cp_exit = B_TRUE;
+	(void) pthread_cond_broadcast(&cp->cp_work_cv);
+	(void) pthread_mutex_unlock(&cp->cp_lock);
+	for (int i = 0; i < cp->cp_nworkers; i++)
+		(void) pthread_join(cp->cp_workers[i], NULL);
+
+	for (uint64_t i = 0; i < cp->cp_nslots; i++)
+		free(cp->cp_slots[i].cs_buf);
+	free(cp->cp_slots);
+	free(cp->cp_workers);
+	free(cp->cp_ddt.dedup_hash_array);
+	if (cp->cp_ifp != NULL)
+		(void) fclose(cp->cp_ifp);
+	(void) pthread_cond_destroy(&cp->cp_work_cv);
+	(void) pthread_cond_destroy(&cp->cp_done_cv);
+	(void) pthread_mutex_destroy(&cp->cp_lock);
+}
 
 /*
  * This function is started in a separate thread when the dedup option
@@ -244,48 +537,86 @@ dump_record(dmu_replay_record_t *drr, void *payload, int payload_len,
  *      a duplicate block is found.
  * The output of this function then goes to the output fd requested
  * by the caller of zfs_send().
+ *
+ * The checksums are calculated by a pool of worker threads (one per
+ * processor, or ZFS_SEND_DEDUP_THREADS) while this thread keeps reading the
+ * stream ahead of them.  Records are looked up in the DDT and written out in
+ * stream order, as soon as they and every record before them are ready.
  */
 static void *
 cksummer(void *arg)
 {
 	dedup_arg_t *dda = arg;
-	char *buf = zfs_alloc(dda->dedup_hdl, SPA_MAXBLOCKSIZE);
+	cksum_pipeline_t cp = { 0 };
 	dmu_replay_record_t thedrr;
 	dmu_replay_record_t *drr = &thedrr;
-	FILE *ofp;
+	cksum_slot_t *cs;
 	int outfd;
-	dedup_table_t ddt;
 	zio_cksum_t stream_cksum;
-    size_t len;
+	size_t len;
 	uint64_t physmem = 0;
 	uint64_t numbuckets;
+	uint64_t payload_size;
+	char *env;
+	int nthreads;
 
-    len = sizeof(physmem);
-    sysctlbyname("hw.memsize", &physmem, &len, NULL, 0);
+	len = sizeof (physmem);
+	sysctlbyname("hw.memsize", &physmem, &len, NULL, 0);
 
-	ddt.max_ddt_size =
+	cp.cp_ddt.max_ddt_size =
 	    MAX((physmem * MAX_DDT_PHYSMEM_PERCENT)/100,
 	    SMALLEST_POSSIBLE_MAX_DDT_MB<<20);
 
-	numbuckets = ddt.max_ddt_size/(sizeof (dedup_entry_t));
+	numbuckets = cp.cp_ddt.max_ddt_size/(sizeof (dedup_entry_t));
 
 	/*
-	 * numbuckets must be a power of 2.  Increase number to
-	 * a power of 2 if necessary.
+	 * The number of buckets is a power of 2, so the largest table
+	 * holds the largest power of 2 that is no more than numbuckets.
 	 */
-	if (!ISP2(numbuckets))
-		numbuckets = 1ULL << high_order_bit(numbuckets);
+	cp.cp_ddt.max_numhashbits = high_order_bit(numbuckets) - 1;
 
-	ddt.dedup_hash_array = calloc(numbuckets, sizeof (dedup_entry_t *));
-	ddt.ddecache = umem_cache_create("dde", sizeof (dedup_entry_t), 0,
-	    NULL, NULL, NULL, NULL, NULL, 0);
-	ddt.cur_ddt_size = numbuckets * sizeof (dedup_entry_t *);
-	ddt.numhashbits = high_order_bit(numbuckets) - 1;
-	ddt.ddt_full = B_FALSE;
+	/*
+	 * Most streams are far smaller than the largest table we allow, so
+	 * start small and let ddt_update() grow the table as needed.
+	 */
+	ddt_set_hashbits(&cp.cp_ddt,
+	    MIN(INITIAL_DDT_HASHBITS, cp.cp_ddt.max_numhashbits));
+	cp.cp_ddt.dedup_hash_array = zfs_alloc(dda->dedup_hdl,
+	    (1ULL << cp.cp_ddt.numhashbits) * sizeof (dedup_entry_t));
+	cp.cp_ddt.ddt_full = B_FALSE;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((env = getenv("ZFS_SEND_DEDUP_THREADS")) != NULL)
+		nthreads = atoi(env);
+	nthreads = MAX(1, MIN(nthreads, CKSUM_THREADS_MAX));
+
+	cp.cp_hdl = dda->dedup_hdl;
+	cp.cp_nslots = 2 * nthreads;
+	cp.cp_slots = zfs_alloc(dda->dedup_hdl,
+	    cp.cp_nslots * sizeof (cksum_slot_t));
+	cp.cp_workers = zfs_alloc(dda->dedup_hdl,
+	    nthreads * sizeof (pthread_t));
+	(void) pthread_mutex_init(&cp.cp_lock, NULL);
+	(void) pthread_cond_init(&cp.cp_done_cv, NULL);
+	(void) pthread_cond_init(&cp.cp_work_cv, NULL);
 
 	outfd = dda->outputfd;
-	ofp = fdopen(dda->inputfd, "r");
-	while (ssread(drr, sizeof (*drr), ofp) != 0) {
+	cp.cp_ifp = fdopen(dda->inputfd, "r");
+	pthread_cleanup_push(cksum_pipeline_fini, &cp);
+
+	if (cp.cp_ddt.dedup_hash_array == NULL || cp.cp_slots == NULL ||
+	    cp.cp_workers == NULL || cp.cp_ifp == NULL) {
+		cp.cp_nslots = 0;
+		goto out;
+	}
+
+	/* Without any worker, the checksums are calculated inline. */
+	while (cp.cp_nworkers < nthreads &&
+	    pthread_create(&cp.cp_workers[cp.cp_nworkers], NULL,
+	    cksum_worker, &cp) == 0)
+		cp.cp_nworkers++;
+
+	while (ssread(drr, sizeof (*drr), cp.cp_ifp) != 0) {
 
 		/*
 		 * kernel filled in checksum, we are going to write same
@@ -298,201 +629,98 @@ cksummer(void *arg)
 
 		switch (drr->drr_type) {
 		case DRR_BEGIN:
-		{
-			struct drr_begin *drrb = &drr->drr_u.drr_begin;
-			int fflags;
-			int sz = 0;
-			ZIO_SET_CHECKSUM(&stream_cksum, 0, 0, 0, 0);
-
-			ASSERT3U(drrb->drr_magic, ==, DMU_BACKUP_MAGIC);
-
-			/* set the DEDUP feature flag for this stream */
-			fflags = DMU_GET_FEATUREFLAGS(drrb->drr_versioninfo);
-			fflags |= (DMU_BACKUP_FEATURE_DEDUP |
-			    DMU_BACKUP_FEATURE_DEDUPPROPS);
-			DMU_SET_FEATUREFLAGS(drrb->drr_versioninfo, fflags);
-
-			if (drr->drr_payloadlen != 0) {
-				sz = drr->drr_payloadlen;
-
-				if (sz > SPA_MAXBLOCKSIZE) {
-					buf = zfs_realloc(dda->dedup_hdl, buf,
-					    SPA_MAXBLOCKSIZE, sz);
-				}
-				(void) ssread(buf, sz, ofp);
-				if (ferror(stdin))
-					perror("fread");
-			}
-			if (dump_record(drr, buf, sz, &stream_cksum,
-			    outfd) != 0)
-				goto out;
-			break;
-		}
-
-		case DRR_END:
-		{
-			struct drr_end *drre = &drr->drr_u.drr_end;
-			/* use the recalculated checksum */
-			drre->drr_checksum = stream_cksum;
-			if (dump_record(drr, NULL, 0, &stream_cksum,
-			    outfd) != 0)
-				goto out;
+			payload_size = drr->drr_payloadlen;
 			break;
-		}
-
 		case DRR_OBJECT:
-		{
-			struct drr_object *drro = &drr->drr_u.drr_object;
-			if (drro->drr_bonuslen > 0) {
-				(void) ssread(buf,
-				    DRR_OBJECT_PAYLOAD_SIZE(drro), ofp);
-			}
-			if (dump_record(drr, buf, DRR_OBJECT_PAYLOAD_SIZE(drro),
-			    &stream_cksum, outfd) != 0)
-				goto out;
+			payload_size =
+			    DRR_OBJECT_PAYLOAD_SIZE(&drr->drr_u.drr_object);
 			break;
-		}
-
 		case DRR_SPILL:
-		{
-			struct drr_spill *drrs = &drr->drr_u.drr_spill;
-			(void) ssread(buf, DRR_SPILL_PAYLOAD_SIZE(drrs), ofp);
-			if (dump_record(drr, buf, DRR_SPILL_PAYLOAD_SIZE(drrs),
-			    &stream_cksum, outfd) != 0)
-				goto out;
+			payload_size =
+			    DRR_SPILL_PAYLOAD_SIZE(&drr->drr_u.drr_spill);
 			break;
-		}
-
-		case DRR_FREEOBJECTS:
-		{
-			if (dump_record(drr, NULL, 0, &stream_cksum,
-							outfd) != 0)
-				goto out;
-			break;
-		}
-
 		case DRR_WRITE:
-		{
- 			struct drr_write *drrw = &drr->drr_u.drr_write;
-			dataref_t	dataref;
-			uint64_t	payload_size;
-
-			payload_size = DRR_WRITE_PAYLOAD_SIZE(drrw);
-			(void) ssread(buf, payload_size, ofp);
-
-			/*
-			 * Use the existing checksum if it's dedup-capable,
-			 * else calculate a SHA256 checksum for it.
-			 */
-
-			if (ZIO_CHECKSUM_EQUAL(drrw->drr_key.ddk_cksum,
-			    zero_cksum) ||
-			    !DRR_IS_DEDUP_CAPABLE(drrw->drr_flags)) {
-				SHA256_CTX	ctx;
-				zio_cksum_t tmpsha256;
-
-				SHA256Init(&ctx);
-				SHA256Update(&ctx, buf, payload_size);
-				SHA256Final(&tmpsha256, &ctx);
-
-				drrw->drr_key.ddk_cksum.zc_word[0] =
-				    BE_64(tmpsha256.zc_word[0]);
-				drrw->drr_key.ddk_cksum.zc_word[1] =
-				    BE_64(tmpsha256.zc_word[1]);
-				drrw->drr_key.ddk_cksum.zc_word[2] =
-				    BE_64(tmpsha256.zc_word[2]);
-				drrw->drr_key.ddk_cksum.zc_word[3] =
-				    BE_64(tmpsha256.zc_word[3]);
-				drrw->drr_checksumtype = ZIO_CHECKSUM_SHA256;
-				drrw->drr_flags |= DRR_CHECKSUM_DEDUP;
-			}
-
-			dataref.ref_guid = drrw->drr_toguid;
-			dataref.ref_object = drrw->drr_object;
-			dataref.ref_offset = drrw->drr_offset;
-
-			if (ddt_update(dda->dedup_hdl, &ddt,
-			    &drrw->drr_key.ddk_cksum, drrw->drr_key.ddk_prop,
-			    &dataref)) {
-				dmu_replay_record_t wbr_drr = {0};
-				struct drr_write_byref *wbr_drrr =
-				    &wbr_drr.drr_u.drr_write_byref;
-
-				/* block already present in stream */
-				wbr_drr.drr_type = DRR_WRITE_BYREF;
-
-				wbr_drrr->drr_object = drrw->drr_object;
-				wbr_drrr->drr_offset = drrw->drr_offset;
-				wbr_drrr->drr_length = drrw->drr_logical_size;
-				wbr_drrr->drr_toguid = drrw->drr_toguid;
-				wbr_drrr->drr_refguid = dataref.ref_guid;
-				wbr_drrr->drr_refobject =
-				    dataref.ref_object;
-				wbr_drrr->drr_refoffset =
-				    dataref.ref_offset;
-
-				wbr_drrr->drr_checksumtype =
-				    drrw->drr_checksumtype;
-				wbr_drrr->drr_flags =
-				    drrw->drr_flags;
-				wbr_drrr->drr_key.ddk_cksum =
-				    drrw->drr_key.ddk_cksum;
-				wbr_drrr->drr_key.ddk_prop =
-				    drrw->drr_key.ddk_prop;
-
-				if (dump_record(&wbr_drr, NULL, 0,
-				    &stream_cksum, outfd) != 0)
-					goto out;
-			} else {
-				/* block not previously seen */
-				if (dump_record(drr, buf, payload_size,
-				    &stream_cksum, outfd) != 0)
-					goto out;
-			}
+			payload_size =
+			    DRR_WRITE_PAYLOAD_SIZE(&drr->drr_u.drr_write);
 			break;
-		}
-
 		case DRR_WRITE_EMBEDDED:
-		{
-			struct drr_write_embedded *drrwe =
-			    &drr->drr_u.drr_write_embedded;
-			(void) ssread(buf,
-			    P2ROUNDUP((uint64_t)drrwe->drr_psize, 8), ofp);
-			if (dump_record(drr, buf,
-			    P2ROUNDUP((uint64_t)drrwe->drr_psize, 8),
-			    &stream_cksum, outfd) != 0)
-				goto out;
+			payload_size = P2ROUNDUP((uint64_t)
+			    drr->drr_u.drr_write_embedded.drr_psize, 8);
 			break;
+		case DRR_END:
+		case DRR_FREEOBJECTS:
+		case DRR_FREE:
+		case DRR_OBJECT_RANGE:
+			payload_size = 0;
+			break;
+		default:
+			(void) fprintf(stderr, "INVALID record type 0x%x\n",
+			    drr->drr_type);
+			/* should never happen, so assert */
+			assert(B_FALSE);
+			payload_size = 0;
 		}
 
-		case DRR_FREE:
-		{
-			if (dump_record(drr, NULL, 0, &stream_cksum,
+		/* Make room in the ring, writing out the oldest record. */
+		if (cp.cp_tail - cp.cp_head == cp.cp_nslots) {
+			cs = cksum_head(&cp, B_TRUE);
+			if (cksum_slot_dump(&cp, cs, &stream_cksum,
 			    outfd) != 0)
 				goto out;
-			break;
+			cp.cp_head++;
 		}
 
-		case DRR_OBJECT_RANGE:
-		{
-			if (dump_record(drr, NULL, 0, &stream_cksum,
-			    outfd) != 0)
+		cs = &cp.cp_slots[cp.cp_tail % cp.cp_nslots];
+		cs->cs_drr = *drr;
+		cs->cs_payload_size = payload_size;
+		if (payload_size > cs->cs_bufsize) {
+			cs->cs_buf = zfs_realloc(dda->dedup_hdl, cs->cs_buf,
+			    cs->cs_bufsize, payload_size);
+			if (cs->cs_buf == NULL) {
+				cs->cs_bufsize = 0;
 				goto out;
-			break;
+			}
+			cs->cs_bufsize = payload_size;
+		}
+		if (payload_size != 0)
+			(void) ssread(cs->cs_buf, payload_size, cp.cp_ifp);
+
+		if (!cksum_slot_needs_hash(cs)) {
+			cs->cs_done = B_TRUE;
+		} else if (cp.cp_nworkers == 0) {
+			cksum_slot_hash(cs);
+			cs->cs_done = B_TRUE;
+		} else {
+			cs->cs_done = B_FALSE;
 		}
 
-		default:
-			(void) fprintf(stderr, "INVALID record type 0x%x\n",
-			    drr->drr_type);
-			/* should never happen, so assert */
-			assert(B_FALSE);
+		(void) pthread_mutex_lock(&cp.cp_lock);
+		cp.cp_tail++;
+		if (!cs->cs_done)
+			(void) pthread_cond_signal(&cp.cp_work_cv);
+		(void) pthread_mutex_unlock(&cp.cp_lock);
+
+		/*
+		 * Write out whatever is ready, so that records which need
+		 * no checksum aren't held back behind a full ring.
+		 */
+		while (cp.cp_head != cp.cp_tail &&
+		    (cs = cksum_head(&cp, B_FALSE)) != NULL) {
+			if (cksum_slot_dump(&cp, cs, &stream_cksum,
+			    outfd) != 0)
+				goto out;
+			cp.cp_head++;
 		}
 	}
+
+	while (cp.cp_head != cp.cp_tail) {
+		cs = cksum_head(&cp, B_TRUE);
+		if (cksum_slot_dump(&cp, cs, &stream_cksum, outfd) != 0)
+			goto out;
+		cp.cp_head++;
+	}
 out:
-	umem_cache_destroy(ddt.ddecache);
-	free(ddt.dedup_hash_array);
-	free(buf);
-	(void) fclose(ofp);
+	pthread_cleanup_pop(1);
 
 	return (NULL);
 }
@@ -1065,6 +1065,7 @@ libzfs_init(void)
 	zfs_prop_init();
 	zpool_prop_init();
 	zpool_feature_init();
+	(void) pthread_mutex_init(&hdl->libzfs_mnttab_cache_lock, NULL);
 	libzfs_mnttab_init(hdl);
 	fletcher_4_init();
 #ifdef __APPLE__
@@ -1099,6 +1100,7 @@ libzfs_fini(libzfs_handle_t *hdl)
 	libzfs_fru_clear(hdl, B_TRUE);
 	namespace_clear(hdl);
 	libzfs_mnttab_fini(hdl);
+	(void) pthread_mutex_destroy(&hdl->libzfs_mnttab_cache_lock);
 	libzfs_core_fini();
 	fletcher_4_fini();
 	free(hdl);
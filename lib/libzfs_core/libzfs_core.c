@@ -1479,3 +1479,32 @@ lzc_trim(const char *poolname, pool_trim_func_t cmd_type, uint64_t rate,
 
 	return (error);
 }
+
+/*
+ * Remove unique entries from the dedup tables of the given pool: those
+ * older than 'amount' seconds with POOL_DDT_PRUNE_AGE, or the oldest
+ * 'amount' percent of them with POOL_DDT_PRUNE_PERCENTAGE.  The blocks they
+ * describe stay where they are, and are freed like blocks that were never
+ * deduplicated.
+ *
+ * The pool only notes the time of a txg once a day, so entries up to a day
+ * older than the age asked for may be kept.
+ */
+int
+lzc_ddt_prune(const char *pool, pool_ddt_prune_unit_t unit, uint64_t amount)
+{
+	int error;
+
+	nvlist_t *result = NULL;
+	nvlist_t *args = fnvlist_alloc();
+
+	fnvlist_add_uint64(args, ZPOOL_DDT_PRUNE_UNIT, unit);
+	fnvlist_add_uint64(args, ZPOOL_DDT_PRUNE_AMOUNT, amount);
+
+	error = lzc_ioctl(ZFS_IOC_DDT_PRUNE, pool, args, &result);
+
+	fnvlist_free(args);
+	fnvlist_free(result);
+
+	return (error);
+}
@@ -0,0 +1,424 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <blake3/blake3_impl.h>
+
+/*
+ * Selection of the BLAKE3 implementation, in the same way as fletcher 4:
+ * every compiled in implementation the CPU supports is benchmarked when
+ * the module loads, and "fastest" uses the one with the highest throughput
+ * on 128k blocks.  The numbers are kept in the blake3_bench kstat.
+ */
+
+static const blake3_impl_ops_t *blake3_impls[] = {
+	&blake3_generic_impl,
+#if defined(__x86_64) && defined(HAVE_SSE2)
+	&blake3_sse2_impl,
+#endif
+#if defined(__x86_64) && defined(HAVE_SSE4_1)
+	&blake3_sse41_impl,
+#endif
+#if defined(__x86_64) && defined(HAVE_AVX2)
+	&blake3_avx2_impl,
+#endif
+/*
+ * APPLE: the kernel does not preserve the AVX-512 state, see
+ * fletcher_4_impls[].
+ */
+#if defined(__x86_64) && defined(HAVE_AVX512F) && \
+	!(defined(_KERNEL) && defined(__APPLE__))
+	&blake3_avx512_impl,
+#endif
+};
+
+/* Hold all supported implementations */
+static uint32_t blake3_supp_impls_cnt = 0;
+static blake3_impl_ops_t *blake3_supp_impls[ARRAY_SIZE(blake3_impls)];
+
+static blake3_impl_ops_t blake3_fastest_impl = {
+	.name = "fastest"
+};
+
+/* Select blake3 implementation */
+#define	IMPL_FASTEST	(UINT32_MAX)
+#define	IMPL_CYCLE	(UINT32_MAX - 1)
+
+static uint64_t blake3_impl_chosen = IMPL_FASTEST;
+
+#define	IMPL_READ(i)	(*(volatile uint64_t *) &(i))
+
+static struct blake3_impl_selector {
+	const char	*bis_name;
+	uint64_t	bis_sel;
+} blake3_impl_selectors[] = {
+#if !defined(_KERNEL)
+	{ "cycle",	IMPL_CYCLE },
+#endif
+	{ "fastest",	IMPL_FASTEST }
+};
+
+#if defined(_KERNEL)
+static kstat_t *blake3_kstat;
+
+/* Throughput of each implementation, the last entry names the fastest */
+static struct blake3_kstat {
+	uint64_t bs4k;
+	uint64_t bs128k;
+} blake3_stat_data[ARRAY_SIZE(blake3_impls) + 1];
+#endif
+
+/* Indicate that benchmark has been completed */
+static boolean_t blake3_initialized = B_FALSE;
+
+const blake3_impl_ops_t *
+blake3_impl_get_ops(void)
+{
+	const blake3_impl_ops_t *ops = NULL;
+	const uint64_t impl = IMPL_READ(blake3_impl_chosen);
+
+	switch (impl) {
+	case IMPL_FASTEST:
+		ASSERT(blake3_initialized);
+		ops = &blake3_fastest_impl;
+		break;
+#if !defined(_KERNEL)
+	case IMPL_CYCLE: {
+		ASSERT(blake3_initialized);
+		ASSERT3U(blake3_supp_impls_cnt, >, 0);
+
+		static uint32_t cycle_count = 0;
+		uint32_t idx = (++cycle_count) % blake3_supp_impls_cnt;
+		ops = blake3_supp_impls[idx];
+	}
+	break;
+#endif
+	default:
+		ASSERT3U(blake3_supp_impls_cnt, >, 0);
+		ASSERT3U(impl, <, blake3_supp_impls_cnt);
+
+		ops = blake3_supp_impls[impl];
+		break;
+	}
+
+	ASSERT3P(ops, !=, NULL);
+
+	return (ops);
+}
+
+int
+blake3_impl_set(const char *val)
+{
+	int err = -EINVAL;
+	uint64_t impl = IMPL_READ(blake3_impl_chosen);
+	size_t i, val_len;
+
+	val_len = strlen(val);
+	while ((val_len > 0) && !!isspace(val[val_len-1])) /* trim '\n' */
+		val_len--;
+
+	/* check mandatory implementations */
+	for (i = 0; i < ARRAY_SIZE(blake3_impl_selectors); i++) {
+		const char *name = blake3_impl_selectors[i].bis_name;
+
+		if (val_len == strlen(name) &&
+		    strncmp(val, name, val_len) == 0) {
+			impl = blake3_impl_selectors[i].bis_sel;
+			err = 0;
+			break;
+		}
+	}
+
+	if (err != 0 && blake3_initialized) {
+		/* check all supported implementations */
+		for (i = 0; i < blake3_supp_impls_cnt; i++) {
+			const char *name = blake3_supp_impls[i]->name;
+
+			if (val_len == strlen(name) &&
+			    strncmp(val, name, val_len) == 0) {
+				impl = i;
+				err = 0;
+				break;
+			}
+		}
+	}
+
+	if (err == 0) {
+		atomic_swap_64(&blake3_impl_chosen, impl);
+		membar_producer();
+	}
+
+	return (err);
+}
+
+uint32_t
+blake3_impl_getcnt(void)
+{
+	ASSERT(blake3_initialized);
+
+	return (blake3_supp_impls_cnt);
+}
+
+const char *
+blake3_impl_getname(uint32_t id)
+{
+	ASSERT(blake3_initialized);
+
+	if (id >= blake3_supp_impls_cnt)
+		return (NULL);
+
+	return (blake3_supp_impls[id]->name);
+}
+
+#if defined(_KERNEL)
+/* BLAKE3 kstats */
+
+static int
+blake3_kstat_headers(char *buf, size_t size)
+{
+	ssize_t off = 0;
+
+	off += snprintf(buf + off, size, "%-17s", "implementation");
+	off += snprintf(buf + off, size - off, "%-15s", "4k");
+	(void) snprintf(buf + off, size - off, "%-15s\n", "128k");
+
+	return (0);
+}
+
+static int
+blake3_kstat_data(char *buf, size_t size, void *data)
+{
+	struct blake3_kstat *fastest_stat =
+	    &blake3_stat_data[blake3_supp_impls_cnt];
+	struct blake3_kstat *curr_stat = (struct blake3_kstat *)data;
+	ssize_t off = 0;
+
+	if (curr_stat == fastest_stat) {
+		off += snprintf(buf + off, size - off, "%-17s", "fastest");
+		off += snprintf(buf + off, size - off, "%-15s",
+		    blake3_supp_impls[fastest_stat->bs4k]->name);
+		off += snprintf(buf + off, size - off, "%-15s\n",
+		    blake3_supp_impls[fastest_stat->bs128k]->name);
+	} else {
+		ptrdiff_t id = curr_stat - blake3_stat_data;
+
+		off += snprintf(buf + off, size - off, "%-17s",
+		    blake3_supp_impls[id]->name);
+		off += snprintf(buf + off, size - off, "%-15llu",
+		    (u_longlong_t)curr_stat->bs4k);
+		off += snprintf(buf + off, size - off, "%-15llu\n",
+		    (u_longlong_t)curr_stat->bs128k);
+	}
+
+	return (0);
+}
+
+static void *
+blake3_kstat_addr(kstat_t *ksp, int64_t n)
+{
+	if (n <= blake3_supp_impls_cnt)
+		ksp->ks_private = (void *) (blake3_stat_data + n);
+	else
+		ksp->ks_private = NULL;
+
+	return (ksp->ks_private);
+}
+
+#define	BLAKE3_BENCH_NS	(MSEC2NSEC(25))		/* 25ms */
+
+/*
+ * Measure the throughput of every supported implementation on 4k and on
+ * 128k buffers.  Only the 128k result picks the fastest implementation;
+ * the 4k column shows how much of that survives on small blocks.
+ */
+static void
+blake3_benchmark_impl(const uint8_t *data, uint64_t data_size)
+{
+	struct blake3_kstat *fastest_stat =
+	    &blake3_stat_data[blake3_supp_impls_cnt];
+	uint64_t sel_save = IMPL_READ(blake3_impl_chosen);
+	uint64_t best_run = 0;
+	uint8_t digest[BLAKE3_OUT_LEN];
+	BLAKE3_CTX *ctx;
+	uint32_t i, l;
+
+	ctx = kmem_alloc(sizeof (*ctx), KM_SLEEP);
+
+	for (i = 0; i < blake3_supp_impls_cnt; i++) {
+		struct blake3_kstat *stat = &blake3_stat_data[i];
+		uint64_t sizes[2] = { 4096, data_size };
+		uint64_t run_bw[2];
+		int s;
+
+		/* temporary set an implementation */
+		blake3_impl_chosen = i;
+
+		for (s = 0; s < 2; s++) {
+			uint64_t run_count = 0, run_time_ns;
+			hrtime_t start;
+
+			kpreempt_disable();
+			start = gethrtime();
+			do {
+				for (l = 0; l < 8; l++, run_count++) {
+					Blake3_Init(ctx);
+					Blake3_Update(ctx, data, sizes[s]);
+					Blake3_Final(ctx, digest);
+				}
+
+				run_time_ns = gethrtime() - start;
+			} while (run_time_ns < BLAKE3_BENCH_NS);
+			kpreempt_enable();
+
+			run_bw[s] = sizes[s] * run_count * NANOSEC;
+			run_bw[s] /= run_time_ns;	/* B/s */
+		}
+
+		stat->bs4k = run_bw[0];
+		stat->bs128k = run_bw[1];
+
+		if (run_bw[1] > best_run) {
+			best_run = run_bw[1];
+			fastest_stat->bs128k = i;
+			memcpy(&blake3_fastest_impl, blake3_supp_impls[i],
+			    sizeof (blake3_fastest_impl));
+			blake3_fastest_impl.name = "fastest";
+		}
+		if (run_bw[0] > blake3_stat_data[fastest_stat->bs4k].bs4k)
+			fastest_stat->bs4k = i;
+
+		dprintf("%s: %14s %16llu %16llu B/s\n", __func__,
+		    blake3_supp_impls[i]->name, (u_longlong_t)run_bw[0],
+		    (u_longlong_t)run_bw[1]);
+	}
+
+	kmem_free(ctx, sizeof (*ctx));
+
+	/* restore original selection */
+	atomic_swap_64(&blake3_impl_chosen, sel_save);
+}
+#endif
+
+void
+blake3_impl_init(void)
+{
+	blake3_impl_ops_t *curr_impl;
+	int i, c;
+
+	/* move supported impl into blake3_supp_impls */
+	for (i = 0, c = 0; i < ARRAY_SIZE(blake3_impls); i++) {
+		curr_impl = (blake3_impl_ops_t *)blake3_impls[i];
+
+		if (curr_impl->is_supported())
+			blake3_supp_impls[c++] = curr_impl;
+	}
+	membar_producer();	/* complete blake3_supp_impls[] init */
+	blake3_supp_impls_cnt = c;	/* number of supported impl */
+
+#if !defined(_KERNEL)
+	/* Skip benchmarking and use last implementation as fastest */
+	memcpy(&blake3_fastest_impl,
+	    blake3_supp_impls[blake3_supp_impls_cnt - 1],
+	    sizeof (blake3_fastest_impl));
+	blake3_fastest_impl.name = "fastest";
+	membar_producer();
+#else
+	/* Benchmark all supported implementations */
+	{
+		static const size_t data_size = 1 << 17; /* 128kiB */
+		uint8_t *databuf;
+
+		databuf = kmem_alloc(data_size, KM_SLEEP);
+		for (i = 0; i < data_size / sizeof (uint64_t); i++)
+			((uint64_t *)databuf)[i] = (uintptr_t)(databuf + i);
+
+		blake3_benchmark_impl(databuf, data_size);
+
+		kmem_free(databuf, data_size);
+	}
+
+	/* install kstats for all implementations */
+	blake3_kstat = kstat_create("zfs", 0, "blake3_bench", "misc",
+	    KSTAT_TYPE_RAW, 0, KSTAT_FLAG_VIRTUAL);
+	if (blake3_kstat != NULL) {
+		blake3_kstat->ks_data = NULL;
+		blake3_kstat->ks_ndata = UINT32_MAX;
+		kstat_set_raw_ops(blake3_kstat,
+		    blake3_kstat_headers,
+		    blake3_kstat_data,
+		    blake3_kstat_addr);
+		kstat_install(blake3_kstat);
+	}
+#endif
+
+	/* Finish initialization */
+	blake3_initialized = B_TRUE;
+}
+
+void
+blake3_impl_fini(void)
+{
+#if defined(_KERNEL)
+	if (blake3_kstat != NULL) {
+		kstat_delete(blake3_kstat);
+		blake3_kstat = NULL;
+	}
+#endif
+}
+
+#if defined(_KERNEL)
+
+int
+zfs_blake3_impl_get(char *buffer, int max)
+{
+	const uint64_t impl = IMPL_READ(blake3_impl_chosen);
+	char *fmt;
+	int i, cnt = 0;
+
+	/* list fastest */
+	fmt = (impl == IMPL_FASTEST) ? "[%s] " : "%s ";
+	cnt += snprintf(buffer + cnt, max, fmt, "fastest");
+
+	/* list all supported implementations */
+	for (i = 0; i < blake3_supp_impls_cnt; i++) {
+		fmt = (i == impl) ? "[%s] " : "%s ";
+		cnt += snprintf(buffer + cnt, max, fmt,
+		    blake3_supp_impls[i]->name);
+	}
+
+	return (cnt);
+}
+
+int
+zfs_blake3_impl_set(const char *val)
+{
+	return (blake3_impl_set(val));
+}
+
+#endif
+
+#if defined(_KERNEL) && defined(__linux__)
+EXPORT_SYMBOL(blake3_impl_init);
+EXPORT_SYMBOL(blake3_impl_fini);
+EXPORT_SYMBOL(blake3_impl_set);
+EXPORT_SYMBOL(blake3_impl_getcnt);
+EXPORT_SYMBOL(blake3_impl_getname);
+#endif
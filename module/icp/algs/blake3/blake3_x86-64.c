@@ -0,0 +1,491 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Based on BLAKE3 v1.3.1, https://github.com/BLAKE3-team/BLAKE3
+ * Copyright (c) 2019-2020 Samuel Neves and Jack O'Connor
+ */
+
+/*
+ * SSE2, SSE4.1, AVX2 and AVX-512 versions of hash_many().
+ *
+ * All of them hash 4, 8 or 16 inputs side by side, one input per 32-bit
+ * lane: row i of the state holds word i of every input's compression
+ * state, and row i of the message holds word i of every input's block.
+ * Each G function is a single asm statement which loads its four state
+ * rows and two message rows, mixes them and stores the state rows back.
+ * This keeps the kernels free of any assumption about what the compiler
+ * does with the vector registers between statements, which matters in
+ * userland, where it may use them itself.
+ *
+ * The implementations only differ in the width of the registers and in
+ * how the rotations are done: SSE2 with shifts (and word shuffles for the
+ * rotation by 16), SSE4.1 and AVX2 with byte shuffles for the rotations by
+ * 16 and 8, and AVX-512 with vprord.  Single blocks, and whatever is left
+ * over when fewer inputs than the degree are handed in, go through the
+ * portable code.
+ */
+
+#if defined(__x86_64)
+
+#include <sys/simd_x86.h>
+#include <blake3/blake3_impl.h>
+
+typedef struct blake3_simd_state {
+	uint32_t v[16][MAX_SIMD_DEGREE];	/* compression state */
+	uint32_t m[16][MAX_SIMD_DEGREE];	/* message block */
+	uint32_t h[8][MAX_SIMD_DEGREE];		/* chaining value */
+} blake3_simd_state_t;
+
+typedef void (*blake3_simd_rounds_f)(blake3_simd_state_t *);
+
+/*
+ * pshufb masks rotating every 32-bit word right by 16 and by 8 bits.
+ * The AVX2 shuffle works on each 128-bit half, so the mask is repeated.
+ */
+static const uint8_t blake3_rot16_mask[32] = {
+	2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+	2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13
+};
+
+static const uint8_t blake3_rot8_mask[32] = {
+	1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+	1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12
+};
+
+/* One round: mix the columns, then the diagonals. */
+#define	BLAKE3_SIMD_ROUND(G, st, s)					\
+{									\
+	G((st)->v[0], (st)->v[4], (st)->v[8], (st)->v[12],		\
+	    (st)->m[(s)[0]], (st)->m[(s)[1]]);				\
+	G((st)->v[1], (st)->v[5], (st)->v[9], (st)->v[13],		\
+	    (st)->m[(s)[2]], (st)->m[(s)[3]]);				\
+	G((st)->v[2], (st)->v[6], (st)->v[10], (st)->v[14],		\
+	    (st)->m[(s)[4]], (st)->m[(s)[5]]);				\
+	G((st)->v[3], (st)->v[7], (st)->v[11], (st)->v[15],		\
+	    (st)->m[(s)[6]], (st)->m[(s)[7]]);				\
+	G((st)->v[0], (st)->v[5], (st)->v[10], (st)->v[15],		\
+	    (st)->m[(s)[8]], (st)->m[(s)[9]]);				\
+	G((st)->v[1], (st)->v[6], (st)->v[11], (st)->v[12],		\
+	    (st)->m[(s)[10]], (st)->m[(s)[11]]);			\
+	G((st)->v[2], (st)->v[7], (st)->v[8], (st)->v[13],		\
+	    (st)->m[(s)[12]], (st)->m[(s)[13]]);			\
+	G((st)->v[3], (st)->v[4], (st)->v[9], (st)->v[14],		\
+	    (st)->m[(s)[14]], (st)->m[(s)[15]]);			\
+}
+
+/*
+ * Compress one block of each of the degree inputs.  The caller owns the
+ * FPU, and leaves whatever it likes in the lanes past the degree.
+ */
+static void
+blake3_simd_compress(blake3_simd_rounds_f rounds, size_t degree,
+    blake3_simd_state_t *st, const uint8_t * const *inputs, size_t block,
+    uint64_t counter, boolean_t increment_counter, uint8_t block_flags)
+{
+	size_t i, j;
+
+	for (j = 0; j < degree; j++) {
+		const uint8_t *p = inputs[j] + block * BLAKE3_BLOCK_LEN;
+		uint64_t ctr = increment_counter ? counter + j : counter;
+
+		for (i = 0; i < 16; i++)
+			st->m[i][j] = load32(p + 4 * i);
+		for (i = 0; i < 8; i++)
+			st->v[i][j] = st->h[i][j];
+		for (i = 0; i < 4; i++)
+			st->v[i + 8][j] = BLAKE3_IV[i];
+		st->v[12][j] = counter_low(ctr);
+		st->v[13][j] = counter_high(ctr);
+		st->v[14][j] = BLAKE3_BLOCK_LEN;
+		st->v[15][j] = block_flags;
+	}
+
+	rounds(st);
+
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < degree; j++)
+			st->h[i][j] = st->v[i][j] ^ st->v[i + 8][j];
+	}
+}
+
+static void
+blake3_hash_many_simd(blake3_simd_rounds_f rounds, size_t degree,
+    const uint8_t * const *inputs, size_t num_inputs, size_t blocks,
+    const uint32_t key[8], uint64_t counter, boolean_t increment_counter,
+    uint8_t flags, uint8_t flags_start, uint8_t flags_end, uint8_t *out)
+{
+	blake3_simd_state_t st;
+	size_t b, i, j;
+
+	ASSERT3U(degree, <=, MAX_SIMD_DEGREE);
+
+	if (num_inputs >= degree) {
+		kfpu_begin();
+		while (num_inputs >= degree) {
+			for (i = 0; i < 8; i++) {
+				for (j = 0; j < degree; j++)
+					st.h[i][j] = key[i];
+			}
+			for (b = 0; b < blocks; b++) {
+				uint8_t block_flags = flags;
+
+				if (b == 0)
+					block_flags |= flags_start;
+				if (b == blocks - 1)
+					block_flags |= flags_end;
+				blake3_simd_compress(rounds, degree, &st,
+				    inputs, b, counter, increment_counter,
+				    block_flags);
+			}
+			for (j = 0; j < degree; j++) {
+				for (i = 0; i < 8; i++)
+					store32(&out[j * BLAKE3_OUT_LEN +
+					    i * 4], st.h[i][j]);
+			}
+
+			if (increment_counter)
+				counter += degree;
+			inputs += degree;
+			num_inputs -= degree;
+			out = &out[degree * BLAKE3_OUT_LEN];
+		}
+		kfpu_end();
+	}
+
+	if (num_inputs > 0) {
+		blake3_hash_many_generic(inputs, num_inputs, blocks, key,
+		    counter, increment_counter, flags, flags_start, flags_end,
+		    out);
+	}
+}
+
+#if defined(HAVE_SSE2)
+
+/*
+ * xmm0-xmm3 hold a, b, c and d, xmm4 is scratch.  A rotation by 16 swaps
+ * the 16-bit halves of each word.
+ */
+#define	BLAKE3_G_SSE2(va, vb, vc, vd, mx, my)				\
+	asm volatile(							\
+	    "movdqu %[a], %%xmm0\n"					\
+	    "movdqu %[b], %%xmm1\n"					\
+	    "movdqu %[c], %%xmm2\n"					\
+	    "movdqu %[d], %%xmm3\n"					\
+	    "movdqu %[x], %%xmm4\n"					\
+	    "paddd %%xmm1, %%xmm0\n"					\
+	    "paddd %%xmm4, %%xmm0\n"					\
+	    "pxor %%xmm0, %%xmm3\n"					\
+	    "pshuflw $0xb1, %%xmm3, %%xmm3\n"				\
+	    "pshufhw $0xb1, %%xmm3, %%xmm3\n"				\
+	    "paddd %%xmm3, %%xmm2\n"					\
+	    "pxor %%xmm2, %%xmm1\n"					\
+	    "movdqa %%xmm1, %%xmm4\n"					\
+	    "psrld $12, %%xmm1\n"					\
+	    "pslld $20, %%xmm4\n"					\
+	    "por %%xmm4, %%xmm1\n"					\
+	    "movdqu %[y], %%xmm4\n"					\
+	    "paddd %%xmm1, %%xmm0\n"					\
+	    "paddd %%xmm4, %%xmm0\n"					\
+	    "pxor %%xmm0, %%xmm3\n"					\
+	    "movdqa %%xmm3, %%xmm4\n"					\
+	    "psrld $8, %%xmm3\n"					\
+	    "pslld $24, %%xmm4\n"					\
+	    "por %%xmm4, %%xmm3\n"					\
+	    "paddd %%xmm3, %%xmm2\n"					\
+	    "pxor %%xmm2, %%xmm1\n"					\
+	    "movdqa %%xmm1, %%xmm4\n"					\
+	    "psrld $7, %%xmm1\n"					\
+	    "pslld $25, %%xmm4\n"					\
+	    "por %%xmm4, %%xmm1\n"					\
+	    "movdqu %%xmm0, %[a]\n"					\
+	    "movdqu %%xmm1, %[b]\n"					\
+	    "movdqu %%xmm2, %[c]\n"					\
+	    "movdqu %%xmm3, %[d]\n"					\
+	    : [a] "+m" (va), [b] "+m" (vb), [c] "+m" (vc), [d] "+m" (vd)	\
+	    : [x] "m" (mx), [y] "m" (my)				\
+	    : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4")
+
+static void
+blake3_rounds_sse2(blake3_simd_state_t *st)
+{
+	int r;
+
+	for (r = 0; r < 7; r++)
+		BLAKE3_SIMD_ROUND(BLAKE3_G_SSE2, st, BLAKE3_MSG_SCHEDULE[r]);
+}
+
+static void
+blake3_hash_many_sse2(const uint8_t * const *inputs, size_t num_inputs,
+    size_t blocks, const uint32_t key[8], uint64_t counter,
+    boolean_t increment_counter, uint8_t flags, uint8_t flags_start,
+    uint8_t flags_end, uint8_t *out)
+{
+	blake3_hash_many_simd(blake3_rounds_sse2, 4, inputs, num_inputs,
+	    blocks, key, counter, increment_counter, flags, flags_start,
+	    flags_end, out);
+}
+
+static boolean_t
+blake3_is_sse2_supported(void)
+{
+	return (zfs_sse2_available());
+}
+
+const blake3_impl_ops_t blake3_sse2_impl = {
+	.compress_in_place = blake3_compress_in_place_generic,
+	.compress_xof = blake3_compress_xof_generic,
+	.hash_many = blake3_hash_many_sse2,
+	.is_supported = blake3_is_sse2_supported,
+	.degree = 4,
+	.name = "sse2"
+};
+
+#endif /* defined(HAVE_SSE2) */
+
+#if defined(HAVE_SSE4_1)
+
+/* As BLAKE3_G_SSE2(), but xmm5 holds the byte shuffle mask. */
+#define	BLAKE3_G_SSE41(va, vb, vc, vd, mx, my)				\
+	asm volatile(							\
+	    "movdqu %[a], %%xmm0\n"					\
+	    "movdqu %[b], %%xmm1\n"					\
+	    "movdqu %[c], %%xmm2\n"					\
+	    "movdqu %[d], %%xmm3\n"					\
+	    "movdqu %[x], %%xmm4\n"					\
+	    "movdqu %[r16], %%xmm5\n"					\
+	    "paddd %%xmm1, %%xmm0\n"					\
+	    "paddd %%xmm4, %%xmm0\n"					\
+	    "pxor %%xmm0, %%xmm3\n"					\
+	    "pshufb %%xmm5, %%xmm3\n"					\
+	    "paddd %%xmm3, %%xmm2\n"					\
+	    "pxor %%xmm2, %%xmm1\n"					\
+	    "movdqa %%xmm1, %%xmm4\n"					\
+	    "psrld $12, %%xmm1\n"					\
+	    "pslld $20, %%xmm4\n"					\
+	    "por %%xmm4, %%xmm1\n"					\
+	    "movdqu %[y], %%xmm4\n"					\
+	    "movdqu %[r8], %%xmm5\n"					\
+	    "paddd %%xmm1, %%xmm0\n"					\
+	    "paddd %%xmm4, %%xmm0\n"					\
+	    "pxor %%xmm0, %%xmm3\n"					\
+	    "pshufb %%xmm5, %%xmm3\n"					\
+	    "paddd %%xmm3, %%xmm2\n"					\
+	    "pxor %%xmm2, %%xmm1\n"					\
+	    "movdqa %%xmm1, %%xmm4\n"					\
+	    "psrld $7, %%xmm1\n"					\
+	    "pslld $25, %%xmm4\n"					\
+	    "por %%xmm4, %%xmm1\n"					\
+	    "movdqu %%xmm0, %[a]\n"					\
+	    "movdqu %%xmm1, %[b]\n"					\
+	    "movdqu %%xmm2, %[c]\n"					\
+	    "movdqu %%xmm3, %[d]\n"					\
+	    : [a] "+m" (va), [b] "+m" (vb), [c] "+m" (vc), [d] "+m" (vd)	\
+	    : [x] "m" (mx), [y] "m" (my),					\
+	    [r16] "m" (blake3_rot16_mask), [r8] "m" (blake3_rot8_mask)	\
+	    : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5")
+
+static void
+blake3_rounds_sse41(blake3_simd_state_t *st)
+{
+	int r;
+
+	for (r = 0; r < 7; r++)
+		BLAKE3_SIMD_ROUND(BLAKE3_G_SSE41, st, BLAKE3_MSG_SCHEDULE[r]);
+}
+
+static void
+blake3_hash_many_sse41(const uint8_t * const *inputs, size_t num_inputs,
+    size_t blocks, const uint32_t key[8], uint64_t counter,
+    boolean_t increment_counter, uint8_t flags, uint8_t flags_start,
+    uint8_t flags_end, uint8_t *out)
+{
+	blake3_hash_many_simd(blake3_rounds_sse41, 4, inputs, num_inputs,
+	    blocks, key, counter, increment_counter, flags, flags_start,
+	    flags_end, out);
+}
+
+static boolean_t
+blake3_is_sse41_supported(void)
+{
+	return (zfs_sse4_1_available());
+}
+
+const blake3_impl_ops_t blake3_sse41_impl = {
+	.compress_in_place = blake3_compress_in_place_generic,
+	.compress_xof = blake3_compress_xof_generic,
+	.hash_many = blake3_hash_many_sse41,
+	.is_supported = blake3_is_sse41_supported,
+	.degree = 4,
+	.name = "sse41"
+};
+
+#endif /* defined(HAVE_SSE4_1) */
+
+#if defined(HAVE_AVX2)
+
+/* ymm0-ymm3 hold a, b, c and d, ymm4 is scratch. */
+#define	BLAKE3_G_AVX2(va, vb, vc, vd, mx, my)				\
+	asm volatile(							\
+	    "vmovdqu %[a], %%ymm0\n"					\
+	    "vmovdqu %[b], %%ymm1\n"					\
+	    "vmovdqu %[c], %%ymm2\n"					\
+	    "vmovdqu %[d], %%ymm3\n"					\
+	    "vpaddd %%ymm1, %%ymm0, %%ymm0\n"				\
+	    "vpaddd %[x], %%ymm0, %%ymm0\n"				\
+	    "vpxor %%ymm0, %%ymm3, %%ymm3\n"				\
+	    "vpshufb %[r16], %%ymm3, %%ymm3\n"				\
+	    "vpaddd %%ymm3, %%ymm2, %%ymm2\n"				\
+	    "vpxor %%ymm2, %%ymm1, %%ymm1\n"				\
+	    "vpsrld $12, %%ymm1, %%ymm4\n"				\
+	    "vpslld $20, %%ymm1, %%ymm1\n"				\
+	    "vpor %%ymm4, %%ymm1, %%ymm1\n"				\
+	    "vpaddd %%ymm1, %%ymm0, %%ymm0\n"				\
+	    "vpaddd %[y], %%ymm0, %%ymm0\n"				\
+	    "vpxor %%ymm0, %%ymm3, %%ymm3\n"				\
+	    "vpshufb %[r8], %%ymm3, %%ymm3\n"				\
+	    "vpaddd %%ymm3, %%ymm2, %%ymm2\n"				\
+	    "vpxor %%ymm2, %%ymm1, %%ymm1\n"				\
+	    "vpsrld $7, %%ymm1, %%ymm4\n"				\
+	    "vpslld $25, %%ymm1, %%ymm1\n"				\
+	    "vpor %%ymm4, %%ymm1, %%ymm1\n"				\
+	    "vmovdqu %%ymm0, %[a]\n"					\
+	    "vmovdqu %%ymm1, %[b]\n"					\
+	    "vmovdqu %%ymm2, %[c]\n"					\
+	    "vmovdqu %%ymm3, %[d]\n"					\
+	    : [a] "+m" (va), [b] "+m" (vb), [c] "+m" (vc), [d] "+m" (vd)	\
+	    : [x] "m" (mx), [y] "m" (my),					\
+	    [r16] "m" (blake3_rot16_mask), [r8] "m" (blake3_rot8_mask)	\
+	    : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4")
+
+static void
+blake3_rounds_avx2(blake3_simd_state_t *st)
+{
+	int r;
+
+	for (r = 0; r < 7; r++)
+		BLAKE3_SIMD_ROUND(BLAKE3_G_AVX2, st, BLAKE3_MSG_SCHEDULE[r]);
+
+	asm volatile("vzeroupper");
+}
+
+static void
+blake3_hash_many_avx2(const uint8_t * const *inputs, size_t num_inputs,
+    size_t blocks, const uint32_t key[8], uint64_t counter,
+    boolean_t increment_counter, uint8_t flags, uint8_t flags_start,
+    uint8_t flags_end, uint8_t *out)
+{
+	blake3_hash_many_simd(blake3_rounds_avx2, 8, inputs, num_inputs,
+	    blocks, key, counter, increment_counter, flags, flags_start,
+	    flags_end, out);
+}
+
+static boolean_t
+blake3_is_avx2_supported(void)
+{
+	return (zfs_avx2_available());
+}
+
+const blake3_impl_ops_t blake3_avx2_impl = {
+	.compress_in_place = blake3_compress_in_place_generic,
+	.compress_xof = blake3_compress_xof_generic,
+	.hash_many = blake3_hash_many_avx2,
+	.is_supported = blake3_is_avx2_supported,
+	.degree = 8,
+	.name = "avx2"
+};
+
+#endif /* defined(HAVE_AVX2) */
+
+#if defined(HAVE_AVX512F)
+
+/*
+ * zmm0-zmm3 hold a, b, c and d.  The clobbers name the xmm registers,
+ * which the compiler takes to cover the whole zmm register.
+ */
+#define	BLAKE3_G_AVX512(va, vb, vc, vd, mx, my)				\
+	asm volatile(							\
+	    "vmovdqu32 %[a], %%zmm0\n"					\
+	    "vmovdqu32 %[b], %%zmm1\n"					\
+	    "vmovdqu32 %[c], %%zmm2\n"					\
+	    "vmovdqu32 %[d], %%zmm3\n"					\
+	    "vpaddd %%zmm1, %%zmm0, %%zmm0\n"				\
+	    "vpaddd %[x], %%zmm0, %%zmm0\n"				\
+	    "vpxord %%zmm0, %%zmm3, %%zmm3\n"				\
+	    "vprord $16, %%zmm3, %%zmm3\n"				\
+	    "vpaddd %%zmm3, %%zmm2, %%zmm2\n"				\
+	    "vpxord %%zmm2, %%zmm1, %%zmm1\n"				\
+	    "vprord $12, %%zmm1, %%zmm1\n"				\
+	    "vpaddd %%zmm1, %%zmm0, %%zmm0\n"				\
+	    "vpaddd %[y], %%zmm0, %%zmm0\n"				\
+	    "vpxord %%zmm0, %%zmm3, %%zmm3\n"				\
+	    "vprord $8, %%zmm3, %%zmm3\n"				\
+	    "vpaddd %%zmm3, %%zmm2, %%zmm2\n"				\
+	    "vpxord %%zmm2, %%zmm1, %%zmm1\n"				\
+	    "vprord $7, %%zmm1, %%zmm1\n"				\
+	    "vmovdqu32 %%zmm0, %[a]\n"					\
+	    "vmovdqu32 %%zmm1, %[b]\n"					\
+	    "vmovdqu32 %%zmm2, %[c]\n"					\
+	    "vmovdqu32 %%zmm3, %[d]\n"					\
+	    : [a] "+m" (va), [b] "+m" (vb), [c] "+m" (vc), [d] "+m" (vd)	\
+	    : [x] "m" (mx), [y] "m" (my)				\
+	    : "xmm0", "xmm1", "xmm2", "xmm3")
+
+static void
+blake3_rounds_avx512(blake3_simd_state_t *st)
+{
+	int r;
+
+	for (r = 0; r < 7; r++)
+		BLAKE3_SIMD_ROUND(BLAKE3_G_AVX512, st, BLAKE3_MSG_SCHEDULE[r]);
+
+	asm volatile("vzeroupper");
+}
+
+static void
+blake3_hash_many_avx512(const uint8_t * const *inputs, size_t num_inputs,
+    size_t blocks, const uint32_t key[8], uint64_t counter,
+    boolean_t increment_counter, uint8_t flags, uint8_t flags_start,
+    uint8_t flags_end, uint8_t *out)
+{
+	blake3_hash_many_simd(blake3_rounds_avx512, 16, inputs, num_inputs,
+	    blocks, key, counter, increment_counter, flags, flags_start,
+	    flags_end, out);
+}
+
+static boolean_t
+blake3_is_avx512_supported(void)
+{
+	return (zfs_avx512f_available());
+}
+
+const blake3_impl_ops_t blake3_avx512_impl = {
+	.compress_in_place = blake3_compress_in_place_generic,
+	.compress_xof = blake3_compress_xof_generic,
+	.hash_many = blake3_hash_many_avx512,
+	.is_supported = blake3_is_avx512_supported,
+	.degree = 16,
+	.name = "avx512"
+};
+
+#endif /* defined(HAVE_AVX512F) */
+
+#endif /* defined(__x86_64) */
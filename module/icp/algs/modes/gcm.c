@@ -29,12 +29,53 @@
 #include <sys/crypto/impl.h>
 #include <sys/byteorder.h>
 #include <modes/gcm_impl.h>
+#include <aes/aes_impl.h>
 
 #define	GHASH(c, d, t, o) \
 	xor_block((uint8_t *)(d), (uint8_t *)(c)->gcm_ghash); \
 	(o)->mul((uint64_t *)(void *)(c)->gcm_ghash, (c)->gcm_H, \
 	(uint64_t *)(void *)(t));
 
+/*
+ * Encrypt the longest run of whole blocks at datap that also fits in one
+ * piece of the output with the implementation's stitched code, and return
+ * how many bytes that was.  It may be less than a chunk, then nothing is
+ * done.
+ */
+static size_t
+gcm_encrypt_blocks(gcm_ctx_t *ctx, const gcm_impl_ops_t *gops,
+    uint8_t *datap, size_t length, crypto_data_t *out, void **iov_or_mp,
+    offset_t *offset, size_t block_size)
+{
+	uint8_t *out_data_1 = NULL;
+	uint8_t *out_data_2;
+	size_t out_data_1_len = 0;
+	void *iov_save = *iov_or_mp;
+	offset_t offset_save = *offset;
+	size_t done;
+
+	length -= length % block_size;
+
+	/* find out how much room there is without taking it yet */
+	crypto_get_ptrs(out, iov_or_mp, offset, &out_data_1,
+	    &out_data_1_len, &out_data_2, length);
+	*iov_or_mp = iov_save;
+	*offset = offset_save;
+	if (out_data_1 == NULL)
+		return (0);
+
+	length = MIN(length, out_data_1_len);
+	done = gops->crypt_blocks(ctx, datap, out_data_1,
+	    length - length % block_size, B_TRUE);
+	if (done > 0) {
+		crypto_get_ptrs(out, iov_or_mp, offset, &out_data_1,
+		    &out_data_1_len, &out_data_2, done);
+		out->cd_offset += done;
+	}
+
+	return (done);
+}
+
 /*
  * Encrypt multiple blocks of data in GCM mode.  Decrypt for GCM mode
  * is done in another function.
@@ -75,6 +116,28 @@ gcm_mode_encrypt_contiguous_blocks(gcm_ctx_t *ctx, char *data, size_t length,
 		crypto_init_ptrs(out, &iov_or_mp, &offset);
 
 	gops = gcm_impl_get_ops();
+	if (out != NULL && ctx->gcm_remainder_len == 0 &&
+	    gops->crypt_blocks != NULL) {
+		size_t done = gcm_encrypt_blocks(ctx, gops, datap, remainder,
+		    out, &iov_or_mp, &offset, block_size);
+
+		ctx->gcm_processed_data_len += done;
+		datap += done;
+		remainder -= done;
+
+		/* Incomplete last block. */
+		if (remainder < block_size) {
+			if (remainder > 0) {
+				bcopy(datap, ctx->gcm_remainder, remainder);
+				ctx->gcm_remainder_len = remainder;
+				ctx->gcm_copy_to = datap;
+			} else {
+				ctx->gcm_copy_to = NULL;
+			}
+			return (CRYPTO_SUCCESS);
+		}
+	}
+
 	do {
 		/* Unprocessed data from last call. */
 		if (ctx->gcm_remainder_len > 0) {
@@ -337,6 +400,14 @@ gcm_decrypt_final(gcm_ctx_t *ctx, crypto_data_t *out, size_t block_size,
 	ghash = (uint8_t *)ctx->gcm_ghash;
 	blockp = ctx->gcm_pt_buf;
 	remainder = pt_len;
+	if (gops->crypt_blocks != NULL) {
+		size_t done = gops->crypt_blocks(ctx, blockp, blockp,
+		    remainder - remainder % block_size, B_FALSE);
+
+		processed += done;
+		blockp += done;
+		remainder -= done;
+	}
 	while (remainder > 0) {
 		/* Incomplete last block */
 		if (remainder < block_size) {
@@ -641,6 +712,13 @@ const gcm_impl_ops_t *gcm_all_impl[] = {
 #if defined(__x86_64) && defined(HAVE_PCLMULQDQ)
 	&gcm_pclmulqdq_impl,
 #endif
+#if defined(__x86_64) && defined(HAVE_AES) && defined(HAVE_PCLMULQDQ) && \
+	defined(HAVE_AVX2)
+	&gcm_avx2_impl,
+#if defined(HAVE_VAES) && defined(HAVE_VPCLMULQDQ)
+	&gcm_vaes_impl,
+#endif
+#endif
 };
 
 /* Indicate that benchmark has been completed */
@@ -659,6 +737,15 @@ static uint64_t user_sel_impl = IMPL_FASTEST;
 static size_t gcm_supp_impl_cnt = 0;
 static gcm_impl_ops_t *gcm_supp_impl[ARRAY_SIZE(gcm_all_impl)];
 
+#if defined(_KERNEL)
+static kstat_t *gcm_kstat;
+
+/* Throughput of each implementation, the last entry names the fastest */
+static struct gcm_kstat {
+	uint64_t encrypt;
+} gcm_stat_data[ARRAY_SIZE(gcm_all_impl) + 1];
+#endif
+
 /*
  * Selects the gcm operation
  */
@@ -696,6 +783,133 @@ gcm_impl_get_ops()
 	return (ops);
 }
 
+#if defined(_KERNEL)
+/* GCM kstats */
+
+static int
+gcm_kstat_headers(char *buf, size_t size)
+{
+	ssize_t off = 0;
+
+	off += snprintf(buf + off, size, "%-17s", "implementation");
+	(void) snprintf(buf + off, size - off, "%-15s\n", "encrypt");
+
+	return (0);
+}
+
+static int
+gcm_kstat_data(char *buf, size_t size, void *data)
+{
+	struct gcm_kstat *fastest_stat = &gcm_stat_data[gcm_supp_impl_cnt];
+	struct gcm_kstat *curr_stat = (struct gcm_kstat *)data;
+	ssize_t off = 0;
+
+	if (curr_stat == fastest_stat) {
+		off += snprintf(buf + off, size - off, "%-17s", "fastest");
+		(void) snprintf(buf + off, size - off, "%-15s\n",
+		    gcm_supp_impl[fastest_stat->encrypt]->name);
+	} else {
+		ptrdiff_t id = curr_stat - gcm_stat_data;
+
+		off += snprintf(buf + off, size - off, "%-17s",
+		    gcm_supp_impl[id]->name);
+		(void) snprintf(buf + off, size - off, "%-15llu\n",
+		    (u_longlong_t)curr_stat->encrypt);
+	}
+
+	return (0);
+}
+
+static void *
+gcm_kstat_addr(kstat_t *ksp, int64_t n)
+{
+	if (n <= gcm_supp_impl_cnt)
+		ksp->ks_private = (void *) (gcm_stat_data + n);
+	else
+		ksp->ks_private = NULL;
+
+	return (ksp->ks_private);
+}
+
+#define	GCM_BENCH_NS	(MSEC2NSEC(25))		/* 25ms */
+
+/*
+ * Bytes per second encrypted with AES-256 in GCM mode by the chosen
+ * implementation, in place.
+ */
+static uint64_t
+gcm_benchmark_run(void *keysched, uint8_t *data, uint64_t data_size)
+{
+	uint64_t run_count = 0, run_time_ns, run_bw;
+	crypto_data_t out = { 0 };
+	gcm_ctx_t *ctx;
+	hrtime_t start;
+
+	ctx = kmem_zalloc(sizeof (gcm_ctx_t), KM_SLEEP);
+	ctx->gcm_keysched = keysched;
+	(void) aes_encrypt_block(keysched, (uint8_t *)ctx->gcm_H,
+	    (uint8_t *)ctx->gcm_H);
+
+	out.cd_format = CRYPTO_DATA_RAW;
+	out.cd_length = data_size;
+	out.cd_raw.iov_base = (char *)data;
+	out.cd_raw.iov_len = data_size;
+
+	kpreempt_disable();
+	start = gethrtime();
+	do {
+		out.cd_offset = 0;
+		(void) gcm_mode_encrypt_contiguous_blocks(ctx, (char *)data,
+		    data_size, &out, AES_BLOCK_LEN, aes_encrypt_block,
+		    aes_copy_block, aes_xor_block);
+		run_count++;
+
+		run_time_ns = gethrtime() - start;
+	} while (run_time_ns < GCM_BENCH_NS);
+	kpreempt_enable();
+
+	bzero(ctx, sizeof (gcm_ctx_t));
+	kmem_free(ctx, sizeof (gcm_ctx_t));
+
+	run_bw = data_size * run_count * NANOSEC;
+	run_bw /= run_time_ns;	/* B/s */
+
+	return (run_bw);
+}
+
+/*
+ * Measure the throughput of every supported implementation, and make the
+ * fastest one the "fastest" implementation.
+ */
+static void
+gcm_benchmark_impl(void *keysched, uint8_t *data, uint64_t data_size)
+{
+	struct gcm_kstat *fastest_stat = &gcm_stat_data[gcm_supp_impl_cnt];
+	uint64_t best = 0;
+	uint32_t i;
+
+	fastest_stat->encrypt = 0;
+	for (i = 0; i < gcm_supp_impl_cnt; i++) {
+		struct gcm_kstat *stat = &gcm_stat_data[i];
+
+		/* temporary set an implementation */
+		icp_gcm_impl = i;
+
+		stat->encrypt = gcm_benchmark_run(keysched, data, data_size);
+		if (stat->encrypt > best) {
+			best = stat->encrypt;
+			fastest_stat->encrypt = i;
+		}
+
+		dprintf("%s: %14s %16llu B/s\n", __func__,
+		    gcm_supp_impl[i]->name, (u_longlong_t)stat->encrypt);
+	}
+
+	memcpy(&gcm_fastest_impl, gcm_supp_impl[fastest_stat->encrypt],
+	    sizeof (gcm_fastest_impl));
+}
+#endif
+
 void
 gcm_impl_init(void)
 {
@@ -711,15 +925,48 @@ gcm_impl_init(void)
 	}
 	gcm_supp_impl_cnt = c;
 
-	/* set fastest implementation. assume hardware accelerated is fastest */
-#if defined(__x86_64) && defined(HAVE_PCLMULQDQ)
-	if (gcm_pclmulqdq_impl.is_supported())
-		memcpy(&gcm_fastest_impl, &gcm_pclmulqdq_impl,
-		    sizeof (gcm_fastest_impl));
-	else
+#if !defined(_KERNEL)
+	/* Skip benchmarking and use last implementation as fastest */
+	memcpy(&gcm_fastest_impl, gcm_supp_impl[gcm_supp_impl_cnt - 1],
+	    sizeof (gcm_fastest_impl));
+#else
+	/* Benchmark all supported implementations with a 128k block */
+	{
+		static const size_t data_size = 1 << 17;
+		uint8_t key[AES_MAX_KEY_BYTES];
+		uint8_t *databuf;
+		void *keysched;
+		size_t size;
+
+		keysched = aes_alloc_keysched(&size, KM_SLEEP);
+		for (i = 0; i < sizeof (key); i++)
+			key[i] = i;
+		aes_init_keysched(key, AES_MAXBITS, keysched);
+
+		databuf = kmem_alloc(data_size, KM_SLEEP);
+		for (i = 0; i < data_size / sizeof (uint64_t); i++)
+			((uint64_t *)databuf)[i] = (uintptr_t)(databuf + i);
+
+		gcm_benchmark_impl(keysched, databuf, data_size);
+
+		kmem_free(databuf, data_size);
+		bzero(keysched, size);
+		kmem_free(keysched, size);
+	}
+
+	/* install kstats for all implementations */
+	gcm_kstat = kstat_create("zfs", 0, "gcm_bench", "misc",
+	    KSTAT_TYPE_RAW, 0, KSTAT_FLAG_VIRTUAL);
+	if (gcm_kstat != NULL) {
+		gcm_kstat->ks_data = NULL;
+		gcm_kstat->ks_ndata = UINT32_MAX;
+		kstat_set_raw_ops(gcm_kstat,
+		    gcm_kstat_headers,
+		    gcm_kstat_data,
+		    gcm_kstat_addr);
+		kstat_install(gcm_kstat);
+	}
 #endif
-		memcpy(&gcm_fastest_impl, &gcm_generic_impl,
-		    sizeof (gcm_fastest_impl));
 
 	strlcpy(gcm_fastest_impl.name, "fastest", sizeof(gcm_fastest_impl.name));
 
@@ -728,6 +975,17 @@ gcm_impl_init(void)
 	gcm_impl_initialized = B_TRUE;
 }
 
+void
+gcm_impl_fini(void)
+{
+#if defined(_KERNEL)
+	if (gcm_kstat != NULL) {
+		kstat_delete(gcm_kstat);
+		gcm_kstat = NULL;
+	}
+#endif
+}
+
 static const struct {
 	char *name;
 	uint64_t sel;
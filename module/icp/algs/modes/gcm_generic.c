@@ -78,6 +78,7 @@ gcm_generic_will_work(void)
 
 const gcm_impl_ops_t gcm_generic_impl = {
 	.mul = &gcm_generic_mul,
+	.crypt_blocks = NULL,
 	.is_supported = &gcm_generic_will_work,
 	.name = "generic"
 };
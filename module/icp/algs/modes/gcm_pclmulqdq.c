@@ -57,6 +57,7 @@ gcm_pclmulqdq_will_work(void)
 
 const gcm_impl_ops_t gcm_pclmulqdq_impl = {
 	.mul = &gcm_pclmulqdq_mul,
+	.crypt_blocks = NULL,
 	.is_supported = &gcm_pclmulqdq_will_work,
 	.name = "pclmulqdq"
 };
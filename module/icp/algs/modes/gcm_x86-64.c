@@ -0,0 +1,577 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * AVX2 and VAES implementations of GCM, which encrypt whole chunks of
+ * counter blocks with AES-NI and fold them into the GHASH in the same
+ * pass ("stitched"), instead of one aes_encrypt_block() and one GHASH
+ * multiplication per block.
+ *
+ * avx2 works on 8 blocks at a time in xmm registers, vaes on 16 blocks,
+ * two per ymm register, with the VAES and VPCLMULQDQ instructions.  The
+ * AES rounds of a chunk are interleaved with the carry-less
+ * multiplications of 8 or 16 ciphertext blocks by H^8..H^1 or
+ * H^16..H^1, whose sum is only reduced once per chunk.  Decryption hashes
+ * the chunk it decrypts.  Encryption hashes the previous chunk, so the
+ * first chunk is encrypted only and the last one hashed only.
+ *
+ * As in gcm_pclmulqdq.S the field elements are byte reversed, which puts
+ * the GHASH bit order upside down: products are shifted left by one bit
+ * before they are reduced.  Counter blocks are kept byte reversed too,
+ * so that the 32-bit counter is the lowest lane and vpaddd increments it
+ * modulo 2^32.  Blocks that do not fill a chunk are left to the per block
+ * code in gcm.c, which uses the pclmulqdq multiplication.
+ *
+ * Both need the AES key schedule laid out by aes_impl_aesni.c; with
+ * another AES implementation selected they encrypt nothing.
+ */
+
+#if defined(__x86_64) && defined(HAVE_AES) && defined(HAVE_PCLMULQDQ) && \
+	defined(HAVE_AVX2)
+
+#include <sys/zfs_context.h>
+#include <sys/simd_x86.h>
+#include <sys/byteorder.h>
+#include <modes/modes.h>
+#include <modes/gcm_impl.h>
+#include <aes/aes_impl.h>
+
+/* asm-x86_64/modes/gcm_pclmulqdq.S, for blocks outside of whole chunks */
+extern void gcm_mul_pclmulqdq(uint64_t *, uint64_t *, uint64_t *);
+
+#define	GCM_X86_HTAB_LEN	16	/* powers of H in the table */
+
+static const uint8_t gcm_x86_bswap[16] __attribute__((aligned(16))) = {
+	15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+};
+
+/* Counter increments: by one, and by one and two or two in each lane */
+static const uint32_t gcm_x86_one[4] __attribute__((aligned(16))) = {
+	1, 0, 0, 0
+};
+static const uint32_t gcm_x86_inc12[8] __attribute__((aligned(32))) = {
+	1, 0, 0, 0, 2, 0, 0, 0
+};
+static const uint32_t gcm_x86_inc2[8] __attribute__((aligned(32))) = {
+	2, 0, 0, 0, 2, 0, 0, 0
+};
+
+/*
+ * Register use in all of the asm statements below: the counter blocks
+ * being encrypted are in 0-7, the round key in 8, the low, middle and
+ * high halves of the GHASH sum in 9, 10 and 11, 12 and 13 are scratch,
+ * 14 is the byte reversal mask and 15 the last counter used.  Once a
+ * chunk is encrypted and stored 0-8 are free for the reduction.
+ *
+ * The macros take the register prefix, x for the 8 block code and y for
+ * the 16 block one.
+ */
+#define	GCM_X86_R(v, n)		"%%" #v "mm" #n
+
+/*
+ * The chunk operations use all 16 vector registers.  The clobbers name the
+ * xmm registers, which covers their ymm halves too.
+ */
+#define	GCM_X86_CLOBBERS						\
+	"cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",	\
+	"xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11", "xmm12",	\
+	"xmm13", "xmm14", "xmm15"
+
+#define	GCM_X86_KEY_x(off)						\
+	"vmovdqu " #off "(%[rk]), %%xmm8\n"
+#define	GCM_X86_KEY_y(off)						\
+	"vbroadcasti128 " #off "(%[rk]), %%ymm8\n"
+
+#define	GCM_X86_AESENC(v, op)						\
+	op " " GCM_X86_R(v, 8) ", " GCM_X86_R(v, 0) ", " GCM_X86_R(v, 0) "\n" \
+	op " " GCM_X86_R(v, 8) ", " GCM_X86_R(v, 1) ", " GCM_X86_R(v, 1) "\n" \
+	op " " GCM_X86_R(v, 8) ", " GCM_X86_R(v, 2) ", " GCM_X86_R(v, 2) "\n" \
+	op " " GCM_X86_R(v, 8) ", " GCM_X86_R(v, 3) ", " GCM_X86_R(v, 3) "\n" \
+	op " " GCM_X86_R(v, 8) ", " GCM_X86_R(v, 4) ", " GCM_X86_R(v, 4) "\n" \
+	op " " GCM_X86_R(v, 8) ", " GCM_X86_R(v, 5) ", " GCM_X86_R(v, 5) "\n" \
+	op " " GCM_X86_R(v, 8) ", " GCM_X86_R(v, 6) ", " GCM_X86_R(v, 6) "\n" \
+	op " " GCM_X86_R(v, 8) ", " GCM_X86_R(v, 7) ", " GCM_X86_R(v, 7) "\n"
+
+/* AES round r of the chunk, r = 1..8, followed by any GHASH step */
+#define	GCM_X86_ROUND(v, off, ghash)					\
+	GCM_X86_KEY_##v(off)						\
+	GCM_X86_AESENC(v, "vaesenc")					\
+	ghash
+
+/* The rounds from 9 on, which depend on the key size, and the last one */
+#define	GCM_X86_LAST_ROUNDS(v)						\
+	GCM_X86_KEY_##v(144)						\
+	GCM_X86_AESENC(v, "vaesenc")					\
+	GCM_X86_KEY_##v(160)						\
+	"cmpl $10, %[nr]\n"						\
+	"je 2f\n"							\
+	GCM_X86_AESENC(v, "vaesenc")					\
+	GCM_X86_KEY_##v(176)						\
+	GCM_X86_AESENC(v, "vaesenc")					\
+	GCM_X86_KEY_##v(192)						\
+	"cmpl $12, %[nr]\n"						\
+	"je 2f\n"							\
+	GCM_X86_AESENC(v, "vaesenc")					\
+	GCM_X86_KEY_##v(208)						\
+	GCM_X86_AESENC(v, "vaesenc")					\
+	GCM_X86_KEY_##v(224)						\
+	"2:\n"								\
+	GCM_X86_AESENC(v, "vaesenclast")
+
+/* XOR the key stream of block register n with the input, and store it */
+#define	GCM_X86_XOR_STORE(v, n, off)					\
+	"vpxor " #off "(%[in]), " GCM_X86_R(v, n) ", " GCM_X86_R(v, n) "\n" \
+	"vmovdqu " GCM_X86_R(v, n) ", " #off "(%[out])\n"
+
+/* Counter blocks for the 8 block chunk, whitened with round key 0 */
+#define	GCM_AVX2_CTR(n)							\
+	"vpaddd %[one], %%xmm15, %%xmm15\n"				\
+	"vpshufb %%xmm14, %%xmm15, %%xmm" #n "\n"			\
+	"vpxor %%xmm8, %%xmm" #n ", %%xmm" #n "\n"
+
+/* And for the 16 block one, two counters per register */
+#define	GCM_VAES_CTR(n)							\
+	"vpaddd %[inc12], %%ymm15, %%ymm" #n "\n"			\
+	"vpaddd %[inc2], %%ymm15, %%ymm15\n"				\
+	"vpshufb %%ymm14, %%ymm" #n ", %%ymm" #n "\n"			\
+	"vpxor %%ymm8, %%ymm" #n ", %%ymm" #n "\n"
+
+/*
+ * Load the ciphertext block(s) at doff of the hashed chunk, and add their
+ * products with the powers of H at hoff of the table to the GHASH sum.
+ * The first block of a chunk also gets the running GHASH added.
+ */
+#define	GCM_X86_GHASH_LOAD(v, doff)					\
+	"vmovdqu " #doff "(%[hp]), " GCM_X86_R(v, 12) "\n"		\
+	"vpshufb " GCM_X86_R(v, 14) ", " GCM_X86_R(v, 12) ", "		\
+	    GCM_X86_R(v, 12) "\n"
+
+#define	GCM_X86_GHASH_ADD(v)						\
+	"vpxor %[gh], " GCM_X86_R(v, 12) ", " GCM_X86_R(v, 12) "\n"
+
+#define	GCM_X86_GHASH_MUL(v, hoff)					\
+	"vpclmulqdq $0x00, " #hoff "(%[htab]), " GCM_X86_R(v, 12) ", "	\
+	    GCM_X86_R(v, 13) "\n"					\
+	"vpxor " GCM_X86_R(v, 13) ", " GCM_X86_R(v, 9) ", "		\
+	    GCM_X86_R(v, 9) "\n"					\
+	"vpclmulqdq $0x11, " #hoff "(%[htab]), " GCM_X86_R(v, 12) ", "	\
+	    GCM_X86_R(v, 13) "\n"					\
+	"vpxor " GCM_X86_R(v, 13) ", " GCM_X86_R(v, 11) ", "		\
+	    GCM_X86_R(v, 11) "\n"					\
+	"vpclmulqdq $0x01, " #hoff "(%[htab]), " GCM_X86_R(v, 12) ", "	\
+	    GCM_X86_R(v, 13) "\n"					\
+	"vpxor " GCM_X86_R(v, 13) ", " GCM_X86_R(v, 10) ", "		\
+	    GCM_X86_R(v, 10) "\n"					\
+	"vpclmulqdq $0x10, " #hoff "(%[htab]), " GCM_X86_R(v, 12) ", "	\
+	    GCM_X86_R(v, 13) "\n"					\
+	"vpxor " GCM_X86_R(v, 13) ", " GCM_X86_R(v, 10) ", "		\
+	    GCM_X86_R(v, 10) "\n"
+
+#define	GCM_X86_GHASH_FIRST(v, hoff)					\
+	"vpxor %%xmm9, %%xmm9, %%xmm9\n"				\
+	"vpxor %%xmm10, %%xmm10, %%xmm10\n"				\
+	"vpxor %%xmm11, %%xmm11, %%xmm11\n"				\
+	GCM_X86_GHASH_LOAD(v, 0)					\
+	GCM_X86_GHASH_ADD(v)						\
+	GCM_X86_GHASH_MUL(v, hoff)
+
+#define	GCM_X86_GHASH(v, doff, hoff)					\
+	GCM_X86_GHASH_LOAD(v, doff)					\
+	GCM_X86_GHASH_MUL(v, hoff)
+
+/* Add the upper lanes of the 16 block sum to the lower ones */
+#define	GCM_VAES_FOLD							\
+	"vextracti128 $1, %%ymm9, %%xmm12\n"				\
+	"vpxor %%xmm12, %%xmm9, %%xmm9\n"				\
+	"vextracti128 $1, %%ymm10, %%xmm12\n"				\
+	"vpxor %%xmm12, %%xmm10, %%xmm10\n"				\
+	"vextracti128 $1, %%ymm11, %%xmm12\n"				\
+	"vpxor %%xmm12, %%xmm11, %%xmm11\n"
+
+/*
+ * Put the 256-bit sum in 9, 10 and 11 together, shift it left by one bit
+ * and reduce it modulo the GCM polynomial into gh, the same way as
+ * gcm_mul_pclmulqdq() does.
+ */
+#define	GCM_X86_REDUCE							\
+	"vpslldq $8, %%xmm10, %%xmm12\n"				\
+	"vpsrldq $8, %%xmm10, %%xmm13\n"				\
+	"vpxor %%xmm12, %%xmm9, %%xmm3\n"				\
+	"vpxor %%xmm13, %%xmm11, %%xmm6\n"				\
+	"vpsrld $31, %%xmm3, %%xmm7\n"					\
+	"vpsrld $31, %%xmm6, %%xmm8\n"					\
+	"vpslld $1, %%xmm3, %%xmm3\n"					\
+	"vpslld $1, %%xmm6, %%xmm6\n"					\
+	"vpsrldq $12, %%xmm7, %%xmm9\n"					\
+	"vpslldq $4, %%xmm8, %%xmm8\n"					\
+	"vpslldq $4, %%xmm7, %%xmm7\n"					\
+	"vpor %%xmm7, %%xmm3, %%xmm3\n"					\
+	"vpor %%xmm8, %%xmm6, %%xmm6\n"					\
+	"vpor %%xmm9, %%xmm6, %%xmm6\n"					\
+	"vpslld $31, %%xmm3, %%xmm7\n"					\
+	"vpslld $30, %%xmm3, %%xmm8\n"					\
+	"vpslld $25, %%xmm3, %%xmm9\n"					\
+	"vpxor %%xmm8, %%xmm7, %%xmm7\n"				\
+	"vpxor %%xmm9, %%xmm7, %%xmm7\n"				\
+	"vpsrldq $4, %%xmm7, %%xmm8\n"					\
+	"vpslldq $12, %%xmm7, %%xmm7\n"					\
+	"vpxor %%xmm7, %%xmm3, %%xmm3\n"				\
+	"vpsrld $1, %%xmm3, %%xmm2\n"					\
+	"vpsrld $2, %%xmm3, %%xmm4\n"					\
+	"vpsrld $7, %%xmm3, %%xmm5\n"					\
+	"vpxor %%xmm4, %%xmm2, %%xmm2\n"				\
+	"vpxor %%xmm5, %%xmm2, %%xmm2\n"				\
+	"vpxor %%xmm8, %%xmm2, %%xmm2\n"				\
+	"vpxor %%xmm2, %%xmm3, %%xmm3\n"				\
+	"vpxor %%xmm3, %%xmm6, %%xmm6\n"				\
+	"vmovdqu %%xmm6, %[gh]\n"
+
+/*
+ * Fill htab with H^16 down to H^1, byte reversed, so that block i of a
+ * chunk of n blocks is multiplied by entry 16 - n + i.
+ */
+static void
+gcm_x86_htab(const uint64_t *H, uint64_t htab[GCM_X86_HTAB_LEN][2])
+{
+	uint64_t gh[2];
+	int i;
+
+	htab[GCM_X86_HTAB_LEN - 1][0] = BSWAP_64(H[1]);
+	htab[GCM_X86_HTAB_LEN - 1][1] = BSWAP_64(H[0]);
+	for (i = GCM_X86_HTAB_LEN - 2; i >= 0; i--) {
+		asm volatile(
+		    "vmovdqu %[a], %%xmm12\n"
+		    "vpclmulqdq $0x00, %[b], %%xmm12, %%xmm9\n"
+		    "vpclmulqdq $0x11, %[b], %%xmm12, %%xmm11\n"
+		    "vpclmulqdq $0x01, %[b], %%xmm12, %%xmm10\n"
+		    "vpclmulqdq $0x10, %[b], %%xmm12, %%xmm13\n"
+		    "vpxor %%xmm13, %%xmm10, %%xmm10\n"
+		    GCM_X86_REDUCE
+		    : [gh] "=m" (gh)
+		    : [a] "m" (htab[i + 1]),
+		    [b] "m" (htab[GCM_X86_HTAB_LEN - 1])
+		    : "cc", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",
+		    "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13");
+		htab[i][0] = gh[0];
+		htab[i][1] = gh[1];
+	}
+}
+
+/* The GHASH multiplication of single blocks, as in gcm_pclmulqdq.c */
+static void
+gcm_x86_mul(uint64_t *x_in, uint64_t *y, uint64_t *res)
+{
+	kfpu_begin();
+	gcm_mul_pclmulqdq(x_in, y, res);
+	kfpu_end();
+}
+
+/*
+ * Whether the key schedule of ctx is the one of AES-NI, which the asm
+ * below reads its round keys from.
+ */
+static boolean_t
+gcm_x86_key_usable(const gcm_ctx_t *ctx)
+{
+	const aes_key_t *ks = ctx->gcm_keysched;
+
+	return (ks->ops->generate == aes_aesni_impl.generate &&
+	    (ks->nr == 10 || ks->nr == 12 || ks->nr == 14));
+}
+
+/*
+ * The three chunk operations of the 8 block code: encrypt only, encrypt
+ * and hash the chunk at hp, and hash only.  in, out and hp may be the
+ * same.
+ */
+#define	GCM_AVX2_CHUNK		(8 * 16)
+
+#define	GCM_X86_CTR_OPERANDS						\
+	    [in] "r" (in), [out] "r" (out), [rk] "r" (rk),		\
+	    [nr] "r" (nr), [mask] "m" (gcm_x86_bswap),			\
+	    [one] "m" (gcm_x86_one),					\
+	    [inc12] "m" (gcm_x86_inc12), [inc2] "m" (gcm_x86_inc2)
+
+#define	GCM_AVX2_CTR_START						\
+	"vmovdqu %[mask], %%xmm14\n"					\
+	"vmovdqu %[cb], %%xmm15\n"					\
+	"vpshufb %%xmm14, %%xmm15, %%xmm15\n"				\
+	GCM_X86_KEY_x(0)						\
+	GCM_AVX2_CTR(0) GCM_AVX2_CTR(1) GCM_AVX2_CTR(2) GCM_AVX2_CTR(3)	\
+	GCM_AVX2_CTR(4) GCM_AVX2_CTR(5) GCM_AVX2_CTR(6) GCM_AVX2_CTR(7)
+
+#define	GCM_AVX2_CTR_END_STORE						\
+	GCM_X86_XOR_STORE(x, 0, 0) GCM_X86_XOR_STORE(x, 1, 16)		\
+	GCM_X86_XOR_STORE(x, 2, 32) GCM_X86_XOR_STORE(x, 3, 48)		\
+	GCM_X86_XOR_STORE(x, 4, 64) GCM_X86_XOR_STORE(x, 5, 80)		\
+	GCM_X86_XOR_STORE(x, 6, 96) GCM_X86_XOR_STORE(x, 7, 112)	\
+	"vpshufb %%xmm14, %%xmm15, %%xmm12\n"				\
+	"vmovdqu %%xmm12, %[cb]\n"
+
+static void
+gcm_avx2_encrypt_chunk(const uint32_t *rk, int nr, uint64_t *cb,
+    const uint8_t *in, uint8_t *out)
+{
+	asm volatile(
+	    GCM_AVX2_CTR_START
+	    GCM_X86_ROUND(x, 16, "") GCM_X86_ROUND(x, 32, "")
+	    GCM_X86_ROUND(x, 48, "") GCM_X86_ROUND(x, 64, "")
+	    GCM_X86_ROUND(x, 80, "") GCM_X86_ROUND(x, 96, "")
+	    GCM_X86_ROUND(x, 112, "") GCM_X86_ROUND(x, 128, "")
+	    GCM_X86_LAST_ROUNDS(x)
+	    GCM_AVX2_CTR_END_STORE
+	        : [cb] "+m" (*(uint64_t (*)[2])cb)
+	    : GCM_X86_CTR_OPERANDS
+	    : GCM_X86_CLOBBERS);
+}
+
+static void
+gcm_avx2_stitched_chunk(const uint32_t *rk, int nr, uint64_t *cb,
+    uint64_t *gh, const uint64_t *htab, const uint8_t *hp,
+    const uint8_t *in, uint8_t *out)
+{
+	asm volatile(
+	    GCM_AVX2_CTR_START
+	    GCM_X86_ROUND(x, 16, GCM_X86_GHASH_FIRST(x, 128))
+	    GCM_X86_ROUND(x, 32, GCM_X86_GHASH(x, 16, 144))
+	    GCM_X86_ROUND(x, 48, GCM_X86_GHASH(x, 32, 160))
+	    GCM_X86_ROUND(x, 64, GCM_X86_GHASH(x, 48, 176))
+	    GCM_X86_ROUND(x, 80, GCM_X86_GHASH(x, 64, 192))
+	    GCM_X86_ROUND(x, 96, GCM_X86_GHASH(x, 80, 208))
+	    GCM_X86_ROUND(x, 112, GCM_X86_GHASH(x, 96, 224))
+	    GCM_X86_ROUND(x, 128, GCM_X86_GHASH(x, 112, 240))
+	    GCM_X86_LAST_ROUNDS(x)
+	    GCM_AVX2_CTR_END_STORE
+	    GCM_X86_REDUCE
+	        : [cb] "+m" (*(uint64_t (*)[2])cb),
+	    [gh] "+m" (*(uint64_t (*)[4])gh)
+	    : GCM_X86_CTR_OPERANDS, [hp] "r" (hp), [htab] "r" (htab)
+	    : GCM_X86_CLOBBERS);
+}
+
+static void
+gcm_avx2_ghash_chunk(uint64_t *gh, const uint64_t *htab, const uint8_t *hp)
+{
+	asm volatile(
+	    "vmovdqu %[mask], %%xmm14\n"
+	    GCM_X86_GHASH_FIRST(x, 128)
+	    GCM_X86_GHASH(x, 16, 144)
+	    GCM_X86_GHASH(x, 32, 160)
+	    GCM_X86_GHASH(x, 48, 176)
+	    GCM_X86_GHASH(x, 64, 192)
+	    GCM_X86_GHASH(x, 80, 208)
+	    GCM_X86_GHASH(x, 96, 224)
+	    GCM_X86_GHASH(x, 112, 240)
+	    GCM_X86_REDUCE
+	        : [gh] "+m" (*(uint64_t (*)[4])gh)
+	    : [hp] "r" (hp), [htab] "r" (htab), [mask] "m" (gcm_x86_bswap)
+	    : GCM_X86_CLOBBERS);
+}
+
+/*
+ * Run the chunks of len bytes through the chunk operations, keeping the
+ * counter and the GHASH in ctx up to date, and return the number of
+ * bytes done, a multiple of chunk.
+ */
+typedef void (*gcm_x86_encrypt_f)(const uint32_t *, int, uint64_t *,
+    const uint8_t *, uint8_t *);
+typedef void (*gcm_x86_stitched_f)(const uint32_t *, int, uint64_t *,
+    uint64_t *, const uint64_t *, const uint8_t *, const uint8_t *,
+    uint8_t *);
+typedef void (*gcm_x86_ghash_f)(uint64_t *, const uint64_t *,
+    const uint8_t *);
+
+static size_t
+gcm_x86_crypt_blocks(gcm_ctx_t *ctx, const uint8_t *in, uint8_t *out,
+    size_t len, boolean_t encrypt, size_t chunk, gcm_x86_encrypt_f encf,
+    gcm_x86_stitched_f stitchf, gcm_x86_ghash_f ghashf)
+{
+	const aes_key_t *ks = ctx->gcm_keysched;
+	const uint32_t *rk = &ks->encr_ks.ks32[0];
+	uint64_t htab[GCM_X86_HTAB_LEN][2] __attribute__((aligned(32)));
+	uint64_t gh[4] __attribute__((aligned(32)));
+	size_t done;
+
+	len -= len % chunk;
+	if (len == 0 || !gcm_x86_key_usable(ctx))
+		return (0);
+
+	gh[0] = BSWAP_64(ctx->gcm_ghash[1]);
+	gh[1] = BSWAP_64(ctx->gcm_ghash[0]);
+	gh[2] = gh[3] = 0;
+
+	kfpu_begin();
+	gcm_x86_htab(ctx->gcm_H, htab);
+
+	if (encrypt) {
+		encf(rk, ks->nr, ctx->gcm_cb, in, out);
+		for (done = chunk; done < len; done += chunk) {
+			stitchf(rk, ks->nr, ctx->gcm_cb, gh, &htab[0][0],
+			    out + done - chunk, in + done, out + done);
+		}
+		ghashf(gh, &htab[0][0], out + done - chunk);
+	} else {
+		for (done = 0; done < len; done += chunk) {
+			stitchf(rk, ks->nr, ctx->gcm_cb, gh, &htab[0][0],
+			    in + done, in + done, out + done);
+		}
+	}
+	asm volatile("vzeroupper");
+	kfpu_end();
+
+	ctx->gcm_ghash[0] = BSWAP_64(gh[1]);
+	ctx->gcm_ghash[1] = BSWAP_64(gh[0]);
+	bzero(htab, sizeof (htab));
+
+	return (len);
+}
+
+static size_t
+gcm_avx2_crypt_blocks(gcm_ctx_t *ctx, const uint8_t *in, uint8_t *out,
+    size_t len, boolean_t encrypt)
+{
+	return (gcm_x86_crypt_blocks(ctx, in, out, len, encrypt,
+	    GCM_AVX2_CHUNK, gcm_avx2_encrypt_chunk, gcm_avx2_stitched_chunk,
+	    gcm_avx2_ghash_chunk));
+}
+
+static boolean_t
+gcm_avx2_will_work(void)
+{
+	return (zfs_avx2_available() && zfs_aes_available() &&
+	    zfs_pclmulqdq_available());
+}
+
+const gcm_impl_ops_t gcm_avx2_impl = {
+	.mul = &gcm_x86_mul,
+	.crypt_blocks = &gcm_avx2_crypt_blocks,
+	.is_supported = &gcm_avx2_will_work,
+	.name = "avx2"
+};
+
+#if defined(HAVE_VAES) && defined(HAVE_VPCLMULQDQ)
+
+#define	GCM_VAES_CHUNK		(16 * 16)
+
+#define	GCM_VAES_CTR_START						\
+	"vbroadcasti128 %[mask], %%ymm14\n"				\
+	"vbroadcasti128 %[cb], %%ymm15\n"				\
+	"vpshufb %%ymm14, %%ymm15, %%ymm15\n"				\
+	GCM_X86_KEY_y(0)						\
+	GCM_VAES_CTR(0) GCM_VAES_CTR(1) GCM_VAES_CTR(2) GCM_VAES_CTR(3)	\
+	GCM_VAES_CTR(4) GCM_VAES_CTR(5) GCM_VAES_CTR(6) GCM_VAES_CTR(7)
+
+#define	GCM_VAES_CTR_END_STORE						\
+	GCM_X86_XOR_STORE(y, 0, 0) GCM_X86_XOR_STORE(y, 1, 32)		\
+	GCM_X86_XOR_STORE(y, 2, 64) GCM_X86_XOR_STORE(y, 3, 96)		\
+	GCM_X86_XOR_STORE(y, 4, 128) GCM_X86_XOR_STORE(y, 5, 160)	\
+	GCM_X86_XOR_STORE(y, 6, 192) GCM_X86_XOR_STORE(y, 7, 224)	\
+	"vpshufb %%xmm14, %%xmm15, %%xmm12\n"				\
+	"vmovdqu %%xmm12, %[cb]\n"
+
+static void
+gcm_vaes_encrypt_chunk(const uint32_t *rk, int nr, uint64_t *cb,
+    const uint8_t *in, uint8_t *out)
+{
+	asm volatile(
+	    GCM_VAES_CTR_START
+	    GCM_X86_ROUND(y, 16, "") GCM_X86_ROUND(y, 32, "")
+	    GCM_X86_ROUND(y, 48, "") GCM_X86_ROUND(y, 64, "")
+	    GCM_X86_ROUND(y, 80, "") GCM_X86_ROUND(y, 96, "")
+	    GCM_X86_ROUND(y, 112, "") GCM_X86_ROUND(y, 128, "")
+	    GCM_X86_LAST_ROUNDS(y)
+	    GCM_VAES_CTR_END_STORE
+	        : [cb] "+m" (*(uint64_t (*)[2])cb)
+	    : GCM_X86_CTR_OPERANDS
+	    : GCM_X86_CLOBBERS);
+}
+
+static void
+gcm_vaes_stitched_chunk(const uint32_t *rk, int nr, uint64_t *cb,
+    uint64_t *gh, const uint64_t *htab, const uint8_t *hp,
+    const uint8_t *in, uint8_t *out)
+{
+	asm volatile(
+	    GCM_VAES_CTR_START
+	    GCM_X86_ROUND(y, 16, GCM_X86_GHASH_FIRST(y, 0))
+	    GCM_X86_ROUND(y, 32, GCM_X86_GHASH(y, 32, 32))
+	    GCM_X86_ROUND(y, 48, GCM_X86_GHASH(y, 64, 64))
+	    GCM_X86_ROUND(y, 64, GCM_X86_GHASH(y, 96, 96))
+	    GCM_X86_ROUND(y, 80, GCM_X86_GHASH(y, 128, 128))
+	    GCM_X86_ROUND(y, 96, GCM_X86_GHASH(y, 160, 160))
+	    GCM_X86_ROUND(y, 112, GCM_X86_GHASH(y, 192, 192))
+	    GCM_X86_ROUND(y, 128, GCM_X86_GHASH(y, 224, 224))
+	    GCM_X86_LAST_ROUNDS(y)
+	    GCM_VAES_CTR_END_STORE
+	    GCM_VAES_FOLD
+	    GCM_X86_REDUCE
+	        : [cb] "+m" (*(uint64_t (*)[2])cb),
+	    [gh] "+m" (*(uint64_t (*)[4])gh)
+	    : GCM_X86_CTR_OPERANDS, [hp] "r" (hp), [htab] "r" (htab)
+	    : GCM_X86_CLOBBERS);
+}
+
+static void
+gcm_vaes_ghash_chunk(uint64_t *gh, const uint64_t *htab, const uint8_t *hp)
+{
+	asm volatile(
+	    "vbroadcasti128 %[mask], %%ymm14\n"
+	    GCM_X86_GHASH_FIRST(y, 0)
+	    GCM_X86_GHASH(y, 32, 32)
+	    GCM_X86_GHASH(y, 64, 64)
+	    GCM_X86_GHASH(y, 96, 96)
+	    GCM_X86_GHASH(y, 128, 128)
+	    GCM_X86_GHASH(y, 160, 160)
+	    GCM_X86_GHASH(y, 192, 192)
+	    GCM_X86_GHASH(y, 224, 224)
+	    GCM_VAES_FOLD
+	    GCM_X86_REDUCE
+	        : [gh] "+m" (*(uint64_t (*)[4])gh)
+	    : [hp] "r" (hp), [htab] "r" (htab), [mask] "m" (gcm_x86_bswap)
+	    : GCM_X86_CLOBBERS);
+}
+
+static size_t
+gcm_vaes_crypt_blocks(gcm_ctx_t *ctx, const uint8_t *in, uint8_t *out,
+    size_t len, boolean_t encrypt)
+{
+	return (gcm_x86_crypt_blocks(ctx, in, out, len, encrypt,
+	    GCM_VAES_CHUNK, gcm_vaes_encrypt_chunk, gcm_vaes_stitched_chunk,
+	    gcm_vaes_ghash_chunk));
+}
+
+static boolean_t
+gcm_vaes_will_work(void)
+{
+	return (gcm_avx2_will_work() && zfs_vaes_available() &&
+	    zfs_vpclmulqdq_available());
+}
+
+const gcm_impl_ops_t gcm_vaes_impl = {
+	.mul = &gcm_x86_mul,
+	.crypt_blocks = &gcm_vaes_crypt_blocks,
+	.is_supported = &gcm_vaes_will_work,
+	.name = "vaes"
+};
+
+#endif /* defined(HAVE_VAES) && defined(HAVE_VPCLMULQDQ) */
+
+#endif /* defined(__x86_64) && defined(HAVE_AES) && ... */
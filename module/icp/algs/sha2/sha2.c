@@ -40,6 +40,7 @@
 #define	_SHA2_IMPL
 #include <sys/sha2.h>
 #include <sha2/sha2_consts.h>
+#include <sha2/sha2_impl.h>
 
 #define	_RESTRICT_KYWD
 
@@ -52,18 +53,12 @@
 static void Encode(uint8_t *, uint32_t *, size_t);
 static void Encode64(uint8_t *, uint64_t *, size_t);
 
-/* userspace only supports the generic version */
-#if	defined(__amd64) && defined(_KERNEL)
-#define	SHA512Transform(ctx, in) SHA512TransformBlocks((ctx), (in), 1)
-#define	SHA256Transform(ctx, in) SHA256TransformBlocks((ctx), (in), 1)
-
-void SHA512TransformBlocks(SHA2_CTX *ctx, const void *in, size_t num);
-void SHA256TransformBlocks(SHA2_CTX *ctx, const void *in, size_t num);
-
-#else
+/*
+ * The portable transforms.  The blocks are hashed by whichever
+ * implementation sha2_impl.c has selected, this is only one of them.
+ */
 static void SHA256Transform(SHA2_CTX *, const uint8_t *);
 static void SHA512Transform(SHA2_CTX *, const uint8_t *);
-#endif	/* __amd64 && _KERNEL */
 
 static uint8_t PADDING[128] = { 0x80, /* all zeros */ };
 
@@ -143,7 +138,6 @@ static uint8_t PADDING[128] = { 0x80, /* all zeros */ };
 #endif	/* _BIG_ENDIAN */
 
 
-#if	!defined(__amd64) || !defined(_KERNEL)
 /* SHA256 Transform */
 
 static void
@@ -601,7 +595,41 @@ SHA512Transform(SHA2_CTX *ctx, const uint8_t *blk)
 	ctx->state.s64[7] += h;
 
 }
-#endif	/* !__amd64 || !_KERNEL */
+
+void
+sha256_generic_blocks(SHA2_CTX *ctx, const void *in, size_t num)
+{
+	const uint8_t *blk = in;
+
+	for (; num > 0; num--, blk += 64)
+		SHA256Transform(ctx, blk);
+}
+
+void
+sha512_generic_blocks(SHA2_CTX *ctx, const void *in, size_t num)
+{
+	const uint8_t *blk = in;
+
+	for (; num > 0; num--, blk += 128)
+		SHA512Transform(ctx, blk);
+}
+
+static boolean_t
+sha2_generic_is_supported(void)
+{
+	return (B_TRUE);
+}
+
+const sha2_impl_ops_t sha2_generic_impl = {
+	.sha256_blocks = sha256_generic_blocks,
+	.sha512_blocks = sha512_generic_blocks,
+	.sha256_many = NULL,
+	.sha512_many = NULL,
+	.is_supported = sha2_generic_is_supported,
+	.sha256_degree = 1,
+	.sha512_degree = 1,
+	.name = "generic"
+};
 
 
 /*
@@ -777,16 +805,33 @@ SHA512Init(SHA512_CTX *ctx)
  *  output: void
  */
 
+/*
+ * Add input_len bytes to the number of bits hashed by the context.
+ */
+static void
+SHA2Count(SHA2_CTX *ctx, size_t input_len)
+{
+	if (ctx->algotype <= SHA256_HMAC_GEN_MECH_INFO_TYPE) {
+		if ((ctx->count.c32[1] += (input_len << 3)) < (input_len << 3))
+			ctx->count.c32[0]++;
+
+		ctx->count.c32[0] += (input_len >> 29);
+	} else {
+		if ((ctx->count.c64[1] += (input_len << 3)) < (input_len << 3))
+			ctx->count.c64[0]++;
+
+		ctx->count.c64[0] += (input_len >> 29);
+	}
+}
+
 void
 SHA2Update(SHA2_CTX *ctx, const void *inptr, size_t input_len)
 {
 	uint32_t	i, buf_index, buf_len, buf_limit;
 	const uint8_t	*input = inptr;
 	uint32_t	algotype = ctx->algotype;
-#if !(!defined(__amd64) || !defined(_KERNEL))
 	uint32_t	block_count;
-#endif	/* !__amd64 */
-
+	const sha2_impl_ops_t *ops;
 
 	/* check for noop */
 	if (input_len == 0)
@@ -797,31 +842,22 @@ SHA2Update(SHA2_CTX *ctx, const void *inptr, size_t input_len)
 
 		/* compute number of bytes mod 64 */
 		buf_index = (ctx->count.c32[1] >> 3) & 0x3F;
-
-		/* update number of bits */
-		if ((ctx->count.c32[1] += (input_len << 3)) < (input_len << 3))
-			ctx->count.c32[0]++;
-
-		ctx->count.c32[0] += (input_len >> 29);
-
 	} else {
 		buf_limit = 128;
 
 		/* compute number of bytes mod 128 */
 		buf_index = (ctx->count.c64[1] >> 3) & 0x7F;
-
-		/* update number of bits */
-		if ((ctx->count.c64[1] += (input_len << 3)) < (input_len << 3))
-			ctx->count.c64[0]++;
-
-		ctx->count.c64[0] += (input_len >> 29);
 	}
 
+	/* update number of bits */
+	SHA2Count(ctx, input_len);
+
 	buf_len = buf_limit - buf_index;
 
 	/* transform as many times as possible */
 	i = 0;
 	if (input_len >= buf_len) {
+		ops = sha2_impl_get_ops();
 
 		/*
 		 * general optimization:
@@ -835,41 +871,28 @@ SHA2Update(SHA2_CTX *ctx, const void *inptr, size_t input_len)
 		if (buf_index) {
 			bcopy(input, &ctx->buf_un.buf8[buf_index], buf_len);
 			if (algotype <= SHA256_HMAC_GEN_MECH_INFO_TYPE)
-				SHA256Transform(ctx, ctx->buf_un.buf8);
+				ops->sha256_blocks(ctx, ctx->buf_un.buf8, 1);
 			else
-				SHA512Transform(ctx, ctx->buf_un.buf8);
+				ops->sha512_blocks(ctx, ctx->buf_un.buf8, 1);
 
 			i = buf_len;
 		}
 
-#if !defined(__amd64) || !defined(_KERNEL)
-		if (algotype <= SHA256_HMAC_GEN_MECH_INFO_TYPE) {
-			for (; i + buf_limit - 1 < input_len; i += buf_limit) {
-				SHA256Transform(ctx, &input[i]);
-			}
-		} else {
-			for (; i + buf_limit - 1 < input_len; i += buf_limit) {
-				SHA512Transform(ctx, &input[i]);
-			}
-		}
-
-#else
 		if (algotype <= SHA256_HMAC_GEN_MECH_INFO_TYPE) {
 			block_count = (input_len - i) >> 6;
 			if (block_count > 0) {
-				SHA256TransformBlocks(ctx, &input[i],
+				ops->sha256_blocks(ctx, &input[i],
 				    block_count);
 				i += block_count << 6;
 			}
 		} else {
 			block_count = (input_len - i) >> 7;
 			if (block_count > 0) {
-				SHA512TransformBlocks(ctx, &input[i],
+				ops->sha512_blocks(ctx, &input[i],
 				    block_count);
 				i += block_count << 7;
 			}
 		}
-#endif	/* !__amd64 || !_KERNEL */
 
 		/*
 		 * general optimization:
@@ -951,10 +974,227 @@ SHA2Final(void *digest, SHA2_CTX *ctx)
 	bzero(ctx, sizeof (*ctx));
 }
 
+/*
+ * SHA2MultiLanes()
+ *
+ * purpose: returns the number of buffers SHA2Multi() hashes side by side
+ *          with the selected implementation, 1 if it has no multi-buffer
+ *          function for the algorithm.
+ *   input: uint64_t	: the SHA2 mechanism
+ *  output: uint32_t	: the number of lanes
+ */
+
+uint32_t
+SHA2MultiLanes(uint64_t mech)
+{
+	const sha2_impl_ops_t *ops = sha2_impl_get_ops();
+
+	if (mech <= SHA256_HMAC_GEN_MECH_INFO_TYPE)
+		return (ops->sha256_many != NULL ? ops->sha256_degree : 1);
+	else
+		return (ops->sha512_many != NULL ? ops->sha512_degree : 1);
+}
+
+/*
+ * SHA2Multi()
+ *
+ * purpose: hashes count separate buffers.  Every lane of the multi-buffer
+ *          function is given a buffer, and all of them are advanced by as
+ *          many blocks as the shortest one has left; a lane that is done
+ *          is finalized and given the next buffer.  The last partial block
+ *          of each buffer is hashed by SHA2Final().  Once no more than half
+ *          of the lanes are busy, the rest is hashed one buffer at a time.
+ *   input: uint64_t	: the SHA2 mechanism
+ *          void **	: the buffers
+ *          size_t *	: the length of each buffer, in bytes
+ *          void **	: where to store the digest of each buffer
+ *          uint32_t	: the number of buffers
+ *  output: void
+ */
+
+void
+SHA2Multi(uint64_t mech, const void *const *in, const size_t *len,
+    void *const *digest, uint32_t count)
+{
+	const sha2_impl_ops_t *ops = sha2_impl_get_ops();
+	SHA2_CTX	*ctx, *lane_ctx[SHA2_MAX_DEGREE];
+	const uint8_t	*lane_in[SHA2_MAX_DEGREE];
+	size_t		lane_blocks[SHA2_MAX_DEGREE];
+	int64_t		lane_job[SHA2_MAX_DEGREE];
+	sha2_many_f	many;
+	uint32_t	next = 0;
+	int		degree, shift, active = 0, busy, l;
+
+	if (mech <= SHA256_HMAC_GEN_MECH_INFO_TYPE) {
+		many = ops->sha256_many;
+		degree = ops->sha256_degree;
+		shift = 6;
+	} else {
+		many = ops->sha512_many;
+		degree = ops->sha512_degree;
+		shift = 7;
+	}
+
+	if (many == NULL || count < 2) {
+		SHA2_CTX sctx;
+
+		for (next = 0; next < count; next++) {
+			SHA2Init(mech, &sctx);
+			SHA2Update(&sctx, in[next], len[next]);
+			SHA2Final(digest[next], &sctx);
+		}
+		return;
+	}
+
+	ASSERT3S(degree, <=, SHA2_MAX_DEGREE);
+
+	/* one context per lane, and one the idle lanes scribble on */
+	ctx = kmem_alloc((degree + 1) * sizeof (SHA2_CTX), KM_SLEEP);
+	for (l = 0; l < degree; l++)
+		lane_job[l] = -1;
+
+	for (;;) {
+		size_t n = 0, hashed;
+		boolean_t single, refill = B_FALSE;
+
+		for (l = 0; l < degree && next < count; l++) {
+			if (lane_job[l] != -1)
+				continue;
+			SHA2Init(mech, &ctx[l]);
+			lane_in[l] = in[next];
+			lane_blocks[l] = len[next] >> shift;
+			lane_job[l] = next++;
+			active++;
+		}
+		if (active == 0)
+			break;
+
+		/* finalize the buffers without whole blocks left */
+		single = (next == count && active * 2 <= degree);
+		for (l = 0, busy = -1; l < degree; l++) {
+			int64_t j = lane_job[l];
+
+			if (j == -1)
+				continue;
+			if (lane_blocks[l] > 0 && !single) {
+				if (busy == -1 || lane_blocks[l] < n)
+					n = lane_blocks[l];
+				busy = l;
+				continue;
+			}
+
+			hashed = ((len[j] >> shift) - lane_blocks[l]) << shift;
+			SHA2Count(&ctx[l], hashed);
+			SHA2Update(&ctx[l], lane_in[l], len[j] - hashed);
+			SHA2Final(digest[j], &ctx[l]);
+			lane_job[l] = -1;
+			active--;
+			refill = (next < count);
+		}
+		if (busy == -1 || refill)
+			continue;
+
+		for (l = 0; l < degree; l++) {
+			if (lane_job[l] != -1) {
+				lane_ctx[l] = &ctx[l];
+			} else {
+				lane_ctx[l] = &ctx[degree];
+				lane_in[l] = lane_in[busy];
+			}
+		}
+
+		many(lane_ctx, lane_in, n);
+
+		for (l = 0; l < degree; l++) {
+			if (lane_job[l] == -1)
+				continue;
+			lane_in[l] += n << shift;
+			lane_blocks[l] -= n;
+		}
+	}
+
+	bzero(ctx, (degree + 1) * sizeof (SHA2_CTX));
+	kmem_free(ctx, (degree + 1) * sizeof (SHA2_CTX));
+}
+
+/*
+ * SHA2MultiUpdate()
+ *
+ * purpose: advances count contexts of the same mechanism by len bytes
+ *          each.  None of the contexts may hold a partial block, and len
+ *          has to be a multiple of the block size, so that the input can
+ *          go straight to the multi-buffer function, a lane per context.
+ *          Like in SHA2Multi(), groups of no more than half as many
+ *          contexts as there are lanes are advanced one at a time.
+ *   input: SHA2_CTX **	: the contexts
+ *          void **	: the input of each context
+ *          size_t	: the length of each input, in bytes
+ *          uint32_t	: the number of contexts
+ *  output: void
+ */
+
+void
+SHA2MultiUpdate(SHA2_CTX *const *ctx, const void *const *in, size_t len,
+    uint32_t count)
+{
+	const sha2_impl_ops_t *ops = sha2_impl_get_ops();
+	SHA2_CTX	idle, *lane_ctx[SHA2_MAX_DEGREE];
+	const uint8_t	*lane_in[SHA2_MAX_DEGREE];
+	sha2_many_f	many;
+	uint32_t	i;
+	int		degree, shift, group, l;
+
+	if (count == 0 || len == 0)
+		return;
+
+	if (ctx[0]->algotype <= SHA256_HMAC_GEN_MECH_INFO_TYPE) {
+		many = ops->sha256_many;
+		degree = ops->sha256_degree;
+		shift = 6;
+	} else {
+		many = ops->sha512_many;
+		degree = ops->sha512_degree;
+		shift = 7;
+	}
+
+	ASSERT0(len & ((1 << shift) - 1));
+	ASSERT3S(degree, <=, SHA2_MAX_DEGREE);
+
+	for (i = 0; i < count; i += group) {
+		group = (int)MIN(count - i, (uint32_t)degree);
+
+		if (many == NULL || group * 2 <= degree) {
+			for (l = 0; l < group; l++)
+				SHA2Update(ctx[i + l], in[i + l], len);
+			continue;
+		}
+
+		for (l = 0; l < degree; l++) {
+			if (l < group) {
+				lane_ctx[l] = ctx[i + l];
+				lane_in[l] = in[i + l];
+			} else {
+				lane_ctx[l] = &idle;
+				lane_in[l] = in[i];
+			}
+		}
+
+		many(lane_ctx, lane_in, len >> shift);
+
+		for (l = 0; l < group; l++)
+			SHA2Count(ctx[i + l], len);
+	}
+
+	bzero(&idle, sizeof (idle));
+}
+
 
 
 #ifdef _KERNEL
 EXPORT_SYMBOL(SHA2Init);
 EXPORT_SYMBOL(SHA2Update);
 EXPORT_SYMBOL(SHA2Final);
+EXPORT_SYMBOL(SHA2Multi);
+EXPORT_SYMBOL(SHA2MultiUpdate);
+EXPORT_SYMBOL(SHA2MultiLanes);
 #endif
@@ -0,0 +1,502 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#define	_SHA2_IMPL
+#include <sys/sha2.h>
+#include <sha2/sha2_impl.h>
+
+/*
+ * Selection of the SHA2 implementation, in the same way as fletcher 4:
+ * every compiled in implementation the CPU supports is benchmarked when
+ * the module loads.  "fastest" is put together from the implementations
+ * with the highest throughput for single SHA-256 and SHA-512 streams and
+ * for SHA2Multi() of each, which need not be the same ones.  The numbers
+ * are kept in the sha2_bench kstat.
+ */
+
+static const sha2_impl_ops_t *sha2_impls[] = {
+	&sha2_generic_impl,
+#if defined(__x86_64) && defined(_KERNEL)
+	&sha2_x86_64_impl,
+#endif
+#if defined(__x86_64) && defined(HAVE_SHA_NI)
+	&sha2_shani_impl,
+#endif
+#if defined(__x86_64) && defined(HAVE_AVX2)
+	&sha2_avx2_impl,
+#endif
+};
+
+/* Hold all supported implementations */
+static uint32_t sha2_supp_impls_cnt = 0;
+static sha2_impl_ops_t *sha2_supp_impls[ARRAY_SIZE(sha2_impls)];
+
+/*
+ * Hashing may start before sha2_impl_init() has been called, by consumers
+ * of the userland library which never call it, so "fastest" starts out
+ * as the portable code.
+ */
+static sha2_impl_ops_t sha2_fastest_impl = {
+	.sha256_blocks = sha256_generic_blocks,
+	.sha512_blocks = sha512_generic_blocks,
+	.sha256_many = NULL,
+	.sha512_many = NULL,
+	.sha256_degree = 1,
+	.sha512_degree = 1,
+	.name = "fastest"
+};
+
+/* Select sha2 implementation */
+#define	IMPL_FASTEST	(UINT32_MAX)
+#define	IMPL_CYCLE	(UINT32_MAX - 1)
+
+static uint64_t sha2_impl_chosen = IMPL_FASTEST;
+
+#define	IMPL_READ(i)	(*(volatile uint64_t *) &(i))
+
+static struct sha2_impl_selector {
+	const char	*sis_name;
+	uint64_t	sis_sel;
+} sha2_impl_selectors[] = {
+#if !defined(_KERNEL)
+	{ "cycle",	IMPL_CYCLE },
+#endif
+	{ "fastest",	IMPL_FASTEST }
+};
+
+#if defined(_KERNEL)
+static kstat_t *sha2_kstat;
+
+/* Throughput of each implementation, the last entry names the fastest */
+static struct sha2_kstat {
+	uint64_t sha256;
+	uint64_t sha512;
+	uint64_t sha256_multi;
+	uint64_t sha512_multi;
+} sha2_stat_data[ARRAY_SIZE(sha2_impls) + 1];
+#endif
+
+/* Indicate that benchmark has been completed */
+static boolean_t sha2_initialized = B_FALSE;
+
+const sha2_impl_ops_t *
+sha2_impl_get_ops(void)
+{
+	const sha2_impl_ops_t *ops = NULL;
+	const uint64_t impl = IMPL_READ(sha2_impl_chosen);
+
+	switch (impl) {
+	case IMPL_FASTEST:
+		ops = &sha2_fastest_impl;
+		break;
+#if !defined(_KERNEL)
+	case IMPL_CYCLE: {
+		ASSERT(sha2_initialized);
+		ASSERT3U(sha2_supp_impls_cnt, >, 0);
+
+		static uint32_t cycle_count = 0;
+		uint32_t idx = (++cycle_count) % sha2_supp_impls_cnt;
+		ops = sha2_supp_impls[idx];
+	}
+	break;
+#endif
+	default:
+		ASSERT3U(sha2_supp_impls_cnt, >, 0);
+		ASSERT3U(impl, <, sha2_supp_impls_cnt);
+
+		ops = sha2_supp_impls[impl];
+		break;
+	}
+
+	ASSERT3P(ops, !=, NULL);
+
+	return (ops);
+}
+
+int
+sha2_impl_set(const char *val)
+{
+	int err = -EINVAL;
+	uint64_t impl = IMPL_READ(sha2_impl_chosen);
+	size_t i, val_len;
+
+	val_len = strlen(val);
+	while ((val_len > 0) && !!isspace(val[val_len-1])) /* trim '\n' */
+		val_len--;
+
+	/* check mandatory implementations */
+	for (i = 0; i < ARRAY_SIZE(sha2_impl_selectors); i++) {
+		const char *name = sha2_impl_selectors[i].sis_name;
+
+		if (val_len == strlen(name) &&
+		    strncmp(val, name, val_len) == 0) {
+			impl = sha2_impl_selectors[i].sis_sel;
+			err = 0;
+			break;
+		}
+	}
+
+	if (err != 0 && sha2_initialized) {
+		/* check all supported implementations */
+		for (i = 0; i < sha2_supp_impls_cnt; i++) {
+			const char *name = sha2_supp_impls[i]->name;
+
+			if (val_len == strlen(name) &&
+			    strncmp(val, name, val_len) == 0) {
+				impl = i;
+				err = 0;
+				break;
+			}
+		}
+	}
+
+	if (err == 0) {
+		atomic_swap_64(&sha2_impl_chosen, impl);
+		membar_producer();
+	}
+
+	return (err);
+}
+
+uint32_t
+sha2_impl_getcnt(void)
+{
+	ASSERT(sha2_initialized);
+
+	return (sha2_supp_impls_cnt);
+}
+
+const char *
+sha2_impl_getname(uint32_t id)
+{
+	ASSERT(sha2_initialized);
+
+	if (id >= sha2_supp_impls_cnt)
+		return (NULL);
+
+	return (sha2_supp_impls[id]->name);
+}
+
+#if defined(_KERNEL)
+/* SHA2 kstats */
+
+static int
+sha2_kstat_headers(char *buf, size_t size)
+{
+	ssize_t off = 0;
+
+	off += snprintf(buf + off, size, "%-17s", "implementation");
+	off += snprintf(buf + off, size - off, "%-15s", "sha256");
+	off += snprintf(buf + off, size - off, "%-15s", "sha512");
+	off += snprintf(buf + off, size - off, "%-15s", "sha256_multi");
+	(void) snprintf(buf + off, size - off, "%-15s\n", "sha512_multi");
+
+	return (0);
+}
+
+static int
+sha2_kstat_data(char *buf, size_t size, void *data)
+{
+	struct sha2_kstat *fastest_stat =
+	    &sha2_stat_data[sha2_supp_impls_cnt];
+	struct sha2_kstat *curr_stat = (struct sha2_kstat *)data;
+	ssize_t off = 0;
+
+	if (curr_stat == fastest_stat) {
+		off += snprintf(buf + off, size - off, "%-17s", "fastest");
+		off += snprintf(buf + off, size - off, "%-15s",
+		    sha2_supp_impls[fastest_stat->sha256]->name);
+		off += snprintf(buf + off, size - off, "%-15s",
+		    sha2_supp_impls[fastest_stat->sha512]->name);
+		off += snprintf(buf + off, size - off, "%-15s",
+		    sha2_supp_impls[fastest_stat->sha256_multi]->name);
+		off += snprintf(buf + off, size - off, "%-15s\n",
+		    sha2_supp_impls[fastest_stat->sha512_multi]->name);
+	} else {
+		ptrdiff_t id = curr_stat - sha2_stat_data;
+
+		off += snprintf(buf + off, size - off, "%-17s",
+		    sha2_supp_impls[id]->name);
+		off += snprintf(buf + off, size - off, "%-15llu",
+		    (u_longlong_t)curr_stat->sha256);
+		off += snprintf(buf + off, size - off, "%-15llu",
+		    (u_longlong_t)curr_stat->sha512);
+		off += snprintf(buf + off, size - off, "%-15llu",
+		    (u_longlong_t)curr_stat->sha256_multi);
+		off += snprintf(buf + off, size - off, "%-15llu\n",
+		    (u_longlong_t)curr_stat->sha512_multi);
+	}
+
+	return (0);
+}
+
+static void *
+sha2_kstat_addr(kstat_t *ksp, int64_t n)
+{
+	if (n <= sha2_supp_impls_cnt)
+		ksp->ks_private = (void *) (sha2_stat_data + n);
+	else
+		ksp->ks_private = NULL;
+
+	return (ksp->ks_private);
+}
+
+#define	SHA2_BENCH_NS		(MSEC2NSEC(25))		/* 25ms */
+#define	SHA2_BENCH_BUFS		SHA2_MAX_DEGREE
+
+/*
+ * Bytes per second hashed by the chosen implementation, as single
+ * streams or as SHA2_BENCH_BUFS buffers at once.
+ */
+static uint64_t
+sha2_benchmark_run(uint64_t mech, boolean_t multi, const uint8_t *data,
+    uint64_t data_size)
+{
+	const void *in[SHA2_BENCH_BUFS];
+	size_t len[SHA2_BENCH_BUFS];
+	void *digest[SHA2_BENCH_BUFS];
+	uint8_t out[SHA2_BENCH_BUFS][SHA512_DIGEST_LENGTH];
+	uint64_t run_count = 0, run_time_ns, run_bw;
+	uint64_t buf_size = data_size / SHA2_BENCH_BUFS;
+	SHA2_CTX ctx;
+	hrtime_t start;
+	int i;
+
+	for (i = 0; i < SHA2_BENCH_BUFS; i++) {
+		in[i] = data + i * buf_size;
+		len[i] = buf_size;
+		digest[i] = out[i];
+	}
+
+	/* SHA2Multi() allocates its contexts, which may sleep */
+	if (!multi)
+		kpreempt_disable();
+	start = gethrtime();
+	do {
+		if (multi) {
+			SHA2Multi(mech, in, len, digest, SHA2_BENCH_BUFS);
+		} else {
+			SHA2Init(mech, &ctx);
+			SHA2Update(&ctx, data, data_size);
+			SHA2Final(out[0], &ctx);
+		}
+		run_count++;
+
+		run_time_ns = gethrtime() - start;
+	} while (run_time_ns < SHA2_BENCH_NS);
+	if (!multi)
+		kpreempt_enable();
+
+	run_bw = data_size * run_count * NANOSEC;
+	run_bw /= run_time_ns;	/* B/s */
+
+	return (run_bw);
+}
+
+/*
+ * Measure the throughput of every supported implementation, and make up
+ * the fastest one from the best of each.
+ */
+static void
+sha2_benchmark_impl(const uint8_t *data, uint64_t data_size)
+{
+	struct sha2_kstat *fastest_stat = &sha2_stat_data[sha2_supp_impls_cnt];
+	uint64_t sel_save = IMPL_READ(sha2_impl_chosen);
+	sha2_impl_ops_t fastest = sha2_generic_impl;
+	uint64_t best[4] = { 0, 0, 0, 0 };
+	uint32_t i;
+
+	for (i = 0; i < sha2_supp_impls_cnt; i++) {
+		const sha2_impl_ops_t *curr = sha2_supp_impls[i];
+		struct sha2_kstat *stat = &sha2_stat_data[i];
+
+		/* temporary set an implementation */
+		sha2_impl_chosen = i;
+
+		stat->sha256 = sha2_benchmark_run(SHA256, B_FALSE,
+		    data, data_size);
+		stat->sha512 = sha2_benchmark_run(SHA512_256, B_FALSE,
+		    data, data_size);
+		stat->sha256_multi = sha2_benchmark_run(SHA256, B_TRUE,
+		    data, data_size);
+		stat->sha512_multi = sha2_benchmark_run(SHA512_256, B_TRUE,
+		    data, data_size);
+
+		if (stat->sha256 > best[0]) {
+			best[0] = stat->sha256;
+			fastest_stat->sha256 = i;
+			fastest.sha256_blocks = curr->sha256_blocks;
+		}
+		if (stat->sha512 > best[1]) {
+			best[1] = stat->sha512;
+			fastest_stat->sha512 = i;
+			fastest.sha512_blocks = curr->sha512_blocks;
+		}
+		if (stat->sha256_multi > best[2]) {
+			best[2] = stat->sha256_multi;
+			fastest_stat->sha256_multi = i;
+			fastest.sha256_many = curr->sha256_many;
+			fastest.sha256_degree = curr->sha256_degree;
+		}
+		if (stat->sha512_multi > best[3]) {
+			best[3] = stat->sha512_multi;
+			fastest_stat->sha512_multi = i;
+			fastest.sha512_many = curr->sha512_many;
+			fastest.sha512_degree = curr->sha512_degree;
+		}
+
+		dprintf("%s: %14s %16llu %16llu %16llu %16llu B/s\n", __func__,
+		    curr->name, (u_longlong_t)stat->sha256,
+		    (u_longlong_t)stat->sha512,
+		    (u_longlong_t)stat->sha256_multi,
+		    (u_longlong_t)stat->sha512_multi);
+	}
+
+	/*
+	 * A multi-buffer function no faster than hashing the buffers one
+	 * after another with the fastest single stream code is not used.
+	 */
+	if (best[2] <= best[0]) {
+		fastest.sha256_many = NULL;
+		fastest.sha256_degree = 1;
+	}
+	if (best[3] <= best[1]) {
+		fastest.sha512_many = NULL;
+		fastest.sha512_degree = 1;
+	}
+
+	fastest.name = "fastest";
+	memcpy(&sha2_fastest_impl, &fastest, sizeof (sha2_fastest_impl));
+	membar_producer();
+
+	/* restore original selection */
+	atomic_swap_64(&sha2_impl_chosen, sel_save);
+}
+#endif
+
+void
+sha2_impl_init(void)
+{
+	sha2_impl_ops_t *curr_impl;
+	int i, c;
+
+	/* move supported impl into sha2_supp_impls */
+	for (i = 0, c = 0; i < ARRAY_SIZE(sha2_impls); i++) {
+		curr_impl = (sha2_impl_ops_t *)sha2_impls[i];
+
+		if (curr_impl->is_supported())
+			sha2_supp_impls[c++] = curr_impl;
+	}
+	membar_producer();	/* complete sha2_supp_impls[] init */
+	sha2_supp_impls_cnt = c;	/* number of supported impl */
+
+#if !defined(_KERNEL)
+	/* Skip benchmarking and use last implementation as fastest */
+	memcpy(&sha2_fastest_impl,
+	    sha2_supp_impls[sha2_supp_impls_cnt - 1],
+	    sizeof (sha2_fastest_impl));
+	sha2_fastest_impl.name = "fastest";
+	membar_producer();
+#else
+	/* Benchmark all supported implementations */
+	{
+		static const size_t data_size = 1 << 17; /* 128kiB */
+		uint8_t *databuf;
+
+		databuf = kmem_alloc(data_size, KM_SLEEP);
+		for (i = 0; i < data_size / sizeof (uint64_t); i++)
+			((uint64_t *)databuf)[i] = (uintptr_t)(databuf + i);
+
+		sha2_benchmark_impl(databuf, data_size);
+
+		kmem_free(databuf, data_size);
+	}
+
+	/* install kstats for all implementations */
+	sha2_kstat = kstat_create("zfs", 0, "sha2_bench", "misc",
+	    KSTAT_TYPE_RAW, 0, KSTAT_FLAG_VIRTUAL);
+	if (sha2_kstat != NULL) {
+		sha2_kstat->ks_data = NULL;
+		sha2_kstat->ks_ndata = UINT32_MAX;
+		kstat_set_raw_ops(sha2_kstat,
+		    sha2_kstat_headers,
+		    sha2_kstat_data,
+		    sha2_kstat_addr);
+		kstat_install(sha2_kstat);
+	}
+#endif
+
+	/* Finish initialization */
+	sha2_initialized = B_TRUE;
+}
+
+void
+sha2_impl_fini(void)
+{
+#if defined(_KERNEL)
+	if (sha2_kstat != NULL) {
+		kstat_delete(sha2_kstat);
+		sha2_kstat = NULL;
+	}
+#endif
+}
+
+#if defined(_KERNEL)
+
+int
+icp_sha2_impl_set(const char *val)
+{
+	return (sha2_impl_set(val));
+}
+
+int
+icp_sha2_impl_get(char *buffer, int max)
+{
+	const uint64_t impl = IMPL_READ(sha2_impl_chosen);
+	char *fmt;
+	int i, cnt = 0;
+
+	ASSERT(sha2_initialized);
+
+	/* list fastest */
+	fmt = (impl == IMPL_FASTEST) ? "[%s] " : "%s ";
+	cnt += snprintf(buffer + cnt, max, fmt, "fastest");
+
+	/* list all supported implementations */
+	for (i = 0; i < sha2_supp_impls_cnt; i++) {
+		fmt = (i == impl) ? "[%s] " : "%s ";
+		cnt += snprintf(buffer + cnt, max, fmt,
+		    sha2_supp_impls[i]->name);
+	}
+
+	return (cnt);
+}
+
+#endif
+
+#if defined(_KERNEL) && defined(__linux__)
+EXPORT_SYMBOL(sha2_impl_init);
+EXPORT_SYMBOL(sha2_impl_fini);
+EXPORT_SYMBOL(sha2_impl_set);
+EXPORT_SYMBOL(sha2_impl_getcnt);
+EXPORT_SYMBOL(sha2_impl_getname);
+#endif
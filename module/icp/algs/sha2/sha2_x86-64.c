@@ -0,0 +1,527 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * x86_64, SHA-NI and AVX2 implementations of SHA-256 and SHA-512.
+ *
+ * x86_64 is the hand scheduled assembly in asm-x86_64/sha2, which only
+ * the kernel module is built with.
+ *
+ * SHA-NI hashes a single SHA-256 stream with the sha256rnds2 and
+ * sha256msg1/2 instructions, following the sequence in Intel's "Intel SHA
+ * Extensions" paper.  There are no SHA-512 instructions before AVX10, so
+ * its SHA-512 is the one of the x86_64 implementation.
+ *
+ * AVX2 hashes 8 SHA-256 or 4 SHA-512 streams side by side, one stream per
+ * 32 or 64-bit lane: row i of the state holds working variable i of every
+ * stream, and row i of the message schedule holds word i of every
+ * stream's block.  As in blake3_x86-64.c, every round is a single asm
+ * statement which loads the rows it reads and stores those it changes, so
+ * nothing is assumed about the vector registers between statements.  It
+ * is only faster than the single stream code when there are enough
+ * buffers to fill the lanes, see SHA2Multi().
+ */
+
+#if defined(__x86_64)
+
+#include <sys/zfs_context.h>
+#include <sys/simd_x86.h>
+#define	_SHA2_IMPL
+#include <sys/sha2.h>
+#include <sha2/sha2_consts.h>
+#include <sha2/sha2_impl.h>
+
+#if defined(_KERNEL)
+
+/* asm-x86_64/sha2/sha256_impl.S and sha512_impl.S */
+extern void SHA256TransformBlocks(SHA2_CTX *ctx, const void *in, size_t num);
+extern void SHA512TransformBlocks(SHA2_CTX *ctx, const void *in, size_t num);
+
+#define	sha256_x86_64_blocks	SHA256TransformBlocks
+#define	sha512_x86_64_blocks	SHA512TransformBlocks
+
+static boolean_t
+sha2_x86_64_will_work(void)
+{
+	return (B_TRUE);
+}
+
+const sha2_impl_ops_t sha2_x86_64_impl = {
+	.sha256_blocks = sha256_x86_64_blocks,
+	.sha512_blocks = sha512_x86_64_blocks,
+	.sha256_many = NULL,
+	.sha512_many = NULL,
+	.is_supported = sha2_x86_64_will_work,
+	.sha256_degree = 1,
+	.sha512_degree = 1,
+	.name = "x86_64"
+};
+
+#else
+
+#define	sha256_x86_64_blocks	sha256_generic_blocks
+#define	sha512_x86_64_blocks	sha512_generic_blocks
+
+#endif /* defined(_KERNEL) */
+
+#if defined(HAVE_SHA_NI) || defined(HAVE_AVX2)
+
+static const uint32_t __attribute__((aligned(16))) sha256_k[64] = {
+	SHA256_CONST_0, SHA256_CONST_1, SHA256_CONST_2, SHA256_CONST_3,
+	SHA256_CONST_4, SHA256_CONST_5, SHA256_CONST_6, SHA256_CONST_7,
+	SHA256_CONST_8, SHA256_CONST_9, SHA256_CONST_10, SHA256_CONST_11,
+	SHA256_CONST_12, SHA256_CONST_13, SHA256_CONST_14, SHA256_CONST_15,
+	SHA256_CONST_16, SHA256_CONST_17, SHA256_CONST_18, SHA256_CONST_19,
+	SHA256_CONST_20, SHA256_CONST_21, SHA256_CONST_22, SHA256_CONST_23,
+	SHA256_CONST_24, SHA256_CONST_25, SHA256_CONST_26, SHA256_CONST_27,
+	SHA256_CONST_28, SHA256_CONST_29, SHA256_CONST_30, SHA256_CONST_31,
+	SHA256_CONST_32, SHA256_CONST_33, SHA256_CONST_34, SHA256_CONST_35,
+	SHA256_CONST_36, SHA256_CONST_37, SHA256_CONST_38, SHA256_CONST_39,
+	SHA256_CONST_40, SHA256_CONST_41, SHA256_CONST_42, SHA256_CONST_43,
+	SHA256_CONST_44, SHA256_CONST_45, SHA256_CONST_46, SHA256_CONST_47,
+	SHA256_CONST_48, SHA256_CONST_49, SHA256_CONST_50, SHA256_CONST_51,
+	SHA256_CONST_52, SHA256_CONST_53, SHA256_CONST_54, SHA256_CONST_55,
+	SHA256_CONST_56, SHA256_CONST_57, SHA256_CONST_58, SHA256_CONST_59,
+	SHA256_CONST_60, SHA256_CONST_61, SHA256_CONST_62, SHA256_CONST_63
+};
+
+#endif /* defined(HAVE_SHA_NI) || defined(HAVE_AVX2) */
+
+#if defined(HAVE_SHA_NI)
+
+/* pshufb mask turning the big endian message words into native ones */
+static const uint8_t __attribute__((aligned(16))) sha256_shani_flip[16] = {
+	3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+};
+
+/*
+ * xmm0 holds the message words plus round constants, which sha256rnds2
+ * takes implicitly, xmm1 and xmm2 the state as ABEF and CDGH, xmm3-xmm6
+ * the last 16 message words, xmm7 is scratch, xmm8 the byte flip mask
+ * and xmm9-xmm10 the state at the start of the block.
+ */
+
+/* Rounds 4i to 4i + 3, with message words m plus K[4i] in xmm0 */
+#define	SHA256_SHANI_RNDS4(i)						\
+	"paddd " #i "*16(%[k]), %%xmm0\n"				\
+	"sha256rnds2 %%xmm1, %%xmm2\n"					\
+	"pshufd $0x0e, %%xmm0, %%xmm0\n"				\
+	"sha256rnds2 %%xmm2, %%xmm1\n"
+
+/* Load the byte swapped message words 4i to 4i + 3 into xmm0 and m */
+#define	SHA256_SHANI_LOAD(i, m)						\
+	"movdqu " #i "*16(%[in]), %%xmm0\n"				\
+	"pshufb %%xmm8, %%xmm0\n"					\
+	"movdqa %%xmm0, %%" m "\n"
+
+/*
+ * Rounds 4i to 4i + 3 for i >= 3: cur holds message words 4i to 4i + 3,
+ * and finishing the words 4i + 4 to 4i + 7 in next needs those in prev.
+ */
+#define	SHA256_SHANI_MSG2(i, prev, cur, next)				\
+	"movdqa %%" cur ", %%xmm0\n"					\
+	"paddd " #i "*16(%[k]), %%xmm0\n"				\
+	"sha256rnds2 %%xmm1, %%xmm2\n"					\
+	"movdqa %%" cur ", %%xmm7\n"					\
+	"palignr $4, %%" prev ", %%xmm7\n"				\
+	"paddd %%xmm7, %%" next "\n"					\
+	"sha256msg2 %%" cur ", %%" next "\n"				\
+	"pshufd $0x0e, %%xmm0, %%xmm0\n"				\
+	"sha256rnds2 %%xmm2, %%xmm1\n"
+
+#define	SHA256_SHANI_MSG1(cur, prev)					\
+	"sha256msg1 %%" cur ", %%" prev "\n"
+
+static void
+sha256_shani_blocks(SHA2_CTX *ctx, const void *in, size_t num)
+{
+	const uint8_t *data = in;
+
+	if (num == 0)
+		return;
+
+	kfpu_begin();
+	asm volatile(
+	    "movdqu 0(%[state]), %%xmm1\n"
+	    "movdqu 16(%[state]), %%xmm2\n"
+	    "pshufd $0xb1, %%xmm1, %%xmm1\n"	/* CDAB */
+	    "pshufd $0x1b, %%xmm2, %%xmm2\n"	/* EFGH */
+	    "movdqa %%xmm1, %%xmm7\n"
+	    "palignr $8, %%xmm2, %%xmm1\n"	/* ABEF */
+	    "pblendw $0xf0, %%xmm7, %%xmm2\n"	/* CDGH */
+	    "movdqa %[flip], %%xmm8\n"
+	    "1:\n"
+	    "movdqa %%xmm1, %%xmm9\n"
+	    "movdqa %%xmm2, %%xmm10\n"
+	    SHA256_SHANI_LOAD(0, "xmm3")
+	    SHA256_SHANI_RNDS4(0)
+	    SHA256_SHANI_LOAD(1, "xmm4")
+	    SHA256_SHANI_RNDS4(1)
+	    SHA256_SHANI_MSG1("xmm4", "xmm3")
+	    SHA256_SHANI_LOAD(2, "xmm5")
+	    SHA256_SHANI_RNDS4(2)
+	    SHA256_SHANI_MSG1("xmm5", "xmm4")
+	    SHA256_SHANI_LOAD(3, "xmm6")
+	    "paddd 3*16(%[k]), %%xmm0\n"
+	    "sha256rnds2 %%xmm1, %%xmm2\n"
+	    "movdqa %%xmm6, %%xmm7\n"
+	    "palignr $4, %%xmm5, %%xmm7\n"
+	    "paddd %%xmm7, %%xmm3\n"
+	    "sha256msg2 %%xmm6, %%xmm3\n"
+	    "pshufd $0x0e, %%xmm0, %%xmm0\n"
+	    "sha256rnds2 %%xmm2, %%xmm1\n"
+	    SHA256_SHANI_MSG1("xmm6", "xmm5")
+	    SHA256_SHANI_MSG2(4, "xmm6", "xmm3", "xmm4")
+	    SHA256_SHANI_MSG1("xmm3", "xmm6")
+	    SHA256_SHANI_MSG2(5, "xmm3", "xmm4", "xmm5")
+	    SHA256_SHANI_MSG1("xmm4", "xmm3")
+	    SHA256_SHANI_MSG2(6, "xmm4", "xmm5", "xmm6")
+	    SHA256_SHANI_MSG1("xmm5", "xmm4")
+	    SHA256_SHANI_MSG2(7, "xmm5", "xmm6", "xmm3")
+	    SHA256_SHANI_MSG1("xmm6", "xmm5")
+	    SHA256_SHANI_MSG2(8, "xmm6", "xmm3", "xmm4")
+	    SHA256_SHANI_MSG1("xmm3", "xmm6")
+	    SHA256_SHANI_MSG2(9, "xmm3", "xmm4", "xmm5")
+	    SHA256_SHANI_MSG1("xmm4", "xmm3")
+	    SHA256_SHANI_MSG2(10, "xmm4", "xmm5", "xmm6")
+	    SHA256_SHANI_MSG1("xmm5", "xmm4")
+	    SHA256_SHANI_MSG2(11, "xmm5", "xmm6", "xmm3")
+	    SHA256_SHANI_MSG1("xmm6", "xmm5")
+	    SHA256_SHANI_MSG2(12, "xmm6", "xmm3", "xmm4")
+	    SHA256_SHANI_MSG1("xmm3", "xmm6")
+	    SHA256_SHANI_MSG2(13, "xmm3", "xmm4", "xmm5")
+	    SHA256_SHANI_MSG2(14, "xmm4", "xmm5", "xmm6")
+	    "movdqa %%xmm6, %%xmm0\n"
+	    SHA256_SHANI_RNDS4(15)
+	    "paddd %%xmm9, %%xmm1\n"
+	    "paddd %%xmm10, %%xmm2\n"
+	    "add $64, %[in]\n"
+	    "dec %[num]\n"
+	    "jnz 1b\n"
+	    "pshufd $0x1b, %%xmm1, %%xmm1\n"	/* FEBA */
+	    "pshufd $0xb1, %%xmm2, %%xmm2\n"	/* DCHG */
+	    "movdqa %%xmm1, %%xmm7\n"
+	    "pblendw $0xf0, %%xmm2, %%xmm1\n"	/* DCBA */
+	    "palignr $8, %%xmm7, %%xmm2\n"	/* HGFE */
+	    "movdqu %%xmm1, 0(%[state])\n"
+	    "movdqu %%xmm2, 16(%[state])\n"
+	    : [in] "+r" (data), [num] "+r" (num)
+	    : [state] "r" (ctx->state.s32), [k] "r" (sha256_k),
+	    [flip] "m" (sha256_shani_flip)
+	    : "cc", "memory", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5",
+	    "xmm6", "xmm7", "xmm8", "xmm9", "xmm10");
+	kfpu_end();
+}
+
+static boolean_t
+sha2_shani_will_work(void)
+{
+	return (zfs_shani_available() && zfs_sse4_1_available());
+}
+
+const sha2_impl_ops_t sha2_shani_impl = {
+	.sha256_blocks = sha256_shani_blocks,
+	.sha512_blocks = sha512_x86_64_blocks,
+	.sha256_many = NULL,
+	.sha512_many = NULL,
+	.is_supported = sha2_shani_will_work,
+	.sha256_degree = 1,
+	.sha512_degree = 1,
+	.name = "shani"
+};
+
+#endif /* defined(HAVE_SHA_NI) */
+
+#if defined(HAVE_AVX2)
+
+#define	SHA256_AVX2_DEGREE	8
+#define	SHA512_AVX2_DEGREE	4
+
+static const uint64_t sha512_k[80] = {
+	SHA512_CONST_0, SHA512_CONST_1, SHA512_CONST_2, SHA512_CONST_3,
+	SHA512_CONST_4, SHA512_CONST_5, SHA512_CONST_6, SHA512_CONST_7,
+	SHA512_CONST_8, SHA512_CONST_9, SHA512_CONST_10, SHA512_CONST_11,
+	SHA512_CONST_12, SHA512_CONST_13, SHA512_CONST_14, SHA512_CONST_15,
+	SHA512_CONST_16, SHA512_CONST_17, SHA512_CONST_18, SHA512_CONST_19,
+	SHA512_CONST_20, SHA512_CONST_21, SHA512_CONST_22, SHA512_CONST_23,
+	SHA512_CONST_24, SHA512_CONST_25, SHA512_CONST_26, SHA512_CONST_27,
+	SHA512_CONST_28, SHA512_CONST_29, SHA512_CONST_30, SHA512_CONST_31,
+	SHA512_CONST_32, SHA512_CONST_33, SHA512_CONST_34, SHA512_CONST_35,
+	SHA512_CONST_36, SHA512_CONST_37, SHA512_CONST_38, SHA512_CONST_39,
+	SHA512_CONST_40, SHA512_CONST_41, SHA512_CONST_42, SHA512_CONST_43,
+	SHA512_CONST_44, SHA512_CONST_45, SHA512_CONST_46, SHA512_CONST_47,
+	SHA512_CONST_48, SHA512_CONST_49, SHA512_CONST_50, SHA512_CONST_51,
+	SHA512_CONST_52, SHA512_CONST_53, SHA512_CONST_54, SHA512_CONST_55,
+	SHA512_CONST_56, SHA512_CONST_57, SHA512_CONST_58, SHA512_CONST_59,
+	SHA512_CONST_60, SHA512_CONST_61, SHA512_CONST_62, SHA512_CONST_63,
+	SHA512_CONST_64, SHA512_CONST_65, SHA512_CONST_66, SHA512_CONST_67,
+	SHA512_CONST_68, SHA512_CONST_69, SHA512_CONST_70, SHA512_CONST_71,
+	SHA512_CONST_72, SHA512_CONST_73, SHA512_CONST_74, SHA512_CONST_75,
+	SHA512_CONST_76, SHA512_CONST_77, SHA512_CONST_78, SHA512_CONST_79
+};
+
+typedef struct sha256_avx2_state {
+	uint32_t v[8][SHA256_AVX2_DEGREE];	/* working variables a-h */
+	uint32_t w[16][SHA256_AVX2_DEGREE];	/* message schedule */
+} sha256_avx2_state_t;
+
+typedef struct sha512_avx2_state {
+	uint64_t v[8][SHA512_AVX2_DEGREE];
+	uint64_t w[16][SHA512_AVX2_DEGREE];
+} sha512_avx2_state_t;
+
+/*
+ * dst = src rotated right by n bits, m is the word size minus n, tmp is
+ * scratch.  s is the element size suffix of the shifts, d or q.
+ */
+#define	SHA2_AVX2_ROR(s, n, m, src, dst, tmp)				\
+	"vpsrl" s " $" #n ", %%" src ", %%" dst "\n"			\
+	"vpsll" s " $" #m ", %%" src ", %%" tmp "\n"			\
+	"vpor %%" tmp ", %%" dst ", %%" dst "\n"
+
+/* dst = src rotated right by n1, n2 and n3 bits, all xor'ed together */
+#define	SHA2_AVX2_SIGMA(s, n1, m1, n2, m2, n3, m3, src, dst)		\
+	SHA2_AVX2_ROR(s, n1, m1, src, dst, "ymm6")			\
+	SHA2_AVX2_ROR(s, n2, m2, src, "ymm5", "ymm6")			\
+	"vpxor %%ymm5, %%" dst ", %%" dst "\n"				\
+	SHA2_AVX2_ROR(s, n3, m3, src, "ymm5", "ymm6")			\
+	"vpxor %%ymm5, %%" dst ", %%" dst "\n"
+
+/* As SHA2_AVX2_SIGMA(), but the last one is a shift by n3 bits */
+#define	SHA2_AVX2_SSIGMA(s, n1, m1, n2, m2, n3, src, dst)		\
+	SHA2_AVX2_ROR(s, n1, m1, src, dst, "ymm6")			\
+	SHA2_AVX2_ROR(s, n2, m2, src, "ymm5", "ymm6")			\
+	"vpxor %%ymm5, %%" dst ", %%" dst "\n"				\
+	"vpsrl" s " $" #n3 ", %%" src ", %%ymm5\n"			\
+	"vpxor %%ymm5, %%" dst ", %%" dst "\n"
+
+#define	SHA256_AVX2_BSIG0(src, dst)					\
+	SHA2_AVX2_SIGMA("d", 2, 30, 13, 19, 22, 10, src, dst)
+#define	SHA256_AVX2_BSIG1(src, dst)					\
+	SHA2_AVX2_SIGMA("d", 6, 26, 11, 21, 25, 7, src, dst)
+#define	SHA256_AVX2_SSIG0(src, dst)					\
+	SHA2_AVX2_SSIGMA("d", 7, 25, 18, 14, 3, src, dst)
+#define	SHA256_AVX2_SSIG1(src, dst)					\
+	SHA2_AVX2_SSIGMA("d", 17, 15, 19, 13, 10, src, dst)
+
+#define	SHA512_AVX2_BSIG0(src, dst)					\
+	SHA2_AVX2_SIGMA("q", 28, 36, 34, 30, 39, 25, src, dst)
+#define	SHA512_AVX2_BSIG1(src, dst)					\
+	SHA2_AVX2_SIGMA("q", 14, 50, 18, 46, 41, 23, src, dst)
+#define	SHA512_AVX2_SSIG0(src, dst)					\
+	SHA2_AVX2_SSIGMA("q", 1, 63, 8, 56, 7, src, dst)
+#define	SHA512_AVX2_SSIG1(src, dst)					\
+	SHA2_AVX2_SSIGMA("q", 19, 45, 61, 3, 6, src, dst)
+
+/*
+ * One round: d += T1 and h = T1 + T2, the caller renames the working
+ * variables.  ymm0 holds e and then a, ymm1 T1, ymm2-ymm4 the rest, and
+ * Maj(a, b, c) is computed as (a & b) ^ (c & (a ^ b)).
+ */
+#define	SHA2_AVX2_ROUND(s, BSIG0, BSIG1, va, vb, vc, vd, ve, vf, vg, vh,	\
+    vw, kt)								\
+	asm volatile(							\
+	    "vmovdqu %[e], %%ymm0\n"					\
+	    BSIG1("ymm0", "ymm1")					\
+	    "vpand %[f], %%ymm0, %%ymm2\n"				\
+	    "vpandn %[g], %%ymm0, %%ymm3\n"				\
+	    "vpxor %%ymm3, %%ymm2, %%ymm2\n"				\
+	    "vpadd" s " %%ymm2, %%ymm1, %%ymm1\n"			\
+	    "vpadd" s " %[h], %%ymm1, %%ymm1\n"				\
+	    "vpadd" s " %[w], %%ymm1, %%ymm1\n"				\
+	    "vpbroadcast" s " %[k], %%ymm2\n"				\
+	    "vpadd" s " %%ymm2, %%ymm1, %%ymm1\n"			\
+	    "vpadd" s " %[d], %%ymm1, %%ymm2\n"				\
+	    "vmovdqu %%ymm2, %[d]\n"					\
+	    "vmovdqu %[a], %%ymm0\n"					\
+	    BSIG0("ymm0", "ymm2")					\
+	    "vmovdqu %[b], %%ymm3\n"					\
+	    "vpxor %%ymm0, %%ymm3, %%ymm4\n"				\
+	    "vpand %[c], %%ymm4, %%ymm4\n"				\
+	    "vpand %%ymm0, %%ymm3, %%ymm3\n"				\
+	    "vpxor %%ymm4, %%ymm3, %%ymm3\n"				\
+	    "vpadd" s " %%ymm3, %%ymm2, %%ymm2\n"			\
+	    "vpadd" s " %%ymm2, %%ymm1, %%ymm1\n"			\
+	    "vmovdqu %%ymm1, %[h]\n"					\
+	    : [d] "+m" (vd), [h] "+m" (vh)				\
+	    : [a] "m" (va), [b] "m" (vb), [c] "m" (vc), [e] "m" (ve),	\
+	    [f] "m" (vf), [g] "m" (vg), [w] "m" (vw), [k] "m" (kt)	\
+	    : "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6")
+
+/* W[t] = SSIG1(W[t - 2]) + W[t - 7] + SSIG0(W[t - 15]) + W[t - 16] */
+#define	SHA2_AVX2_SCHEDULE(s, SSIG0, SSIG1, vt, v2, v7, v15)		\
+	asm volatile(							\
+	    "vmovdqu %[w2], %%ymm0\n"					\
+	    SSIG1("ymm0", "ymm1")					\
+	    "vmovdqu %[w15], %%ymm0\n"					\
+	    SSIG0("ymm0", "ymm2")					\
+	    "vpadd" s " %%ymm2, %%ymm1, %%ymm1\n"			\
+	    "vpadd" s " %[w7], %%ymm1, %%ymm1\n"			\
+	    "vpadd" s " %[wt], %%ymm1, %%ymm1\n"			\
+	    "vmovdqu %%ymm1, %[wt]\n"					\
+	    : [wt] "+m" (vt)						\
+	    : [w2] "m" (v2), [w7] "m" (v7), [w15] "m" (v15)		\
+	    : "xmm0", "xmm1", "xmm2", "xmm5", "xmm6")
+
+/* Round t, with the working variables renamed to a-h */
+#define	SHA2_AVX2_STEP(s, S, st, K, t, a, b, c, d, e, f, g, h)		\
+{									\
+	if ((t) >= 16) {						\
+		SHA2_AVX2_SCHEDULE(s, S##_SSIG0, S##_SSIG1,		\
+		    (st)->w[(t) & 15], (st)->w[((t) - 2) & 15],		\
+		    (st)->w[((t) - 7) & 15], (st)->w[((t) - 15) & 15]);	\
+	}								\
+	SHA2_AVX2_ROUND(s, S##_BSIG0, S##_BSIG1, (st)->v[a], (st)->v[b],	\
+	    (st)->v[c], (st)->v[d], (st)->v[e], (st)->v[f], (st)->v[g],	\
+	    (st)->v[h], (st)->w[(t) & 15], (K)[t]);			\
+}
+
+/* Eight rounds from t on, which brings the names back where they were */
+#define	SHA2_AVX2_ROUNDS8(s, S, st, K, t)				\
+{									\
+	SHA2_AVX2_STEP(s, S, st, K, (t) + 0, 0, 1, 2, 3, 4, 5, 6, 7);	\
+	SHA2_AVX2_STEP(s, S, st, K, (t) + 1, 7, 0, 1, 2, 3, 4, 5, 6);	\
+	SHA2_AVX2_STEP(s, S, st, K, (t) + 2, 6, 7, 0, 1, 2, 3, 4, 5);	\
+	SHA2_AVX2_STEP(s, S, st, K, (t) + 3, 5, 6, 7, 0, 1, 2, 3, 4);	\
+	SHA2_AVX2_STEP(s, S, st, K, (t) + 4, 4, 5, 6, 7, 0, 1, 2, 3);	\
+	SHA2_AVX2_STEP(s, S, st, K, (t) + 5, 3, 4, 5, 6, 7, 0, 1, 2);	\
+	SHA2_AVX2_STEP(s, S, st, K, (t) + 6, 2, 3, 4, 5, 6, 7, 0, 1);	\
+	SHA2_AVX2_STEP(s, S, st, K, (t) + 7, 1, 2, 3, 4, 5, 6, 7, 0);	\
+}
+
+static void
+sha256_avx2_rounds(sha256_avx2_state_t *st)
+{
+	int t;
+
+	for (t = 0; t < 64; t += 8)
+		SHA2_AVX2_ROUNDS8("d", SHA256_AVX2, st, sha256_k, t);
+}
+
+static void
+sha512_avx2_rounds(sha512_avx2_state_t *st)
+{
+	int t;
+
+	for (t = 0; t < 80; t += 8)
+		SHA2_AVX2_ROUNDS8("q", SHA512_AVX2, st, sha512_k, t);
+}
+
+static void
+sha256_avx2_many(SHA2_CTX *const *ctx, const uint8_t *const *in, size_t num)
+{
+	sha256_avx2_state_t st;
+	uint32_t h[8][SHA256_AVX2_DEGREE];
+	size_t b, i, j;
+
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < SHA256_AVX2_DEGREE; j++)
+			h[i][j] = ctx[j]->state.s32[i];
+	}
+
+	kfpu_begin();
+	for (b = 0; b < num; b++) {
+		for (j = 0; j < SHA256_AVX2_DEGREE; j++) {
+			const uint32_t *p =
+			    (const uint32_t *)(in[j] + (b << 6));
+
+			for (i = 0; i < 16; i++)
+				st.w[i][j] = BE_32(p[i]);
+		}
+		bcopy(h, st.v, sizeof (h));
+
+		sha256_avx2_rounds(&st);
+
+		for (i = 0; i < 8; i++) {
+			for (j = 0; j < SHA256_AVX2_DEGREE; j++)
+				h[i][j] += st.v[i][j];
+		}
+	}
+	asm volatile("vzeroupper");
+	kfpu_end();
+
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < SHA256_AVX2_DEGREE; j++)
+			ctx[j]->state.s32[i] = h[i][j];
+	}
+	bzero(&st, sizeof (st));
+}
+
+static void
+sha512_avx2_many(SHA2_CTX *const *ctx, const uint8_t *const *in, size_t num)
+{
+	sha512_avx2_state_t st;
+	uint64_t h[8][SHA512_AVX2_DEGREE];
+	size_t b, i, j;
+
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < SHA512_AVX2_DEGREE; j++)
+			h[i][j] = ctx[j]->state.s64[i];
+	}
+
+	kfpu_begin();
+	for (b = 0; b < num; b++) {
+		for (j = 0; j < SHA512_AVX2_DEGREE; j++) {
+			const uint64_t *p =
+			    (const uint64_t *)(in[j] + (b << 7));
+
+			for (i = 0; i < 16; i++)
+				st.w[i][j] = BE_64(p[i]);
+		}
+		bcopy(h, st.v, sizeof (h));
+
+		sha512_avx2_rounds(&st);
+
+		for (i = 0; i < 8; i++) {
+			for (j = 0; j < SHA512_AVX2_DEGREE; j++)
+				h[i][j] += st.v[i][j];
+		}
+	}
+	asm volatile("vzeroupper");
+	kfpu_end();
+
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < SHA512_AVX2_DEGREE; j++)
+			ctx[j]->state.s64[i] = h[i][j];
+	}
+	bzero(&st, sizeof (st));
+}
+
+static boolean_t
+sha2_avx2_will_work(void)
+{
+	return (zfs_avx2_available());
+}
+
+const sha2_impl_ops_t sha2_avx2_impl = {
+	.sha256_blocks = sha256_x86_64_blocks,
+	.sha512_blocks = sha512_x86_64_blocks,
+	.sha256_many = sha256_avx2_many,
+	.sha512_many = sha512_avx2_many,
+	.is_supported = sha2_avx2_will_work,
+	.sha256_degree = SHA256_AVX2_DEGREE,
+	.sha512_degree = SHA512_AVX2_DEGREE,
+	.name = "avx2"
+};
+
+#endif /* defined(HAVE_AVX2) */
+
+#endif /* defined(__x86_64) */
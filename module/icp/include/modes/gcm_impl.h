@@ -36,19 +36,27 @@ extern "C" {
 #include <sys/zfs_context.h>
 #include <sys/crypto/common.h>
 
+struct gcm_ctx;
+
 /*
  * Methods used to define gcm implementation
  *
  * @gcm_mul_f Perform carry-less multiplication
+ * @gcm_crypt_blocks_f Encrypt or decrypt as many whole chunks of blocks
+ *   as fit in the length and add the ciphertext to the GHASH, returning
+ *   the number of bytes done.  Optional.
  * @gcm_will_work_f Function tests whether implementation will function
  */
 typedef void 		(*gcm_mul_f)(uint64_t *, uint64_t *, uint64_t *);
+typedef size_t		(*gcm_crypt_blocks_f)(struct gcm_ctx *,
+    const uint8_t *, uint8_t *, size_t, boolean_t);
 typedef boolean_t	(*gcm_will_work_f)(void);
 
 #define	GCM_IMPL_NAME_MAX (16)
 
 typedef struct gcm_impl_ops {
 	gcm_mul_f mul;
+	gcm_crypt_blocks_f crypt_blocks;
 	gcm_will_work_f is_supported;
 	char name[GCM_IMPL_NAME_MAX];
 } gcm_impl_ops_t;
@@ -57,11 +65,19 @@ extern const gcm_impl_ops_t gcm_generic_impl;
 #if defined(__x86_64) && defined(HAVE_PCLMULQDQ)
 extern const gcm_impl_ops_t gcm_pclmulqdq_impl;
 #endif
+#if defined(__x86_64) && defined(HAVE_AES) && defined(HAVE_PCLMULQDQ) && \
+	defined(HAVE_AVX2)
+extern const gcm_impl_ops_t gcm_avx2_impl;
+#if defined(HAVE_VAES) && defined(HAVE_VPCLMULQDQ)
+extern const gcm_impl_ops_t gcm_vaes_impl;
+#endif
+#endif
 
 /*
  * Initializes fastest implementation
  */
 void gcm_impl_init(void);
+void gcm_impl_fini(void);
 
 /*
  * Get selected aes implementation
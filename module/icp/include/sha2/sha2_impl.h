@@ -57,6 +57,52 @@ typedef struct sha2_hmac_ctx {
 	SHA2_CTX		hc_ocontext;	/* outer SHA2 context */
 } sha2_hmac_ctx_t;
 
+/*
+ * Methods used to define SHA2 implementations.  The block functions hash
+ * num consecutive blocks into the state of a context.  The multi-buffer
+ * functions hash num blocks of each of as many inputs as their degree,
+ * one input per vector lane, into as many contexts.  Neither touches the
+ * byte counts or the buffered input of the contexts.
+ */
+typedef void (*sha2_blocks_f)(SHA2_CTX *ctx, const void *in, size_t num);
+typedef void (*sha2_many_f)(SHA2_CTX *const *ctx, const uint8_t *const *in,
+    size_t num);
+typedef boolean_t (*sha2_is_supported_f)(void);
+
+typedef struct sha2_impl_ops {
+	sha2_blocks_f sha256_blocks;
+	sha2_blocks_f sha512_blocks;
+	sha2_many_f sha256_many;	/* NULL for single buffer only */
+	sha2_many_f sha512_many;
+	sha2_is_supported_f is_supported;
+	int sha256_degree;		/* inputs sha256_many() does at once */
+	int sha512_degree;		/* inputs sha512_many() does at once */
+	const char *name;
+} sha2_impl_ops_t;
+
+#define	SHA2_MAX_DEGREE		8
+
+/* Return selected SHA2 implementation ops */
+extern const sha2_impl_ops_t *sha2_impl_get_ops(void);
+
+extern const sha2_impl_ops_t sha2_generic_impl;
+
+/* The portable block functions, also used by the SIMD implementations */
+extern void sha256_generic_blocks(SHA2_CTX *ctx, const void *in, size_t num);
+extern void sha512_generic_blocks(SHA2_CTX *ctx, const void *in, size_t num);
+
+#if defined(__x86_64) && defined(_KERNEL)
+extern const sha2_impl_ops_t sha2_x86_64_impl;
+#endif
+
+#if defined(__x86_64) && defined(HAVE_SHA_NI)
+extern const sha2_impl_ops_t sha2_shani_impl;
+#endif
+
+#if defined(__x86_64) && defined(HAVE_AVX2)
+extern const sha2_impl_ops_t sha2_avx2_impl;
+#endif
+
 #ifdef	__cplusplus
 }
 #endif
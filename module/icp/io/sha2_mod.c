@@ -220,6 +220,9 @@ sha2_mod_init(void)
 {
 	int ret;
 
+	/* find the fastest implementation and set any requested one */
+	sha2_impl_init();
+
 	if ((ret = mod_install(&modlinkage)) != 0)
 		return (ret);
 
@@ -252,6 +255,8 @@ sha2_mod_fini(void)
 		sha2_prov_handle = 0;
 	}
 
+	sha2_impl_fini();
+
 	return (mod_remove(&modlinkage));
 }
 
@@ -848,10 +848,17 @@ abd_fletcher_4_simd2scalar(boolean_t native, void *data, size_t size,
 	abd_fletcher_4_fini(cdp);
 	cdp->acd_private = (void *)&fletcher_4_scalar_ops;
 
+	/*
+	 * Carry the partial sums over into the scalar context, so that any
+	 * further iterations and the final abd_fletcher_4_fini() continue
+	 * from them.
+	 */
+	cdp->acd_ctx->scalar = *zcp;
+
 	if (native)
-		fletcher_4_incremental_native(data, size, zcp);
+		fletcher_4_scalar_native(cdp->acd_ctx, data, size);
 	else
-		fletcher_4_incremental_byteswap(data, size, zcp);
+		fletcher_4_scalar_byteswap(cdp->acd_ctx, data, size);
 }
 
 static int
@@ -75,6 +75,7 @@ zfs_prop_init(void)
 		{ "sha512",     ZIO_CHECKSUM_SHA512 },
 		{ "skein",      ZIO_CHECKSUM_SKEIN },
 		{ "edonr",      ZIO_CHECKSUM_EDONR },
+		{ "blake3",     ZIO_CHECKSUM_BLAKE3 },
 		{ NULL }
 	};
 
@@ -93,6 +94,9 @@ zfs_prop_init(void)
 		  ZIO_CHECKSUM_SKEIN | ZIO_CHECKSUM_VERIFY },
 		{ "edonr,verify",
 		  ZIO_CHECKSUM_EDONR | ZIO_CHECKSUM_VERIFY },
+		{ "blake3",     ZIO_CHECKSUM_BLAKE3 },
+		{ "blake3,verify",
+		  ZIO_CHECKSUM_BLAKE3 | ZIO_CHECKSUM_VERIFY },
 		{ NULL }
 	};
 
@@ -112,6 +116,89 @@ zfs_prop_init(void)
 		{ "gzip-9",	ZIO_COMPRESS_GZIP_9 },
 		{ "zle",	ZIO_COMPRESS_ZLE },
 		{ "lz4",	ZIO_COMPRESS_LZ4 },
+		{ "zstd",	ZIO_COMPRESS_ZSTD },
+		{ "zstd-1",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_1) },
+		{ "zstd-2",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_2) },
+		{ "zstd-3",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_3) },
+		{ "zstd-4",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_4) },
+		{ "zstd-5",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_5) },
+		{ "zstd-6",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_6) },
+		{ "zstd-7",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_7) },
+		{ "zstd-8",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_8) },
+		{ "zstd-9",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_9) },
+		{ "zstd-10",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_10) },
+		{ "zstd-11",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_11) },
+		{ "zstd-12",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_12) },
+		{ "zstd-13",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_13) },
+		{ "zstd-14",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_14) },
+		{ "zstd-15",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_15) },
+		{ "zstd-16",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_16) },
+		{ "zstd-17",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_17) },
+		{ "zstd-18",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_18) },
+		{ "zstd-19",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_19) },
+		{ "zstd-fast",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_1) },
+		{ "zstd-fast-1",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_1) },
+		{ "zstd-fast-2",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_2) },
+		{ "zstd-fast-3",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_3) },
+		{ "zstd-fast-4",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_4) },
+		{ "zstd-fast-5",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_5) },
+		{ "zstd-fast-6",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_6) },
+		{ "zstd-fast-7",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_7) },
+		{ "zstd-fast-8",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_8) },
+		{ "zstd-fast-9",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_9) },
+		{ "zstd-fast-10",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_10) },
+		{ "zstd-fast-20",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_20) },
+		{ "zstd-fast-30",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_30) },
+		{ "zstd-fast-40",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_40) },
+		{ "zstd-fast-50",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_50) },
+		{ "zstd-fast-60",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_60) },
+		{ "zstd-fast-70",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_70) },
+		{ "zstd-fast-80",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_80) },
+		{ "zstd-fast-90",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_90) },
+		{ "zstd-fast-100",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_100) },
+		{ "zstd-fast-500",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_500) },
+		{ "zstd-fast-1000",	ZIO_COMPRESS_RAW(ZIO_COMPRESS_ZSTD,
+		    ZIO_ZSTD_LEVEL_FAST_1000) },
 		{ NULL }
 	};
 
@@ -253,6 +340,13 @@ zfs_prop_init(void)
 		{ NULL }
 	};
 
+	static zprop_index_t direct_table[] = {
+		{ "standard",	ZFS_DIRECT_STANDARD },
+		{ "always",	ZFS_DIRECT_ALWAYS },
+		{ "disabled",	ZFS_DIRECT_DISABLED },
+		{ NULL }
+	};
+
 	static zprop_index_t xattr_table[] = {
 		{ "off",	ZFS_XATTR_OFF },
 		{ "on",		ZFS_XATTR_DIR },
@@ -297,19 +391,27 @@ zfs_prop_init(void)
 	    PROP_INHERIT, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME,
 	    "standard | always | disabled", "SYNC",
 	    sync_table);
+	zprop_register_index(ZFS_PROP_DIRECT, "direct", ZFS_DIRECT_STANDARD,
+	    PROP_INHERIT, ZFS_TYPE_FILESYSTEM,
+	    "standard | always | disabled", "DIRECT",
+	    direct_table);
 	zprop_register_index(ZFS_PROP_CHECKSUM, "checksum",
 	    ZIO_CHECKSUM_DEFAULT, PROP_INHERIT, ZFS_TYPE_FILESYSTEM |
 	    ZFS_TYPE_VOLUME,
 		"on | off | fletcher2 | fletcher4 | sha256 | sha512 | "
-		"skein | edonr", "CHECKSUM", checksum_table);
+		"skein | edonr | blake3", "CHECKSUM", checksum_table);
 	zprop_register_index(ZFS_PROP_DEDUP, "dedup", ZIO_CHECKSUM_OFF,
 	    PROP_INHERIT, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME,
 		"on | off | verify | sha256[,verify], sha512[,verify], "
-		"skein[,verify], edonr,verify", "DEDUP", dedup_table);
+		"skein[,verify], edonr,verify, blake3[,verify]", "DEDUP",
+		dedup_table);
 	zprop_register_index(ZFS_PROP_COMPRESSION, "compression",
 	    ZIO_COMPRESS_DEFAULT, PROP_INHERIT,
 	    ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME,
-	    "on | off | lzjb | gzip | gzip-[1-9] | zle | lz4", "COMPRESS",
+	    "on | off | lzjb | gzip | gzip-[1-9] | zle | lz4 | "
+	    "zstd | zstd-[1-19] | "
+	    "zstd-fast-[1-10,20,30,40,50,60,70,80,90,100,500,1000]",
+	    "COMPRESS",
 	    compress_table);
 	zprop_register_index(ZFS_PROP_SNAPDIR, "snapdir", ZFS_SNAPDIR_HIDDEN,
 	    PROP_INHERIT, ZFS_TYPE_FILESYSTEM,
@@ -560,6 +662,18 @@ zfs_prop_init(void)
 	zprop_register_number(ZFS_PROP_SPECIAL_SMALL_BLOCKS,
 	    "special_small_blocks", 0, PROP_INHERIT, ZFS_TYPE_FILESYSTEM,
 	    "zero or 512 to 128K, power of 2", "SPECIAL_SMALL_BLOCKS");
+	zprop_register_number(ZFS_PROP_LIMIT_BW_READ, "limit_bw_read", 0,
+	    PROP_INHERIT, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME,
+	    "<bytes per second> | none", "LIMIT_BW_READ");
+	zprop_register_number(ZFS_PROP_LIMIT_BW_WRITE, "limit_bw_write", 0,
+	    PROP_INHERIT, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME,
+	    "<bytes per second> | none", "LIMIT_BW_WRITE");
+	zprop_register_number(ZFS_PROP_LIMIT_OP_READ, "limit_op_read", 0,
+	    PROP_INHERIT, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME,
+	    "<operations per second> | none", "LIMIT_OP_READ");
+	zprop_register_number(ZFS_PROP_LIMIT_OP_WRITE, "limit_op_write", 0,
+	    PROP_INHERIT, ZFS_TYPE_FILESYSTEM | ZFS_TYPE_VOLUME,
+	    "<operations per second> | none", "LIMIT_OP_WRITE");
 
 	/* hidden properties */
 	zprop_register_hidden(ZFS_PROP_CREATETXG, "createtxg", PROP_TYPE_NUMBER,
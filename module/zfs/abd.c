@@ -165,6 +165,7 @@ typedef struct abd_stats {
 	kstat_named_t abdstat_scattered_metadata_cnt;
 	kstat_named_t abdstat_scattered_filedata_cnt;
 	kstat_named_t abdstat_borrowed_buf_cnt;
+	kstat_named_t abdstat_borrowed_uio_cnt;
 	kstat_named_t abdstat_move_refcount_nonzero;
 	kstat_named_t abdstat_moved_linear;
 	kstat_named_t abdstat_moved_scattered_filedata;
@@ -209,6 +210,8 @@ static abd_stats_t abd_stats = {
 	{ "filedata_scattered_buffers",         KSTAT_DATA_UINT64 },
 	/* number of borrowed bufs */
 	{ "borrowed_bufs",                      KSTAT_DATA_UINT64 },
+	/* number of ABDs lent out as uios by abd_borrow_uio() */
+	{ "borrowed_uios",                      KSTAT_DATA_UINT64 },
 	/* abd_try_move() statistics */
 	{ "move_refcount_nonzero",              KSTAT_DATA_UINT64 },
 	{ "moved_linear",                       KSTAT_DATA_UINT64 },
@@ -1118,6 +1121,72 @@ abd_iterate_func(abd_t *abd, size_t off, size_t size,
 	return (ret);
 }
 
+/*
+ * Borrow the first n bytes of an ABD as a uio with one iovec per chunk, so
+ * consumers of uios (like the ICP) can work on the ABD's own memory
+ * instead of a linear copy from abd_borrow_buf_copy().  The uio has room
+ * for extra iovecs the caller may append.  The ABD can't be moved until
+ * the uio is handed back with abd_return_uio().
+ */
+uio_t *
+abd_borrow_uio(abd_t *abd, size_t n, uint_t extra, int rw)
+{
+	struct abd_iter aiter;
+	size_t cnt, off;
+	uio_t *uio;
+
+	mutex_enter(&abd->abd_mutex);
+	abd_verify(abd);
+	ASSERT3U((size_t)abd->abd_size, >=, n);
+
+	if (abd_is_linear(abd)) {
+		cnt = 1;
+	} else {
+		off = abd->abd_u.abd_scatter.abd_offset;
+		cnt = abd_chunkcnt_for_bytes(off + n) -
+		    off / zfs_abd_chunk_size;
+	}
+
+	uio = uio_create(cnt + extra, 0, UIO_SYSSPACE, rw);
+	if (uio == NULL) {
+		mutex_exit(&abd->abd_mutex);
+		return (NULL);
+	}
+
+	abd_iter_init(&aiter, abd);
+	for (off = 0; off < n; ) {
+		abd_iter_map(&aiter);
+
+		size_t len = MIN(aiter.iter_mapsize, n - off);
+		ASSERT3U(len, >, 0);
+
+		VERIFY0(uio_addiov(uio, (user_addr_t)aiter.iter_mapaddr, len));
+
+		abd_iter_unmap(&aiter);
+		abd_iter_advance(&aiter, len);
+		off += len;
+	}
+
+	(void) zfs_refcount_add_many(&abd->abd_children, n, uio);
+	mutex_exit(&abd->abd_mutex);
+
+	ABDSTAT_BUMP(abdstat_borrowed_uio_cnt);
+
+	return (uio);
+}
+
+void
+abd_return_uio(abd_t *abd, uio_t *uio, size_t n)
+{
+	mutex_enter(&abd->abd_mutex);
+	abd_verify(abd);
+	(void) zfs_refcount_remove_many(&abd->abd_children, n, uio);
+	mutex_exit(&abd->abd_mutex);
+
+	uio_free(uio);
+	ABDSTAT_BUMPDOWN(abdstat_borrowed_uio_cnt);
+}
+
 struct buf_arg {
 	void *arg_buf;
 };
@@ -343,6 +343,39 @@ int zfs_arc_evict_batch_limit = 10;
  */
 int zfs_arc_num_sublists_per_state = 0;
 
+/*
+ * The number of threads used to evict from the sublists of an arc state
+ * in parallel. If this is not set to a suitable value by the user, it
+ * will be configured based on the number of CPUs on the system in
+ * arc_init(). A value of 1 keeps all eviction on the calling thread.
+ * Only read when the ARC is initialized; the kstat of the same name
+ * reports the number of threads in use and can't be written.
+ */
+int zfs_arc_evict_threads = 0;
+static int arc_evict_threads;
+static taskq_t *arc_evict_taskq;
+
+/*
+ * Per-sublist share of an eviction request below which the request is
+ * handled by the calling thread instead of the arc_evict taskq; the
+ * dispatch overhead isn't worth it for small amounts.
+ */
+#define	ARC_EVICT_TASK_MIN_BYTES	(1ULL << 20)
+
+/*
+ * Argument of one arc_evict_task(): evict up to eva_bytes from sublist
+ * eva_idx of eva_ml, resuming from eva_marker.
+ */
+typedef struct arc_evict_arg {
+	taskq_ent_t	eva_tqent;
+	multilist_t	*eva_ml;
+	arc_buf_hdr_t	*eva_marker;
+	int		eva_idx;
+	uint64_t	eva_spa;
+	int64_t		eva_bytes;
+	uint64_t	eva_evicted;
+} arc_evict_arg_t;
+
 /* number of seconds before growing cache again */
 static int		arc_grow_retry = 60;
 
@@ -477,6 +510,17 @@ typedef struct arc_stats {
 	 * buffers to reach its target amount.
 	 */
 	kstat_named_t arcstat_evict_not_enough;
+	/*
+	 * Number of sublist eviction tasks handed to the arc_evict taskq.
+	 */
+	kstat_named_t arcstat_evict_tasks;
+	/*
+	 * Number of times a thread allocating ARC space had to wait in
+	 * arc_get_data_impl() for eviction to catch up, and the total time
+	 * (in microseconds) spent waiting.
+	 */
+	kstat_named_t arcstat_evict_throttle_count;
+	kstat_named_t arcstat_evict_throttle_time_us;
 	kstat_named_t arcstat_evict_l2_cached;
 	kstat_named_t arcstat_evict_l2_eligible;
 	kstat_named_t arcstat_evict_l2_ineligible;
@@ -684,6 +728,75 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_l2_psize;
 	/* Not updated directly; only synced in arc_kstat_update. */
 	kstat_named_t arcstat_l2_hdr_size;
+	/*
+	 * Number of L2ARC log blocks written. These are used for restoring
+	 * the L2ARC. Updated during writing of L2ARC log blocks.
+	 */
+	kstat_named_t arcstat_l2_log_blk_writes;
+	/*
+	 * Moving average of the aligned size of the L2ARC log blocks, in
+	 * bytes. Updated during L2ARC rebuild and during writing of L2ARC
+	 * log blocks.
+	 */
+	kstat_named_t arcstat_l2_log_blk_avg_asize;
+	/* Aligned size of L2ARC log blocks on L2ARC devices. */
+	kstat_named_t arcstat_l2_log_blk_asize;
+	/* Number of L2ARC log blocks present on L2ARC devices. */
+	kstat_named_t arcstat_l2_log_blk_count;
+	/*
+	 * Moving average of the aligned size of L2ARC restored data, in bytes,
+	 * to the aligned size of their metadata in L2ARC, in bytes.
+	 * Updated during L2ARC rebuild and during writing of L2ARC log blocks.
+	 */
+	kstat_named_t arcstat_l2_data_to_meta_ratio;
+	/*
+	 * Number of times the L2ARC rebuild was successful for an L2ARC device.
+	 */
+	kstat_named_t arcstat_l2_rebuild_success;
+	/*
+	 * Number of times the L2ARC rebuild failed because the device header
+	 * was in an unsupported format or corrupted.
+	 */
+	kstat_named_t arcstat_l2_rebuild_abort_unsupported;
+	/*
+	 * Number of times the L2ARC rebuild failed because of IO errors
+	 * while reading a log block.
+	 */
+	kstat_named_t arcstat_l2_rebuild_abort_io_errors;
+	/*
+	 * Number of times the L2ARC rebuild failed because of IO errors when
+	 * reading the device header.
+	 */
+	kstat_named_t arcstat_l2_rebuild_abort_dh_errors;
+	/*
+	 * Number of L2ARC log blocks which failed to be restored due to
+	 * checksum errors or a bad magic/format.
+	 */
+	kstat_named_t arcstat_l2_rebuild_abort_cksum_lb_errors;
+	/*
+	 * Number of times the L2ARC rebuild was aborted due to low system
+	 * memory.
+	 */
+	kstat_named_t arcstat_l2_rebuild_abort_lowmem;
+	/* Logical size of L2ARC restored data, in bytes. */
+	kstat_named_t arcstat_l2_rebuild_size;
+	/* Aligned size of L2ARC restored data, in bytes. */
+	kstat_named_t arcstat_l2_rebuild_asize;
+	/*
+	 * Number of L2ARC log entries (buffers) that were successfully
+	 * restored in ARC.
+	 */
+	kstat_named_t arcstat_l2_rebuild_bufs;
+	/*
+	 * Number of L2ARC log entries (buffers) already cached in ARC. These
+	 * were not restored again.
+	 */
+	kstat_named_t arcstat_l2_rebuild_bufs_precached;
+	/*
+	 * Number of L2ARC log blocks that were restored successfully. Each
+	 * log block may hold up to L2ARC_LOG_BLK_MAX_ENTRIES buffers.
+	 */
+	kstat_named_t arcstat_l2_rebuild_log_blks;
 	kstat_named_t arcstat_memory_throttle_count;
 	/* Not updated directly; only synced in arc_kstat_update. */
 	kstat_named_t arcstat_meta_used;
@@ -744,6 +857,9 @@ static arc_stats_t arc_stats = {
 	{ "mutex_miss",			KSTAT_DATA_UINT64 },
 	{ "evict_skip",			KSTAT_DATA_UINT64 },
 	{ "evict_not_enough",		KSTAT_DATA_UINT64 },
+	{ "evict_tasks",		KSTAT_DATA_UINT64 },
+	{ "evict_throttle_count",	KSTAT_DATA_UINT64 },
+	{ "evict_throttle_time_us",	KSTAT_DATA_UINT64 },
 	{ "evict_l2_cached",		KSTAT_DATA_UINT64 },
 	{ "evict_l2_eligible",		KSTAT_DATA_UINT64 },
 	{ "evict_l2_ineligible",	KSTAT_DATA_UINT64 },
@@ -801,6 +917,22 @@ static arc_stats_t arc_stats = {
 	{ "l2_size",			KSTAT_DATA_UINT64 },
 	{ "l2_asize",			KSTAT_DATA_UINT64 },
 	{ "l2_hdr_size",		KSTAT_DATA_UINT64 },
+	{ "l2_log_blk_writes",		KSTAT_DATA_UINT64 },
+	{ "l2_log_blk_avg_asize",	KSTAT_DATA_UINT64 },
+	{ "l2_log_blk_asize",		KSTAT_DATA_UINT64 },
+	{ "l2_log_blk_count",		KSTAT_DATA_UINT64 },
+	{ "l2_data_to_meta_ratio",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_success",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_unsupported",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_io_errors",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_dh_errors",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_cksum_lb_errors",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_lowmem",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_size",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_asize",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_bufs",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_bufs_precached",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_log_blks",	KSTAT_DATA_UINT64 },
 	{ "memory_throttle_count",	KSTAT_DATA_UINT64 },
 	{ "arc_meta_used",		KSTAT_DATA_UINT64 },
 	{ "arc_meta_limit",		KSTAT_DATA_UINT64 },
@@ -859,6 +991,24 @@ static arc_stats_t arc_stats = {
 #define	ARCSTAT_MAXSTAT(stat) \
 	ARCSTAT_MAX(stat##_max, arc_stats.stat.value.ui64)
 
+/*
+ * This macro allows us to use kstats as floating averages. Each time we
+ * update this kstat, we first factor it and the update value by
+ * ARCSTAT_AVG_FACTOR to shrink the new value's contribution to the overall
+ * average. This macro assumes that integer loads and stores are atomic, but
+ * is not safe for multiple writers updating the kstat in parallel (only the
+ * last writer's update will remain).
+ */
+#define	ARCSTAT_F_AVG_FACTOR	3
+#define	ARCSTAT_F_AVG(stat, value) \
+	do { \
+		uint64_t x = ARCSTAT(stat); \
+		x = x - x / ARCSTAT_F_AVG_FACTOR + \
+		    (value) / ARCSTAT_F_AVG_FACTOR; \
+		ARCSTAT(stat) = x; \
+		_NOTE(CONSTCOND) \
+	} while (0)
+
 /*
  * We define a macro to allow ARC hits/misses to be easily broken down by
  * two separate conditions, giving a total of four different subtypes for
@@ -1110,6 +1260,21 @@ boolean_t l2arc_noprefetch = B_TRUE;		/* don't cache prefetch bufs */
 boolean_t l2arc_feed_again = B_TRUE;		/* turbo warmup */
 boolean_t l2arc_norw = B_TRUE;			/* no reads during writes */
 
+/*
+ * L2ARC persistence tunables:
+ *
+ *	l2arc_rebuild_enabled		rebuild the L2ARC contents from the
+ *					log blocks on the cache device when
+ *					it is added (at pool import or later)
+ *	l2arc_rebuild_blocks_min_l2size	cache devices smaller than this get
+ *					no log blocks; on small devices the
+ *					space l2arc_evict() frees ahead of the
+ *					write hand is large compared to what
+ *					a rebuild could restore
+ */
+boolean_t l2arc_rebuild_enabled = B_TRUE;
+uint64_t l2arc_rebuild_blocks_min_l2size = 1024 * 1024 * 1024;
+
 static list_t L2ARC_dev_list;			/* device list */
 static list_t *l2arc_dev_list;			/* device list pointer */
 static kmutex_t l2arc_dev_mtx;			/* device list mutex */
@@ -1118,6 +1283,8 @@ static list_t L2ARC_free_on_write;		/* free after write buf list */
 static list_t *l2arc_free_on_write;		/* free after write list ptr */
 static kmutex_t l2arc_free_on_write_mtx;	/* mutex for list */
 static uint64_t l2arc_ndev;			/* number of devices */
+static kmutex_t l2arc_rebuild_thr_lock;		/* rebuild thread lock */
+static kcondvar_t l2arc_rebuild_thr_cv;		/* rebuild thread cv */
 
 typedef struct l2arc_read_callback {
 	arc_buf_hdr_t		*l2rcb_hdr;		/* read header */
@@ -1167,6 +1334,34 @@ static inline void arc_hdr_clear_flags(arc_buf_hdr_t *hdr, arc_flags_t flags);
 static boolean_t l2arc_write_eligible(uint64_t, arc_buf_hdr_t *);
 static void l2arc_read_done(zio_t *);
 
+/*
+ * Persistent L2ARC routines
+ */
+static void l2arc_rebuild_vdev(l2arc_dev_t *dev);
+static void l2arc_dev_rebuild_start(l2arc_dev_t *dev);
+static int l2arc_rebuild(l2arc_dev_t *dev);
+static int l2arc_dev_hdr_read(l2arc_dev_t *dev);
+static void l2arc_dev_hdr_update(l2arc_dev_t *dev);
+static int l2arc_log_blk_read(l2arc_dev_t *dev,
+    const l2arc_log_blkptr_t *this_lbp, l2arc_log_blk_phys_t *this_lb,
+    l2arc_log_blk_phys_t *next_lb, zio_t *this_io, zio_t **next_io);
+static zio_t *l2arc_log_blk_fetch(vdev_t *vd,
+    const l2arc_log_blkptr_t *lbp, l2arc_log_blk_phys_t *lb);
+static void l2arc_log_blk_fetch_abort(zio_t *zio);
+static void l2arc_log_blk_restore(l2arc_dev_t *dev,
+    const l2arc_log_blk_phys_t *lb, uint64_t lb_asize);
+static void l2arc_hdr_restore(const l2arc_log_ent_phys_t *le,
+    l2arc_dev_t *dev);
+static uint64_t l2arc_log_blk_commit(l2arc_dev_t *dev, zio_t *pio,
+    l2arc_write_callback_t *cb);
+static boolean_t l2arc_log_blk_insert(l2arc_dev_t *dev,
+    const arc_buf_hdr_t *ab);
+static boolean_t l2arc_range_check_overlap(uint64_t bottom, uint64_t top,
+    uint64_t check);
+static boolean_t l2arc_log_blkptr_valid(l2arc_dev_t *dev,
+    const l2arc_log_blkptr_t *lbp);
+static uint64_t l2arc_log_blk_overhead(uint64_t write_sz, l2arc_dev_t *dev);
+
 
 /*
  * We use Cityhash for this. It's fast, and has good hash properties without
@@ -1697,7 +1892,7 @@ arc_cksum_is_equal(arc_buf_hdr_t *hdr, zio_t *zio)
 
 		abd_t *cdata = abd_alloc_linear(HDR_GET_PSIZE(hdr), B_TRUE);
 		csize = zio_compress_data(compress, zio->io_abd,
-		    abd_to_buf(cdata), lsize);
+		    abd_to_buf(cdata), lsize, hdr->b_complevel);
 
 		ASSERT3U(csize, <=, HDR_GET_PSIZE(hdr));
 		if (csize < HDR_GET_PSIZE(hdr)) {
@@ -2038,7 +2233,7 @@ arc_hdr_authenticate(arc_buf_hdr_t *hdr, spa_t *spa, uint64_t dsobj)
 		abd_take_ownership_of_buf(abd, B_TRUE);
 
 		csize = zio_compress_data(HDR_GET_COMPRESS(hdr),
-		    hdr->b_l1hdr.b_pabd, tmpbuf, lsize);
+		    hdr->b_l1hdr.b_pabd, tmpbuf, lsize, hdr->b_complevel);
 		ASSERT3U(csize, <=, psize);
 		abd_zero_off(abd, csize, psize - csize);
 	}
@@ -2124,7 +2319,7 @@ arc_hdr_decrypt(arc_buf_hdr_t *hdr, spa_t *spa, const zbookmark_phys_t *zb)
 
 		ret = zio_decompress_data(HDR_GET_COMPRESS(hdr),
 		    hdr->b_l1hdr.b_pabd, tmp, HDR_GET_PSIZE(hdr),
-		    HDR_GET_LSIZE(hdr));
+		    HDR_GET_LSIZE(hdr), &hdr->b_complevel);
 		if (ret != 0) {
 			abd_return_buf(cabd, tmp, arc_hdr_size(hdr));
 			goto error;
@@ -2374,7 +2569,8 @@ arc_buf_fill(arc_buf_t *buf, spa_t *spa, const zbookmark_phys_t *zb,
 		} else {
 			int error = zio_decompress_data(HDR_GET_COMPRESS(hdr),
 			    hdr->b_l1hdr.b_pabd, buf->b_data,
-			    HDR_GET_PSIZE(hdr), HDR_GET_LSIZE(hdr));
+			    HDR_GET_PSIZE(hdr), HDR_GET_LSIZE(hdr),
+			    &hdr->b_complevel);
 
 			/*
 			 * Absent hardware errors or software bugs, this should
@@ -3428,6 +3624,7 @@ arc_hdr_alloc(uint64_t spa, int32_t psize, int32_t lsize,
 	ASSERT3P(hdr->b_l1hdr.b_freeze_cksum, ==, NULL);
 	HDR_SET_PSIZE(hdr, psize);
 	HDR_SET_LSIZE(hdr, lsize);
+	hdr->b_complevel = 0;
 	hdr->b_spa = spa;
 	hdr->b_type = type;
 	hdr->b_flags = 0;
@@ -3616,6 +3813,7 @@ arc_hdr_realloc_crypt(arc_buf_hdr_t *hdr, boolean_t need_crypt)
 	nhdr->b_flags = hdr->b_flags;
 	nhdr->b_psize = hdr->b_psize;
 	nhdr->b_lsize = hdr->b_lsize;
+	nhdr->b_complevel = hdr->b_complevel;
 	nhdr->b_spa = hdr->b_spa;
 	nhdr->b_l2hdr.b_dev = hdr->b_l2hdr.b_dev;
 	nhdr->b_l2hdr.b_daddr = hdr->b_l2hdr.b_daddr;
@@ -4191,6 +4389,32 @@ arc_evict_state_impl(multilist_t *ml, int idx, arc_buf_hdr_t *marker,
 	return (bytes_evicted);
 }
 
+/*
+ * Taskq callback evicting a single sublist on behalf of arc_evict_state().
+ * arc_evict_state_impl() gives up the sublist lock after every
+ * zfs_arc_evict_batch_limit headers; keep calling it until this task's
+ * share has been evicted or a batch makes no progress.
+ */
+static void
+arc_evict_task(void *arg)
+{
+	arc_evict_arg_t *eva = arg;
+	uint64_t evicted;
+
+	eva->eva_evicted = 0;
+	do {
+		int64_t bytes_remaining = eva->eva_bytes;
+
+		if (bytes_remaining != ARC_EVICT_ALL)
+			bytes_remaining -= eva->eva_evicted;
+
+		evicted = arc_evict_state_impl(eva->eva_ml, eva->eva_idx,
+		    eva->eva_marker, eva->eva_spa, bytes_remaining);
+		eva->eva_evicted += evicted;
+	} while (evicted != 0 && (eva->eva_bytes == ARC_EVICT_ALL ||
+	    eva->eva_evicted < eva->eva_bytes));
+}
+
 /*
  * Evict buffers from the given arc state, until we've removed the
  * specified number of bytes. Move the removed buffers to the
@@ -4212,11 +4436,22 @@ arc_evict_state(arc_state_t *state, uint64_t spa, int64_t bytes,
 	multilist_t *ml = state->arcs_list[type];
 	int num_sublists;
 	arc_buf_hdr_t **markers;
+	arc_evict_arg_t *evarg = NULL;
 
 	IMPLY(bytes < 0, bytes == ARC_EVICT_ALL);
 
 	num_sublists = multilist_get_num_sublists(ml);
 
+	/*
+	 * With more than one eviction thread, the sublists are evicted in
+	 * parallel by the arc_evict taskq.
+	 */
+	if (arc_evict_taskq != NULL && num_sublists > 1) {
+		evarg = kmem_zalloc(sizeof (*evarg) * num_sublists, KM_SLEEP);
+		for (int i = 0; i < num_sublists; i++)
+			taskq_init_ent(&evarg[i].eva_tqent);
+	}
+
 	/*
 	 * If we've tried to evict from each sublist, made some
 	 * progress, but still have not hit the target number of bytes
@@ -4255,26 +4490,60 @@ arc_evict_state(arc_state_t *state, uint64_t spa, int64_t bytes,
 		int sublist_idx = multilist_get_random_index(ml);
 		uint64_t scan_evicted = 0;
 
-		for (int i = 0; i < num_sublists; i++) {
-			uint64_t bytes_remaining;
-			uint64_t bytes_evicted;
+		/*
+		 * Split what is left to evict evenly across the sublists and
+		 * let the taskq evict them concurrently, as long as each
+		 * share is large enough to be worth a dispatch.
+		 */
+		if (evarg != NULL && (bytes == ARC_EVICT_ALL ||
+		    (bytes - total_evicted) / num_sublists >=
+		    ARC_EVICT_TASK_MIN_BYTES)) {
+			int64_t share = (bytes == ARC_EVICT_ALL) ?
+			    ARC_EVICT_ALL : (bytes - total_evicted) / num_sublists;
+
+			for (int i = 0; i < num_sublists; i++) {
+				arc_evict_arg_t *eva = &evarg[sublist_idx];
+
+				eva->eva_ml = ml;
+				eva->eva_marker = markers[sublist_idx];
+				eva->eva_idx = sublist_idx;
+				eva->eva_spa = spa;
+				eva->eva_bytes = share;
+				taskq_dispatch_ent(arc_evict_taskq, arc_evict_task,
+				    eva, 0, &eva->eva_tqent);
+
+				if (++sublist_idx >= num_sublists)
+					sublist_idx = 0;
+			}
+			ARCSTAT_INCR(arcstat_evict_tasks, num_sublists);
+			taskq_wait(arc_evict_taskq);
 
-			if (bytes == ARC_EVICT_ALL)
-				bytes_remaining = ARC_EVICT_ALL;
-			else if (total_evicted < bytes)
-				bytes_remaining = bytes - total_evicted;
-			else
-				break;
+			for (int i = 0; i < num_sublists; i++)
+				scan_evicted += evarg[i].eva_evicted;
+			total_evicted += scan_evicted;
+		} else {
+			for (int i = 0; i < num_sublists; i++) {
+				uint64_t bytes_remaining;
+				uint64_t bytes_evicted;
+
+				if (bytes == ARC_EVICT_ALL)
+					bytes_remaining = ARC_EVICT_ALL;
+				else if (total_evicted < bytes)
+					bytes_remaining = bytes - total_evicted;
+				else
+					break;
 
-			bytes_evicted = arc_evict_state_impl(ml, sublist_idx,
-			    markers[sublist_idx], spa, bytes_remaining);
+				bytes_evicted = arc_evict_state_impl(ml,
+				    sublist_idx, markers[sublist_idx], spa,
+				    bytes_remaining);
 
-			scan_evicted += bytes_evicted;
-			total_evicted += bytes_evicted;
+				scan_evicted += bytes_evicted;
+				total_evicted += bytes_evicted;
 
-			/* we've reached the end, wrap to the beginning */
-			if (++sublist_idx >= num_sublists)
-				sublist_idx = 0;
+				/* we've reached the end, wrap to the beginning */
+				if (++sublist_idx >= num_sublists)
+					sublist_idx = 0;
+			}
 		}
 
 		/*
@@ -4309,6 +4578,8 @@ arc_evict_state(arc_state_t *state, uint64_t spa, int64_t bytes,
 		kmem_cache_free(hdr_full_cache, markers[i]);
 	}
 	kmem_free(markers, sizeof (*markers) * num_sublists);
+	if (evarg != NULL)
+		kmem_free(evarg, sizeof (*evarg) * num_sublists);
 
 	return (total_evicted);
 }
@@ -4847,7 +5118,7 @@ arc_kmem_reap_now(void)
 	kmem_cache_t		*prev_data_cache = NULL;
 	extern kmem_cache_t	*zio_buf_cache[];
 	extern kmem_cache_t	*zio_data_buf_cache[];
-	extern kmem_cache_t	*range_seg_cache;
+	extern kmem_cache_t	*zfs_btree_leaf_cache;
 	extern kmem_cache_t	*abd_chunk_cache;
 	extern vmem_t           *abd_chunk_arena;
 
@@ -4904,7 +5175,7 @@ arc_kmem_reap_now(void)
 	kmem_cache_reap_now(buf_cache);
 	kmem_cache_reap_now(hdr_full_cache);
 	kmem_cache_reap_now(hdr_l2only_cache);
-	kmem_cache_reap_now(range_seg_cache);
+	kmem_cache_reap_now(zfs_btree_leaf_cache);
 #ifdef _KERNEL
 	extern kmem_cache_t *dnode_cache;
 	if (dnode_cache) kmem_cache_reap_now(dnode_cache);
@@ -5537,15 +5808,23 @@ arc_get_data_impl(arc_buf_hdr_t *hdr, uint64_t size, void *tag)
 		 */
 #ifndef __APPLE__
 		if (arc_is_overflowing()) {
+			hrtime_t start = gethrtime();
+
 			cv_signal(&arc_reclaim_thread_cv);
 			cv_wait(&arc_reclaim_waiters_cv, &arc_reclaim_lock);
+
+			ARCSTAT_BUMP(arcstat_evict_throttle_count);
+			ARCSTAT_INCR(arcstat_evict_throttle_time_us,
+			    (gethrtime() - start) / (NANOSEC / MICROSEC));
 		}
 #else
 		if (arc_is_overflowing()) {
 			static _Atomic int32_t waiters = 0;
+			hrtime_t start = gethrtime();
+			boolean_t throttled = B_FALSE;
 			waiters++;
 
-			for (hrtime_t start = gethrtime(); arc_is_overflowing();) {
+			while (arc_is_overflowing()) {
 
 				if (arc_reclaim_in_loop == B_FALSE)
 					cv_signal(&arc_reclaim_thread_cv);
@@ -5555,6 +5834,7 @@ arc_get_data_impl(arc_buf_hdr_t *hdr, uint64_t size, void *tag)
 
 				ARCSTAT_BUMP(arc_reclaim_waiters_count_total);
 				ARCSTAT_BUMP(arc_reclaim_waiters_count);
+				throttled = B_TRUE;
 				(void) cv_timedwait_hires(&arc_reclaim_waiters_cv,
 				    &arc_reclaim_lock, USEC2NSEC(500), 0, 0);
 				ARCSTAT_BUMPDOWN(arc_reclaim_waiters_count);
@@ -5565,6 +5845,12 @@ arc_get_data_impl(arc_buf_hdr_t *hdr, uint64_t size, void *tag)
 				}
 			}
 			waiters--;
+
+			if (throttled) {
+				ARCSTAT_BUMP(arcstat_evict_throttle_count);
+				ARCSTAT_INCR(arcstat_evict_throttle_time_us,
+				    (gethrtime() - start) / (NANOSEC / MICROSEC));
+			}
 		}
 #endif
 
@@ -5920,6 +6206,15 @@ arc_read_done(zio_t *zio)
 		}
 	}
 
+	/*
+	 * If the zio layer decompressed the block on our behalf (compressed
+	 * ARC disabled), it also learned the level it was compressed with.
+	 * Keep it so the block can be recompressed identically for L2ARC
+	 * and authentication.
+	 */
+	if (zio->io_error == 0 && zio->io_prop.zp_complevel != 0)
+		hdr->b_complevel = zio->io_prop.zp_complevel;
+
 	arc_hdr_clear_flags(hdr, ARC_FLAG_L2_EVICTED);
 	if (l2arc_noprefetch && HDR_PREFETCH(hdr))
 		arc_hdr_clear_flags(hdr, ARC_FLAG_L2CACHE);
@@ -6919,6 +7214,7 @@ arc_write_ready(zio_t *zio)
 	}
 	HDR_SET_PSIZE(hdr, psize);
 	arc_hdr_set_compress(hdr, compress);
+	hdr->b_complevel = zio->io_prop.zp_complevel;
 
 	if (zio->io_error != 0 || psize == 0)
 		goto out;
@@ -7108,6 +7404,7 @@ arc_write(zio_t *pio, spa_t *spa, uint64_t txg,
 		ASSERT(ARC_BUF_COMPRESSED(buf));
 		localprop.zp_encrypt = B_TRUE;
 		localprop.zp_compress = HDR_GET_COMPRESS(hdr);
+		localprop.zp_complevel = hdr->b_complevel;
 		localprop.zp_byteorder =
 		    (hdr->b_l1hdr.b_byteswap == DMU_BSWAP_NUMFUNCS) ?
 		    ZFS_HOST_BYTEORDER : !ZFS_HOST_BYTEORDER;
@@ -7126,6 +7423,7 @@ arc_write(zio_t *pio, spa_t *spa, uint64_t txg,
 	} else if (ARC_BUF_COMPRESSED(buf)) {
 		ASSERT3U(HDR_GET_LSIZE(hdr), !=, arc_buf_size(buf));
 		localprop.zp_compress = HDR_GET_COMPRESS(hdr);
+		localprop.zp_complevel = hdr->b_complevel;
 		zio_flags |= ZIO_FLAG_RAW_COMPRESS;
 	}
 	callback = kmem_zalloc(sizeof (arc_write_callback_t), KM_SLEEP);
@@ -7479,6 +7777,10 @@ int arc_kstat_update_osx(kstat_t *ksp, int rw)
 		zfs_arc_shrink_shift      = ks->arc_zfs_arc_shrink_shift.value.ui64;
 		zfs_arc_p_min_shift       = ks->arc_zfs_arc_p_min_shift.value.ui64;
 		zfs_arc_average_blocksize = ks->arc_zfs_arc_average_blocksize.value.ui64;
+		/*
+		 * zfs_arc_evict_threads is read-only: the eviction taskq is
+		 * sized once in arc_init(), before the kstat can be written.
+		 */
 
 	} else {
 
@@ -7505,6 +7807,7 @@ int arc_kstat_update_osx(kstat_t *ksp, int rw)
 		ks->arc_zfs_arc_shrink_shift.value.ui64      = zfs_arc_shrink_shift;
 		ks->arc_zfs_arc_p_min_shift.value.ui64       = zfs_arc_p_min_shift;
 		ks->arc_zfs_arc_average_blocksize.value.ui64 = zfs_arc_average_blocksize;
+		ks->arc_zfs_arc_evict_threads.value.ui64     = arc_evict_threads;
 	}
 	return 0;
 }
@@ -7784,6 +8087,23 @@ arc_init(void)
 	arc_state_init();
 	buf_init();
 
+	/*
+	 * Size the eviction thread pool: a single thread keeps up on
+	 * small systems, larger ones get a thread per doubling of the CPU
+	 * count plus one per 32 CPUs.
+	 */
+	if (zfs_arc_evict_threads > 0)
+		arc_evict_threads = zfs_arc_evict_threads;
+	else if (max_ncpus < 6)
+		arc_evict_threads = 1;
+	else
+		arc_evict_threads = (highbit64(max_ncpus) - 1) +
+		    max_ncpus / 32;
+	if (arc_evict_threads > 1) {
+		arc_evict_taskq = taskq_create("arc_evict", arc_evict_threads,
+		    minclsyspri, arc_evict_threads, INT_MAX, TASKQ_PREPOPULATE);
+	}
+
 	arc_reclaim_thread_exit = B_FALSE;
 
 	arc_ksp = kstat_create("zfs", 0, "arcstats", "misc", KSTAT_TYPE_NAMED,
@@ -7843,6 +8163,11 @@ arc_fini(void)
 	/* Use B_TRUE to ensure *all* buffers are evicted */
 	arc_flush(NULL, B_TRUE);
 
+	if (arc_evict_taskq != NULL) {
+		taskq_destroy(arc_evict_taskq);
+		arc_evict_taskq = NULL;
+	}
+
 	arc_dead = B_TRUE;
 
 	if (arc_ksp != NULL) {
@@ -8115,10 +8440,14 @@ l2arc_dev_get_next(void)
 		else if (next == first)
 			break;
 
-	} while (vdev_is_dead(next->l2ad_vdev));
+	} while (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild);
 
-	/* if we were unable to find any usable vdevs, return NULL */
-	if (vdev_is_dead(next->l2ad_vdev))
+	/*
+	 * If we were unable to find any usable vdevs, return NULL. Devices
+	 * that are still being rebuilt are skipped, since writing to them
+	 * would move the write hand under the feet of l2arc_rebuild().
+	 */
+	if (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild)
 		next = NULL;
 
 	l2arc_dev_last = next;
@@ -8168,6 +8497,7 @@ static void
 l2arc_write_done(zio_t *zio)
 {
 	l2arc_write_callback_t *cb;
+	l2arc_lb_abd_buf_t *abd_buf;
 	l2arc_dev_t *dev;
 	list_t *buflist;
 	arc_buf_hdr_t *head, *hdr, *hdr_prev;
@@ -8273,6 +8603,15 @@ top:
 
 	l2arc_do_free_on_write();
 
+	/*
+	 * Free the buffers of the log blocks written along with the data.
+	 */
+	while ((abd_buf = list_remove_head(&cb->l2wcb_abd_list)) != NULL) {
+		abd_free(abd_buf->abd);
+		kmem_free(abd_buf, sizeof (l2arc_lb_abd_buf_t));
+	}
+	list_destroy(&cb->l2wcb_abd_list);
+
 	kmem_free(cb, sizeof (l2arc_write_callback_t));
 }
 
@@ -8344,7 +8683,7 @@ l2arc_untransform(zio_t *zio, l2arc_read_callback_t *cb)
 
 		ret = zio_decompress_data(HDR_GET_COMPRESS(hdr),
 		    hdr->b_l1hdr.b_pabd, tmp, HDR_GET_PSIZE(hdr),
-		    HDR_GET_LSIZE(hdr));
+		    HDR_GET_LSIZE(hdr), &hdr->b_complevel);
 		if (ret != 0) {
 			abd_return_buf_copy(cabd, tmp, arc_hdr_size(hdr));
 			arc_free_data_abd(hdr, cabd, arc_hdr_size(hdr), hdr);
@@ -8553,16 +8892,14 @@ l2arc_evict(l2arc_dev_t *dev, uint64_t distance, boolean_t all)
 	arc_buf_hdr_t *hdr, *hdr_prev;
 	kmutex_t *hash_lock;
 	uint64_t taddr;
+	l2arc_lb_ptr_buf_t *lb_ptr_buf, *lb_ptr_buf_prev;
 
 	buflist = &dev->l2ad_buflist;
 
-	if (!all && dev->l2ad_first) {
-		/*
-		 * This is the first sweep through the device.  There is
-		 * nothing to evict.
-		 */
-		return;
-	}
+	/*
+	 * We need to add in the worst case scenario of log block overhead.
+	 */
+	distance += l2arc_log_blk_overhead(distance, dev);
 
 	if (dev->l2ad_hand >= (dev->l2ad_end - (2 * distance))) {
 		/*
@@ -8573,11 +8910,67 @@ l2arc_evict(l2arc_dev_t *dev, uint64_t distance, boolean_t all)
 	} else {
 		taddr = dev->l2ad_hand + distance;
 	}
+
+	/*
+	 * Record how far ahead of the write hand the device has been
+	 * cleared. Log blocks (and their payload) falling into the range
+	 * between the write hand and this address are no longer valid and
+	 * must not be used by a later rebuild.
+	 */
+	if (!all)
+		dev->l2ad_evict = MAX(dev->l2ad_evict, taddr);
+
+	if (!all && dev->l2ad_first) {
+		/*
+		 * This is the first sweep through the device.  There is
+		 * nothing to evict.
+		 */
+		return;
+	}
+
 	DTRACE_PROBE4(l2arc__evict, l2arc_dev_t *, dev, list_t *, buflist,
 	    uint64_t, taddr, boolean_t, all);
 
 top:
 	mutex_enter(&dev->l2ad_mtx);
+	/*
+	 * We have to account for evicted log blocks. Run vdev_space_update()
+	 * on log blocks whose offset (in bytes) is before the evicted offset
+	 * (in bytes) by searching in the list of pointers to log blocks
+	 * present in the L2ARC device.
+	 */
+	for (lb_ptr_buf = list_tail(&dev->l2ad_lbptr_list); lb_ptr_buf;
+	    lb_ptr_buf = lb_ptr_buf_prev) {
+
+		lb_ptr_buf_prev = list_prev(&dev->l2ad_lbptr_list, lb_ptr_buf);
+
+		/* L2BLK_GET_PSIZE returns aligned size for log blocks */
+		uint64_t asize = L2BLK_GET_PSIZE(
+		    (lb_ptr_buf->lb_ptr)->lbp_prop);
+
+		/*
+		 * We don't worry about log blocks left behind (ie
+		 * lbp_payload_start < l2ad_hand) because l2arc_write_buffers()
+		 * will never write more than l2arc_evict() evicted.
+		 */
+		if (!all && l2arc_log_blkptr_valid(dev, lb_ptr_buf->lb_ptr)) {
+			break;
+		} else {
+			vdev_space_update(dev->l2ad_vdev, -asize, 0, 0);
+			ARCSTAT_INCR(arcstat_l2_log_blk_asize, -asize);
+			ARCSTAT_BUMPDOWN(arcstat_l2_log_blk_count);
+			(void) zfs_refcount_remove_many(&dev->l2ad_lb_asize,
+			    asize, lb_ptr_buf);
+			(void) zfs_refcount_remove(&dev->l2ad_lb_count,
+			    lb_ptr_buf);
+			list_remove(&dev->l2ad_lbptr_list, lb_ptr_buf);
+			kmem_free(lb_ptr_buf->lb_ptr,
+			    sizeof (l2arc_log_blkptr_t));
+			kmem_free(lb_ptr_buf, sizeof (l2arc_lb_ptr_buf_t));
+			dev->l2ad_dev_hdr_dirty = B_TRUE;
+		}
+	}
+
 	for (hdr = list_tail(buflist); hdr; hdr = hdr_prev) {
 		hdr_prev = list_prev(buflist, hdr);
 
@@ -8697,7 +9090,8 @@ l2arc_apply_transforms(spa_t *spa, arc_buf_hdr_t *hdr, uint64_t asize,
         cabd = abd_alloc_for_io(asize, ismd);
         tmp = abd_borrow_buf(cabd, asize);
 
-        psize = zio_compress_data(compress, to_write, tmp, size);
+        psize = zio_compress_data(compress, to_write, tmp, size,
+		    hdr->b_complevel);
 		ASSERT3U(psize, <=, HDR_GET_PSIZE(hdr));
 		if (psize < asize)
 			bzero((char *)tmp + psize, asize - psize);
@@ -8776,8 +9170,8 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 {
 	arc_buf_hdr_t *hdr, *hdr_prev, *head;
 	uint64_t write_asize, write_psize, write_lsize, headroom;
-	boolean_t full;
-	l2arc_write_callback_t *cb;
+	boolean_t full, commit;
+	l2arc_write_callback_t *cb = NULL;
 	zio_t *pio, *wzio;
 	uint64_t guid = spa_load_guid(spa);
 
@@ -8929,6 +9323,13 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 				    sizeof (l2arc_write_callback_t), KM_SLEEP);
 				cb->l2wcb_dev = dev;
 				cb->l2wcb_head = head;
+				/*
+				 * Create a list to save allocated abd buffers
+				 * for l2arc_log_blk_commit().
+				 */
+				list_create(&cb->l2wcb_abd_list,
+				    sizeof (l2arc_lb_abd_buf_t),
+				    offsetof(l2arc_lb_abd_buf_t, node));
 				pio = zio_root(spa, l2arc_write_done, cb,
 				    ZIO_FLAG_CANFAIL);
 			}
@@ -8958,9 +9359,23 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 			write_psize += psize;
 			dev->l2ad_hand += asize;
 
+			/*
+			 * Append buf info to the current log block; it is
+			 * committed to the device once it fills up.
+			 */
+			commit = l2arc_log_blk_insert(dev, hdr);
+
 			mutex_exit(hash_lock);
 
 			(void) zio_nowait(wzio);
+
+			/*
+			 * l2ad_hand will be adjusted in l2arc_log_blk_commit().
+			 */
+			if (commit) {
+				write_asize +=
+				    l2arc_log_blk_commit(dev, pio, cb);
+			}
 		}
 
 		multilist_sublist_unlock(mls);
@@ -8977,7 +9392,8 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 		return (0);
 	}
 
-	ASSERT3U(write_asize, <=, target_sz);
+	ASSERT3U(write_asize, <=, target_sz +
+	    l2arc_log_blk_overhead(target_sz, dev));
 	ARCSTAT_BUMP(arcstat_l2_writes_sent);
 	ARCSTAT_INCR(arcstat_l2_write_bytes, write_psize);
 	ARCSTAT_INCR(arcstat_l2_lsize, write_lsize);
@@ -8988,15 +9404,28 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	 * Bump device hand to the device start if it is approaching the end.
 	 * l2arc_evict() will already have evicted ahead for this case.
 	 */
-	if (dev->l2ad_hand >= (dev->l2ad_end - target_sz)) {
+	if (dev->l2ad_hand >= (dev->l2ad_end - (target_sz +
+	    l2arc_log_blk_overhead(target_sz, dev)))) {
 		dev->l2ad_hand = dev->l2ad_start;
+		dev->l2ad_evict = dev->l2ad_start;
 		dev->l2ad_first = B_FALSE;
+		dev->l2ad_dev_hdr_dirty = B_TRUE;
 	}
 
 	dev->l2ad_writing = B_TRUE;
 	(void) zio_wait(pio);
 	dev->l2ad_writing = B_FALSE;
 
+	/*
+	 * Update the device header only after the data and log blocks it
+	 * references have made it to the device, and only if a log block
+	 * was committed or evicted, or the device wrapped, since it was
+	 * last written.  A rebuild needs nothing else from it that could
+	 * have changed.
+	 */
+	if (dev->l2ad_dev_hdr_dirty)
+		l2arc_dev_hdr_update(dev);
+
 	return (write_asize);
 }
 
@@ -9131,11 +9560,20 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	adddev = kmem_zalloc(sizeof (l2arc_dev_t), KM_SLEEP);
 	adddev->l2ad_spa = spa;
 	adddev->l2ad_vdev = vd;
-	adddev->l2ad_start = VDEV_LABEL_START_SIZE;
+	/* leave extra size for an l2arc device header */
+	adddev->l2ad_dev_hdr_asize = MAX(sizeof (*adddev->l2ad_dev_hdr),
+	    1ULL << vd->vdev_ashift);
+	adddev->l2ad_start = VDEV_LABEL_START_SIZE + adddev->l2ad_dev_hdr_asize;
 	adddev->l2ad_end = VDEV_LABEL_START_SIZE + vdev_get_min_asize(vd);
+	ASSERT3U(adddev->l2ad_start, <, adddev->l2ad_end);
 	adddev->l2ad_hand = adddev->l2ad_start;
+	adddev->l2ad_evict = adddev->l2ad_start;
 	adddev->l2ad_first = B_TRUE;
 	adddev->l2ad_writing = B_FALSE;
+	adddev->l2ad_dev_hdr = kmem_zalloc(adddev->l2ad_dev_hdr_asize,
+	    KM_SLEEP);
+	/* whatever is on the device is replaced by the first write */
+	adddev->l2ad_dev_hdr_dirty = B_TRUE;
 
 	mutex_init(&adddev->l2ad_mtx, NULL, MUTEX_DEFAULT, NULL);
 	/*
@@ -9145,8 +9583,23 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	list_create(&adddev->l2ad_buflist, sizeof (arc_buf_hdr_t),
 	    offsetof(arc_buf_hdr_t, b_l2hdr.b_l2node));
 
+	/*
+	 * This is a list of pointers to log blocks that are still present
+	 * on the device.
+	 */
+	list_create(&adddev->l2ad_lbptr_list, sizeof (l2arc_lb_ptr_buf_t),
+	    offsetof(l2arc_lb_ptr_buf_t, node));
+
 	vdev_space_update(vd, 0, 0, adddev->l2ad_end - adddev->l2ad_hand);
 	zfs_refcount_create(&adddev->l2ad_alloc);
+	zfs_refcount_create(&adddev->l2ad_lb_asize);
+	zfs_refcount_create(&adddev->l2ad_lb_count);
+
+	/*
+	 * Decide whether the device is large enough to carry log blocks
+	 * and whether its previous contents can be rebuilt.
+	 */
+	l2arc_rebuild_vdev(adddev);
 
 	/*
 	 * Add device to global list
@@ -9177,6 +9630,22 @@ l2arc_remove_vdev(vdev_t *vd)
 		}
 	}
 	ASSERT3P(remdev, !=, NULL);
+	mutex_exit(&l2arc_dev_mtx);
+
+	/*
+	 * Cancel any ongoing or scheduled rebuild and wait for the rebuild
+	 * thread to let go of the device.
+	 */
+	mutex_enter(&l2arc_rebuild_thr_lock);
+	if (remdev->l2ad_rebuild) {
+		remdev->l2ad_rebuild_cancel = B_TRUE;
+		while (remdev->l2ad_rebuild_began && remdev->l2ad_rebuild)
+			cv_wait(&l2arc_rebuild_thr_cv, &l2arc_rebuild_thr_lock);
+		remdev->l2ad_rebuild = B_FALSE;
+	}
+	mutex_exit(&l2arc_rebuild_thr_lock);
+
+	mutex_enter(&l2arc_dev_mtx);
 
 	/*
 	 * Remove device from global list
@@ -9191,8 +9660,13 @@ l2arc_remove_vdev(vdev_t *vd)
 	 */
 	l2arc_evict(remdev, 0, B_TRUE);
 	list_destroy(&remdev->l2ad_buflist);
+	ASSERT(list_is_empty(&remdev->l2ad_lbptr_list));
+	list_destroy(&remdev->l2ad_lbptr_list);
 	mutex_destroy(&remdev->l2ad_mtx);
 	zfs_refcount_destroy(&remdev->l2ad_alloc);
+	zfs_refcount_destroy(&remdev->l2ad_lb_asize);
+	zfs_refcount_destroy(&remdev->l2ad_lb_count);
+	kmem_free(remdev->l2ad_dev_hdr, remdev->l2ad_dev_hdr_asize);
 	kmem_free(remdev, sizeof (l2arc_dev_t));
 }
 
@@ -9206,6 +9680,8 @@ l2arc_init(void)
 
 	mutex_init(&l2arc_feed_thr_lock, NULL, MUTEX_DEFAULT, NULL);
 	cv_init(&l2arc_feed_thr_cv, NULL, CV_DEFAULT, NULL);
+	mutex_init(&l2arc_rebuild_thr_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&l2arc_rebuild_thr_cv, NULL, CV_DEFAULT, NULL);
 	mutex_init(&l2arc_dev_mtx, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&l2arc_free_on_write_mtx, NULL, MUTEX_DEFAULT, NULL);
 
@@ -9230,6 +9706,8 @@ l2arc_fini(void)
 
 	mutex_destroy(&l2arc_feed_thr_lock);
 	cv_destroy(&l2arc_feed_thr_cv);
+	mutex_destroy(&l2arc_rebuild_thr_lock);
+	cv_destroy(&l2arc_rebuild_thr_cv);
 	mutex_destroy(&l2arc_dev_mtx);
 	mutex_destroy(&l2arc_free_on_write_mtx);
 
@@ -9261,6 +9739,893 @@ l2arc_stop(void)
 	mutex_exit(&l2arc_feed_thr_lock);
 }
 
+/*
+ * Look up the L2ARC device for a vdev, or NULL if it isn't an L2ARC device.
+ */
+static l2arc_dev_t *
+l2arc_vdev_get(vdev_t *vd)
+{
+	l2arc_dev_t *dev;
+
+	mutex_enter(&l2arc_dev_mtx);
+	for (dev = list_head(l2arc_dev_list); dev != NULL;
+	    dev = list_next(l2arc_dev_list, dev)) {
+		if (dev->l2ad_vdev == vd)
+			break;
+	}
+	mutex_exit(&l2arc_dev_mtx);
+
+	return (dev);
+}
+
+/*
+ * Called from l2arc_add_vdev() before the device is made visible to the
+ * feed thread. Decides whether the device keeps log blocks at all and,
+ * if it carries a usable device header, restores the write hand from it
+ * and marks the device for a rebuild. Otherwise a fresh log block chain
+ * is started.
+ */
+static void
+l2arc_rebuild_vdev(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *l2dhdr = dev->l2ad_dev_hdr;
+	uint64_t target_sz;
+
+	/*
+	 * Log blocks are only worth their overhead on larger devices.
+	 */
+	if (dev->l2ad_end - dev->l2ad_start >= l2arc_rebuild_blocks_min_l2size)
+		dev->l2ad_log_entries = L2ARC_LOG_BLK_MAX_ENTRIES;
+	else
+		dev->l2ad_log_entries = 0;
+
+	if (dev->l2ad_log_entries == 0 || !l2arc_rebuild_enabled ||
+	    l2arc_dev_hdr_read(dev) != 0 ||
+	    l2dhdr->dh_start_lbps[0].lbp_daddr == 0) {
+		bzero(l2dhdr, dev->l2ad_dev_hdr_asize);
+		return;
+	}
+
+	/*
+	 * Pick up where the previous incarnation of this device left off.
+	 * L2BLK_GET_PSIZE returns aligned size for log blocks.
+	 */
+	dev->l2ad_evict = MAX(l2dhdr->dh_evict, dev->l2ad_start);
+	dev->l2ad_hand = MAX(l2dhdr->dh_start_lbps[0].lbp_daddr +
+	    L2BLK_GET_PSIZE(l2dhdr->dh_start_lbps[0].lbp_prop),
+	    dev->l2ad_start);
+	dev->l2ad_first = !!(l2dhdr->dh_flags & L2ARC_DEV_HDR_EVICT_FIRST);
+
+	/*
+	 * Apply the wrap rule of l2arc_write_buffers() for the largest
+	 * possible write, in case the write size grew since the header
+	 * was written.
+	 */
+	target_sz = l2arc_write_max + l2arc_write_boost;
+	if (dev->l2ad_hand >= (dev->l2ad_end - (target_sz +
+	    l2arc_log_blk_overhead(target_sz, dev)))) {
+		dev->l2ad_hand = dev->l2ad_start;
+		dev->l2ad_evict = dev->l2ad_start;
+		dev->l2ad_first = B_FALSE;
+	}
+
+	dev->l2ad_rebuild = B_TRUE;
+}
+
+/*
+ * Kicks off rebuild threads for the L2ARC devices of a spa that have a
+ * rebuild pending. This is called from the spa async thread rather than
+ * from the import itself so that a long rebuild doesn't hold up the
+ * "zpool import" process.
+ */
+void
+l2arc_spa_rebuild_start(spa_t *spa)
+{
+	ASSERT(MUTEX_HELD(&spa_namespace_lock));
+
+	for (int i = 0; i < spa->spa_l2cache.sav_count; i++) {
+		l2arc_dev_t *dev =
+		    l2arc_vdev_get(spa->spa_l2cache.sav_vdevs[i]);
+		if (dev == NULL) {
+			/* Don't attempt a rebuild if the vdev is UNAVAIL */
+			continue;
+		}
+		mutex_enter(&l2arc_rebuild_thr_lock);
+		if (dev->l2ad_rebuild && !dev->l2ad_rebuild_began &&
+		    !dev->l2ad_rebuild_cancel) {
+			dev->l2ad_rebuild_began = B_TRUE;
+			(void) thread_create(NULL, 0,
+			    (void *)l2arc_dev_rebuild_start, dev, 0, &p0,
+			    TS_RUN, minclsyspri);
+		}
+		mutex_exit(&l2arc_rebuild_thr_lock);
+	}
+}
+
+/*
+ * Main entry point for L2ARC rebuilding.
+ */
+static void
+l2arc_dev_rebuild_start(l2arc_dev_t *dev)
+{
+	VERIFY(dev->l2ad_rebuild);
+	(void) l2arc_rebuild(dev);
+
+	mutex_enter(&l2arc_rebuild_thr_lock);
+	dev->l2ad_rebuild_began = B_FALSE;
+	dev->l2ad_rebuild = B_FALSE;
+	cv_broadcast(&l2arc_rebuild_thr_cv);
+	mutex_exit(&l2arc_rebuild_thr_lock);
+
+	thread_exit();
+}
+
+/*
+ * This function implements the actual L2ARC metadata rebuild. It:
+ * starts reading the log block chain and restores each block's contents
+ * to memory (reconstructing arc_buf_hdr_t's).
+ *
+ * Operation stops under any of the following conditions:
+ *
+ * 1) We reach the end of the log block chain.
+ * 2) We encounter *any* error condition (cksum errors, io errors)
+ * 3) The rebuild is cancelled because the device is being removed.
+ * 4) The system is running low on memory.
+ */
+static int
+l2arc_rebuild(l2arc_dev_t *dev)
+{
+	vdev_t *vd = dev->l2ad_vdev;
+	spa_t *spa = vd->vdev_spa;
+	l2arc_dev_hdr_phys_t *l2dhdr = dev->l2ad_dev_hdr;
+	l2arc_log_blk_phys_t *this_lb, *next_lb;
+	zio_t *this_io = NULL, *next_io = NULL;
+	l2arc_log_blkptr_t lbp;
+	l2arc_lb_ptr_buf_t *lb_ptr_buf;
+	boolean_t lock_held = B_FALSE;
+	uint64_t asize;
+	int err = 0;
+
+	this_lb = kmem_zalloc(sizeof (*this_lb), KM_SLEEP);
+	next_lb = kmem_zalloc(sizeof (*next_lb), KM_SLEEP);
+
+	lbp = l2dhdr->dh_start_lbps[0];
+
+	for (;;) {
+		/*
+		 * Device removal holds the config lock as writer while it
+		 * waits for us to stop, so never block on it; poll for
+		 * cancellation instead.
+		 */
+		while (!spa_config_tryenter(spa, SCL_L2ARC, vd, RW_READER)) {
+			if (dev->l2ad_rebuild_cancel) {
+				err = SET_ERROR(ECANCELED);
+				goto out;
+			}
+			delay(1);
+		}
+		lock_held = B_TRUE;
+
+		if (dev->l2ad_rebuild_cancel) {
+			err = SET_ERROR(ECANCELED);
+			goto out;
+		}
+
+		if (!l2arc_log_blkptr_valid(dev, &lbp))
+			break;
+
+		err = l2arc_log_blk_read(dev, &lbp, this_lb, next_lb,
+		    this_io, &next_io);
+		this_io = NULL;
+		if (err != 0)
+			goto out;
+
+		/*
+		 * Our memory pressure valve. Rather than swamping memory with
+		 * new ARC buf hdrs, give up on the rebuild. The device already
+		 * chains new log blocks onto the old ones, so it can be
+		 * rebuilt later by re-importing the pool or re-adding the
+		 * device once there is less memory pressure.
+		 */
+		if (arc_reclaim_needed()) {
+			ARCSTAT_BUMP(arcstat_l2_rebuild_abort_lowmem);
+			cmn_err(CE_NOTE, "System running low on memory, "
+			    "aborting L2ARC rebuild.");
+			err = SET_ERROR(ENOMEM);
+			goto out;
+		}
+
+		spa_config_exit(spa, SCL_L2ARC, vd);
+		lock_held = B_FALSE;
+
+		/*
+		 * The log block checks out; restore its entries.
+		 * L2BLK_GET_PSIZE returns aligned size for log blocks.
+		 */
+		asize = L2BLK_GET_PSIZE(lbp.lbp_prop);
+		l2arc_log_blk_restore(dev, this_lb, asize);
+
+		/*
+		 * Include the restored log block's pointer in the list of
+		 * pointers to log blocks present on the device, oldest last.
+		 */
+		lb_ptr_buf = kmem_zalloc(sizeof (l2arc_lb_ptr_buf_t), KM_SLEEP);
+		lb_ptr_buf->lb_ptr = kmem_zalloc(sizeof (l2arc_log_blkptr_t),
+		    KM_SLEEP);
+		bcopy(&lbp, lb_ptr_buf->lb_ptr, sizeof (l2arc_log_blkptr_t));
+		mutex_enter(&dev->l2ad_mtx);
+		list_insert_tail(&dev->l2ad_lbptr_list, lb_ptr_buf);
+		ARCSTAT_INCR(arcstat_l2_log_blk_asize, asize);
+		ARCSTAT_BUMP(arcstat_l2_log_blk_count);
+		(void) zfs_refcount_add_many(&dev->l2ad_lb_asize, asize,
+		    lb_ptr_buf);
+		(void) zfs_refcount_add(&dev->l2ad_lb_count, lb_ptr_buf);
+		mutex_exit(&dev->l2ad_mtx);
+		vdev_space_update(vd, asize, 0, 0);
+
+		/*
+		 * Protection against loops of log blocks: once the device has
+		 * wrapped, the chain ends where the payload of the previous
+		 * block would reach past the evicted offset into data that
+		 * has already been overwritten.
+		 */
+		if (!dev->l2ad_first && l2arc_range_check_overlap(
+		    this_lb->lb_prev_lbp.lbp_payload_start,
+		    lbp.lbp_payload_start, dev->l2ad_evict))
+			break;
+
+		/*
+		 * Continue with the next (older) log block, whose read has
+		 * already been issued by l2arc_log_blk_read().
+		 */
+		lbp = this_lb->lb_prev_lbp;
+		PTR_SWAP(this_lb, next_lb);
+		this_io = next_io;
+		next_io = NULL;
+	}
+
+out:
+	if (this_io != NULL)
+		l2arc_log_blk_fetch_abort(this_io);
+	if (next_io != NULL)
+		l2arc_log_blk_fetch_abort(next_io);
+	kmem_free(this_lb, sizeof (*this_lb));
+	kmem_free(next_lb, sizeof (*next_lb));
+
+	if (lock_held)
+		spa_config_exit(spa, SCL_L2ARC, vd);
+
+	if (err == 0)
+		ARCSTAT_BUMP(arcstat_l2_rebuild_success);
+
+	return (err);
+}
+
+/*
+ * Attempts to read the device header on the provided L2ARC device and
+ * validate it against the device and pool. On success, the header is
+ * left in dev->l2ad_dev_hdr and 0 is returned.
+ */
+static int
+l2arc_dev_hdr_read(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *l2dhdr = dev->l2ad_dev_hdr;
+	const uint64_t l2dhdr_asize = dev->l2ad_dev_hdr_asize;
+	vdev_t *vd = dev->l2ad_vdev;
+	abd_t *abd;
+	int err;
+
+	abd = abd_alloc_linear(l2dhdr_asize, B_TRUE);
+
+	err = zio_wait(zio_read_phys(NULL, vd,
+	    VDEV_LABEL_START_SIZE, l2dhdr_asize, abd,
+	    ZIO_CHECKSUM_LABEL, NULL, NULL, ZIO_PRIORITY_ASYNC_READ,
+	    ZIO_FLAG_DONT_CACHE | ZIO_FLAG_CANFAIL |
+	    ZIO_FLAG_DONT_PROPAGATE | ZIO_FLAG_DONT_RETRY |
+	    ZIO_FLAG_SPECULATIVE, B_FALSE));
+
+	abd_copy_to_buf(l2dhdr, abd, l2dhdr_asize);
+	abd_free(abd);
+
+	if (err != 0) {
+		ARCSTAT_BUMP(arcstat_l2_rebuild_abort_dh_errors);
+		zfs_dbgmsg("L2ARC IO error (%d) while reading device header, "
+		    "vdev guid: %llu", err, (u_longlong_t)vd->vdev_guid);
+		return (err);
+	}
+
+	if (l2dhdr->dh_magic != L2ARC_DEV_HDR_MAGIC ||
+	    l2dhdr->dh_version != L2ARC_PERSISTENT_VERSION ||
+	    l2dhdr->dh_spa_guid != spa_guid(vd->vdev_spa) ||
+	    l2dhdr->dh_vdev_guid != vd->vdev_guid ||
+	    l2dhdr->dh_log_entries != dev->l2ad_log_entries ||
+	    l2dhdr->dh_start != dev->l2ad_start ||
+	    l2dhdr->dh_end != dev->l2ad_end ||
+	    !l2arc_range_check_overlap(dev->l2ad_start, dev->l2ad_end,
+	    l2dhdr->dh_evict)) {
+		/*
+		 * Attempt to rebuild a device containing no actual dev hdr
+		 * or containing a header from some other pool, device size
+		 * or version of persistent L2ARC.
+		 */
+		ARCSTAT_BUMP(arcstat_l2_rebuild_abort_unsupported);
+		return (SET_ERROR(ENOTSUP));
+	}
+
+	return (0);
+}
+
+/*
+ * Reads L2ARC log blocks from storage and validates their contents.
+ *
+ * This function implements a simple fetcher to make sure that while
+ * we're processing one buffer the L2ARC is already fetching the next
+ * one in the chain.
+ *
+ * The arguments this_lbp and this_lb identify the log block to read and
+ * the buffer to read it into. If this_io is not NULL, the read of this
+ * log block has already been issued by a previous call and we only wait
+ * for it. Once this block has been validated, the read of the block it
+ * points back to is issued into next_lb and returned in next_io.
+ */
+static int
+l2arc_log_blk_read(l2arc_dev_t *dev, const l2arc_log_blkptr_t *this_lbp,
+    l2arc_log_blk_phys_t *this_lb, l2arc_log_blk_phys_t *next_lb,
+    zio_t *this_io, zio_t **next_io)
+{
+	zio_cksum_t cksum;
+	uint64_t asize;
+	void *tmp;
+	int err;
+
+	ASSERT(this_lbp != NULL && this_lb != NULL && next_lb != NULL);
+	ASSERT(next_io != NULL && *next_io == NULL);
+
+	/*
+	 * Check to see if we have issued the IO for this log block in a
+	 * previous run. If not, this is the first call, so issue it now.
+	 */
+	if (this_io == NULL)
+		this_io = l2arc_log_blk_fetch(dev->l2ad_vdev, this_lbp,
+		    this_lb);
+
+	/*
+	 * Wait for the IO to read this log block to complete.
+	 */
+	if ((err = zio_wait(this_io)) != 0) {
+		ARCSTAT_BUMP(arcstat_l2_rebuild_abort_io_errors);
+		zfs_dbgmsg("L2ARC IO error (%d) while reading log block, "
+		    "offset: %llu, vdev guid: %llu", err,
+		    (u_longlong_t)this_lbp->lbp_daddr,
+		    (u_longlong_t)dev->l2ad_vdev->vdev_guid);
+		return (err);
+	}
+
+	/*
+	 * Make sure the buffer checks out.
+	 * L2BLK_GET_PSIZE returns aligned size for log blocks.
+	 */
+	asize = L2BLK_GET_PSIZE(this_lbp->lbp_prop);
+	fletcher_4_native(this_lb, asize, NULL, &cksum);
+	if (!ZIO_CHECKSUM_EQUAL(cksum, this_lbp->lbp_cksum)) {
+		ARCSTAT_BUMP(arcstat_l2_rebuild_abort_cksum_lb_errors);
+		zfs_dbgmsg("L2ARC log block cksum failed, offset: %llu, "
+		    "vdev guid: %llu, l2ad_hand: %llu, l2ad_evict: %llu",
+		    (u_longlong_t)this_lbp->lbp_daddr,
+		    (u_longlong_t)dev->l2ad_vdev->vdev_guid,
+		    (u_longlong_t)dev->l2ad_hand,
+		    (u_longlong_t)dev->l2ad_evict);
+		return (SET_ERROR(ECKSUM));
+	}
+
+	/* Now we can take our time decoding this buffer */
+	switch (L2BLK_GET_COMPRESS(this_lbp->lbp_prop)) {
+	case ZIO_COMPRESS_OFF:
+		break;
+	case ZIO_COMPRESS_LZ4:
+		tmp = zio_buf_alloc(sizeof (*this_lb));
+		bcopy(this_lb, tmp, asize);
+		err = zio_decompress_data_buf(ZIO_COMPRESS_LZ4, tmp, this_lb,
+		    asize, sizeof (*this_lb), NULL);
+		zio_buf_free(tmp, sizeof (*this_lb));
+		if (err != 0)
+			return (SET_ERROR(EINVAL));
+		break;
+	default:
+		return (SET_ERROR(EINVAL));
+	}
+
+	if (this_lb->lb_magic != L2ARC_LOG_BLK_MAGIC) {
+		ARCSTAT_BUMP(arcstat_l2_rebuild_abort_cksum_lb_errors);
+		return (SET_ERROR(EINVAL));
+	}
+
+	/*
+	 * Start issuing the IO for the next log block early - this should
+	 * help keep the L2ARC device busy while we restore this one.
+	 */
+	if (l2arc_log_blkptr_valid(dev, &this_lb->lb_prev_lbp)) {
+		*next_io = l2arc_log_blk_fetch(dev->l2ad_vdev,
+		    &this_lb->lb_prev_lbp, next_lb);
+	}
+
+	return (0);
+}
+
+/*
+ * Restores the payload of a log block to ARC. This creates empty ARC hdr
+ * entries which only contain an l2arc hdr, essentially restoring the
+ * buffers to their L2ARC evicted state. This function also updates space
+ * usage on the L2ARC vdev to make sure it tracks restored buffers.
+ */
+static void
+l2arc_log_blk_restore(l2arc_dev_t *dev, const l2arc_log_blk_phys_t *lb,
+    uint64_t lb_asize)
+{
+	uint64_t size = 0, asize = 0;
+
+	for (int i = dev->l2ad_log_entries - 1; i >= 0; i--) {
+		/*
+		 * Restore goes in the reverse temporal direction to preserve
+		 * correct temporal ordering of buffers in the l2ad_buflist.
+		 * l2arc_hdr_restore also does a list_insert_tail instead of
+		 * list_insert_head on the l2ad_buflist:
+		 *
+		 *		LIST	l2ad_buflist		LIST
+		 *		HEAD  <------ (time) ------	TAIL
+		 * direction	+-----+-----+-----+-----+-----+	   direction
+		 * of l2arc <== | buf | buf | buf | buf | buf | ===> of rebuild
+		 * fill		+-----+-----+-----+-----+-----+
+		 *		^				^
+		 *		|				|
+		 *		|				|
+		 *	l2arc_feed_thread		l2arc_rebuild
+		 *	will place new bufs here	restores bufs here
+		 */
+		size += L2BLK_GET_LSIZE(lb->lb_entries[i].le_prop);
+		asize += vdev_psize_to_asize(dev->l2ad_vdev,
+		    L2BLK_GET_PSIZE(lb->lb_entries[i].le_prop));
+		l2arc_hdr_restore(&lb->lb_entries[i], dev);
+	}
+
+	/*
+	 * Record rebuild stats:
+	 *	size		Logical size of restored buffers in the L2ARC
+	 *	asize		Aligned size of restored buffers in the L2ARC
+	 */
+	ARCSTAT_INCR(arcstat_l2_rebuild_size, size);
+	ARCSTAT_INCR(arcstat_l2_rebuild_asize, asize);
+	ARCSTAT_BUMP(arcstat_l2_rebuild_log_blks);
+	ARCSTAT_F_AVG(arcstat_l2_log_blk_avg_asize, lb_asize);
+	ARCSTAT_F_AVG(arcstat_l2_data_to_meta_ratio, asize / lb_asize);
+}
+
+/*
+ * Restores a single ARC buf hdr from a log entry. The ARC buffer is put
+ * into a state indicating that it has been evicted to L2ARC.
+ */
+static void
+l2arc_hdr_restore(const l2arc_log_ent_phys_t *le, l2arc_dev_t *dev)
+{
+	arc_buf_hdr_t *hdr, *exists;
+	kmutex_t *hash_lock;
+	arc_buf_contents_t type = L2BLK_GET_TYPE(le->le_prop);
+	uint64_t psize;
+
+	if (type != ARC_BUFC_DATA && type != ARC_BUFC_METADATA)
+		return;
+
+	/*
+	 * Do all the allocation before grabbing any locks, this lets us
+	 * sleep if memory is full and we don't have to deal with failed
+	 * allocations.
+	 */
+	hdr = kmem_cache_alloc(hdr_l2only_cache, KM_SLEEP);
+	ASSERT(HDR_EMPTY(hdr));
+
+	/*
+	 * The flags must be set while the header is still empty, see
+	 * arc_hdr_set_flags().
+	 */
+	HDR_SET_LSIZE(hdr, L2BLK_GET_LSIZE(le->le_prop));
+	HDR_SET_PSIZE(hdr, L2BLK_GET_PSIZE(le->le_prop));
+	hdr->b_spa = spa_load_guid(dev->l2ad_vdev->vdev_spa);
+	hdr->b_complevel = 0;
+	hdr->b_type = type;
+	hdr->b_flags = 0;
+	arc_hdr_set_flags(hdr, arc_bufc_to_flags(type) | ARC_FLAG_HAS_L2HDR);
+	arc_hdr_set_compress(hdr, L2BLK_GET_COMPRESS(le->le_prop));
+	if (L2BLK_GET_PREFETCH(le->le_prop))
+		arc_hdr_set_flags(hdr, ARC_FLAG_PREFETCH);
+
+	hdr->b_dva = le->le_dva;
+	hdr->b_birth = le->le_birth;
+	hdr->b_l2hdr.b_dev = dev;
+	hdr->b_l2hdr.b_daddr = le->le_daddr;
+
+	exists = buf_hash_insert(hdr, &hash_lock);
+	if (exists) {
+		/* Buffer was already cached, no need to restore it. */
+		mutex_exit(hash_lock);
+		buf_discard_identity(hdr);
+		kmem_cache_free(hdr_l2only_cache, hdr);
+		ARCSTAT_BUMP(arcstat_l2_rebuild_bufs_precached);
+		return;
+	}
+
+	psize = HDR_GET_PSIZE(hdr);
+
+	mutex_enter(&dev->l2ad_mtx);
+	list_insert_tail(&dev->l2ad_buflist, hdr);
+	(void) zfs_refcount_add_many(&dev->l2ad_alloc, arc_hdr_size(hdr), hdr);
+	mutex_exit(&dev->l2ad_mtx);
+
+	mutex_exit(hash_lock);
+
+	ARCSTAT_INCR(arcstat_l2_lsize, HDR_GET_LSIZE(hdr));
+	ARCSTAT_INCR(arcstat_l2_psize, psize);
+	vdev_space_update(dev->l2ad_vdev, psize, 0, 0);
+	ARCSTAT_BUMP(arcstat_l2_rebuild_bufs);
+}
+
+/*
+ * Completion handler for l2arc_log_blk_fetch(); releases the abd
+ * wrapping the caller's log block buffer.
+ */
+static void
+l2arc_log_blk_fetch_done(zio_t *zio)
+{
+	abd_put(zio->io_private);
+}
+
+/*
+ * Starts an asynchronous read IO to read a log block. This is used in
+ * log block reconstruction to start reading the next block before we
+ * are done decoding and reconstructing the current block, to keep the
+ * l2arc device nice and hot with read IO to process.
+ * The returned zio will contain newly allocated memory buffers for the IO
+ * data which should then be freed by the caller once the zio is no longer
+ * needed (i.e. due to it having completed). If you wish to abort this
+ * zio, you should do so using l2arc_log_blk_fetch_abort, which takes
+ * care of disposing of the allocated buffers correctly.
+ */
+static zio_t *
+l2arc_log_blk_fetch(vdev_t *vd, const l2arc_log_blkptr_t *lbp,
+    l2arc_log_blk_phys_t *lb)
+{
+	uint64_t asize;
+	abd_t *abd;
+	zio_t *pio;
+
+	/* L2BLK_GET_PSIZE returns aligned size for log blocks */
+	asize = L2BLK_GET_PSIZE(lbp->lbp_prop);
+	ASSERT3U(asize, <=, sizeof (l2arc_log_blk_phys_t));
+
+	abd = abd_get_from_buf(lb, asize);
+	pio = zio_root(vd->vdev_spa, l2arc_log_blk_fetch_done, abd,
+	    ZIO_FLAG_DONT_CACHE | ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE |
+	    ZIO_FLAG_DONT_RETRY);
+	(void) zio_nowait(zio_read_phys(pio, vd, lbp->lbp_daddr, asize, abd,
+	    ZIO_CHECKSUM_OFF, NULL, NULL, ZIO_PRIORITY_ASYNC_READ,
+	    ZIO_FLAG_DONT_CACHE | ZIO_FLAG_CANFAIL |
+	    ZIO_FLAG_DONT_PROPAGATE | ZIO_FLAG_DONT_RETRY, B_FALSE));
+
+	return (pio);
+}
+
+/*
+ * Aborts a zio returned from l2arc_log_blk_fetch and frees the data
+ * buffers allocated for it.
+ */
+static void
+l2arc_log_blk_fetch_abort(zio_t *zio)
+{
+	(void) zio_wait(zio);
+}
+
+/*
+ * Creates a zio to update the device header on an l2arc device.
+ */
+static void
+l2arc_dev_hdr_update(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *l2dhdr = dev->l2ad_dev_hdr;
+	const uint64_t l2dhdr_asize = dev->l2ad_dev_hdr_asize;
+	vdev_t *vd = dev->l2ad_vdev;
+	abd_t *abd;
+	int err;
+
+	l2dhdr->dh_magic = L2ARC_DEV_HDR_MAGIC;
+	l2dhdr->dh_version = L2ARC_PERSISTENT_VERSION;
+	l2dhdr->dh_spa_guid = spa_guid(vd->vdev_spa);
+	l2dhdr->dh_vdev_guid = vd->vdev_guid;
+	l2dhdr->dh_log_entries = dev->l2ad_log_entries;
+	l2dhdr->dh_evict = dev->l2ad_evict;
+	l2dhdr->dh_start = dev->l2ad_start;
+	l2dhdr->dh_end = dev->l2ad_end;
+	l2dhdr->dh_lb_asize = zfs_refcount_count(&dev->l2ad_lb_asize);
+	l2dhdr->dh_lb_count = zfs_refcount_count(&dev->l2ad_lb_count);
+	l2dhdr->dh_flags = 0;
+	if (dev->l2ad_first)
+		l2dhdr->dh_flags |= L2ARC_DEV_HDR_EVICT_FIRST;
+
+	abd = abd_get_from_buf(l2dhdr, l2dhdr_asize);
+
+	err = zio_wait(zio_write_phys(NULL, vd,
+	    VDEV_LABEL_START_SIZE, l2dhdr_asize, abd, ZIO_CHECKSUM_LABEL, NULL,
+	    NULL, ZIO_PRIORITY_ASYNC_WRITE, ZIO_FLAG_CANFAIL, B_FALSE));
+
+	abd_put(abd);
+
+	if (err != 0) {
+		zfs_dbgmsg("L2ARC IO error (%d) while writing device header, "
+		    "vdev guid: %llu", err, (u_longlong_t)vd->vdev_guid);
+	} else {
+		dev->l2ad_dev_hdr_dirty = B_FALSE;
+	}
+}
+
+/*
+ * Commits a log block to the L2ARC device. This routine is invoked from
+ * l2arc_write_buffers when the log block fills up.
+ * This function allocates some memory to temporarily hold the serialized
+ * buffer to be written. This is then released in l2arc_write_done.
+ */
+static uint64_t
+l2arc_log_blk_commit(l2arc_dev_t *dev, zio_t *pio, l2arc_write_callback_t *cb)
+{
+	l2arc_log_blk_phys_t *lb = &dev->l2ad_log_blk;
+	l2arc_dev_hdr_phys_t *l2dhdr = dev->l2ad_dev_hdr;
+	l2arc_log_blkptr_t *lbp = &l2dhdr->dh_start_lbps[0];
+	l2arc_lb_abd_buf_t *abd_buf;
+	l2arc_lb_ptr_buf_t *lb_ptr_buf;
+	enum zio_compress compress;
+	uint64_t psize, asize;
+	abd_t *lb_abd;
+	uint8_t *tmpbuf;
+	zio_t *wzio;
+
+	VERIFY3S(dev->l2ad_log_ent_idx, ==, dev->l2ad_log_entries);
+
+	/* link the buffer into the block chain */
+	lb->lb_magic = L2ARC_LOG_BLK_MAGIC;
+	lb->lb_prev_lbp = l2dhdr->dh_start_lbps[0];
+
+	/* try to compress the buffer */
+	tmpbuf = zio_buf_alloc(sizeof (*lb));
+	lb_abd = abd_get_from_buf(lb, sizeof (*lb));
+	psize = zio_compress_data(ZIO_COMPRESS_LZ4, lb_abd, tmpbuf,
+	    sizeof (*lb), ZIO_COMPLEVEL_INHERIT);
+	abd_put(lb_abd);
+
+	/* a log block is never entirely zero */
+	ASSERT(psize != 0);
+	if (psize < sizeof (*lb)) {
+		compress = ZIO_COMPRESS_LZ4;
+	} else {
+		compress = ZIO_COMPRESS_OFF;
+		psize = sizeof (*lb);
+		bcopy(lb, tmpbuf, psize);
+	}
+	asize = vdev_psize_to_asize(dev->l2ad_vdev, psize);
+	ASSERT3U(asize, <=, sizeof (*lb));
+	bzero(tmpbuf + psize, asize - psize);
+
+	/* the new log block pointer goes to the head of the chain */
+	l2dhdr->dh_start_lbps[1] = l2dhdr->dh_start_lbps[0];
+	dev->l2ad_dev_hdr_dirty = B_TRUE;
+	bzero(lbp, sizeof (*lbp));
+	lbp->lbp_daddr = dev->l2ad_hand;
+	lbp->lbp_payload_asize = dev->l2ad_log_blk_payload_asize;
+	lbp->lbp_payload_start = dev->l2ad_log_blk_payload_start;
+	L2BLK_SET_LSIZE(lbp->lbp_prop, sizeof (*lb));
+	L2BLK_SET_PSIZE(lbp->lbp_prop, asize);
+	L2BLK_SET_CHECKSUM(lbp->lbp_prop, ZIO_CHECKSUM_FLETCHER_4);
+	L2BLK_SET_COMPRESS(lbp->lbp_prop, compress);
+	fletcher_4_native(tmpbuf, asize, NULL, &lbp->lbp_cksum);
+
+	/*
+	 * The open log block is reused right away, so the write goes out
+	 * of a private copy that l2arc_write_done() frees.
+	 */
+	abd_buf = kmem_zalloc(sizeof (l2arc_lb_abd_buf_t), KM_SLEEP);
+	abd_buf->abd = abd_alloc_for_io(asize, B_TRUE);
+	abd_copy_from_buf(abd_buf->abd, tmpbuf, asize);
+	list_insert_tail(&cb->l2wcb_abd_list, abd_buf);
+	zio_buf_free(tmpbuf, sizeof (*lb));
+
+	wzio = zio_write_phys(pio, dev->l2ad_vdev, dev->l2ad_hand,
+	    asize, abd_buf->abd, ZIO_CHECKSUM_OFF, NULL, NULL,
+	    ZIO_PRIORITY_ASYNC_WRITE, ZIO_FLAG_CANFAIL, B_FALSE);
+	DTRACE_PROBE2(l2arc__write, vdev_t *, dev->l2ad_vdev, zio_t *, wzio);
+	(void) zio_nowait(wzio);
+
+	dev->l2ad_hand += asize;
+
+	/*
+	 * Include the committed log block's pointer in the list of pointers
+	 * to log blocks present on the device, newest first.
+	 */
+	lb_ptr_buf = kmem_zalloc(sizeof (l2arc_lb_ptr_buf_t), KM_SLEEP);
+	lb_ptr_buf->lb_ptr = kmem_zalloc(sizeof (l2arc_log_blkptr_t), KM_SLEEP);
+	bcopy(lbp, lb_ptr_buf->lb_ptr, sizeof (l2arc_log_blkptr_t));
+	mutex_enter(&dev->l2ad_mtx);
+	list_insert_head(&dev->l2ad_lbptr_list, lb_ptr_buf);
+	ARCSTAT_INCR(arcstat_l2_log_blk_asize, asize);
+	ARCSTAT_BUMP(arcstat_l2_log_blk_count);
+	(void) zfs_refcount_add_many(&dev->l2ad_lb_asize, asize, lb_ptr_buf);
+	(void) zfs_refcount_add(&dev->l2ad_lb_count, lb_ptr_buf);
+	mutex_exit(&dev->l2ad_mtx);
+	vdev_space_update(dev->l2ad_vdev, asize, 0, 0);
+
+	/* bump the kstats */
+	ARCSTAT_INCR(arcstat_l2_write_bytes, asize);
+	ARCSTAT_BUMP(arcstat_l2_log_blk_writes);
+	ARCSTAT_F_AVG(arcstat_l2_log_blk_avg_asize, asize);
+	ARCSTAT_F_AVG(arcstat_l2_data_to_meta_ratio,
+	    dev->l2ad_log_blk_payload_asize / asize);
+
+	/* start a new log block */
+	dev->l2ad_log_ent_idx = 0;
+	dev->l2ad_log_blk_payload_asize = 0;
+	dev->l2ad_log_blk_payload_start = 0;
+
+	return (asize);
+}
+
+/*
+ * Validates an L2ARC log block address to make sure that it can be read
+ * from the provided L2ARC device.
+ */
+static boolean_t
+l2arc_log_blkptr_valid(l2arc_dev_t *dev, const l2arc_log_blkptr_t *lbp)
+{
+	/* L2BLK_GET_PSIZE returns aligned size for log blocks */
+	uint64_t asize = L2BLK_GET_PSIZE(lbp->lbp_prop);
+	uint64_t end = lbp->lbp_daddr + asize - 1;
+	uint64_t start = lbp->lbp_payload_start;
+	boolean_t evicted = B_FALSE;
+
+	/*
+	 * A log block is valid if all of the following conditions are true:
+	 * - it fits entirely (including its payload) between l2ad_start and
+	 *   l2ad_end
+	 * - it has a valid size
+	 * - neither the log block itself nor part of its payload was evicted
+	 *   by l2arc_evict():
+	 *
+	 *		l2ad_hand          l2ad_evict
+	 *		|			 |	lbp_daddr
+	 *		|     start		 |	|  end
+	 *		|     |			 |	|  |
+	 *		V     V		         V	V  V
+	 *   l2ad_start ============================================ l2ad_end
+	 *                    --------------------------||||
+	 *				^		 ^
+	 *				|		log block
+	 *				payload
+	 */
+
+	evicted =
+	    l2arc_range_check_overlap(start, end, dev->l2ad_hand) ||
+	    l2arc_range_check_overlap(start, end, dev->l2ad_evict) ||
+	    l2arc_range_check_overlap(dev->l2ad_hand, dev->l2ad_evict, start) ||
+	    l2arc_range_check_overlap(dev->l2ad_hand, dev->l2ad_evict, end);
+
+	return (start >= dev->l2ad_start && end <= dev->l2ad_end &&
+	    asize > 0 && asize <= sizeof (l2arc_log_blk_phys_t) &&
+	    (!evicted || dev->l2ad_first));
+}
+
+/*
+ * Inserts ARC buffer header `hdr' into the current L2ARC log block on
+ * the device. The buffer being inserted must be present in L2ARC.
+ * Returns B_TRUE if the L2ARC log block is full and needs to be committed
+ * to L2ARC, or B_FALSE if it still has room for more ARC buffers.
+ */
+static boolean_t
+l2arc_log_blk_insert(l2arc_dev_t *dev, const arc_buf_hdr_t *hdr)
+{
+	l2arc_log_blk_phys_t *lb = &dev->l2ad_log_blk;
+	l2arc_log_ent_phys_t *le;
+	int index;
+
+	if (dev->l2ad_log_entries == 0)
+		return (B_FALSE);
+
+	/*
+	 * The crypt parameters of encrypted buffers aren't recorded in
+	 * the log, so they cannot be restored and are left out of it.
+	 */
+	if (HDR_PROTECTED(hdr))
+		return (B_FALSE);
+
+	index = dev->l2ad_log_ent_idx++;
+
+	ASSERT3S(index, <, dev->l2ad_log_entries);
+	ASSERT(HDR_HAS_L2HDR(hdr));
+
+	le = &lb->lb_entries[index];
+	bzero(le, sizeof (*le));
+	le->le_dva = hdr->b_dva;
+	le->le_birth = hdr->b_birth;
+	le->le_daddr = hdr->b_l2hdr.b_daddr;
+	if (index == 0)
+		dev->l2ad_log_blk_payload_start = le->le_daddr;
+	L2BLK_SET_LSIZE(le->le_prop, HDR_GET_LSIZE(hdr));
+	L2BLK_SET_PSIZE(le->le_prop, HDR_GET_PSIZE(hdr));
+	L2BLK_SET_COMPRESS(le->le_prop, HDR_GET_COMPRESS(hdr));
+	L2BLK_SET_TYPE(le->le_prop, hdr->b_type);
+	L2BLK_SET_PREFETCH(le->le_prop, !!HDR_PREFETCH(hdr));
+
+	dev->l2ad_log_blk_payload_asize += vdev_psize_to_asize(dev->l2ad_vdev,
+	    HDR_GET_PSIZE(hdr));
+
+	return (dev->l2ad_log_ent_idx == dev->l2ad_log_entries);
+}
+
+/*
+ * Checks whether a given L2ARC device address sits in a time-sequential
+ * range. The trick here is that the L2ARC is a rotary buffer, so we can't
+ * just do a range comparison, we need to handle the situation in which the
+ * range wraps around the end of the L2ARC device. Arguments:
+ *	bottom -- Lower end of the range to check (written to earlier).
+ *	top    -- Upper end of the range to check (written to later).
+ *	check  -- The address for which we want to determine if it sits in
+ *		  between the top and bottom.
+ *
+ * The 3-way conditional below represents the following cases:
+ *
+ *	bottom < top : Sequentially ordered case:
+ *	  <check>--------+-------------------+
+ *	                 |  (overlap here?)  |
+ *	 L2ARC dev       V                   V
+ *	 |---------------<bottom>============<top>--------------|
+ *
+ *	bottom > top: Looped-around case:
+ *	                      <check>--------+------------------+
+ *	                                     |  (overlap here?) |
+ *	 L2ARC dev                           V                  V
+ *	 |===============<top>---------------<bottom>===========|
+ *	 ^               ^
+ *	 |  (or here?)   |
+ *	 +---------------+---------<check>
+ *
+ *	top == bottom : Just a single address comparison.
+ */
+static boolean_t
+l2arc_range_check_overlap(uint64_t bottom, uint64_t top, uint64_t check)
+{
+	if (bottom < top)
+		return (bottom <= check && check <= top);
+	else if (bottom > top)
+		return (check <= top || bottom <= check);
+	else
+		return (check == top);
+}
+
+/*
+ * Returns the worst case number of bytes of log blocks needed to describe
+ * a write of write_sz bytes, assuming every buffer is of the minimum
+ * block size.
+ */
+static uint64_t
+l2arc_log_blk_overhead(uint64_t write_sz, l2arc_dev_t *dev)
+{
+	if (dev->l2ad_log_entries == 0) {
+		return (0);
+	} else {
+		uint64_t log_entries = write_sz >> SPA_MINBLOCKSHIFT;
+
+		uint64_t log_blocks = (log_entries +
+		    dev->l2ad_log_entries - 1) /
+		    dev->l2ad_log_entries;
+
+		return (vdev_psize_to_asize(dev->l2ad_vdev,
+		    sizeof (l2arc_log_blk_phys_t)) * log_blocks);
+	}
+}
+
 #ifdef __APPLE__
 #undef ZDB_DEBUG
 #ifdef _KERNEL
@@ -0,0 +1,153 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+#include <sys/zfs_context.h>
+#include <sys/zio.h>
+#include <sys/blake3.h>
+#include <sys/abd.h>
+
+/*
+ * BLAKE3 only hashes as many chunks side by side as it is given in one
+ * update, and the chunks of a scatter ABD are too small for the SIMD
+ * implementations to fill their lanes.  Scatter ABDs are therefore
+ * gathered into a staging buffer of this size before they are hashed.
+ */
+#define	BLAKE3_STAGE_SIZE	(16 * BLAKE3_CHUNK_LEN)
+
+typedef struct blake3_stage {
+	BLAKE3_CTX	*bs_ctx;
+	uint8_t		*bs_buf;
+	size_t		bs_len;
+} blake3_stage_t;
+
+static int
+blake3_incremental(void *buf, size_t size, void *arg)
+{
+	BLAKE3_CTX *ctx = arg;
+	Blake3_Update(ctx, buf, size);
+	return (0);
+}
+
+static int
+blake3_staged_incremental(void *buf, size_t size, void *arg)
+{
+	blake3_stage_t *bs = arg;
+
+	while (size > 0) {
+		size_t len = MIN(size, BLAKE3_STAGE_SIZE - bs->bs_len);
+
+		bcopy(buf, bs->bs_buf + bs->bs_len, len);
+		bs->bs_len += len;
+		buf = (char *)buf + len;
+		size -= len;
+
+		if (bs->bs_len == BLAKE3_STAGE_SIZE) {
+			Blake3_Update(bs->bs_ctx, bs->bs_buf, bs->bs_len);
+			bs->bs_len = 0;
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Computes a native 256-bit BLAKE3 MAC checksum. Please note that this
+ * function requires the presence of a ctx_template that should be allocated
+ * using abd_checksum_blake3_tmpl_init.
+ */
+/*ARGSUSED*/
+void
+abd_checksum_blake3_native(abd_t *abd, uint64_t size,
+    const void *ctx_template, zio_cksum_t *zcp)
+{
+	BLAKE3_CTX	*ctx;
+
+	ASSERT(ctx_template != NULL);
+
+	/* The context is too large to live on the stack of a zio thread. */
+	ctx = kmem_alloc(sizeof (*ctx), KM_SLEEP);
+	bcopy(ctx_template, ctx, sizeof (*ctx));
+
+	if (abd_is_linear(abd) || size <= BLAKE3_CHUNK_LEN) {
+		(void) abd_iterate_func(abd, 0, size, blake3_incremental, ctx);
+	} else {
+		blake3_stage_t bs;
+
+		bs.bs_ctx = ctx;
+		bs.bs_buf = zio_buf_alloc(BLAKE3_STAGE_SIZE);
+		bs.bs_len = 0;
+		(void) abd_iterate_func(abd, 0, size,
+		    blake3_staged_incremental, &bs);
+		if (bs.bs_len > 0)
+			Blake3_Update(ctx, bs.bs_buf, bs.bs_len);
+		zio_buf_free(bs.bs_buf, BLAKE3_STAGE_SIZE);
+	}
+
+	Blake3_Final(ctx, (uint8_t *)zcp);
+	bzero(ctx, sizeof (*ctx));
+	kmem_free(ctx, sizeof (*ctx));
+}
+
+/*
+ * Byteswapped version of abd_checksum_blake3_native. This just invokes
+ * the native checksum function and byteswaps the resulting checksum (since
+ * BLAKE3 is internally endian-insensitive).
+ */
+void
+abd_checksum_blake3_byteswap(abd_t *abd, uint64_t size,
+    const void *ctx_template, zio_cksum_t *zcp)
+{
+	zio_cksum_t	tmp;
+
+	abd_checksum_blake3_native(abd, size, ctx_template, &tmp);
+	zcp->zc_word[0] = BSWAP_64(tmp.zc_word[0]);
+	zcp->zc_word[1] = BSWAP_64(tmp.zc_word[1]);
+	zcp->zc_word[2] = BSWAP_64(tmp.zc_word[2]);
+	zcp->zc_word[3] = BSWAP_64(tmp.zc_word[3]);
+}
+
+/*
+ * Allocates a BLAKE3 MAC template suitable for using in BLAKE3 MAC checksum
+ * computations and returns a pointer to it.
+ */
+void *
+abd_checksum_blake3_tmpl_init(const zio_cksum_salt_t *salt)
+{
+	BLAKE3_CTX	*ctx;
+
+	CTASSERT(sizeof (salt->zcs_bytes) == BLAKE3_KEY_LEN);
+
+	ctx = kmem_zalloc(sizeof (*ctx), KM_SLEEP);
+	Blake3_InitKeyed(ctx, salt->zcs_bytes);
+	return (ctx);
+}
+
+/*
+ * Frees a BLAKE3 context template previously allocated using
+ * abd_checksum_blake3_tmpl_init.
+ */
+void
+abd_checksum_blake3_tmpl_free(void *ctx_template)
+{
+	BLAKE3_CTX	*ctx = ctx_template;
+
+	bzero(ctx, sizeof (*ctx));
+	kmem_free(ctx, sizeof (*ctx));
+}
@@ -84,6 +84,9 @@ bpobj_alloc(objset_t *os, int blocksize, dmu_tx_t *tx)
 		size = BPOBJ_SIZE_V0;
 	else if (spa_version(dmu_objset_spa(os)) < SPA_VERSION_DEADLISTS)
 		size = BPOBJ_SIZE_V1;
+	else if (!spa_feature_is_active(dmu_objset_spa(os),
+	    SPA_FEATURE_LIVELIST))
+		size = BPOBJ_SIZE_V2;
 	else
 		size = sizeof (bpobj_phys_t);
 
@@ -172,6 +175,7 @@ bpobj_open(bpobj_t *bpo, objset_t *os, uint64_t object)
 	bpo->bpo_epb = doi.doi_data_block_size >> SPA_BLKPTRSHIFT;
 	bpo->bpo_havecomp = (doi.doi_bonus_size > BPOBJ_SIZE_V0);
 	bpo->bpo_havesubobj = (doi.doi_bonus_size > BPOBJ_SIZE_V1);
+	bpo->bpo_havefreed = (doi.doi_bonus_size > BPOBJ_SIZE_V2);
 	bpo->bpo_phys = bpo->bpo_dbuf->db_data;
 	return (0);
 }
@@ -209,7 +213,7 @@ bpobj_is_empty(bpobj_t *bpo)
 
 static int
 bpobj_iterate_impl(bpobj_t *bpo, bpobj_itor_t func, void *arg, dmu_tx_t *tx,
-    boolean_t free)
+    boolean_t free, uint64_t *bpi_size)
 {
 	dmu_object_info_t doi;
 	int epb;
@@ -223,10 +227,18 @@ bpobj_iterate_impl(bpobj_t *bpo, bpobj_itor_t func, void *arg, dmu_tx_t *tx,
 	if (free)
 		dmu_buf_will_dirty(bpo->bpo_dbuf, tx);
 
+	/*
+	 * Report the number of blkptrs this iteration will visit, so that
+	 * livelist condensing can later pick up entries appended after it.
+	 */
+	if (bpi_size != NULL)
+		*bpi_size = bpo->bpo_phys->bpo_num_blkptrs;
+
 	for (i = bpo->bpo_phys->bpo_num_blkptrs - 1; i >= 0; i--) {
 		blkptr_t *bparray;
 		blkptr_t *bp;
 		uint64_t offset, blkoff;
+		boolean_t bp_freed;
 
 		offset = i * sizeof (blkptr_t);
 		blkoff = P2PHASE(i, bpo->bpo_epb);
@@ -245,16 +257,25 @@ bpobj_iterate_impl(bpobj_t *bpo, bpobj_itor_t func, void *arg, dmu_tx_t *tx,
 
 		bparray = dbuf->db_data;
 		bp = &bparray[blkoff];
-		err = func(arg, bp, tx);
+		bp_freed = BP_GET_FREE(bp);
+		err = func(arg, bp, bp_freed, tx);
 		if (err)
 			break;
 		if (free) {
-			bpo->bpo_phys->bpo_bytes -=
+			int sign = bp_freed ? -1 : +1;
+
+			bpo->bpo_phys->bpo_bytes -= sign *
 			    bp_get_dsize_sync(dmu_objset_spa(bpo->bpo_os), bp);
 			ASSERT3S(bpo->bpo_phys->bpo_bytes, >=, 0);
 			if (bpo->bpo_havecomp) {
-				bpo->bpo_phys->bpo_comp -= BP_GET_PSIZE(bp);
-				bpo->bpo_phys->bpo_uncomp -= BP_GET_UCSIZE(bp);
+				bpo->bpo_phys->bpo_comp -=
+				    sign * BP_GET_PSIZE(bp);
+				bpo->bpo_phys->bpo_uncomp -=
+				    sign * BP_GET_UCSIZE(bp);
+			}
+			if (bp_freed) {
+				ASSERT(bpo->bpo_havefreed);
+				bpo->bpo_phys->bpo_num_freed--;
 			}
 			bpo->bpo_phys->bpo_num_blkptrs--;
 			ASSERT3S(bpo->bpo_phys->bpo_num_blkptrs, >=, 0);
@@ -314,7 +335,7 @@ bpobj_iterate_impl(bpobj_t *bpo, bpobj_itor_t func, void *arg, dmu_tx_t *tx,
 				break;
 			}
 		}
-		err = bpobj_iterate_impl(&sublist, func, arg, tx, free);
+		err = bpobj_iterate_impl(&sublist, func, arg, tx, free, NULL);
 		if (free) {
 			VERIFY3U(0, ==, bpobj_space(&sublist,
 			    &used_after, &comp_after, &uncomp_after));
@@ -366,16 +387,69 @@ out:
 int
 bpobj_iterate(bpobj_t *bpo, bpobj_itor_t func, void *arg, dmu_tx_t *tx)
 {
-	return (bpobj_iterate_impl(bpo, func, arg, tx, B_TRUE));
+	return (bpobj_iterate_impl(bpo, func, arg, tx, B_TRUE, NULL));
 }
 
 /*
  * Iterate the entries.  If func returns nonzero, iteration will stop.
+ * If bpi_size is non-NULL, it is set to the number of blkptrs (not
+ * counting subobjs) present when the iteration started.
+ */
+int
+bpobj_iterate_nofree(bpobj_t *bpo, bpobj_itor_t func, void *arg,
+    uint64_t *bpi_size)
+{
+	return (bpobj_iterate_impl(bpo, func, arg, NULL, B_FALSE, bpi_size));
+}
+
+/*
+ * Iterate, in order of insertion, over the blkptrs of a livelist bpobj
+ * starting at index start.  Livelist bpobjs never have subobjs, so only
+ * the blkptr array is visited.  If func returns nonzero, iteration stops.
  */
 int
-bpobj_iterate_nofree(bpobj_t *bpo, bpobj_itor_t func, void *arg, dmu_tx_t *tx)
+livelist_bpobj_iterate_from_nofree(bpobj_t *bpo, bpobj_itor_t func, void *arg,
+    int64_t start)
 {
-	return (bpobj_iterate_impl(bpo, func, arg, tx, B_FALSE));
+	dmu_buf_t *dbuf = NULL;
+	int err = 0;
+
+	ASSERT(bpobj_is_open(bpo));
+	ASSERT(!bpo->bpo_havesubobj || bpo->bpo_phys->bpo_subobjs == 0);
+	ASSERT3S(start, >=, 0);
+
+	mutex_enter(&bpo->bpo_lock);
+	for (int64_t i = start; i < bpo->bpo_phys->bpo_num_blkptrs; i++) {
+		blkptr_t *bparray;
+		blkptr_t *bp;
+		uint64_t offset, blkoff;
+
+		offset = i * sizeof (blkptr_t);
+		blkoff = P2PHASE(i, bpo->bpo_epb);
+
+		if (dbuf == NULL ||
+		    offset >= dbuf->db_offset + dbuf->db_size) {
+			if (dbuf)
+				dmu_buf_rele(dbuf, FTAG);
+			err = dmu_buf_hold(bpo->bpo_os, bpo->bpo_object, offset,
+			    FTAG, &dbuf, 0);
+			if (err)
+				break;
+		}
+
+		ASSERT3U(offset, >=, dbuf->db_offset);
+		ASSERT3U(offset, <, dbuf->db_offset + dbuf->db_size);
+
+		bparray = dbuf->db_data;
+		bp = &bparray[blkoff];
+		err = func(arg, bp, BP_GET_FREE(bp), NULL);
+		if (err)
+			break;
+	}
+	if (dbuf)
+		dmu_buf_rele(dbuf, FTAG);
+	mutex_exit(&bpo->bpo_lock);
+	return (err);
 }
 
 void
@@ -465,12 +539,14 @@ bpobj_enqueue_subobj(bpobj_t *bpo, uint64_t subobj, dmu_tx_t *tx)
 }
 
 void
-bpobj_enqueue(bpobj_t *bpo, const blkptr_t *bp, dmu_tx_t *tx)
+bpobj_enqueue(bpobj_t *bpo, const blkptr_t *bp, boolean_t bp_freed,
+    dmu_tx_t *tx)
 {
 	blkptr_t stored_bp = *bp;
 	uint64_t offset;
 	int blkoff;
 	blkptr_t *bparray;
+	int sign = bp_freed ? -1 : +1;
 
 	ASSERT(bpobj_is_open(bpo));
 	ASSERT(!BP_IS_HOLE(bp));
@@ -496,8 +572,12 @@ bpobj_enqueue(bpobj_t *bpo, const blkptr_t *bp, dmu_tx_t *tx)
 		bzero(&stored_bp.blk_cksum, sizeof (stored_bp.blk_cksum));
 	}
 
-	/* We never need the fill count. */
+	/*
+	 * We never need the fill count.  Its low bit is reused to record
+	 * whether this entry is a FREE (livelists only).
+	 */
 	stored_bp.blk_fill = 0;
+	BP_SET_FREE(&stored_bp, bp_freed);
 
 	mutex_enter(&bpo->bpo_lock);
 
@@ -520,11 +600,15 @@ bpobj_enqueue(bpobj_t *bpo, const blkptr_t *bp, dmu_tx_t *tx)
 
 	dmu_buf_will_dirty(bpo->bpo_dbuf, tx);
 	bpo->bpo_phys->bpo_num_blkptrs++;
-	bpo->bpo_phys->bpo_bytes +=
+	bpo->bpo_phys->bpo_bytes += sign *
 	    bp_get_dsize_sync(dmu_objset_spa(bpo->bpo_os), bp);
 	if (bpo->bpo_havecomp) {
-		bpo->bpo_phys->bpo_comp += BP_GET_PSIZE(bp);
-		bpo->bpo_phys->bpo_uncomp += BP_GET_UCSIZE(bp);
+		bpo->bpo_phys->bpo_comp += sign * BP_GET_PSIZE(bp);
+		bpo->bpo_phys->bpo_uncomp += sign * BP_GET_UCSIZE(bp);
+	}
+	if (bp_freed) {
+		ASSERT(bpo->bpo_havefreed);
+		bpo->bpo_phys->bpo_num_freed++;
 	}
 	mutex_exit(&bpo->bpo_lock);
 }
@@ -540,7 +624,7 @@ struct space_range_arg {
 
 /* ARGSUSED */
 static int
-space_range_cb(void *arg, const blkptr_t *bp, dmu_tx_t *tx)
+space_range_cb(void *arg, const blkptr_t *bp, boolean_t bp_freed, dmu_tx_t *tx)
 {
 	struct space_range_arg *sra = arg;
 
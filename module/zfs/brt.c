@@ -0,0 +1,1023 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2020, 2021, 2022 by Pawel Jakub Dawidek
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/spa_impl.h>
+#include <sys/zio.h>
+#include <sys/brt.h>
+#include <sys/dmu_tx.h>
+#include <sys/dsl_pool.h>
+#include <sys/zap.h>
+#include <sys/vdev_impl.h>
+#include <sys/zfeature.h>
+#include <sys/kstat.h>
+
+/*
+ * Block Reference Table (BRT)
+ *
+ * Block cloning copies a range of a file by copying its block pointers
+ * instead of its data, so the same block ends up being referenced from
+ * more than one place.  The pool then has to know how many references a
+ * cloned block has, so that it is only freed together with the last one.
+ *
+ * Dedup already tracks references, but the DDT is keyed by checksum and
+ * must be consulted on every write of a dedup dataset.  The BRT is keyed
+ * by the block's location instead (top-level vdev and offset of DVA[0]),
+ * and it is only consulted when a block is freed, so datasets that never
+ * clone anything do not pay for it.
+ *
+ * A BRT entry counts the references to a block beyond the first one: a
+ * block that has been cloned once has a refcount of 1.  Freeing a block
+ * with a non-zero BRT refcount only decrements the refcount and leaves the
+ * block allocated.  Once the refcount is back at zero the entry goes away
+ * and the next free really frees the block.
+ *
+ * Whether a block may have an entry must be cheap to answer, since it is
+ * asked on every free.  For each top-level vdev we keep an array of 16-bit
+ * counters, one per zfs_brt_rangesize bytes of the vdev, of the entries
+ * within that range.  Frees in a range whose counter is zero never look at
+ * the entries at all.  The counters are kept on disk next to the entries
+ * so that they need not be rebuilt on import.
+ *
+ * Clones are recorded in open context by brt_pending_add(), in a per-txg
+ * tree.  brt_pending_apply() is called at the beginning of spa_sync() and
+ * turns the pending references into entries before any of the txg's frees
+ * are processed; a block that is cloned and then freed in the same txg is
+ * therefore never released.  Frees reach brt_entry_decref() through
+ * zio_free_sync().  Both only modify in-core state, and brt_sync() writes
+ * the modified entries and counters out at the end of every sync pass.
+ *
+ * Entries are only looked up and modified from syncing context, so the
+ * per-vdev entry trees need no locking.  brt_lock protects the vdev array
+ * and the range counters, which brt_maybe_exists() reads from any context.
+ * It is never held across I/O, since frees are issued from zio interrupt
+ * threads.
+ *
+ * On disk, every top-level vdev with entries has a BRT object, named in
+ * the MOS directory by BRT_OBJECT_VDEV_PREFIX followed by the vdev id.
+ * The object holds the range counters and its bonus buffer the rest of
+ * the vdev's state (see brt_vdev_phys_t), including the ZAP object of
+ * entries.  The block_cloning feature refcount is the number of such
+ * objects.
+ */
+
+/*
+ * Size of the vdev region covered by one range counter.
+ */
+uint64_t zfs_brt_rangesize = 64 * 1024 * 1024;
+
+/*
+ * Block size of the BRT objects holding the range counters.  Only the
+ * blocks whose counters changed are rewritten in each txg.
+ */
+#define	BRT_BLOCKSIZE	(32 * 1024)
+
+/* ZAP block sizes for BRT entries, see ddt_zap.c */
+int brt_zap_leaf_blockshift = 12;
+int brt_zap_indirect_blockshift = 12;
+
+typedef struct brt_entry {
+	uint64_t	bre_offset;	/* offset of DVA[0] */
+	uint64_t	bre_refcount;	/* references beyond the first */
+	avl_node_t	bre_node;
+} brt_entry_t;
+
+typedef struct brt_pending_entry {
+	blkptr_t	bpe_bp;
+	uint64_t	bpe_count;
+	avl_node_t	bpe_node;
+} brt_pending_entry_t;
+
+typedef struct brt_vdev {
+	uint64_t	bv_vdevid;
+	uint64_t	bv_mos_brtvdev;	/* BRT object, 0 if none yet */
+	uint64_t	bv_mos_entries;	/* ZAP of entries, 0 if none yet */
+	uint64_t	bv_rangesize;	/* bytes covered by a counter */
+	uint16_t	*bv_entcount;	/* per-range entry counters */
+	uint64_t	bv_size;	/* number of counters */
+	uint8_t		*bv_bitmap;	/* dirty BRT_BLOCKSIZE counter blocks */
+	uint64_t	bv_nblocks;	/* number of counter blocks */
+	boolean_t	bv_dirty;	/* bonus needs to be written */
+	uint64_t	bv_totalcount;	/* number of entries */
+	uint64_t	bv_usedspace;	/* space of cloned blocks */
+	uint64_t	bv_savedspace;	/* space saved by cloning */
+	avl_tree_t	bv_tree;	/* entries referenced in this txg */
+} brt_vdev_t;
+
+struct brt {
+	spa_t		*brt_spa;
+	krwlock_t	brt_lock;
+	brt_vdev_t	*brt_vdevs;
+	uint64_t	brt_nvdevs;
+	kmutex_t	brt_pending_lock[TXG_SIZE];
+	avl_tree_t	brt_pending_tree[TXG_SIZE];
+};
+
+/*
+ * BRT statistics.
+ */
+typedef struct brt_stats {
+	/*
+	 * Number of blocks cloned for the first time.
+	 */
+	kstat_named_t brt_addref_entry_new;
+	/*
+	 * Number of clones of blocks that already had a BRT entry.
+	 */
+	kstat_named_t brt_addref_entry_existing;
+	/*
+	 * Number of frees which dropped a reference to a block that still
+	 * has other clones.
+	 */
+	kstat_named_t brt_decref_entry_still_referenced;
+	/*
+	 * Number of frees which dropped the last extra reference; the block
+	 * itself is freed together with its last reference.
+	 */
+	kstat_named_t brt_decref_free_data_later;
+	/*
+	 * Number of frees of the last reference to a cloned block.
+	 */
+	kstat_named_t brt_decref_free_data_now;
+	/*
+	 * Number of frees in a range with entries which turned out not to
+	 * have one.
+	 */
+	kstat_named_t brt_decref_no_entry;
+} brt_stats_t;
+
+static brt_stats_t brt_stats = {
+	{ "addref_entry_new",			KSTAT_DATA_UINT64 },
+	{ "addref_entry_existing",		KSTAT_DATA_UINT64 },
+	{ "decref_entry_still_referenced",	KSTAT_DATA_UINT64 },
+	{ "decref_free_data_later",		KSTAT_DATA_UINT64 },
+	{ "decref_free_data_now",		KSTAT_DATA_UINT64 },
+	{ "decref_no_entry",			KSTAT_DATA_UINT64 },
+};
+
+#define	BRTSTAT_BUMP(stat) \
+	atomic_inc_64(&brt_stats.stat.value.ui64)
+
+static kstat_t *brt_ksp;
+static kmem_cache_t *brt_entry_cache;
+static kmem_cache_t *brt_pending_entry_cache;
+
+static int
+brt_entry_compare(const void *x1, const void *x2)
+{
+	const brt_entry_t *bre1 = x1;
+	const brt_entry_t *bre2 = x2;
+
+	return (AVL_CMP(bre1->bre_offset, bre2->bre_offset));
+}
+
+static int
+brt_pending_entry_compare(const void *x1, const void *x2)
+{
+	const brt_pending_entry_t *bpe1 = x1;
+	const brt_pending_entry_t *bpe2 = x2;
+	const dva_t *dva1 = &bpe1->bpe_bp.blk_dva[0];
+	const dva_t *dva2 = &bpe2->bpe_bp.blk_dva[0];
+
+	int cmp = AVL_CMP(DVA_GET_VDEV(dva1), DVA_GET_VDEV(dva2));
+	if (likely(cmp))
+		return (cmp);
+
+	return (AVL_CMP(DVA_GET_OFFSET(dva1), DVA_GET_OFFSET(dva2)));
+}
+
+static void
+brt_vdev_name(uint64_t vdevid, char *name, size_t size)
+{
+	(void) snprintf(name, size, "%s%llu", BRT_OBJECT_VDEV_PREFIX,
+	    (u_longlong_t)vdevid);
+}
+
+/*
+ * Make sure the vdev has at least nranges range counters.  Called with
+ * brt_lock held as writer.
+ */
+static void
+brt_vdev_realloc(brt_t *brt, brt_vdev_t *brtvd, uint64_t nranges)
+{
+	uint16_t *entcount;
+	uint8_t *bitmap;
+	uint64_t nblocks;
+
+	ASSERT(RW_WRITE_HELD(&brt->brt_lock));
+
+	if (nranges <= brtvd->bv_size)
+		return;
+
+	entcount = kmem_zalloc(nranges * sizeof (uint16_t), KM_SLEEP);
+	nblocks = howmany(nranges * sizeof (uint16_t), BRT_BLOCKSIZE);
+	bitmap = kmem_zalloc(nblocks, KM_SLEEP);
+
+	if (brtvd->bv_entcount != NULL) {
+		bcopy(brtvd->bv_entcount, entcount,
+		    brtvd->bv_size * sizeof (uint16_t));
+		kmem_free(brtvd->bv_entcount,
+		    brtvd->bv_size * sizeof (uint16_t));
+		kmem_free(brtvd->bv_bitmap, brtvd->bv_nblocks);
+	}
+
+	/*
+	 * The grown part has to reach the disk as well, which is simplest
+	 * done by rewriting all of the counters.  Vdevs rarely grow.
+	 */
+	memset(bitmap, 0xff, nblocks);
+
+	brtvd->bv_entcount = entcount;
+	brtvd->bv_size = nranges;
+	brtvd->bv_bitmap = bitmap;
+	brtvd->bv_nblocks = nblocks;
+	brtvd->bv_dirty = B_TRUE;
+}
+
+/*
+ * Make sure brt_vdevs covers vdevid.  Called with brt_lock held as writer.
+ */
+static brt_vdev_t *
+brt_vdev(brt_t *brt, uint64_t vdevid)
+{
+	brt_vdev_t *vdevs;
+	uint64_t nvdevs, i;
+
+	ASSERT(RW_WRITE_HELD(&brt->brt_lock));
+
+	if (vdevid < brt->brt_nvdevs)
+		return (&brt->brt_vdevs[vdevid]);
+
+	/*
+	 * AVL trees do not point back at their avl_tree_t, so the entry
+	 * trees embedded in brt_vdev_t can simply be copied.
+	 */
+	nvdevs = vdevid + 1;
+	vdevs = kmem_zalloc(nvdevs * sizeof (brt_vdev_t), KM_SLEEP);
+	if (brt->brt_nvdevs > 0) {
+		bcopy(brt->brt_vdevs, vdevs, brt->brt_nvdevs *
+		    sizeof (brt_vdev_t));
+		kmem_free(brt->brt_vdevs, brt->brt_nvdevs *
+		    sizeof (brt_vdev_t));
+	}
+	for (i = brt->brt_nvdevs; i < nvdevs; i++) {
+		vdevs[i].bv_vdevid = i;
+		vdevs[i].bv_rangesize = zfs_brt_rangesize;
+		avl_create(&vdevs[i].bv_tree, brt_entry_compare,
+		    sizeof (brt_entry_t), offsetof(brt_entry_t, bre_node));
+	}
+
+	brt->brt_vdevs = vdevs;
+	brt->brt_nvdevs = nvdevs;
+
+	return (&brt->brt_vdevs[vdevid]);
+}
+
+static void
+brt_vdev_create(brt_t *brt, brt_vdev_t *brtvd, dmu_tx_t *tx)
+{
+	spa_t *spa = brt->brt_spa;
+	objset_t *mos = spa->spa_meta_objset;
+	char name[64];
+
+	ASSERT0(brtvd->bv_mos_brtvdev);
+	ASSERT0(brtvd->bv_mos_entries);
+
+	brtvd->bv_mos_entries = zap_create_flags(mos, 0,
+	    ZAP_FLAG_HASH64 | ZAP_FLAG_UINT64_KEY, DMU_OTN_ZAP_METADATA,
+	    brt_zap_leaf_blockshift, brt_zap_indirect_blockshift,
+	    DMU_OT_NONE, 0, tx);
+	VERIFY(brtvd->bv_mos_entries != 0);
+
+	brtvd->bv_mos_brtvdev = dmu_object_alloc(mos,
+	    DMU_OTN_UINT16_METADATA, BRT_BLOCKSIZE,
+	    DMU_OTN_UINT64_METADATA, sizeof (brt_vdev_phys_t), tx);
+	VERIFY(brtvd->bv_mos_brtvdev != 0);
+
+	brt_vdev_name(brtvd->bv_vdevid, name, sizeof (name));
+	VERIFY0(zap_add(mos, DMU_POOL_DIRECTORY_OBJECT, name,
+	    sizeof (uint64_t), 1, &brtvd->bv_mos_brtvdev, tx));
+
+	spa_feature_incr(spa, SPA_FEATURE_BLOCK_CLONING, tx);
+
+	/* All of the counters have to be written to the new object. */
+	if (brtvd->bv_bitmap != NULL)
+		memset(brtvd->bv_bitmap, 0xff, brtvd->bv_nblocks);
+	brtvd->bv_dirty = B_TRUE;
+}
+
+static void
+brt_vdev_destroy(brt_t *brt, brt_vdev_t *brtvd, dmu_tx_t *tx)
+{
+	spa_t *spa = brt->brt_spa;
+	objset_t *mos = spa->spa_meta_objset;
+	char name[64];
+
+	ASSERT0(brtvd->bv_totalcount);
+	ASSERT0(brtvd->bv_usedspace);
+	ASSERT0(brtvd->bv_savedspace);
+
+	VERIFY0(zap_destroy(mos, brtvd->bv_mos_entries, tx));
+	VERIFY0(dmu_object_free(mos, brtvd->bv_mos_brtvdev, tx));
+
+	brt_vdev_name(brtvd->bv_vdevid, name, sizeof (name));
+	VERIFY0(zap_remove(mos, DMU_POOL_DIRECTORY_OBJECT, name, tx));
+
+	spa_feature_decr(spa, SPA_FEATURE_BLOCK_CLONING, tx);
+
+	brtvd->bv_mos_entries = 0;
+	brtvd->bv_mos_brtvdev = 0;
+	if (brtvd->bv_bitmap != NULL)
+		bzero(brtvd->bv_bitmap, brtvd->bv_nblocks);
+	brtvd->bv_dirty = B_FALSE;
+}
+
+static int
+brt_vdev_load(brt_t *brt, brt_vdev_t *brtvd)
+{
+	spa_t *spa = brt->brt_spa;
+	objset_t *mos = spa->spa_meta_objset;
+	brt_vdev_phys_t *bvphys;
+	dmu_buf_t *db;
+	uint64_t mos_brtvdev;
+	char name[64];
+	int error;
+
+	brt_vdev_name(brtvd->bv_vdevid, name, sizeof (name));
+	error = zap_lookup(mos, DMU_POOL_DIRECTORY_OBJECT, name,
+	    sizeof (uint64_t), 1, &mos_brtvdev);
+	if (error == ENOENT)
+		return (0);
+	if (error != 0)
+		return (error);
+
+	error = dmu_bonus_hold(mos, mos_brtvdev, FTAG, &db);
+	if (error != 0)
+		return (error);
+
+	bvphys = db->db_data;
+	brtvd->bv_mos_brtvdev = mos_brtvdev;
+	brtvd->bv_mos_entries = bvphys->bvp_mos_entries;
+	brtvd->bv_rangesize = bvphys->bvp_rangesize;
+	brtvd->bv_totalcount = bvphys->bvp_totalcount;
+	brtvd->bv_usedspace = bvphys->bvp_usedspace;
+	brtvd->bv_savedspace = bvphys->bvp_savedspace;
+	uint64_t size = bvphys->bvp_size;
+	dmu_buf_rele(db, FTAG);
+
+	rw_enter(&brt->brt_lock, RW_WRITER);
+	brt_vdev_realloc(brt, brtvd, size);
+	rw_exit(&brt->brt_lock);
+
+	error = dmu_read(mos, mos_brtvdev, 0, size * sizeof (uint16_t),
+	    brtvd->bv_entcount, DMU_READ_PREFETCH);
+	if (error != 0)
+		return (error);
+
+	/* Nothing has changed since the counters were read. */
+	bzero(brtvd->bv_bitmap, brtvd->bv_nblocks);
+	brtvd->bv_dirty = B_FALSE;
+
+	return (0);
+}
+
+static void
+brt_vdev_sync(brt_t *brt, brt_vdev_t *brtvd, dmu_tx_t *tx)
+{
+	objset_t *mos = brt->brt_spa->spa_meta_objset;
+	brt_vdev_phys_t *bvphys;
+	dmu_buf_t *db;
+	uint64_t b, off, len;
+
+	ASSERT(brtvd->bv_mos_brtvdev != 0);
+
+	for (b = 0; b < brtvd->bv_nblocks; b++) {
+		if (!brtvd->bv_bitmap[b])
+			continue;
+		off = b * BRT_BLOCKSIZE;
+		len = MIN(BRT_BLOCKSIZE,
+		    brtvd->bv_size * sizeof (uint16_t) - off);
+		dmu_write(mos, brtvd->bv_mos_brtvdev, off, len,
+		    (char *)brtvd->bv_entcount + off, tx);
+		brtvd->bv_bitmap[b] = 0;
+	}
+
+	if (!brtvd->bv_dirty)
+		return;
+
+	VERIFY0(dmu_bonus_hold(mos, brtvd->bv_mos_brtvdev, FTAG, &db));
+	dmu_buf_will_dirty(db, tx);
+	bvphys = db->db_data;
+	bvphys->bvp_mos_entries = brtvd->bv_mos_entries;
+	bvphys->bvp_size = brtvd->bv_size;
+	bvphys->bvp_byteorder = ZFS_HOST_BYTEORDER;
+	bvphys->bvp_totalcount = brtvd->bv_totalcount;
+	bvphys->bvp_rangesize = brtvd->bv_rangesize;
+	bvphys->bvp_usedspace = brtvd->bv_usedspace;
+	bvphys->bvp_savedspace = brtvd->bv_savedspace;
+	dmu_buf_rele(db, FTAG);
+
+	brtvd->bv_dirty = B_FALSE;
+}
+
+/*
+ * Adjust the counter of the range holding offset.  Counters that reached
+ * UINT16_MAX stick there: an overestimate only costs a ZAP lookup.
+ */
+static void
+brt_vdev_entcount_adjust(brt_vdev_t *brtvd, uint64_t offset, int delta)
+{
+	uint64_t idx = offset / brtvd->bv_rangesize;
+
+	ASSERT3U(idx, <, brtvd->bv_size);
+
+	if (brtvd->bv_entcount[idx] == UINT16_MAX)
+		return;
+	ASSERT(delta > 0 || brtvd->bv_entcount[idx] > 0);
+	brtvd->bv_entcount[idx] += delta;
+	brtvd->bv_bitmap[idx * sizeof (uint16_t) / BRT_BLOCKSIZE] = 1;
+}
+
+/*
+ * Find the entry for the block at offset, bringing it into the vdev's
+ * entry tree from disk if needed.  If the block has no entry, ENOENT is
+ * returned, unless create is set, in which case an entry with a zero
+ * refcount is added.
+ */
+static int
+brt_entry_find(brt_t *brt, brt_vdev_t *brtvd, uint64_t offset,
+    boolean_t create, brt_entry_t **brep)
+{
+	brt_entry_t *bre, search;
+	avl_index_t where;
+	uint64_t refcount = 0;
+	int error = ENOENT;
+
+	ASSERT(dsl_pool_sync_context(spa_get_dsl(brt->brt_spa)));
+
+	search.bre_offset = offset;
+	bre = avl_find(&brtvd->bv_tree, &search, &where);
+	if (bre != NULL) {
+		*brep = bre;
+		return (0);
+	}
+
+	if (brtvd->bv_mos_entries != 0) {
+		error = zap_lookup_uint64(brt->brt_spa->spa_meta_objset,
+		    brtvd->bv_mos_entries, &offset, 1, sizeof (uint64_t), 1,
+		    &refcount);
+	}
+	if (error != 0 && (error != ENOENT || !create))
+		return (error);
+
+	bre = kmem_cache_alloc(brt_entry_cache, KM_SLEEP);
+	bre->bre_offset = offset;
+	bre->bre_refcount = refcount;
+	avl_insert(&brtvd->bv_tree, bre, where);
+
+	*brep = bre;
+	return (0);
+}
+
+static void
+brt_entry_addref(brt_t *brt, const blkptr_t *bp, uint64_t count)
+{
+	spa_t *spa = brt->brt_spa;
+	uint64_t vdevid = DVA_GET_VDEV(&bp->blk_dva[0]);
+	uint64_t offset = DVA_GET_OFFSET(&bp->blk_dva[0]);
+	uint64_t dsize = bp_get_dsize_sync(spa, bp);
+	brt_vdev_t *brtvd;
+	brt_entry_t *bre;
+	vdev_t *vd;
+	int error;
+
+	rw_enter(&brt->brt_lock, RW_WRITER);
+	brtvd = brt_vdev(brt, vdevid);
+	if (offset / brtvd->bv_rangesize >= brtvd->bv_size) {
+		vd = vdev_lookup_top(spa, vdevid);
+		brt_vdev_realloc(brt, brtvd, MAX(
+		    offset / brtvd->bv_rangesize + 1,
+		    howmany(vd->vdev_asize, brtvd->bv_rangesize)));
+	}
+	rw_exit(&brt->brt_lock);
+
+	error = brt_entry_find(brt, brtvd, offset, B_TRUE, &bre);
+	VERIFY0(error);
+
+	rw_enter(&brt->brt_lock, RW_WRITER);
+	if (bre->bre_refcount == 0) {
+		brt_vdev_entcount_adjust(brtvd, offset, 1);
+		brtvd->bv_totalcount++;
+		brtvd->bv_usedspace += dsize;
+		BRTSTAT_BUMP(brt_addref_entry_new);
+	} else {
+		BRTSTAT_BUMP(brt_addref_entry_existing);
+	}
+	bre->bre_refcount += count;
+	brtvd->bv_savedspace += dsize * count;
+	brtvd->bv_dirty = B_TRUE;
+	rw_exit(&brt->brt_lock);
+}
+
+/*
+ * Drop a reference to a block that may have a BRT entry.  Returns B_TRUE
+ * if this was the last reference and the block has to be freed.
+ */
+boolean_t
+brt_entry_decref(spa_t *spa, const blkptr_t *bp)
+{
+	brt_t *brt = spa->spa_brt;
+	uint64_t vdevid = DVA_GET_VDEV(&bp->blk_dva[0]);
+	uint64_t offset = DVA_GET_OFFSET(&bp->blk_dva[0]);
+	brt_vdev_t *brtvd;
+	brt_entry_t *bre;
+	int error;
+
+	if (!brt_maybe_exists(spa, bp))
+		return (B_TRUE);
+
+	/*
+	 * brt_maybe_exists() found a counter for this vdev, and the vdev
+	 * array only changes in syncing context, so it is safe to use.
+	 */
+	brtvd = &brt->brt_vdevs[vdevid];
+	error = brt_entry_find(brt, brtvd, offset, B_FALSE, &bre);
+	if (error == ENOENT) {
+		BRTSTAT_BUMP(brt_decref_no_entry);
+		return (B_TRUE);
+	} else if (error != 0) {
+		/*
+		 * We cannot tell whether the block is still referenced, so
+		 * leaking it is the only safe choice.
+		 */
+		zfs_dbgmsg("brt: lookup of vdev %llu offset %llu failed, "
+		    "error %d; leaking block", (u_longlong_t)vdevid,
+		    (u_longlong_t)offset, error);
+		return (B_FALSE);
+	}
+	if (bre->bre_refcount == 0) {
+		BRTSTAT_BUMP(brt_decref_free_data_now);
+		return (B_TRUE);
+	}
+
+	uint64_t dsize = bp_get_dsize_sync(spa, bp);
+
+	rw_enter(&brt->brt_lock, RW_WRITER);
+	bre->bre_refcount--;
+	if (bre->bre_refcount == 0) {
+		brt_vdev_entcount_adjust(brtvd, offset, -1);
+		ASSERT3U(brtvd->bv_totalcount, >, 0);
+		brtvd->bv_totalcount--;
+		brtvd->bv_usedspace -= dsize;
+		BRTSTAT_BUMP(brt_decref_free_data_later);
+	} else {
+		BRTSTAT_BUMP(brt_decref_entry_still_referenced);
+	}
+	brtvd->bv_savedspace -= dsize;
+	brtvd->bv_dirty = B_TRUE;
+	rw_exit(&brt->brt_lock);
+
+	return (B_FALSE);
+}
+
+/*
+ * Cheap check, done for every freed block, whether the block may have a
+ * BRT entry.  Only level 0 data blocks can be cloned.
+ */
+boolean_t
+brt_maybe_exists(spa_t *spa, const blkptr_t *bp)
+{
+	brt_t *brt = spa->spa_brt;
+	brt_vdev_t *brtvd;
+	uint64_t vdevid, idx;
+	boolean_t mayexists = B_FALSE;
+
+	if (brt == NULL || BP_IS_EMBEDDED(bp) || BP_IS_HOLE(bp) ||
+	    BP_IS_METADATA(bp))
+		return (B_FALSE);
+
+	vdevid = DVA_GET_VDEV(&bp->blk_dva[0]);
+
+	rw_enter(&brt->brt_lock, RW_READER);
+	if (vdevid < brt->brt_nvdevs) {
+		brtvd = &brt->brt_vdevs[vdevid];
+		if (brtvd->bv_entcount != NULL) {
+			idx = DVA_GET_OFFSET(&bp->blk_dva[0]) /
+			    brtvd->bv_rangesize;
+			if (idx < brtvd->bv_size)
+				mayexists = (brtvd->bv_entcount[idx] > 0);
+		}
+	}
+	rw_exit(&brt->brt_lock);
+
+	return (mayexists);
+}
+
+/*
+ * The block's references beyond the first one, as of the last synced txg.
+ * This reads the entry from disk without bringing it in core, so it can be
+ * used outside of syncing context by consumers such as zdb that do not
+ * modify the pool.
+ */
+uint64_t
+brt_entry_get_refcount(spa_t *spa, const blkptr_t *bp)
+{
+	brt_t *brt = spa->spa_brt;
+	uint64_t vdevid = DVA_GET_VDEV(&bp->blk_dva[0]);
+	uint64_t offset = DVA_GET_OFFSET(&bp->blk_dva[0]);
+	uint64_t mos_entries = 0;
+	uint64_t refcount = 0;
+
+	if (!brt_maybe_exists(spa, bp))
+		return (0);
+
+	rw_enter(&brt->brt_lock, RW_READER);
+	if (vdevid < brt->brt_nvdevs)
+		mos_entries = brt->brt_vdevs[vdevid].bv_mos_entries;
+	rw_exit(&brt->brt_lock);
+
+	if (mos_entries == 0 || zap_lookup_uint64(spa->spa_meta_objset,
+	    mos_entries, &offset, 1, sizeof (uint64_t), 1, &refcount) != 0)
+		return (0);
+
+	return (refcount);
+}
+
+/*
+ * Whether the block may be referenced once more by cloning it.  Holes and
+ * embedded blocks carry no allocation and can always be copied.
+ */
+boolean_t
+brt_can_clone(spa_t *spa, const blkptr_t *bp)
+{
+	vdev_t *vd;
+	boolean_t ok;
+
+	if (BP_IS_HOLE(bp) || BP_IS_EMBEDDED(bp))
+		return (B_TRUE);
+
+	/* Dedup blocks are already reference counted by the DDT. */
+	if (BP_GET_DEDUP(bp) || BP_IS_METADATA(bp))
+		return (B_FALSE);
+
+	/*
+	 * Blocks on vdevs being removed or already removed would need their
+	 * entries remapped along with the data.
+	 */
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	vd = vdev_lookup_top(spa, DVA_GET_VDEV(&bp->blk_dva[0]));
+	ok = (vd != NULL && vd->vdev_ops != &vdev_indirect_ops &&
+	    !vd->vdev_removing);
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	return (ok);
+}
+
+/*
+ * Record in open context that bp gained a reference in tx's txg.
+ */
+void
+brt_pending_add(spa_t *spa, const blkptr_t *bp, dmu_tx_t *tx)
+{
+	brt_t *brt = spa->spa_brt;
+	brt_pending_entry_t *bpe, *newbpe;
+	avl_index_t where;
+	uint64_t txg = dmu_tx_get_txg(tx);
+	int i = txg & TXG_MASK;
+
+	ASSERT(!BP_IS_HOLE(bp) && !BP_IS_EMBEDDED(bp));
+
+	newbpe = kmem_cache_alloc(brt_pending_entry_cache, KM_SLEEP);
+	newbpe->bpe_bp = *bp;
+	newbpe->bpe_count = 1;
+
+	mutex_enter(&brt->brt_pending_lock[i]);
+	bpe = avl_find(&brt->brt_pending_tree[i], newbpe, &where);
+	if (bpe == NULL) {
+		avl_insert(&brt->brt_pending_tree[i], newbpe, where);
+		newbpe = NULL;
+	} else {
+		bpe->bpe_count++;
+	}
+	mutex_exit(&brt->brt_pending_lock[i]);
+
+	if (newbpe != NULL)
+		kmem_cache_free(brt_pending_entry_cache, newbpe);
+}
+
+/*
+ * Turn the references added in txg into BRT entries.  Called at the start
+ * of spa_sync(), before any of the txg's frees are processed.
+ */
+void
+brt_pending_apply(spa_t *spa, uint64_t txg)
+{
+	brt_t *brt = spa->spa_brt;
+	brt_pending_entry_t *bpe;
+	avl_tree_t tree;
+	void *c = NULL;
+	int i = txg & TXG_MASK;
+
+	ASSERT3U(txg, !=, 0);
+
+	avl_create(&tree, brt_pending_entry_compare,
+	    sizeof (brt_pending_entry_t),
+	    offsetof(brt_pending_entry_t, bpe_node));
+
+	mutex_enter(&brt->brt_pending_lock[i]);
+	avl_swap(&tree, &brt->brt_pending_tree[i]);
+	mutex_exit(&brt->brt_pending_lock[i]);
+
+	while ((bpe = avl_destroy_nodes(&tree, &c)) != NULL) {
+		brt_entry_addref(brt, &bpe->bpe_bp, bpe->bpe_count);
+		kmem_cache_free(brt_pending_entry_cache, bpe);
+	}
+	avl_destroy(&tree);
+}
+
+static void
+brt_sync_entry(brt_t *brt, brt_vdev_t *brtvd, brt_entry_t *bre, dmu_tx_t *tx)
+{
+	objset_t *mos = brt->brt_spa->spa_meta_objset;
+	int error;
+
+	if (brtvd->bv_mos_entries == 0) {
+		/* Cloned and freed again before ever reaching the disk. */
+		ASSERT0(bre->bre_refcount);
+		return;
+	}
+
+	if (bre->bre_refcount == 0) {
+		error = zap_remove_uint64(mos, brtvd->bv_mos_entries,
+		    &bre->bre_offset, 1, tx);
+		VERIFY(error == 0 || error == ENOENT);
+	} else {
+		VERIFY0(zap_update_uint64(mos, brtvd->bv_mos_entries,
+		    &bre->bre_offset, 1, sizeof (uint64_t), 1,
+		    &bre->bre_refcount, tx));
+	}
+}
+
+/*
+ * Write the entries and counters modified in this sync pass.
+ */
+void
+brt_sync(spa_t *spa, uint64_t txg)
+{
+	brt_t *brt = spa->spa_brt;
+	brt_vdev_t *brtvd;
+	brt_entry_t *bre;
+	dmu_tx_t *tx = NULL;
+	uint64_t vdevid;
+	void *c;
+
+	ASSERT(spa_syncing_txg(spa) == txg);
+
+	if (brt == NULL)
+		return;
+
+	for (vdevid = 0; vdevid < brt->brt_nvdevs; vdevid++) {
+		brtvd = &brt->brt_vdevs[vdevid];
+
+		if (avl_numnodes(&brtvd->bv_tree) == 0 && !brtvd->bv_dirty)
+			continue;
+
+		if (tx == NULL)
+			tx = dmu_tx_create_assigned(spa->spa_dsl_pool, txg);
+
+		if (brtvd->bv_mos_brtvdev == 0 && brtvd->bv_totalcount > 0)
+			brt_vdev_create(brt, brtvd, tx);
+
+		c = NULL;
+		while ((bre = avl_destroy_nodes(&brtvd->bv_tree, &c)) != NULL) {
+			brt_sync_entry(brt, brtvd, bre, tx);
+			kmem_cache_free(brt_entry_cache, bre);
+		}
+
+		if (brtvd->bv_mos_brtvdev == 0) {
+			brtvd->bv_dirty = B_FALSE;
+			continue;
+		}
+
+		if (brtvd->bv_totalcount == 0)
+			brt_vdev_destroy(brt, brtvd, tx);
+		else
+			brt_vdev_sync(brt, brtvd, tx);
+	}
+
+	if (tx != NULL)
+		dmu_tx_commit(tx);
+}
+
+/*
+ * Whether any block on the top-level vdev has been cloned.  Such vdevs
+ * cannot be removed, since the entries would have to follow the data.
+ */
+boolean_t
+brt_vdev_has_entries(spa_t *spa, uint64_t vdevid)
+{
+	brt_t *brt = spa->spa_brt;
+	boolean_t has;
+
+	if (brt == NULL)
+		return (B_FALSE);
+
+	rw_enter(&brt->brt_lock, RW_READER);
+	has = (vdevid < brt->brt_nvdevs &&
+	    brt->brt_vdevs[vdevid].bv_totalcount > 0);
+	rw_exit(&brt->brt_lock);
+
+	return (has);
+}
+
+uint64_t
+brt_get_used(spa_t *spa)
+{
+	brt_t *brt = spa->spa_brt;
+	uint64_t used = 0;
+
+	if (brt == NULL)
+		return (0);
+
+	rw_enter(&brt->brt_lock, RW_READER);
+	for (uint64_t vdevid = 0; vdevid < brt->brt_nvdevs; vdevid++)
+		used += brt->brt_vdevs[vdevid].bv_usedspace;
+	rw_exit(&brt->brt_lock);
+
+	return (used);
+}
+
+uint64_t
+brt_get_saved(spa_t *spa)
+{
+	brt_t *brt = spa->spa_brt;
+	uint64_t saved = 0;
+
+	if (brt == NULL)
+		return (0);
+
+	rw_enter(&brt->brt_lock, RW_READER);
+	for (uint64_t vdevid = 0; vdevid < brt->brt_nvdevs; vdevid++)
+		saved += brt->brt_vdevs[vdevid].bv_savedspace;
+	rw_exit(&brt->brt_lock);
+
+	return (saved);
+}
+
+/*
+ * Ratio of referenced to allocated space of cloned blocks, times 100, as
+ * reported by the bcloneratio pool property.
+ */
+uint64_t
+brt_get_ratio(spa_t *spa)
+{
+	uint64_t used = brt_get_used(spa);
+
+	if (used == 0)
+		return (100);
+
+	return ((used + brt_get_saved(spa)) * 100 / used);
+}
+
+void
+brt_create(spa_t *spa)
+{
+	brt_t *brt;
+	int i;
+
+	ASSERT(spa->spa_brt == NULL);
+
+	brt = kmem_zalloc(sizeof (brt_t), KM_SLEEP);
+	brt->brt_spa = spa;
+	rw_init(&brt->brt_lock, NULL, RW_DEFAULT, NULL);
+	for (i = 0; i < TXG_SIZE; i++) {
+		mutex_init(&brt->brt_pending_lock[i], NULL, MUTEX_DEFAULT,
+		    NULL);
+		avl_create(&brt->brt_pending_tree[i],
+		    brt_pending_entry_compare, sizeof (brt_pending_entry_t),
+		    offsetof(brt_pending_entry_t, bpe_node));
+	}
+
+	rw_enter(&brt->brt_lock, RW_WRITER);
+	if (spa->spa_root_vdev != NULL &&
+	    spa->spa_root_vdev->vdev_children > 0)
+		(void) brt_vdev(brt, spa->spa_root_vdev->vdev_children - 1);
+	rw_exit(&brt->brt_lock);
+
+	spa->spa_brt = brt;
+}
+
+int
+brt_load(spa_t *spa)
+{
+	brt_t *brt;
+	uint64_t vdevid;
+	int error = 0;
+
+	brt_create(spa);
+	brt = spa->spa_brt;
+
+	/*
+	 * Nothing can free blocks of the pool while it is being loaded, so
+	 * the vdev array cannot change under us.
+	 */
+	for (vdevid = 0; vdevid < brt->brt_nvdevs && error == 0; vdevid++)
+		error = brt_vdev_load(brt, &brt->brt_vdevs[vdevid]);
+
+	return (error);
+}
+
+void
+brt_unload(spa_t *spa)
+{
+	brt_t *brt = spa->spa_brt;
+	brt_pending_entry_t *bpe;
+	brt_entry_t *bre;
+	brt_vdev_t *brtvd;
+	uint64_t vdevid;
+	void *c;
+	int i;
+
+	if (brt == NULL)
+		return;
+
+	for (vdevid = 0; vdevid < brt->brt_nvdevs; vdevid++) {
+		brtvd = &brt->brt_vdevs[vdevid];
+		c = NULL;
+		while ((bre = avl_destroy_nodes(&brtvd->bv_tree, &c)) != NULL)
+			kmem_cache_free(brt_entry_cache, bre);
+		avl_destroy(&brtvd->bv_tree);
+		if (brtvd->bv_entcount != NULL) {
+			kmem_free(brtvd->bv_entcount,
+			    brtvd->bv_size * sizeof (uint16_t));
+			kmem_free(brtvd->bv_bitmap, brtvd->bv_nblocks);
+		}
+	}
+	if (brt->brt_nvdevs > 0)
+		kmem_free(brt->brt_vdevs, brt->brt_nvdevs * sizeof (brt_vdev_t));
+
+	for (i = 0; i < TXG_SIZE; i++) {
+		c = NULL;
+		while ((bpe = avl_destroy_nodes(&brt->brt_pending_tree[i],
+		    &c)) != NULL)
+			kmem_cache_free(brt_pending_entry_cache, bpe);
+		avl_destroy(&brt->brt_pending_tree[i]);
+		mutex_destroy(&brt->brt_pending_lock[i]);
+	}
+	rw_destroy(&brt->brt_lock);
+
+	kmem_free(brt, sizeof (brt_t));
+	spa->spa_brt = NULL;
+}
+
+void
+brt_init(void)
+{
+	brt_entry_cache = kmem_cache_create("brt_entry_cache",
+	    sizeof (brt_entry_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+	brt_pending_entry_cache = kmem_cache_create("brt_pending_entry_cache",
+	    sizeof (brt_pending_entry_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+
+	brt_ksp = kstat_create("zfs", 0, "brtstats", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (brt_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (brt_ksp != NULL) {
+		brt_ksp->ks_data = &brt_stats;
+		kstat_install(brt_ksp);
+	}
+}
+
+void
+brt_fini(void)
+{
+	if (brt_ksp != NULL) {
+		kstat_delete(brt_ksp);
+		brt_ksp = NULL;
+	}
+
+	kmem_cache_destroy(brt_entry_cache);
+	kmem_cache_destroy(brt_pending_entry_cache);
+}
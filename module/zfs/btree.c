@@ -0,0 +1,958 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+/*
+ * Copyright (c) 2019 by Delphix. All rights reserved.
+ */
+
+#include	<sys/btree.h>
+#include	<sys/bitops.h>
+#include	<sys/zfs_context.h>
+
+kmem_cache_t *zfs_btree_leaf_cache;
+
+/*
+ * Control the extent of the verification that occurs when zfs_btree_verify is
+ * called. Primarily used for debugging when extending the btree logic and
+ * functionality. As the intensity is increased, new verification steps are
+ * added. These steps are cumulative; intensity = 3 includes the intensity = 1
+ * and intensity = 2 steps as well.
+ *
+ * Intensity 1: Verify that the root node has no parent.
+ * Intensity 2: Verify that a core node's children's parent pointers point
+ * to the core node.
+ * Intensity 3: Verify that the tree's height is consistent throughout, and
+ * that the total number of elements in the tree matches the sum of the
+ * number of elements in each node. Also verifies that each node's count
+ * obeys the invariants (less than or equal to maximum value).
+ * Intensity 4: Verify that the elements are in order.
+ */
+int zfs_btree_verify_intensity = 0;
+
+#ifdef _ILP32
+#define	BTREE_POISON 0xabadb10c
+#else
+#define	BTREE_POISON 0xabadb10cdeadbeef
+#endif
+
+#define	BT_CORE_MIN	(BTREE_CORE_ELEMS / 2)
+#define	BT_LEAF_MIN(tree)	((tree)->bt_leaf_cap / 2)
+
+static uint8_t *
+bt_elems(zfs_btree_hdr_t *hdr)
+{
+	if (hdr->bth_core)
+		return (((zfs_btree_core_t *)hdr)->btc_elems);
+	return (((zfs_btree_leaf_t *)hdr)->btl_elems);
+}
+
+#define	BT_ELEM(tree, hdr, i)	\
+	(bt_elems(hdr) + (size_t)(i) * (tree)->bt_elem_size)
+
+static zfs_btree_hdr_t *
+bt_child(zfs_btree_hdr_t *hdr, uint32_t i)
+{
+	ASSERT(hdr->bth_core);
+	return (((zfs_btree_core_t *)hdr)->btc_children[i]);
+}
+
+static size_t
+bt_core_size(zfs_btree_t *tree)
+{
+	return (offsetof(zfs_btree_core_t, btc_elems) +
+	    BTREE_CORE_ELEMS * tree->bt_elem_size);
+}
+
+void
+zfs_btree_init(void)
+{
+	zfs_btree_leaf_cache = kmem_cache_create("zfs_btree_leaf_cache",
+	    BTREE_LEAF_SIZE, 0, NULL, NULL, NULL, NULL, NULL, 0);
+}
+
+void
+zfs_btree_fini(void)
+{
+	kmem_cache_destroy(zfs_btree_leaf_cache);
+}
+
+void
+zfs_btree_create(zfs_btree_t *tree, int (*compar) (const void *, const void *),
+    size_t size)
+{
+	/*
+	 * We need a minimum of 4 elements so that when we split a node we
+	 * always have at least two elements in each node, and so that a
+	 * node that is half full can always spare an element to a sibling.
+	 */
+	ASSERT3U(size, <=, (BTREE_LEAF_SIZE -
+	    offsetof(zfs_btree_leaf_t, btl_elems)) / 4);
+
+	bzero(tree, sizeof (*tree));
+	tree->bt_compar = compar;
+	tree->bt_elem_size = size;
+	tree->bt_leaf_cap = (BTREE_LEAF_SIZE -
+	    offsetof(zfs_btree_leaf_t, btl_elems)) / size;
+	tree->bt_height = -1;
+}
+
+/*
+ * Find value in the array of elements provided. Uses a simple binary search.
+ */
+static void *
+zfs_btree_find_in_buf(zfs_btree_t *tree, uint8_t *buf, uint32_t nelems,
+    const void *value, zfs_btree_index_t *where)
+{
+	uint32_t max = nelems;
+	uint32_t min = 0;
+
+	while (max > min) {
+		uint32_t idx = (min + max) / 2;
+		uint8_t *cur = buf + (size_t)idx * tree->bt_elem_size;
+		int comp = tree->bt_compar(cur, value);
+		if (comp < 0) {
+			min = idx + 1;
+		} else if (comp > 0) {
+			max = idx;
+		} else {
+			where->bti_offset = idx;
+			where->bti_before = B_FALSE;
+			return (cur);
+		}
+	}
+
+	where->bti_offset = max;
+	where->bti_before = B_TRUE;
+	return (NULL);
+}
+
+/*
+ * Find the given value in the tree. where may be passed as null to use as a
+ * membership test or if the btree is being used as a map.
+ */
+void *
+zfs_btree_find(zfs_btree_t *tree, const void *value, zfs_btree_index_t *where)
+{
+	zfs_btree_index_t idx;
+	zfs_btree_hdr_t *hdr = tree->bt_root;
+
+	if (hdr == NULL) {
+		if (where != NULL) {
+			where->bti_node = NULL;
+			where->bti_offset = 0;
+			where->bti_before = B_TRUE;
+		}
+		return (NULL);
+	}
+
+	/*
+	 * Iterate down the tree, finding which child the value should be in
+	 * by comparing with the separators.
+	 */
+	for (;;) {
+		void *d = zfs_btree_find_in_buf(tree, bt_elems(hdr),
+		    hdr->bth_count, value, &idx);
+		idx.bti_node = hdr;
+		if (d != NULL || !hdr->bth_core) {
+			if (where != NULL)
+				*where = idx;
+			return (d);
+		}
+		hdr = bt_child(hdr, idx.bti_offset);
+	}
+}
+
+/*
+ * Return the index of the given child in its parent's child array.
+ */
+static uint32_t
+zfs_btree_child_idx(zfs_btree_hdr_t *hdr)
+{
+	zfs_btree_core_t *parent = hdr->bth_parent;
+
+	ASSERT3P(parent, !=, NULL);
+	for (uint32_t i = 0; i <= parent->btc_hdr.bth_count; i++) {
+		if (parent->btc_children[i] == hdr)
+			return (i);
+	}
+	panic("node %p not found in parent %p", (void *)hdr, (void *)parent);
+	return (0);
+}
+
+/*
+ * Return true if the node lies on the right edge of the tree, i.e. if no
+ * element in the tree sorts after the elements of this node's subtree.
+ */
+static boolean_t
+zfs_btree_is_rightmost(zfs_btree_hdr_t *hdr)
+{
+	for (zfs_btree_core_t *parent = hdr->bth_parent; parent != NULL;
+	    hdr = &parent->btc_hdr, parent = hdr->bth_parent) {
+		if (parent->btc_children[parent->btc_hdr.bth_count] != hdr)
+			return (B_FALSE);
+	}
+	return (B_TRUE);
+}
+
+static zfs_btree_leaf_t *
+zfs_btree_leaf_alloc(zfs_btree_t *tree)
+{
+	zfs_btree_leaf_t *leaf = kmem_cache_alloc(zfs_btree_leaf_cache,
+	    KM_SLEEP);
+	leaf->btl_hdr.bth_parent = NULL;
+	leaf->btl_hdr.bth_core = B_FALSE;
+	leaf->btl_hdr.bth_count = 0;
+	tree->bt_num_nodes++;
+	return (leaf);
+}
+
+static zfs_btree_core_t *
+zfs_btree_core_alloc(zfs_btree_t *tree)
+{
+	zfs_btree_core_t *core = kmem_alloc(bt_core_size(tree), KM_SLEEP);
+	core->btc_hdr.bth_parent = NULL;
+	core->btc_hdr.bth_core = B_TRUE;
+	core->btc_hdr.bth_count = 0;
+	tree->bt_num_nodes++;
+	return (core);
+}
+
+static void
+zfs_btree_node_free(zfs_btree_t *tree, zfs_btree_hdr_t *hdr)
+{
+	ASSERT3U(tree->bt_num_nodes, >, 0);
+	tree->bt_num_nodes--;
+	if (hdr->bth_core) {
+		kmem_free(hdr, bt_core_size(tree));
+	} else {
+		kmem_cache_free(zfs_btree_leaf_cache, hdr);
+	}
+}
+
+/*
+ * Copy elements [from, to) of the sequence formed by inserting value at
+ * position idx of the n elements of buf, into dst.
+ */
+static void
+zfs_btree_copy_with_insert(zfs_btree_t *tree, uint8_t *buf, uint32_t idx,
+    const void *value, uint32_t from, uint32_t to, uint8_t *dst)
+{
+	size_t size = tree->bt_elem_size;
+
+	for (uint32_t i = from; i < to; i++, dst += size) {
+		const void *src;
+		if (i < idx)
+			src = buf + (size_t)i * size;
+		else if (i == idx)
+			src = value;
+		else
+			src = buf + (size_t)(i - 1) * size;
+		bcopy(src, dst, size);
+	}
+}
+
+/*
+ * Compute where to split a full node that receives one more element at
+ * position idx. The left node keeps elements [0, split), the element at
+ * split moves up to the parent and the rest goes to the new right node.
+ *
+ * If we are appending to the right edge of the tree, keep the left node
+ * full and start the new node with just the new element, so that in-order
+ * insertions (e.g. loading a space map) produce full nodes.
+ */
+static uint32_t
+zfs_btree_split_point(zfs_btree_hdr_t *hdr, uint32_t capacity, uint32_t idx)
+{
+	if (idx == capacity && zfs_btree_is_rightmost(hdr))
+		return (capacity - 1);
+	return ((capacity + 1) / 2);
+}
+
+/*
+ * Insert the separator sep into the parent of old_node, with new_node as
+ * its right child. Splits the parent if needed, recursively.
+ */
+static void
+zfs_btree_insert_into_parent(zfs_btree_t *tree, zfs_btree_hdr_t *old_node,
+    const void *sep, zfs_btree_hdr_t *new_node)
+{
+	size_t size = tree->bt_elem_size;
+	zfs_btree_core_t *parent = old_node->bth_parent;
+
+	if (parent == NULL) {
+		ASSERT3P(old_node, ==, tree->bt_root);
+		zfs_btree_core_t *root = zfs_btree_core_alloc(tree);
+		root->btc_hdr.bth_count = 1;
+		root->btc_children[0] = old_node;
+		root->btc_children[1] = new_node;
+		bcopy(sep, root->btc_elems, size);
+		old_node->bth_parent = root;
+		new_node->bth_parent = root;
+		tree->bt_root = &root->btc_hdr;
+		tree->bt_height++;
+		return;
+	}
+
+	zfs_btree_hdr_t *par_hdr = &parent->btc_hdr;
+	uint32_t count = par_hdr->bth_count;
+	uint32_t c = zfs_btree_child_idx(old_node);
+
+	if (count < BTREE_CORE_ELEMS) {
+		memmove(parent->btc_elems + (c + 1) * size,
+		    parent->btc_elems + c * size, (count - c) * size);
+		memmove(&parent->btc_children[c + 2],
+		    &parent->btc_children[c + 1],
+		    (count - c) * sizeof (zfs_btree_hdr_t *));
+		bcopy(sep, parent->btc_elems + c * size, size);
+		parent->btc_children[c + 1] = new_node;
+		new_node->bth_parent = parent;
+		par_hdr->bth_count++;
+		return;
+	}
+
+	/*
+	 * The parent is full, split it. The elements of the parent plus sep
+	 * form a sequence of count + 1 elements with sep at position c, and
+	 * its children plus new_node form a sequence of count + 2 children
+	 * with new_node at position c + 1.
+	 */
+	uint32_t split = zfs_btree_split_point(par_hdr, count, c);
+	zfs_btree_core_t *right = zfs_btree_core_alloc(tree);
+	zfs_btree_hdr_t *rhdr = &right->btc_hdr;
+	uint8_t *new_sep = kmem_alloc(size, KM_SLEEP);
+
+	rhdr->bth_count = count - split;
+	zfs_btree_copy_with_insert(tree, parent->btc_elems, c, sep,
+	    split + 1, count + 1, right->btc_elems);
+	zfs_btree_copy_with_insert(tree, parent->btc_elems, c, sep,
+	    split, split + 1, new_sep);
+	for (uint32_t i = split + 1; i < count + 2; i++) {
+		zfs_btree_hdr_t *child;
+		if (i <= c)
+			child = parent->btc_children[i];
+		else if (i == c + 1)
+			child = new_node;
+		else
+			child = parent->btc_children[i - 1];
+		right->btc_children[i - split - 1] = child;
+		child->bth_parent = right;
+	}
+
+	if (c < split) {
+		memmove(parent->btc_elems + (c + 1) * size,
+		    parent->btc_elems + c * size, (split - c - 1) * size);
+		bcopy(sep, parent->btc_elems + c * size, size);
+	}
+	if (c + 1 <= split) {
+		memmove(&parent->btc_children[c + 2],
+		    &parent->btc_children[c + 1],
+		    (split - c - 1) * sizeof (zfs_btree_hdr_t *));
+		parent->btc_children[c + 1] = new_node;
+		new_node->bth_parent = parent;
+	}
+	par_hdr->bth_count = split;
+
+	zfs_btree_insert_into_parent(tree, par_hdr, new_sep, rhdr);
+	kmem_free(new_sep, size);
+}
+
+/*
+ * Insert value at position idx of the given leaf, splitting it if needed.
+ */
+static void
+zfs_btree_insert_into_leaf(zfs_btree_t *tree, zfs_btree_leaf_t *leaf,
+    const void *value, uint32_t idx)
+{
+	size_t size = tree->bt_elem_size;
+	zfs_btree_hdr_t *hdr = &leaf->btl_hdr;
+	uint32_t count = hdr->bth_count;
+
+	ASSERT3U(idx, <=, count);
+	if (count < tree->bt_leaf_cap) {
+		memmove(leaf->btl_elems + (idx + 1) * size,
+		    leaf->btl_elems + idx * size, (count - idx) * size);
+		bcopy(value, leaf->btl_elems + idx * size, size);
+		hdr->bth_count++;
+		return;
+	}
+
+	uint32_t split = zfs_btree_split_point(hdr, count, idx);
+	zfs_btree_leaf_t *right = zfs_btree_leaf_alloc(tree);
+	uint8_t *sep = kmem_alloc(size, KM_SLEEP);
+
+	right->btl_hdr.bth_count = count - split;
+	zfs_btree_copy_with_insert(tree, leaf->btl_elems, idx, value,
+	    split + 1, count + 1, right->btl_elems);
+	zfs_btree_copy_with_insert(tree, leaf->btl_elems, idx, value,
+	    split, split + 1, sep);
+	if (idx < split) {
+		memmove(leaf->btl_elems + (idx + 1) * size,
+		    leaf->btl_elems + idx * size, (split - idx - 1) * size);
+		bcopy(value, leaf->btl_elems + idx * size, size);
+	}
+	hdr->bth_count = split;
+
+	zfs_btree_insert_into_parent(tree, hdr, sep, &right->btl_hdr);
+	kmem_free(sep, size);
+}
+
+static zfs_btree_hdr_t *
+zfs_btree_first_helper(zfs_btree_hdr_t *hdr, zfs_btree_index_t *where)
+{
+	while (hdr->bth_core)
+		hdr = bt_child(hdr, 0);
+	where->bti_node = hdr;
+	where->bti_offset = 0;
+	where->bti_before = B_FALSE;
+	return (hdr);
+}
+
+static zfs_btree_hdr_t *
+zfs_btree_last_helper(zfs_btree_hdr_t *hdr, zfs_btree_index_t *where)
+{
+	while (hdr->bth_core)
+		hdr = bt_child(hdr, hdr->bth_count);
+	where->bti_node = hdr;
+	where->bti_offset = hdr->bth_count - 1;
+	where->bti_before = B_FALSE;
+	return (hdr);
+}
+
+void
+zfs_btree_add_idx(zfs_btree_t *tree, const void *value,
+    const zfs_btree_index_t *where)
+{
+	zfs_btree_hdr_t *hdr = where->bti_node;
+	uint32_t offset = where->bti_offset;
+
+	if (hdr == NULL) {
+		ASSERT3P(tree->bt_root, ==, NULL);
+		ASSERT0(tree->bt_num_elems);
+		zfs_btree_leaf_t *leaf = zfs_btree_leaf_alloc(tree);
+		tree->bt_root = &leaf->btl_hdr;
+		tree->bt_height = 0;
+		hdr = &leaf->btl_hdr;
+		offset = 0;
+	} else if (!where->bti_before) {
+		/*
+		 * The index points at an element; insert right before it.
+		 * For an element in a core node, that is at the end of the
+		 * rightmost leaf of the subtree to its left.
+		 */
+		if (hdr->bth_core) {
+			zfs_btree_index_t idx;
+			hdr = zfs_btree_last_helper(bt_child(hdr, offset),
+			    &idx);
+			offset = hdr->bth_count;
+		}
+	}
+
+	ASSERT(!hdr->bth_core);
+	zfs_btree_insert_into_leaf(tree, (zfs_btree_leaf_t *)hdr, value,
+	    offset);
+	tree->bt_num_elems++;
+
+#ifdef ZFS_DEBUG
+	if (zfs_btree_verify_intensity > 0)
+		zfs_btree_verify(tree);
+#endif
+}
+
+void
+zfs_btree_add(zfs_btree_t *tree, const void *node)
+{
+	zfs_btree_index_t where = {0};
+	VERIFY3P(zfs_btree_find(tree, node, &where), ==, NULL);
+	zfs_btree_add_idx(tree, node, &where);
+}
+
+void *
+zfs_btree_first(zfs_btree_t *tree, zfs_btree_index_t *where)
+{
+	zfs_btree_index_t idx;
+
+	if (tree->bt_root == NULL) {
+		ASSERT0(tree->bt_num_elems);
+		return (NULL);
+	}
+	if (where == NULL)
+		where = &idx;
+	return (bt_elems(zfs_btree_first_helper(tree->bt_root, where)));
+}
+
+void *
+zfs_btree_last(zfs_btree_t *tree, zfs_btree_index_t *where)
+{
+	zfs_btree_index_t idx;
+
+	if (tree->bt_root == NULL) {
+		ASSERT0(tree->bt_num_elems);
+		return (NULL);
+	}
+	if (where == NULL)
+		where = &idx;
+	zfs_btree_hdr_t *hdr = zfs_btree_last_helper(tree->bt_root, where);
+	return (BT_ELEM(tree, hdr, where->bti_offset));
+}
+
+/*
+ * Walk up from a node whose elements are exhausted in the given direction,
+ * to the first ancestor separator in that direction.
+ */
+static void *
+zfs_btree_climb(zfs_btree_t *tree, zfs_btree_hdr_t *hdr, boolean_t forward,
+    zfs_btree_index_t *out_idx)
+{
+	while (hdr->bth_parent != NULL) {
+		uint32_t c = zfs_btree_child_idx(hdr);
+		hdr = &hdr->bth_parent->btc_hdr;
+		if (forward && c < hdr->bth_count) {
+			out_idx->bti_node = hdr;
+			out_idx->bti_offset = c;
+			out_idx->bti_before = B_FALSE;
+			return (BT_ELEM(tree, hdr, c));
+		} else if (!forward && c > 0) {
+			out_idx->bti_node = hdr;
+			out_idx->bti_offset = c - 1;
+			out_idx->bti_before = B_FALSE;
+			return (BT_ELEM(tree, hdr, c - 1));
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Return the next valued node in the tree. The same address can be safely
+ * passed for idx and out_idx.
+ */
+void *
+zfs_btree_next(zfs_btree_t *tree, const zfs_btree_index_t *idx,
+    zfs_btree_index_t *out_idx)
+{
+	zfs_btree_hdr_t *hdr = idx->bti_node;
+	uint32_t offset = idx->bti_offset;
+
+	if (hdr == NULL)
+		return (NULL);
+
+	if (hdr->bth_core) {
+		ASSERT(!idx->bti_before);
+		hdr = zfs_btree_first_helper(bt_child(hdr, offset + 1),
+		    out_idx);
+		return (bt_elems(hdr));
+	}
+
+	if (!idx->bti_before)
+		offset++;
+	if (offset < hdr->bth_count) {
+		out_idx->bti_node = hdr;
+		out_idx->bti_offset = offset;
+		out_idx->bti_before = B_FALSE;
+		return (BT_ELEM(tree, hdr, offset));
+	}
+	return (zfs_btree_climb(tree, hdr, B_TRUE, out_idx));
+}
+
+/*
+ * Return the previous valued node in the tree.  The same value can be safely
+ * passed for idx and out_idx.
+ */
+void *
+zfs_btree_prev(zfs_btree_t *tree, const zfs_btree_index_t *idx,
+    zfs_btree_index_t *out_idx)
+{
+	zfs_btree_hdr_t *hdr = idx->bti_node;
+	uint32_t offset = idx->bti_offset;
+
+	if (hdr == NULL)
+		return (NULL);
+
+	if (hdr->bth_core) {
+		ASSERT(!idx->bti_before);
+		hdr = zfs_btree_last_helper(bt_child(hdr, offset), out_idx);
+		return (BT_ELEM(tree, hdr, out_idx->bti_offset));
+	}
+
+	if (offset > 0) {
+		out_idx->bti_node = hdr;
+		out_idx->bti_offset = offset - 1;
+		out_idx->bti_before = B_FALSE;
+		return (BT_ELEM(tree, hdr, offset - 1));
+	}
+	return (zfs_btree_climb(tree, hdr, B_FALSE, out_idx));
+}
+
+/*
+ * Get the value at the provided index in the tree.
+ *
+ * Note that the value returned from this function can be mutated, but only
+ * if it will not change the ordering of the element with respect to any other
+ * elements that could be in the tree.
+ */
+void *
+zfs_btree_get(zfs_btree_t *tree, zfs_btree_index_t *idx)
+{
+	ASSERT(!idx->bti_before);
+	ASSERT3U(idx->bti_offset, <, idx->bti_node->bth_count);
+	return (BT_ELEM(tree, idx->bti_node, idx->bti_offset));
+}
+
+/*
+ * Remove element k of the given core node and its child k + 1.
+ */
+static void
+zfs_btree_core_remove(zfs_btree_t *tree, zfs_btree_core_t *core, uint32_t k)
+{
+	size_t size = tree->bt_elem_size;
+	uint32_t count = core->btc_hdr.bth_count;
+
+	memmove(core->btc_elems + k * size, core->btc_elems + (k + 1) * size,
+	    (count - k - 1) * size);
+	memmove(&core->btc_children[k + 1], &core->btc_children[k + 2],
+	    (count - k - 1) * sizeof (zfs_btree_hdr_t *));
+	core->btc_hdr.bth_count--;
+}
+
+static void zfs_btree_rebalance_core(zfs_btree_t *, zfs_btree_core_t *);
+
+/*
+ * Merge child k + 1 of parent into child k, along with the separator
+ * between them, then fix up the parent.
+ */
+static void
+zfs_btree_merge(zfs_btree_t *tree, zfs_btree_core_t *parent, uint32_t k)
+{
+	size_t size = tree->bt_elem_size;
+	zfs_btree_hdr_t *left = parent->btc_children[k];
+	zfs_btree_hdr_t *right = parent->btc_children[k + 1];
+	uint32_t lcount = left->bth_count;
+	uint32_t rcount = right->bth_count;
+
+	ASSERT3U(left->bth_core, ==, right->bth_core);
+	ASSERT3U(lcount + rcount + 1, <=, left->bth_core ?
+	    BTREE_CORE_ELEMS : tree->bt_leaf_cap);
+
+	bcopy(parent->btc_elems + k * size, BT_ELEM(tree, left, lcount), size);
+	bcopy(bt_elems(right), BT_ELEM(tree, left, lcount + 1), rcount * size);
+	if (left->bth_core) {
+		zfs_btree_core_t *lcore = (zfs_btree_core_t *)left;
+		zfs_btree_core_t *rcore = (zfs_btree_core_t *)right;
+		for (uint32_t i = 0; i <= rcount; i++) {
+			lcore->btc_children[lcount + 1 + i] =
+			    rcore->btc_children[i];
+			rcore->btc_children[i]->bth_parent = lcore;
+		}
+	}
+	left->bth_count = lcount + 1 + rcount;
+	zfs_btree_node_free(tree, right);
+
+	zfs_btree_core_remove(tree, parent, k);
+	zfs_btree_rebalance_core(tree, parent);
+}
+
+/*
+ * Move the last element of the left sibling of hdr (child c of its parent)
+ * through the parent into the front of hdr.
+ */
+static void
+zfs_btree_take_from_left(zfs_btree_t *tree, zfs_btree_hdr_t *hdr, uint32_t c)
+{
+	size_t size = tree->bt_elem_size;
+	zfs_btree_core_t *parent = hdr->bth_parent;
+	zfs_btree_hdr_t *left = parent->btc_children[c - 1];
+	uint32_t count = hdr->bth_count;
+
+	memmove(BT_ELEM(tree, hdr, 1), bt_elems(hdr), count * size);
+	bcopy(parent->btc_elems + (c - 1) * size, bt_elems(hdr), size);
+	bcopy(BT_ELEM(tree, left, left->bth_count - 1),
+	    parent->btc_elems + (c - 1) * size, size);
+	if (hdr->bth_core) {
+		zfs_btree_core_t *core = (zfs_btree_core_t *)hdr;
+		zfs_btree_core_t *lcore = (zfs_btree_core_t *)left;
+		memmove(&core->btc_children[1], &core->btc_children[0],
+		    (count + 1) * sizeof (zfs_btree_hdr_t *));
+		core->btc_children[0] = lcore->btc_children[left->bth_count];
+		core->btc_children[0]->bth_parent = core;
+	}
+	left->bth_count--;
+	hdr->bth_count++;
+}
+
+/*
+ * Move the first element of the right sibling of hdr (child c of its
+ * parent) through the parent onto the end of hdr.
+ */
+static void
+zfs_btree_take_from_right(zfs_btree_t *tree, zfs_btree_hdr_t *hdr,
+    uint32_t c)
+{
+	size_t size = tree->bt_elem_size;
+	zfs_btree_core_t *parent = hdr->bth_parent;
+	zfs_btree_hdr_t *right = parent->btc_children[c + 1];
+	uint32_t count = hdr->bth_count;
+	uint32_t rcount = right->bth_count;
+
+	bcopy(parent->btc_elems + c * size, BT_ELEM(tree, hdr, count), size);
+	bcopy(bt_elems(right), parent->btc_elems + c * size, size);
+	memmove(bt_elems(right), BT_ELEM(tree, right, 1), (rcount - 1) * size);
+	if (hdr->bth_core) {
+		zfs_btree_core_t *core = (zfs_btree_core_t *)hdr;
+		zfs_btree_core_t *rcore = (zfs_btree_core_t *)right;
+		core->btc_children[count + 1] = rcore->btc_children[0];
+		core->btc_children[count + 1]->bth_parent = core;
+		memmove(&rcore->btc_children[0], &rcore->btc_children[1],
+		    rcount * sizeof (zfs_btree_hdr_t *));
+	}
+	right->bth_count--;
+	hdr->bth_count++;
+}
+
+/*
+ * Restore the invariants of a non-root node that may have dropped below
+ * the minimum number of elements, by taking an element from a sibling
+ * that can spare one or by merging with a sibling.
+ */
+static void
+zfs_btree_rebalance(zfs_btree_t *tree, zfs_btree_hdr_t *hdr, uint32_t min)
+{
+	zfs_btree_core_t *parent = hdr->bth_parent;
+	uint32_t c = zfs_btree_child_idx(hdr);
+	zfs_btree_hdr_t *left = (c > 0) ? parent->btc_children[c - 1] : NULL;
+	zfs_btree_hdr_t *right = (c < parent->btc_hdr.bth_count) ?
+	    parent->btc_children[c + 1] : NULL;
+
+	ASSERT3U(hdr->bth_count, <, min);
+
+	if (left != NULL && left->bth_count > min) {
+		zfs_btree_take_from_left(tree, hdr, c);
+	} else if (right != NULL && right->bth_count > min) {
+		zfs_btree_take_from_right(tree, hdr, c);
+	} else if (left != NULL) {
+		zfs_btree_merge(tree, parent, c - 1);
+	} else {
+		ASSERT3P(right, !=, NULL);
+		zfs_btree_merge(tree, parent, c);
+	}
+}
+
+static void
+zfs_btree_rebalance_core(zfs_btree_t *tree, zfs_btree_core_t *core)
+{
+	zfs_btree_hdr_t *hdr = &core->btc_hdr;
+
+	if (hdr->bth_parent == NULL) {
+		ASSERT3P(hdr, ==, tree->bt_root);
+		if (hdr->bth_count == 0) {
+			tree->bt_root = core->btc_children[0];
+			tree->bt_root->bth_parent = NULL;
+			tree->bt_height--;
+			zfs_btree_node_free(tree, hdr);
+		}
+		return;
+	}
+	if (hdr->bth_count >= BT_CORE_MIN)
+		return;
+	zfs_btree_rebalance(tree, hdr, BT_CORE_MIN);
+}
+
+static void
+zfs_btree_rebalance_leaf(zfs_btree_t *tree, zfs_btree_leaf_t *leaf)
+{
+	zfs_btree_hdr_t *hdr = &leaf->btl_hdr;
+
+	if (hdr->bth_parent == NULL) {
+		ASSERT3P(hdr, ==, tree->bt_root);
+		if (hdr->bth_count == 0) {
+			tree->bt_root = NULL;
+			tree->bt_height = -1;
+			zfs_btree_node_free(tree, hdr);
+		}
+		return;
+	}
+	if (hdr->bth_count >= BT_LEAF_MIN(tree))
+		return;
+	zfs_btree_rebalance(tree, hdr, BT_LEAF_MIN(tree));
+}
+
+/*
+ * Remove the element at the specific location.
+ */
+void
+zfs_btree_remove_idx(zfs_btree_t *tree, zfs_btree_index_t *where)
+{
+	size_t size = tree->bt_elem_size;
+	zfs_btree_hdr_t *hdr = where->bti_node;
+	uint32_t offset = where->bti_offset;
+
+	ASSERT(!where->bti_before);
+	ASSERT3U(offset, <, hdr->bth_count);
+
+	if (hdr->bth_core) {
+		/*
+		 * Replace the element with its predecessor, the last element
+		 * of the rightmost leaf of the subtree to its left, and
+		 * remove that one from its leaf instead.
+		 */
+		zfs_btree_index_t idx;
+		zfs_btree_hdr_t *leaf = zfs_btree_last_helper(
+		    bt_child(hdr, offset), &idx);
+		bcopy(BT_ELEM(tree, leaf, idx.bti_offset),
+		    BT_ELEM(tree, hdr, offset), size);
+		hdr = leaf;
+		offset = idx.bti_offset;
+	}
+
+	memmove(BT_ELEM(tree, hdr, offset), BT_ELEM(tree, hdr, offset + 1),
+	    (hdr->bth_count - offset - 1) * size);
+	hdr->bth_count--;
+	tree->bt_num_elems--;
+
+	zfs_btree_rebalance_leaf(tree, (zfs_btree_leaf_t *)hdr);
+
+#ifdef ZFS_DEBUG
+	if (zfs_btree_verify_intensity > 0)
+		zfs_btree_verify(tree);
+#endif
+}
+
+/*
+ * Remove the given value from the tree.
+ */
+void
+zfs_btree_remove(zfs_btree_t *tree, const void *value)
+{
+	zfs_btree_index_t where = {0};
+	VERIFY3P(zfs_btree_find(tree, value, &where), !=, NULL);
+	zfs_btree_remove_idx(tree, &where);
+}
+
+/* Return the number of elements in the tree. */
+ulong_t
+zfs_btree_numnodes(zfs_btree_t *tree)
+{
+	return (tree->bt_num_elems);
+}
+
+static void
+zfs_btree_clear_helper(zfs_btree_t *tree, zfs_btree_hdr_t *hdr)
+{
+	if (hdr->bth_core) {
+		zfs_btree_core_t *core = (zfs_btree_core_t *)hdr;
+		for (uint32_t i = 0; i <= hdr->bth_count; i++)
+			zfs_btree_clear_helper(tree, core->btc_children[i]);
+	}
+	zfs_btree_node_free(tree, hdr);
+}
+
+void
+zfs_btree_clear(zfs_btree_t *tree)
+{
+	if (tree->bt_root != NULL)
+		zfs_btree_clear_helper(tree, tree->bt_root);
+	ASSERT0(tree->bt_num_nodes);
+	tree->bt_root = NULL;
+	tree->bt_height = -1;
+	tree->bt_num_elems = 0;
+}
+
+void
+zfs_btree_destroy(zfs_btree_t *tree)
+{
+	ASSERT0(tree->bt_num_elems);
+	ASSERT3P(tree->bt_root, ==, NULL);
+	tree->bt_compar = (int (*)(const void *, const void *))BTREE_POISON;
+}
+
+/* Verify that every child of this node has the correct parent pointer. */
+static void
+zfs_btree_verify_pointers_helper(zfs_btree_t *tree, zfs_btree_hdr_t *hdr)
+{
+	if (!hdr->bth_core)
+		return;
+
+	zfs_btree_core_t *node = (zfs_btree_core_t *)hdr;
+	for (uint32_t i = 0; i <= hdr->bth_count; i++) {
+		VERIFY3P(node->btc_children[i]->bth_parent, ==, node);
+		zfs_btree_verify_pointers_helper(tree, node->btc_children[i]);
+	}
+}
+
+/*
+ * Verify that the height of every leaf is the same, and return the number
+ * of elements in the subtree.
+ */
+static uint64_t
+zfs_btree_verify_counts_helper(zfs_btree_t *tree, zfs_btree_hdr_t *hdr,
+    int64_t height)
+{
+	if (!hdr->bth_core) {
+		VERIFY0(height);
+		VERIFY3U(hdr->bth_count, <=, tree->bt_leaf_cap);
+		if (hdr != tree->bt_root)
+			VERIFY3U(hdr->bth_count, >, 0);
+		return (hdr->bth_count);
+	}
+
+	zfs_btree_core_t *node = (zfs_btree_core_t *)hdr;
+	uint64_t ret = hdr->bth_count;
+	VERIFY3U(hdr->bth_count, <=, BTREE_CORE_ELEMS);
+	VERIFY3U(hdr->bth_count, >, 0);
+	for (uint32_t i = 0; i <= hdr->bth_count; i++) {
+		ret += zfs_btree_verify_counts_helper(tree,
+		    node->btc_children[i], height - 1);
+	}
+	return (ret);
+}
+
+/* Check that every element is greater than the previous one. */
+static void
+zfs_btree_verify_order(zfs_btree_t *tree)
+{
+	zfs_btree_index_t idx;
+	uint8_t *prev = NULL;
+	uint64_t n = 0;
+
+	for (uint8_t *cur = zfs_btree_first(tree, &idx); cur != NULL;
+	    cur = zfs_btree_next(tree, &idx, &idx)) {
+		if (prev != NULL)
+			VERIFY3S(tree->bt_compar(prev, cur), ==, -1);
+		prev = cur;
+		n++;
+	}
+	VERIFY3U(n, ==, tree->bt_num_elems);
+}
+
+void
+zfs_btree_verify(zfs_btree_t *tree)
+{
+	if (zfs_btree_verify_intensity == 0)
+		return;
+	if (tree->bt_root == NULL) {
+		VERIFY3S(tree->bt_height, ==, -1);
+		VERIFY0(tree->bt_num_elems);
+		VERIFY0(tree->bt_num_nodes);
+		return;
+	}
+	VERIFY3P(tree->bt_root->bth_parent, ==, NULL);
+	if (zfs_btree_verify_intensity <= 1)
+		return;
+	zfs_btree_verify_pointers_helper(tree, tree->bt_root);
+	if (zfs_btree_verify_intensity <= 2)
+		return;
+	VERIFY3U(zfs_btree_verify_counts_helper(tree, tree->bt_root,
+	    tree->bt_height), ==, tree->bt_num_elems);
+	if (zfs_btree_verify_intensity <= 3)
+		return;
+	zfs_btree_verify_order(tree);
+}
@@ -1534,13 +1534,19 @@ dbuf_unoverride(dbuf_dirty_record_t *dr)
 
 	ASSERT(db->db_data_pending != dr);
 
-	/* free this block */
+	/*
+	 * Free this block.  A cloned block took a BRT reference in this
+	 * txg, which is applied before the txg's frees, so freeing it here
+	 * simply drops that reference again.
+	 */
 	if (!BP_IS_HOLE(bp) && !dr->dt.dl.dr_nopwrite)
 		zio_free(db->db_objset->os_spa, txg, bp);
 
 	dr->dt.dl.dr_override_state = DR_NOT_OVERRIDDEN;
 	dr->dt.dl.dr_nopwrite = B_FALSE;
 	dr->dt.dl.dr_has_raw_params = B_FALSE;
+	dr->dt.dl.dr_diowrite = B_FALSE;
+	dr->dt.dl.dr_brtwrite = B_FALSE;
 
 	/*
 	 * Release the already-written buffer, so we leave it in
@@ -1548,9 +1554,10 @@ dbuf_unoverride(dbuf_dirty_record_t *dr)
 	 * modifying the buffer, so they will immediately do
 	 * another (redundant) arc_release().  Therefore, leave
 	 * the buf thawed to save the effort of freezing &
-	 * immediately re-thawing it.
+	 * immediately re-thawing it.  Cloned blocks have no buffer.
 	 */
-	arc_release(dr->dt.dl.dr_data, db);
+	if (dr->dt.dl.dr_data != NULL)
+		arc_release(dr->dt.dl.dr_data, db);
 }
 
 /*
@@ -2127,6 +2134,9 @@ dbuf_undirty(dmu_buf_impl_t *db, dmu_tx_t *tx)
 		ASSERT(dr->dt.dl.dr_data != NULL);
 		if (dr->dt.dl.dr_data != db->db_buf)
 			arc_buf_destroy(dr->dt.dl.dr_data, db);
+	} else if (dr->dt.dl.dr_brtwrite) {
+		/* Drop the reference taken by dmu_brt_clone(). */
+		dbuf_unoverride(dr);
 	}
 
 	kmem_free(dr, sizeof (dbuf_dirty_record_t));
@@ -2201,6 +2211,45 @@ dmu_buf_will_not_fill(dmu_buf_t *db_fake, dmu_tx_t *tx)
 	dmu_buf_will_fill(db_fake, tx);
 }
 
+/*
+ * Prepare a level-0 dbuf to take a block pointer cloned by dmu_brt_clone()
+ * in this txg.  Anything written to the block so far in this txg is
+ * undone, and the dbuf is left dirty and without data (DB_NOFILL) until
+ * the txg has synced.
+ */
+void
+dmu_buf_will_clone(dmu_buf_t *db_fake, dmu_tx_t *tx)
+{
+	dmu_buf_impl_t *db = (dmu_buf_impl_t *)db_fake;
+
+	ASSERT(db->db_blkid != DMU_BONUS_BLKID);
+	ASSERT(tx->tx_txg != 0);
+	ASSERT0(db->db_level);
+	ASSERT(!zfs_refcount_is_zero(&db->db_holds));
+
+	mutex_enter(&db->db_mtx);
+	while (db->db_state == DB_READ || db->db_state == DB_FILL)
+		cv_wait(&db->db_changed, &db->db_mtx);
+	DBUF_VERIFY(db);
+
+	VERIFY(!dbuf_undirty(db, tx));
+	/* dmu_brt_clone() refuses blocks that are still being synced. */
+	ASSERT3P(db->db_last_dirty, ==, NULL);
+
+	if (db->db_buf != NULL) {
+		arc_buf_destroy(db->db_buf, db);
+		db->db_buf = NULL;
+		dbuf_clear_data(db);
+	}
+	db->db_state = DB_NOFILL;
+
+	DBUF_VERIFY(db);
+	mutex_exit(&db->db_mtx);
+
+	dbuf_noread(db);
+	(void) dbuf_dirty(db, tx);
+}
+
 void
 dmu_buf_will_fill(dmu_buf_t *db_fake, dmu_tx_t *tx)
 {
@@ -2589,6 +2638,31 @@ dbuf_findbp(dnode_t *dn, int level, uint64_t blkid, int fail_sparse,
 	}
 }
 
+/*
+ * Copy out the block pointer for the given block without instantiating a
+ * dbuf for it.  Used by direct I/O reads, which go to disk without
+ * caching the block.  The caller must hold dn_struct_rwlock.
+ */
+int
+dbuf_dnode_findbp(dnode_t *dn, uint64_t level, uint64_t blkid,
+    blkptr_t *bp)
+{
+	dmu_buf_impl_t *dbp = NULL;
+	blkptr_t *bp2;
+	int err;
+
+	ASSERT(RW_LOCK_HELD(&dn->dn_struct_rwlock));
+
+	err = dbuf_findbp(dn, level, blkid, B_FALSE, &dbp, &bp2, NULL);
+	if (err == 0) {
+		*bp = *bp2;
+		if (dbp != NULL)
+			dbuf_rele(dbp, NULL);
+	}
+
+	return (err);
+}
+
 static dmu_buf_impl_t *
 dbuf_create(dnode_t *dn, uint8_t level, uint64_t blkid,
     dmu_buf_impl_t *parent, blkptr_t *blkptr)
@@ -4126,7 +4200,8 @@ dbuf_write_override_done(zio_t *zio)
 	if (!BP_EQUAL(zio->io_bp, obp)) {
 		if (!BP_IS_HOLE(obp))
 			dsl_free(spa_get_dsl(zio->io_spa), zio->io_txg, obp);
-		arc_release(dr->dt.dl.dr_data, db);
+		if (dr->dt.dl.dr_data != NULL)
+			arc_release(dr->dt.dl.dr_data, db);
 	}
 	mutex_exit(&db->db_mtx);
 	dbuf_write_done(zio, NULL, db);
@@ -4174,6 +4249,29 @@ dbuf_remap_impl(dnode_t *dn, blkptr_t *bp, dmu_tx_t *tx)
 	drica.drica_tx = tx;
 	if (spa_remap_blkptr(spa, &bp_copy, dbuf_remap_impl_callback,
 	    &drica)) {
+		/*
+		 * If the blkptr being remapped is tracked by a livelist,
+		 * then we need to make sure the livelist reflects the update.
+		 * First, cancel out the old blkptr by appending a 'FREE'
+		 * entry. Next, add an 'ALLOC' to track the new version. This
+		 * way we avoid trying to free an inaccurate blkptr at delete.
+		 * Note that embedded blkptrs are not tracked in livelists.
+		 */
+		if (dn->dn_objset != spa_meta_objset(spa)) {
+			dsl_dataset_t *ds = dmu_objset_ds(dn->dn_objset);
+			if (dsl_deadlist_is_open(&ds->ds_dir->dd_livelist) &&
+			    bp->blk_birth > ds->ds_dir->dd_origin_txg) {
+				ASSERT(!BP_IS_EMBEDDED(bp));
+				ASSERT(dsl_dir_is_clone(ds->ds_dir));
+				ASSERT(spa_feature_is_enabled(spa,
+				    SPA_FEATURE_LIVELIST));
+				bplist_append(&ds->ds_dir->dd_pending_frees,
+				    bp);
+				bplist_append(&ds->ds_dir->dd_pending_allocs,
+				    &bp_copy);
+			}
+		}
+
 		/*
 		 * The struct_rwlock prevents dbuf_read_impl() from
 		 * dereferencing the BP while we are changing it.  To
@@ -33,10 +33,12 @@
 #include <sys/dmu_tx.h>
 #include <sys/arc.h>
 #include <sys/dsl_pool.h>
+#include <sys/dsl_synctask.h>
 #include <sys/zio_checksum.h>
 #include <sys/zio_compress.h>
 #include <sys/dsl_scan.h>
 #include <sys/abd.h>
+#include <sys/zfeature.h>
 
 static kmem_cache_t *ddt_cache;
 static kmem_cache_t *ddt_entry_cache;
@@ -46,6 +48,24 @@ static kmem_cache_t *ddt_entry_cache;
  */
 int zfs_dedup_prefetch = 0;
 
+/*
+ * Number of entries of a unique DDT object that ddt_prune_unique_entries()
+ * looks at in one txg.
+ */
+uint64_t zfs_dedup_prune_batch = 4096;
+
+/*
+ * Largest number of dedup writes whose DDT entries are prefetched and
+ * looked up together, or 0 to look entries up in each write's own thread.
+ */
+uint64_t zfs_dedup_lookup_batch = 256;
+
+/*
+ * The DDT keeps the time of a txg once a day, so that unique entries can be
+ * pruned by age even though entries only record the txg they were born in.
+ */
+#define	DDT_TXG_TIME_INTERVAL	(24 * 60 * 60)
+
 static const ddt_ops_t *ddt_ops[DDT_TYPES] = {
 	&ddt_zap_ops,
 };
@@ -56,7 +76,7 @@ static const char *ddt_class_name[DDT_CLASSES] = {
 	"unique",
 };
 
-static void
+void
 ddt_object_create(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
     dmu_tx_t *tx)
 {
@@ -192,7 +212,7 @@ ddt_object_update(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
 	    ddt->ddt_object[type][class], dde, tx));
 }
 
-static int
+int
 ddt_object_remove(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
     ddt_entry_t *dde, dmu_tx_t *tx)
 {
@@ -552,6 +572,34 @@ ddt_get_pool_dedup_ratio(spa_t *spa)
 	return (dds_total.dds_ref_dsize * 100 / dds_total.dds_dsize);
 }
 
+/*
+ * Space used on disk by the DDT objects, as of the last txg synced.
+ */
+uint64_t
+ddt_get_ddt_dsize(spa_t *spa)
+{
+	ddt_object_t ddo_total = { 0 };
+
+	ddt_get_dedup_object_stats(spa, &ddo_total);
+
+	/* ddt_get_dedup_object_stats() returns the average per entry. */
+	spa->spa_dedup_dsize = ddo_total.ddo_dspace * ddo_total.ddo_count;
+
+	return (spa->spa_dedup_dsize);
+}
+
+/*
+ * Returns B_TRUE once the DDT has grown to its dedup_table_quota.  No new
+ * entries are created then; blocks that would have needed one are written
+ * as ordinary blocks instead.
+ */
+boolean_t
+ddt_over_quota(spa_t *spa)
+{
+	return (spa->spa_dedup_table_quota != 0 &&
+	    spa->spa_dedup_dsize >= spa->spa_dedup_table_quota);
+}
+
 size_t
 ddt_compress(void *src, uchar_t *dst, size_t s_len, size_t d_len)
 {
@@ -625,11 +673,13 @@ ddt_init(void)
 	    sizeof (ddt_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
 	ddt_entry_cache = kmem_cache_create("ddt_entry_cache",
 	    sizeof (ddt_entry_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+	ddt_log_init();
 }
 
 void
 ddt_fini(void)
 {
+	ddt_log_fini();
 	kmem_cache_destroy(ddt_entry_cache);
 	kmem_cache_destroy(ddt_cache);
 }
@@ -674,8 +724,8 @@ ddt_remove(ddt_t *ddt, ddt_entry_t *dde)
 	ddt_free(dde);
 }
 
-ddt_entry_t *
-ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
+static ddt_entry_t *
+ddt_lookup_key(ddt_t *ddt, const ddt_key_t *ddk, boolean_t add)
 {
 	ddt_entry_t *dde, dde_search;
 	enum ddt_type type;
@@ -685,7 +735,7 @@ ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 
 	ASSERT(MUTEX_HELD(&ddt->ddt_lock));
 
-	ddt_key_fill(&dde_search.dde_key, bp);
+	dde_search.dde_key = *ddk;
 
 	dde = avl_find(&ddt->ddt_tree, &dde_search, &where);
 	if (dde == NULL) {
@@ -701,6 +751,17 @@ ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 	if (dde->dde_loaded)
 		return (dde);
 
+	/*
+	 * Changes that are still in the DDT log are newer than the DDT
+	 * objects.
+	 */
+	if (ddt_log_lookup(ddt, dde)) {
+		dde->dde_loaded = B_TRUE;
+		if (dde->dde_type != DDT_TYPES)
+			ddt_stat_update(ddt, dde, -1ULL);
+		return (dde);
+	}
+
 	dde->dde_loading = B_TRUE;
 
 	ddt_exit(ddt);
@@ -726,6 +787,8 @@ ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 
 	dde->dde_type = type;	/* will be DDT_TYPES if no entry found */
 	dde->dde_class = class;	/* will be DDT_CLASSES if no entry found */
+	dde->dde_obj_type = type;
+	dde->dde_obj_class = class;
 	dde->dde_loaded = B_TRUE;
 	dde->dde_loading = B_FALSE;
 
@@ -737,6 +800,184 @@ ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 	return (dde);
 }
 
+ddt_entry_t *
+ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
+{
+	ddt_key_t ddk;
+
+	ddt_key_fill(&ddk, bp);
+
+	return (ddt_lookup_key(ddt, &ddk, add));
+}
+
+/*
+ * A dedup write whose entry has to be read from the DDT objects.
+ */
+typedef struct ddt_lookup_req {
+	list_node_t	dlr_node;
+	ddt_key_t	dlr_key;
+	zio_t		*dlr_zio;
+} ddt_lookup_req_t;
+
+static void
+ddt_prefetch_key(ddt_t *ddt, const ddt_key_t *ddk)
+{
+	ddt_entry_t dde;
+	enum ddt_type type;
+	enum ddt_class class;
+
+	dde.dde_key = *ddk;
+
+	for (type = 0; type < DDT_TYPES; type++) {
+		for (class = 0; class < DDT_CLASSES; class++) {
+			ddt_object_prefetch(ddt, type, class, &dde);
+		}
+	}
+}
+
+static boolean_t
+ddt_objects_exist(ddt_t *ddt)
+{
+	enum ddt_type type;
+	enum ddt_class class;
+
+	for (type = 0; type < DDT_TYPES; type++) {
+		for (class = 0; class < DDT_CLASSES; class++) {
+			if (ddt_object_exists(ddt, type, class))
+				return (B_TRUE);
+		}
+	}
+
+	return (B_FALSE);
+}
+
+/*
+ * Send the writes of a resolved batch back to the issue taskqs, where
+ * zio_ddt_write() now finds their entries loaded.
+ */
+static void
+ddt_lookup_resume(list_t *done)
+{
+	ddt_lookup_req_t *dlr;
+
+	while ((dlr = list_remove_head(done)) != NULL) {
+		zio_t *zio = dlr->dlr_zio;
+
+		spa_taskq_dispatch_ent(zio->io_spa, ZIO_TYPE_WRITE,
+		    ZIO_TASKQ_ISSUE, (task_func_t *)zio_execute, zio, 0,
+		    &zio->io_tqent);
+		kmem_free(dlr, sizeof (ddt_lookup_req_t));
+	}
+}
+
+/*
+ * Resolve the queued lookups of a DDT, up to zfs_dedup_lookup_batch at a
+ * time.  The reads of every entry in a batch are started before any of
+ * them is waited for, so the batch costs about one round trip to disk.
+ *
+ * A batch is resumed only once the next one has been taken off the queue
+ * or the queue found empty: the DDT may go away as soon as the last of
+ * its writes is done, so it must not be touched after that.
+ */
+static void
+ddt_lookup_batch_task(void *arg)
+{
+	ddt_t *ddt = arg;
+	ddt_lookup_req_t *dlr;
+	list_t batch, done;
+	uint64_t n;
+
+	list_create(&batch, sizeof (ddt_lookup_req_t),
+	    offsetof(ddt_lookup_req_t, dlr_node));
+	list_create(&done, sizeof (ddt_lookup_req_t),
+	    offsetof(ddt_lookup_req_t, dlr_node));
+
+	mutex_enter(&ddt->ddt_lookup_lock);
+	for (;;) {
+		for (n = 0; n < MAX(zfs_dedup_lookup_batch, 1) &&
+		    (dlr = list_remove_head(&ddt->ddt_lookup_list)) != NULL;
+		    n++)
+			list_insert_tail(&batch, dlr);
+		if (list_is_empty(&batch)) {
+			ddt->ddt_lookup_dispatched = B_FALSE;
+			break;
+		}
+		mutex_exit(&ddt->ddt_lookup_lock);
+
+		ddt_lookup_resume(&done);
+
+		for (dlr = list_head(&batch); dlr != NULL;
+		    dlr = list_next(&batch, dlr))
+			ddt_prefetch_key(ddt, &dlr->dlr_key);
+
+		for (dlr = list_head(&batch); dlr != NULL;
+		    dlr = list_next(&batch, dlr)) {
+			ddt_enter(ddt);
+			(void) ddt_lookup_key(ddt, &dlr->dlr_key, B_TRUE);
+			ddt_exit(ddt);
+		}
+		list_move_tail(&done, &batch);
+
+		mutex_enter(&ddt->ddt_lookup_lock);
+	}
+	mutex_exit(&ddt->ddt_lookup_lock);
+
+	ddt_lookup_resume(&done);
+
+	list_destroy(&batch);
+	list_destroy(&done);
+}
+
+/*
+ * Called by zio_ddt_write() before it looks up the entry of its block.  If
+ * the entry is neither in core nor in the DDT log, it has to be read from
+ * the DDT objects: rather than have the write's thread wait for that, queue
+ * the write for a batch lookup and return B_TRUE.  The write's pipeline is
+ * rewound to repeat the current stage before it is queued, since the batch
+ * task may re-execute it before this returns; the caller must not touch
+ * the zio again and just returns NULL.
+ */
+boolean_t
+ddt_lookup_async(ddt_t *ddt, zio_t *zio)
+{
+	ddt_entry_t *dde, dde_search;
+	ddt_lookup_req_t *dlr;
+	boolean_t dispatch;
+
+	if (zfs_dedup_lookup_batch == 0 || zio->io_bp_override != NULL)
+		return (B_FALSE);
+
+	ddt_key_fill(&dde_search.dde_key, zio->io_bp);
+
+	ddt_enter(ddt);
+	dde = avl_find(&ddt->ddt_tree, &dde_search, NULL);
+	if (dde != NULL || ddt_log_lookup(ddt, &dde_search) ||
+	    !ddt_objects_exist(ddt)) {
+		ddt_exit(ddt);
+		return (B_FALSE);
+	}
+	ddt_exit(ddt);
+
+	dlr = kmem_alloc(sizeof (ddt_lookup_req_t), KM_SLEEP);
+	dlr->dlr_key = dde_search.dde_key;
+	dlr->dlr_zio = zio;
+
+	mutex_enter(&ddt->ddt_lookup_lock);
+	zio->io_stage >>= 1;
+	list_insert_tail(&ddt->ddt_lookup_list, dlr);
+	dispatch = !ddt->ddt_lookup_dispatched;
+	ddt->ddt_lookup_dispatched = B_TRUE;
+	mutex_exit(&ddt->ddt_lookup_lock);
+
+	if (dispatch) {
+		spa_taskq_dispatch_ent(ddt->ddt_spa, ZIO_TYPE_WRITE,
+		    ZIO_TASKQ_ISSUE, ddt_lookup_batch_task, ddt, 0,
+		    &ddt->ddt_lookup_tqent);
+	}
+
+	return (B_TRUE);
+}
+
 void
 ddt_prefetch(spa_t *spa, const blkptr_t *bp)
 {
@@ -764,12 +1005,10 @@ ddt_prefetch(spa_t *spa, const blkptr_t *bp)
 }
 
 int
-ddt_entry_compare(const void *x1, const void *x2)
+ddt_key_compare(const ddt_key_t *k1, const ddt_key_t *k2)
 {
-	const ddt_entry_t *dde1 = x1;
-	const ddt_entry_t *dde2 = x2;
-	const uint64_t *u1 = (const uint64_t *)&dde1->dde_key;
-	const uint64_t *u2 = (const uint64_t *)&dde2->dde_key;
+	const uint64_t *u1 = (const uint64_t *)k1;
+	const uint64_t *u2 = (const uint64_t *)k2;
 	int i;
 
 	for (i = 0; i < DDT_KEY_WORDS; i++) {
@@ -782,6 +1021,15 @@ ddt_entry_compare(const void *x1, const void *x2)
 	return (0);
 }
 
+int
+ddt_entry_compare(const void *x1, const void *x2)
+{
+	const ddt_entry_t *dde1 = x1;
+	const ddt_entry_t *dde2 = x2;
+
+	return (ddt_key_compare(&dde1->dde_key, &dde2->dde_key));
+}
+
 static ddt_t *
 ddt_table_alloc(spa_t *spa, enum zio_checksum c)
 {
@@ -798,6 +1046,12 @@ ddt_table_alloc(spa_t *spa, enum zio_checksum c)
 	ddt->ddt_checksum = c;
 	ddt->ddt_spa = spa;
 	ddt->ddt_os = spa->spa_meta_objset;
+	ddt_log_alloc(ddt);
+
+	mutex_init(&ddt->ddt_lookup_lock, NULL, MUTEX_DEFAULT, NULL);
+	list_create(&ddt->ddt_lookup_list, sizeof (ddt_lookup_req_t),
+	    offsetof(ddt_lookup_req_t, dlr_node));
+	taskq_init_ent(&ddt->ddt_lookup_tqent);
 
 	return (ddt);
 }
@@ -807,6 +1061,11 @@ ddt_table_free(ddt_t *ddt)
 {
 	ASSERT(avl_numnodes(&ddt->ddt_tree) == 0);
 	ASSERT(avl_numnodes(&ddt->ddt_repair_tree) == 0);
+	ASSERT(list_is_empty(&ddt->ddt_lookup_list));
+	ASSERT(!ddt->ddt_lookup_dispatched);
+	ddt_log_free(ddt);
+	list_destroy(&ddt->ddt_lookup_list);
+	mutex_destroy(&ddt->ddt_lookup_lock);
 	avl_destroy(&ddt->ddt_tree);
 	avl_destroy(&ddt->ddt_repair_tree);
 	mutex_destroy(&ddt->ddt_lock);
@@ -824,10 +1083,44 @@ ddt_create(spa_t *spa)
 		spa->spa_ddt[c] = ddt_table_alloc(spa, c);
 }
 
+/*
+ * Find the DDT's txg time samples, and the time of the last one.
+ */
+static int
+ddt_txg_time_load(spa_t *spa)
+{
+	objset_t *mos = spa->spa_meta_objset;
+	zap_cursor_t zc;
+	zap_attribute_t za;
+	uint64_t sample[2];
+	int error;
+
+	error = zap_lookup(mos, DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_DDT_TXG_TIME, sizeof (uint64_t), 1,
+	    &spa->spa_ddt_txg_time_object);
+	if (error != 0)
+		return (error == ENOENT ? 0 : error);
+
+	for (zap_cursor_init(&zc, mos, spa->spa_ddt_txg_time_object);
+	    (error = zap_cursor_retrieve(&zc, &za)) == 0;
+	    zap_cursor_advance(&zc)) {
+		error = zap_lookup(mos, spa->spa_ddt_txg_time_object,
+		    za.za_name, sizeof (uint64_t), 2, sample);
+		if (error != 0)
+			break;
+		spa->spa_ddt_txg_time_last = MAX(spa->spa_ddt_txg_time_last,
+		    sample[1]);
+	}
+	zap_cursor_fini(&zc);
+
+	return (error == ENOENT ? 0 : error);
+}
+
 int
 ddt_load(spa_t *spa)
 {
 	enum zio_checksum c;
+	dsl_scan_t *scn = spa->spa_dsl_pool->dp_scan;
 	enum ddt_type type;
 	enum ddt_class class;
 	int error;
@@ -852,6 +1145,10 @@ ddt_load(spa_t *spa)
 			}
 		}
 
+		error = ddt_log_load(ddt);
+		if (error != 0)
+			return (error);
+
 		/*
 		 * Seed the cached histograms.
 		 */
@@ -859,7 +1156,18 @@ ddt_load(spa_t *spa)
 		    sizeof (ddt->ddt_histogram));
 	}
 
-	return (0);
+	/*
+	 * A scan that was interrupted in its DDT phase must not walk on
+	 * before the changes logged so far have reached the DDT objects.
+	 */
+	if (scn != NULL && scn->scn_phys.scn_state == DSS_SCANNING &&
+	    scn->scn_phys.scn_ddt_bookmark.ddb_class <=
+	    scn->scn_phys.scn_ddt_class_max)
+		ddt_walk_init(spa, spa->spa_uberblock.ub_txg);
+
+	(void) ddt_get_ddt_dsize(spa);
+
+	return (ddt_txg_time_load(spa));
 }
 
 void
@@ -873,6 +1181,10 @@ ddt_unload(spa_t *spa)
 			spa->spa_ddt[c] = NULL;
 		}
 	}
+
+	spa->spa_dedup_dsize = 0;
+	spa->spa_ddt_txg_time_object = 0;
+	spa->spa_ddt_txg_time_last = 0;
 }
 
 boolean_t
@@ -894,6 +1206,22 @@ ddt_class_contains(spa_t *spa, enum ddt_class max_class, const blkptr_t *bp)
 
 	ddt_key_fill(&(dde->dde_key), bp);
 
+	/*
+	 * A logged entry has only been walked by the scan if the DDT
+	 * object it is in matches its logged class.
+	 */
+	ddt_enter(ddt);
+	if (ddt_log_lookup(ddt, dde)) {
+		boolean_t contains = dde->dde_type != DDT_TYPES &&
+		    dde->dde_class <= max_class &&
+		    dde->dde_obj_type == dde->dde_type &&
+		    dde->dde_obj_class == dde->dde_class;
+		ddt_exit(ddt);
+		kmem_cache_free(ddt_entry_cache, dde);
+		return (contains);
+	}
+	ddt_exit(ddt);
+
 	for (type = 0; type < DDT_TYPES; type++) {
 		for (class = 0; class <= max_class; class++) {
 			if (ddt_object_lookup(ddt, type, class, dde) == 0) {
@@ -919,6 +1247,16 @@ ddt_repair_start(ddt_t *ddt, const blkptr_t *bp)
 
 	dde = ddt_alloc(&ddk);
 
+	ddt_enter(ddt);
+	if (ddt_log_lookup(ddt, dde)) {
+		ddt_exit(ddt);
+		if (dde->dde_type == DDT_TYPES ||
+		    dde->dde_class == DDT_CLASS_UNIQUE)
+			bzero(dde->dde_phys, sizeof (dde->dde_phys));
+		return (dde);
+	}
+	ddt_exit(ddt);
+
 	for (type = 0; type < DDT_TYPES; type++) {
 		for (class = 0; class < DDT_CLASSES; class++) {
 			/*
@@ -1014,6 +1352,29 @@ ddt_repair_table(ddt_t *ddt, zio_t *rio)
 	ddt_exit(ddt);
 }
 
+/*
+ * Returns B_TRUE if the entry is unique, with a single copy of its block
+ * born before 'txg', and so may be pruned.
+ */
+static boolean_t
+ddt_entry_prunable(const ddt_entry_t *dde, uint64_t txg)
+{
+	int p, n = 0;
+
+	for (p = 0; p < DDT_PHYS_TYPES; p++) {
+		const ddt_phys_t *ddp = &dde->dde_phys[p];
+
+		if (ddp->ddp_phys_birth == 0)
+			continue;
+		if (p == DDT_PHYS_DITTO || ddp->ddp_refcnt != 1 ||
+		    ddp->ddp_phys_birth >= txg)
+			return (B_FALSE);
+		n++;
+	}
+
+	return (n == 1);
+}
+
 static void
 ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 {
@@ -1025,11 +1386,21 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 	enum ddt_class oclass = dde->dde_class;
 	enum ddt_class nclass;
 	uint64_t total_refcnt = 0;
+	boolean_t logged;
 	int p;
 
 	ASSERT(dde->dde_loaded);
 	ASSERT(!dde->dde_loading);
 
+	/*
+	 * A pruned entry is dropped without freeing its block, which is left
+	 * to the one block pointer that references it.  The entry may have
+	 * been referenced again since it was picked, in which case it stays.
+	 */
+	if (dde->dde_prune_txg != 0 &&
+	    ddt_entry_prunable(dde, dde->dde_prune_txg))
+		bzero(dde->dde_phys, sizeof (dde->dde_phys));
+
 	for (p = 0; p < DDT_PHYS_TYPES; p++, ddp++) {
 		ASSERT(dde->dde_lead_zio[p] == NULL);
 		if (ddp->ddp_phys_birth == 0) {
@@ -1056,7 +1427,14 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 	else
 		nclass = DDT_CLASS_UNIQUE;
 
-	if (otype != DDT_TYPES &&
+	/*
+	 * With a DDT log, the new state of the entry is only logged here and
+	 * reaches the DDT objects when the log is flushed.  The object for
+	 * its class is still created now, so that its histogram is saved.
+	 */
+	logged = spa_feature_is_enabled(ddt->ddt_spa, SPA_FEATURE_DDT_LOG);
+
+	if (!logged && otype != DDT_TYPES &&
 	    (otype != ntype || oclass != nclass || total_refcnt == 0)) {
 		VERIFY(ddt_object_remove(ddt, otype, oclass, dde, tx) == 0);
 		ASSERT(ddt_object_lookup(ddt, otype, oclass, dde) == ENOENT);
@@ -1068,7 +1446,10 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 		ddt_stat_update(ddt, dde, 0);
 		if (!ddt_object_exists(ddt, ntype, nclass))
 			ddt_object_create(ddt, ntype, nclass, tx);
-		VERIFY(ddt_object_update(ddt, ntype, nclass, dde, tx) == 0);
+		if (!logged) {
+			VERIFY(ddt_object_update(ddt, ntype, nclass, dde,
+			    tx) == 0);
+		}
 
 		/*
 		 * If the class changes, the order that we scan this bp
@@ -1081,7 +1462,13 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 			dsl_scan_ddt_entry(dp->dp_scan,
 			    ddt->ddt_checksum, dde, tx);
 		}
+	} else {
+		dde->dde_type = DDT_TYPES;
+		dde->dde_class = DDT_CLASSES;
 	}
+
+	if (logged)
+		ddt_log_entry(ddt, dde, tx);
 }
 
 static void
@@ -1092,22 +1479,34 @@ ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 	void *cookie = NULL;
 	enum ddt_type type;
 	enum ddt_class class;
+	boolean_t dirty = B_FALSE;
 
-	if (avl_numnodes(&ddt->ddt_tree) == 0)
-		return;
+	if (avl_numnodes(&ddt->ddt_tree) != 0) {
+		ASSERT(spa->spa_uberblock.ub_version >= SPA_VERSION_DEDUP);
 
-	ASSERT(spa->spa_uberblock.ub_version >= SPA_VERSION_DEDUP);
+		if (spa->spa_ddt_stat_object == 0) {
+			spa->spa_ddt_stat_object = zap_create_link(ddt->ddt_os,
+			    DMU_OT_DDT_STATS, DMU_POOL_DIRECTORY_OBJECT,
+			    DMU_POOL_DDT_STATS, tx);
+		}
 
-	if (spa->spa_ddt_stat_object == 0) {
-		spa->spa_ddt_stat_object = zap_create_link(ddt->ddt_os,
-		    DMU_OT_DDT_STATS, DMU_POOL_DIRECTORY_OBJECT,
-		    DMU_POOL_DDT_STATS, tx);
+		while ((dde = avl_destroy_nodes(&ddt->ddt_tree, &cookie)) !=
+		    NULL) {
+			ddt_sync_entry(ddt, dde, tx, txg);
+			ddt_free(dde);
+		}
+		dirty = B_TRUE;
 	}
 
-	while ((dde = avl_destroy_nodes(&ddt->ddt_tree, &cookie)) != NULL) {
-		ddt_sync_entry(ddt, dde, tx, txg);
-		ddt_free(dde);
-	}
+	/*
+	 * Write out the entries just logged, and move a batch of older
+	 * ones into the DDT objects.
+	 */
+	if (ddt_log_sync(ddt, tx))
+		dirty = B_TRUE;
+
+	if (!dirty)
+		return;
 
 	for (type = 0; type < DDT_TYPES; type++) {
 		uint64_t count = 0;
@@ -1118,7 +1517,8 @@ ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 			}
 		}
 		for (class = 0; class < DDT_CLASSES; class++) {
-			if (count == 0 && ddt_object_exists(ddt, type, class))
+			if (count == 0 && ddt_log_empty(ddt) &&
+			    ddt_object_exists(ddt, type, class))
 				ddt_object_destroy(ddt, type, class, tx);
 		}
 	}
@@ -1127,6 +1527,36 @@ ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 	    sizeof (ddt->ddt_histogram));
 }
 
+/*
+ * Once a day, note the time of the txg being synced, for
+ * ddt_prune_unique_entries() to map ages to txgs.
+ */
+static void
+ddt_txg_time_sync(spa_t *spa, dmu_tx_t *tx)
+{
+	objset_t *mos = spa->spa_meta_objset;
+	uint64_t sample[2];
+	char name[32];
+
+	sample[0] = tx->tx_txg;
+	sample[1] = gethrestime_sec();
+
+	if (spa->spa_ddt_stat_object == 0 || spa_sync_pass(spa) != 1 ||
+	    sample[1] < spa->spa_ddt_txg_time_last + DDT_TXG_TIME_INTERVAL)
+		return;
+
+	if (spa->spa_ddt_txg_time_object == 0) {
+		spa->spa_ddt_txg_time_object = zap_create_link(mos,
+		    DMU_OTN_ZAP_METADATA, DMU_POOL_DIRECTORY_OBJECT,
+		    DMU_POOL_DDT_TXG_TIME, tx);
+	}
+
+	(void) snprintf(name, sizeof (name), "%llx", (u_longlong_t)sample[0]);
+	VERIFY0(zap_add(mos, spa->spa_ddt_txg_time_object, name,
+	    sizeof (uint64_t), 2, sample, tx));
+	spa->spa_ddt_txg_time_last = sample[1];
+}
+
 void
 ddt_sync(spa_t *spa, uint64_t txg)
 {
@@ -1161,9 +1591,62 @@ ddt_sync(spa_t *spa, uint64_t txg)
 	(void) zio_wait(rio);
 	scn->scn_zio_root = NULL;
 
+	(void) ddt_get_ddt_dsize(spa);
+	ddt_txg_time_sync(spa, tx);
+
 	dmu_tx_commit(tx);
 }
 
+/*
+ * Check an entry just walked in the DDT object of the given type and
+ * class against the DDT log.  Returns B_FALSE if the entry has since been
+ * logged with another class, or removed, and is to be skipped; otherwise
+ * the entry is amended with its logged state, if any.
+ */
+static boolean_t
+ddt_walk_current(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
+    ddt_entry_t *dde)
+{
+	boolean_t current = B_TRUE;
+
+	ddt_enter(ddt);
+	if (ddt_log_lookup(ddt, dde))
+		current = (dde->dde_type == type && dde->dde_class == class);
+	ddt_exit(ddt);
+
+	return (current);
+}
+
+/*
+ * Have everything logged up to and including 'txg' flushed to the DDT
+ * objects, so that ddt_walk() sees it.
+ */
+void
+ddt_walk_init(spa_t *spa, uint64_t txg)
+{
+	for (enum zio_checksum c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
+		if (ddt == NULL || ddt_log_empty(ddt))
+			continue;
+		ddt->ddt_flush_force_txg = MAX(ddt->ddt_flush_force_txg, txg);
+	}
+}
+
+/*
+ * Returns B_TRUE once the flushes asked for by ddt_walk_init() are done.
+ */
+boolean_t
+ddt_walk_ready(spa_t *spa)
+{
+	for (enum zio_checksum c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
+		if (ddt != NULL && ddt->ddt_flush_force_txg != 0)
+			return (B_FALSE);
+	}
+
+	return (B_TRUE);
+}
+
 int
 ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde)
 {
@@ -1174,9 +1657,15 @@ ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde)
 				int error = ENOENT;
 				if (ddt_object_exists(ddt, ddb->ddb_type,
 				    ddb->ddb_class)) {
-					error = ddt_object_walk(ddt,
+					do {
+						error = ddt_object_walk(ddt,
+						    ddb->ddb_type,
+						    ddb->ddb_class,
+						    &ddb->ddb_cursor, dde);
+					} while (error == 0 &&
+					    !ddt_walk_current(ddt,
 					    ddb->ddb_type, ddb->ddb_class,
-					    &ddb->ddb_cursor, dde);
+					    dde));
 				}
 				dde->dde_type = ddb->ddb_type;
 				dde->dde_class = ddb->ddb_class;
@@ -1193,3 +1682,259 @@ ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde)
 
 	return (SET_ERROR(ENOENT));
 }
+
+typedef struct ddt_prune_arg {
+	ddt_t		*dpa_ddt;
+	enum ddt_type	dpa_type;
+	uint64_t	dpa_cursor;	/* walk of the unique object */
+	uint64_t	dpa_txg;	/* prune entries born before this txg */
+	avl_tree_t	*dpa_births;	/* if set, only count them in here */
+	boolean_t	dpa_done;
+} ddt_prune_arg_t;
+
+/*
+ * Number of prunable unique entries born in one txg.
+ */
+typedef struct ddt_prune_birth {
+	avl_node_t	dpb_node;
+	uint64_t	dpb_txg;
+	uint64_t	dpb_count;
+} ddt_prune_birth_t;
+
+static int
+ddt_prune_birth_compare(const void *x1, const void *x2)
+{
+	const ddt_prune_birth_t *dpb1 = x1;
+	const ddt_prune_birth_t *dpb2 = x2;
+
+	return (AVL_CMP(dpb1->dpb_txg, dpb2->dpb_txg));
+}
+
+static void
+ddt_prune_count(avl_tree_t *births, const ddt_entry_t *dde)
+{
+	ddt_prune_birth_t search, *dpb;
+	avl_index_t where;
+	int p;
+
+	for (p = 0; p < DDT_PHYS_TYPES; p++) {
+		if (dde->dde_phys[p].ddp_phys_birth != 0)
+			break;
+	}
+	ASSERT3S(p, <, DDT_PHYS_TYPES);
+
+	search.dpb_txg = dde->dde_phys[p].ddp_phys_birth;
+	dpb = avl_find(births, &search, &where);
+	if (dpb == NULL) {
+		dpb = kmem_zalloc(sizeof (ddt_prune_birth_t), KM_SLEEP);
+		dpb->dpb_txg = search.dpb_txg;
+		avl_insert(births, dpb, where);
+	}
+	dpb->dpb_count++;
+}
+
+/*
+ * Walk on through the unique entries of one DDT object, and mark those old
+ * enough to be pruned.  ddt_sync_entry() prunes them, later in this txg.
+ * When only counting, nothing is marked.
+ */
+static void
+ddt_prune_sync(void *arg, dmu_tx_t *tx)
+{
+	ddt_prune_arg_t *dpa = arg;
+	ddt_t *ddt = dpa->dpa_ddt;
+	ddt_entry_t *walked, *dde;
+	uint64_t n;
+
+	walked = kmem_zalloc(sizeof (ddt_entry_t), KM_SLEEP);
+
+	for (n = 0; n < zfs_dedup_prune_batch; n++) {
+		if (!ddt_object_exists(ddt, dpa->dpa_type, DDT_CLASS_UNIQUE) ||
+		    ddt_object_walk(ddt, dpa->dpa_type, DDT_CLASS_UNIQUE,
+		    &dpa->dpa_cursor, walked) != 0) {
+			dpa->dpa_done = B_TRUE;
+			break;
+		}
+
+		if (!ddt_entry_prunable(walked, dpa->dpa_txg))
+			continue;
+
+		if (dpa->dpa_births != NULL) {
+			if (ddt_walk_current(ddt, dpa->dpa_type,
+			    DDT_CLASS_UNIQUE, walked) &&
+			    ddt_entry_prunable(walked, dpa->dpa_txg))
+				ddt_prune_count(dpa->dpa_births, walked);
+			continue;
+		}
+
+		/*
+		 * The DDT log, or this txg's changes, may know better than
+		 * the object walked.
+		 */
+		ddt_enter(ddt);
+		dde = ddt_lookup_key(ddt, &walked->dde_key, B_TRUE);
+		if (dde->dde_class == DDT_CLASS_UNIQUE &&
+		    ddt_entry_prunable(dde, dpa->dpa_txg))
+			dde->dde_prune_txg = dpa->dpa_txg;
+		ddt_exit(ddt);
+	}
+
+	kmem_free(walked, sizeof (ddt_entry_t));
+}
+
+/*
+ * Find the newest txg known to have been synced no later than 'time', or
+ * 0 if there is none.
+ */
+static uint64_t
+ddt_txg_time_lookup(spa_t *spa, uint64_t time)
+{
+	objset_t *mos = spa->spa_meta_objset;
+	zap_cursor_t zc;
+	zap_attribute_t za;
+	uint64_t sample[2];
+	uint64_t txg = 0;
+
+	if (spa->spa_ddt_txg_time_object == 0)
+		return (0);
+
+	for (zap_cursor_init(&zc, mos, spa->spa_ddt_txg_time_object);
+	    zap_cursor_retrieve(&zc, &za) == 0;
+	    zap_cursor_advance(&zc)) {
+		if (zap_lookup(mos, spa->spa_ddt_txg_time_object, za.za_name,
+		    sizeof (uint64_t), 2, sample) != 0)
+			break;
+		if (sample[1] <= time)
+			txg = MAX(txg, sample[0]);
+	}
+	zap_cursor_fini(&zc);
+
+	return (txg);
+}
+
+/*
+ * Run ddt_prune_sync() over the unique entries of every DDT, either marking
+ * those born before 'txg' or, with 'births', counting them by birth txg.
+ */
+static int
+ddt_prune_walk(spa_t *spa, uint64_t txg, avl_tree_t *births)
+{
+	int error = 0;
+
+	for (enum zio_checksum c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
+		if (ddt == NULL)
+			continue;
+		for (enum ddt_type type = 0; type < DDT_TYPES; type++) {
+			ddt_prune_arg_t dpa = { 0 };
+
+			dpa.dpa_ddt = ddt;
+			dpa.dpa_type = type;
+			dpa.dpa_txg = txg;
+			dpa.dpa_births = births;
+
+			while (!dpa.dpa_done && error == 0) {
+				error = dsl_sync_task(spa_name(spa), NULL,
+				    ddt_prune_sync, &dpa, 0,
+				    ZFS_SPACE_CHECK_EXTRA_RESERVED);
+			}
+			if (error != 0)
+				return (error);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Find the txg such that the unique entries born before it make up at
+ * least 'percentage' percent of them, or 0 if there are none to prune.
+ * Entries born in the same txg are pruned or kept together, so more than
+ * asked for may be pruned.
+ */
+static int
+ddt_prune_percentage_txg(spa_t *spa, uint64_t percentage, uint64_t *txgp)
+{
+	avl_tree_t births;
+	ddt_prune_birth_t *dpb;
+	uint64_t total = 0, target, sum = 0;
+	void *cookie = NULL;
+	int error;
+
+	avl_create(&births, ddt_prune_birth_compare,
+	    sizeof (ddt_prune_birth_t), offsetof(ddt_prune_birth_t, dpb_node));
+
+	*txgp = 0;
+	error = ddt_prune_walk(spa, UINT64_MAX, &births);
+
+	for (dpb = avl_first(&births); dpb != NULL;
+	    dpb = AVL_NEXT(&births, dpb))
+		total += dpb->dpb_count;
+	target = total * percentage / 100;
+
+	for (dpb = avl_first(&births); error == 0 && target != 0 &&
+	    dpb != NULL; dpb = AVL_NEXT(&births, dpb)) {
+		sum += dpb->dpb_count;
+		if (sum >= target) {
+			*txgp = dpb->dpb_txg + 1;
+			break;
+		}
+	}
+
+	while ((dpb = avl_destroy_nodes(&births, &cookie)) != NULL)
+		kmem_free(dpb, sizeof (ddt_prune_birth_t));
+	avl_destroy(&births);
+
+	return (error);
+}
+
+/*
+ * Drop unique entries from the DDT: those older than 'amount' seconds, or
+ * the oldest 'amount' percent of them.  Their blocks stay where they are,
+ * each still referenced by the one block pointer it had, and are freed
+ * like ordinary blocks (see zio_ddt_free()).
+ *
+ * Entries record the txg they were born in rather than a time, so an age
+ * is mapped to the txg of the newest daily sample that is at least that
+ * old; entries up to a day older than the age may be kept.
+ */
+int
+ddt_prune_unique_entries(spa_t *spa, pool_ddt_prune_unit_t unit,
+    uint64_t amount)
+{
+	uint64_t now = gethrestime_sec();
+	uint64_t txg;
+	int error;
+
+	switch (unit) {
+	case POOL_DDT_PRUNE_AGE:
+		if (amount > now)
+			return (0);
+		txg = ddt_txg_time_lookup(spa, now - amount);
+		break;
+	case POOL_DDT_PRUNE_PERCENTAGE:
+		if (amount == 0 || amount > 100)
+			return (SET_ERROR(EINVAL));
+		error = ddt_prune_percentage_txg(spa, amount, &txg);
+		if (error != 0)
+			return (error);
+		break;
+	default:
+		return (SET_ERROR(EINVAL));
+	}
+
+	if (txg == 0)
+		return (0);
+
+	return (ddt_prune_walk(spa, txg, NULL));
+}
+
+#if defined(_KERNEL)
+module_param(zfs_dedup_prune_batch, ulong, 0644);
+MODULE_PARM_DESC(zfs_dedup_prune_batch,
+	"Unique DDT entries looked at per txg when pruning");
+
+module_param(zfs_dedup_lookup_batch, ulong, 0644);
+MODULE_PARM_DESC(zfs_dedup_lookup_batch,
+	"Dedup writes whose DDT entries are looked up together");
+#endif
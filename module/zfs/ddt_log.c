@@ -0,0 +1,767 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2023, Klara Inc.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/spa_impl.h>
+#include <sys/ddt.h>
+#include <sys/dmu_tx.h>
+#include <sys/zap.h>
+#include <sys/zfeature.h>
+#include <sys/zio_checksum.h>
+
+/*
+ * DDT Log
+ *
+ * Every dedup write or free of a deduplicated block changes an entry of
+ * the DDT, and the entries are keyed by checksum, so the changes of a txg
+ * are scattered all over the DDT ZAPs.  Without a log, ddt_sync() applies
+ * them right away, which dirties (and first reads) a ZAP leaf for almost
+ * every changed entry; on a large DDT this random read-modify-write makes
+ * up most of the cost of dedup.
+ *
+ * With the ddt_log feature, ddt_sync() instead appends the new state of
+ * each changed entry to the "active" log of its DDT, a plain object of
+ * fixed-size records that is only ever written sequentially, and keeps the
+ * latest logged state of each entry in an in-core AVL tree.  After
+ * zfs_dedup_log_txg_max txgs (or once the logs hold zfs_dedup_log_mem_max
+ * bytes in core) the active log becomes the "flushing" log, and a new
+ * active log is started.  The flushing log is then moved into the ZAPs in
+ * key order, a batch per txg, so that consecutive updates land in the same
+ * or neighbouring leaves; the batches are sized to finish the log within
+ * about zfs_dedup_log_flush_txgs txgs, but are never smaller than
+ * zfs_dedup_log_flush_entries_min.  An entry that changes again while it
+ * waits to be flushed moves to the active log, so every entry is in at
+ * most one of the two trees, and once the flushing tree is empty its
+ * object is freed.
+ *
+ * The last key flushed is kept in the flushing log's bonus buffer.  When
+ * the pool is opened the flushing log is replayed, skipping the records
+ * that were already flushed, and then the active log, where later records
+ * replace earlier ones.
+ *
+ * Everything that reads the DDT looks at the logs first: ddt_lookup(),
+ * ddt_repair_start() and ddt_class_contains() use the logged state of an
+ * entry if there is one, and ddt_walk() skips or amends the entries of the
+ * ZAPs that the logs have changed.  The walk can not see entries that are
+ * only in the logs, so ddt_walk_init() makes the logs flush everything
+ * logged before a scan starts, and the scan does not walk the DDT before
+ * ddt_walk_ready() says so.  Entries logged after that are taken care of
+ * by ddt_sync_entry(), as they are without a log.
+ *
+ * The DDT histograms always describe the logged state and are synced in
+ * the same txg as the records, so they survive a crash the same way.  The
+ * per-object counts reported by zpool status -D count the entries of the
+ * ZAPs, and so do not include entries that are still only logged.
+ *
+ * Each DDT with a log has a zfs/<pool>/ddt_log-<checksum> kstat with the
+ * size of its logs and how fast they are flushed.
+ */
+
+/*
+ * Number of txgs an active log collects changes for before it is flushed.
+ */
+uint64_t zfs_dedup_log_txg_max = 8;
+
+/*
+ * Number of txgs a flushing log is spread over.
+ */
+uint64_t zfs_dedup_log_flush_txgs = 8;
+
+/*
+ * Minimum number of entries flushed per txg.
+ */
+uint64_t zfs_dedup_log_flush_entries_min = 1000;
+
+/*
+ * Once both logs of a DDT hold this many bytes in core, the flushing log
+ * is flushed in full and the active one is swapped out early.
+ */
+uint64_t zfs_dedup_log_mem_max = 64ULL << 20;
+
+/*
+ * Block size of the log objects.
+ */
+uint64_t zfs_dedup_log_blksz = 1ULL << 17;
+
+static kmem_cache_t *ddt_log_entry_cache;
+
+static const char *ddt_log_name[2] = {
+	"active",
+	"flushing",
+};
+
+static int
+ddt_log_entry_compare(const void *x1, const void *x2)
+{
+	const ddt_log_entry_t *ddle1 = x1;
+	const ddt_log_entry_t *ddle2 = x2;
+
+	return (ddt_key_compare(&ddle1->ddle_key, &ddle2->ddle_key));
+}
+
+void
+ddt_log_init(void)
+{
+	ddt_log_entry_cache = kmem_cache_create("ddt_log_entry_cache",
+	    sizeof (ddt_log_entry_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+}
+
+void
+ddt_log_fini(void)
+{
+	kmem_cache_destroy(ddt_log_entry_cache);
+}
+
+static void
+ddt_log_kstat_create(ddt_t *ddt)
+{
+	ddt_log_stats_t *st = &ddt->ddt_log_stats;
+	char *module, *name;
+	kstat_t *ksp;
+
+	kstat_named_init(&st->ddls_active_entries, "active_entries",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->ddls_active_bytes, "active_bytes",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->ddls_active_records, "active_records",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->ddls_flushing_entries, "flushing_entries",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->ddls_flushing_bytes, "flushing_bytes",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->ddls_flush_rate, "flush_rate",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->ddls_flushed_last_txg, "flushed_last_txg",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->ddls_flushed_entries, "flushed_entries",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->ddls_swaps, "swaps",
+	    KSTAT_DATA_UINT64);
+
+	module = kmem_asprintf("zfs/%s", spa_name(ddt->ddt_spa));
+	name = kmem_asprintf("ddt_log-%s",
+	    zio_checksum_table[ddt->ddt_checksum].ci_name);
+	ksp = kstat_create(module, 0, name, "misc", KSTAT_TYPE_NAMED,
+	    sizeof (ddt_log_stats_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (ksp != NULL) {
+		ksp->ks_data = st;
+		kstat_install(ksp);
+	}
+	strfree(name);
+	strfree(module);
+
+	ddt->ddt_log_kstat = ksp;
+}
+
+static void
+ddt_log_kstat_update(ddt_t *ddt)
+{
+	ddt_log_stats_t *st = &ddt->ddt_log_stats;
+	ddt_log_t *active = ddt->ddt_log_active;
+	ddt_log_t *flushing = ddt->ddt_log_flushing;
+	uint64_t nactive = avl_numnodes(&active->ddl_tree);
+	uint64_t nflushing = avl_numnodes(&flushing->ddl_tree);
+
+	if (ddt->ddt_log_kstat == NULL) {
+		if (nactive == 0 && nflushing == 0)
+			return;
+		ddt_log_kstat_create(ddt);
+	}
+
+	st->ddls_active_entries.value.ui64 = nactive;
+	st->ddls_active_bytes.value.ui64 = nactive * sizeof (ddt_log_entry_t);
+	st->ddls_active_records.value.ui64 = active->ddl_count;
+	st->ddls_flushing_entries.value.ui64 = nflushing;
+	st->ddls_flushing_bytes.value.ui64 =
+	    nflushing * sizeof (ddt_log_entry_t);
+	st->ddls_flush_rate.value.ui64 = ddt->ddt_flush_rate;
+}
+
+static void
+ddt_log_reset(ddt_log_t *ddl)
+{
+	ASSERT0(avl_numnodes(&ddl->ddl_tree));
+
+	ddl->ddl_object = 0;
+	ddl->ddl_count = 0;
+	ddl->ddl_first_txg = 0;
+	ddl->ddl_flags = 0;
+	bzero(&ddl->ddl_checkpoint, sizeof (ddt_key_t));
+	ddl->ddl_dirty = B_FALSE;
+}
+
+void
+ddt_log_alloc(ddt_t *ddt)
+{
+	for (int i = 0; i < 2; i++) {
+		avl_create(&ddt->ddt_log[i].ddl_tree, ddt_log_entry_compare,
+		    sizeof (ddt_log_entry_t), offsetof(ddt_log_entry_t,
+		    ddle_node));
+		ddt_log_reset(&ddt->ddt_log[i]);
+	}
+	ddt->ddt_log_active = &ddt->ddt_log[0];
+	ddt->ddt_log_flushing = &ddt->ddt_log[1];
+}
+
+void
+ddt_log_free(ddt_t *ddt)
+{
+	ddt_log_entry_t *ddle;
+	void *cookie;
+
+	if (ddt->ddt_log_kstat != NULL) {
+		kstat_delete(ddt->ddt_log_kstat);
+		ddt->ddt_log_kstat = NULL;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		cookie = NULL;
+		while ((ddle = avl_destroy_nodes(&ddt->ddt_log[i].ddl_tree,
+		    &cookie)) != NULL)
+			kmem_cache_free(ddt_log_entry_cache, ddle);
+		avl_destroy(&ddt->ddt_log[i].ddl_tree);
+	}
+
+	if (ddt->ddt_log_records != NULL) {
+		kmem_free(ddt->ddt_log_records,
+		    ddt->ddt_log_maxrecords * sizeof (ddt_log_record_t));
+		ddt->ddt_log_records = NULL;
+	}
+}
+
+boolean_t
+ddt_log_empty(ddt_t *ddt)
+{
+	return (avl_numnodes(&ddt->ddt_log_active->ddl_tree) == 0 &&
+	    avl_numnodes(&ddt->ddt_log_flushing->ddl_tree) == 0);
+}
+
+static void
+ddt_log_dirname(ddt_t *ddt, ddt_log_t *ddl, char *name)
+{
+	(void) snprintf(name, DDT_NAMELEN, DMU_POOL_DDT_LOG,
+	    zio_checksum_table[ddt->ddt_checksum].ci_name,
+	    ddt_log_name[ddl == ddt->ddt_log_flushing]);
+}
+
+static void
+ddt_log_entry_fill(ddt_log_entry_t *ddle, const ddt_entry_t *dde)
+{
+	bcopy(dde->dde_phys, ddle->ddle_phys, sizeof (ddle->ddle_phys));
+	ddle->ddle_type = dde->dde_type;
+	ddle->ddle_class = dde->dde_class;
+	ddle->ddle_obj_type = dde->dde_obj_type;
+	ddle->ddle_obj_class = dde->dde_obj_class;
+}
+
+/*
+ * Look for the logged state of an entry.  If there is one, fill in the
+ * entry's phys, type and class and the DDT object it is stored in, and
+ * return B_TRUE.  A removed entry has type DDT_TYPES and class DDT_CLASSES.
+ */
+boolean_t
+ddt_log_lookup(ddt_t *ddt, ddt_entry_t *dde)
+{
+	ddt_log_entry_t *ddle, search;
+
+	ASSERT(MUTEX_HELD(&ddt->ddt_lock));
+
+	search.ddle_key = dde->dde_key;
+	ddle = avl_find(&ddt->ddt_log_active->ddl_tree, &search, NULL);
+	if (ddle == NULL) {
+		ddle = avl_find(&ddt->ddt_log_flushing->ddl_tree, &search,
+		    NULL);
+	}
+	if (ddle == NULL)
+		return (B_FALSE);
+
+	bcopy(ddle->ddle_phys, dde->dde_phys, sizeof (dde->dde_phys));
+	dde->dde_type = ddle->ddle_type;
+	dde->dde_class = ddle->ddle_class;
+	dde->dde_obj_type = ddle->ddle_obj_type;
+	dde->dde_obj_class = ddle->ddle_obj_class;
+
+	return (B_TRUE);
+}
+
+/*
+ * Record the new state of an entry in the active log.  Called by
+ * ddt_sync_entry() in place of updating the DDT objects.
+ */
+void
+ddt_log_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx)
+{
+	ddt_log_t *active = ddt->ddt_log_active;
+	ddt_log_t *flushing = ddt->ddt_log_flushing;
+	ddt_log_entry_t *ddle, search;
+	ddt_log_record_t *dlr;
+	avl_index_t where;
+
+	search.ddle_key = dde->dde_key;
+
+	ddt_enter(ddt);
+	ddle = avl_find(&active->ddl_tree, &search, &where);
+	if (ddle == NULL) {
+		ddle = avl_find(&flushing->ddl_tree, &search, NULL);
+		if (ddle != NULL) {
+			avl_remove(&flushing->ddl_tree, ddle);
+		} else if (dde->dde_type == DDT_TYPES &&
+		    dde->dde_obj_type == DDT_TYPES) {
+			/* Neither logged nor stored, nothing to record. */
+			ddt_exit(ddt);
+			return;
+		} else {
+			ddle = kmem_cache_alloc(ddt_log_entry_cache, KM_SLEEP);
+			ddle->ddle_key = dde->dde_key;
+		}
+		avl_insert(&active->ddl_tree, ddle, where);
+	}
+	ddt_log_entry_fill(ddle, dde);
+	ddt_exit(ddt);
+
+	if (ddt->ddt_log_nrecords == ddt->ddt_log_maxrecords) {
+		uint64_t max = MAX(ddt->ddt_log_maxrecords * 2,
+		    zfs_dedup_log_blksz / sizeof (ddt_log_record_t));
+		ddt_log_record_t *records;
+
+		records = kmem_alloc(max * sizeof (ddt_log_record_t), KM_SLEEP);
+		if (ddt->ddt_log_records != NULL) {
+			bcopy(ddt->ddt_log_records, records,
+			    ddt->ddt_log_nrecords * sizeof (ddt_log_record_t));
+			kmem_free(ddt->ddt_log_records,
+			    ddt->ddt_log_maxrecords *
+			    sizeof (ddt_log_record_t));
+		}
+		ddt->ddt_log_records = records;
+		ddt->ddt_log_maxrecords = max;
+	}
+
+	dlr = &ddt->ddt_log_records[ddt->ddt_log_nrecords++];
+	dlr->dlr_key = dde->dde_key;
+	bcopy(dde->dde_phys, dlr->dlr_phys, sizeof (dlr->dlr_phys));
+	dlr->dlr_info = 0;
+	DLR_SET_TYPE(dlr, dde->dde_type);
+	DLR_SET_CLASS(dlr, dde->dde_class);
+	DLR_SET_OBJ_TYPE(dlr, dde->dde_obj_type);
+	DLR_SET_OBJ_CLASS(dlr, dde->dde_obj_class);
+
+	if (active->ddl_first_txg == 0)
+		active->ddl_first_txg = tx->tx_txg;
+}
+
+static void
+ddt_log_create(ddt_t *ddt, ddt_log_t *ddl, dmu_tx_t *tx)
+{
+	objset_t *mos = ddt->ddt_os;
+	char name[DDT_NAMELEN];
+
+	ASSERT0(ddl->ddl_object);
+
+	ddl->ddl_object = dmu_object_alloc(mos, DMU_OTN_UINT64_METADATA,
+	    zfs_dedup_log_blksz, DMU_OTN_UINT64_METADATA,
+	    sizeof (ddt_log_phys_t), tx);
+	VERIFY(ddl->ddl_object != 0);
+
+	ddt_log_dirname(ddt, ddl, name);
+	VERIFY0(zap_add(mos, DMU_POOL_DIRECTORY_OBJECT, name,
+	    sizeof (uint64_t), 1, &ddl->ddl_object, tx));
+
+	spa_feature_incr(ddt->ddt_spa, SPA_FEATURE_DDT_LOG, tx);
+	ddl->ddl_dirty = B_TRUE;
+}
+
+static void
+ddt_log_destroy(ddt_t *ddt, ddt_log_t *ddl, dmu_tx_t *tx)
+{
+	objset_t *mos = ddt->ddt_os;
+	char name[DDT_NAMELEN];
+
+	ASSERT(ddl->ddl_object != 0);
+
+	VERIFY0(dmu_object_free(mos, ddl->ddl_object, tx));
+
+	ddt_log_dirname(ddt, ddl, name);
+	VERIFY0(zap_remove(mos, DMU_POOL_DIRECTORY_OBJECT, name, tx));
+
+	spa_feature_decr(ddt->ddt_spa, SPA_FEATURE_DDT_LOG, tx);
+	ddt_log_reset(ddl);
+}
+
+static void
+ddt_log_sync_phys(ddt_t *ddt, ddt_log_t *ddl, dmu_tx_t *tx)
+{
+	ddt_log_phys_t *dlp;
+	dmu_buf_t *db;
+
+	if (!ddl->ddl_dirty)
+		return;
+
+	VERIFY0(dmu_bonus_hold(ddt->ddt_os, ddl->ddl_object, FTAG, &db));
+	dmu_buf_will_dirty(db, tx);
+	dlp = db->db_data;
+	dlp->dlp_count = ddl->ddl_count;
+	dlp->dlp_first_txg = ddl->ddl_first_txg;
+	dlp->dlp_flags = ddl->ddl_flags;
+	dlp->dlp_checkpoint = ddl->ddl_checkpoint;
+	dmu_buf_rele(db, FTAG);
+
+	ddl->ddl_dirty = B_FALSE;
+}
+
+/*
+ * Append this txg's records to the active log.
+ */
+static void
+ddt_log_write(ddt_t *ddt, dmu_tx_t *tx)
+{
+	ddt_log_t *active = ddt->ddt_log_active;
+	uint64_t n = ddt->ddt_log_nrecords;
+
+	if (n == 0)
+		return;
+
+	if (active->ddl_object == 0)
+		ddt_log_create(ddt, active, tx);
+
+	dmu_write(ddt->ddt_os, active->ddl_object,
+	    active->ddl_count * sizeof (ddt_log_record_t),
+	    n * sizeof (ddt_log_record_t), ddt->ddt_log_records, tx);
+	active->ddl_count += n;
+	active->ddl_dirty = B_TRUE;
+	ddt->ddt_log_nrecords = 0;
+
+	ddt_log_sync_phys(ddt, active, tx);
+}
+
+/*
+ * Move up to 'count' entries of the flushing log, in key order, into the
+ * DDT objects.  Returns the number of entries flushed.
+ */
+static uint64_t
+ddt_log_flush(ddt_t *ddt, uint64_t count, dmu_tx_t *tx)
+{
+	ddt_log_t *flushing = ddt->ddt_log_flushing;
+	ddt_log_entry_t *ddle;
+	ddt_entry_t *dde;
+	uint64_t n;
+
+	dde = kmem_zalloc(sizeof (ddt_entry_t), KM_SLEEP);
+
+	for (n = 0; n < count; n++) {
+		enum ddt_type type, otype;
+		enum ddt_class class, oclass;
+
+		ddt_enter(ddt);
+		ddle = avl_first(&flushing->ddl_tree);
+		ddt_exit(ddt);
+		if (ddle == NULL)
+			break;
+
+		dde->dde_key = ddle->ddle_key;
+		bcopy(ddle->ddle_phys, dde->dde_phys, sizeof (dde->dde_phys));
+		type = ddle->ddle_type;
+		class = ddle->ddle_class;
+		otype = ddle->ddle_obj_type;
+		oclass = ddle->ddle_obj_class;
+
+		/*
+		 * The entry stays in the tree, where readers find it, until
+		 * the DDT objects are up to date.
+		 */
+		if (otype != DDT_TYPES && (otype != type || oclass != class))
+			VERIFY0(ddt_object_remove(ddt, otype, oclass, dde, tx));
+		if (type != DDT_TYPES) {
+			if (!ddt_object_exists(ddt, type, class))
+				ddt_object_create(ddt, type, class, tx);
+			VERIFY0(ddt_object_update(ddt, type, class, dde, tx));
+		}
+
+		ddt_enter(ddt);
+		avl_remove(&flushing->ddl_tree, ddle);
+		ddt_exit(ddt);
+
+		flushing->ddl_checkpoint = ddle->ddle_key;
+		kmem_cache_free(ddt_log_entry_cache, ddle);
+	}
+
+	kmem_free(dde, sizeof (ddt_entry_t));
+
+	if (n != 0) {
+		flushing->ddl_flags |= DDT_LOG_FLAG_CHECKPOINT;
+		flushing->ddl_dirty = B_TRUE;
+	}
+
+	return (n);
+}
+
+/*
+ * Make the active log the flushing one.  The flushing log must be empty.
+ */
+static void
+ddt_log_swap(ddt_t *ddt, dmu_tx_t *tx)
+{
+	objset_t *mos = ddt->ddt_os;
+	ddt_log_t *active = ddt->ddt_log_active;
+	ddt_log_t *flushing = ddt->ddt_log_flushing;
+	char name[DDT_NAMELEN];
+	uint64_t n;
+
+	ASSERT0(avl_numnodes(&flushing->ddl_tree));
+	ASSERT0(flushing->ddl_object);
+	ASSERT(active->ddl_object != 0);
+	ASSERT0(ddt->ddt_log_nrecords);
+
+	ddt_log_dirname(ddt, active, name);
+	VERIFY0(zap_remove(mos, DMU_POOL_DIRECTORY_OBJECT, name, tx));
+
+	ddt_enter(ddt);
+	ddt->ddt_log_active = flushing;
+	ddt->ddt_log_flushing = active;
+	ddt_exit(ddt);
+
+	ddt_log_dirname(ddt, active, name);
+	VERIFY0(zap_add(mos, DMU_POOL_DIRECTORY_OBJECT, name,
+	    sizeof (uint64_t), 1, &active->ddl_object, tx));
+
+	n = avl_numnodes(&active->ddl_tree);
+	ddt->ddt_flush_rate = MAX(zfs_dedup_log_flush_entries_min,
+	    (n + zfs_dedup_log_flush_txgs - 1) /
+	    MAX(zfs_dedup_log_flush_txgs, 1));
+	ddt->ddt_log_stats.ddls_swaps.value.ui64++;
+}
+
+static boolean_t
+ddt_log_over_mem(ddt_t *ddt)
+{
+	return ((avl_numnodes(&ddt->ddt_log_active->ddl_tree) +
+	    avl_numnodes(&ddt->ddt_log_flushing->ddl_tree)) *
+	    sizeof (ddt_log_entry_t) >= zfs_dedup_log_mem_max);
+}
+
+static boolean_t
+ddt_log_swap_due(ddt_t *ddt, uint64_t txg)
+{
+	ddt_log_t *active = ddt->ddt_log_active;
+
+	if (active->ddl_object == 0)
+		return (B_FALSE);
+
+	return (txg - active->ddl_first_txg >= zfs_dedup_log_txg_max ||
+	    (ddt->ddt_flush_force_txg != 0 &&
+	    active->ddl_first_txg <= ddt->ddt_flush_force_txg) ||
+	    ddt_log_over_mem(ddt));
+}
+
+/*
+ * Called by ddt_sync_table() after the entries of the txg have been
+ * logged.  Writes them out and, in the first pass, flushes a batch of the
+ * flushing log.  Returns B_TRUE if the DDT objects were changed.
+ */
+boolean_t
+ddt_log_sync(ddt_t *ddt, dmu_tx_t *tx)
+{
+	ddt_log_t *flushing = ddt->ddt_log_flushing;
+	uint64_t flushed = 0;
+
+	if (ddt->ddt_log_nrecords == 0 && flushing->ddl_object == 0 &&
+	    ddt->ddt_log_active->ddl_object == 0 &&
+	    ddt->ddt_flush_force_txg == 0)
+		return (B_FALSE);
+
+	ddt_log_write(ddt, tx);
+
+	if (spa_sync_pass(ddt->ddt_spa) > 1)
+		return (B_FALSE);
+
+	for (;;) {
+		flushing = ddt->ddt_log_flushing;
+		if (avl_numnodes(&flushing->ddl_tree) != 0) {
+			boolean_t all = ddt->ddt_flush_force_txg != 0 ||
+			    ddt_log_over_mem(ddt);
+			flushed += ddt_log_flush(ddt,
+			    all ? UINT64_MAX : ddt->ddt_flush_rate, tx);
+		}
+		if (avl_numnodes(&flushing->ddl_tree) != 0) {
+			ddt_log_sync_phys(ddt, flushing, tx);
+			break;
+		}
+		if (flushing->ddl_object != 0)
+			ddt_log_destroy(ddt, flushing, tx);
+		if (!ddt_log_swap_due(ddt, tx->tx_txg))
+			break;
+		ddt_log_swap(ddt, tx);
+		if (ddt->ddt_flush_force_txg == 0)
+			break;
+	}
+
+	/*
+	 * Everything logged up to the forced txg has reached the DDT
+	 * objects once it is no longer in either log.
+	 */
+	if (ddt->ddt_flush_force_txg != 0 &&
+	    ddt->ddt_log_flushing->ddl_object == 0 &&
+	    (ddt->ddt_log_active->ddl_object == 0 ||
+	    ddt->ddt_log_active->ddl_first_txg > ddt->ddt_flush_force_txg))
+		ddt->ddt_flush_force_txg = 0;
+
+	ddt->ddt_log_stats.ddls_flushed_last_txg.value.ui64 = flushed;
+	ddt->ddt_log_stats.ddls_flushed_entries.value.ui64 += flushed;
+	ddt_log_kstat_update(ddt);
+
+	return (flushed != 0);
+}
+
+/*
+ * Apply a record read back from a log.
+ */
+static void
+ddt_log_replay(ddt_t *ddt, ddt_log_t *ddl, const ddt_log_record_t *dlr)
+{
+	ddt_log_entry_t *ddle, search;
+	avl_index_t where;
+
+	search.ddle_key = dlr->dlr_key;
+	ddle = avl_find(&ddl->ddl_tree, &search, &where);
+	if (ddle == NULL) {
+		if (ddl == ddt->ddt_log_active) {
+			ddle = avl_find(&ddt->ddt_log_flushing->ddl_tree,
+			    &search, NULL);
+		}
+		if (ddle != NULL) {
+			avl_remove(&ddt->ddt_log_flushing->ddl_tree, ddle);
+		} else {
+			ddle = kmem_cache_alloc(ddt_log_entry_cache, KM_SLEEP);
+			ddle->ddle_key = dlr->dlr_key;
+		}
+		avl_insert(&ddl->ddl_tree, ddle, where);
+	}
+
+	bcopy(dlr->dlr_phys, ddle->ddle_phys, sizeof (ddle->ddle_phys));
+	ddle->ddle_type = DLR_GET_TYPE(dlr);
+	ddle->ddle_class = DLR_GET_CLASS(dlr);
+	ddle->ddle_obj_type = DLR_GET_OBJ_TYPE(dlr);
+	ddle->ddle_obj_class = DLR_GET_OBJ_CLASS(dlr);
+}
+
+static int
+ddt_log_load_one(ddt_t *ddt, ddt_log_t *ddl)
+{
+	objset_t *mos = ddt->ddt_os;
+	ddt_log_phys_t *dlp;
+	ddt_log_record_t *records;
+	dmu_buf_t *db;
+	char name[DDT_NAMELEN];
+	uint64_t object, chunk;
+	int error;
+
+	ddt_log_dirname(ddt, ddl, name);
+	error = zap_lookup(mos, DMU_POOL_DIRECTORY_OBJECT, name,
+	    sizeof (uint64_t), 1, &object);
+	if (error == ENOENT)
+		return (0);
+	if (error != 0)
+		return (error);
+
+	error = dmu_bonus_hold(mos, object, FTAG, &db);
+	if (error != 0)
+		return (error);
+
+	dlp = db->db_data;
+	ddl->ddl_object = object;
+	ddl->ddl_count = dlp->dlp_count;
+	ddl->ddl_first_txg = dlp->dlp_first_txg;
+	ddl->ddl_flags = dlp->dlp_flags;
+	ddl->ddl_checkpoint = dlp->dlp_checkpoint;
+	dmu_buf_rele(db, FTAG);
+
+	chunk = zfs_dedup_log_blksz / sizeof (ddt_log_record_t);
+	records = kmem_alloc(chunk * sizeof (ddt_log_record_t), KM_SLEEP);
+
+	for (uint64_t i = 0; i < ddl->ddl_count; i += chunk) {
+		uint64_t n = MIN(chunk, ddl->ddl_count - i);
+
+		error = dmu_read(mos, object, i * sizeof (ddt_log_record_t),
+		    n * sizeof (ddt_log_record_t), records,
+		    DMU_READ_PREFETCH);
+		if (error != 0)
+			break;
+
+		for (uint64_t r = 0; r < n; r++) {
+			/* Already in the DDT objects. */
+			if ((ddl->ddl_flags & DDT_LOG_FLAG_CHECKPOINT) &&
+			    ddt_key_compare(&records[r].dlr_key,
+			    &ddl->ddl_checkpoint) <= 0)
+				continue;
+			ddt_log_replay(ddt, ddl, &records[r]);
+		}
+	}
+
+	kmem_free(records, chunk * sizeof (ddt_log_record_t));
+
+	return (error);
+}
+
+/*
+ * Rebuild the in-core logs from the log objects: the flushing log first,
+ * as it is the older one.
+ */
+int
+ddt_log_load(ddt_t *ddt)
+{
+	int error;
+
+	error = ddt_log_load_one(ddt, ddt->ddt_log_flushing);
+	if (error == 0)
+		error = ddt_log_load_one(ddt, ddt->ddt_log_active);
+	if (error != 0)
+		return (error);
+
+	ddt->ddt_flush_rate = MAX(zfs_dedup_log_flush_entries_min,
+	    (avl_numnodes(&ddt->ddt_log_flushing->ddl_tree) +
+	    zfs_dedup_log_flush_txgs - 1) / MAX(zfs_dedup_log_flush_txgs, 1));
+	ddt_log_kstat_update(ddt);
+
+	return (0);
+}
+
+#if defined(_KERNEL)
+module_param(zfs_dedup_log_txg_max, ulong, 0644);
+MODULE_PARM_DESC(zfs_dedup_log_txg_max,
+	"Number of txgs a DDT log collects changes for before flushing");
+
+module_param(zfs_dedup_log_flush_txgs, ulong, 0644);
+MODULE_PARM_DESC(zfs_dedup_log_flush_txgs,
+	"Number of txgs a DDT log flush is spread over");
+
+module_param(zfs_dedup_log_flush_entries_min, ulong, 0644);
+MODULE_PARM_DESC(zfs_dedup_log_flush_entries_min,
+	"Minimum number of DDT log entries flushed per txg");
+
+module_param(zfs_dedup_log_mem_max, ulong, 0644);
+MODULE_PARM_DESC(zfs_dedup_log_mem_max,
+	"Memory used by the DDT logs of a table before they are flushed early");
+#endif
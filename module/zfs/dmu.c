@@ -47,6 +47,7 @@
 #include <sys/sa.h>
 #include <sys/zfeature.h>
 #include <sys/abd.h>
+#include <sys/brt.h>
 #ifdef _KERNEL
 #include <sys/vmsystm.h>
 #include <sys/zfs_znode.h>
@@ -1258,6 +1259,189 @@ dmu_write_embedded(objset_t *os, uint64_t object, uint64_t offset,
 	dmu_buf_rele(db, FTAG);
 }
 
+/*
+ * Block cloning.
+ *
+ * A range of an object is cloned by copying the block pointers of its
+ * level-0 blocks, as returned by dmu_read_l0_bps(), over the blocks of
+ * another range with dmu_brt_clone().  The ranges may be in different
+ * objects and datasets of the same pool, but must have the same block
+ * size.  The extra references are tracked by the BRT (see brt.c).
+ *
+ * The cloned blocks only appear in the destination once the txg has
+ * synced; until then reading them through the DMU fails with EIO.
+ * Callers must keep readers away, e.g. with a range lock, until then.
+ */
+
+/*
+ * Copy the level-0 block pointers of the given range, which must be
+ * block aligned, into bps.  Fails with EAGAIN if any of the blocks has
+ * changes that have not reached the disk yet, since its block pointer
+ * does not describe its contents then; the caller can wait for the txg
+ * to sync and retry.  The caller must keep the range from being modified
+ * or freed until the block pointers have been passed to dmu_brt_clone().
+ */
+int
+dmu_read_l0_bps(objset_t *os, uint64_t object, uint64_t offset,
+    uint64_t length, blkptr_t *bps, size_t *nbpsp)
+{
+	dmu_buf_t **dbp;
+	dmu_buf_impl_t *db;
+	dnode_t *dn;
+	int error, numbufs, i;
+
+	error = dmu_buf_hold_array(os, object, offset, length, FALSE, FTAG,
+	    &numbufs, &dbp);
+	if (error != 0)
+		return (error);
+
+	ASSERT3U(numbufs, <=, *nbpsp);
+
+	for (i = 0; i < numbufs; i++) {
+		db = (dmu_buf_impl_t *)dbp[i];
+
+		DB_DNODE_ENTER(db);
+		dn = DB_DNODE(db);
+		rw_enter(&dn->dn_struct_rwlock, RW_READER);
+		mutex_enter(&db->db_mtx);
+		if (db->db_last_dirty != NULL ||
+		    dnode_block_freed(dn, db->db_blkid)) {
+			error = SET_ERROR(EAGAIN);
+		} else if (db->db_blkptr == NULL) {
+			/* Beyond the last level of indirection: a hole. */
+			BP_ZERO(&bps[i]);
+		} else {
+			bps[i] = *db->db_blkptr;
+		}
+		mutex_exit(&db->db_mtx);
+		rw_exit(&dn->dn_struct_rwlock);
+		DB_DNODE_EXIT(db);
+
+		if (error != 0)
+			break;
+	}
+
+	if (error == 0)
+		*nbpsp = numbufs;
+
+	dmu_buf_rele_array(dbp, numbufs, FTAG);
+	return (error);
+}
+
+/*
+ * Make the level-0 blocks of the given range, which must be block aligned,
+ * reference the blocks described by bps.  Everything is checked before
+ * anything is changed, so on error the destination is left untouched.
+ */
+int
+dmu_brt_clone(objset_t *os, uint64_t object, uint64_t offset, uint64_t length,
+    dmu_tx_t *tx, const blkptr_t *bps, size_t nbps)
+{
+	spa_t *spa = dmu_objset_spa(os);
+	dmu_buf_t **dbp;
+	dmu_buf_impl_t *db;
+	dbuf_dirty_record_t *dr;
+	struct dirty_leaf *dl;
+	const blkptr_t *bp;
+	dmu_object_type_t type;
+	int error, numbufs, i;
+
+	ASSERT(!dmu_tx_is_syncing(tx));
+
+	if (!spa_feature_is_enabled(spa, SPA_FEATURE_BLOCK_CLONING))
+		return (SET_ERROR(ENOTSUP));
+
+	/*
+	 * Encrypted blocks are bound to their dataset's keys and to their
+	 * location by the MAC, so they cannot be referenced elsewhere.
+	 */
+	if (os->os_encrypted)
+		return (SET_ERROR(EXDEV));
+
+	error = dmu_buf_hold_array(os, object, offset, length, FALSE, FTAG,
+	    &numbufs, &dbp);
+	if (error != 0)
+		return (error);
+
+	if (numbufs != nbps) {
+		error = SET_ERROR(EINVAL);
+		goto out;
+	}
+
+	for (i = 0; i < numbufs; i++) {
+		db = (dmu_buf_impl_t *)dbp[i];
+		bp = &bps[i];
+
+		ASSERT0(db->db_level);
+		ASSERT(db->db_blkid != DMU_BONUS_BLKID);
+
+		DB_DNODE_ENTER(db);
+		type = DB_DNODE(db)->dn_type;
+		DB_DNODE_EXIT(db);
+
+		if (!BP_IS_HOLE(bp) && (BP_GET_LSIZE(bp) != db->db.db_size ||
+		    BP_GET_TYPE(bp) != type || !brt_can_clone(spa, bp))) {
+			error = SET_ERROR(EXDEV);
+			goto out;
+		}
+
+		/*
+		 * A dirty record of an earlier txg is still being synced
+		 * and owns the dbuf's current data.
+		 */
+		mutex_enter(&db->db_mtx);
+		for (dr = db->db_last_dirty; dr != NULL; dr = dr->dr_next) {
+			if (dr->dr_txg < tx->tx_txg)
+				error = SET_ERROR(EAGAIN);
+		}
+		mutex_exit(&db->db_mtx);
+		if (error != 0)
+			goto out;
+	}
+
+	for (i = 0; i < numbufs; i++) {
+		db = (dmu_buf_impl_t *)dbp[i];
+		bp = &bps[i];
+
+		dmu_buf_will_clone(&db->db, tx);
+
+		mutex_enter(&db->db_mtx);
+		dr = db->db_last_dirty;
+		ASSERT3U(dr->dr_txg, ==, tx->tx_txg);
+		dl = &dr->dt.dl;
+		ASSERT3U(dl->dr_override_state, ==, DR_NOT_OVERRIDDEN);
+
+		dl->dr_overridden_by = *bp;
+		if (BP_IS_EMBEDDED(bp)) {
+			dl->dr_overridden_by.blk_birth = dr->dr_txg;
+		} else if (BP_IS_HOLE(bp)) {
+			/* Old style holes stay without a birth time. */
+			if (bp->blk_birth != 0)
+				dl->dr_overridden_by.blk_birth = dr->dr_txg;
+		} else {
+			/*
+			 * The block is logically born in this txg, as far
+			 * as snapshots and send are concerned, but its data
+			 * was written when the source block was.
+			 */
+			BP_SET_BIRTH(&dl->dr_overridden_by, dr->dr_txg,
+			    BP_PHYSICAL_BIRTH(bp));
+		}
+		dl->dr_override_state = DR_OVERRIDDEN;
+		dl->dr_brtwrite = B_TRUE;
+		dl->dr_nopwrite = B_FALSE;
+		dl->dr_copies = os->os_copies;
+		mutex_exit(&db->db_mtx);
+
+		if (!BP_IS_HOLE(bp) && !BP_IS_EMBEDDED(bp))
+			brt_pending_add(spa, bp, tx);
+	}
+
+out:
+	dmu_buf_rele_array(dbp, numbufs, FTAG);
+	return (error);
+}
+
 /*
  * DMU support for xuio
  */
@@ -1501,6 +1685,8 @@ dmu_read_uio_dbuf(dmu_buf_t *zdb, uio_t *uio, uint64_t size)
 
         DB_DNODE_ENTER(db);
         dn = DB_DNODE(db);
+        dmu_iolimit_read(dn->dn_objset, dn->dn_datablksz, uio_offset(uio),
+            size);
         err = dmu_read_uio_dnode(dn, uio, size);
         DB_DNODE_EXIT(db);
 
@@ -1525,6 +1711,7 @@ dmu_read_uio(objset_t *os, uint64_t object, uio_t *uio, uint64_t size)
         if (err)
                 return (err);
 
+        dmu_iolimit_read(os, dn->dn_datablksz, uio_offset(uio), size);
         err = dmu_read_uio_dnode(dn, uio, size);
 
         dnode_rele(dn, FTAG);
@@ -1640,6 +1827,319 @@ dmu_write_uio(objset_t *os, uint64_t object, uio_t *uio, uint64_t size,
 	return (err);
 }
 
+/*
+ * Direct I/O.
+ *
+ * Reads and writes that cover whole, recordsize-aligned blocks of a file
+ * can bypass the ARC, so that streaming a large file once does not push
+ * everything else out of the cache.
+ *
+ * A direct read issues the zio for each block straight into a transient
+ * buffer, decompressing and verifying it there, and copies it out to the
+ * caller without creating a dbuf or an ARC header.  Blocks that have a
+ * dbuf (cached or dirty) or a free pending in the open txg are read
+ * through the dbuf layer instead, which keeps direct readers coherent
+ * with buffered writers.
+ *
+ * A direct write fills the dbuf as usual, so buffered readers keep
+ * seeing the new data until it is on disk, but then immediately writes
+ * the block out from open context and overrides its block pointer, the
+ * same way dmu_sync() does.  Since the override path in dbuf_write()
+ * does not go through arc_write(), the dbuf's buffer stays anonymous and
+ * is never added to the ARC.  A dbuf with anonymous data is not kept in
+ * the dbuf cache, so the buffer is freed along with the dbuf when its
+ * last hold is released: when the dirty record's write completes if no
+ * one else is using the block, or later, when the last reader or the
+ * next txg's dirty record lets go of it.
+ */
+typedef struct dmu_direct_arg {
+	dbuf_dirty_record_t	*dda_dr;
+	blkptr_t		dda_bp;
+} dmu_direct_arg_t;
+
+static void
+dmu_write_direct_ready(zio_t *zio)
+{
+	dmu_direct_arg_t *dda = zio->io_private;
+	blkptr_t *bp = zio->io_bp;
+
+	if (zio->io_error == 0) {
+		if (BP_IS_HOLE(bp)) {
+			BP_SET_LSIZE(bp, dda->dda_dr->dr_dbuf->db.db_size);
+		} else if (!BP_IS_EMBEDDED(bp)) {
+			ASSERT(BP_GET_LEVEL(bp) == 0);
+			BP_SET_FILL(bp, 1);
+		}
+	}
+}
+
+static void
+dmu_write_direct_done(zio_t *zio)
+{
+	dmu_direct_arg_t *dda = zio->io_private;
+	dbuf_dirty_record_t *dr = dda->dda_dr;
+	dmu_buf_impl_t *db = dr->dr_dbuf;
+
+	abd_put(zio->io_abd);
+
+	mutex_enter(&db->db_mtx);
+	ASSERT(dr->dt.dl.dr_override_state == DR_IN_DMU_SYNC);
+	if (zio->io_error == 0) {
+		dr->dt.dl.dr_nopwrite = !!(zio->io_flags & ZIO_FLAG_NOPWRITE);
+		dr->dt.dl.dr_overridden_by = *zio->io_bp;
+		dr->dt.dl.dr_override_state = DR_OVERRIDDEN;
+		dr->dt.dl.dr_copies = zio->io_prop.zp_copies;
+		dr->dt.dl.dr_diowrite = B_TRUE;
+
+		/* See the comment in dmu_sync_done() about old style holes */
+		if (BP_IS_HOLE(&dr->dt.dl.dr_overridden_by) &&
+		    dr->dt.dl.dr_overridden_by.blk_birth == 0)
+			BP_ZERO(&dr->dt.dl.dr_overridden_by);
+	} else {
+		/*
+		 * The data is still in the dbuf; it will be written out
+		 * the usual way when the txg syncs.
+		 */
+		dr->dt.dl.dr_override_state = DR_NOT_OVERRIDDEN;
+	}
+	cv_broadcast(&db->db_changed);
+	mutex_exit(&db->db_mtx);
+
+	kmem_free(dda, sizeof (*dda));
+}
+
+/*
+ * Write out a freshly filled level-0 dbuf from open context and record
+ * the result as the override for its dirty record in this txg.
+ */
+static void
+dmu_write_direct(zio_t *pio, dmu_buf_impl_t *db, dmu_tx_t *tx)
+{
+	objset_t *os = db->db_objset;
+	dsl_dataset_t *ds = os->os_dsl_dataset;
+	dbuf_dirty_record_t *dr;
+	dmu_direct_arg_t *dda;
+	zbookmark_phys_t zb;
+	zio_prop_t zp;
+	dnode_t *dn;
+
+	ASSERT0(db->db_level);
+	ASSERT(!os->os_encrypted);
+
+	SET_BOOKMARK(&zb, ds->ds_object,
+	    db->db.db_object, db->db_level, db->db_blkid);
+
+	dda = kmem_alloc(sizeof (dmu_direct_arg_t), KM_SLEEP);
+
+	DB_DNODE_ENTER(db);
+	dn = DB_DNODE(db);
+	dmu_write_policy(os, dn, db->db_level, WP_DMU_SYNC, &zp);
+
+	mutex_enter(&db->db_mtx);
+	dr = db->db_last_dirty;
+	ASSERT(dr != NULL && dr->dr_txg == dmu_tx_get_txg(tx));
+	ASSERT(dr->dt.dl.dr_override_state == DR_NOT_OVERRIDDEN);
+
+	/*
+	 * As in dmu_sync(), only nopwrite against the current on-disk
+	 * block pointer if it cannot change before this txg syncs.
+	 */
+	if (db->db_blkptr != NULL)
+		dda->dda_bp = *db->db_blkptr;
+	else
+		BP_ZERO(&dda->dda_bp);
+	if (dr->dr_next != NULL || dnode_block_freed(dn, db->db_blkid))
+		zp.zp_nopwrite = B_FALSE;
+
+	dda->dda_dr = dr;
+	dr->dt.dl.dr_override_state = DR_IN_DMU_SYNC;
+	mutex_exit(&db->db_mtx);
+	DB_DNODE_EXIT(db);
+
+	zio_nowait(zio_write(pio, os->os_spa, dmu_tx_get_txg(tx),
+	    &dda->dda_bp, abd_get_from_buf(dr->dt.dl.dr_data->b_data,
+	    db->db.db_size), db->db.db_size, db->db.db_size, &zp,
+	    dmu_write_direct_ready, NULL, NULL, dmu_write_direct_done, dda,
+	    ZIO_PRIORITY_SYNC_WRITE, ZIO_FLAG_CANFAIL, &zb));
+}
+
+/*
+ * Write 'size' bytes from the uio buffer, which must cover whole blocks of
+ * the object, bypassing the ARC.  The block writes are issued as each
+ * block is filled and waited for before returning; a block whose write
+ * fails is simply written again when the txg syncs.
+ */
+static int
+dmu_write_uio_direct_dnode(dnode_t *dn, uio_t *uio, uint64_t size,
+    dmu_tx_t *tx)
+{
+	dmu_buf_t **dbp;
+	int numbufs, i;
+	int err = 0;
+	zio_t *pio;
+
+	err = dmu_buf_hold_array_by_dnode(dn, uio_offset(uio), size,
+	    FALSE, FTAG, &numbufs, &dbp, 0);
+	if (err)
+		return (err);
+
+	pio = zio_root(dn->dn_objset->os_spa, NULL, NULL, ZIO_FLAG_CANFAIL);
+
+	for (i = 0; i < numbufs; i++) {
+		dmu_buf_t *db = dbp[i];
+
+		ASSERT3U(db->db_offset, ==, uio_offset(uio));
+		ASSERT3U(db->db_size, <=, size);
+
+		dmu_buf_will_fill(db, tx);
+		err = uiomove((char *)db->db_data, db->db_size,
+		    UIO_WRITE, uio);
+		dmu_buf_fill_done(db, tx);
+		if (err)
+			break;
+
+		dmu_write_direct(pio, (dmu_buf_impl_t *)db, tx);
+		size -= db->db_size;
+	}
+
+	(void) zio_wait(pio);
+
+	dmu_buf_rele_array(dbp, numbufs, FTAG);
+	return (err);
+}
+
+int
+dmu_write_uio_direct(dmu_buf_t *zdb, uio_t *uio, uint64_t size,
+    dmu_tx_t *tx)
+{
+	dmu_buf_impl_t *db = (dmu_buf_impl_t *)zdb;
+	dnode_t *dn;
+	int err;
+
+	if (size == 0)
+		return (0);
+
+	DB_DNODE_ENTER(db);
+	dn = DB_DNODE(db);
+	if (dn->dn_objset->os_encrypted || !ISP2(dn->dn_datablksz) ||
+	    P2PHASE(uio_offset(uio), dn->dn_datablksz) != 0 ||
+	    P2PHASE(size, dn->dn_datablksz) != 0)
+		err = dmu_write_uio_dnode(dn, uio, size, tx);
+	else
+		err = dmu_write_uio_direct_dnode(dn, uio, size, tx);
+	DB_DNODE_EXIT(db);
+
+	return (err);
+}
+
+/*
+ * Read a single block of the object from disk into buf, without going
+ * through the dbuf layer.  Returns EAGAIN if the block has to be read
+ * through the dbuf layer instead.
+ */
+static int
+dmu_read_direct_block(dnode_t *dn, uint64_t blkid, void *buf)
+{
+	objset_t *os = dn->dn_objset;
+	uint64_t blksz = dn->dn_datablksz;
+	dmu_buf_impl_t *db;
+	zbookmark_phys_t zb;
+	blkptr_t bp;
+	abd_t *abd;
+	int err;
+
+	rw_enter(&dn->dn_struct_rwlock, RW_READER);
+	db = dbuf_find(os, dn->dn_object, 0, blkid);
+	if (db != NULL) {
+		mutex_exit(&db->db_mtx);
+		rw_exit(&dn->dn_struct_rwlock);
+		return (SET_ERROR(EAGAIN));
+	}
+	if (dnode_block_freed(dn, blkid)) {
+		rw_exit(&dn->dn_struct_rwlock);
+		return (SET_ERROR(EAGAIN));
+	}
+	err = dbuf_dnode_findbp(dn, 0, blkid, &bp);
+	rw_exit(&dn->dn_struct_rwlock);
+	if (err != 0)
+		return (SET_ERROR(EAGAIN));
+
+	if (BP_IS_HOLE(&bp)) {
+		bzero(buf, blksz);
+		return (0);
+	}
+
+	if (BP_IS_PROTECTED(&bp) || BP_GET_LSIZE(&bp) != blksz)
+		return (SET_ERROR(EAGAIN));
+
+	SET_BOOKMARK(&zb, os->os_dsl_dataset ?
+	    os->os_dsl_dataset->ds_object : DMU_META_OBJSET,
+	    dn->dn_object, 0, blkid);
+
+	abd = abd_get_from_buf(buf, blksz);
+	err = zio_wait(zio_read(NULL, os->os_spa, &bp, abd, blksz,
+	    NULL, NULL, ZIO_PRIORITY_SYNC_READ, ZIO_FLAG_CANFAIL, &zb));
+	abd_put(abd);
+
+	return (err);
+}
+
+static int
+dmu_read_uio_direct_dnode(dnode_t *dn, uio_t *uio, uint64_t size)
+{
+	uint64_t blksz = dn->dn_datablksz;
+	void *buf;
+	int err = 0;
+
+	buf = zio_data_buf_alloc(blksz);
+
+	while (size > 0) {
+		uint64_t blkid = dbuf_whichblock(dn, 0, uio_offset(uio));
+
+		err = dmu_read_direct_block(dn, blkid, buf);
+		if (err == EAGAIN)
+			err = dmu_read_uio_dnode(dn, uio, blksz);
+		else if (err == 0)
+			err = uiomove(buf, blksz, UIO_READ, uio);
+		if (err)
+			break;
+
+		size -= blksz;
+	}
+
+	zio_data_buf_free(buf, blksz);
+	return (err);
+}
+
+/*
+ * Read 'size' bytes into the uio buffer, bypassing the ARC if the range
+ * covers whole blocks of the object; otherwise this is dmu_read_uio_dbuf().
+ */
+int
+dmu_read_uio_direct(dmu_buf_t *zdb, uio_t *uio, uint64_t size)
+{
+	dmu_buf_impl_t *db = (dmu_buf_impl_t *)zdb;
+	dnode_t *dn;
+	int err;
+
+	if (size == 0)
+		return (0);
+
+	DB_DNODE_ENTER(db);
+	dn = DB_DNODE(db);
+	dmu_iolimit_read(dn->dn_objset, dn->dn_datablksz, uio_offset(uio),
+	    size);
+	if (dn->dn_objset->os_encrypted || !ISP2(dn->dn_datablksz) ||
+	    P2PHASE(uio_offset(uio), dn->dn_datablksz) != 0 ||
+	    P2PHASE(size, dn->dn_datablksz) != 0)
+		err = dmu_read_uio_dnode(dn, uio, size);
+	else
+		err = dmu_read_uio_direct_dnode(dn, uio, size);
+	DB_DNODE_EXIT(db);
+
+	return (err);
+}
+
 /*
  * Support function for IOKit, iomem is an IOMemoryDescriptor passed back
  * into zvolIO.cpp
@@ -1712,6 +2212,8 @@ dmu_read_iokit_dbuf(dmu_buf_t *zdb, uint64_t object, uint64_t *offset,
 	DB_DNODE_ENTER(db);
 	dn = DB_DNODE(db);
 
+	dmu_iolimit_read(dn->dn_objset, dn->dn_datablksz, position + *offset,
+	    *size);
 
 	dmu_buf_t **dbp;
 	int numbufs, i;
@@ -2295,6 +2797,19 @@ dmu_sync(zio_t *pio, uint64_t txg, dmu_sync_cb_t *done, zgd_t *zgd)
 	DB_DNODE_EXIT(db);
 
 	ASSERT(dr->dr_txg == txg);
+	if (dr->dt.dl.dr_override_state == DR_OVERRIDDEN &&
+	    dr->dt.dl.dr_diowrite) {
+		/*
+		 * A direct I/O write has already put this block on disk
+		 * (see dmu_write_direct()); log its block pointer as is.
+		 */
+		*zgd->zgd_bp = dr->dt.dl.dr_overridden_by;
+		mutex_exit(&db->db_mtx);
+		zil_lwb_add_block(zgd->zgd_lwb, zgd->zgd_bp);
+		done(zgd, 0);
+		return (0);
+	}
+
 	if (dr->dt.dl.dr_override_state == DR_IN_DMU_SYNC ||
 	    dr->dt.dl.dr_override_state == DR_OVERRIDDEN) {
 		/*
@@ -2425,6 +2940,7 @@ dmu_write_policy(objset_t *os, dnode_t *dn, int level, int wp, zio_prop_t *zp)
 	    (wp & WP_SPILL));
 	enum zio_checksum checksum = os->os_checksum;
 	enum zio_compress compress = os->os_compress;
+	uint8_t complevel = os->os_complevel;
 	enum zio_checksum dedup_checksum = os->os_dedup_checksum;
 	boolean_t dedup = B_FALSE;
 	boolean_t nopwrite = B_FALSE;
@@ -2446,6 +2962,7 @@ dmu_write_policy(objset_t *os, dnode_t *dn, int level, int wp, zio_prop_t *zp)
 		 */
 		compress = zio_compress_select(os->os_spa,
 		    ZIO_COMPRESS_ON, ZIO_COMPRESS_ON);
+		complevel = ZIO_COMPLEVEL_INHERIT;
 
 		/*
 		 * Metadata always gets checksummed.  If the data
@@ -2539,6 +3056,7 @@ dmu_write_policy(objset_t *os, dnode_t *dn, int level, int wp, zio_prop_t *zp)
 	}
 
 	zp->zp_compress = compress;
+	zp->zp_complevel = complevel;
 	zp->zp_checksum = checksum;
 	zp->zp_type = (wp & WP_SPILL) ? dn->dn_bonustype : type;
 	zp->zp_level = level;
@@ -2553,6 +3071,9 @@ dmu_write_policy(objset_t *os, dnode_t *dn, int level, int wp, zio_prop_t *zp)
 	bzero(zp->zp_mac, ZIO_DATA_MAC_LEN);
 	zp->zp_zpl_smallblk = DMU_OT_IS_FILE(zp->zp_type) ?
 	    os->os_zpl_special_smallblock : 0;
+	zp->zp_compress_stats = (compress == ZIO_COMPRESS_OFF ||
+	    compress == ZIO_COMPRESS_EMPTY) ? NULL :
+	    dmu_objset_compress_stats(os);
 
 	ASSERT3U(zp->zp_compress, !=, ZIO_COMPRESS_INHERIT);
 }
@@ -0,0 +1,214 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2024 by Pawel Jakub Dawidek
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/dmu.h>
+#include <sys/dmu_objset.h>
+#include <sys/dmu_tx.h>
+#include <sys/dmu_iolimit.h>
+#include <sys/dnode.h>
+#include <sys/dsl_dataset.h>
+#include <sys/dsl_pool.h>
+#include <sys/spa.h>
+
+/*
+ * Per-dataset I/O rate limits
+ *
+ * The limit_bw_read, limit_bw_write, limit_op_read and limit_op_write
+ * properties cap how many bytes, and how many blocks, a dataset may read
+ * or write per second.  They are inherited like any other property, but
+ * each dataset is limited on its own: a limit set on a parent applies to
+ * every descendant separately, not to their sum.
+ *
+ * Limits are enforced where the I/O enters the DMU on behalf of the
+ * dataset, before any of it is done:
+ *
+ *  - reads in dmu_read_uio*() and dmu_read_iokit_dbuf(), the entry points
+ *    of file and volume reads, whether or not the data is cached;
+ *  - writes in dmu_tx_assign(), charged with the length of the
+ *    transaction's write holds, before the tx is assigned to a txg so
+ *    that a throttled writer never holds a txg open.
+ *
+ * An operation is a block of the object being read or written, so a
+ * large sequential request counts as several operations.
+ *
+ * Each limit is a token bucket, implemented as a "generic cell rate
+ * algorithm": the bucket is represented by its theoretical arrival time
+ * (TAT), the time at which everything charged to it so far would have
+ * been done at the configured rate.  A request may start once the TAT is
+ * no more than zfs_iolimit_burst_ms in the future, and then moves the TAT
+ * forward by its own cost.  Requests therefore start in the order they
+ * were charged, a dataset that has been idle may burst for up to
+ * zfs_iolimit_burst_ms worth of I/O, and a single large request is never
+ * delayed by its own size, only the requests after it are.
+ *
+ * Time spent waiting is reported in the zfs/<pool>/objset-0x<id> kstat
+ * (see dmu_objset_kstat_create()).
+ */
+
+uint64_t zfs_iolimit_burst_ms = 100;
+
+void
+dmu_iolimit_init(dmu_iolimit_t *iol)
+{
+	mutex_init(&iol->iol_lock, NULL, MUTEX_DEFAULT, NULL);
+}
+
+void
+dmu_iolimit_fini(dmu_iolimit_t *iol)
+{
+	mutex_destroy(&iol->iol_lock);
+}
+
+void
+dmu_iolimit_stats_init(dmu_iolimit_stats_t *st)
+{
+	kstat_named_init(&st->iols_reads_delayed, "reads_delayed",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->iols_read_delay_time, "read_delay_time",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->iols_writes_delayed, "writes_delayed",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&st->iols_write_delay_time, "write_delay_time",
+	    KSTAT_DATA_UINT64);
+}
+
+/*
+ * Charge 'amount' to the bucket whose TAT is at 'tatp'.  Returns the time
+ * the request has to wait for, or 0 if it may start right away.
+ */
+static hrtime_t
+dmu_iolimit_bucket(hrtime_t *tatp, uint64_t limit, uint64_t amount,
+    hrtime_t now)
+{
+	hrtime_t burst = MSEC2NSEC(zfs_iolimit_burst_ms);
+	hrtime_t tat, wakeup;
+
+	if (limit == 0 || amount == 0)
+		return (0);
+
+	tat = MAX(*tatp, now);
+	wakeup = tat - burst;
+	amount = MIN(amount, UINT64_MAX / NANOSEC);
+	*tatp = tat + (hrtime_t)(amount * NANOSEC / limit);
+
+	return (wakeup > now ? wakeup : 0);
+}
+
+static void
+dmu_iolimit_charge(objset_t *os, dmu_iolimit_type_t type, uint64_t bytes,
+    uint64_t ops)
+{
+	dmu_iolimit_t *iol = &os->os_iolimit;
+	dmu_iolimit_stats_t *st = &os->os_kstat_values.oks_iolimit;
+	hrtime_t now, wakeup;
+
+	if (iol->iol_bw[type] == 0 && iol->iol_ops[type] == 0)
+		return;
+
+	/* Never stall the sync thread on behalf of a dataset. */
+	if (os->os_dsl_dataset == NULL ||
+	    dsl_pool_sync_context(dmu_objset_pool(os)))
+		return;
+
+	now = gethrtime();
+	mutex_enter(&iol->iol_lock);
+	wakeup = MAX(
+	    dmu_iolimit_bucket(&iol->iol_bw_tat[type], iol->iol_bw[type],
+	    bytes, now),
+	    dmu_iolimit_bucket(&iol->iol_ops_tat[type], iol->iol_ops[type],
+	    ops, now));
+	mutex_exit(&iol->iol_lock);
+
+	dmu_objset_kstat_create(os);
+
+	if (wakeup == 0)
+		return;
+
+	if (type == DMU_IOLIMIT_READ) {
+		atomic_inc_64(&st->iols_reads_delayed.value.ui64);
+		atomic_add_64(&st->iols_read_delay_time.value.ui64,
+		    wakeup - now);
+	} else {
+		atomic_inc_64(&st->iols_writes_delayed.value.ui64);
+		atomic_add_64(&st->iols_write_delay_time.value.ui64,
+		    wakeup - now);
+	}
+
+	zfs_sleep_until(wakeup);
+}
+
+/*
+ * Number of blocks of size 'blksz' spanned by [offset, offset + length).
+ */
+static uint64_t
+dmu_iolimit_blocks(uint64_t blksz, uint64_t offset, uint64_t length)
+{
+	if (length == 0)
+		return (0);
+	if (blksz == 0)
+		return (1);
+	return ((offset + length - 1) / blksz - offset / blksz + 1);
+}
+
+/*
+ * Wait until the objset may read 'length' bytes at 'offset' of an object
+ * with 'blksz' blocks.
+ */
+void
+dmu_iolimit_read(objset_t *os, uint64_t blksz, uint64_t offset,
+    uint64_t length)
+{
+	dmu_iolimit_charge(os, DMU_IOLIMIT_READ, length,
+	    dmu_iolimit_blocks(blksz, offset, length));
+}
+
+/*
+ * Wait until the objset may do the writes held by the transaction.
+ * Called from dmu_tx_assign() for TXG_WAIT transactions, before they are
+ * assigned.
+ */
+void
+dmu_iolimit_tx(dmu_tx_t *tx)
+{
+	objset_t *os = tx->tx_objset;
+	uint64_t bytes = 0, ops = 0;
+
+	if (os == NULL)
+		return;
+
+	for (dmu_tx_hold_t *txh = list_head(&tx->tx_holds); txh != NULL;
+	    txh = list_next(&tx->tx_holds, txh)) {
+		if (txh->txh_type != THT_WRITE)
+			continue;
+		bytes += txh->txh_arg2;
+		ops += dmu_iolimit_blocks(txh->txh_dnode != NULL ?
+		    txh->txh_dnode->dn_datablksz : 0, txh->txh_arg1,
+		    txh->txh_arg2);
+	}
+
+	if (bytes != 0)
+		dmu_iolimit_charge(os, DMU_IOLIMIT_WRITE, bytes, ops);
+}
@@ -185,8 +185,9 @@ compression_changed_cb(void *arg, uint64_t newval)
 	 */
 	ASSERT(newval != ZIO_COMPRESS_INHERIT);
 
-	os->os_compress = zio_compress_select(os->os_spa, newval,
-	    ZIO_COMPRESS_ON);
+	os->os_compress = zio_compress_select(os->os_spa,
+	    ZIO_COMPRESS_ALGO(newval), ZIO_COMPRESS_ON);
+	os->os_complevel = ZIO_COMPRESS_LEVEL(newval);
 }
 
 static void
@@ -265,6 +266,52 @@ sync_changed_cb(void *arg, uint64_t newval)
 		zil_set_sync(os->os_zil, newval);
 }
 
+static void
+direct_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	/*
+	 * Inheritance and range checking should have been done by now.
+	 */
+	ASSERT(newval == ZFS_DIRECT_STANDARD || newval == ZFS_DIRECT_ALWAYS ||
+	    newval == ZFS_DIRECT_DISABLED);
+
+	os->os_direct = newval;
+}
+
+static void
+limit_bw_read_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	os->os_iolimit.iol_bw[DMU_IOLIMIT_READ] = newval;
+}
+
+static void
+limit_bw_write_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	os->os_iolimit.iol_bw[DMU_IOLIMIT_WRITE] = newval;
+}
+
+static void
+limit_op_read_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	os->os_iolimit.iol_ops[DMU_IOLIMIT_READ] = newval;
+}
+
+static void
+limit_op_write_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	os->os_iolimit.iol_ops[DMU_IOLIMIT_WRITE] = newval;
+}
+
 static void
 redundant_metadata_changed_cb(void *arg, uint64_t newval)
 {
@@ -468,6 +515,12 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 		bzero(os->os_phys, size);
 	}
 
+	dmu_iolimit_init(&os->os_iolimit);
+	kstat_named_init(&os->os_kstat_values.oks_dataset_name,
+	    "dataset_name", KSTAT_DATA_STRING);
+	dmu_iolimit_stats_init(&os->os_kstat_values.oks_iolimit);
+	zio_compress_stats_init(&os->os_kstat_values.oks_compress);
+
 	/*
 	 * Note: the changed_cb will be called once before the register
 	 * func returns, thus changing the checksum/compression from the
@@ -497,6 +550,16 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 			    zfs_prop_to_name(ZFS_PROP_SECONDARYCACHE),
 			    secondary_cache_changed_cb, os);
 		}
+		if (err == 0) {
+			err = dsl_prop_register(ds,
+			    zfs_prop_to_name(ZFS_PROP_LIMIT_BW_READ),
+			    limit_bw_read_changed_cb, os);
+		}
+		if (err == 0) {
+			err = dsl_prop_register(ds,
+			    zfs_prop_to_name(ZFS_PROP_LIMIT_OP_READ),
+			    limit_op_read_changed_cb, os);
+		}
 		if (!ds->ds_is_snapshot) {
 			if (err == 0) {
 				err = dsl_prop_register(ds,
@@ -528,6 +591,21 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 				    zfs_prop_to_name(ZFS_PROP_SYNC),
 				    sync_changed_cb, os);
 			}
+			if (err == 0) {
+				err = dsl_prop_register(ds,
+				    zfs_prop_to_name(ZFS_PROP_DIRECT),
+				    direct_changed_cb, os);
+			}
+			if (err == 0) {
+				err = dsl_prop_register(ds,
+				    zfs_prop_to_name(ZFS_PROP_LIMIT_BW_WRITE),
+				    limit_bw_write_changed_cb, os);
+			}
+			if (err == 0) {
+				err = dsl_prop_register(ds,
+				    zfs_prop_to_name(ZFS_PROP_LIMIT_OP_WRITE),
+				    limit_op_write_changed_cb, os);
+			}
 			if (err == 0) {
 				err = dsl_prop_register(ds,
 				    zfs_prop_to_name(
@@ -555,6 +633,7 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 			dsl_pool_config_exit(dmu_objset_pool(os), FTAG);
 		if (err != 0) {
 			arc_buf_destroy(os->os_phys_buf, &os->os_phys_buf);
+			dmu_iolimit_fini(&os->os_iolimit);
 			kmem_free(os, sizeof (objset_t));
 			return (err);
 		}
@@ -562,12 +641,14 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 		/* It's the meta-objset. */
 		os->os_checksum = ZIO_CHECKSUM_FLETCHER_4;
 		os->os_compress = ZIO_COMPRESS_ON;
+		os->os_complevel = ZIO_COMPLEVEL_INHERIT;
 		os->os_encrypted = B_FALSE;
 		os->os_copies = spa_max_replication(spa);
 		os->os_dedup_checksum = ZIO_CHECKSUM_OFF;
 		os->os_dedup_verify = B_FALSE;
 		os->os_logbias = ZFS_LOGBIAS_LATENCY;
 		os->os_sync = ZFS_SYNC_STANDARD;
+		os->os_direct = ZFS_DIRECT_DISABLED;
 		os->os_primary_cache = ZFS_CACHE_ALL;
 		os->os_secondary_cache = ZFS_CACHE_ALL;
 		os->os_dnodesize = DNODE_MIN_SIZE;
@@ -948,6 +1029,9 @@ dmu_objset_evict_done(objset_t *os)
 	mutex_destroy(&os->os_userused_lock);
 	mutex_destroy(&os->os_obj_lock);
 	mutex_destroy(&os->os_user_ptr_lock);
+	dmu_iolimit_fini(&os->os_iolimit);
+	if (os->os_kstat != NULL)
+		kstat_delete(os->os_kstat);
 	for (int i = 0; i < TXG_SIZE; i++) {
 		multilist_destroy(os->os_dirty_dnodes[i]);
 	}
@@ -961,6 +1045,61 @@ dmu_objset_snap_cmtime(objset_t *os)
 	return (dsl_dir_snap_cmtime(os->os_dsl_dataset->ds_dir));
 }
 
+/*
+ * Create the zfs/<pool>/objset-0x<id> kstat of a dataset.  It reports the
+ * time the dataset's I/O waited for its limits (see dmu_iolimit.c) and the
+ * records it wrote uncompressed although compression is enabled (see
+ * zio_write_compress()), and is created the first time either happens.
+ */
+void
+dmu_objset_kstat_create(objset_t *os)
+{
+	objset_kstat_values_t *oks = &os->os_kstat_values;
+	char *module, *name;
+	kstat_t *ksp;
+
+	ASSERT(os->os_dsl_dataset != NULL);
+
+	if (os->os_kstat_tried != 0 ||
+	    atomic_cas_32(&os->os_kstat_tried, 0, 1) != 0)
+		return;
+
+	dsl_dataset_name(os->os_dsl_dataset, os->os_kstat_dsname);
+	oks->oks_dataset_name.value.string.addr.ptr = os->os_kstat_dsname;
+	oks->oks_dataset_name.value.string.len =
+	    strlen(os->os_kstat_dsname) + 1;
+
+	module = kmem_asprintf("zfs/%s", spa_name(os->os_spa));
+	name = kmem_asprintf("objset-0x%llx",
+	    (u_longlong_t)dmu_objset_id(os));
+	ksp = kstat_create(module, 0, name, "dataset", KSTAT_TYPE_NAMED,
+	    sizeof (objset_kstat_values_t) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (ksp != NULL) {
+		ksp->ks_data = oks;
+		kstat_install(ksp);
+	}
+	strfree(name);
+	strfree(module);
+
+	os->os_kstat = ksp;
+}
+
+/*
+ * Counters for records the write pipeline left uncompressed although the
+ * dataset has compression enabled (see zio_write_compress()), or NULL for
+ * the MOS.
+ */
+zio_compress_stats_t *
+dmu_objset_compress_stats(objset_t *os)
+{
+	if (os->os_dsl_dataset == NULL)
+		return (NULL);
+
+	dmu_objset_kstat_create(os);
+	return (&os->os_kstat_values.oks_compress);
+}
+
 objset_t *
 dmu_objset_create_impl_dnstats(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
     dmu_objset_type_t type, int levels, int blksz, int ibs, dmu_tx_t *tx)
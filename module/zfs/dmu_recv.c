@@ -61,6 +61,7 @@
 #include <sys/policy.h>
 
 int zfs_recv_queue_length = SPA_MAXBLOCKSIZE;
+uint64_t zfs_recv_writer_threads = 8;
 
 static char *dmu_recv_tag = "dmu_recv_tag";
 const char *recv_clone_name = "%recv";
@@ -260,6 +261,14 @@ dmu_recv_begin_check(void *arg, dmu_tx_t *tx)
 	    !spa_feature_is_enabled(dp->dp_spa, SPA_FEATURE_LZ4_COMPRESS))
 		return (SET_ERROR(ENOTSUP));
 
+	/*
+	 * Compressed and raw streams carry zstd blocks as they are, and
+	 * their birth activates the zstd feature, which must be enabled.
+	 */
+	if ((featureflags & DMU_BACKUP_FEATURE_ZSTD) &&
+	    !spa_feature_is_enabled(dp->dp_spa, SPA_FEATURE_ZSTD_COMPRESS))
+		return (SET_ERROR(ENOTSUP));
+
 	/*
 	 * The receiving code doesn't know how to translate large blocks
 	 * to smaller ones, so the pool must have the LARGE_BLOCKS
@@ -608,6 +617,14 @@ dmu_recv_resume_begin_check(void *arg, dmu_tx_t *tx)
 	    !spa_feature_is_enabled(dp->dp_spa, SPA_FEATURE_LZ4_COMPRESS))
 		return (SET_ERROR(ENOTSUP));
 
+	/*
+	 * Compressed and raw streams carry zstd blocks as they are, and
+	 * their birth activates the zstd feature, which must be enabled.
+	 */
+	if ((featureflags & DMU_BACKUP_FEATURE_ZSTD) &&
+	    !spa_feature_is_enabled(dp->dp_spa, SPA_FEATURE_ZSTD_COMPRESS))
+		return (SET_ERROR(ENOTSUP));
+
 	/*
 	 * The receiving code doesn't know how to translate large blocks
 	 * to smaller ones, so the pool must have the LARGE_BLOCKS
@@ -834,6 +851,7 @@ struct receive_record_arg {
 	int payload_size;
 	uint64_t bytes_read; /* bytes read from stream when record created */
 	boolean_t eos_marker; /* Marks the end of the stream */
+	boolean_t barrier; /* Marks a barrier between the writer threads */
 	bqueue_node_t node;
 };
 
@@ -843,12 +861,13 @@ struct receive_writer_arg {
 	bqueue_t q;
 
 	/*
-	 * These three args are used to signal to the main thread that we're
-	 * done.
+	 * These args are used to signal to the main thread that we're done,
+	 * or that we have applied every record queued ahead of a barrier.
 	 */
 	kmutex_t mutex;
 	kcondvar_t cv;
 	boolean_t done;
+	boolean_t drained;
 
 	int err;
 	/* A map from guid to dataset to help handle dedup'd streams. */
@@ -2412,9 +2431,36 @@ receive_process_record(struct receive_writer_arg *rwa,
 	return (err);
 }
 
+/*
+ * Apply one record and free it.
+ */
+static void
+receive_writer_apply(struct receive_writer_arg *rwa,
+    struct receive_record_arg *rrd)
+{
+	/*
+	 * If there's an error, the main thread will stop putting things
+	 * on the queue, but we need to clear everything in it before we
+	 * can exit.
+	 */
+	if (rwa->err == 0) {
+		rwa->err = receive_process_record(rwa, rrd);
+	} else if (rrd->arc_buf != NULL) {
+		dmu_return_arcbuf(rrd->arc_buf);
+		rrd->arc_buf = NULL;
+		rrd->payload = NULL;
+	} else if (rrd->payload != NULL) {
+		kmem_free(rrd->payload, rrd->payload_size);
+		rrd->payload = NULL;
+	}
+	kmem_free(rrd, sizeof (*rrd));
+}
+
 /*
  * dmu_recv_stream's worker thread; pull records off the queue, and then call
- * receive_process_record  When we're done, signal the main thread and exit.
+ * receive_process_record  When we reach a barrier, tell the main thread that
+ * everything before it has been applied.  When we're done, signal the main
+ * thread and exit.
  */
 static void
 receive_writer_thread(void *arg)
@@ -2423,22 +2469,15 @@ receive_writer_thread(void *arg)
 	struct receive_record_arg *rrd;
 	for (rrd = bqueue_dequeue(&rwa->q); !rrd->eos_marker;
 	    rrd = bqueue_dequeue(&rwa->q)) {
-		/*
-		 * If there's an error, the main thread will stop putting things
-		 * on the queue, but we need to clear everything in it before we
-		 * can exit.
-		 */
-		if (rwa->err == 0) {
-			rwa->err = receive_process_record(rwa, rrd);
-		} else if (rrd->arc_buf != NULL) {
-			dmu_return_arcbuf(rrd->arc_buf);
-			rrd->arc_buf = NULL;
-			rrd->payload = NULL;
-		} else if (rrd->payload != NULL) {
-			kmem_free(rrd->payload, rrd->payload_size);
-			rrd->payload = NULL;
+		if (rrd->barrier) {
+			kmem_free(rrd, sizeof (*rrd));
+			mutex_enter(&rwa->mutex);
+			rwa->drained = B_TRUE;
+			cv_signal(&rwa->cv);
+			mutex_exit(&rwa->mutex);
+			continue;
 		}
-		kmem_free(rrd, sizeof (*rrd));
+		receive_writer_apply(rwa, rrd);
 	}
 	kmem_free(rrd, sizeof (*rrd));
 	mutex_enter(&rwa->mutex);
@@ -2448,6 +2487,94 @@ receive_writer_thread(void *arg)
 	thread_exit();
 }
 
+/*
+ * Pick the writer thread that applies a record, or return -1 if the record
+ * may only be applied once every writer thread has caught up with it.
+ *
+ * Records are partitioned by block of dnodes rather than by object, so that
+ * everything touching one dnode block is applied in stream order by a single
+ * thread: a multi-slot dnode may free the slots of its neighbours, and a
+ * DRR_OBJECT_RANGE record holds the encryption parameters used by the
+ * DRR_OBJECT records of its block.
+ */
+static int
+receive_writer_pick(struct receive_record_arg *rrd, int nwriters)
+{
+	dmu_replay_record_t *drr = &rrd->header;
+	uint64_t object;
+
+	if (nwriters == 1)
+		return (0);
+
+	switch (drr->drr_type) {
+	case DRR_OBJECT:
+		object = drr->drr_u.drr_object.drr_object;
+		break;
+	case DRR_WRITE:
+		object = drr->drr_u.drr_write.drr_object;
+		break;
+	case DRR_WRITE_BYREF:
+		/*
+		 * A block referenced from this same stream may have been
+		 * written by any of the writer threads.
+		 */
+		if (drr->drr_u.drr_write_byref.drr_toguid ==
+		    drr->drr_u.drr_write_byref.drr_refguid)
+			return (-1);
+		object = drr->drr_u.drr_write_byref.drr_object;
+		break;
+	case DRR_WRITE_EMBEDDED:
+		object = drr->drr_u.drr_write_embedded.drr_object;
+		break;
+	case DRR_FREE:
+		object = drr->drr_u.drr_free.drr_object;
+		break;
+	case DRR_SPILL:
+		object = drr->drr_u.drr_spill.drr_object;
+		break;
+	case DRR_OBJECT_RANGE:
+		object = drr->drr_u.drr_object_range.drr_firstobj;
+		break;
+	default:
+		/* DRR_FREEOBJECTS may cover any number of dnode blocks. */
+		return (-1);
+	}
+
+	return ((object >> DNODES_PER_BLOCK_SHIFT) % nwriters);
+}
+
+/*
+ * Wait until every writer thread has applied all the records queued to it.
+ */
+static void
+receive_writers_drain(struct receive_writer_arg *rwa, int nwriters)
+{
+	struct receive_record_arg *rrd;
+
+	for (int i = 0; i < nwriters; i++) {
+		rrd = kmem_zalloc(sizeof (*rrd), KM_SLEEP);
+		rrd->barrier = B_TRUE;
+		bqueue_enqueue(&rwa[i].q, rrd, 1);
+	}
+	for (int i = 0; i < nwriters; i++) {
+		mutex_enter(&rwa[i].mutex);
+		while (!rwa[i].drained)
+			cv_wait(&rwa[i].cv, &rwa[i].mutex);
+		rwa[i].drained = B_FALSE;
+		mutex_exit(&rwa[i].mutex);
+	}
+}
+
+static int
+receive_writers_err(struct receive_writer_arg *rwa, int nwriters)
+{
+	for (int i = 0; i < nwriters; i++) {
+		if (rwa[i].err != 0)
+			return (rwa[i].err);
+	}
+	return (0);
+}
+
 static int
 resume_check(struct receive_arg *ra, nvlist_t *begin_nvl)
 {
@@ -2475,14 +2602,23 @@ resume_check(struct receive_arg *ra, nvlist_t *begin_nvl)
 }
 
 /*
- * Read in the stream's records, one by one, and apply them to the pool.  There
- * are two threads involved; the thread that calls this function will spin up a
- * worker thread, read the records off the stream one by one, and issue
- * prefetches for any necessary indirect blocks.  It will then push the records
- * onto an internal blocking queue.  The worker thread will pull the records off
- * the queue, and actually write the data into the DMU.  This way, the worker
- * thread doesn't have to wait for reads to complete, since everything it needs
- * (the indirect blocks) will be prefetched.
+ * Read in the stream's records, one by one, and apply them to the pool.  The
+ * thread that calls this function will spin up the worker threads, read the
+ * records off the stream one by one, and issue prefetches for any necessary
+ * indirect blocks.  It will then push each record onto the blocking queue of
+ * the worker that owns its object (see receive_writer_pick()).  The worker
+ * threads pull the records off their queues, and actually write the data into
+ * the DMU.  This way, the workers don't have to wait for reads to complete,
+ * since everything they need (the indirect blocks) will be prefetched, and
+ * records for different objects are applied in parallel.
+ *
+ * Records that can't be tied to a single worker are barriers: the main thread
+ * waits for every worker to apply the records queued ahead of it, and then
+ * applies it itself.  The stream's end is handled the same way, so nothing
+ * after the loop below runs before every record has been applied.
+ *
+ * Resumable receives use a single worker, since the resume state saved with
+ * each txg must point at a record before which everything has been applied.
  *
  * NB: callers *must* call dmu_recv_end() if this succeeds.
  */
@@ -2493,13 +2629,22 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp,
 	int err = 0;
 	struct receive_arg *ra;
 	struct receive_writer_arg *rwa;
+	int nwriters;
+	uint64_t max_object;
 	int featureflags;
 	uint32_t payloadlen;
 	void *payload;
 	nvlist_t *begin_nvl = NULL;
 
+	if (drc->drc_resumable) {
+		nwriters = 1;
+	} else {
+		nwriters = (int)MIN(MAX(zfs_recv_writer_threads, 1),
+		    max_ncpus);
+	}
+
 	ra = kmem_zalloc(sizeof (*ra), KM_SLEEP);
-	rwa = kmem_zalloc(sizeof (*rwa), KM_SLEEP);
+	rwa = kmem_zalloc(nwriters * sizeof (*rwa), KM_SLEEP);
 
 	ra->byteswap = drc->drc_byteswap;
 	ra->raw = drc->drc_raw;
@@ -2624,36 +2769,46 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp,
 			goto out;
 	}
 
-	(void) bqueue_init(&rwa->q,
-	    MAX(zfs_recv_queue_length, 2 * zfs_max_recordsize),
-	    offsetof(struct receive_record_arg, node));
-	cv_init(&rwa->cv, NULL, CV_DEFAULT, NULL);
-	mutex_init(&rwa->mutex, NULL, MUTEX_DEFAULT, NULL);
-	rwa->os = ra->os;
-	rwa->byteswap = drc->drc_byteswap;
-	rwa->resumable = drc->drc_resumable;
-	rwa->raw = drc->drc_raw;
-	rwa->spill = drc->drc_spill;
+	for (int i = 0; i < nwriters; i++) {
+		struct receive_writer_arg *w = &rwa[i];
+
+		(void) bqueue_init(&w->q,
+		    MAX(zfs_recv_queue_length / nwriters,
+		    2 * zfs_max_recordsize),
+		    offsetof(struct receive_record_arg, node));
+		cv_init(&w->cv, NULL, CV_DEFAULT, NULL);
+		mutex_init(&w->mutex, NULL, MUTEX_DEFAULT, NULL);
+		w->os = ra->os;
+		w->byteswap = drc->drc_byteswap;
+		w->resumable = drc->drc_resumable;
+		w->raw = drc->drc_raw;
+		w->spill = drc->drc_spill;
+		w->guid_to_ds_map = rwa->guid_to_ds_map;
+	}
 	rwa->os->os_raw_receive = drc->drc_raw;
 
-	(void) thread_create(NULL, 0, receive_writer_thread, rwa, 0, curproc,
-	    TS_RUN, minclsyspri);
+	for (int i = 0; i < nwriters; i++) {
+		(void) thread_create(NULL, 0, receive_writer_thread, &rwa[i],
+		    0, curproc, TS_RUN, minclsyspri);
+	}
 	/*
-	 * We're reading rwa->err without locks, which is safe since we are the
-	 * only reader, and the worker thread is the only writer.  It's ok if we
-	 * miss a write for an iteration or two of the loop, since the writer
-	 * thread will keep freeing records we send it until we send it an eos
-	 * marker.
+	 * We're reading the workers' err without locks, which is safe since we
+	 * are the only reader, and each worker thread is the only writer of its
+	 * own.  It's ok if we miss a write for an iteration or two of the loop,
+	 * since the writer threads will keep freeing records we send them until
+	 * we send them an eos marker.
 	 *
-	 * We can leave this loop in 3 ways:  First, if rwa->err is
-	 * non-zero.  In that case, the writer thread will free the rrd we just
+	 * We can leave this loop in 3 ways:  First, if a worker's err is
+	 * non-zero.  In that case, the writer threads will free the rrd we just
 	 * pushed.  Second, if  we're interrupted; in that case, either it's the
 	 * first loop and ra->rrd was never allocated, or it's later and ra->rrd
-	 * has been handed off to the writer thread who will free it.  Finally,
+	 * has been handed off to a writer thread who will free it.  Finally,
 	 * if receive_read_record fails or we're at the end of the stream, then
 	 * we free ra->rrd and exit.
 	 */
-	while (rwa->err == 0) {
+	while (receive_writers_err(rwa, nwriters) == 0) {
+		int w;
+
 		if (issig(JUSTLOOKING) && issig(FORREAL)) {
 			err = SET_ERROR(EINTR);
 			break;
@@ -2671,20 +2826,38 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp,
 			break;
 		}
 
-		bqueue_enqueue(&rwa->q, ra->rrd,
-		    sizeof (struct receive_record_arg) + ra->rrd->payload_size);
+		w = receive_writer_pick(ra->rrd, nwriters);
+		if (w == -1) {
+			/*
+			 * Apply the record ourselves, on behalf of the first
+			 * worker, once every worker has caught up with it.
+			 */
+			receive_writers_drain(rwa, nwriters);
+			receive_writer_apply(&rwa[0], ra->rrd);
+		} else {
+			bqueue_enqueue(&rwa[w].q, ra->rrd,
+			    sizeof (struct receive_record_arg) +
+			    ra->rrd->payload_size);
+		}
 		ra->rrd = NULL;
 	}
 	ASSERT3P(ra->rrd, ==, NULL);
-	ra->rrd = kmem_zalloc(sizeof (*ra->rrd), KM_SLEEP);
-	ra->rrd->eos_marker = B_TRUE;
-	bqueue_enqueue(&rwa->q, ra->rrd, 1);
-
-	mutex_enter(&rwa->mutex);
-	while (!rwa->done) {
-		cv_wait(&rwa->cv, &rwa->mutex);
+	for (int i = 0; i < nwriters; i++) {
+		ra->rrd = kmem_zalloc(sizeof (*ra->rrd), KM_SLEEP);
+		ra->rrd->eos_marker = B_TRUE;
+		bqueue_enqueue(&rwa[i].q, ra->rrd, 1);
+	}
+	ra->rrd = NULL;
+
+	max_object = 0;
+	for (int i = 0; i < nwriters; i++) {
+		mutex_enter(&rwa[i].mutex);
+		while (!rwa[i].done) {
+			cv_wait(&rwa[i].cv, &rwa[i].mutex);
+		}
+		mutex_exit(&rwa[i].mutex);
+		max_object = MAX(max_object, rwa[i].max_object);
 	}
-	mutex_exit(&rwa->mutex);
 
 	/*
 	 * If we are receiving a full stream as a clone, all object IDs which
@@ -2692,7 +2865,7 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp,
 	 * by definition unused and must be freed.
 	 */
 	if (drc->drc_clone && drc->drc_drrb->drr_fromguid == 0) {
-		uint64_t obj = rwa->max_object + 1;
+		uint64_t obj = max_object + 1;
 		int free_err = 0;
 		int next_err = 0;
 
@@ -2712,11 +2885,13 @@ dmu_recv_stream(dmu_recv_cookie_t *drc, vnode_t *vp, offset_t *voffp,
 		}
 	}
 
-	cv_destroy(&rwa->cv);
-	mutex_destroy(&rwa->mutex);
-	bqueue_destroy(&rwa->q);
+	for (int i = 0; i < nwriters; i++) {
+		cv_destroy(&rwa[i].cv);
+		mutex_destroy(&rwa[i].mutex);
+		bqueue_destroy(&rwa[i].q);
+	}
 	if (err == 0)
-		err = rwa->err;
+		err = receive_writers_err(rwa, nwriters);
 
 out:
 	/*
@@ -2744,7 +2919,7 @@ out:
 	*voffp = ra->voff;
 	objlist_destroy(&ra->ignore_objlist);
 	kmem_free(ra, sizeof (*ra));
-	kmem_free(rwa, sizeof (*rwa));
+	kmem_free(rwa, nwriters * sizeof (*rwa));
 	return (err);
 }
 
@@ -3074,3 +3249,9 @@ dmu_objset_is_receiving(objset_t *os)
 	return (os->os_dsl_dataset != NULL &&
 	    os->os_dsl_dataset->ds_owner == dmu_recv_tag);
 }
+
+#if defined(_KERNEL)
+module_param(zfs_recv_writer_threads, ulong, 0644);
+MODULE_PARM_DESC(zfs_recv_writer_threads,
+	"Maximum number of threads applying a received stream");
+#endif
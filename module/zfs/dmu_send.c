@@ -61,6 +61,8 @@
 /* Set this tunable to TRUE to replace corrupt data with 0x2f5baddb10c */
 int zfs_send_corrupt_data = B_FALSE;
 int zfs_send_queue_length = 16 * 1024 * 1024;
+/* Bytes of data blocks that may be read ahead of the send stream. */
+uint64_t zfs_send_read_queue_length = 16 * 1024 * 1024;
 /* Set this tunable to FALSE to disable setting of DRR_FLAG_FREERECORDS */
 uint64_t zfs_send_set_freerecords_bit = B_TRUE;
 /* Set this tunable to FALSE is disable sending unmodified spill blocks. */
@@ -85,6 +87,20 @@ struct send_thread_arg {
 	zbookmark_phys_t resume;
 };
 
+/*
+ * Records flow from the traversal thread, through the reader thread, which
+ * issues the read of any block do_dump() will need the data of, to
+ * dmu_send_impl(), which waits for each read in turn.
+ */
+struct send_reader_arg {
+	bqueue_t	q;
+	bqueue_t	*from;		/* queue filled by the traversal */
+	dmu_sendarg_t	*dsa;
+	kmutex_t	lock;		/* protects the records' io state */
+	kcondvar_t	cv;
+	boolean_t	cancel;
+};
+
 struct send_block_record {
 	boolean_t		eos_marker; /* Marks the end of the stream */
 	blkptr_t		bp;
@@ -92,6 +108,11 @@ struct send_block_record {
 	uint8_t			indblkshift;
 	uint16_t		datablkszsec;
 	bqueue_node_t		ln;
+	struct send_reader_arg	*sra;
+	boolean_t		io_issued;
+	boolean_t		io_outstanding;
+	int			io_err;
+	arc_buf_t		*abuf;
 };
 
 typedef struct dump_bytes_io {
@@ -681,6 +702,13 @@ backup_do_embed(dmu_sendarg_t *dsp, const blkptr_t *bp)
 	    !(dsp->dsa_featureflags & DMU_BACKUP_FEATURE_LZ4)))
 		return (B_FALSE);
 
+	/*
+	 * The receiver may not know zstd unless the stream says it needs it.
+	 */
+	if (BP_GET_COMPRESS(bp) == ZIO_COMPRESS_ZSTD &&
+	    !(dsp->dsa_featureflags & DMU_BACKUP_FEATURE_ZSTD))
+		return (B_FALSE);
+
 	/*
 	 * Embed type must be explicitly enabled.
 	 */
@@ -762,10 +790,150 @@ send_traverse_thread(void *arg)
 	thread_exit();
 }
 
+/*
+ * Returns B_TRUE if do_dump() will need the data of the block in 'data',
+ * and if so the flags to read it with.  This must make the same choices as
+ * do_dump().
+ */
+static boolean_t
+send_record_needs_read(dmu_sendarg_t *dsa, struct send_block_record *data,
+    enum zio_flag *zioflagsp)
+{
+	const blkptr_t *bp = &data->bp;
+	const zbookmark_phys_t *zb = &data->zb;
+	enum zio_flag zioflags = ZIO_FLAG_CANFAIL;
+	boolean_t request_raw =
+	    (dsa->dsa_featureflags & DMU_BACKUP_FEATURE_RAW) != 0;
+
+	if (zb->zb_object != DMU_META_DNODE_OBJECT &&
+	    DMU_OBJECT_IS_SPECIAL(zb->zb_object))
+		return (B_FALSE);
+	if (BP_IS_HOLE(bp) || zb->zb_level > 0 ||
+	    BP_GET_TYPE(bp) == DMU_OT_OBJSET)
+		return (B_FALSE);
+
+	if (BP_GET_TYPE(bp) == DMU_OT_DNODE || BP_GET_TYPE(bp) == DMU_OT_SA) {
+		if (request_raw)
+			zioflags |= ZIO_FLAG_RAW;
+	} else if (backup_do_embed(dsa, bp)) {
+		return (B_FALSE);
+	} else {
+		int blksz = data->datablkszsec << SPA_MINBLOCKSHIFT;
+		boolean_t split_large_blocks = blksz > SPA_OLD_MAXBLOCKSIZE &&
+		    !(dsa->dsa_featureflags & DMU_BACKUP_FEATURE_LARGE_BLOCKS);
+		boolean_t request_compressed =
+		    (dsa->dsa_featureflags & DMU_BACKUP_FEATURE_COMPRESSED) &&
+		    !split_large_blocks && !BP_SHOULD_BYTESWAP(bp) &&
+		    !BP_IS_EMBEDDED(bp) && !DMU_OT_IS_METADATA(BP_GET_TYPE(bp));
+
+		if (request_raw)
+			zioflags |= ZIO_FLAG_RAW;
+		else if (request_compressed)
+			zioflags |= ZIO_FLAG_RAW_COMPRESS;
+	}
+
+	*zioflagsp = zioflags;
+	return (B_TRUE);
+}
+
+/* ARGSUSED */
+static void
+send_read_done(zio_t *zio, const zbookmark_phys_t *zb, const blkptr_t *bp,
+    arc_buf_t *buf, void *arg)
+{
+	struct send_block_record *data = arg;
+	struct send_reader_arg *sra = data->sra;
+
+	mutex_enter(&sra->lock);
+	data->abuf = buf;
+	if (buf != NULL)
+		data->io_err = 0;
+	else if (zio != NULL && zio->io_error != 0)
+		data->io_err = zio->io_error;
+	else
+		data->io_err = SET_ERROR(EIO);
+	data->io_outstanding = B_FALSE;
+	cv_broadcast(&sra->cv);
+	mutex_exit(&sra->lock);
+}
+
+/*
+ * Wait for the read issued for this record, if any.  On success the data is
+ * in data->abuf, which is released by send_record_free().
+ */
+static int
+send_record_wait(struct send_block_record *data)
+{
+	struct send_reader_arg *sra = data->sra;
+
+	if (!data->io_issued)
+		return (SET_ERROR(EIO));
+
+	mutex_enter(&sra->lock);
+	while (data->io_outstanding)
+		cv_wait(&sra->cv, &sra->lock);
+	mutex_exit(&sra->lock);
+
+	return (data->io_err);
+}
+
+static void
+send_record_free(struct send_block_record *data)
+{
+	if (data->io_issued)
+		(void) send_record_wait(data);
+	if (data->abuf != NULL)
+		arc_buf_destroy(data->abuf, data);
+	kmem_free(data, sizeof (*data));
+}
+
+/*
+ * Pass the records from the traversal on to dmu_send_impl(), issuing the
+ * reads of the blocks whose data will be needed as they go by.  The reads
+ * complete in any order, but the records stay in traversal order, so the
+ * number of reads in flight is bounded by zfs_send_read_queue_length
+ * rather than by how far prefetch got ahead of the stream.
+ */
+static void
+send_reader_thread(void *arg)
+{
+	struct send_reader_arg *sra = arg;
+	dmu_sendarg_t *dsa = sra->dsa;
+	spa_t *spa = dmu_objset_spa(dsa->dsa_os);
+	struct send_block_record *data;
+	enum zio_flag zioflags;
+
+	for (data = bqueue_dequeue(sra->from); !data->eos_marker;
+	    data = bqueue_dequeue(sra->from)) {
+		data->sra = sra;
+		if (!sra->cancel &&
+		    send_record_needs_read(dsa, data, &zioflags)) {
+			arc_flags_t aflags = ARC_FLAG_NOWAIT;
+
+			data->io_issued = B_TRUE;
+			data->io_outstanding = B_TRUE;
+			if (arc_read(NULL, spa, &data->bp, send_read_done,
+			    data, ZIO_PRIORITY_ASYNC_READ, zioflags, &aflags,
+			    &data->zb) != 0) {
+				mutex_enter(&sra->lock);
+				if (data->io_outstanding) {
+					data->io_err = SET_ERROR(EIO);
+					data->io_outstanding = B_FALSE;
+				}
+				mutex_exit(&sra->lock);
+			}
+		}
+		bqueue_enqueue(&sra->q, data,
+		    data->datablkszsec << SPA_MINBLOCKSHIFT);
+	}
+	bqueue_enqueue(&sra->q, data, 1);
+	thread_exit();
+}
+
 /*
  * This function actually handles figuring out what kind of record needs to be
- * dumped, reading the data (which has hopefully been prefetched), and calling
- * the appropriate helper function.
+ * dumped, waiting for its data (which send_reader_thread() has issued the read
+ * of), and calling the appropriate helper function.
  */
 static int
 do_dump(dmu_sendarg_t *dsa, struct send_block_record *data)
@@ -814,21 +982,18 @@ do_dump(dmu_sendarg_t *dsa, struct send_block_record *data)
 		return (0);
 	} else if (type == DMU_OT_DNODE) {
 		int epb = BP_GET_LSIZE(bp) >> DNODE_SHIFT;
-		arc_flags_t aflags = ARC_FLAG_WAIT;
 		arc_buf_t *abuf;
-		enum zio_flag zioflags = ZIO_FLAG_CANFAIL;
 
 		if (dsa->dsa_featureflags & DMU_BACKUP_FEATURE_RAW) {
 			ASSERT(BP_IS_ENCRYPTED(bp));
 			ASSERT3U(BP_GET_COMPRESS(bp), ==, ZIO_COMPRESS_OFF);
-			zioflags |= ZIO_FLAG_RAW;
 		}
 
 		ASSERT0(zb->zb_level);
 
-		if (arc_read(NULL, spa, bp, arc_getbuf_func, &abuf,
-		    ZIO_PRIORITY_ASYNC_READ, zioflags, &aflags, zb) != 0)
+		if (send_record_wait(data) != 0)
 			return (SET_ERROR(EIO));
+		abuf = data->abuf;
 
 		dnode_phys_t *blk = abuf->b_data;
 		uint64_t dnobj = zb->zb_blkid * epb;
@@ -851,23 +1016,14 @@ do_dump(dmu_sendarg_t *dsa, struct send_block_record *data)
 					break;
 			}
 		}
-		arc_buf_destroy(abuf, &abuf);
 	} else if (type == DMU_OT_SA) {
-		arc_flags_t aflags = ARC_FLAG_WAIT;
-		arc_buf_t *abuf;
-		enum zio_flag zioflags = ZIO_FLAG_CANFAIL;
-
-		if (dsa->dsa_featureflags & DMU_BACKUP_FEATURE_RAW) {
+		if (dsa->dsa_featureflags & DMU_BACKUP_FEATURE_RAW)
 			ASSERT(BP_IS_PROTECTED(bp));
-			zioflags |= ZIO_FLAG_RAW;
-		}
 
-		if (arc_read(NULL, spa, bp, arc_getbuf_func, &abuf,
-		    ZIO_PRIORITY_ASYNC_READ, zioflags, &aflags, zb) != 0)
+		if (send_record_wait(data) != 0)
 			return (SET_ERROR(EIO));
 
-		err = dump_spill(dsa, bp, zb->zb_object, abuf->b_data);
-		arc_buf_destroy(abuf, &abuf);
+		err = dump_spill(dsa, bp, zb->zb_object, data->abuf->b_data);
 	} else if (backup_do_embed(dsa, bp)) {
 		/* it's an embedded level-0 block of a regular object */
 		int blksz = dblkszsec << SPA_MINBLOCKSHIFT;
@@ -876,11 +1032,9 @@ do_dump(dmu_sendarg_t *dsa, struct send_block_record *data)
 		    zb->zb_blkid * blksz, blksz, bp);
 	} else {
 		/* it's a level-0 block of a regular object */
-		arc_flags_t aflags = ARC_FLAG_WAIT;
 		arc_buf_t *abuf;
 		int blksz = dblkszsec << SPA_MINBLOCKSHIFT;
 		uint64_t offset;
-		enum zio_flag zioflags = ZIO_FLAG_CANFAIL;
 
 		/*
 		 * If we have large blocks stored on disk but the send flags
@@ -898,8 +1052,9 @@ do_dump(dmu_sendarg_t *dsa, struct send_block_record *data)
 		    (dsa->dsa_featureflags & DMU_BACKUP_FEATURE_RAW) != 0;
 
 		/*
-		 * We should only request compressed data from the ARC if all
-		 * the following are true:
+		 * The data was read by send_reader_thread(), compressed
+		 * (see send_record_needs_read()) if all the following are
+		 * true:
 		 *  - stream compression was requested
 		 *  - we aren't splitting large blocks into smaller chunks
 		 *  - the data won't need to be byteswapped before sending
@@ -907,11 +1062,6 @@ do_dump(dmu_sendarg_t *dsa, struct send_block_record *data)
 		 *  - this isn't metadata (if receiving on a different endian
 		 *    system it can be byteswapped more easily)
 		 */
-		boolean_t request_compressed =
-		    (dsa->dsa_featureflags & DMU_BACKUP_FEATURE_COMPRESSED) &&
-		    !split_large_blocks && !BP_SHOULD_BYTESWAP(bp) &&
-		    !BP_IS_EMBEDDED(bp) && !DMU_OT_IS_METADATA(BP_GET_TYPE(bp));
-
 		IMPLY(request_raw, !split_large_blocks);
 		IMPLY(request_raw, BP_IS_PROTECTED(bp));
 		ASSERT0(zb->zb_level);
@@ -919,17 +1069,12 @@ do_dump(dmu_sendarg_t *dsa, struct send_block_record *data)
 		    (zb->zb_object == dsa->dsa_resume_object &&
 		    zb->zb_blkid * blksz >= dsa->dsa_resume_offset));
 
-		if (request_raw)
-			zioflags |= ZIO_FLAG_RAW;
-		else if (request_compressed)
-			zioflags |= ZIO_FLAG_RAW_COMPRESS;
-
-		if (arc_read(NULL, spa, bp, arc_getbuf_func, &abuf,
-		    ZIO_PRIORITY_ASYNC_READ, zioflags, &aflags, zb) != 0) {
+		if (send_record_wait(data) != 0) {
 			if (zfs_send_corrupt_data) {
 				/* Send a block filled with 0x"zfs badd bloc" */
-				abuf = arc_alloc_buf(spa, &abuf, ARC_BUFC_DATA,
-				    blksz);
+				data->abuf = arc_alloc_buf(spa, data,
+				    ARC_BUFC_DATA, blksz);
+				abuf = data->abuf;
 				uint64_t *ptr;
 				for (ptr = abuf->b_data;
 				    (char *)ptr < (char *)abuf->b_data + blksz;
@@ -938,6 +1083,8 @@ do_dump(dmu_sendarg_t *dsa, struct send_block_record *data)
 			} else {
 				return (SET_ERROR(EIO));
 			}
+		} else {
+			abuf = data->abuf;
 		}
 
 		offset = zb->zb_blkid * blksz;
@@ -959,7 +1106,6 @@ do_dump(dmu_sendarg_t *dsa, struct send_block_record *data)
 			err = dump_write(dsa, type, zb->zb_object, offset,
 			    blksz, arc_buf_size(abuf), bp, abuf->b_data);
 		}
-		arc_buf_destroy(abuf, &abuf);
 	}
 
 	ASSERT(err == 0 || err == EINTR);
@@ -973,7 +1119,7 @@ static struct send_block_record *
 get_next_record(bqueue_t *bq, struct send_block_record *data)
 {
 	struct send_block_record *tmp = bqueue_dequeue(bq);
-	kmem_free(data, sizeof (*data));
+	send_record_free(data);
 	return (tmp);
 }
 
@@ -998,6 +1144,7 @@ dmu_send_impl(void *tag, dsl_pool_t *dp, dsl_dataset_t *to_ds,
 	void *payload = NULL;
 	size_t payload_len = 0;
 	struct send_thread_arg to_arg = { { { 0 } } };
+	struct send_reader_arg sr_arg = { { { 0 } } };
 
 	err = dmu_objset_from_ds(to_ds, &os);
 	if (err != 0) {
@@ -1075,6 +1222,18 @@ dmu_send_impl(void *tag, dsl_pool_t *dp, dsl_dataset_t *to_ds,
 		featureflags |= DMU_BACKUP_FEATURE_LZ4;
 	}
 
+	/*
+	 * Blocks of a dataset that has used zstd are sent as they are on
+	 * disk in compressed and raw streams, so the receiving pool must
+	 * support zstd as well.
+	 */
+	if ((featureflags &
+	    (DMU_BACKUP_FEATURE_EMBED_DATA | DMU_BACKUP_FEATURE_COMPRESSED |
+	    DMU_BACKUP_FEATURE_RAW)) != 0 &&
+	    to_ds->ds_feature_inuse[SPA_FEATURE_ZSTD_COMPRESS]) {
+		featureflags |= DMU_BACKUP_FEATURE_ZSTD;
+	}
+
 	if (resumeobj != 0 || resumeoff != 0) {
 		featureflags |= DMU_BACKUP_FEATURE_RESUMING;
 	}
@@ -1186,31 +1345,51 @@ dmu_send_impl(void *tag, dsl_pool_t *dp, dsl_dataset_t *to_ds,
 	to_arg.cancel = B_FALSE;
 	to_arg.ds = to_ds;
 	to_arg.fromtxg = fromtxg;
-	to_arg.flags = TRAVERSE_PRE | TRAVERSE_PREFETCH;
+	/*
+	 * Data blocks are read by send_reader_thread(), so the traversal only
+	 * needs to prefetch the metadata it walks.
+	 */
+	to_arg.flags = TRAVERSE_PRE | TRAVERSE_PREFETCH_METADATA;
 	if (rawok)
 		to_arg.flags |= TRAVERSE_NO_DECRYPT;
+
+	VERIFY0(bqueue_init(&sr_arg.q,
+	    MAX(zfs_send_read_queue_length, 2 * zfs_max_recordsize),
+	    offsetof(struct send_block_record, ln)));
+	mutex_init(&sr_arg.lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&sr_arg.cv, NULL, CV_DEFAULT, NULL);
+	sr_arg.from = &to_arg.q;
+	sr_arg.dsa = dsp;
+	sr_arg.cancel = B_FALSE;
+
 	(void) thread_create(NULL, 0, send_traverse_thread, &to_arg, 0, curproc,
 	    TS_RUN, minclsyspri);
+	(void) thread_create(NULL, 0, send_reader_thread, &sr_arg, 0, curproc,
+	    TS_RUN, minclsyspri);
 
 	struct send_block_record *to_data;
-	to_data = bqueue_dequeue(&to_arg.q);
+	to_data = bqueue_dequeue(&sr_arg.q);
 
 	while (!to_data->eos_marker && err == 0) {
 		err = do_dump(dsp, to_data);
-		to_data = get_next_record(&to_arg.q, to_data);
+		to_data = get_next_record(&sr_arg.q, to_data);
 		if (issig(JUSTLOOKING) && issig(FORREAL))
 			err = EINTR;
 	}
 
 	if (err != 0) {
 		to_arg.cancel = B_TRUE;
+		sr_arg.cancel = B_TRUE;
 		while (!to_data->eos_marker) {
-			to_data = get_next_record(&to_arg.q, to_data);
+			to_data = get_next_record(&sr_arg.q, to_data);
 		}
 	}
 	kmem_free(to_data, sizeof (*to_data));
 
+	bqueue_destroy(&sr_arg.q);
 	bqueue_destroy(&to_arg.q);
+	cv_destroy(&sr_arg.cv);
+	mutex_destroy(&sr_arg.lock);
 
 	if (err == 0 && to_arg.error_code != 0)
 		err = to_arg.error_code;
@@ -1592,6 +1771,10 @@ MODULE_PARM_DESC(zfs_send_corrupt_data, "Allow sending corrupt data");
 module_param(zfs_send_queue_length, int, 0644);
 MODULE_PARM_DESC(zfs_send_queue_length, "Maximum send queue length");
 
+module_param(zfs_send_read_queue_length, ulong, 0644);
+MODULE_PARM_DESC(zfs_send_read_queue_length,
+	"Maximum bytes of data read ahead of the send stream");
+
 module_param(zfs_send_unmodified_spill_blocks, int, 0644);
 MODULE_PARM_DESC(zfs_send_unmodified_spill_blocks,
 	"Send unmodified spill blocks");
@@ -474,6 +474,69 @@ dmu_tx_hold_free_by_dnode(dmu_tx_t *tx, dnode_t *dn, uint64_t off, uint64_t len)
 		(void) dmu_tx_hold_free_impl(txh, off, len);
 }
 
+/*
+ * Cloning a range only writes block pointers: nothing is allocated for
+ * the level-0 blocks, but every level-1 block spanning the range gets
+ * rewritten.
+ */
+static void
+dmu_tx_count_clone(dmu_tx_hold_t *txh, uint64_t off, uint64_t len)
+{
+	dnode_t *dn = txh->txh_dnode;
+	uint64_t start, end;
+	int shift;
+
+	if (len == 0 || dn == NULL)
+		return;
+
+	if (dn->dn_datablkshift == 0 || dn->dn_nlevels == 1) {
+		start = end = 0;
+	} else {
+		shift = dn->dn_datablkshift + dn->dn_indblkshift -
+		    SPA_BLKPTRSHIFT;
+		start = off >> shift;
+		end = (off + len - 1) >> shift;
+	}
+
+	(void) zfs_refcount_add_many(&txh->txh_space_towrite,
+	    (end - start + 1) << dn->dn_indblkshift, FTAG);
+
+	if (zfs_refcount_count(&txh->txh_space_towrite) > 2 * DMU_MAX_ACCESS)
+		txh->txh_tx->tx_err = SET_ERROR(EFBIG);
+}
+
+void
+dmu_tx_hold_clone(dmu_tx_t *tx, uint64_t object, uint64_t off, uint64_t len)
+{
+	dmu_tx_hold_t *txh;
+
+	ASSERT0(tx->tx_txg);
+	ASSERT(len == 0 || UINT64_MAX - off >= len - 1);
+
+	txh = dmu_tx_hold_object_impl(tx, tx->tx_objset,
+	    object, THT_CLONE, off, len);
+	if (txh != NULL) {
+		dmu_tx_count_clone(txh, off, len);
+		dmu_tx_count_dnode(txh);
+	}
+}
+
+void
+dmu_tx_hold_clone_by_dnode(dmu_tx_t *tx, dnode_t *dn, uint64_t off,
+    uint64_t len)
+{
+	dmu_tx_hold_t *txh;
+
+	ASSERT0(tx->tx_txg);
+	ASSERT(len == 0 || UINT64_MAX - off >= len - 1);
+
+	txh = dmu_tx_hold_dnode_impl(tx, dn, THT_CLONE, off, len);
+	if (txh != NULL) {
+		dmu_tx_count_clone(txh, off, len);
+		dmu_tx_count_dnode(txh);
+	}
+}
+
 static void
 dmu_tx_hold_zap_impl(dmu_tx_hold_t *txh, const char *name)
 {
@@ -671,6 +734,17 @@ dmu_tx_dirty_buf(dmu_tx_t *tx, dmu_buf_impl_t *db)
 				if (blkid == DMU_SPILL_BLKID)
 					match_offset = TRUE;
 				break;
+			case THT_CLONE:
+				/*
+				 * Cloning dirties the level-0 blocks in the
+				 * range and their parents.  Like a write, it
+				 * may also grow blk 0 to the source's block
+				 * size.
+				 */
+				if ((blkid >= beginblk && blkid <= endblk) ||
+				    blkid == 0)
+					match_offset = TRUE;
+				break;
 			case THT_BONUS:
 				if (blkid == DMU_BONUS_BLKID)
 					match_offset = TRUE;
@@ -1031,6 +1105,13 @@ dmu_tx_assign(dmu_tx_t *tx, uint64_t txg_how)
 	if ((txg_how & TXG_NOTHROTTLE))
 		tx->tx_dirty_delayed = B_TRUE;
 
+	/*
+	 * Apply the dataset's write rate limits before the tx is assigned,
+	 * so a throttled writer never holds a txg open; see dmu_iolimit.c.
+	 */
+	if ((txg_how & TXG_WAIT))
+		dmu_iolimit_tx(tx);
+
 	while ((err = dmu_tx_try_assign(tx, txg_how)) != 0) {
 		dmu_tx_unassign(tx);
 
@@ -156,6 +156,9 @@ dsl_dir_evict_async(void *dbu)
 
 	spa_async_close(dd->dd_pool->dp_spa, dd);
 
+	if (dsl_deadlist_is_open(&dd->dd_livelist))
+		dsl_dir_livelist_close(dd);
+
 	/*
 	 * The props callback list should have been cleaned up by
 	 * objset_evict().
@@ -259,6 +262,16 @@ dsl_dir_hold_obj(dsl_pool_t *dp, uint64_t ddobj,
 			dd->dd_origin_txg =
 			    origin_phys->ds_creation_txg;
 			dmu_buf_rele(origin_bonus, FTAG);
+			if (dsl_dir_is_zapified(dd)) {
+				uint64_t obj;
+				err = zap_lookup(dp->dp_meta_objset,
+				    dd->dd_object, DD_FIELD_LIVELIST,
+				    sizeof (uint64_t), 1, &obj);
+				if (err == 0)
+					dsl_dir_livelist_open(dd, obj);
+				else if (err != ENOENT)
+					goto errout;
+			}
 		}
 
 		dmu_buf_init_user(&dd->dd_dbu, NULL, dsl_dir_evict_async,
@@ -267,6 +280,8 @@ dsl_dir_hold_obj(dsl_pool_t *dp, uint64_t ddobj,
 		if (winner != NULL) {
 			if (dd->dd_parent)
 				dsl_dir_rele(dd->dd_parent, dd);
+			if (dsl_deadlist_is_open(&dd->dd_livelist))
+				dsl_dir_livelist_close(dd);
 			dsl_prop_fini(dd);
 			mutex_destroy(&dd->dd_lock);
 			kmem_free(dd, sizeof (dsl_dir_t));
@@ -296,6 +311,8 @@ dsl_dir_hold_obj(dsl_pool_t *dp, uint64_t ddobj,
 errout:
 	if (dd->dd_parent)
 		dsl_dir_rele(dd->dd_parent, dd);
+	if (dsl_deadlist_is_open(&dd->dd_livelist))
+		dsl_dir_livelist_close(dd);
 	dsl_prop_fini(dd);
 	mutex_destroy(&dd->dd_lock);
 	kmem_free(dd, sizeof (dsl_dir_t));
@@ -2215,6 +2232,88 @@ dsl_dir_is_zapified(dsl_dir_t *dd)
 	return (doi.doi_type == DMU_OTN_ZAP_METADATA);
 }
 
+void
+dsl_dir_livelist_open(dsl_dir_t *dd, uint64_t obj)
+{
+	objset_t *mos = dd->dd_pool->dp_meta_objset;
+	ASSERT(spa_feature_is_active(dd->dd_pool->dp_spa,
+	    SPA_FEATURE_LIVELIST));
+	dsl_deadlist_open(&dd->dd_livelist, mos, obj);
+	bplist_create(&dd->dd_pending_allocs);
+	bplist_create(&dd->dd_pending_frees);
+}
+
+void
+dsl_dir_livelist_close(dsl_dir_t *dd)
+{
+	dsl_deadlist_close(&dd->dd_livelist);
+	bplist_clear(&dd->dd_pending_allocs);
+	bplist_destroy(&dd->dd_pending_allocs);
+	bplist_clear(&dd->dd_pending_frees);
+	bplist_destroy(&dd->dd_pending_frees);
+}
+
+/*
+ * Detach the livelist from dd.  If total is set, the livelist itself is
+ * freed as well; otherwise the caller has handed it off elsewhere (e.g.
+ * to the pool's deleted clones list).
+ */
+void
+dsl_dir_remove_livelist(dsl_dir_t *dd, dmu_tx_t *tx, boolean_t total)
+{
+	uint64_t obj;
+	dsl_pool_t *dp = dmu_tx_pool(tx);
+	spa_t *spa = dp->dp_spa;
+	livelist_condense_entry_t *to_condense = &spa->spa_to_condense;
+	zthr_t *ll_condense_thread = spa->spa_livelist_condense_zthr;
+
+	ASSERT(dmu_tx_is_syncing(tx));
+
+	if (!dsl_deadlist_is_open(&dd->dd_livelist))
+		return;
+
+	/*
+	 * If this livelist is queued to be condensed, stop the condense
+	 * zthr and flag the cancellation in case the condense synctask has
+	 * already been dispatched.  zthr_cancel() waits for the thread to
+	 * notice and bail out of its current pass; it is then resumed so
+	 * that it can serve other livelists, unless the pool's async
+	 * threads are suspended, in which case spa_async_resume() will.
+	 */
+	if (ll_condense_thread != NULL && to_condense->ds != NULL &&
+	    to_condense->ds->ds_dir == dd) {
+		to_condense->cancelled = B_TRUE;
+		zthr_cancel(ll_condense_thread);
+		mutex_enter(&spa->spa_async_lock);
+		if (spa->spa_async_suspended == 0)
+			zthr_resume(ll_condense_thread);
+		mutex_exit(&spa->spa_async_lock);
+
+		/*
+		 * If the synctask has been dispatched (indicated by
+		 * 'syncing'), it will find 'cancelled' set and clear
+		 * spa_to_condense on its own.  Otherwise nothing else
+		 * references the dataset, so release it here.  The entry
+		 * cannot be repopulated meanwhile because both this function
+		 * and dsl_livelist_try_condense() run in syncing context.
+		 */
+		if (to_condense->ds != NULL && !to_condense->syncing) {
+			dmu_buf_rele(to_condense->ds->ds_dbuf, spa);
+			to_condense->ds = NULL;
+		}
+	}
+
+	dsl_dir_livelist_close(dd);
+	VERIFY0(zap_lookup(dp->dp_meta_objset, dd->dd_object,
+	    DD_FIELD_LIVELIST, sizeof (uint64_t), 1, &obj));
+	VERIFY0(zap_remove(dp->dp_meta_objset, dd->dd_object,
+	    DD_FIELD_LIVELIST, tx));
+	if (total) {
+		dsl_deadlist_free(dp->dp_meta_objset, obj, tx);
+		spa_feature_decr(spa, SPA_FEATURE_LIVELIST, tx);
+	}
+}
+
 #if defined(_KERNEL) && defined(HAVE_SPL)
 EXPORT_SYMBOL(dsl_dir_set_quota);
 EXPORT_SYMBOL(dsl_dir_set_reservation);
@@ -28,11 +28,15 @@
 
 #include <sys/debug.h>
 #include <sys/types.h>
+#include <sys/zfs_context.h>
+#include <sys/abd.h>
+#include <sys/zio_compress.h>
 
 #ifdef _KERNEL
 
 #include <sys/systm.h>
 #include <sys/zmod.h>
+#include <libkern/zlib.h>
 
 typedef size_t zlen_t;
 #define	compress_func	z_compress_level
@@ -67,6 +71,96 @@ gzip_compress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
 	return ((size_t) dstlen);
 }
 
+#ifdef _KERNEL
+/*
+ * The kernel zlib has no default allocator. kmem_free() needs the size of
+ * the allocation, so stash it in front of the buffer.
+ */
+/*ARGSUSED*/
+static void *
+gzip_zalloc(void *opaque, uInt items, uInt size)
+{
+	size_t nbytes = sizeof (uint64_t) + (size_t)items * size;
+	uint64_t *p = kmem_alloc(nbytes, KM_SLEEP);
+
+	*p = nbytes;
+	return (p + 1);
+}
+
+/*ARGSUSED*/
+static void
+gzip_zfree(void *opaque, void *ptr)
+{
+	uint64_t *p = (uint64_t *)ptr - 1;
+
+	kmem_free(p, *p);
+}
+#endif
+
+static int
+gzip_compress_abd_cb(void *buf, size_t size, void *private)
+{
+	z_stream *zs = private;
+
+	zs->next_in = buf;
+	zs->avail_in = size;
+
+	while (zs->avail_in > 0) {
+		/* Out of room: the block is not going to fit in d_len */
+		if (zs->avail_out == 0 || deflate(zs, Z_NO_FLUSH) != Z_OK)
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Same as gzip_compress(), but feeds deflate() one ABD chunk at a time so a
+ * scattered source does not have to be copied into a linear buffer first.
+ * deflate() output does not depend on how its input is split up, so this
+ * produces exactly the same stream as gzip_compress(); the ARC relies on
+ * that when it recompresses a block to verify it.
+ */
+size_t
+gzip_compress_abd(abd_t *src, void *d_start, size_t s_len, size_t d_len,
+    int n)
+{
+	z_stream zs;
+	int err;
+
+	ASSERT(d_len <= s_len);
+
+	bzero(&zs, sizeof (zs));
+#ifdef _KERNEL
+	zs.zalloc = gzip_zalloc;
+	zs.zfree = gzip_zfree;
+#endif
+	zs.next_out = d_start;
+	zs.avail_out = d_len;
+
+	if (deflateInit(&zs, n) != Z_OK)
+		goto fail;
+
+	if (abd_iterate_func(src, 0, s_len, gzip_compress_abd_cb, &zs) != 0) {
+		(void) deflateEnd(&zs);
+		goto fail;
+	}
+
+	err = deflate(&zs, Z_FINISH);
+	(void) deflateEnd(&zs);
+	if (err != Z_STREAM_END)
+		goto fail;
+
+	return ((size_t)zs.total_out);
+
+fail:
+	if (d_len != s_len)
+		return (s_len);
+
+	abd_copy_to_buf(d_start, src, s_len);
+	return (s_len);
+}
+
 /*ARGSUSED*/
 int
 gzip_decompress(void *s_start, void *d_start, size_t s_len, size_t d_len, int n)
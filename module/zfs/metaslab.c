@@ -1135,45 +1135,74 @@ metaslab_group_allocatable(metaslab_group_t *mg, metaslab_group_t *rotor,
  */
 
 /*
- * Comparison function for the private size-ordered tree. Tree is sorted
- * by size, larger sizes at the end of the tree.
+ * Comparison function for the private size-ordered tree using 32-bit
+ * ranges. Tree is sorted by size, larger sizes at the end of the tree.
  */
 static int
-metaslab_rangesize_compare(const void *x1, const void *x2)
+metaslab_rangesize32_compare(const void *x1, const void *x2)
 {
-	const range_seg_t *r1 = x1;
-	const range_seg_t *r2 = x2;
+	const range_seg32_t *r1 = x1;
+	const range_seg32_t *r2 = x2;
+
 	uint64_t rs_size1 = r1->rs_end - r1->rs_start;
 	uint64_t rs_size2 = r2->rs_end - r2->rs_start;
 
-	if (rs_size1 < rs_size2)
-		return (-1);
-	if (rs_size1 > rs_size2)
-		return (1);
+	int cmp = AVL_CMP(rs_size1, rs_size2);
+	if (cmp != 0)
+		return (cmp);
 
-	if (r1->rs_start < r2->rs_start)
-		return (-1);
+	return (AVL_CMP(r1->rs_start, r2->rs_start));
+}
 
-	if (r1->rs_start > r2->rs_start)
-		return (1);
+/*
+ * Comparison function for the private size-ordered tree using 64-bit
+ * ranges. Tree is sorted by size, larger sizes at the end of the tree.
+ */
+static int
+metaslab_rangesize64_compare(const void *x1, const void *x2)
+{
+	const range_seg64_t *r1 = x1;
+	const range_seg64_t *r2 = x2;
 
-	return (0);
+	uint64_t rs_size1 = r1->rs_end - r1->rs_start;
+	uint64_t rs_size2 = r2->rs_end - r2->rs_start;
+
+	int cmp = AVL_CMP(rs_size1, rs_size2);
+	if (cmp != 0)
+		return (cmp);
+
+	return (AVL_CMP(r1->rs_start, r2->rs_start));
 }
 
 /*
  * Create any block allocator specific components. The current allocators
- * rely on using both a size-ordered range_tree_t and an array of uint64_t's.
+ * rely on using both a size-ordered b-tree of segments and an array of
+ * uint64_t's.
  */
 static void
 metaslab_rt_create(range_tree_t *rt, void *arg)
 {
 	metaslab_t *msp = arg;
+	size_t size;
+	int (*compare) (const void *, const void *);
 
 	ASSERT3P(rt->rt_arg, ==, msp);
 	ASSERT(msp->ms_allocatable == NULL);
 
-	avl_create(&msp->ms_allocatable_by_size, metaslab_rangesize_compare,
-	    sizeof (range_seg_t), offsetof(range_seg_t, rs_pp_node));
+	switch (rt->rt_type) {
+	case RANGE_SEG32:
+		size = sizeof (range_seg32_t);
+		compare = metaslab_rangesize32_compare;
+		break;
+	case RANGE_SEG64:
+		size = sizeof (range_seg64_t);
+		compare = metaslab_rangesize64_compare;
+		break;
+	default:
+		panic("Invalid range seg type %d", rt->rt_type);
+		return;
+	}
+	zfs_btree_create(&msp->ms_allocatable_by_size, compare, size);
 }
 
 /*
@@ -1186,9 +1215,9 @@ metaslab_rt_destroy(range_tree_t *rt, void *arg)
 
 	ASSERT3P(rt->rt_arg, ==, msp);
 	ASSERT3P(msp->ms_allocatable, ==, rt);
-	ASSERT0(avl_numnodes(&msp->ms_allocatable_by_size));
+	ASSERT0(zfs_btree_numnodes(&msp->ms_allocatable_by_size));
 
-	avl_destroy(&msp->ms_allocatable_by_size);
+	zfs_btree_destroy(&msp->ms_allocatable_by_size);
 }
 
 static void
@@ -1199,7 +1228,7 @@ metaslab_rt_add(range_tree_t *rt, range_seg_t *rs, void *arg)
 	ASSERT3P(rt->rt_arg, ==, msp);
 	ASSERT3P(msp->ms_allocatable, ==, rt);
 	VERIFY(!msp->ms_condensing);
-	avl_add(&msp->ms_allocatable_by_size, rs);
+	zfs_btree_add(&msp->ms_allocatable_by_size, rs);
 }
 
 static void
@@ -1210,7 +1239,7 @@ metaslab_rt_remove(range_tree_t *rt, range_seg_t *rs, void *arg)
 	ASSERT3P(rt->rt_arg, ==, msp);
 	ASSERT3P(msp->ms_allocatable, ==, rt);
 	VERIFY(!msp->ms_condensing);
-	avl_remove(&msp->ms_allocatable_by_size, rs);
+	zfs_btree_remove(&msp->ms_allocatable_by_size, rs);
 }
 
 static void
@@ -1222,13 +1251,10 @@ metaslab_rt_vacate(range_tree_t *rt, void *arg)
 	ASSERT3P(msp->ms_allocatable, ==, rt);
 
 	/*
-	 * Normally one would walk the tree freeing nodes along the way.
-	 * Since the nodes are shared with the range trees we can avoid
-	 * walking all nodes and just reinitialize the avl tree. The nodes
-	 * will be freed by the range tree, so we don't want to free them here.
+	 * The size-ordered tree holds its own copies of the segments, so
+	 * it can be emptied without walking the range tree.
 	 */
-	avl_create(&msp->ms_allocatable_by_size, metaslab_rangesize_compare,
-	    sizeof (range_seg_t), offsetof(range_seg_t, rs_pp_node));
+	zfs_btree_clear(&msp->ms_allocatable_by_size);
 }
 
 static range_tree_ops_t metaslab_rt_ops = {
@@ -1251,27 +1277,33 @@ static range_tree_ops_t metaslab_rt_ops = {
 uint64_t
 metaslab_block_maxsize(metaslab_t *msp)
 {
-	avl_tree_t *t = &msp->ms_allocatable_by_size;
+	zfs_btree_t *t = &msp->ms_allocatable_by_size;
 	range_seg_t *rs;
 
-	if (t == NULL || (rs = avl_last(t)) == NULL)
+	if (t == NULL || (rs = zfs_btree_last(t, NULL)) == NULL)
 		return (0ULL);
 
-	return (rs->rs_end - rs->rs_start);
+	return (rs_get_end(rs, msp->ms_allocatable) -
+	    rs_get_start(rs, msp->ms_allocatable));
 }
 
+/*
+ * Find the first segment in the given tree (either the offset-ordered or
+ * the size-ordered tree of rt) at or after the given range.
+ */
 static range_seg_t *
-metaslab_block_find(avl_tree_t *t, uint64_t start, uint64_t size)
+metaslab_block_find(zfs_btree_t *t, range_tree_t *rt, uint64_t start,
+    uint64_t size, zfs_btree_index_t *where)
 {
-	range_seg_t *rs, rsearch;
-	avl_index_t where;
+	range_seg_t *rs;
+	range_seg_max_t rsearch;
 
-	rsearch.rs_start = start;
-	rsearch.rs_end = start + size;
+	rs_set_start(&rsearch, rt, start);
+	rs_set_end(&rsearch, rt, start + size);
 
-	rs = avl_find(t, &rsearch, &where);
+	rs = zfs_btree_find(t, &rsearch, where);
 	if (rs == NULL) {
-		rs = avl_nearest(t, where, AVL_AFTER);
+		rs = zfs_btree_next(t, where, where);
 	}
 	return (rs);
 }
@@ -1281,34 +1313,41 @@ metaslab_block_find(avl_tree_t *t, uint64_t start, uint64_t size)
     defined(WITH_CF_BLOCK_ALLOCATOR)
 /*
  * This is a helper function that can be used by the allocator to find
- * a suitable block to allocate. This will search the specified AVL
- * tree looking for a block that matches the specified criteria.
+ * a suitable block to allocate. This will search the specified b-tree
+ * looking for a block that matches the specified criteria.
  */
 static uint64_t
-metaslab_block_picker(avl_tree_t *t, uint64_t *cursor, uint64_t size,
-    uint64_t align)
+metaslab_block_picker(zfs_btree_t *t, range_tree_t *rt, uint64_t *cursor,
+    uint64_t size, uint64_t align)
 {
-	range_seg_t *rs = metaslab_block_find(t, *cursor, size);
+	zfs_btree_index_t where;
+	range_seg_t *rs;
 
+	/* Segments are stored relative to the start of the metaslab. */
+	if (*cursor < rt->rt_start)
+		*cursor = rt->rt_start;
+
+	rs = metaslab_block_find(t, rt, *cursor, size, &where);
 	while (rs != NULL) {
-		uint64_t offset = P2ROUNDUP(rs->rs_start, align);
+		uint64_t offset = P2ROUNDUP(rs_get_start(rs, rt), align);
 
-		if (offset + size <= rs->rs_end) {
+		if (offset + size <= rs_get_end(rs, rt)) {
 			*cursor = offset + size;
 			return (offset);
 		}
-		rs = AVL_NEXT(t, rs);
+		rs = zfs_btree_next(t, &where, &where);
 	}
 
 	/*
-	 * If we know we've searched the whole map (*cursor == 0), give up.
-	 * Otherwise, reset the cursor to the beginning and try again.
+	 * If we know we've searched the whole map (*cursor is at the start
+	 * of the metaslab), give up. Otherwise, reset the cursor to the
+	 * beginning and try again.
 	 */
-	if (*cursor == 0)
+	if (*cursor == rt->rt_start)
 		return (-1ULL);
 
-	*cursor = 0;
-	return (metaslab_block_picker(t, cursor, size, align));
+	*cursor = rt->rt_start;
+	return (metaslab_block_picker(t, rt, cursor, size, align));
 }
 #endif /* WITH_FF/DF/CF_BLOCK_ALLOCATOR */
 
@@ -1330,9 +1369,9 @@ metaslab_ff_alloc(metaslab_t *msp, uint64_t size)
 	 */
 	uint64_t align = size & -size;
 	uint64_t *cursor = &msp->ms_lbas[highbit64(align) - 1];
-	avl_tree_t *t = &msp->ms_allocatable->rt_root;
+	range_tree_t *rt = msp->ms_allocatable;
 
-	return (metaslab_block_picker(t, cursor, size, align));
+	return (metaslab_block_picker(&rt->rt_root, rt, cursor, size, align));
 }
 
 static metaslab_ops_t metaslab_ff_ops = {
@@ -1364,20 +1403,20 @@ metaslab_df_alloc(metaslab_t *msp, uint64_t size)
 	uint64_t align = size & -size;
 	uint64_t *cursor = &msp->ms_lbas[highbit64(align) - 1];
 	range_tree_t *rt = msp->ms_allocatable;
-	avl_tree_t *t = &rt->rt_root;
+	zfs_btree_t *t = &rt->rt_root;
 	uint64_t max_size = metaslab_block_maxsize(msp);
 	int free_pct = range_tree_space(rt) * 100 / msp->ms_size;
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
-	ASSERT3U(avl_numnodes(t), ==,
-	    avl_numnodes(&msp->ms_allocatable_by_size));
+	ASSERT3U(zfs_btree_numnodes(t), ==,
+	    zfs_btree_numnodes(&msp->ms_allocatable_by_size));
 
 	if (max_size < size)
 		return (-1ULL);
 
 	/*
 	 * If we're running low on space switch to using the size
-	 * sorted AVL tree (best-fit).
+	 * sorted b-tree (best-fit).
 	 */
 	if (max_size < metaslab_df_alloc_threshold ||
 	    free_pct < metaslab_df_free_pct) {
@@ -1385,7 +1424,7 @@ metaslab_df_alloc(metaslab_t *msp, uint64_t size)
 		*cursor = 0;
 	}
 
-	return (metaslab_block_picker(t, cursor, size, 1ULL));
+	return (metaslab_block_picker(t, rt, cursor, size, 1ULL));
 }
 
 static metaslab_ops_t metaslab_df_ops = {
@@ -1409,25 +1448,26 @@ static uint64_t
 metaslab_cf_alloc(metaslab_t *msp, uint64_t size)
 {
 	range_tree_t *rt = msp->ms_allocatable;
-	avl_tree_t *t = &msp->ms_allocatable_by_size;
+	zfs_btree_t *t = &msp->ms_allocatable_by_size;
 	uint64_t *cursor = &msp->ms_lbas[0];
 	uint64_t *cursor_end = &msp->ms_lbas[1];
 	uint64_t offset = 0;
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
-	ASSERT3U(avl_numnodes(t), ==, avl_numnodes(&rt->rt_root));
+	ASSERT3U(zfs_btree_numnodes(t), ==, zfs_btree_numnodes(&rt->rt_root));
 
 	ASSERT3U(*cursor_end, >=, *cursor);
 
 	if ((*cursor + size) > *cursor_end) {
 		range_seg_t *rs;
 
-		rs = avl_last(&msp->ms_allocatable_by_size);
-		if (rs == NULL || (rs->rs_end - rs->rs_start) < size)
+		rs = zfs_btree_last(t, NULL);
+		if (rs == NULL ||
+		    (rs_get_end(rs, rt) - rs_get_start(rs, rt)) < size)
 			return (-1ULL);
 
-		*cursor = rs->rs_start;
-		*cursor_end = rs->rs_end;
+		*cursor = rs_get_start(rs, rt);
+		*cursor_end = rs_get_end(rs, rt);
 	}
 
 	offset = *cursor;
@@ -1462,39 +1502,43 @@ uint64_t metaslab_ndf_clump_shift = 4;
 static uint64_t
 metaslab_ndf_alloc(metaslab_t *msp, uint64_t size)
 {
-	avl_tree_t *t = &msp->ms_allocatable->rt_root;
-	avl_index_t where;
-	range_seg_t *rs, rsearch;
+	range_tree_t *rt = msp->ms_allocatable;
+	zfs_btree_t *t = &rt->rt_root;
+	zfs_btree_index_t where;
+	range_seg_t *rs;
+	range_seg_max_t rsearch;
 	uint64_t hbit = highbit64(size);
 	uint64_t *cursor = &msp->ms_lbas[hbit - 1];
 	uint64_t max_size = metaslab_block_maxsize(msp);
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
-	ASSERT3U(avl_numnodes(t), ==,
-	    avl_numnodes(&msp->ms_allocatable_by_size));
+	ASSERT3U(zfs_btree_numnodes(t), ==,
+	    zfs_btree_numnodes(&msp->ms_allocatable_by_size));
 
 	if (max_size < size)
 		return (-1ULL);
 
-	rsearch.rs_start = *cursor;
-	rsearch.rs_end = *cursor + size;
+	if (*cursor < rt->rt_start)
+		*cursor = rt->rt_start;
+	rs_set_start(&rsearch, rt, *cursor);
+	rs_set_end(&rsearch, rt, *cursor + size);
 
-	rs = avl_find(t, &rsearch, &where);
-	if (rs == NULL || (rs->rs_end - rs->rs_start) < size) {
+	rs = zfs_btree_find(t, &rsearch, &where);
+	if (rs == NULL || (rs_get_end(rs, rt) - rs_get_start(rs, rt)) < size) {
 		t = &msp->ms_allocatable_by_size;
 
-		rsearch.rs_start = 0;
-		rsearch.rs_end = MIN(max_size,
-		    1ULL << (hbit + metaslab_ndf_clump_shift));
-		rs = avl_find(t, &rsearch, &where);
+		rs_set_start(&rsearch, rt, rt->rt_start);
+		rs_set_end(&rsearch, rt, rt->rt_start + MIN(max_size,
+		    1ULL << (hbit + metaslab_ndf_clump_shift)));
+		rs = zfs_btree_find(t, &rsearch, &where);
 		if (rs == NULL)
-			rs = avl_nearest(t, where, AVL_AFTER);
+			rs = zfs_btree_next(t, &where, &where);
 		ASSERT(rs != NULL);
 	}
 
-	if ((rs->rs_end - rs->rs_start) >= size) {
-		*cursor = rs->rs_start + size;
-		return (rs->rs_start);
+	if ((rs_get_end(rs, rt) - rs_get_start(rs, rt)) >= size) {
+		*cursor = rs_get_start(rs, rt) + size;
+		return (rs_get_start(rs, rt));
 	}
 	return (-1ULL);
 }
@@ -1589,12 +1633,32 @@ metaslab_load_impl(metaslab_t *msp)
 	ASSERT3P(msp->ms_group, !=, NULL);
 	msp->ms_loaded = B_TRUE;
 
+	/*
+	 * Apply the changes that were recorded in the log space maps
+	 * but have not been flushed to the metaslab's space map yet.
+	 * The ms_sm can't have changed while we were reading it, since
+	 * metaslab_flush() is the only writer to the ms_sm of a metaslab
+	 * that uses the log and it skips metaslabs that are loading.
+	 */
+	range_tree_walk(msp->ms_unflushed_allocs,
+	    range_tree_remove, msp->ms_allocatable);
+	range_tree_walk(msp->ms_unflushed_frees,
+	    range_tree_add, msp->ms_allocatable);
+
 	/*
 	 * The ms_allocatable contains the segments that exist in the
 	 * ms_defer trees [see ms_synced_length]. Thus we need to remove
 	 * them from ms_allocatable as they will be added again in
 	 * metaslab_sync_done().
+	 *
+	 * If the metaslab uses the log, this txg's frees were already
+	 * applied to the unflushed trees by metaslab_sync() and are now
+	 * part of ms_allocatable as well, so we remove ms_freed too.
 	 */
+	if (msp->ms_unflushed_txg != 0) {
+		range_tree_walk(msp->ms_freed,
+		    range_tree_remove, msp->ms_allocatable);
+	}
 	for (int t = 0; t < TXG_DEFER_SIZE; t++) {
 		range_tree_walk(msp->ms_defer[t],
 		    range_tree_remove, msp->ms_allocatable);
@@ -1624,7 +1688,16 @@ metaslab_load(metaslab_t *msp)
 	VERIFY(!msp->ms_loading);
 	ASSERT(!msp->ms_condensing);
 
+	/*
+	 * We set the loading flag before waiting for an ongoing flush,
+	 * so other threads know that this metaslab is already being
+	 * loaded and metaslab_flush() won't start a new flush.
+	 */
 	msp->ms_loading = B_TRUE;
+	while (msp->ms_flushing)
+		cv_wait(&msp->ms_flush_cv, &msp->ms_lock);
+	ASSERT(!msp->ms_loaded);
+
 	int error = metaslab_load_impl(msp);
 	msp->ms_loading = B_FALSE;
 	cv_broadcast(&msp->ms_load_cv);
@@ -1642,7 +1715,7 @@ metaslab_unload(metaslab_t *msp)
 	msp->ms_max_size = 0;
 }
 
-static void
+void
 metaslab_space_update(vdev_t *vd, metaslab_class_t *mc, int64_t alloc_delta,
     int64_t defer_delta, int64_t space_delta)
 {
@@ -1655,6 +1728,27 @@ metaslab_space_update(vdev_t *vd, metaslab_class_t *mc, int64_t alloc_delta,
 	    vdev_deflated_space(vd, space_delta));
 }
 
+/*
+ * Get the range tree type and the shift and start for the metaslab's trees.
+ * Metaslabs with no more than 2^32 allocatable units store their segments
+ * as 32-bit offsets from the start of the metaslab, in units of the vdev's
+ * ashift.
+ */
+static range_seg_type_t
+metaslab_calculate_range_tree_type(vdev_t *vdev, metaslab_t *msp,
+    uint64_t *start, uint64_t *shift)
+{
+	if (vdev->vdev_ms_shift - vdev->vdev_ashift < 32) {
+		*shift = vdev->vdev_ashift;
+		*start = msp->ms_start;
+		return (RANGE_SEG32);
+	} else {
+		*shift = 0;
+		*start = 0;
+		return (RANGE_SEG64);
+	}
+}
+
 int
 metaslab_init(metaslab_group_t *mg, uint64_t id, uint64_t object, uint64_t txg,
     metaslab_t **msp)
@@ -1669,6 +1763,7 @@ metaslab_init(metaslab_group_t *mg, uint64_t id, uint64_t object, uint64_t txg,
 	mutex_init(&ms->ms_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&ms->ms_sync_lock, NULL, MUTEX_DEFAULT, NULL);
 	cv_init(&ms->ms_load_cv, NULL, CV_DEFAULT, NULL);
+	cv_init(&ms->ms_flush_cv, NULL, CV_DEFAULT, NULL);
 
 	ms->ms_id = id;
 	ms->ms_start = id << vd->vdev_ms_shift;
@@ -1708,9 +1803,19 @@ metaslab_init(metaslab_group_t *mg, uint64_t id, uint64_t object, uint64_t txg,
 	 * we'd data fault on any attempt to use this metaslab before
 	 * it's ready.
 	 */
-	ms->ms_allocatable = range_tree_create(&metaslab_rt_ops, ms);
+	range_seg_type_t type;
+	uint64_t shift, start;
+	type = metaslab_calculate_range_tree_type(vd, ms, &start, &shift);
+
+	ms->ms_allocatable = range_tree_create(&metaslab_rt_ops, type, ms,
+	    start, shift);
+
+	ms->ms_trim = range_tree_create(NULL, type, NULL, start, shift);
 
-	ms->ms_trim = range_tree_create(NULL, NULL);
+	ms->ms_unflushed_allocs = range_tree_create(NULL, type, NULL, start,
+	    shift);
+	ms->ms_unflushed_frees = range_tree_create(NULL, type, NULL, start,
+	    shift);
 
 	metaslab_group_add(mg, ms);
 	metaslab_set_fragmentation(ms);
@@ -1756,6 +1861,18 @@ metaslab_fini(metaslab_t *msp)
 {
 	metaslab_group_t *mg = msp->ms_group;
 	vdev_t *vd = mg->mg_vd;
+	spa_t *spa = vd->vdev_spa;
+
+	/*
+	 * Leave spa_metaslabs_by_flushed before metaslab_group_remove()
+	 * clears ms_group, which the tree's comparator uses.
+	 */
+	mutex_enter(&spa->spa_flushed_ms_lock);
+	if (msp->ms_unflushed_txg != 0) {
+		avl_remove(&spa->spa_metaslabs_by_flushed, msp);
+		spa_log_sm_decrement_mscount(spa, msp->ms_unflushed_txg);
+	}
+	mutex_exit(&spa->spa_flushed_ms_lock);
 
 	metaslab_group_remove(mg, msp);
 
@@ -1789,8 +1906,18 @@ metaslab_fini(metaslab_t *msp)
 	range_tree_vacate(msp->ms_trim, NULL, NULL);
 	range_tree_destroy(msp->ms_trim);
 
+	ASSERT3U(spa->spa_unflushed_stats.sus_memused, >=,
+	    metaslab_unflushed_changes_memused(msp));
+	spa->spa_unflushed_stats.sus_memused -=
+	    metaslab_unflushed_changes_memused(msp);
+	range_tree_vacate(msp->ms_unflushed_allocs, NULL, NULL);
+	range_tree_destroy(msp->ms_unflushed_allocs);
+	range_tree_vacate(msp->ms_unflushed_frees, NULL, NULL);
+	range_tree_destroy(msp->ms_unflushed_frees);
+
 	mutex_exit(&msp->ms_lock);
 	cv_destroy(&msp->ms_load_cv);
+	cv_destroy(&msp->ms_flush_cv);
 	mutex_destroy(&msp->ms_lock);
 	mutex_destroy(&msp->ms_sync_lock);
 	ASSERT3U(msp->ms_allocator, ==, -1);
@@ -2192,6 +2319,17 @@ metaslab_weight(metaslab_t *msp)
 	return (weight);
 }
 
+void
+metaslab_recalculate_weight_and_sort(metaslab_t *msp)
+{
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	/* note: we preserve the mask (e.g. indication of primary, etc..) */
+	uint64_t was_active = msp->ms_weight & METASLAB_ACTIVE_MASK;
+	metaslab_group_sort(msp->ms_group, msp,
+	    metaslab_weight(msp) | was_active);
+}
+
 static int
 metaslab_activate_allocator(metaslab_group_t *mg, metaslab_t *msp,
     int allocator, uint64_t activation_weight)
@@ -2441,7 +2579,7 @@ metaslab_should_condense(metaslab_t *msp)
 	 * We always condense metaslabs that are empty and metaslabs for
 	 * which a condense request has been made.
 	 */
-	if (avl_is_empty(&msp->ms_allocatable_by_size) ||
+	if (range_tree_numsegs(msp->ms_allocatable) == 0 ||
 	    msp->ms_condense_wanted)
 		return (B_TRUE);
 
@@ -2461,12 +2599,20 @@ metaslab_should_condense(metaslab_t *msp)
  * Condense the on-disk space map representation to its minimized form.
  * The minimized form consists of a small number of allocations followed by
  * the entries of the free range tree.
+ *
+ * For metaslabs that use the log space map, this is called from
+ * metaslab_flush() in sync pass 1, before this txg's changes have been
+ * processed by metaslab_sync(). In that case the condensed space map
+ * describes the metaslab as of the end of the previous txg, and it
+ * also absorbs the unflushed changes.
  */
 static void
 metaslab_condense(metaslab_t *msp, uint64_t txg, dmu_tx_t *tx)
 {
 	range_tree_t *condense_tree;
 	space_map_t *sm = msp->ms_sm;
+	spa_t *spa = msp->ms_group->mg_vd->vdev_spa;
+	boolean_t logged = (msp->ms_unflushed_txg != 0);
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
 	ASSERT(msp->ms_loaded);
@@ -2476,32 +2622,73 @@ metaslab_condense(metaslab_t *msp, uint64_t txg, dmu_tx_t *tx)
 	    msp->ms_id, msp, msp->ms_group->mg_vd->vdev_id,
 	    msp->ms_group->mg_vd->vdev_spa->spa_name,
 	    space_map_length(msp->ms_sm),
-	    avl_numnodes(&msp->ms_allocatable->rt_root),
+	    range_tree_numsegs(msp->ms_allocatable),
 	    msp->ms_condense_wanted ? "TRUE" : "FALSE");
 
 	msp->ms_condense_wanted = B_FALSE;
 
-	/*
-	 * Create an range tree that is 100% allocated. We remove segments
-	 * that have been freed in this txg, any deferred frees that exist,
-	 * and any allocation in the future. Removing segments should be
-	 * a relatively inexpensive operation since we expect these trees to
-	 * have a small number of nodes.
-	 */
-	condense_tree = range_tree_create(NULL, NULL);
-	range_tree_add(condense_tree, msp->ms_start, msp->ms_size);
+	range_seg_type_t type;
+	uint64_t shift, start;
+	type = metaslab_calculate_range_tree_type(msp->ms_group->mg_vd, msp,
+	    &start, &shift);
 
-	range_tree_walk(msp->ms_freeing, range_tree_remove, condense_tree);
-	range_tree_walk(msp->ms_freed, range_tree_remove, condense_tree);
+	condense_tree = range_tree_create(NULL, type, NULL, start, shift);
+	if (!logged) {
+		/*
+		 * Create an range tree that is 100% allocated. We remove
+		 * segments that have been freed in this txg, any deferred
+		 * frees that exist, and any allocation in the future.
+		 * Removing segments should be a relatively inexpensive
+		 * operation since we expect these trees to have a small
+		 * number of nodes.
+		 */
+		range_tree_add(condense_tree, msp->ms_start, msp->ms_size);
 
-	for (int t = 0; t < TXG_DEFER_SIZE; t++) {
-		range_tree_walk(msp->ms_defer[t],
-		    range_tree_remove, condense_tree);
-	}
+		range_tree_walk(msp->ms_freeing, range_tree_remove,
+		    condense_tree);
+		range_tree_walk(msp->ms_freed, range_tree_remove,
+		    condense_tree);
+
+		for (int t = 0; t < TXG_DEFER_SIZE; t++) {
+			range_tree_walk(msp->ms_defer[t],
+			    range_tree_remove, condense_tree);
+		}
+
+		for (int t = 1; t < TXG_CONCURRENT_STATES; t++) {
+			range_tree_walk(msp->ms_allocating[(txg + t) &
+			    TXG_MASK], range_tree_remove, condense_tree);
+		}
+	} else {
+		/*
+		 * Collect the segments that were free at the end of the
+		 * previous txg but are not in ms_allocatable: the deferred
+		 * frees and everything allocated since, including this
+		 * txg's allocations (they are written to the log later in
+		 * this txg). ms_freeing is ignored for the same reason and
+		 * ms_freed is empty in sync pass 1.
+		 *
+		 * The unflushed changes are already reflected in
+		 * ms_allocatable, so they are simply dropped.
+		 */
+		ASSERT3U(spa_sync_pass(spa), ==, 1);
+		ASSERT(range_tree_is_empty(msp->ms_freed));
 
-	for (int t = 1; t < TXG_CONCURRENT_STATES; t++) {
-		range_tree_walk(msp->ms_allocating[(txg + t) & TXG_MASK],
-		    range_tree_remove, condense_tree);
+		for (int t = 0; t < TXG_DEFER_SIZE; t++) {
+			range_tree_walk(msp->ms_defer[t],
+			    range_tree_add, condense_tree);
+		}
+
+		for (int t = 0; t < TXG_CONCURRENT_STATES; t++) {
+			range_tree_walk(msp->ms_allocating[(txg + t) &
+			    TXG_MASK], range_tree_add, condense_tree);
+		}
+
+		ASSERT3U(spa->spa_unflushed_stats.sus_memused, >=,
+		    metaslab_unflushed_changes_memused(msp));
+		spa->spa_unflushed_stats.sus_memused -=
+		    metaslab_unflushed_changes_memused(msp);
+		range_tree_vacate(msp->ms_unflushed_allocs, NULL, NULL);
+		range_tree_vacate(msp->ms_unflushed_frees, NULL, NULL);
 	}
 
 	/*
@@ -2527,16 +2714,222 @@ metaslab_condense(metaslab_t *msp, uint64_t txg, dmu_tx_t *tx)
 	 * allocation only tree followed by the in-core free tree. While not
 	 * optimal, this is typically close to optimal, and much cheaper to
 	 * compute.
+	 *
+	 * When the metaslab uses the log, we instead write a single
+	 * allocation for the whole metaslab followed by the free tree
+	 * and the segments collected above.
 	 */
-	space_map_write(sm, condense_tree, SM_ALLOC, SM_NO_VDEVID, tx);
+	if (!logged) {
+		space_map_write(sm, condense_tree, SM_ALLOC, SM_NO_VDEVID, tx);
+		space_map_write(sm, msp->ms_allocatable, SM_FREE,
+		    SM_NO_VDEVID, tx);
+	} else {
+		range_tree_t *tmp_tree = range_tree_create(NULL, type, NULL,
+		    start, shift);
+		range_tree_add(tmp_tree, msp->ms_start, msp->ms_size);
+		space_map_write(sm, tmp_tree, SM_ALLOC, SM_NO_VDEVID, tx);
+		range_tree_vacate(tmp_tree, NULL, NULL);
+		range_tree_destroy(tmp_tree);
+
+		space_map_write(sm, msp->ms_allocatable, SM_FREE,
+		    SM_NO_VDEVID, tx);
+		space_map_write(sm, condense_tree, SM_FREE, SM_NO_VDEVID, tx);
+	}
 	range_tree_vacate(condense_tree, NULL, NULL);
 	range_tree_destroy(condense_tree);
 
-	space_map_write(sm, msp->ms_allocatable, SM_FREE, SM_NO_VDEVID, tx);
 	mutex_enter(&msp->ms_lock);
 	msp->ms_condensing = B_FALSE;
 }
 
+int
+metaslab_sort_by_flushed(const void *va, const void *vb)
+{
+	const metaslab_t *a = va;
+	const metaslab_t *b = vb;
+
+	int cmp = AVL_CMP(a->ms_unflushed_txg, b->ms_unflushed_txg);
+	if (cmp != 0)
+		return (cmp);
+
+	uint64_t a_vdev_id = a->ms_group->mg_vd->vdev_id;
+	uint64_t b_vdev_id = b->ms_group->mg_vd->vdev_id;
+	cmp = AVL_CMP(a_vdev_id, b_vdev_id);
+	if (cmp)
+		return (cmp);
+
+	return (AVL_CMP(a->ms_id, b->ms_id));
+}
+
+/*
+ * Memory used by the metaslab's unflushed changes, accounted in
+ * spa_unflushed_stats to bound the size of the log.
+ */
+uint64_t
+metaslab_unflushed_changes_memused(metaslab_t *ms)
+{
+	return ((range_tree_numsegs(ms->ms_unflushed_allocs) +
+	    range_tree_numsegs(ms->ms_unflushed_frees)) *
+	    ms->ms_unflushed_allocs->rt_root.bt_elem_size);
+}
+
+/*
+ * Record ms_unflushed_txg in the per-vdev array of the vdev's top ZAP,
+ * so it can be found at import when replaying the log space maps.
+ */
+static void
+metaslab_update_ondisk_flush_data(metaslab_t *ms, dmu_tx_t *tx)
+{
+	vdev_t *vd = ms->ms_group->mg_vd;
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa_meta_objset(spa);
+
+	ASSERT(spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP));
+	ASSERT3U(vd->vdev_top_zap, !=, 0);
+
+	metaslab_unflushed_phys_t entry = {
+		.msp_unflushed_txg = ms->ms_unflushed_txg,
+	};
+	uint64_t entry_size = sizeof (entry);
+	uint64_t entry_offset = ms->ms_id * entry_size;
+
+	uint64_t object = 0;
+	int err = zap_lookup(mos, vd->vdev_top_zap,
+	    VDEV_TOP_ZAP_MS_UNFLUSHED_PHYS_TXGS, sizeof (uint64_t), 1,
+	    &object);
+	if (err == ENOENT) {
+		object = dmu_object_alloc(mos, DMU_OTN_UINT64_METADATA,
+		    SPA_OLD_MAXBLOCKSIZE, DMU_OT_NONE, 0, tx);
+		VERIFY0(zap_add(mos, vd->vdev_top_zap,
+		    VDEV_TOP_ZAP_MS_UNFLUSHED_PHYS_TXGS, sizeof (uint64_t), 1,
+		    &object, tx));
+	} else {
+		VERIFY0(err);
+	}
+
+	dmu_write(mos, object, entry_offset, entry_size, &entry, tx);
+}
+
+/*
+ * Mark all changes of the metaslab up to the previous txg as flushed,
+ * i.e. the metaslab's oldest unflushed changes now live in this txg's
+ * log space map.
+ */
+static void
+metaslab_unflushed_bump(metaslab_t *msp, dmu_tx_t *tx)
+{
+	spa_t *spa = msp->ms_group->mg_vd->vdev_spa;
+	uint64_t txg = dmu_tx_get_txg(tx);
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+	ASSERT3P(spa_syncing_log_sm(spa), !=, NULL);
+	ASSERT3U(msp->ms_unflushed_txg, <, txg);
+
+	mutex_enter(&spa->spa_flushed_ms_lock);
+	if (msp->ms_unflushed_txg != 0) {
+		avl_remove(&spa->spa_metaslabs_by_flushed, msp);
+		spa_log_sm_decrement_mscount(spa, msp->ms_unflushed_txg);
+	}
+	msp->ms_unflushed_txg = txg;
+	avl_add(&spa->spa_metaslabs_by_flushed, msp);
+	spa_log_sm_increment_current_mscount(spa);
+	mutex_exit(&spa->spa_flushed_ms_lock);
+
+	metaslab_update_ondisk_flush_data(msp, tx);
+}
+
+/*
+ * Write the metaslab's unflushed changes to its own space map (or
+ * condense it, if it's loaded and due), so that the log space maps
+ * holding them can eventually be destroyed. Called from
+ * spa_flush_metaslabs() in sync pass 1 with ms_sync_lock and ms_lock
+ * held. Returns B_FALSE if the metaslab could not be flushed.
+ */
+boolean_t
+metaslab_flush(metaslab_t *msp, dmu_tx_t *tx)
+{
+	metaslab_group_t *mg = msp->ms_group;
+	vdev_t *vd = mg->mg_vd;
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa_meta_objset(spa);
+	uint64_t txg = dmu_tx_get_txg(tx);
+	uint64_t object = space_map_object(msp->ms_sm);
+
+	ASSERT(MUTEX_HELD(&msp->ms_sync_lock));
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+	ASSERT3U(spa_sync_pass(spa), ==, 1);
+	ASSERT(spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP));
+	ASSERT3P(msp->ms_sm, !=, NULL);
+	ASSERT3U(msp->ms_unflushed_txg, !=, 0);
+	ASSERT3U(msp->ms_unflushed_txg, <, txg);
+
+	/*
+	 * We can not flush while loading, because then the load would
+	 * miss the unflushed changes that we are about to write out.
+	 */
+	if (msp->ms_loading)
+		return (B_FALSE);
+
+	if (msp->ms_loaded && metaslab_should_condense(msp)) {
+		/*
+		 * Condensing rewrites the whole space map, which flushes
+		 * the unflushed changes as a side effect. It also clears
+		 * the space map's histogram, so we rebuild it here the
+		 * same way metaslab_sync() does.
+		 */
+		metaslab_group_histogram_verify(mg);
+		metaslab_class_histogram_verify(mg->mg_class);
+		metaslab_group_histogram_remove(mg, msp);
+
+		metaslab_condense(msp, txg, tx);
+
+		space_map_histogram_clear(msp->ms_sm);
+		space_map_histogram_add(msp->ms_sm, msp->ms_allocatable, tx);
+		for (int t = 0; t < TXG_DEFER_SIZE; t++) {
+			space_map_histogram_add(msp->ms_sm,
+			    msp->ms_defer[t], tx);
+		}
+
+		metaslab_group_histogram_add(mg, msp);
+		metaslab_group_histogram_verify(mg);
+		metaslab_class_histogram_verify(mg->mg_class);
+	} else {
+		msp->ms_flushing = B_TRUE;
+
+		mutex_exit(&msp->ms_lock);
+		space_map_write(msp->ms_sm, msp->ms_unflushed_allocs, SM_ALLOC,
+		    SM_NO_VDEVID, tx);
+		space_map_write(msp->ms_sm, msp->ms_unflushed_frees, SM_FREE,
+		    SM_NO_VDEVID, tx);
+		mutex_enter(&msp->ms_lock);
+
+		ASSERT3U(spa->spa_unflushed_stats.sus_memused, >=,
+		    metaslab_unflushed_changes_memused(msp));
+		spa->spa_unflushed_stats.sus_memused -=
+		    metaslab_unflushed_changes_memused(msp);
+		range_tree_vacate(msp->ms_unflushed_allocs, NULL, NULL);
+		range_tree_vacate(msp->ms_unflushed_frees, NULL, NULL);
+
+		msp->ms_flushing = B_FALSE;
+		cv_broadcast(&msp->ms_flush_cv);
+	}
+
+	/*
+	 * A flushed metaslab doesn't necessarily go through
+	 * metaslab_sync_done() this txg, so update ms_synced_length here.
+	 */
+	msp->ms_synced_length = space_map_length(msp->ms_sm);
+	metaslab_unflushed_bump(msp, tx);
+	metaslab_recalculate_weight_and_sort(msp);
+
+	if (object != space_map_object(msp->ms_sm)) {
+		object = space_map_object(msp->ms_sm);
+		dmu_write(mos, vd->vdev_ms_array, sizeof (uint64_t) *
+		    msp->ms_id, sizeof (uint64_t), &object, tx);
+	}
+	return (B_TRUE);
+}
+
 /*
  * Write a metaslab to disk in the context of the specified transaction group.
  */
@@ -2596,6 +2989,17 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 	 */
 	tx = dmu_tx_create_assigned(spa_get_dsl(spa), txg);
 
+	/*
+	 * Generate a log space map if one doesn't exist already. Vdevs
+	 * without a top-level ZAP have nowhere to record their flush
+	 * state, so they keep writing to their own space maps.
+	 */
+	space_map_t *log_sm = NULL;
+	if (vd->vdev_top_zap != 0) {
+		spa_generate_syncing_log_sm(spa, tx);
+		log_sm = spa_syncing_log_sm(spa);
+	}
+
 	if (msp->ms_sm == NULL) {
 		uint64_t new_object;
 
@@ -2643,7 +3047,35 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 	metaslab_class_histogram_verify(mg->mg_class);
 	metaslab_group_histogram_remove(mg, msp);
 
-	if (msp->ms_loaded && metaslab_should_condense(msp)) {
+	if (log_sm != NULL) {
+		/*
+		 * Append this txg's changes to the pool-wide log space map
+		 * and keep track of them in the unflushed trees. An alloc
+		 * cancels out an unflushed free of the same segment and
+		 * vice versa. Condensing is deferred to metaslab_flush().
+		 */
+		ASSERT(spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP));
+		if (msp->ms_unflushed_txg == 0)
+			metaslab_unflushed_bump(msp, tx);
+
+		mutex_exit(&msp->ms_lock);
+		space_map_write(log_sm, alloctree, SM_ALLOC,
+		    vd->vdev_id, tx);
+		space_map_write(log_sm, msp->ms_freeing, SM_FREE,
+		    vd->vdev_id, tx);
+		mutex_enter(&msp->ms_lock);
+
+		ASSERT3U(spa->spa_unflushed_stats.sus_memused, >=,
+		    metaslab_unflushed_changes_memused(msp));
+		spa->spa_unflushed_stats.sus_memused -=
+		    metaslab_unflushed_changes_memused(msp);
+		range_tree_remove_xor_add(alloctree,
+		    msp->ms_unflushed_frees, msp->ms_unflushed_allocs);
+		range_tree_remove_xor_add(msp->ms_freeing,
+		    msp->ms_unflushed_allocs, msp->ms_unflushed_frees);
+		spa->spa_unflushed_stats.sus_memused +=
+		    metaslab_unflushed_changes_memused(msp);
+	} else if (msp->ms_loaded && metaslab_should_condense(msp)) {
 		metaslab_condense(msp, txg, tx);
 	} else {
 		mutex_exit(&msp->ms_lock);
@@ -2808,26 +3240,36 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	 * range trees and add its capacity to the vdev.
 	 */
 	if (msp->ms_freed == NULL) {
+		range_seg_type_t type;
+		uint64_t shift, start;
+		type = metaslab_calculate_range_tree_type(vd, msp, &start,
+		    &shift);
+
 		for (int t = 0; t < TXG_SIZE; t++) {
 			ASSERT(msp->ms_allocating[t] == NULL);
 
-			msp->ms_allocating[t] = range_tree_create(NULL, NULL);
+			msp->ms_allocating[t] = range_tree_create(NULL, type,
+			    NULL, start, shift);
 		}
 
 		ASSERT3P(msp->ms_freeing, ==, NULL);
-		msp->ms_freeing = range_tree_create(NULL, NULL);
+		msp->ms_freeing = range_tree_create(NULL, type,
+		    NULL, start, shift);
 
 		ASSERT3P(msp->ms_freed, ==, NULL);
-		msp->ms_freed = range_tree_create(NULL, NULL);
+		msp->ms_freed = range_tree_create(NULL, type,
+		    NULL, start, shift);
 
 		for (int t = 0; t < TXG_DEFER_SIZE; t++) {
 			ASSERT(msp->ms_defer[t] == NULL);
 
-			msp->ms_defer[t] = range_tree_create(NULL, NULL);
+			msp->ms_defer[t] = range_tree_create(NULL, type,
+			    NULL, start, shift);
 		}
 
 		ASSERT3P(msp->ms_checkpointing, ==, NULL);
-		msp->ms_checkpointing = range_tree_create(NULL, NULL);
+		msp->ms_checkpointing = range_tree_create(NULL, type,
+		    NULL, start, shift);
 
 		metaslab_space_update(vd, mg->mg_class, 0, 0, msp->ms_size);
 	}
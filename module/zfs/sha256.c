@@ -90,3 +90,124 @@ abd_checksum_SHA512_byteswap(abd_t *abd, uint64_t size,
 	zcp->zc_word[2] = BSWAP_64(tmp.zc_word[2]);
 	zcp->zc_word[3] = BSWAP_64(tmp.zc_word[3]);
 }
+
+/*
+ * Number of blocks abd_checksum_SHA2_batch() hashes side by side for the
+ * given checksum, or 1 if the selected SHA2 implementation has no
+ * multi-buffer code for it and batching the blocks gains nothing.
+ */
+uint_t
+abd_checksum_SHA2_batch_width(enum zio_checksum checksum)
+{
+	switch (checksum) {
+	case ZIO_CHECKSUM_SHA256:
+		return (SHA2MultiLanes(SHA256));
+	case ZIO_CHECKSUM_SHA512:
+		return (SHA2MultiLanes(SHA512_256));
+	default:
+		return (1);
+	}
+}
+
+/*
+ * abd_checksum_SHA2_batch() hashes the blocks a window of this many bytes
+ * at a time, a multiple of both SHA2 block sizes.
+ */
+#define	SHA2_BATCH_WINDOW	1024
+
+typedef struct sha2_batch_window {
+	const void	*sbw_in;	/* the window */
+	uint8_t		*sbw_buf;	/* for a window split across chunks */
+	size_t		sbw_len;	/* bytes copied to sbw_buf */
+} sha2_batch_window_t;
+
+/*
+ * Point at a window of a block.  ABD chunks stay mapped in this port, so
+ * a window that lies in one chunk (or in a linear ABD) is hashed in place
+ * after abd_iterate_func() returns; only a window that straddles chunks
+ * is copied.
+ */
+static int
+sha2_batch_window_cb(void *buf, size_t size, void *arg)
+{
+	sha2_batch_window_t *sbw = arg;
+
+	if (size == SHA2_BATCH_WINDOW) {
+		sbw->sbw_in = buf;
+		return (0);
+	}
+
+	bcopy(buf, sbw->sbw_buf + sbw->sbw_len, size);
+	sbw->sbw_len += size;
+	sbw->sbw_in = sbw->sbw_buf;
+	return (0);
+}
+
+/*
+ * Computes the native SHA256 or SHA512 checksums of n blocks at once, the
+ * same as abd_checksum_SHA256() and abd_checksum_SHA512_native() would
+ * one block at a time.  The lanes are fed the blocks window by window,
+ * straight from their ABDs, rather than from linear copies of the blocks:
+ * borrowing a linear copy of every block costs about as much as the
+ * multi-buffer code saves.  The tail of each block that does not fill a
+ * window is hashed on its own.
+ */
+void
+abd_checksum_SHA2_batch(enum zio_checksum checksum, abd_t **abds,
+    const uint64_t *sizes, uint_t n, zio_cksum_t *zcp)
+{
+	SHA2_CTX	*ctx[ZIO_CHECKSUM_BATCH_MAX];
+	const void	*in[ZIO_CHECKSUM_BATCH_MAX];
+	SHA2_CTX	*ctxs;
+	sha2_batch_window_t sbw;
+	uint8_t		*bufs;
+	uint64_t	off, done;
+	uint_t		i, lanes;
+
+	ASSERT(checksum == ZIO_CHECKSUM_SHA256 ||
+	    checksum == ZIO_CHECKSUM_SHA512);
+	ASSERT3U(n, <=, ZIO_CHECKSUM_BATCH_MAX);
+
+	ctxs = kmem_alloc(n * sizeof (SHA2_CTX), KM_SLEEP);
+	bufs = kmem_alloc(n * SHA2_BATCH_WINDOW, KM_SLEEP);
+	for (i = 0; i < n; i++) {
+		SHA2Init(checksum == ZIO_CHECKSUM_SHA256 ? SHA256 : SHA512_256,
+		    &ctxs[i]);
+	}
+
+	for (off = 0; ; off += SHA2_BATCH_WINDOW) {
+		for (i = 0, lanes = 0; i < n; i++) {
+			if (off + SHA2_BATCH_WINDOW > sizes[i])
+				continue;
+			sbw.sbw_in = NULL;
+			sbw.sbw_buf = bufs + lanes * SHA2_BATCH_WINDOW;
+			sbw.sbw_len = 0;
+			(void) abd_iterate_func(abds[i], off, SHA2_BATCH_WINDOW,
+			    sha2_batch_window_cb, &sbw);
+			ctx[lanes] = &ctxs[i];
+			in[lanes] = sbw.sbw_in;
+			lanes++;
+		}
+		if (lanes == 0)
+			break;
+		SHA2MultiUpdate(ctx, in, SHA2_BATCH_WINDOW, lanes);
+	}
+
+	for (i = 0; i < n; i++) {
+		done = P2ALIGN(sizes[i], SHA2_BATCH_WINDOW);
+		(void) abd_iterate_func(abds[i], done, sizes[i] - done,
+		    sha_incremental, &ctxs[i]);
+		SHA2Final(&zcp[i], &ctxs[i]);
+
+		/* see abd_checksum_SHA256() */
+		if (checksum == ZIO_CHECKSUM_SHA256) {
+			zcp[i].zc_word[0] = BE_64(zcp[i].zc_word[0]);
+			zcp[i].zc_word[1] = BE_64(zcp[i].zc_word[1]);
+			zcp[i].zc_word[2] = BE_64(zcp[i].zc_word[2]);
+			zcp[i].zc_word[3] = BE_64(zcp[i].zc_word[3]);
+		}
+	}
+
+	kmem_free(bufs, n * SHA2_BATCH_WINDOW);
+	kmem_free(ctxs, n * sizeof (SHA2_CTX));
+}
@@ -0,0 +1,724 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Copyright (c) 2018, 2019 by Delphix. All rights reserved.
+ */
+
+#include <sys/dmu_objset.h>
+#include <sys/metaslab.h>
+#include <sys/metaslab_impl.h>
+#include <sys/spa.h>
+#include <sys/spa_impl.h>
+#include <sys/spa_log_spacemap.h>
+#include <sys/vdev_impl.h>
+#include <sys/zap.h>
+#include <sys/zfeature.h>
+
+/*
+ * Log Space Maps
+ *
+ * Log space maps are an optimization in ZFS metadata allocations for pools
+ * whose workloads are primarily random-writes. Random-write workloads are
+ * also typically random-free, meaning that they are freeing from locations
+ * scattered throughout the pool. This means that each TXG we will have to
+ * append some FREE records to almost every metaslab. With log space maps,
+ * we hold their changes in memory and log them altogether in one pool-wide
+ * space map on-disk for persistence. As more blocks are accumulated in the
+ * log space maps and more unflushed changes are accounted in memory, we
+ * flush a selected group of metaslabs every TXG to relieve memory pressure
+ * and potential overheads when loading the pool. Flushing a metaslab to
+ * disk relieves memory as we flush any unflushed changes from memory to
+ * disk (i.e. the metaslab's space map) and saves import time by making old
+ * log space maps obsolete and thus destroyable.
+ *
+ * == On-disk data structures used ==
+ *
+ * - The pool has a feature flag and a new entry in the MOS. The feature
+ *   is activated when we create the first log space map and remains active
+ *   for the lifetime of the pool. The new entry in the MOS Directory
+ *   [DMU_POOL_LOG_SPACEMAP_ZAP] is populated with a ZAP whose key-value
+ *   pairs are of the form <key: txg, value: log space map object for
+ *   that txg>.
+ *
+ * - Each top-level vdev has an array of metaslab_unflushed_phys_t entries,
+ *   one per metaslab, recording the txg of the metaslab's oldest change
+ *   that has not been flushed to its space map yet. The array's object is
+ *   stored in the vdev's top ZAP [VDEV_TOP_ZAP_MS_UNFLUSHED_PHYS_TXGS].
+ *
+ * == In-core data structures ==
+ *
+ * - spa_sm_logs_by_txg holds one spa_log_sm_t per log space map on disk,
+ *   keeping track of its size and of how many metaslabs have their oldest
+ *   unflushed change in it (sls_mscount). A log is destroyed once no
+ *   metaslab depends on it anymore.
+ *
+ * - spa_metaslabs_by_flushed holds all metaslabs that use the log, sorted
+ *   by ms_unflushed_txg, so we always know which metaslabs to flush next.
+ *
+ * - Each metaslab has two range trees, ms_unflushed_allocs and
+ *   ms_unflushed_frees, with its changes since its last flush. They are
+ *   applied on top of the metaslab's space map when it is loaded.
+ *
+ * == Flush heuristic ==
+ *
+ * Every txg we flush at least zfs_min_metaslabs_to_flush metaslabs, plus
+ * as many of the oldest ones as needed to bring the total number of log
+ * blocks under a limit derived from the number of metaslabs in the pool
+ * [see spa_log_sm_set_blocklimit()] and the number of logs under
+ * zfs_unflushed_log_txg_max. We also keep flushing while the memory used
+ * by the unflushed trees exceeds its own limit.
+ *
+ * == Pool import ==
+ *
+ * At import we read the flushed txg of every metaslab, then iterate
+ * every log space map from oldest to newest, applying each entry to the
+ * unflushed trees of its metaslab if the entry's txg is not older than the
+ * metaslab's flushed txg [see spa_ld_log_spacemaps()].
+ */
+
+/*
+ * Hard upper limit on the amount of memory used by the unflushed changes
+ * of all metaslabs, and its limit as a fraction (parts per million) of
+ * physical memory. The smaller of the two applies.
+ */
+uint64_t zfs_unflushed_max_mem_amt = 1ULL << 30;
+uint64_t zfs_unflushed_max_mem_ppm = 1000;
+
+/*
+ * Bounds on the number of blocks allowed in all log space maps. The
+ * limit scales with the number of metaslabs in the pool, as a
+ * percentage given by zfs_unflushed_log_block_pct.
+ */
+uint64_t zfs_unflushed_log_block_max = (1ULL << 18);
+uint64_t zfs_unflushed_log_block_min = 1000;
+uint64_t zfs_unflushed_log_block_pct = 400;
+
+/*
+ * Upper bound on the number of log space maps (i.e. txgs) that can be
+ * kept around. Lower values mean faster imports at the expense of more
+ * metaslab flushing.
+ */
+uint64_t zfs_unflushed_log_txg_max = 1000;
+
+/* Minimum number of metaslabs flushed per dirty txg. */
+uint64_t zfs_min_metaslabs_to_flush = 1;
+
+/* Block size of log space maps. */
+uint64_t zfs_log_sm_blksz = 1ULL << 17;
+
+int
+spa_log_sm_sort_by_txg(const void *va, const void *vb)
+{
+	const spa_log_sm_t *a = va;
+	const spa_log_sm_t *b = vb;
+
+	return (AVL_CMP(a->sls_txg, b->sls_txg));
+}
+
+space_map_t *
+spa_syncing_log_sm(spa_t *spa)
+{
+	return (spa->spa_syncing_log_sm);
+}
+
+static spa_log_sm_t *
+spa_log_sm_alloc(uint64_t sm_obj, uint64_t txg)
+{
+	spa_log_sm_t *sls = kmem_zalloc(sizeof (*sls), KM_SLEEP);
+	sls->sls_sm_obj = sm_obj;
+	sls->sls_txg = txg;
+	return (sls);
+}
+
+/*
+ * The metaslab whose oldest unflushed change was in the log of the
+ * given txg has been flushed or is going away.
+ */
+void
+spa_log_sm_decrement_mscount(spa_t *spa, uint64_t txg)
+{
+	spa_log_sm_t target = { .sls_txg = txg };
+	spa_log_sm_t *sls = avl_find(&spa->spa_sm_logs_by_txg,
+	    &target, NULL);
+
+	/*
+	 * The log may already be gone if the metaslab's changes in it were
+	 * all cancelled out, which can happen during import.
+	 */
+	if (sls == NULL)
+		return;
+
+	ASSERT3U(sls->sls_mscount, >, 0);
+	sls->sls_mscount--;
+}
+
+void
+spa_log_sm_increment_current_mscount(spa_t *spa)
+{
+	spa_log_sm_t *last_sls = avl_last(&spa->spa_sm_logs_by_txg);
+
+	ASSERT3P(last_sls, !=, NULL);
+	ASSERT3U(last_sls->sls_txg, ==, spa_syncing_txg(spa));
+	last_sls->sls_mscount++;
+}
+
+void
+spa_log_sm_set_blocklimit(spa_t *spa)
+{
+	if (!spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP)) {
+		spa->spa_unflushed_stats.sus_blocklimit = 0;
+		return;
+	}
+
+	uint64_t msdcount = 0;
+	vdev_t *rvd = spa->spa_root_vdev;
+	for (uint64_t c = 0; c < rvd->vdev_children; c++)
+		msdcount += rvd->vdev_child[c]->vdev_ms_count;
+
+	uint64_t limit = msdcount * zfs_unflushed_log_block_pct / 100;
+	spa->spa_unflushed_stats.sus_blocklimit = MIN(MAX(limit,
+	    zfs_unflushed_log_block_min), zfs_unflushed_log_block_max);
+}
+
+boolean_t
+spa_log_exceeds_memlimit(spa_t *spa)
+{
+	uint64_t system_mem_allowed = (physmem * PAGESIZE) *
+	    zfs_unflushed_max_mem_ppm / 1000000;
+
+	return (spa->spa_unflushed_stats.sus_memused >
+	    MIN(zfs_unflushed_max_mem_amt, system_mem_allowed));
+}
+
+/*
+ * Create the log space map of the syncing txg, if it hasn't been created
+ * already. Called from metaslab_sync() for each metaslab with changes, so
+ * that txgs without any changes don't get a log.
+ */
+void
+spa_generate_syncing_log_sm(spa_t *spa, dmu_tx_t *tx)
+{
+	uint64_t txg = dmu_tx_get_txg(tx);
+	objset_t *mos = spa_meta_objset(spa);
+
+	if (spa_syncing_log_sm(spa) != NULL)
+		return;
+
+	if (!spa_feature_is_enabled(spa, SPA_FEATURE_LOG_SPACEMAP))
+		return;
+
+	/*
+	 * If the log space map feature is enabled then the spacemap_v2
+	 * feature must be active.
+	 */
+	ASSERT(spa_feature_is_active(spa, SPA_FEATURE_SPACEMAP_V2));
+
+	if (!spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP))
+		spa_feature_incr(spa, SPA_FEATURE_LOG_SPACEMAP, tx);
+
+	uint64_t spacemap_zap;
+	int error = zap_lookup(mos, DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_LOG_SPACEMAP_ZAP, sizeof (spacemap_zap), 1,
+	    &spacemap_zap);
+	if (error == ENOENT) {
+		ASSERT(avl_is_empty(&spa->spa_sm_logs_by_txg));
+
+		spacemap_zap = zap_create(mos, DMU_OTN_ZAP_METADATA,
+		    DMU_OT_NONE, 0, tx);
+		VERIFY0(zap_add(mos, DMU_POOL_DIRECTORY_OBJECT,
+		    DMU_POOL_LOG_SPACEMAP_ZAP, sizeof (spacemap_zap), 1,
+		    &spacemap_zap, tx));
+	} else {
+		VERIFY0(error);
+	}
+
+	uint64_t sm_obj;
+	ASSERT3U(zap_lookup_int_key(mos, spacemap_zap, txg, &sm_obj),
+	    ==, ENOENT);
+	sm_obj = space_map_alloc(mos, zfs_log_sm_blksz, tx);
+	VERIFY0(zap_add_int_key(mos, spacemap_zap, txg, sm_obj, tx));
+	avl_add(&spa->spa_sm_logs_by_txg, spa_log_sm_alloc(sm_obj, txg));
+
+	/*
+	 * We pass UINT64_MAX as the space map's representation size
+	 * and SPA_MINBLOCKSHIFT as the shift, to make the space map
+	 * accept any sorts of segments since there's no real advantage
+	 * to being more restrictive (given that we're already going
+	 * to be using 2-word entries).
+	 */
+	VERIFY0(space_map_open(&spa->spa_syncing_log_sm, mos, sm_obj,
+	    0, UINT64_MAX, SPA_MINBLOCKSHIFT));
+}
+
+/*
+ * Number of metaslabs we need to flush this txg so that the logs stay
+ * within the block and txg limits, assuming we flush the oldest ones.
+ */
+static uint64_t
+spa_estimate_metaslabs_to_flush(spa_t *spa)
+{
+	uint64_t nblocks = spa->spa_unflushed_stats.sus_nblocks;
+	uint64_t blocklimit = spa->spa_unflushed_stats.sus_blocklimit;
+	uint64_t nlogs = avl_numnodes(&spa->spa_sm_logs_by_txg);
+	uint64_t want = 0;
+
+	for (spa_log_sm_t *sls = avl_first(&spa->spa_sm_logs_by_txg);
+	    sls != NULL && (nblocks > blocklimit ||
+	    nlogs > zfs_unflushed_log_txg_max);
+	    sls = AVL_NEXT(&spa->spa_sm_logs_by_txg, sls)) {
+		want += sls->sls_mscount;
+		nblocks -= MIN(nblocks, sls->sls_nblocks);
+		nlogs--;
+	}
+
+	return (MAX(want, zfs_min_metaslabs_to_flush));
+}
+
+/*
+ * Flush the metaslabs with the oldest unflushed changes, so that old log
+ * space maps can be destroyed. Called in sync pass 1, before vdev_sync().
+ */
+void
+spa_flush_metaslabs(spa_t *spa, dmu_tx_t *tx)
+{
+	uint64_t txg = dmu_tx_get_txg(tx);
+
+	ASSERT3U(spa_sync_pass(spa), ==, 1);
+
+	if (!spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP))
+		return;
+
+	/*
+	 * If we don't have any metaslabs with unflushed changes
+	 * return immediately.
+	 */
+	if (avl_numnodes(&spa->spa_metaslabs_by_flushed) == 0)
+		return;
+
+	/*
+	 * Don't dirty an otherwise idle txg just to flush metaslabs; the
+	 * logs can only grow in txgs with changes anyway.
+	 */
+	if (spa->spa_uberblock.ub_rootbp.blk_birth < txg &&
+	    !dmu_objset_is_dirty(spa_meta_objset(spa), txg))
+		return;
+
+	/*
+	 * We need to generate a log space map before flushing because this
+	 * will set up the in-memory data (i.e. node in spa_sm_logs_by_txg)
+	 * for this TXG's flushed metaslab count (aka sls_mscount which is
+	 * manipulated in many ways down the metaslab_flush() codepath).
+	 */
+	spa_generate_syncing_log_sm(spa, tx);
+	spa_log_sm_set_blocklimit(spa);
+
+	uint64_t want_to_flush = spa_estimate_metaslabs_to_flush(spa);
+	uint64_t flushed = 0;
+
+	for (;;) {
+		mutex_enter(&spa->spa_flushed_ms_lock);
+		metaslab_t *curr = avl_first(&spa->spa_metaslabs_by_flushed);
+		mutex_exit(&spa->spa_flushed_ms_lock);
+
+		if (curr == NULL || curr->ms_unflushed_txg == txg)
+			break;
+		if (flushed >= want_to_flush && !spa_log_exceeds_memlimit(spa))
+			break;
+
+		mutex_enter(&curr->ms_sync_lock);
+		mutex_enter(&curr->ms_lock);
+		boolean_t success = metaslab_flush(curr, tx);
+		mutex_exit(&curr->ms_lock);
+		mutex_exit(&curr->ms_sync_lock);
+
+		/*
+		 * If we failed to flush a metaslab (because it was loading)
+		 * it stays first in line, so no log space map could be
+		 * destroyed by flushing more. Try again next txg.
+		 */
+		if (!success)
+			break;
+
+		flushed++;
+	}
+
+	spa_cleanup_old_sm_logs(spa, tx);
+}
+
+/*
+ * Close the log space map of this txg, once all of this txg's sync
+ * passes are done.
+ */
+void
+spa_sync_close_syncing_log_sm(spa_t *spa)
+{
+	if (spa_syncing_log_sm(spa) == NULL)
+		return;
+	ASSERT(spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP));
+
+	spa_log_sm_t *sls = avl_last(&spa->spa_sm_logs_by_txg);
+	ASSERT3U(sls->sls_txg, ==, spa_syncing_txg(spa));
+
+	sls->sls_nblocks = space_map_nblocks(spa_syncing_log_sm(spa));
+	spa->spa_unflushed_stats.sus_nblocks += sls->sls_nblocks;
+
+	space_map_close(spa->spa_syncing_log_sm);
+	spa->spa_syncing_log_sm = NULL;
+}
+
+/*
+ * Destroy the log space maps that no metaslab depends on anymore, i.e.
+ * those older than the oldest unflushed change of any metaslab.
+ */
+void
+spa_cleanup_old_sm_logs(spa_t *spa, dmu_tx_t *tx)
+{
+	objset_t *mos = spa_meta_objset(spa);
+
+	uint64_t spacemap_zap;
+	int error = zap_lookup(mos, DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_LOG_SPACEMAP_ZAP, sizeof (spacemap_zap), 1,
+	    &spacemap_zap);
+	if (error == ENOENT) {
+		ASSERT(avl_is_empty(&spa->spa_sm_logs_by_txg));
+		return;
+	}
+	VERIFY0(error);
+
+	mutex_enter(&spa->spa_flushed_ms_lock);
+	metaslab_t *oldest = avl_first(&spa->spa_metaslabs_by_flushed);
+	uint64_t oldest_flushed_txg = (oldest != NULL) ?
+	    oldest->ms_unflushed_txg : dmu_tx_get_txg(tx);
+	mutex_exit(&spa->spa_flushed_ms_lock);
+
+	/* Free all log space maps older than the oldest_flushed_txg. */
+	for (spa_log_sm_t *sls = avl_first(&spa->spa_sm_logs_by_txg);
+	    sls != NULL && sls->sls_txg < oldest_flushed_txg;
+	    sls = avl_first(&spa->spa_sm_logs_by_txg)) {
+		ASSERT0(sls->sls_mscount);
+		avl_remove(&spa->spa_sm_logs_by_txg, sls);
+		space_map_free_obj(mos, sls->sls_sm_obj, tx);
+		VERIFY0(zap_remove_int(mos, spacemap_zap, sls->sls_txg, tx));
+		ASSERT3U(spa->spa_unflushed_stats.sus_nblocks, >=,
+		    sls->sls_nblocks);
+		spa->spa_unflushed_stats.sus_nblocks -= sls->sls_nblocks;
+		kmem_free(sls, sizeof (spa_log_sm_t));
+	}
+}
+
+/*
+ * Read the flushed txg of each metaslab of the pool and track the
+ * metaslabs that have unflushed changes.
+ */
+static int
+spa_ld_unflushed_txgs(vdev_t *vd)
+{
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa_meta_objset(spa);
+
+	if (vd->vdev_top_zap == 0)
+		return (0);
+
+	uint64_t object = 0;
+	int error = zap_lookup(mos, vd->vdev_top_zap,
+	    VDEV_TOP_ZAP_MS_UNFLUSHED_PHYS_TXGS,
+	    sizeof (uint64_t), 1, &object);
+	if (error == ENOENT)
+		return (0);
+	else if (error != 0) {
+		spa_load_failed(spa, "spa_ld_unflushed_txgs(): failed at "
+		    "zap_lookup(vdev_top_zap=%llu) [error %d]",
+		    (u_longlong_t)vd->vdev_top_zap, error);
+		return (error);
+	}
+
+	for (uint64_t m = 0; m < vd->vdev_ms_count; m++) {
+		metaslab_t *ms = vd->vdev_ms[m];
+		ASSERT(ms != NULL);
+
+		metaslab_unflushed_phys_t entry;
+		uint64_t entry_size = sizeof (entry);
+		uint64_t entry_offset = ms->ms_id * entry_size;
+
+		error = dmu_read(mos, object,
+		    entry_offset, entry_size, &entry, 0);
+		if (error != 0) {
+			spa_load_failed(spa, "spa_ld_unflushed_txgs(): "
+			    "failed at dmu_read(obj=%llu) [error %d]",
+			    (u_longlong_t)object, error);
+			return (error);
+		}
+
+		ms->ms_unflushed_txg = entry.msp_unflushed_txg;
+		if (ms->ms_unflushed_txg != 0) {
+			mutex_enter(&spa->spa_flushed_ms_lock);
+			avl_add(&spa->spa_metaslabs_by_flushed, ms);
+			mutex_exit(&spa->spa_flushed_ms_lock);
+		}
+	}
+	return (0);
+}
+
+typedef struct spa_ld_log_sm_arg {
+	spa_t *slls_spa;
+	uint64_t slls_txg;
+} spa_ld_log_sm_arg_t;
+
+static int
+spa_ld_log_sm_cb(space_map_entry_t *sme, void *arg)
+{
+	uint64_t offset = sme->sme_offset;
+	uint64_t size = sme->sme_run;
+	uint64_t vdev_id = sme->sme_vdev;
+
+	spa_ld_log_sm_arg_t *slls = arg;
+	spa_t *spa = slls->slls_spa;
+
+	/*
+	 * The entries come straight from disk, so fail the import rather
+	 * than index past the vdevs or metaslabs of the pool if one of
+	 * them is damaged.
+	 */
+	if (vdev_id >= spa->spa_root_vdev->vdev_children)
+		return (SET_ERROR(ECKSUM));
+
+	vdev_t *vd = vdev_lookup_top(spa, vdev_id);
+
+	/*
+	 * If the vdev has been removed (i.e. it is indirect or a hole)
+	 * skip this entry. The contents of this vdev have already moved
+	 * elsewhere.
+	 */
+	if (!vdev_is_concrete(vd))
+		return (0);
+
+	uint64_t ms_index = offset >> vd->vdev_ms_shift;
+	if (size == 0 || ms_index >= vd->vdev_ms_count ||
+	    (offset + size - 1) >> vd->vdev_ms_shift != ms_index)
+		return (SET_ERROR(ECKSUM));
+
+	metaslab_t *ms = vd->vdev_ms[ms_index];
+	ASSERT(!ms->ms_loaded);
+
+	/*
+	 * If we have already flushed entries for this TXG to this
+	 * metaslab's space map, then ignore it. Note that we flush
+	 * before processing any allocations/frees for that TXG, so
+	 * the metaslab's space map only has entries from *before*
+	 * the unflushed TXG.
+	 */
+	if (ms->ms_unflushed_txg == 0 || slls->slls_txg < ms->ms_unflushed_txg)
+		return (0);
+
+	switch (sme->sme_type) {
+	case SM_ALLOC:
+		range_tree_remove_xor_add_segment(offset, offset + size,
+		    ms->ms_unflushed_frees, ms->ms_unflushed_allocs);
+		break;
+	case SM_FREE:
+		range_tree_remove_xor_add_segment(offset, offset + size,
+		    ms->ms_unflushed_allocs, ms->ms_unflushed_frees);
+		break;
+	default:
+		panic("invalid maptype_t");
+		break;
+	}
+	return (0);
+}
+
+static int
+spa_ld_log_sm_data(spa_t *spa)
+{
+	int error = 0;
+
+	for (spa_log_sm_t *sls = avl_first(&spa->spa_sm_logs_by_txg);
+	    sls != NULL; sls = AVL_NEXT(&spa->spa_sm_logs_by_txg, sls)) {
+		space_map_t *sm = NULL;
+		error = space_map_open(&sm, spa_meta_objset(spa),
+		    sls->sls_sm_obj, 0, UINT64_MAX, SPA_MINBLOCKSHIFT);
+		if (error != 0) {
+			spa_load_failed(spa, "spa_ld_log_sm_data(): failed at "
+			    "space_map_open(obj=%llu) [error %d]",
+			    (u_longlong_t)sls->sls_sm_obj, error);
+			return (error);
+		}
+
+		spa_ld_log_sm_arg_t vla = {
+			.slls_spa = spa,
+			.slls_txg = sls->sls_txg
+		};
+		error = space_map_iterate(sm, space_map_length(sm),
+		    spa_ld_log_sm_cb, &vla);
+		space_map_close(sm);
+		if (error != 0) {
+			spa_load_failed(spa, "spa_ld_log_sm_data(): failed "
+			    "at space_map_iterate(obj=%llu) [error %d]",
+			    (u_longlong_t)sls->sls_sm_obj, error);
+			return (error);
+		}
+	}
+
+	/*
+	 * Account the unflushed changes in the metaslabs' space accounting,
+	 * which so far only reflects their space maps.
+	 */
+	for (metaslab_t *m = avl_first(&spa->spa_metaslabs_by_flushed);
+	    m != NULL; m = AVL_NEXT(&spa->spa_metaslabs_by_flushed, m)) {
+		mutex_enter(&m->ms_lock);
+		int64_t delta = range_tree_space(m->ms_unflushed_allocs) -
+		    range_tree_space(m->ms_unflushed_frees);
+		m->ms_allocated_space += delta;
+		metaslab_space_update(m->ms_group->mg_vd,
+		    m->ms_group->mg_class, delta, 0, 0);
+		spa->spa_unflushed_stats.sus_memused +=
+		    metaslab_unflushed_changes_memused(m);
+		metaslab_recalculate_weight_and_sort(m);
+		mutex_exit(&m->ms_lock);
+	}
+
+	return (0);
+}
+
+static int
+spa_ld_log_sm_metadata(spa_t *spa)
+{
+	int error;
+	uint64_t spacemap_zap;
+
+	ASSERT(avl_is_empty(&spa->spa_sm_logs_by_txg));
+
+	error = zap_lookup(spa_meta_objset(spa), DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_LOG_SPACEMAP_ZAP, sizeof (spacemap_zap), 1,
+	    &spacemap_zap);
+	if (error == ENOENT) {
+		/* the space map ZAP doesn't exist yet */
+		return (0);
+	} else if (error != 0) {
+		spa_load_failed(spa, "spa_ld_log_sm_metadata(): failed at "
+		    "zap_lookup(DMU_POOL_DIRECTORY_OBJECT) [error %d]",
+		    error);
+		return (error);
+	}
+
+	zap_cursor_t zc;
+	zap_attribute_t za;
+	for (zap_cursor_init(&zc, spa_meta_objset(spa), spacemap_zap);
+	    zap_cursor_retrieve(&zc, &za) == 0; zap_cursor_advance(&zc)) {
+		uint64_t log_txg = zfs_strtonum(za.za_name, NULL);
+		spa_log_sm_t *sls =
+		    spa_log_sm_alloc(za.za_first_integer, log_txg);
+		avl_add(&spa->spa_sm_logs_by_txg, sls);
+	}
+	zap_cursor_fini(&zc);
+
+	for (spa_log_sm_t *sls = avl_first(&spa->spa_sm_logs_by_txg);
+	    sls != NULL; sls = AVL_NEXT(&spa->spa_sm_logs_by_txg, sls)) {
+		space_map_t *sm = NULL;
+		error = space_map_open(&sm, spa_meta_objset(spa),
+		    sls->sls_sm_obj, 0, UINT64_MAX, SPA_MINBLOCKSHIFT);
+		if (error != 0) {
+			spa_load_failed(spa, "spa_ld_log_sm_metadata(): "
+			    "failed at space_map_open(obj=%llu) [error %d]",
+			    (u_longlong_t)sls->sls_sm_obj, error);
+			return (error);
+		}
+		sls->sls_nblocks = space_map_nblocks(sm);
+		spa->spa_unflushed_stats.sus_nblocks += sls->sls_nblocks;
+		space_map_close(sm);
+	}
+
+	for (metaslab_t *m = avl_first(&spa->spa_metaslabs_by_flushed);
+	    m != NULL; m = AVL_NEXT(&spa->spa_metaslabs_by_flushed, m)) {
+		spa_log_sm_t target = { .sls_txg = m->ms_unflushed_txg };
+		spa_log_sm_t *sls = avl_find(&spa->spa_sm_logs_by_txg,
+		    &target, NULL);
+
+		/*
+		 * At this point if sls is zero it means that a bug occurred
+		 * in ZFS the last time the pool was open or earlier in the
+		 * import code path. In general, we would have placed a
+		 * VERIFY() here or in this case just let the kernel panic
+		 * with NULL pointer dereference when incrementing sls below.
+		 * Instead, since this is a load path, we fail the import.
+		 */
+		if (sls == NULL) {
+			spa_load_failed(spa, "spa_ld_log_sm_metadata(): bug "
+			    "encountered: could not find log spacemap for "
+			    "TXG %llu [error %d]",
+			    (u_longlong_t)m->ms_unflushed_txg, ENOENT);
+			return (ENOENT);
+		}
+		sls->sls_mscount++;
+	}
+
+	return (0);
+}
+
+/*
+ * Load the log space maps and apply their entries to the unflushed trees
+ * of the metaslabs. Called after vdev_load(), once all metaslabs have
+ * been initialized.
+ */
+int
+spa_ld_log_spacemaps(spa_t *spa)
+{
+	vdev_t *rvd = spa->spa_root_vdev;
+	int error;
+
+	if (!spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP))
+		return (0);
+
+	for (uint64_t c = 0; c < rvd->vdev_children; c++) {
+		vdev_t *vd = rvd->vdev_child[c];
+		if (!vdev_is_concrete(vd))
+			continue;
+		error = spa_ld_unflushed_txgs(vd);
+		if (error != 0)
+			return (error);
+	}
+
+	error = spa_ld_log_sm_metadata(spa);
+	if (error != 0)
+		return (error);
+
+	spa_config_enter(spa, SCL_CONFIG, FTAG, RW_READER);
+	error = spa_ld_log_sm_data(spa);
+	spa_config_exit(spa, SCL_CONFIG, FTAG);
+
+	return (error);
+}
+
+void
+spa_unload_log_sm_metadata(spa_t *spa)
+{
+	void *cookie = NULL;
+	spa_log_sm_t *sls;
+
+	while ((sls = avl_destroy_nodes(&spa->spa_sm_logs_by_txg,
+	    &cookie)) != NULL) {
+		VERIFY0(sls->sls_mscount);
+		kmem_free(sls, sizeof (spa_log_sm_t));
+	}
+
+	ASSERT(avl_is_empty(&spa->spa_metaslabs_by_flushed));
+	bzero(&spa->spa_unflushed_stats, sizeof (spa_unflushed_stats_t));
+}
@@ -51,6 +51,7 @@ typedef struct mirror_stats {
 
 	kstat_named_t vdev_mirror_stat_preferred_found;
 	kstat_named_t vdev_mirror_stat_preferred_not_found;
+	kstat_named_t vdev_mirror_stat_latency_preferred;
 } mirror_stats_t;
 
 static mirror_stats_t mirror_stats = {
@@ -68,6 +69,8 @@ static mirror_stats_t mirror_stats = {
 	{ "preferred_found",			KSTAT_DATA_UINT64 },
 	/* Preferred child vdev not found or equal load  */
 	{ "preferred_not_found",		KSTAT_DATA_UINT64 },
+	/* Preferred child vdev was not the one with the shortest queue */
+	{ "latency_preferred",			KSTAT_DATA_UINT64 },
 
 };
 
@@ -103,8 +106,10 @@ vdev_mirror_stat_fini(void)
 typedef struct mirror_child {
 	vdev_t		*mc_vd;
 	uint64_t	mc_offset;
+	hrtime_t	mc_issued;
 	int		mc_error;
 	int		mc_load;
+	int		mc_qload;
 	uint8_t		mc_tried;
 	uint8_t		mc_skipped;
 	uint8_t		mc_speculative;
@@ -140,6 +145,25 @@ static int zfs_vdev_mirror_rotating_seek_offset = 1 * 1024 * 1024;
 static int zfs_vdev_mirror_non_rotating_inc = 0;
 static int zfs_vdev_mirror_non_rotating_seek_inc = 1;
 
+/*
+ * Each child keeps an exponentially weighted moving average of how long
+ * its reads take to complete, queueing included; every sample moves the
+ * average by 1 / 2^zfs_vdev_mirror_latency_ewma_shift of the difference.
+ * When zfs_vdev_mirror_latency_aware is set, the load of a child is
+ * scaled by its average (rounded down to a power of two, so that
+ * children of about the same speed still share reads evenly), which
+ * steers reads away from slower or failing members of the mirror.
+ *
+ * An average older than zfs_vdev_mirror_latency_probe_ms is ignored, and
+ * the next sample starts a new one.  A child without a recent average is
+ * assumed to be as fast as its fastest sibling, so a child that was slow
+ * for a while and stopped getting reads gets some again once its average
+ * expires, which shows whether it has recovered.
+ */
+uint64_t zfs_vdev_mirror_latency_aware = 1;
+uint64_t zfs_vdev_mirror_latency_ewma_shift = 3;
+uint64_t zfs_vdev_mirror_latency_probe_ms = 1000;
+
 static inline size_t
 vdev_mirror_map_size(int children)
 {
@@ -239,6 +263,65 @@ vdev_mirror_load(mirror_map_t *mm, vdev_t *vd, uint64_t zio_offset)
 	return (load + zfs_vdev_mirror_rotating_seek_inc);
 }
 
+/*
+ * Return a child's average read latency, or 0 if it has none recent.
+ */
+static hrtime_t
+vdev_mirror_latency(vdev_t *vd, hrtime_t now)
+{
+	hrtime_t lat = vd->vdev_read_latency;
+
+	if (lat <= 0 || now - vd->vdev_read_latency_time >
+	    MSEC2NSEC(zfs_vdev_mirror_latency_probe_ms))
+		return (0);
+
+	return (lat);
+}
+
+/*
+ * Scale a child's queue load by its average read latency, giving a
+ * figure proportional to how long a new read would take to complete.
+ * A child without a recent average is scaled by base, the lowest recent
+ * average among its siblings (0 if none has one), so that every child is
+ * weighed the same way.
+ */
+static int
+vdev_mirror_latency_load(vdev_t *vd, int load, hrtime_t now, hrtime_t base)
+{
+	hrtime_t lat = vdev_mirror_latency(vd, now);
+	int64_t scaled;
+
+	if (lat == 0)
+		lat = base;
+
+	/* Microseconds, bucketed by powers of two and capped at ~1s. */
+	scaled = (int64_t)(load + 1) << MIN(highbit64(lat / 1000), 20);
+
+	return ((int)MIN(scaled, INT_MAX - 1));
+}
+
+/*
+ * Fold the latency of a completed read into its child's average, or
+ * start a new average if the old one has expired.  The update is not
+ * atomic; a lost sample in a race does not matter.
+ */
+static void
+vdev_mirror_latency_update(mirror_child_t *mc)
+{
+	vdev_t *vd = mc->mc_vd;
+	hrtime_t now = gethrtime();
+	hrtime_t delta = now - mc->mc_issued;
+	hrtime_t lat = vdev_mirror_latency(vd, now);
+	uint64_t shift = MIN(zfs_vdev_mirror_latency_ewma_shift, 16);
+
+	if (lat == 0)
+		lat = delta;
+	else
+		lat += (delta - lat) / (1LL << shift);
+	vd->vdev_read_latency = MAX(lat, 1);
+	vd->vdev_read_latency_time = now;
+}
+
 /*
  * Avoid inlining the function to keep vdev_mirror_io_start(), which
  * is this functions only caller, as small as possible on the stack.
@@ -409,6 +492,10 @@ vdev_mirror_child_done(zio_t *zio)
 {
 	mirror_child_t *mc = zio->io_private;
 
+	if (zio->io_type == ZIO_TYPE_READ && zio->io_error == 0 &&
+	    mc->mc_issued != 0)
+		vdev_mirror_latency_update(mc);
+
 	mc->mc_error = zio->io_error;
 	mc->mc_tried = 1;
 	mc->mc_skipped = 0;
@@ -497,11 +584,32 @@ vdev_mirror_child_select(zio_t *zio)
 {
 	mirror_map_t *mm = zio->io_vsd;
 	uint64_t txg = zio->io_txg;
-	int c, lowest_load;
+	int c, lowest_load, lowest_qload;
+	boolean_t latency = !mm->mm_root && zfs_vdev_mirror_latency_aware;
+	hrtime_t now = 0, base = 0;
 
 	ASSERT(zio->io_bp == NULL || BP_PHYSICAL_BIRTH(zio->io_bp) == txg);
 
+	/*
+	 * The lowest recent read latency among the children stands in for
+	 * the latency of those without a recent average.
+	 */
+	if (latency) {
+		now = gethrtime();
+		for (c = 0; c < mm->mm_children; c++) {
+			vdev_t *cvd = mm->mm_child[c].mc_vd;
+			hrtime_t lat;
+
+			if (cvd == NULL)
+				continue;
+			lat = vdev_mirror_latency(cvd, now);
+			if (lat != 0 && (base == 0 || lat < base))
+				base = lat;
+		}
+	}
+
 	lowest_load = INT_MAX;
+	lowest_qload = INT_MAX;
 	mm->mm_preferred_cnt = 0;
 	for (c = 0; c < mm->mm_children; c++) {
 		mirror_child_t *mc;
@@ -524,7 +632,10 @@ vdev_mirror_child_select(zio_t *zio)
 			continue;
 		}
 
-		mc->mc_load = vdev_mirror_load(mm, mc->mc_vd, mc->mc_offset);
+		mc->mc_qload = vdev_mirror_load(mm, mc->mc_vd, mc->mc_offset);
+		lowest_qload = MIN(lowest_qload, mc->mc_qload);
+		mc->mc_load = latency ? vdev_mirror_latency_load(mc->mc_vd,
+		    mc->mc_qload, now, base) : mc->mc_qload;
 		if (mc->mc_load > lowest_load)
 			continue;
 
@@ -538,6 +649,8 @@ vdev_mirror_child_select(zio_t *zio)
 
 	if (mm->mm_preferred_cnt == 1) {
 		MIRROR_BUMP(vdev_mirror_stat_preferred_found);
+		if (mm->mm_child[mm->mm_preferred[0]].mc_qload > lowest_qload)
+			MIRROR_BUMP(vdev_mirror_stat_latency_preferred);
 		return (mm->mm_preferred[0]);
 	}
 
@@ -605,6 +718,8 @@ vdev_mirror_io_start(zio_t *zio)
 		 */
 		c = vdev_mirror_child_select(zio);
 		children = (c >= 0);
+		if (children)
+			mm->mm_child[c].mc_issued = gethrtime();
 	} else {
 		ASSERT(zio->io_type == ZIO_TYPE_WRITE);
 
@@ -704,6 +819,7 @@ vdev_mirror_io_done(zio_t *zio)
 	if (good_copies == 0 && (c = vdev_mirror_child_select(zio)) != -1) {
 		ASSERT(c >= 0 && c < mm->mm_children);
 		mc = &mm->mm_child[c];
+		mc->mc_issued = gethrtime();
 		zio_vdev_io_redone(zio);
 		zio_nowait(zio_vdev_child_io(zio, zio->io_bp,
 		    mc->mc_vd, mc->mc_offset, zio->io_abd, zio->io_size,
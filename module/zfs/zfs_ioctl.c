@@ -202,6 +202,7 @@
 #include <sys/zfs_onexit.h>
 #include <sys/zvol.h>
 #include <sys/dsl_scan.h>
+#include <sys/ddt.h>
 #include <sharefs/share.h>
 #include <sys/fm/util.h>
 #include <sys/dsl_crypt.h>
@@ -4088,6 +4089,50 @@ zfs_ioc_pool_trim(const char *poolname, nvlist_t *innvl, nvlist_t *outnvl)
 	return (total_errors > 0 ? EINVAL : 0);
 }
 
+/*
+ * innvl: {
+ *     "ddt_prune_unit" -> POOL_DDT_PRUNE_AGE or POOL_DDT_PRUNE_PERCENTAGE
+ *     "ddt_prune_amount" -> age in seconds of the youngest unique entry to
+ *         drop, or percentage of the unique entries to drop
+ * }
+ *
+ * outnvl: empty
+ */
+static const zfs_ioc_key_t zfs_keys_ddt_prune[] = {
+	{ZPOOL_DDT_PRUNE_UNIT,		DATA_TYPE_UINT64,	0},
+	{ZPOOL_DDT_PRUNE_AMOUNT,	DATA_TYPE_UINT64,	0},
+};
+
+/* ARGSUSED */
+static int
+zfs_ioc_ddt_prune(const char *poolname, nvlist_t *innvl, nvlist_t *outnvl)
+{
+	uint64_t unit, amount;
+	spa_t *spa;
+	int error;
+
+	if (nvlist_lookup_uint64(innvl, ZPOOL_DDT_PRUNE_UNIT, &unit) != 0 ||
+	    nvlist_lookup_uint64(innvl, ZPOOL_DDT_PRUNE_AMOUNT, &amount) != 0)
+		return (SET_ERROR(EINVAL));
+
+	if (unit >= POOL_DDT_PRUNE_UNITS)
+		return (SET_ERROR(EINVAL));
+
+	error = spa_open(poolname, &spa, FTAG);
+	if (error != 0)
+		return (error);
+
+	if (spa_version(spa) < SPA_VERSION_DEDUP) {
+		spa_close(spa, FTAG);
+		return (SET_ERROR(ENOTSUP));
+	}
+
+	error = ddt_prune_unique_entries(spa, unit, amount);
+
+	spa_close(spa, FTAG);
+	return (error);
+}
+
 /*
  * fsname is name of dataset to rollback (to most recent snapshot)
  *
@@ -4298,6 +4343,20 @@ zfs_check_settable(const char *dsname, nvpair_t *pair, cred_t *cr)
 				spa_close(spa, FTAG);
 			}
 
+			if (ZIO_COMPRESS_ALGO(intval) == ZIO_COMPRESS_ZSTD) {
+				spa_t *spa;
+
+				if ((err = spa_open(dsname, &spa, FTAG)) != 0)
+					return (err);
+
+				if (!spa_feature_is_enabled(spa,
+				    SPA_FEATURE_ZSTD_COMPRESS)) {
+					spa_close(spa, FTAG);
+					return (SET_ERROR(ENOTSUP));
+				}
+				spa_close(spa, FTAG);
+			}
+
 			/*
 			 * If this is a bootable dataset then
 			 * verify that the compression algorithm
@@ -6876,6 +6935,11 @@ zfs_ioctl_init(void)
 	    POOL_CHECK_SUSPENDED | POOL_CHECK_READONLY, B_TRUE, B_TRUE,
 	    zfs_keys_pool_trim, ARRAY_SIZE(zfs_keys_pool_trim));
 
+	zfs_ioctl_register("ddt_prune", ZFS_IOC_DDT_PRUNE,
+	    zfs_ioc_ddt_prune, zfs_secpolicy_config, POOL_NAME,
+	    POOL_CHECK_SUSPENDED | POOL_CHECK_READONLY, B_TRUE, B_TRUE,
+	    zfs_keys_ddt_prune, ARRAY_SIZE(zfs_keys_ddt_prune));
+
 	/* IOCTLS that use the legacy function signature */
 
 	zfs_ioctl_register_legacy(ZFS_IOC_POOL_FREEZE, zfs_ioc_pool_freeze,
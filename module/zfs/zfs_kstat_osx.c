@@ -78,6 +78,7 @@ osx_kstat_t osx_kstat = {
 	{ "zfs_arc_shrink_shift",		KSTAT_DATA_UINT64 },
 	{ "zfs_arc_p_min_shift",		KSTAT_DATA_UINT64 },
 	{ "zfs_arc_average_blocksize",	KSTAT_DATA_UINT64 },
+	{ "zfs_arc_evict_threads",		KSTAT_DATA_UINT64 },
 
 	{ "l2arc_write_max",			KSTAT_DATA_UINT64 },
 	{ "l2arc_write_boost",			KSTAT_DATA_UINT64 },
@@ -144,6 +145,8 @@ osx_kstat_t osx_kstat = {
 	{ "l2arc_noprefetch",			KSTAT_DATA_INT64  },
 	{ "l2arc_feed_again",			KSTAT_DATA_INT64  },
 	{ "l2arc_norw",					KSTAT_DATA_INT64  },
+	{ "l2arc_rebuild_enabled",		KSTAT_DATA_INT64  },
+	{ "l2arc_rebuild_blocks_min_l2size",	KSTAT_DATA_UINT64 },
 
 	{"zfs_recover",					KSTAT_DATA_INT64  },
 
@@ -178,10 +181,49 @@ osx_kstat_t osx_kstat = {
 	{"zfs_send_unmodified_spill_blocks",		KSTAT_DATA_UINT64  },
 	{"zfs_special_class_metadata_reserve_pct",		KSTAT_DATA_UINT64  },
 
+	{"zfs_zstd_earlyabort_pass",		KSTAT_DATA_UINT64  },
+	{"zfs_zstd_abort_size",			KSTAT_DATA_UINT64  },
+
+	{"zfs_unflushed_max_mem_amt",		KSTAT_DATA_UINT64  },
+	{"zfs_unflushed_log_block_max",		KSTAT_DATA_UINT64  },
+	{"zfs_unflushed_log_txg_max",		KSTAT_DATA_UINT64  },
+	{"zfs_min_metaslabs_to_flush",		KSTAT_DATA_UINT64  },
+
+	{"zfs_livelist_max_entries",		KSTAT_DATA_UINT64  },
+	{"zfs_livelist_min_percent_shared",	KSTAT_DATA_UINT64  },
+
+	{"zfs_bclone_enabled",			KSTAT_DATA_UINT64  },
+
+	{"zfs_vdev_mirror_latency_aware",	KSTAT_DATA_UINT64  },
+	{"zfs_vdev_mirror_latency_ewma_shift",	KSTAT_DATA_UINT64  },
+	{"zfs_vdev_mirror_latency_probe_ms",	KSTAT_DATA_UINT64  },
+
+	{"zfs_iolimit_burst_ms",		KSTAT_DATA_UINT64  },
+
+	{"zfs_send_read_queue_length",		KSTAT_DATA_UINT64  },
+
+	{"zfs_recv_writer_threads",		KSTAT_DATA_UINT64  },
+
+	{"zfs_dedup_log_txg_max",		KSTAT_DATA_UINT64  },
+	{"zfs_dedup_log_flush_txgs",		KSTAT_DATA_UINT64  },
+	{"zfs_dedup_log_flush_entries_min",	KSTAT_DATA_UINT64  },
+	{"zfs_dedup_log_mem_max",		KSTAT_DATA_UINT64  },
+
+	{"zfs_dedup_prune_batch",		KSTAT_DATA_UINT64  },
+
+	{"zfs_dedup_lookup_batch",		KSTAT_DATA_UINT64  },
+
+	{"zio_checksum_batch_max",		KSTAT_DATA_UINT64  },
+
+	{"zfs_compress_entropy_limit",		KSTAT_DATA_UINT64  },
+	{"zfs_compress_entropy_sample",		KSTAT_DATA_UINT64  },
+
 	{"zfs_vdev_raidz_impl",		KSTAT_DATA_STRING  },
 	{"icp_gcm_impl",		KSTAT_DATA_STRING  },
 	{"icp_aes_impl",		KSTAT_DATA_STRING  },
 	{"zfs_fletcher_4_impl",		KSTAT_DATA_STRING  },
+	{"zfs_blake3_impl",		KSTAT_DATA_STRING  },
+	{"icp_sha2_impl",		KSTAT_DATA_STRING  },
 
 };
 
@@ -195,11 +237,17 @@ extern int icp_aes_impl_set(const char *val);
 extern int icp_aes_impl_get(char *buffer, int max);
 extern int zfs_fletcher_4_impl_set(const char *val);
 extern int zfs_fletcher_4_impl_get(char *buffer, int max);
+extern int zfs_blake3_impl_set(const char *val);
+extern int zfs_blake3_impl_get(char *buffer, int max);
+extern int icp_sha2_impl_set(const char *val);
+extern int icp_sha2_impl_get(char *buffer, int max);
 
 static char vdev_raidz_string[80] = { 0 };
 static char icp_gcm_string[80] = { 0 };
 static char icp_aes_string[80] = { 0 };
 static char zfs_fletcher_4_string[80] = { 0 };
+static char zfs_blake3_string[80] = { 0 };
+static char icp_sha2_string[80] = { 0 };
 
 static kstat_t		*osx_kstat_ksp;
 
@@ -241,6 +289,9 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 		l2arc_noprefetch = ks->l2arc_noprefetch.value.i64;
 		l2arc_feed_again = ks->l2arc_feed_again.value.i64;
 		l2arc_norw = ks->l2arc_norw.value.i64;
+		l2arc_rebuild_enabled = ks->l2arc_rebuild_enabled.value.i64;
+		l2arc_rebuild_blocks_min_l2size =
+			ks->l2arc_rebuild_blocks_min_l2size.value.ui64;
 
 		/* vdev_queue */
 
@@ -397,6 +448,67 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 		zfs_special_class_metadata_reserve_pct =
 			ks->zfs_special_class_metadata_reserve_pct.value.ui64;
 
+		zfs_zstd_earlyabort_pass =
+			ks->zfs_zstd_earlyabort_pass.value.ui64;
+		zfs_zstd_abort_size =
+			ks->zfs_zstd_abort_size.value.ui64;
+
+		zfs_unflushed_max_mem_amt =
+			ks->zfs_unflushed_max_mem_amt.value.ui64;
+		zfs_unflushed_log_block_max =
+			ks->zfs_unflushed_log_block_max.value.ui64;
+		zfs_unflushed_log_txg_max =
+			ks->zfs_unflushed_log_txg_max.value.ui64;
+		zfs_min_metaslabs_to_flush =
+			ks->zfs_min_metaslabs_to_flush.value.ui64;
+
+		zfs_livelist_max_entries =
+			ks->zfs_livelist_max_entries.value.ui64;
+		zfs_livelist_min_percent_shared =
+			ks->zfs_livelist_min_percent_shared.value.ui64;
+
+		zfs_bclone_enabled =
+			ks->zfs_bclone_enabled.value.ui64;
+
+		zfs_vdev_mirror_latency_aware =
+			ks->zfs_vdev_mirror_latency_aware.value.ui64;
+		zfs_vdev_mirror_latency_ewma_shift =
+			ks->zfs_vdev_mirror_latency_ewma_shift.value.ui64;
+		zfs_vdev_mirror_latency_probe_ms =
+			ks->zfs_vdev_mirror_latency_probe_ms.value.ui64;
+
+		zfs_iolimit_burst_ms =
+			ks->zfs_iolimit_burst_ms.value.ui64;
+
+		zfs_send_read_queue_length =
+			ks->zfs_send_read_queue_length.value.ui64;
+
+		zfs_recv_writer_threads =
+			ks->zfs_recv_writer_threads.value.ui64;
+
+		zfs_dedup_log_txg_max =
+			ks->zfs_dedup_log_txg_max.value.ui64;
+		zfs_dedup_log_flush_txgs =
+			ks->zfs_dedup_log_flush_txgs.value.ui64;
+		zfs_dedup_log_flush_entries_min =
+			ks->zfs_dedup_log_flush_entries_min.value.ui64;
+		zfs_dedup_log_mem_max =
+			ks->zfs_dedup_log_mem_max.value.ui64;
+
+		zfs_dedup_prune_batch =
+			ks->zfs_dedup_prune_batch.value.ui64;
+
+		zfs_dedup_lookup_batch =
+			ks->zfs_dedup_lookup_batch.value.ui64;
+
+		zio_checksum_batch_max =
+			ks->zio_checksum_batch_max.value.ui64;
+
+		zfs_compress_entropy_limit =
+			ks->zfs_compress_entropy_limit.value.ui64;
+		zfs_compress_entropy_sample =
+			ks->zfs_compress_entropy_sample.value.ui64;
+
 		// Check if string has changed (from KREAD), if so, update.
 		if (strcmp(vdev_raidz_string,
 				ks->zfs_vdev_raidz_impl.value.string.addr.ptr) != 0)
@@ -412,6 +524,13 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 				ks->zfs_fletcher_4_impl.value.string.addr.ptr) != 0)
 			zfs_fletcher_4_impl_set(ks->zfs_fletcher_4_impl.value.string.addr.ptr);
 
+		if (strcmp(zfs_blake3_string,
+				ks->zfs_blake3_impl.value.string.addr.ptr) != 0)
+			zfs_blake3_impl_set(ks->zfs_blake3_impl.value.string.addr.ptr);
+
+		if (strcmp(icp_sha2_string, ks->icp_sha2_impl.value.string.addr.ptr) != 0)
+			icp_sha2_impl_set(ks->icp_sha2_impl.value.string.addr.ptr);
+
 	} else {
 
 		/* kstat READ */
@@ -445,6 +564,9 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 		ks->l2arc_noprefetch.value.i64               = l2arc_noprefetch;
 		ks->l2arc_feed_again.value.i64               = l2arc_feed_again;
 		ks->l2arc_norw.value.i64                     = l2arc_norw;
+		ks->l2arc_rebuild_enabled.value.i64          = l2arc_rebuild_enabled;
+		ks->l2arc_rebuild_blocks_min_l2size.value.ui64 =
+			l2arc_rebuild_blocks_min_l2size;
 
 		/* vdev_queue */
 		ks->zfs_vdev_max_active.value.ui64 =
@@ -596,6 +718,67 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 		ks->zfs_special_class_metadata_reserve_pct.value.ui64 =
 			zfs_special_class_metadata_reserve_pct;
 
+		ks->zfs_zstd_earlyabort_pass.value.ui64 =
+			zfs_zstd_earlyabort_pass;
+		ks->zfs_zstd_abort_size.value.ui64 =
+			zfs_zstd_abort_size;
+
+		ks->zfs_unflushed_max_mem_amt.value.ui64 =
+			zfs_unflushed_max_mem_amt;
+		ks->zfs_unflushed_log_block_max.value.ui64 =
+			zfs_unflushed_log_block_max;
+		ks->zfs_unflushed_log_txg_max.value.ui64 =
+			zfs_unflushed_log_txg_max;
+		ks->zfs_min_metaslabs_to_flush.value.ui64 =
+			zfs_min_metaslabs_to_flush;
+
+		ks->zfs_livelist_max_entries.value.ui64 =
+			zfs_livelist_max_entries;
+		ks->zfs_livelist_min_percent_shared.value.ui64 =
+			zfs_livelist_min_percent_shared;
+
+		ks->zfs_bclone_enabled.value.ui64 =
+			zfs_bclone_enabled;
+
+		ks->zfs_vdev_mirror_latency_aware.value.ui64 =
+			zfs_vdev_mirror_latency_aware;
+		ks->zfs_vdev_mirror_latency_ewma_shift.value.ui64 =
+			zfs_vdev_mirror_latency_ewma_shift;
+		ks->zfs_vdev_mirror_latency_probe_ms.value.ui64 =
+			zfs_vdev_mirror_latency_probe_ms;
+
+		ks->zfs_iolimit_burst_ms.value.ui64 =
+			zfs_iolimit_burst_ms;
+
+		ks->zfs_send_read_queue_length.value.ui64 =
+			zfs_send_read_queue_length;
+
+		ks->zfs_recv_writer_threads.value.ui64 =
+			zfs_recv_writer_threads;
+
+		ks->zfs_dedup_log_txg_max.value.ui64 =
+			zfs_dedup_log_txg_max;
+		ks->zfs_dedup_log_flush_txgs.value.ui64 =
+			zfs_dedup_log_flush_txgs;
+		ks->zfs_dedup_log_flush_entries_min.value.ui64 =
+			zfs_dedup_log_flush_entries_min;
+		ks->zfs_dedup_log_mem_max.value.ui64 =
+			zfs_dedup_log_mem_max;
+
+		ks->zfs_dedup_prune_batch.value.ui64 =
+			zfs_dedup_prune_batch;
+
+		ks->zfs_dedup_lookup_batch.value.ui64 =
+			zfs_dedup_lookup_batch;
+
+		ks->zio_checksum_batch_max.value.ui64 =
+			zio_checksum_batch_max;
+
+		ks->zfs_compress_entropy_limit.value.ui64 =
+			zfs_compress_entropy_limit;
+		ks->zfs_compress_entropy_sample.value.ui64 =
+			zfs_compress_entropy_sample;
+
 		zfs_vdev_raidz_impl_get(vdev_raidz_string, sizeof(vdev_raidz_string));
 		kstat_named_setstr(&ks->zfs_vdev_raidz_impl, vdev_raidz_string);
 
@@ -609,6 +792,13 @@ static int osx_kstat_update(kstat_t *ksp, int rw)
 			sizeof(zfs_fletcher_4_string));
 		kstat_named_setstr(&ks->zfs_fletcher_4_impl, zfs_fletcher_4_string);
 
+		zfs_blake3_impl_get(zfs_blake3_string,
+			sizeof(zfs_blake3_string));
+		kstat_named_setstr(&ks->zfs_blake3_impl, zfs_blake3_string);
+
+		icp_sha2_impl_get(icp_sha2_string, sizeof(icp_sha2_string));
+		kstat_named_setstr(&ks->icp_sha2_impl, icp_sha2_string);
+
 	}
 
 	return 0;
@@ -579,6 +579,44 @@ mappedread(vnode_t *vp, int nbytes, struct uio *uio)
 
 offset_t zfs_read_chunk_size = MAX_UPL_TRANSFER * PAGE_SIZE; /* Tunable */
 
+/*
+ * Should this read or write bypass the ARC?  That is the case when the
+ * dataset's "direct" property is "always", or when it is "standard" and
+ * the file is in no-cache mode (FDIRECT).  Only whole, recordsize-aligned
+ * blocks are actually done directly; see dmu_read_uio_direct() and
+ * dmu_write_uio_direct().  Files with pages in the UBC always use the
+ * buffered path, which keeps the two copies coherent.
+ */
+static boolean_t
+zfs_dio_enabled(znode_t *zp, int ioflag)
+{
+	objset_t *os = zp->z_zfsvfs->z_os;
+
+	if (os->os_encrypted || vn_has_cached_data(ZTOV(zp)))
+		return (B_FALSE);
+
+	switch (os->os_direct) {
+	case ZFS_DIRECT_ALWAYS:
+		return (B_TRUE);
+	case ZFS_DIRECT_STANDARD:
+		return ((ioflag & FDIRECT) != 0);
+	default:
+		return (B_FALSE);
+	}
+}
+
+/*
+ * Is [off, off + len) made of whole blocks of the file?
+ */
+static boolean_t
+zfs_dio_aligned(znode_t *zp, uint64_t off, uint64_t len)
+{
+	uint64_t blksz = zp->z_blksz;
+
+	return (len != 0 && ISP2(blksz) &&
+	    P2PHASE(off, blksz) == 0 && P2PHASE(len, blksz) == 0);
+}
+
 /*
  * Read bytes from specified file into supplied buffer.
  *
@@ -603,8 +641,9 @@ zfs_read(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 	znode_t		*zp = VTOZ(vp);
 	zfsvfs_t	*zfsvfs = zp->z_zfsvfs;
 	objset_t	*os;
-	ssize_t		n, nbytes;
+	ssize_t		n, nbytes, chunk;
 	int		error = 0;
+	boolean_t	dio;
 #ifndef __APPLE__
 	xuio_t		*xuio = NULL;
 #endif
@@ -706,9 +745,17 @@ zfs_read(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 	}
 #endif	/* sun */
 
+	/*
+	 * Direct reads are issued a whole number of blocks at a time, so
+	 * make sure a chunk can hold at least one block.
+	 */
+	dio = zfs_dio_enabled(zp, ioflag);
+	chunk = zfs_read_chunk_size;
+	if (dio && ISP2(zp->z_blksz))
+		chunk = MAX(chunk, zp->z_blksz);
+
 	while (n > 0) {
-		nbytes = MIN(n, zfs_read_chunk_size -
-                     P2PHASE(uio_offset(uio), zfs_read_chunk_size));
+		nbytes = MIN(n, chunk - P2PHASE(uio_offset(uio), chunk));
 
 #ifdef __FreeBSD__
 		if (uio->uio_segflg == UIO_NOCOPY)
@@ -717,6 +764,9 @@ zfs_read(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 #endif /* __FreeBSD__ */
 		if (vn_has_cached_data(vp))
 			error = mappedread(vp, nbytes, uio);
+		else if (dio && zfs_dio_aligned(zp, uio_offset(uio), nbytes))
+			error = dmu_read_uio_direct(sa_get_db(zp->z_sa_hdl),
+			    uio, nbytes);
 		else
 			error = dmu_read_uio_dbuf(sa_get_db(zp->z_sa_hdl),
 			    uio, nbytes);
@@ -781,6 +831,7 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 	iovec_t		*iovp =  (iovec_t *)uio_curriovbase(uio);
 	int		write_eof;
 	int		count = 0;
+	boolean_t	dio;
 	sa_bulk_attr_t	bulk[4];
 	uint64_t	mtime[2], ctime[2];
     struct uio *uio_copy = NULL;
@@ -925,6 +976,15 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 		abuf = NULL;
 		woff = uio_offset(uio);
 
+		/*
+		 * A full, recordsize-aligned block may be written directly,
+		 * bypassing the ARC; see dmu_write_uio_direct().
+		 */
+		dio = (xuio == NULL && n >= max_blksz &&
+		    zp->z_blksz == max_blksz &&
+		    zfs_dio_aligned(zp, woff, max_blksz) &&
+		    zfs_dio_enabled(zp, ioflag));
+
 		if (zfs_owner_overquota(zfsvfs, zp, B_FALSE) ||
 		    zfs_owner_overquota(zfsvfs, zp, B_TRUE)) {
 			if (abuf != NULL)
@@ -947,7 +1007,7 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 			    ((char *)aiov->iov_base - (char *)abuf->b_data +
 			    aiov->iov_len == arc_buf_size(abuf)));
 			i_iov++;
-		} else if (abuf == NULL && n >= max_blksz &&
+		} else if (abuf == NULL && !dio && n >= max_blksz &&
 		    woff >= zp->z_size &&
 		    P2PHASE(woff, max_blksz) == 0 &&
 		    zp->z_blksz == max_blksz) {
@@ -1025,7 +1085,13 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 		if (woff + nbytes > zp->z_size)
 			vnode_pager_setsize(vp, woff + nbytes);
 
-		if (abuf == NULL) {
+		if (abuf == NULL && dio) {
+			ASSERT3S(nbytes, ==, max_blksz);
+			tx_bytes = uio_resid(uio);
+			error = dmu_write_uio_direct(sa_get_db(zp->z_sa_hdl),
+			    uio, nbytes, tx);
+			tx_bytes -= uio_resid(uio);
+		} else if (abuf == NULL) {
 
             if ( vn_has_cached_data(vp) )
                 uio_copy = uio_duplicate(uio);
@@ -1190,6 +1256,280 @@ zfs_write(vnode_t *vp, uio_t *uio, int ioflag, cred_t *cr, caller_context_t *ct)
 	return (0);
 }
 
+uint64_t zfs_bclone_enabled = 1;	/* Tunable */
+
+/*
+ * Clone a range of one file into another (or into a different part of the
+ * same file) by referencing the source's blocks from the destination
+ * instead of copying the data; see module/zfs/brt.c.
+ *
+ *	IN:	inzp	- znode of the file to clone from.
+ *		inoffp	- offset in the source.
+ *		outzp	- znode of the file to clone into.
+ *		outoffp	- offset in the destination.
+ *		lenp	- number of bytes to clone.
+ *		cr	- credentials of caller.
+ *
+ *	OUT:	inoffp, outoffp, lenp - advanced by the number of bytes
+ *			  that were cloned.
+ *
+ *	RETURN:	0 if at least part of the range was cloned
+ *		EXDEV if the range cannot be cloned and should be copied
+ *		error code if failure
+ *
+ * Offsets and length must be multiples of the source's block size, except
+ * that the range may end at the source's EOF if it also ends at or past
+ * the destination's EOF.  Both files must have the same block size, or
+ * the destination must still be a single, smaller block.
+ *
+ * Cloned blocks are not logged to the ZIL, so the call does not return
+ * until the txg holding them has synced.
+ *
+ * Timestamps:
+ *	outzp - ctime|mtime updated if byte count > 0
+ */
+int
+zfs_clone_range(znode_t *inzp, uint64_t *inoffp, znode_t *outzp,
+    uint64_t *outoffp, uint64_t *lenp, cred_t *cr)
+{
+	zfsvfs_t	*zfsvfs = inzp->z_zfsvfs;
+	objset_t	*os = zfsvfs->z_os;
+	locked_range_t	*inlr, *outlr;
+	dmu_tx_t	*tx;
+	blkptr_t	*bps;
+	size_t		maxblocks, nbps;
+	uint64_t	inoff, outoff, len, done, inblksz;
+	uint64_t	size, chunk, cloned;
+	uint64_t	mtime[2], ctime[2];
+	sa_bulk_attr_t	bulk[3];
+	int		count = 0;
+	int		error = 0;
+
+	/*
+	 * Blocks could be shared between datasets of a pool, but the callers
+	 * only ever hand us files from a single file system.
+	 */
+	if (outzp->z_zfsvfs != zfsvfs)
+		return (SET_ERROR(EXDEV));
+
+	ZFS_ENTER(zfsvfs);
+	ZFS_VERIFY_ZP(inzp);
+	ZFS_VERIFY_ZP(outzp);
+
+	if (zfs_bclone_enabled == 0 || !spa_feature_is_enabled(
+	    dmu_objset_spa(os), SPA_FEATURE_BLOCK_CLONING)) {
+		ZFS_EXIT(zfsvfs);
+		return (SET_ERROR(ENOTSUP));
+	}
+
+	if (os->os_encrypted) {
+		ZFS_EXIT(zfsvfs);
+		return (SET_ERROR(EXDEV));
+	}
+
+	if (vfs_flags(zfsvfs->z_vfs) & MNT_RDONLY) {
+		ZFS_EXIT(zfsvfs);
+		return (SET_ERROR(EROFS));
+	}
+
+	if (outzp->z_pflags & (ZFS_IMMUTABLE | ZFS_APPENDONLY)) {
+		ZFS_EXIT(zfsvfs);
+		return (SET_ERROR(EPERM));
+	}
+
+	/*
+	 * Cloned blocks never pass through the UBC, so files with resident
+	 * pages would see stale (or leave behind dirty) data.  Let the
+	 * caller copy those instead.
+	 */
+	if (vn_has_cached_data(ZTOV(inzp)) || vn_has_cached_data(ZTOV(outzp))) {
+		ZFS_EXIT(zfsvfs);
+		return (SET_ERROR(EXDEV));
+	}
+
+	if ((error = zfs_zaccess(inzp, ACE_READ_DATA, 0, B_FALSE, cr)) != 0) {
+		ZFS_EXIT(zfsvfs);
+		return (error);
+	}
+
+	inoff = *inoffp;
+	outoff = *outoffp;
+	len = *lenp;
+	done = 0;
+
+	if (len == 0) {
+		ZFS_EXIT(zfsvfs);
+		return (0);
+	}
+
+	if (len > MAXOFFSET_T || inoff > MAXOFFSET_T - len ||
+	    outoff > MAXOFFSET_T - len ||
+	    (inzp == outzp && inoff < outoff + len && outoff < inoff + len)) {
+		ZFS_EXIT(zfsvfs);
+		return (SET_ERROR(EINVAL));
+	}
+
+	/*
+	 * Lock the source for reading and the destination for writing, in
+	 * object order so that two clones in opposite directions cannot
+	 * deadlock.  Within a single file the writer may have to take the
+	 * whole file to grow its block size, so lock it once, whole.
+	 */
+	if (inzp == outzp) {
+		inlr = NULL;
+		outlr = rangelock_enter(&outzp->z_rangelock, 0, UINT64_MAX,
+		    RL_WRITER);
+	} else if (inzp->z_id < outzp->z_id) {
+		inlr = rangelock_enter(&inzp->z_rangelock, inoff, len,
+		    RL_READER);
+		outlr = rangelock_enter(&outzp->z_rangelock, outoff, len,
+		    RL_WRITER);
+	} else {
+		outlr = rangelock_enter(&outzp->z_rangelock, outoff, len,
+		    RL_WRITER);
+		inlr = rangelock_enter(&inzp->z_rangelock, inoff, len,
+		    RL_READER);
+	}
+
+	inblksz = inzp->z_blksz;
+	size = inzp->z_size;
+
+	if (inoff >= size) {
+		/* Nothing to clone past the source's EOF. */
+		len = 0;
+		goto unlock;
+	}
+	if (len > size - inoff)
+		len = size - inoff;
+
+	if (inoff % inblksz != 0 || outoff % inblksz != 0 ||
+	    (len % inblksz != 0 &&
+	    (inoff + len != size || outoff + len < outzp->z_size))) {
+		error = SET_ERROR(EINVAL);
+		goto unlock;
+	}
+
+	/*
+	 * A destination that is still a single, smaller block is grown to
+	 * the source's block size, which needs the whole file locked (the
+	 * range lock callback normally took care of that).
+	 */
+	if (outzp->z_blksz != inblksz &&
+	    (outzp->z_blksz > inblksz || outzp->z_size > outzp->z_blksz ||
+	    outlr->lr_length != UINT64_MAX)) {
+		error = SET_ERROR(EXDEV);
+		goto unlock;
+	}
+
+	SA_ADD_BULK_ATTR(bulk, count, SA_ZPL_MTIME(zfsvfs), NULL, &mtime, 16);
+	SA_ADD_BULK_ATTR(bulk, count, SA_ZPL_CTIME(zfsvfs), NULL, &ctime, 16);
+	SA_ADD_BULK_ATTR(bulk, count, SA_ZPL_SIZE(zfsvfs), NULL,
+	    &outzp->z_size, 8);
+
+	maxblocks = MAX(DMU_MAX_ACCESS / 2 / inblksz, 1);
+	bps = kmem_alloc(sizeof (blkptr_t) * maxblocks, KM_SLEEP);
+
+	while (len > 0) {
+		chunk = MIN(roundup(len, inblksz), maxblocks * inblksz);
+		cloned = MIN(chunk, len);
+
+		/*
+		 * Blocks written to the source in an open txg have no block
+		 * pointers yet; wait for them to reach disk and try again.
+		 */
+		nbps = maxblocks;
+		error = dmu_read_l0_bps(os, inzp->z_id, inoff, chunk, bps,
+		    &nbps);
+		if (error == EAGAIN) {
+			txg_wait_synced(dmu_objset_pool(os), 0);
+			nbps = maxblocks;
+			error = dmu_read_l0_bps(os, inzp->z_id, inoff, chunk,
+			    bps, &nbps);
+		}
+		if (error != 0)
+			break;
+
+		if (zfs_owner_overquota(zfsvfs, outzp, B_FALSE) ||
+		    zfs_owner_overquota(zfsvfs, outzp, B_TRUE)) {
+			error = SET_ERROR(EDQUOT);
+			break;
+		}
+
+		tx = dmu_tx_create(os);
+		dmu_tx_hold_sa(tx, outzp->z_sa_hdl, B_FALSE);
+		dmu_tx_hold_clone(tx, outzp->z_id, outoff, chunk);
+		zfs_sa_upgrade_txholds(tx, outzp);
+		error = dmu_tx_assign(tx, TXG_WAIT);
+		if (error != 0) {
+			dmu_tx_abort(tx);
+			break;
+		}
+
+		if (outzp->z_blksz < inblksz)
+			zfs_grow_blocksize(outzp, inblksz, tx);
+
+		error = dmu_brt_clone(os, outzp->z_id, outoff, chunk, tx,
+		    bps, nbps);
+		if (error != 0) {
+			dmu_tx_commit(tx);
+			break;
+		}
+
+		if (outoff + cloned > outzp->z_size)
+			vnode_pager_setsize(ZTOV(outzp), outoff + cloned);
+
+		zfs_tstamp_update_setup(outzp, CONTENT_MODIFIED, mtime, ctime,
+		    B_TRUE);
+
+		/*
+		 * Update the file size (zp_size) if it has changed;
+		 * account for possible concurrent updates.
+		 */
+		while ((size = outzp->z_size) < outoff + cloned) {
+			(void) atomic_cas_64(&outzp->z_size, size,
+			    outoff + cloned);
+		}
+
+		error = sa_bulk_update(outzp->z_sa_hdl, bulk, count, tx);
+		dmu_tx_commit(tx);
+
+#ifdef __APPLE__
+		atomic_inc_64(&outzp->z_write_gencount);
+#endif
+
+		if (error != 0)
+			break;
+
+		inoff += cloned;
+		outoff += cloned;
+		len -= cloned;
+		done += cloned;
+	}
+
+	kmem_free(bps, sizeof (blkptr_t) * maxblocks);
+
+	/*
+	 * The clone is not in the ZIL, so it is only stable once its txg has
+	 * synced; wait for that before anybody can see the new contents.
+	 */
+	if (done > 0)
+		txg_wait_synced(dmu_objset_pool(os), 0);
+
+unlock:
+	rangelock_exit(outlr);
+	if (inlr != NULL)
+		rangelock_exit(inlr);
+
+	*inoffp += done;
+	*outoffp += done;
+	*lenp = done;
+
+	ZFS_EXIT(zfsvfs);
+
+	/* A partial clone is a success; the caller sees a short length. */
+	return (done > 0 ? 0 : error);
+}
+
 void
 zfs_get_done(zgd_t *zgd, int error)
 {
@@ -933,6 +933,56 @@ dprintf("%s HFS_FSCTL_GET_JOURNAL_INFO\n", __func__);
 
 			/* End HFS mimic ioctl */
 
+		case ZFS_IOC_CLONE_RANGE:
+		case ZFS_FSCTL_CLONE_RANGE:
+			dprintf("%s ZFS_IOC_CLONE_RANGE\n", __func__);
+			{
+				zfs_clone_range_args_t *args =
+				    (zfs_clone_range_args_t *)ap->a_data;
+				file_t *src_fp;
+				struct vnode *src_vp;
+
+				if (args->flags != 0) {
+					error = EINVAL;
+					goto out;
+				}
+
+				/* The destination must be open for writing. */
+				if (!(ap->a_fflag & FWRITE)) {
+					error = EBADF;
+					goto out;
+				}
+
+				src_fp = getf(args->src_fd);
+				if (src_fp == NULL) {
+					error = EBADF;
+					goto out;
+				}
+
+				src_vp = getf_vnode(src_fp);
+
+				if ( (error = vnode_getwithref(src_vp)) ) {
+					releasef(args->src_fd);
+					goto out;
+				}
+
+				/* Confirm it is inside our mount */
+				if (((zfsvfs_t *)vfs_fsprivate(vnode_mount((src_vp)))) != zfsvfs) {
+					error = EXDEV;
+				} else if (!vnode_isreg(src_vp) ||
+				    !vnode_isreg(ap->a_vp)) {
+					error = EINVAL;
+				} else {
+					error = zfs_clone_range(VTOZ(src_vp),
+					    &args->src_offset, zp,
+					    &args->dst_offset, &args->len, cr);
+				}
+
+				vnode_put(src_vp);
+				releasef(args->src_fd);
+			}
+			break;
+
 
 		default:
 			dprintf("%s: Unknown ioctl %02lx ('%lu' + %lu)\n",
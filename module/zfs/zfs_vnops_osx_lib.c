@@ -610,6 +610,8 @@ zfs_ioflags(int ap_ioflag)
 		flags |= FNONBLOCK;
 	if (ap_ioflag & IO_SYNC)
 		flags |= (FSYNC | FDSYNC | FRSYNC);
+	if (ap_ioflag & IO_NOCACHE)
+		flags |= FDIRECT;
 
 	return (flags);
 }
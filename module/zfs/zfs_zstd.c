@@ -0,0 +1,509 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Glue between the zio compression framework and the zstd library.
+ *
+ * Every zstd-compressed block starts with a small big-endian header:
+ *
+ *	+--------+------------------+---------------------------+
+ *	| c_len  | level  | version | zstd frame (magicless)    |
+ *	| 32 bit | 8 bit  | 24 bit  | c_len bytes               |
+ *	+--------+------------------+---------------------------+
+ *
+ * c_len is the exact length of the zstd frame, since the block itself
+ * is padded up to the pool's ashift.  The second word holds the level in
+ * its top eight bits and ZSTD_VERSION_NUMBER below it; this is the layout
+ * other OpenZFS platforms use for the same feature, so it must not
+ * change.  The level is the zio_zstd_levels
+ * value the block was compressed with; it is not needed to decompress
+ * the block, but it lets the ARC recompress a decompressed copy of the
+ * block bit-for-bit (e.g. for the L2ARC or to verify a MAC) without
+ * knowing the dataset's current compression setting.
+ *
+ * The zstd library sources themselves are expected to be provided by the
+ * build (lib/common, lib/compress, lib/decompress); this file only uses
+ * the public API plus the static-linking-only parameters for the
+ * magicless frame format.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/zio_compress.h>
+
+#define	ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+#include <zstd_errors.h>
+
+typedef struct zfs_zstd_header {
+	/* Length of the zstd frame that follows */
+	uint32_t	c_len;
+	/* zio_zstd_levels value << 24 | ZSTD_VERSION_NUMBER */
+	uint32_t	raw_version_level;
+	char		data[];
+} zfs_zstdhdr_t;
+
+#define	ZSTD_HDR_RAW(version, level)	\
+	(((uint32_t)(level) << 24) | ((version) & 0xffffff))
+
+/*
+ * Some early writers of this feature stored the word with the level and
+ * version swapped around, or in host byte order.  The version always has
+ * a zero top byte, so the position of the first zero byte tells the
+ * encodings apart; this matches what the other platforms accept.
+ */
+static uint8_t
+zstd_hdr_get_level(uint32_t raw)
+{
+	int shift;
+
+	for (shift = 0; shift < 4; shift++) {
+		if (BF32_GET(raw, 8 * shift, 8) == 0)
+			break;
+	}
+
+	switch (shift) {
+	case 0:
+	case 2:
+		return (BF32_GET(raw, 24, 8));
+	case 1:
+	case 3:
+		return (BF32_GET(raw, 0, 8));
+	default:
+		return (ZIO_ZSTD_LEVEL_INHERIT);
+	}
+}
+
+/*
+ * Blocks at least this large that are to be compressed with zstd-3 or
+ * higher are first run through lz4 (and, if that fails, zstd-1).  If
+ * neither manages to compress the block, the expensive level is skipped
+ * and the block is written uncompressed.  lz4 is fast enough that this
+ * costs little on compressible data, and saves a lot of CPU on data that
+ * is already compressed or encrypted.
+ */
+uint64_t zfs_zstd_earlyabort_pass = 1;
+uint64_t zfs_zstd_abort_size = (128 * 1024);
+#define	ZSTD_EARLYABORT_LEVEL		ZIO_ZSTD_LEVEL_3
+
+/*
+ * Map the fast levels onto the negative zstd levels.
+ */
+static const int16_t zstd_fast_levels[] = {
+	-1, -2, -3, -4, -5, -6, -7, -8, -9, -10,
+	-20, -30, -40, -50, -60, -70, -80, -90, -100, -500, -1000
+};
+CTASSERT(ARRAY_SIZE(zstd_fast_levels) ==
+    ZIO_ZSTD_LEVEL_FAST_MAX - ZIO_ZSTD_LEVEL_FAST);
+
+typedef struct zstd_stats {
+	kstat_named_t zstd_stat_alloc_fail;
+	kstat_named_t zstd_stat_com_inval;
+	kstat_named_t zstd_stat_com_fail;
+	kstat_named_t zstd_stat_dec_inval;
+	kstat_named_t zstd_stat_dec_header_inval;
+	kstat_named_t zstd_stat_dec_fail;
+	kstat_named_t zstd_stat_lz4pass_allowed;
+	kstat_named_t zstd_stat_lz4pass_rejected;
+	kstat_named_t zstd_stat_zstdpass_allowed;
+	kstat_named_t zstd_stat_zstdpass_rejected;
+	kstat_named_t zstd_stat_passignored;
+	kstat_named_t zstd_stat_passignored_size;
+} zstd_stats_t;
+
+static zstd_stats_t zstd_stats = {
+	/* Context allocations that failed; the block is left uncompressed */
+	{ "alloc_fail",				KSTAT_DATA_UINT64 },
+	/* Compression requests with a level we don't know about */
+	{ "compress_level_invalid",		KSTAT_DATA_UINT64 },
+	/* Errors returned by the library while compressing */
+	{ "compress_failed",			KSTAT_DATA_UINT64 },
+	/* Blocks whose header recorded a level we don't know about */
+	{ "decompress_level_invalid",		KSTAT_DATA_UINT64 },
+	/* Blocks whose header is inconsistent with the block size */
+	{ "decompress_header_invalid",		KSTAT_DATA_UINT64 },
+	/* Errors returned by the library while decompressing */
+	{ "decompress_failed",			KSTAT_DATA_UINT64 },
+	/* Early abort: lz4 compressed the block, so zstd ran */
+	{ "lz4pass_allowed",			KSTAT_DATA_UINT64 },
+	/* Early abort: lz4 could not compress the block */
+	{ "lz4pass_rejected",			KSTAT_DATA_UINT64 },
+	/* Early abort: zstd-1 compressed the block, so zstd ran */
+	{ "zstdpass_allowed",			KSTAT_DATA_UINT64 },
+	/* Early abort: zstd-1 could not compress it either; skipped */
+	{ "zstdpass_rejected",			KSTAT_DATA_UINT64 },
+	/* Blocks that bypassed early abort because of their level */
+	{ "passignored",			KSTAT_DATA_UINT64 },
+	/* Blocks that bypassed early abort because of their size */
+	{ "passignored_size",			KSTAT_DATA_UINT64 },
+};
+
+#define	ZSTDSTAT_INCR(stat, val) \
+	atomic_add_64(&zstd_stats.stat.value.ui64, (val))
+#define	ZSTDSTAT_BUMP(stat)	ZSTDSTAT_INCR(stat, 1)
+
+static kstat_t *zstd_ksp;
+
+/*
+ * Creating a zstd context is expensive (it allocates the match finder
+ * tables), so a small pool of contexts is kept around and reused across
+ * blocks and levels.  If every pooled context is busy, a one-off context
+ * is created for the call instead of waiting.
+ */
+typedef struct zstd_pool {
+	kmutex_t	zp_lock;
+	void		*zp_ctx;
+} zstd_pool_t;
+
+static zstd_pool_t *zstd_cctx_pool;
+static zstd_pool_t *zstd_dctx_pool;
+static int zstd_pool_count;
+
+/*
+ * kmem_free() needs the size of the allocation, which the zstd allocator
+ * interface does not pass back, so stash it in front of the buffer.
+ */
+/*ARGSUSED*/
+static void *
+zstd_alloc(void *opaque, size_t size)
+{
+	size_t nbytes = sizeof (uint64_t) + size;
+	uint64_t *p = kmem_alloc(nbytes, KM_NOSLEEP);
+
+	if (p == NULL)
+		return (NULL);
+	*p = nbytes;
+	return (p + 1);
+}
+
+/*ARGSUSED*/
+static void
+zstd_free(void *opaque, void *ptr)
+{
+	uint64_t *p;
+
+	if (ptr == NULL)
+		return;
+	p = (uint64_t *)ptr - 1;
+	kmem_free(p, *p);
+}
+
+static const ZSTD_customMem zstd_mem = {
+	.customAlloc = zstd_alloc,
+	.customFree = zstd_free,
+	.opaque = NULL
+};
+
+static ZSTD_CCtx *
+zstd_cctx_create(void)
+{
+	ZSTD_CCtx *cctx = ZSTD_createCCtx_advanced(zstd_mem);
+
+	if (cctx == NULL)
+		ZSTDSTAT_BUMP(zstd_stat_alloc_fail);
+	return (cctx);
+}
+
+static ZSTD_DCtx *
+zstd_dctx_create(void)
+{
+	ZSTD_DCtx *dctx = ZSTD_createDCtx_advanced(zstd_mem);
+
+	if (dctx == NULL)
+		ZSTDSTAT_BUMP(zstd_stat_alloc_fail);
+	return (dctx);
+}
+
+/*
+ * Grab an idle pool entry, creating its context on first use.  Returns
+ * with the entry's lock held, or NULL if every entry is busy.
+ */
+static zstd_pool_t *
+zstd_pool_grab(zstd_pool_t *pool, boolean_t compress)
+{
+	for (int i = 0; i < zstd_pool_count; i++) {
+		zstd_pool_t *zp = &pool[i];
+
+		if (!mutex_tryenter(&zp->zp_lock))
+			continue;
+		if (zp->zp_ctx == NULL) {
+			zp->zp_ctx = compress ? (void *)zstd_cctx_create() :
+			    (void *)zstd_dctx_create();
+		}
+		if (zp->zp_ctx != NULL)
+			return (zp);
+		mutex_exit(&zp->zp_lock);
+	}
+	return (NULL);
+}
+
+static void
+zstd_pool_release(zstd_pool_t *zp)
+{
+	mutex_exit(&zp->zp_lock);
+}
+
+/*
+ * Convert a zio_zstd_levels value into a zstd library level.
+ */
+static int
+zstd_enum_to_level(int level, int *zstd_level)
+{
+	if (level > ZIO_ZSTD_LEVEL_INHERIT && level <= ZIO_ZSTD_LEVEL_MAX) {
+		*zstd_level = level;
+		return (0);
+	}
+	if (level > ZIO_ZSTD_LEVEL_FAST && level <= ZIO_ZSTD_LEVEL_FAST_MAX) {
+		*zstd_level = zstd_fast_levels[level - ZIO_ZSTD_LEVEL_FAST - 1];
+		return (0);
+	}
+	return (SET_ERROR(EINVAL));
+}
+
+/*
+ * Compress s_start into d_start at the given level.  Returns the size of
+ * the header plus frame, or s_len if the block did not fit in d_len.
+ */
+static size_t
+zfs_zstd_compress_impl(void *s_start, void *d_start, size_t s_len,
+    size_t d_len, int level)
+{
+	zfs_zstdhdr_t *hdr = d_start;
+	zstd_pool_t *zp;
+	ZSTD_CCtx *cctx;
+	size_t c_len;
+	int zstd_level;
+
+	if (zstd_enum_to_level(level, &zstd_level) != 0) {
+		ZSTDSTAT_BUMP(zstd_stat_com_inval);
+		return (s_len);
+	}
+
+	if (d_len <= sizeof (*hdr))
+		return (s_len);
+
+	zp = zstd_pool_grab(zstd_cctx_pool, B_TRUE);
+	cctx = (zp != NULL) ? zp->zp_ctx : zstd_cctx_create();
+	if (cctx == NULL)
+		return (s_len);
+
+	/*
+	 * The frame is stored without its magic number and without a
+	 * content checksum, since the block is already checksummed by the
+	 * pool and its size is known from the block pointer.
+	 */
+	(void) ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+	(void) ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+	    zstd_level);
+	(void) ZSTD_CCtx_setParameter(cctx, ZSTD_c_format,
+	    ZSTD_f_zstd1_magicless);
+	(void) ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 0);
+	(void) ZSTD_CCtx_setParameter(cctx, ZSTD_c_contentSizeFlag, 0);
+
+	c_len = ZSTD_compress2(cctx, hdr->data, d_len - sizeof (*hdr),
+	    s_start, s_len);
+
+	if (zp != NULL)
+		zstd_pool_release(zp);
+	else
+		ZSTD_freeCCtx(cctx);
+
+	if (ZSTD_isError(c_len)) {
+		/* Running out of room is the expected way to fail */
+		if (ZSTD_getErrorCode(c_len) != ZSTD_error_dstSize_tooSmall)
+			ZSTDSTAT_BUMP(zstd_stat_com_fail);
+		return (s_len);
+	}
+
+	hdr->c_len = BE_32(c_len);
+	hdr->raw_version_level =
+	    BE_32(ZSTD_HDR_RAW(ZSTD_VERSION_NUMBER, level));
+
+	return (c_len + sizeof (*hdr));
+}
+
+size_t
+zfs_zstd_compress(void *s_start, void *d_start, size_t s_len, size_t d_len,
+    int level)
+{
+	size_t c_len;
+
+	/*
+	 * Early abort: probe the block with cheap compressors before
+	 * spending an expensive level on it.  The probe output is simply
+	 * overwritten by the real compression pass.
+	 */
+	if (zfs_zstd_earlyabort_pass != 0 &&
+	    level >= ZSTD_EARLYABORT_LEVEL && level <= ZIO_ZSTD_LEVEL_MAX) {
+		if (s_len < zfs_zstd_abort_size) {
+			ZSTDSTAT_BUMP(zstd_stat_passignored_size);
+		} else {
+			c_len = lz4_compress_zfs(s_start, d_start, s_len,
+			    d_len, 0);
+			if (c_len < d_len) {
+				ZSTDSTAT_BUMP(zstd_stat_lz4pass_allowed);
+			} else {
+				ZSTDSTAT_BUMP(zstd_stat_lz4pass_rejected);
+
+				c_len = zfs_zstd_compress_impl(s_start,
+				    d_start, s_len, d_len, ZIO_ZSTD_LEVEL_1);
+				if (c_len >= d_len) {
+					ZSTDSTAT_BUMP(
+					    zstd_stat_zstdpass_rejected);
+					return (s_len);
+				}
+				ZSTDSTAT_BUMP(zstd_stat_zstdpass_allowed);
+			}
+		}
+	} else {
+		ZSTDSTAT_BUMP(zstd_stat_passignored);
+	}
+
+	return (zfs_zstd_compress_impl(s_start, d_start, s_len, d_len, level));
+}
+
+int
+zfs_zstd_decompress_level(void *s_start, void *d_start, size_t s_len,
+    size_t d_len, uint8_t *level)
+{
+	const zfs_zstdhdr_t *hdr = s_start;
+	zstd_pool_t *zp;
+	ZSTD_DCtx *dctx;
+	size_t c_len, result;
+	uint8_t curlevel;
+	int zstd_level;
+
+	if (s_len < sizeof (*hdr)) {
+		ZSTDSTAT_BUMP(zstd_stat_dec_header_inval);
+		return (SET_ERROR(EINVAL));
+	}
+
+	c_len = BE_IN32(&hdr->c_len);
+	curlevel = zstd_hdr_get_level(BE_IN32(&hdr->raw_version_level));
+
+	if (c_len + sizeof (*hdr) > s_len) {
+		ZSTDSTAT_BUMP(zstd_stat_dec_header_inval);
+		return (SET_ERROR(EINVAL));
+	}
+
+	/*
+	 * The level is informational only, but a value we don't know
+	 * about means the header is not what we think it is.
+	 */
+	if (zstd_enum_to_level(curlevel, &zstd_level) != 0) {
+		ZSTDSTAT_BUMP(zstd_stat_dec_inval);
+		return (SET_ERROR(EINVAL));
+	}
+
+	zp = zstd_pool_grab(zstd_dctx_pool, B_FALSE);
+	dctx = (zp != NULL) ? zp->zp_ctx : zstd_dctx_create();
+	if (dctx == NULL)
+		return (SET_ERROR(ENOMEM));
+
+	(void) ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+	(void) ZSTD_DCtx_setParameter(dctx, ZSTD_d_format,
+	    ZSTD_f_zstd1_magicless);
+
+	result = ZSTD_decompressDCtx(dctx, d_start, d_len, hdr->data, c_len);
+
+	if (zp != NULL)
+		zstd_pool_release(zp);
+	else
+		ZSTD_freeDCtx(dctx);
+
+	if (ZSTD_isError(result)) {
+		ZSTDSTAT_BUMP(zstd_stat_dec_fail);
+		return (SET_ERROR(EIO));
+	}
+
+	if (level != NULL)
+		*level = curlevel;
+
+	return (0);
+}
+
+/*ARGSUSED*/
+int
+zfs_zstd_decompress(void *s_start, void *d_start, size_t s_len, size_t d_len,
+    int n)
+{
+	return (zfs_zstd_decompress_level(s_start, d_start, s_len, d_len,
+	    NULL));
+}
+
+static void
+zstd_pool_destroy(zstd_pool_t *pool, boolean_t compress)
+{
+	for (int i = 0; i < zstd_pool_count; i++) {
+		zstd_pool_t *zp = &pool[i];
+
+		if (zp->zp_ctx != NULL) {
+			if (compress)
+				ZSTD_freeCCtx(zp->zp_ctx);
+			else
+				ZSTD_freeDCtx(zp->zp_ctx);
+		}
+		mutex_destroy(&zp->zp_lock);
+	}
+	kmem_free(pool, zstd_pool_count * sizeof (zstd_pool_t));
+}
+
+void
+zstd_init(void)
+{
+	/*
+	 * One context per CPU covers the steady state where every
+	 * zio_write_compress() taskq thread is busy compressing.
+	 */
+	zstd_pool_count = MAX(max_ncpus, 4);
+	zstd_cctx_pool = kmem_zalloc(zstd_pool_count * sizeof (zstd_pool_t),
+	    KM_SLEEP);
+	zstd_dctx_pool = kmem_zalloc(zstd_pool_count * sizeof (zstd_pool_t),
+	    KM_SLEEP);
+	for (int i = 0; i < zstd_pool_count; i++) {
+		mutex_init(&zstd_cctx_pool[i].zp_lock, NULL, MUTEX_DEFAULT,
+		    NULL);
+		mutex_init(&zstd_dctx_pool[i].zp_lock, NULL, MUTEX_DEFAULT,
+		    NULL);
+	}
+
+	zstd_ksp = kstat_create("zfs", 0, "zstd", "misc", KSTAT_TYPE_NAMED,
+	    sizeof (zstd_stats) / sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+	if (zstd_ksp != NULL) {
+		zstd_ksp->ks_data = &zstd_stats;
+		kstat_install(zstd_ksp);
+	}
+}
+
+void
+zstd_fini(void)
+{
+	if (zstd_ksp != NULL) {
+		kstat_delete(zstd_ksp);
+		zstd_ksp = NULL;
+	}
+
+	zstd_pool_destroy(zstd_cctx_pool, B_TRUE);
+	zstd_pool_destroy(zstd_dctx_pool, B_FALSE);
+	zstd_cctx_pool = NULL;
+	zstd_dctx_pool = NULL;
+	zstd_pool_count = 0;
+}
@@ -41,6 +41,7 @@
 #include <sys/dmu_objset.h>
 #include <sys/arc.h>
 #include <sys/ddt.h>
+#include <sys/brt.h>
 #include <sys/blkptr.h>
 #include <sys/zfeature.h>
 #include <sys/dsl_scan.h>
@@ -214,6 +215,7 @@ zio_init(void)
 	zio_inject_init();
 
 	lz4_init();
+	zstd_init();
 
 }
 
@@ -251,6 +253,7 @@ zio_fini(void)
 
 	zio_inject_fini();
 
+	zstd_fini();
 	lz4_fini();
 
 #ifdef __APPLE__
@@ -422,7 +425,8 @@ zio_decompress(zio_t *zio, abd_t *data, uint64_t size)
 	if (zio->io_error == 0) {
 		void *tmp = abd_borrow_buf(data, size);
 		int ret = zio_decompress_data(BP_GET_COMPRESS(zio->io_bp),
-		    zio->io_abd, tmp, zio->io_size, size);
+		    zio->io_abd, tmp, zio->io_size, size,
+		    &zio->io_prop.zp_complevel);
 		abd_return_buf_copy(data, tmp, size);
 
 		if (ret != 0)
@@ -469,7 +473,7 @@ zio_decrypt(zio_t *zio, abd_t *data, uint64_t size)
 			 */
 			tmp = zio_buf_alloc(lsize);
 			ret = zio_decompress_data(BP_GET_COMPRESS(bp),
-			    zio->io_abd, tmp, zio->io_size, lsize);
+			    zio->io_abd, tmp, zio->io_size, lsize, NULL);
 			if (ret != 0) {
 				ret = SET_ERROR(EIO);
 				goto error;
@@ -1140,10 +1144,15 @@ zio_free(spa_t *spa, uint64_t txg, const blkptr_t *bp)
 	 * deferred, and which will not need to do a read (i.e. not GANG or
 	 * DEDUP), can be processed immediately.  Otherwise, put them on the
 	 * in-memory list for later processing.
+	 *
+	 * Blocks that may have been cloned go on the list as well, since
+	 * the BRT entries are only looked up and updated by the sync thread,
+	 * while we may be running in a zio interrupt thread.
 	 */
 	if (BP_IS_GANG(bp) || BP_GET_DEDUP(bp) ||
 	    txg != spa->spa_syncing_txg ||
-	    spa_sync_pass(spa) >= zfs_sync_pass_deferred_free) {
+	    spa_sync_pass(spa) >= zfs_sync_pass_deferred_free ||
+	    brt_maybe_exists(spa, bp)) {
 		bplist_append(&spa->spa_free_bplist[txg & TXG_MASK], bp);
 	} else {
 		VERIFY0(zio_wait(zio_free_sync(NULL, spa, txg, bp, 0)));
@@ -1164,6 +1173,13 @@ zio_free_sync(zio_t *pio, spa_t *spa, uint64_t txg, const blkptr_t *bp,
 	if (BP_IS_EMBEDDED(bp))
 		return (zio_null(pio, spa, NULL, NULL, NULL, 0));
 
+	/*
+	 * A cloned block stays allocated until its last reference is gone;
+	 * until then freeing it only drops its BRT refcount.
+	 */
+	if (brt_maybe_exists(spa, bp) && !brt_entry_decref(spa, bp))
+		return (zio_null(pio, spa, NULL, NULL, NULL, 0));
+
 	metaslab_check_free(spa, bp);
 	arc_freed(spa, bp);
 	dsl_scan_freed(spa, bp);
@@ -1553,6 +1569,28 @@ zio_write_bp_init(zio_t *zio)
 	return (zio);
 }
 
+/*
+ * Account a record that is written uncompressed although its dataset has
+ * compression enabled: either 'skipped' without trying, or compressed
+ * without saving enough to be worth it.
+ */
+static void
+zio_write_compress_stat(zio_prop_t *zp, boolean_t skipped, uint64_t lsize)
+{
+	zio_compress_stats_t *zcs = zp->zp_compress_stats;
+
+	if (zcs == NULL)
+		return;
+
+	if (skipped) {
+		atomic_inc_64(&zcs->zcs_skipped.value.ui64);
+		atomic_add_64(&zcs->zcs_skipped_bytes.value.ui64, lsize);
+	} else {
+		atomic_inc_64(&zcs->zcs_failed.value.ui64);
+		atomic_add_64(&zcs->zcs_failed_bytes.value.ui64, lsize);
+	}
+}
+
 static zio_t *
 zio_write_compress(zio_t *zio)
 {
@@ -1612,12 +1650,27 @@ zio_write_compress(zio_t *zio)
 		ASSERT(BP_IS_EMBEDDED(bp) || MIN(zp->zp_copies + BP_IS_GANG(bp),
 			    spa_max_replication(spa)) == BP_GET_NDVAS(bp));
 	}
+	/*
+	 * Don't try to compress records whose sample looks random; see
+	 * zio_compress_incompressible().  EMPTY only detects holes and is
+	 * always cheap.
+	 */
+	if (compress != ZIO_COMPRESS_OFF && compress != ZIO_COMPRESS_EMPTY &&
+	    !(zio->io_flags & ZIO_FLAG_RAW_COMPRESS) &&
+	    zio_compress_incompressible(zio->io_abd, lsize)) {
+		zio_write_compress_stat(zp, B_TRUE, lsize);
+		compress = ZIO_COMPRESS_OFF;
+	}
+
 	/* If it's a compressed write that is not raw, compress the buffer. */
 	if (compress != ZIO_COMPRESS_OFF &&
 	    !(zio->io_flags & ZIO_FLAG_RAW_COMPRESS)) {
 		void *cbuf = zio_buf_alloc(lsize);
-		psize = zio_compress_data(compress, zio->io_abd, cbuf, lsize);
+		psize = zio_compress_data(compress, zio->io_abd, cbuf, lsize,
+		    zp->zp_complevel);
 		if (psize == 0 || psize == lsize) {
+			if (psize == lsize)
+				zio_write_compress_stat(zp, B_FALSE, lsize);
 			compress = ZIO_COMPRESS_OFF;
 			zio_buf_free(cbuf, lsize);
 		} else if (!zp->zp_dedup && !zp->zp_encrypt &&
@@ -1651,6 +1704,7 @@ zio_write_compress(zio_t *zio)
 			rounded = (size_t)P2ROUNDUP(psize,
 			    1ULL << spa->spa_min_ashift);
 			if (rounded >= lsize) {
+				zio_write_compress_stat(zp, B_FALSE, lsize);
 				compress = ZIO_COMPRESS_OFF;
 				zio_buf_free(cbuf, lsize);
 				psize = lsize;
@@ -1686,7 +1740,7 @@ zio_write_compress(zio_t *zio)
 		 * to a hole.
 		 */
 		psize = zio_compress_data(ZIO_COMPRESS_EMPTY,
-		    zio->io_abd, NULL, lsize);
+		    zio->io_abd, NULL, lsize, ZIO_COMPLEVEL_INHERIT);
 		if (psize == 0)
 			compress = ZIO_COMPRESS_OFF;
 	} else {
@@ -2665,6 +2719,7 @@ zio_write_gang_block(zio_t *pio)
 		bzero(zp.zp_salt, ZIO_DATA_SALT_LEN);
 		bzero(zp.zp_iv, ZIO_DATA_IV_LEN);
 		bzero(zp.zp_mac, ZIO_DATA_MAC_LEN);
+		zp.zp_compress_stats = NULL;
 
 		zio_t *cio = zio_write(zio, spa, txg, &gbh->zg_blkptr[g],
 		    abd_get_offset(pio->io_abd, pio->io_size - resid), lsize,
@@ -3046,6 +3101,14 @@ zio_ddt_write(zio_t *zio)
 	ASSERT(BP_IS_HOLE(bp) || zio->io_bp_override);
 	ASSERT(!(zio->io_bp_override && (zio->io_flags & ZIO_FLAG_RAW)));
 
+	/*
+	 * If the entry has to be read from disk, wait for it in a batch with
+	 * other writes, and come back to this stage once it is loaded.  The
+	 * zio may already be running again elsewhere once this returns.
+	 */
+	if (ddt_lookup_async(ddt, zio))
+		return (NULL);
+
 	ddt_enter(ddt);
 	dde = ddt_lookup(ddt, bp, B_TRUE);
 	ddp = &dde->dde_phys[p];
@@ -3073,6 +3136,20 @@ zio_ddt_write(zio_t *zio)
 		return (zio);
 	}
 
+	/*
+	 * Once the DDT is over its quota, a block that would need a new
+	 * entry is written as an ordinary block.
+	 */
+	if (dde->dde_type == DDT_TYPES && ddt_phys_total_refcnt(dde) == 0 &&
+	    dde->dde_lead_zio[p] == NULL && zio->io_bp_override == NULL &&
+	    ddt_over_quota(spa)) {
+		zp->zp_dedup = B_FALSE;
+		BP_SET_DEDUP(bp, B_FALSE);
+		zio->io_pipeline = ZIO_WRITE_PIPELINE;
+		ddt_exit(ddt);
+		return (zio);
+	}
+
 	if (ddp->ddp_phys_birth != 0 || dde->dde_lead_zio[p] != NULL) {
 		if (ddp->ddp_phys_birth != 0)
 			ddt_bp_fill(ddp, bp, txg);
@@ -3120,10 +3197,17 @@ zio_ddt_free(zio_t *zio)
 
 	ddt_enter(ddt);
 	freedde = dde = ddt_lookup(ddt, bp, B_TRUE);
-	if (dde) {
-		ddp = ddt_phys_select(dde, bp);
-		if (ddp)
-			ddt_phys_decref(ddp);
+	ddp = ddt_phys_select(dde, bp);
+	if (ddp != NULL) {
+		ddt_phys_decref(ddp);
+	} else {
+		/*
+		 * The block's entry was pruned from the DDT; it is now only
+		 * referenced by this block pointer, and freed as usual.
+		 */
+		zio->io_pipeline = ZIO_FREE_PIPELINE;
+		if (BP_IS_GANG(bp))
+			zio->io_pipeline |= ZIO_GANG_STAGES;
 	}
 	ddt_exit(ddt);
 
@@ -3983,6 +4067,16 @@ zio_checksum_generate(zio_t *zio)
 			checksum = ZIO_CHECKSUM_GANG_HEADER;
 		} else {
 			checksum = BP_GET_CHECKSUM(bp);
+
+			/*
+			 * Some checksums are computed in batches of writes,
+			 * in which case this one may have to wait for others.
+			 */
+			if ((zio_checksum_table[checksum].ci_flags &
+			    ZCHECKSUM_FLAG_EMBEDDED) == 0) {
+				return (zio_checksum_compute_async(zio,
+				    checksum) ? NULL : zio);
+			}
 		}
 	}
 
@@ -89,7 +89,22 @@
  * construct and destruct the pre-initialized checksum context.  The
  * pre-initialized context is then reused during each checksum
  * invocation and passed to the checksum function.
+ *
+ * BATCHED CHECKSUMS
+ *
+ * SHA2 implementations may hash several buffers side by side, one per
+ * vector lane, which is only faster if they are handed enough buffers at
+ * once.  So when the selected implementation can, writes checksummed
+ * with sha256 or sha512 do not compute their checksum on their own:
+ * they wait on a per-pool queue until enough others have arrived, or
+ * until the batch task runs, and all of them are computed in one call.
+ */
+
+/*
+ * Largest number of writes whose checksums are computed together, or 0
+ * to compute each write's checksum in its own thread.
  */
+uint64_t zio_checksum_batch_max = ZIO_CHECKSUM_BATCH_MAX;
 
 /*ARGSUSED*/
 static void
@@ -174,6 +189,10 @@ zio_checksum_info_t zio_checksum_table[ZIO_CHECKSUM_FUNCTIONS] = {
 	    abd_checksum_edonr_tmpl_init, abd_checksum_edonr_tmpl_free,
 	    ZCHECKSUM_FLAG_METADATA | ZCHECKSUM_FLAG_SALTED |
 	    ZCHECKSUM_FLAG_NOPWRITE, "edonr"},
+	{{abd_checksum_blake3_native,	abd_checksum_blake3_byteswap},
+	    abd_checksum_blake3_tmpl_init, abd_checksum_blake3_tmpl_free,
+	    ZCHECKSUM_FLAG_METADATA | ZCHECKSUM_FLAG_DEDUP |
+	    ZCHECKSUM_FLAG_SALTED | ZCHECKSUM_FLAG_NOPWRITE, "blake3"},
 };
 
 /*
@@ -192,6 +211,8 @@ zio_checksum_to_feature(enum zio_checksum cksum)
 		return (SPA_FEATURE_SKEIN);
 	case ZIO_CHECKSUM_EDONR:
 		return (SPA_FEATURE_EDONR);
+	case ZIO_CHECKSUM_BLAKE3:
+		return (SPA_FEATURE_BLAKE3);
 	default:
 		break;
 	}
@@ -385,6 +406,238 @@ zio_checksum_compute(zio_t *zio, enum zio_checksum checksum,
 
 }
 
+/*
+ * A write waiting for its checksum to be computed in a batch.
+ */
+typedef struct zio_cksum_req {
+	list_node_t		zcr_node;
+	zio_t			*zcr_zio;
+	enum zio_checksum	zcr_checksum;
+} zio_cksum_req_t;
+
+/*
+ * Computes the checksums of n writes whose block pointers use the same,
+ * non-embedded checksum; the batch counterpart of zio_checksum_compute().
+ */
+static void
+zio_checksum_compute_batch(zio_t **zios, enum zio_checksum checksum, uint_t n)
+{
+	zio_checksum_info_t *ci = &zio_checksum_table[checksum];
+	boolean_t insecure = (ci->ci_flags & ZCHECKSUM_FLAG_DEDUP) == 0;
+	abd_t *abds[ZIO_CHECKSUM_BATCH_MAX];
+	uint64_t sizes[ZIO_CHECKSUM_BATCH_MAX];
+	zio_cksum_t cksums[ZIO_CHECKSUM_BATCH_MAX];
+	zio_cksum_t saved;
+	uint_t i;
+
+	ASSERT3U(n, <=, ZIO_CHECKSUM_BATCH_MAX);
+	ASSERT0(ci->ci_flags & ZCHECKSUM_FLAG_EMBEDDED);
+
+	for (i = 0; i < n; i++) {
+		abds[i] = zios[i]->io_abd;
+		sizes[i] = zios[i]->io_size;
+	}
+
+	abd_checksum_SHA2_batch(checksum, abds, sizes, n, cksums);
+
+	for (i = 0; i < n; i++) {
+		blkptr_t *bp = zios[i]->io_bp;
+
+		saved = bp->blk_cksum;
+		if (BP_USES_CRYPT(bp) && BP_GET_TYPE(bp) != DMU_OT_OBJSET)
+			zio_checksum_handle_crypt(&cksums[i], &saved, insecure);
+		bp->blk_cksum = cksums[i];
+	}
+}
+
+/*
+ * Send writes whose checksums have been computed back to the issue taskqs,
+ * where their pipelines go on after the checksum stage.
+ */
+static void
+zio_checksum_batch_resume(list_t *done)
+{
+	zio_cksum_req_t *zcr;
+
+	while ((zcr = list_remove_head(done)) != NULL) {
+		zio_t *zio = zcr->zcr_zio;
+
+		spa_taskq_dispatch_ent(zio->io_spa, ZIO_TYPE_WRITE,
+		    ZIO_TASKQ_ISSUE, (task_func_t *)zio_execute, zio, 0,
+		    &zio->io_tqent);
+		kmem_free(zcr, sizeof (zio_cksum_req_t));
+	}
+}
+
+/*
+ * Move up to max of the requests in from with the same checksum as the
+ * first one to to, and return how many were moved.
+ */
+static uint_t
+zio_checksum_batch_take(list_t *from, list_t *to, uint_t max)
+{
+	zio_cksum_req_t *zcr, *next;
+	enum zio_checksum checksum;
+	uint_t n = 0;
+
+	if ((zcr = list_head(from)) == NULL)
+		return (0);
+	checksum = zcr->zcr_checksum;
+
+	for (; zcr != NULL && n < max; zcr = next) {
+		next = list_next(from, zcr);
+		if (zcr->zcr_checksum != checksum)
+			continue;
+		list_remove(from, zcr);
+		list_insert_tail(to, zcr);
+		n++;
+	}
+
+	return (n);
+}
+
+/*
+ * Compute the checksums of the requests in batch, all with the same
+ * checksum, and move them to done.
+ */
+static void
+zio_checksum_batch_compute(list_t *batch, list_t *done)
+{
+	zio_t *zios[ZIO_CHECKSUM_BATCH_MAX];
+	zio_cksum_req_t *zcr;
+	enum zio_checksum checksum = ZIO_CHECKSUM_OFF;
+	uint_t n = 0;
+
+	while ((zcr = list_remove_head(batch)) != NULL) {
+		zios[n++] = zcr->zcr_zio;
+		checksum = zcr->zcr_checksum;
+		list_insert_tail(done, zcr);
+	}
+
+	if (n > 0)
+		zio_checksum_compute_batch(zios, checksum, n);
+}
+
+/*
+ * Compute the checksums of all writes queued on a pool, in batches of up
+ * to zio_checksum_batch_max with the same checksum.
+ *
+ * A batch is resumed only once the queue has been found empty: the pool
+ * may go away as soon as the last of its writes is done, so it must not
+ * be touched after that.
+ */
+static void
+zio_checksum_batch_task(void *arg)
+{
+	spa_t *spa = arg;
+	list_t queue, batch, done;
+	uint_t max = MIN(MAX(zio_checksum_batch_max, 1),
+	    ZIO_CHECKSUM_BATCH_MAX);
+
+	list_create(&queue, sizeof (zio_cksum_req_t),
+	    offsetof(zio_cksum_req_t, zcr_node));
+	list_create(&batch, sizeof (zio_cksum_req_t),
+	    offsetof(zio_cksum_req_t, zcr_node));
+	list_create(&done, sizeof (zio_cksum_req_t),
+	    offsetof(zio_cksum_req_t, zcr_node));
+
+	mutex_enter(&spa->spa_cksum_batch_lock);
+	for (;;) {
+		list_move_tail(&queue, &spa->spa_cksum_batch_list);
+		if (list_is_empty(&queue)) {
+			spa->spa_cksum_batch_dispatched = B_FALSE;
+			break;
+		}
+		mutex_exit(&spa->spa_cksum_batch_lock);
+
+		zio_checksum_batch_resume(&done);
+
+		while (zio_checksum_batch_take(&queue, &batch, max) > 0)
+			zio_checksum_batch_compute(&batch, &done);
+
+		mutex_enter(&spa->spa_cksum_batch_lock);
+	}
+	mutex_exit(&spa->spa_cksum_batch_lock);
+
+	zio_checksum_batch_resume(&done);
+
+	list_destroy(&queue);
+	list_destroy(&batch);
+	list_destroy(&done);
+}
+
+/*
+ * Called by zio_checksum_generate() for writes whose block pointer gets a
+ * non-embedded checksum.  If as many writes with the same checksum as the
+ * SHA2 code has lanes are queued on the pool, this one included, compute
+ * their checksums together, resume the others and return B_FALSE: this
+ * write goes on in its own thread.  Otherwise leave the write queued for
+ * the batch task and return B_TRUE; the caller has then to stall its
+ * pipeline, which the batch task resumes after the current stage.
+ *
+ * The checksum is computed right away if the selected SHA2 code has no
+ * multi-buffer function for it, or if zio_checksum_batch_max is below 2.
+ */
+boolean_t
+zio_checksum_compute_async(zio_t *zio, enum zio_checksum checksum)
+{
+	spa_t *spa = zio->io_spa;
+	zio_cksum_req_t *zcr, *r;
+	list_t batch, done;
+	uint_t width, max, n;
+	boolean_t dispatch;
+
+	max = MIN(zio_checksum_batch_max, ZIO_CHECKSUM_BATCH_MAX);
+	width = MIN(abd_checksum_SHA2_batch_width(checksum), max);
+	if (width <= 1) {
+		zio_checksum_compute(zio, checksum, zio->io_abd, zio->io_size);
+		return (B_FALSE);
+	}
+
+	zcr = kmem_alloc(sizeof (zio_cksum_req_t), KM_SLEEP);
+	zcr->zcr_zio = zio;
+	zcr->zcr_checksum = checksum;
+
+	mutex_enter(&spa->spa_cksum_batch_lock);
+	list_insert_head(&spa->spa_cksum_batch_list, zcr);
+	for (r = zcr, n = 0; r != NULL && n < width;
+	    r = list_next(&spa->spa_cksum_batch_list, r)) {
+		if (r->zcr_checksum == checksum)
+			n++;
+	}
+	if (n == width) {
+		list_create(&batch, sizeof (zio_cksum_req_t),
+		    offsetof(zio_cksum_req_t, zcr_node));
+		list_create(&done, sizeof (zio_cksum_req_t),
+		    offsetof(zio_cksum_req_t, zcr_node));
+		VERIFY3U(zio_checksum_batch_take(&spa->spa_cksum_batch_list,
+		    &batch, width), ==, width);
+		mutex_exit(&spa->spa_cksum_batch_lock);
+
+		zio_checksum_batch_compute(&batch, &done);
+
+		/* this write goes on in this thread */
+		VERIFY3P(list_remove_head(&done), ==, zcr);
+		kmem_free(zcr, sizeof (zio_cksum_req_t));
+		zio_checksum_batch_resume(&done);
+
+		list_destroy(&batch);
+		list_destroy(&done);
+		return (B_FALSE);
+	}
+	dispatch = !spa->spa_cksum_batch_dispatched;
+	spa->spa_cksum_batch_dispatched = B_TRUE;
+	mutex_exit(&spa->spa_cksum_batch_lock);
+
+	if (dispatch) {
+		spa_taskq_dispatch_ent(spa, ZIO_TYPE_WRITE, ZIO_TASKQ_ISSUE,
+		    zio_checksum_batch_task, spa, 0,
+		    &spa->spa_cksum_batch_tqent);
+	}
+
+	return (B_TRUE);
+}
+
 int
 zio_checksum_error_impl(spa_t *spa, const blkptr_t *bp,
     enum zio_checksum checksum, abd_t *abd, uint64_t size, uint64_t offset,
@@ -547,3 +800,27 @@ zio_checksum_templates_free(spa_t *spa)
 		}
 	}
 }
+
+void
+zio_checksum_batch_init(spa_t *spa)
+{
+	mutex_init(&spa->spa_cksum_batch_lock, NULL, MUTEX_DEFAULT, NULL);
+	list_create(&spa->spa_cksum_batch_list, sizeof (zio_cksum_req_t),
+	    offsetof(zio_cksum_req_t, zcr_node));
+	taskq_init_ent(&spa->spa_cksum_batch_tqent);
+}
+
+void
+zio_checksum_batch_fini(spa_t *spa)
+{
+	ASSERT(list_is_empty(&spa->spa_cksum_batch_list));
+	ASSERT(!spa->spa_cksum_batch_dispatched);
+	list_destroy(&spa->spa_cksum_batch_list);
+	mutex_destroy(&spa->spa_cksum_batch_lock);
+}
+
+#if defined(_KERNEL)
+module_param(zio_checksum_batch_max, ulong, 0644);
+MODULE_PARM_DESC(zio_checksum_batch_max,
+	"Writes whose checksums are computed together");
+#endif
@@ -41,26 +41,54 @@
  */
 uint64_t zio_decompress_fail_fraction = 0;
 
+/*
+ * Before a record is handed to the compressor, zio_write_compress() takes
+ * a sample of it and estimates its order-0 (per byte) entropy.  Records
+ * that look like random data, which is what already compressed or
+ * encrypted files look like, are written uncompressed without first paying
+ * for a compression attempt that would have failed anyway.  This matters
+ * most for the expensive gzip levels.
+ *
+ * zfs_compress_entropy_limit is in thousandths of a bit per byte (uniformly
+ * random data is 8000); records sampling at or above it are not compressed,
+ * and 0 disables the estimate.  zfs_compress_entropy_sample is the number
+ * of bytes sampled, in runs spread evenly across the record; records
+ * smaller than twice the sample are always compressed.
+ */
+uint64_t zfs_compress_entropy_limit = 7900;
+uint64_t zfs_compress_entropy_sample = 4096;
+
 /*
  * Compression vectors.
  */
 zio_compress_info_t zio_compress_table[ZIO_COMPRESS_FUNCTIONS] = {
-	{"inherit",		0,	NULL,		NULL},
-	{"on",			0,	NULL,		NULL},
-	{"uncompressed",	0,	NULL,		NULL},
-	{"lzjb",		0,	lzjb_compress,	lzjb_decompress},
-	{"empty",		0,	NULL,		NULL},
-	{"gzip-1",		1,	gzip_compress,	gzip_decompress},
-	{"gzip-2",		2,	gzip_compress,	gzip_decompress},
-	{"gzip-3",		3,	gzip_compress,	gzip_decompress},
-	{"gzip-4",		4,	gzip_compress,	gzip_decompress},
-	{"gzip-5",		5,	gzip_compress,	gzip_decompress},
-	{"gzip-6",		6,	gzip_compress,	gzip_decompress},
-	{"gzip-7",		7,	gzip_compress,	gzip_decompress},
-	{"gzip-8",		8,	gzip_compress,	gzip_decompress},
-	{"gzip-9",		9,	gzip_compress,	gzip_decompress},
-	{"zle",			64,	zle_compress,	zle_decompress},
-	{"lz4",			0,	lz4_compress_zfs,	lz4_decompress_zfs}
+	{"inherit",	0,	NULL,		NULL,		NULL,	NULL},
+	{"on",		0,	NULL,		NULL,		NULL,	NULL},
+	{"uncompressed", 0,	NULL,		NULL,		NULL,	NULL},
+	{"lzjb",	0,	lzjb_compress,	lzjb_decompress, NULL,	NULL},
+	{"empty",	0,	NULL,		NULL,		NULL,	NULL},
+	{"gzip-1",	1,	gzip_compress,	gzip_decompress, NULL,
+	    gzip_compress_abd},
+	{"gzip-2",	2,	gzip_compress,	gzip_decompress, NULL,
+	    gzip_compress_abd},
+	{"gzip-3",	3,	gzip_compress,	gzip_decompress, NULL,
+	    gzip_compress_abd},
+	{"gzip-4",	4,	gzip_compress,	gzip_decompress, NULL,
+	    gzip_compress_abd},
+	{"gzip-5",	5,	gzip_compress,	gzip_decompress, NULL,
+	    gzip_compress_abd},
+	{"gzip-6",	6,	gzip_compress,	gzip_decompress, NULL,
+	    gzip_compress_abd},
+	{"gzip-7",	7,	gzip_compress,	gzip_decompress, NULL,
+	    gzip_compress_abd},
+	{"gzip-8",	8,	gzip_compress,	gzip_decompress, NULL,
+	    gzip_compress_abd},
+	{"gzip-9",	9,	gzip_compress,	gzip_decompress, NULL,
+	    gzip_compress_abd},
+	{"zle",		64,	zle_compress,	zle_decompress,	NULL,	NULL},
+	{"lz4",		0,	lz4_compress_zfs, lz4_decompress_zfs, NULL, NULL},
+	{"zstd",	ZIO_ZSTD_LEVEL_DEFAULT,	zfs_zstd_compress,
+	    zfs_zstd_decompress, zfs_zstd_decompress_level, NULL},
 };
 
 enum zio_compress
@@ -87,6 +115,136 @@ zio_compress_select(spa_t *spa, enum zio_compress child,
 	return (result);
 }
 
+/*
+ * Return the pool feature that must be active before blocks compressed
+ * with the given algorithm may be born, or SPA_FEATURE_NONE.
+ */
+spa_feature_t
+zio_compress_to_feature(enum zio_compress comp)
+{
+	switch (comp) {
+	case ZIO_COMPRESS_ZSTD:
+		return (SPA_FEATURE_ZSTD_COMPRESS);
+	default:
+		break;
+	}
+	return (SPA_FEATURE_NONE);
+}
+
+#define	ZIO_ENTROPY_RUN		256
+#define	ZIO_ENTROPY_MAX_SAMPLE	(64 * 1024)	/* keeps the counts in 16 bits */
+#define	ZIO_ENTROPY_LANES	4
+
+/*
+ * log2(1 + i/32) in 16.16 fixed point, for i = 0..32.
+ */
+static const uint32_t zio_entropy_log2_tab[33] = {
+	0, 2909, 5732, 8473, 11136, 13727,
+	16248, 18704, 21098, 23433, 25711, 27936,
+	30109, 32234, 34312, 36346, 38336, 40286,
+	42196, 44068, 45904, 47705, 49472, 51207,
+	52911, 54584, 56229, 57845, 59434, 60997,
+	62534, 64047, 65536,
+};
+
+/*
+ * log2(x) in 16.16 fixed point for 0 < x <= 2^32, interpolating linearly
+ * in the table above; the error is below 0.0002.
+ */
+static uint64_t
+zio_entropy_log2(uint64_t x)
+{
+	int msb = highbit64(x) - 1;
+	uint64_t frac = ((x << 16) >> msb) - (1ULL << 16);
+	uint64_t i = frac >> 11;
+	uint64_t rem = frac & ((1ULL << 11) - 1);
+
+	return (((uint64_t)msb << 16) + zio_entropy_log2_tab[i] +
+	    (((zio_entropy_log2_tab[i + 1] - zio_entropy_log2_tab[i]) *
+	    rem) >> 11));
+}
+
+/*
+ * Count the bytes of a run into ZIO_ENTROPY_LANES separate histograms, so
+ * that consecutive increments do not depend on each other when neighbouring
+ * bytes are equal.  The lanes are summed once at the end.
+ */
+static int
+zio_entropy_hist_cb(void *data, size_t len, void *private)
+{
+	uint16_t (*hist)[256] = private;
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i + ZIO_ENTROPY_LANES <= len; i += ZIO_ENTROPY_LANES) {
+		hist[0][p[i]]++;
+		hist[1][p[i + 1]]++;
+		hist[2][p[i + 2]]++;
+		hist[3][p[i + 3]]++;
+	}
+	for (; i < len; i++)
+		hist[0][p[i]]++;
+
+	return (0);
+}
+
+/*
+ * Estimate the entropy of a sample of the record and return B_TRUE if it
+ * is high enough that compressing the record is not worth trying.  This
+ * is deliberately not part of zio_compress_data(): the ARC recompresses
+ * blocks and expects to get the on-disk result back, so the decision is
+ * made once, by the write pipeline.
+ */
+boolean_t
+zio_compress_incompressible(abd_t *src, size_t s_len)
+{
+	uint64_t limit = zfs_compress_entropy_limit;
+	uint64_t sample = MIN(zfs_compress_entropy_sample,
+	    ZIO_ENTROPY_MAX_SAMPLE);
+	uint16_t hist[ZIO_ENTROPY_LANES][256];
+	uint64_t runs, stride, sum, bits;
+
+	sample = P2ALIGN(sample, ZIO_ENTROPY_RUN);
+	if (limit == 0 || sample == 0 || s_len < 2 * sample)
+		return (B_FALSE);
+
+	runs = sample / ZIO_ENTROPY_RUN;
+	stride = P2ALIGN(s_len / runs, sizeof (uint64_t));
+	bzero(hist, sizeof (hist));
+
+	for (uint64_t r = 0; r < runs; r++) {
+		(void) abd_iterate_func(src, r * stride, ZIO_ENTROPY_RUN,
+		    zio_entropy_hist_cb, hist);
+	}
+
+	/* H = log2(n) - sum(c * log2(c)) / n */
+	sum = 0;
+	for (int b = 0; b < 256; b++) {
+		uint64_t c = (uint64_t)hist[0][b] + hist[1][b] + hist[2][b] +
+		    hist[3][b];
+		if (c != 0)
+			sum += c * zio_entropy_log2(c);
+	}
+
+	bits = zio_entropy_log2(sample);
+	bits = (sum / sample < bits) ? bits - sum / sample : 0;
+
+	return ((bits * 1000) >> 16 >= limit);
+}
+
+void
+zio_compress_stats_init(zio_compress_stats_t *zcs)
+{
+	kstat_named_init(&zcs->zcs_skipped, "compress_skipped",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&zcs->zcs_skipped_bytes, "compress_skipped_bytes",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&zcs->zcs_failed, "compress_failed",
+	    KSTAT_DATA_UINT64);
+	kstat_named_init(&zcs->zcs_failed_bytes, "compress_failed_bytes",
+	    KSTAT_DATA_UINT64);
+}
+
 /*ARGSUSED*/
 static int
 zio_compress_zeroed_cb(void *data, size_t len, void *private)
@@ -100,7 +258,8 @@ zio_compress_zeroed_cb(void *data, size_t len, void *private)
 }
 
 size_t
-zio_compress_data(enum zio_compress c, abd_t *src, void *dst, size_t s_len)
+zio_compress_data(enum zio_compress c, abd_t *src, void *dst, size_t s_len,
+    uint8_t level)
 {
 	size_t c_len, d_len;
 	zio_compress_info_t *ci = &zio_compress_table[c];
@@ -121,10 +280,26 @@ zio_compress_data(enum zio_compress c, abd_t *src, void *dst, size_t s_len)
 	/* Compress at least 12.5% */
 	d_len = s_len - (s_len >> 3);
 
-	/* No compression algorithms can read from ABDs directly */
-	void *tmp = abd_borrow_buf_copy(src, s_len);
-	c_len = ci->ci_compress(tmp, dst, s_len, d_len, ci->ci_level);
-	abd_return_buf(src, tmp, s_len);
+	/*
+	 * Only algorithms that record their level in the compressed stream
+	 * honour a caller-supplied level (e.g. the dataset's zstd level);
+	 * everything else always uses its table entry.
+	 */
+	if (level == ZIO_COMPLEVEL_INHERIT || ci->ci_decompress_level == NULL)
+		level = ci->ci_level;
+
+	/*
+	 * Algorithms that can consume ABD chunks directly (only gzip, see
+	 * zio_compress_abd_func_t) avoid linearizing a scattered source; the
+	 * rest get a borrowed linear copy.
+	 */
+	if (ci->ci_compress_abd != NULL) {
+		c_len = ci->ci_compress_abd(src, dst, s_len, d_len, level);
+	} else {
+		void *tmp = abd_borrow_buf_copy(src, s_len);
+		c_len = ci->ci_compress(tmp, dst, s_len, d_len, level);
+		abd_return_buf(src, tmp, s_len);
+	}
 
 	if (c_len > d_len)
 		return (s_len);
@@ -133,23 +308,31 @@ zio_compress_data(enum zio_compress c, abd_t *src, void *dst, size_t s_len)
 	return (c_len);
 }
 
+/*
+ * If the caller passes a non-NULL level and the algorithm records its level
+ * in the compressed stream, *level is set to the level the block was
+ * compressed with.  It is left untouched otherwise.
+ */
 int
 zio_decompress_data_buf(enum zio_compress c, void *src, void *dst,
-    size_t s_len, size_t d_len)
+    size_t s_len, size_t d_len, uint8_t *level)
 {
 	zio_compress_info_t *ci = &zio_compress_table[c];
 	if ((uint_t)c >= ZIO_COMPRESS_FUNCTIONS || ci->ci_decompress == NULL)
 		return (SET_ERROR(EINVAL));
 
+	if (level != NULL && ci->ci_decompress_level != NULL)
+		return (ci->ci_decompress_level(src, dst, s_len, d_len, level));
+
 	return (ci->ci_decompress(src, dst, s_len, d_len, ci->ci_level));
 }
 
 int
 zio_decompress_data(enum zio_compress c, abd_t *src, void *dst,
-    size_t s_len, size_t d_len)
+    size_t s_len, size_t d_len, uint8_t *level)
 {
 	void *tmp = abd_borrow_buf_copy(src, s_len);
-	int ret = zio_decompress_data_buf(c, tmp, dst, s_len, d_len);
+	int ret = zio_decompress_data_buf(c, tmp, dst, s_len, d_len, level);
 	abd_return_buf(src, tmp, s_len);
 
 	/*
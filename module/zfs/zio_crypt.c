@@ -1837,35 +1837,20 @@ error:
 }
 
 /*
- * Primary encryption / decryption entrypoint for zio data.
+ * Encrypt or decrypt the prepared uios with the key derived from the salt.
  */
-int
-zio_do_crypt_data(boolean_t encrypt, zio_crypt_key_t *key,
-    dmu_object_type_t ot, boolean_t byteswap, uint8_t *salt, uint8_t *iv,
-    uint8_t *mac, uint_t datalen, uint8_t *plainbuf, uint8_t *cipherbuf,
-    boolean_t *no_crypt)
+static int
+zio_do_crypt_uios(boolean_t encrypt, zio_crypt_key_t *key, uint8_t *salt,
+    uint8_t *iv, uint_t enc_len, uio_t *puio, uio_t *cuio, uint8_t *authbuf,
+    uint_t auth_len)
 {
 	int ret;
 	boolean_t locked = B_FALSE;
 	uint64_t crypt = key->zk_crypt;
 	uint_t keydata_len = zio_crypt_table[crypt].ci_keylen;
-	/* We have to delay the allocation call uio_create() until we know
-	 * how many iovecs we want (as max).
-	 */
-	uio_t *puio = NULL, *cuio = NULL;
-	uint_t enc_len, auth_len;
 	uint8_t enc_keydata[MASTER_KEY_MAX_LEN];
 	crypto_key_t tmp_ckey, *ckey = NULL;
 	crypto_ctx_template_t tmpl;
-	uint8_t *authbuf = NULL;
-
-	/* create uios for encryption */
-	ret = zio_crypt_init_uios(encrypt, key->zk_version, ot, plainbuf,
-	    cipherbuf, datalen, byteswap, mac, &puio, &cuio, &enc_len,
-	    &authbuf, &auth_len, no_crypt);
-
-	if (ret != 0)
-		return (ret);
 
 	/*
 	 * If the needed key is the current one, just use it. Otherwise we
@@ -1903,39 +1888,57 @@ zio_do_crypt_data(boolean_t encrypt, zio_crypt_key_t *key,
 	ret = zio_do_crypt_uio(encrypt, key->zk_crypt, ckey, tmpl, iv, enc_len,
 	    puio, cuio, authbuf, auth_len);
 
-	if (ret != 0)
-		goto error;
-
-	if (locked) {
+error:
+	if (locked)
 		rw_exit(&key->zk_salt_lock);
-		locked = B_FALSE;
-	}
-
-	if (authbuf != NULL)
-		zio_buf_free(authbuf, datalen);
 	if (ckey == &tmp_ckey)
 		bzero(enc_keydata, keydata_len);
-	zio_crypt_destroy_uio(puio);
-	zio_crypt_destroy_uio(cuio);
 
-	return (0);
+	return (ret);
+}
+
+/*
+ * Primary encryption / decryption entrypoint for zio data.
+ */
+int
+zio_do_crypt_data(boolean_t encrypt, zio_crypt_key_t *key,
+    dmu_object_type_t ot, boolean_t byteswap, uint8_t *salt, uint8_t *iv,
+    uint8_t *mac, uint_t datalen, uint8_t *plainbuf, uint8_t *cipherbuf,
+    boolean_t *no_crypt)
+{
+	int ret;
+	/* We have to delay the allocation call uio_create() until we know
+	 * how many iovecs we want (as max).
+	 */
+	uio_t *puio = NULL, *cuio = NULL;
+	uint_t enc_len, auth_len;
+	uint8_t *authbuf = NULL;
+
+	/* create uios for encryption */
+	ret = zio_crypt_init_uios(encrypt, key->zk_version, ot, plainbuf,
+	    cipherbuf, datalen, byteswap, mac, &puio, &cuio, &enc_len,
+	    &authbuf, &auth_len, no_crypt);
+
+	if (ret != 0)
+		return (ret);
+
+	ret = zio_do_crypt_uios(encrypt, key, salt, iv, enc_len, puio, cuio,
+	    authbuf, auth_len);
 
-error:
-	if (locked)
-		rw_exit(&key->zk_salt_lock);
 	if (authbuf != NULL)
 		zio_buf_free(authbuf, datalen);
-	if (ckey == &tmp_ckey)
-		bzero(enc_keydata, keydata_len);
-
 	zio_crypt_destroy_uio(puio);
 	zio_crypt_destroy_uio(cuio);
+
 	return (ret);
 }
 
 /*
- * Simple wrapper around zio_do_crypt_data() to work with abd's instead of
- * linear buffers.
+ * Wrapper around zio_do_crypt_data() to work with abd's instead of linear
+ * buffers. ZIL and dnode blocks are parsed to find the parts that get
+ * encrypted, so they are still borrowed as linear buffers. All other
+ * blocks are encrypted or decrypted straight from the chunks of one abd
+ * into the chunks of the other.
  */
 int
 zio_do_crypt_abd(boolean_t encrypt, zio_crypt_key_t *key, dmu_object_type_t ot,
@@ -1944,6 +1947,33 @@ zio_do_crypt_abd(boolean_t encrypt, zio_crypt_key_t *key, dmu_object_type_t ot,
 {
 	int ret;
 	void *ptmp, *ctmp;
+	uio_t *puio, *cuio;
+
+	ASSERT(DMU_OT_IS_ENCRYPTED(ot) || ot == DMU_OT_NONE);
+
+	if (ot != DMU_OT_INTENT_LOG && ot != DMU_OT_DNODE) {
+		*no_crypt = B_FALSE;
+
+		puio = abd_borrow_uio(pabd, datalen, 0, UIO_READ);
+		cuio = abd_borrow_uio(cabd, datalen, 1, UIO_WRITE);
+		if (puio != NULL && cuio != NULL) {
+			/* the mac goes in the last iovec of the cipher uio */
+			VERIFY0(uio_addiov(cuio, (user_addr_t)mac,
+			    ZIO_DATA_MAC_LEN));
+
+			ret = zio_do_crypt_uios(encrypt, key, salt, iv,
+			    datalen, puio, cuio, NULL, 0);
+		} else {
+			ret = SET_ERROR(ENOMEM);
+		}
+
+		if (puio != NULL)
+			abd_return_uio(pabd, puio, datalen);
+		if (cuio != NULL)
+			abd_return_uio(cabd, cuio, datalen);
+
+		return (ret);
+	}
 
 	if (encrypt) {
 		ptmp = abd_borrow_buf_copy(pabd, datalen);
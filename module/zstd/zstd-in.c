@@ -0,0 +1,77 @@
+/*
+ * BSD 3-Clause New License (https://spdx.org/licenses/BSD-3-Clause.html)
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Build the zstd library as a single translation unit, for the kernel
+ * module and for libzstd/libzpool in userland.  Only the compressor and
+ * decompressor are built: no legacy formats, dictionary builder,
+ * deprecated APIs, multithreading or assembly.  See README.zfs.
+ */
+
+#define	DEBUGLEVEL		0
+#define	MEM_MODULE
+#undef	XXH_NAMESPACE
+#define	XXH_NAMESPACE		ZSTD_
+#undef	XXH_PRIVATE_API
+#define	XXH_PRIVATE_API
+#undef	XXH_INLINE_ALL
+#define	XXH_INLINE_ALL
+#define	ZSTD_LEGACY_SUPPORT	0
+#define	ZSTD_LIB_DICTBUILDER	0
+#define	ZSTD_LIB_DEPRECATED	0
+#define	ZSTD_NOBENCH
+#define	ZSTD_NO_TRACE
+#define	ZSTD_DISABLE_ASM	1
+#undef	ZSTD_MULTITHREAD
+
+#include "lib/common/debug.c"
+#include "lib/common/entropy_common.c"
+#include "lib/common/error_private.c"
+#include "lib/common/fse_decompress.c"
+#include "lib/common/zstd_common.c"
+
+#include "lib/compress/fse_compress.c"
+#include "lib/compress/hist.c"
+#include "lib/compress/huf_compress.c"
+#include "lib/compress/zstd_compress_literals.c"
+#include "lib/compress/zstd_compress_sequences.c"
+#include "lib/compress/zstd_compress_superblock.c"
+#include "lib/compress/zstd_preSplit.c"
+#include "lib/compress/zstd_compress.c"
+#include "lib/compress/zstd_double_fast.c"
+#include "lib/compress/zstd_fast.c"
+#include "lib/compress/zstd_lazy.c"
+#include "lib/compress/zstd_ldm.c"
+#include "lib/compress/zstd_opt.c"
+
+#include "lib/decompress/huf_decompress.c"
+#include "lib/decompress/zstd_ddict.c"
+#include "lib/decompress/zstd_decompress.c"
+#include "lib/decompress/zstd_decompress_block.c"
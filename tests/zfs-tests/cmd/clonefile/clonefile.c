@@ -0,0 +1,108 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Clone a range of one file into another with the ZFS clone range fsctl:
+ *
+ *	clonefile <src> <dst> [<src_offset> <dst_offset> <len>]
+ *
+ * Without a range the whole of src is cloned to the start of dst, which
+ * is created if needed.  Fails rather than copying the data if the range
+ * can't be cloned.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/fsctl.h>
+
+/* Must match zfs_clone_range_args_t in sys/zfs_vnops.h */
+typedef struct zfs_clone_range_args {
+	int32_t		src_fd;
+	uint32_t	flags;
+	uint64_t	src_offset;
+	uint64_t	dst_offset;
+	uint64_t	len;
+} zfs_clone_range_args_t;
+
+#define	ZFS_IOC_CLONE_RANGE	_IOWR('Z', 1, zfs_clone_range_args_t)
+
+static void
+usage(char *progname)
+{
+	(void) fprintf(stderr,
+	    "usage: %s <src> <dst> [<src_offset> <dst_offset> <len>]\n",
+	    progname);
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	zfs_clone_range_args_t args;
+	struct stat st;
+	int src_fd, dst_fd;
+
+	if (argc != 3 && argc != 6)
+		usage(argv[0]);
+
+	if ((src_fd = open(argv[1], O_RDONLY)) < 0) {
+		perror(argv[1]);
+		return (1);
+	}
+	if ((dst_fd = open(argv[2], O_WRONLY | O_CREAT, 0644)) < 0) {
+		perror(argv[2]);
+		return (1);
+	}
+
+	(void) memset(&args, 0, sizeof (args));
+	args.src_fd = src_fd;
+	if (argc == 6) {
+		args.src_offset = strtoull(argv[3], NULL, 0);
+		args.dst_offset = strtoull(argv[4], NULL, 0);
+		args.len = strtoull(argv[5], NULL, 0);
+	} else {
+		if (fstat(src_fd, &st) != 0) {
+			perror(argv[1]);
+			return (1);
+		}
+		args.len = st.st_size;
+	}
+
+	if (ffsctl(dst_fd, ZFS_IOC_CLONE_RANGE, &args, 0) != 0) {
+		(void) fprintf(stderr, "clone of %s to %s failed: %s\n",
+		    argv[1], argv[2], strerror(errno));
+		return (1);
+	}
+
+	(void) printf("%llu\n", (unsigned long long)args.len);
+
+	(void) close(dst_fd);
+	(void) close(src_fd);
+	return (0);
+}
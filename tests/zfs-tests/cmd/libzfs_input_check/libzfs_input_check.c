@@ -708,6 +708,19 @@ test_vdev_trim(const char *pool)
 	nvlist_free(required);
 }
 
+static void
+test_ddt_prune(const char *pool)
+{
+	nvlist_t *required = fnvlist_alloc();
+
+	fnvlist_add_uint64(required, ZPOOL_DDT_PRUNE_UNIT, POOL_DDT_PRUNE_AGE);
+	fnvlist_add_uint64(required, ZPOOL_DDT_PRUNE_AMOUNT, 365 * 86400);
+
+	IOC_INPUT_TEST(ZFS_IOC_DDT_PRUNE, pool, required, NULL, 0);
+
+	nvlist_free(required);
+}
+
 static int
 zfs_destroy(const char *dataset)
 {
@@ -802,6 +815,8 @@ zfs_ioc_input_tests(const char *pool)
 	test_vdev_initialize(pool);
 	test_vdev_trim(pool);
 
+	test_ddt_prune(pool);
+
 	/*
 	 * cleanup
 	 */
@@ -946,6 +961,7 @@ validate_ioc_values(void)
 	    ZFS_IOC_BASE + 78 == ZFS_IOC_POOL_SYNC &&
 	    ZFS_IOC_BASE + 79 == ZFS_IOC_POOL_TRIM &&
 	    ZFS_IOC_BASE + 80 == ZFS_IOC_RECV_NEW &&
+	    ZFS_IOC_BASE + 81 == ZFS_IOC_DDT_PRUNE &&
 	    LINUX_IOC_BASE + 1 == ZFS_IOC_EVENTS_NEXT &&
 	    LINUX_IOC_BASE + 2 == ZFS_IOC_EVENTS_CLEAR &&
 	    LINUX_IOC_BASE + 3 == ZFS_IOC_EVENTS_SEEK);
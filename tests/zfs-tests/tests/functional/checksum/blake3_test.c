@@ -0,0 +1,214 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://opensource.org/licenses/CDDL-1.0.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * This is just to keep the compiler happy about sys/time.h not declaring
+ * gettimeofday due to -D_KERNEL (we can do this since we're actually
+ * running in userspace, but we need -D_KERNEL for the remaining BLAKE3 code).
+ */
+#ifdef	_KERNEL
+#undef	_KERNEL
+#endif
+
+#include <sys/blake3.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/param.h>
+
+typedef	enum boolean { B_FALSE, B_TRUE } boolean_t;
+typedef	unsigned long long	u_longlong_t;
+
+/*
+ * BLAKE3 test suite using values from the official BLAKE3 test vectors
+ * found at:
+ * https://github.com/BLAKE3-team/BLAKE3/blob/master/test_vectors/test_vectors.json
+ *
+ * The input of length n is the sequence of bytes 0, 1, ..., 250, 0, 1, ...
+ * repeated until it is n bytes long.  The keyed tests use the key below.
+ */
+static const uint8_t	test_key[BLAKE3_KEY_LEN] =
+	"whats the Elvish word for friend";
+
+typedef struct blake3_test {
+	size_t		bt_len;
+	const char	*bt_hash;
+	const char	*bt_keyed_hash;
+} blake3_test_t;
+
+static const blake3_test_t blake3_tests[] = {
+	{ 0,
+	    "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262",
+	    "92b2b75604ed3c761f9d6f62392c8a9227ad0ea3f09573e783f1498a4ed60d26" },
+	{ 1,
+	    "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213",
+	    "6d7878dfff2f485635d39013278ae14f1454b8c0a3a2d34bc1ab38228a80c95b" },
+	{ 1023,
+	    "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11",
+	    "c951ecdf03288d0fcc96ee3413563d8a6d3589547f2c2fb36d9786470f1b9d6e" },
+	{ 1024,
+	    "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7",
+	    "75c46f6f3d9eb4f55ecaaee480db732e6c2105546f1e675003687c31719c7ba4" },
+	{ 1025,
+	    "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444",
+	    "357dc55de0c7e382c900fd6e320acc04146be01db6a8ce7210b7189bd664ea69" },
+	{ 2048,
+	    "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a",
+	    "879cf1fa2ea0e79126cb1063617a05b6ad9d0b696d0d757cf053439f60a99dd1" },
+	{ 8193,
+	    "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b",
+	    "954a2a75420c8d6547e3ba5b98d963e6fa6491addc8c023189cc519821b4a1f5" },
+	{ 102400,
+	    "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085",
+	    "1c35d1a5811083fd7119f5d5d1ba027b4d01c0c6c49fb6ff2cf75393ea5db4a7" },
+};
+
+#define	BLAKE3_TEST_MAXLEN	102400
+#define	ARRAY_SIZE(a)		(sizeof (a) / sizeof (a[0]))
+
+static void
+blake3_hex(const uint8_t *digest, char *hex)
+{
+	int i;
+
+	for (i = 0; i < BLAKE3_OUT_LEN; i++)
+		(void) sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+/*
+ * Hashes the first len bytes of msg, feeding them to Blake3_Update in
+ * pieces of at most step bytes, and compares the result against expected.
+ */
+static boolean_t
+blake3_check(const uint8_t *msg, size_t len, size_t step, boolean_t keyed,
+    const char *expected)
+{
+	BLAKE3_CTX	ctx;
+	uint8_t		digest[BLAKE3_OUT_LEN];
+	char		hex[2 * BLAKE3_OUT_LEN + 1];
+	size_t		off;
+
+	if (keyed)
+		Blake3_InitKeyed(&ctx, test_key);
+	else
+		Blake3_Init(&ctx);
+	for (off = 0; off < len; off += step)
+		Blake3_Update(&ctx, msg + off, MIN(step, len - off));
+	Blake3_Final(&ctx, digest);
+
+	blake3_hex(digest, hex);
+	return (strcmp(hex, expected) == 0 ? B_TRUE : B_FALSE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const size_t steps[] = { 1, 63, 1024, 4000, BLAKE3_TEST_MAXLEN };
+	boolean_t	failed = B_FALSE;
+	uint64_t	cpu_mhz = 0;
+	uint8_t		*msg;
+	uint32_t	impl, i, j;
+
+	if (argc == 2)
+		cpu_mhz = atoi(argv[1]);
+
+	msg = malloc(BLAKE3_TEST_MAXLEN);
+	for (i = 0; i < BLAKE3_TEST_MAXLEN; i++)
+		msg[i] = i % 251;
+
+	blake3_impl_init();
+
+	(void) printf("Running algorithm correctness tests:\n");
+	for (impl = 0; impl < blake3_impl_getcnt(); impl++) {
+		const char *name = blake3_impl_getname(impl);
+
+		if (blake3_impl_set(name) != 0) {
+			(void) printf("BLAKE3/%s\tFAILED to select!\n", name);
+			failed = B_TRUE;
+			continue;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(blake3_tests); i++) {
+			const blake3_test_t *bt = &blake3_tests[i];
+			boolean_t ok = B_TRUE;
+
+			for (j = 0; j < ARRAY_SIZE(steps); j++) {
+				if (!blake3_check(msg, bt->bt_len, steps[j],
+				    B_FALSE, bt->bt_hash))
+					ok = B_FALSE;
+				if (!blake3_check(msg, bt->bt_len, steps[j],
+				    B_TRUE, bt->bt_keyed_hash))
+					ok = B_FALSE;
+			}
+
+			(void) printf("BLAKE3/%s\tMessage: %zu bytes\t"
+			    "Result: %s\n", name, bt->bt_len,
+			    ok ? "OK" : "FAILED!");
+			if (!ok)
+				failed = B_TRUE;
+		}
+	}
+	if (failed) {
+		free(msg);
+		return (1);
+	}
+
+#define	BLAKE3_PERF_TEST(name)						\
+	do {								\
+		BLAKE3_CTX	ctx;					\
+		uint8_t		digest[BLAKE3_OUT_LEN];			\
+		uint8_t		block[131072];				\
+		uint64_t	delta;					\
+		double		cpb = 0;				\
+		int		i;					\
+		struct timeval	start, end;				\
+		bzero(block, sizeof (block));				\
+		(void) gettimeofday(&start, NULL);			\
+		Blake3_Init(&ctx);					\
+		for (i = 0; i < 8192; i++)				\
+			Blake3_Update(&ctx, block, sizeof (block));	\
+		Blake3_Final(&ctx, digest);				\
+		(void) gettimeofday(&end, NULL);			\
+		delta = (end.tv_sec * 1000000llu + end.tv_usec) -	\
+		    (start.tv_sec * 1000000llu + start.tv_usec);	\
+		if (cpu_mhz != 0) {					\
+			cpb = (cpu_mhz * 1e6 * ((double)delta /		\
+			    1000000)) / (8192 * 128 * 1024);		\
+		}							\
+		(void) printf("BLAKE3/%s\t%llu us (%.02f CPB)\n",	\
+		    name, (u_longlong_t)delta, cpb);			\
+	} while (0)
+
+	(void) printf("Running performance tests (hashing 1024 MiB of "
+	    "data):\n");
+	for (impl = 0; impl < blake3_impl_getcnt(); impl++) {
+		const char *name = blake3_impl_getname(impl);
+
+		(void) blake3_impl_set(name);
+		BLAKE3_PERF_TEST(name);
+	}
+
+	free(msg);
+	blake3_impl_fini();
+	return (0);
+}
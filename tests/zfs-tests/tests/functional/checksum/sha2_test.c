@@ -187,15 +187,86 @@ cmn_err(int level, char *format, ...)
 	va_end(ap);
 }
 
+/*
+ * Hashes SHA2_MULTI_BUFS buffers of different lengths with SHA2Multi(), and
+ * again with SHA2MultiUpdate() SHA2_MULTI_WINDOW bytes at a time, and
+ * compares every digest against that of SHA2Init/Update/Final.
+ */
+#define	SHA2_MULTI_BUFS		19
+#define	SHA2_MULTI_MAXLEN	10000
+#define	SHA2_MULTI_WINDOW	256
+
+static boolean_t
+sha2_multi_check(uint64_t mech, size_t diglen)
+{
+	static const size_t lens[SHA2_MULTI_BUFS] = { 0, 1, 55, 56, 64, 111,
+	    112, 127, 128, 129, 1000, 4095, 4096, 4097, 8192, 9999, 10000,
+	    3, 640 };
+	static uint8_t	buf[SHA2_MULTI_BUFS + SHA2_MULTI_MAXLEN];
+	uint8_t		digests[SHA2_MULTI_BUFS][64];
+	uint8_t		digest[64];
+	const void	*in[SHA2_MULTI_BUFS];
+	void		*out[SHA2_MULTI_BUFS];
+	SHA2_CTX	ctx, ctxs[SHA2_MULTI_BUFS], *lane_ctx[SHA2_MULTI_BUFS];
+	const void	*lane_in[SHA2_MULTI_BUFS];
+	boolean_t	ok = B_TRUE;
+	size_t		off, done;
+	int		i, lanes;
+
+	for (i = 0; i < sizeof (buf); i++)
+		buf[i] = i % 251;
+	for (i = 0; i < SHA2_MULTI_BUFS; i++) {
+		in[i] = buf + i;
+		out[i] = digests[i];
+	}
+
+	SHA2Multi(mech, in, lens, out, SHA2_MULTI_BUFS);
+
+	for (i = 0; i < SHA2_MULTI_BUFS; i++) {
+		SHA2Init(mech, &ctx);
+		SHA2Update(&ctx, in[i], lens[i]);
+		SHA2Final(digest, &ctx);
+		if (bcmp(digest, digests[i], diglen / 8) != 0)
+			ok = B_FALSE;
+	}
+
+	for (i = 0; i < SHA2_MULTI_BUFS; i++)
+		SHA2Init(mech, &ctxs[i]);
+	for (off = 0; ; off += SHA2_MULTI_WINDOW) {
+		for (i = 0, lanes = 0; i < SHA2_MULTI_BUFS; i++) {
+			if (off + SHA2_MULTI_WINDOW > lens[i])
+				continue;
+			lane_ctx[lanes] = &ctxs[i];
+			lane_in[lanes] = buf + i + off;
+			lanes++;
+		}
+		if (lanes == 0)
+			break;
+		SHA2MultiUpdate(lane_ctx, lane_in, SHA2_MULTI_WINDOW, lanes);
+	}
+	for (i = 0; i < SHA2_MULTI_BUFS; i++) {
+		done = lens[i] - lens[i] % SHA2_MULTI_WINDOW;
+		SHA2Update(&ctxs[i], buf + i + done, lens[i] - done);
+		SHA2Final(digest, &ctxs[i]);
+		if (bcmp(digest, digests[i], diglen / 8) != 0)
+			ok = B_FALSE;
+	}
+
+	return (ok);
+}
+
 int
 main(int argc, char *argv[])
 {
 	boolean_t	failed = B_FALSE;
 	uint64_t	cpu_mhz = 0;
+	uint32_t	impl;
 
 	if (argc == 2)
 		cpu_mhz = atoi(argv[1]);
 
+	sha2_impl_init();
+
 #define	SHA2_ALGO_TEST(_m, mode, diglen, testdigest)			\
 	do {								\
 		SHA2_CTX		ctx;				\
@@ -203,8 +274,8 @@ main(int argc, char *argv[])
 		SHA2Init(SHA ## mode ## _MECH_INFO_TYPE, &ctx);		\
 		SHA2Update(&ctx, _m, strlen(_m));			\
 		SHA2Final(digest, &ctx);				\
-		(void) printf("SHA%-9sMessage: " #_m			\
-		    "\tResult: ", #mode);				\
+		(void) printf("SHA%-9s%-8sMessage: " #_m		\
+		    "\tResult: ", #mode, name);				\
 		if (bcmp(digest, testdigest, diglen / 8) == 0) {	\
 			(void) printf("OK\n");				\
 		} else {						\
@@ -236,30 +307,66 @@ main(int argc, char *argv[])
 			cpb = (cpu_mhz * 1e6 * ((double)delta /		\
 			    1000000)) / (8192 * 128 * 1024);		\
 		}							\
-		(void) printf("SHA%-9s%llu us (%.02f CPB)\n", #mode,	\
-		    (u_longlong_t)delta, cpb);				\
+		(void) printf("SHA%-9s%-8s%llu us (%.02f CPB)\n", #mode,	\
+		    name, (u_longlong_t)delta, cpb);			\
+		NOTE(CONSTCOND)						\
+	} while (0)
+
+#define	SHA2_MULTI_TEST(mode, diglen)					\
+	do {								\
+		(void) printf("SHA%-9s%-8sMultiple buffers\tResult: ",	\
+		    #mode, name);					\
+		if (sha2_multi_check(SHA ## mode ## _MECH_INFO_TYPE,	\
+		    diglen)) {						\
+			(void) printf("OK\n");				\
+		} else {						\
+			(void) printf("FAILED!\n");			\
+			failed = B_TRUE;				\
+		}							\
 		NOTE(CONSTCOND)						\
 	} while (0)
 
 	(void) printf("Running algorithm correctness tests:\n");
-	SHA2_ALGO_TEST(test_msg0, 256, 256, sha256_test_digests[0]);
-	SHA2_ALGO_TEST(test_msg1, 256, 256, sha256_test_digests[1]);
-	SHA2_ALGO_TEST(test_msg0, 384, 384, sha384_test_digests[0]);
-	SHA2_ALGO_TEST(test_msg2, 384, 384, sha384_test_digests[2]);
-	SHA2_ALGO_TEST(test_msg0, 512, 512, sha512_test_digests[0]);
-	SHA2_ALGO_TEST(test_msg2, 512, 512, sha512_test_digests[2]);
-	SHA2_ALGO_TEST(test_msg0, 512_224, 224, sha512_224_test_digests[0]);
-	SHA2_ALGO_TEST(test_msg2, 512_224, 224, sha512_224_test_digests[2]);
-	SHA2_ALGO_TEST(test_msg0, 512_256, 256, sha512_256_test_digests[0]);
-	SHA2_ALGO_TEST(test_msg2, 512_256, 256, sha512_256_test_digests[2]);
+	for (impl = 0; impl < sha2_impl_getcnt(); impl++) {
+		const char *name = sha2_impl_getname(impl);
+
+		if (sha2_impl_set(name) != 0) {
+			(void) printf("SHA2/%s\tFAILED to select!\n", name);
+			failed = B_TRUE;
+			continue;
+		}
+
+		SHA2_ALGO_TEST(test_msg0, 256, 256, sha256_test_digests[0]);
+		SHA2_ALGO_TEST(test_msg1, 256, 256, sha256_test_digests[1]);
+		SHA2_ALGO_TEST(test_msg0, 384, 384, sha384_test_digests[0]);
+		SHA2_ALGO_TEST(test_msg2, 384, 384, sha384_test_digests[2]);
+		SHA2_ALGO_TEST(test_msg0, 512, 512, sha512_test_digests[0]);
+		SHA2_ALGO_TEST(test_msg2, 512, 512, sha512_test_digests[2]);
+		SHA2_ALGO_TEST(test_msg0, 512_224, 224,
+		    sha512_224_test_digests[0]);
+		SHA2_ALGO_TEST(test_msg2, 512_224, 224,
+		    sha512_224_test_digests[2]);
+		SHA2_ALGO_TEST(test_msg0, 512_256, 256,
+		    sha512_256_test_digests[0]);
+		SHA2_ALGO_TEST(test_msg2, 512_256, 256,
+		    sha512_256_test_digests[2]);
+		SHA2_MULTI_TEST(256, 256);
+		SHA2_MULTI_TEST(512_256, 256);
+	}
 
 	if (failed)
 		return (1);
 
 	(void) printf("Running performance tests (hashing 1024 MiB of "
 	    "data):\n");
-	SHA2_PERF_TEST(256, 256);
-	SHA2_PERF_TEST(512, 512);
+	for (impl = 0; impl < sha2_impl_getcnt(); impl++) {
+		const char *name = sha2_impl_getname(impl);
+
+		(void) sha2_impl_set(name);
+		SHA2_PERF_TEST(256, 256);
+		SHA2_PERF_TEST(512, 512);
+	}
 
+	sha2_impl_fini();
 	return (0);
 }